@@ -39,11 +39,12 @@
 // Data structures
 //-----------------
 
-//! Payload data
+//! Payload data (type is defined by length: 0 - float64, AKU_LENGTH_INT64 - int64, other - ptr)
 typedef union {
     const void *ptr;
     double      float64;
     uint64_t    uint64;
+    int64_t     int64;
 } aku_PData;
 
 
@@ -59,6 +60,16 @@ typedef struct {
 } aku_MemRange;
 
 
+//! Measurement (element of the bulk frame)
+typedef struct {
+    aku_ParamId   paramid;       //< Storage parameter id
+    aku_TimeStamp timestamp;     //< Timestamp
+    double        value;         //< Value (if is_int is zero)
+    int64_t       ivalue;        //< Integer value (if is_int is not zero)
+    int           is_int;        //< Value type
+} aku_Sample;
+
+
 //! Database instance.
 typedef struct {
     int padding;
@@ -72,6 +83,8 @@ typedef struct {
     aku_TimeStamp begin;
     //! End of the search range
     aku_TimeStamp end;
+    //! Max number of results returned by the query (0 - unlimited)
+    uint64_t limit;
     //! Number of parameters to search
     uint32_t n_params;
     //! Array of parameters to search
@@ -108,19 +121,150 @@ typedef struct {
     struct {
         uint64_t fwd_bytes;             //< Number of scanned bytes in forward direction
         uint64_t bwd_bytes;             //< Number of scanned bytes in backward direction
+        uint64_t n_readahead;           //< Number of readahead requests issued by scans
+        uint64_t n_readahead_resident;  //< Number of readahead checks that found data in core
     } scan;
+    struct {
+        uint64_t n_hits;                //< Number of decoded chunks found in chunk cache
+        uint64_t n_misses;              //< Number of chunks that was decoded from page
+    } cache;
+    struct {
+        uint64_t n_hits;                //< Number of coroutine stacks reused from the stack pool
+        uint64_t n_misses;              //< Number of coroutine stacks that was mapped
+    } stacks;
 } aku_SearchStats;
 
 
+//! Compression stats
+typedef struct {
+    uint64_t n_chunks;                  //< Number of encoded chunks
+    uint64_t n_elements;                //< Number of encoded elements
+    struct {
+        uint64_t timestamps;            //< Size of the timestamps column
+        uint64_t paramids;              //< Size of the param ids column
+        uint64_t lengths;               //< Size of the lengths column
+        uint64_t offsets;               //< Size of the offsets column
+        uint64_t values;                //< Size of the values column
+    } bytes;
+    struct {
+        uint64_t ts_delta_rle;          //< Number of chunks with Delta-RLE timestamps
+        uint64_t ts_streamvbyte;        //< Number of chunks with Stream VByte timestamps
+        uint64_t ts_delta_delta;        //< Number of chunks with delta-of-delta timestamps
+        uint64_t ids_base128;           //< Number of chunks with Base128 param ids
+        uint64_t ids_streamvbyte;       //< Number of chunks with Stream VByte param ids
+        uint64_t values_xor4;           //< Number of chunks with 4-bit XOR values
+        uint64_t values_gorilla;        //< Number of chunks with Gorilla values
+    } codecs;
+} aku_CompressionStats;
+
+
+//! Aggregated values of the time bucket
+typedef struct {
+    aku_TimeStamp bucket;               //< Timestamp of the beginning of the bucket
+    aku_ParamId   param_id;             //< Parameter id
+    uint64_t      count;                //< Number of values
+    double        sum;                  //< Sum of the values
+    double        min;                  //< Min value
+    double        max;                  //< Max value
+} aku_AggregateResult;
+
+
 //! Storage stats
 typedef struct {
     uint64_t n_entries;       //< Total number of entries
     uint64_t n_volumes;       //< Total number of volumes
     uint64_t free_space;      //< Free space total
     uint64_t used_space;      //< Space in use
+    uint64_t merge_queue_depth;  //< Number of merge requests waiting for (or in) background merge
+    uint64_t merge_lag;          //< Age of the oldest pending merge request (usec)
+    uint64_t durable_timestamp;  //< All merged data not newer than this timestamp is flushed to disk
+    uint64_t n_flushes;          //< Number of group commit flushes
+    uint64_t window_size;        //< Late write window of the sequencers (largest across shards)
 } aku_StorageStats;
 
 
+//! Latency distribution, all values are in nanoseconds
+typedef struct {
+    uint64_t count;              //< Number of recorded events
+    uint64_t mean;               //< Mean latency
+    uint64_t min;                //< Min latency
+    uint64_t p50;                //< Median
+    uint64_t p90;                //< 90th percentile
+    uint64_t p99;                //< 99th percentile
+    uint64_t p999;               //< 99.9th percentile
+    uint64_t max;                //< Max latency
+} aku_LatencyStats;
+
+
+//! Hot path metrics
+typedef struct {
+    aku_LatencyStats write;      //< Latency of the write calls (sampled, batch is a single call)
+    aku_LatencyStats checkpoint; //< Duration of the sequencer checkpoints (merge and compress)
+    aku_LatencyStats flush;      //< Duration of the group commit flushes
+    aku_LatencyStats query;      //< Time between query start and cursor close
+    uint64_t n_writes;           //< Number of written values
+    uint64_t n_write_errors;     //< Number of values that wasn't written
+    uint64_t sequencer_size;     //< Memory used by the sequencers (bytes)
+    uint64_t merge_queue_depth;  //< Number of merge requests waiting for (or in) background merge
+    uint64_t merge_lag;          //< Age of the oldest pending merge request (usec)
+} aku_Metrics;
+
+
+//! Memory usage of the volume
+typedef struct {
+    uint64_t mapped;             //< Size of the memory mapped volume (bytes)
+    uint64_t resident;           //< Part of the volume that is resident in memory (bytes)
+    int      is_active;          //< Non zero if volume is written to
+} aku_VolumeMemoryStats;
+
+
+//! Memory usage
+typedef struct {
+    uint64_t sequencer_runs;          //< Number of sorted runs of the sequencers (active and frozen)
+    uint64_t sequencer_run_bytes;     //< Memory used by these runs
+    uint64_t sequencer_max_run_bytes; //< Memory used by the largest run
+    uint64_t sequencer_ready;         //< Number of sorted runs that wait for merge
+    uint64_t sequencer_ready_bytes;   //< Memory used by these runs
+    uint64_t sequencer_arena_bytes;   //< Memory owned by the run arenas (used and cached blocks)
+    uint64_t series_count;            //< Number of series
+    uint64_t string_pool_bytes;       //< Memory used by series names
+    uint64_t series_table_bytes;      //< Memory used by series names, entries and hash tables
+    uint64_t index_bytes;             //< Memory used by the inverted index of the series tags
+    uint64_t chunk_cache_bytes;       //< Memory used by decoded chunks (cache is shared by all databases)
+    uint64_t chunk_cache_capacity;    //< Max size of the decoded chunk cache
+    uint64_t chunk_cache_items;       //< Number of decoded chunks in cache
+    uint64_t n_volumes;               //< Number of volumes
+    uint64_t mapped_bytes;            //< Size of all volumes
+    uint64_t resident_bytes;          //< Part of the volumes that is resident in memory
+} aku_MemoryStats;
+
+
+//! Offline maintenance stats (export, compaction and backup)
+typedef struct {
+    uint64_t n_volumes;               //< Number of processed volumes
+    uint64_t n_skipped_volumes;       //< Number of volumes that was left as is
+    uint64_t n_chunks;                //< Number of decoded chunks
+    uint64_t n_elements;              //< Number of exported or rewritten elements
+    uint64_t n_skipped;               //< Number of elements that can't be exported (blobs)
+    uint64_t bytes_read;              //< Size of the compressed data (or copied data) that was read
+    uint64_t bytes_written;           //< Size of the output
+} aku_MaintenanceStats;
+
+
+/** Header of the exported column block (see aku_export_columns).
+  * Header is followed by columns of `count` elements: timestamps (uint64),
+  * param ids (uint64), values (8 bytes, double or int64) and value types
+  * (uint8, 0 - double, 1 - int64). Types column is padded with zeroes to
+  * the multiple of 8 bytes. All numbers are little endian.
+  */
+typedef struct {
+    uint32_t      magic;              //< AKU_COLUMN_BLOCK_MAGIC
+    uint32_t      count;              //< Number of elements in the block
+    aku_TimeStamp min_timestamp;      //< First timestamp of the block
+    aku_TimeStamp max_timestamp;      //< Last timestamp of the block
+} aku_ColumnBlockHeader;
+
+
 //-------------------
 // Utility functions
 //-------------------
@@ -182,6 +326,69 @@ AKU_EXPORT apr_status_t aku_create_database
 AKU_EXPORT apr_status_t aku_remove_database(const char* file_name, aku_logger_cb_t logger);
 
 
+/** Export time range of the stored data to columnar file.
+  * Database must not be opened by anybody. Volumes are read in parallel,
+  * chunks are filtered by their summary and decoded directly to column
+  * blocks (see aku_ColumnBlockHeader), every block corresponds to one chunk
+  * and is sorted by timestamp, order of the blocks is not specified.
+  * Blobs are not exported, data that wasn't merged to volumes is lost
+  * on close anyway.
+  * @param file_name path to storage metadata file
+  * @param out_path path to the output file (truncated if exists)
+  * @param begin first timestamp of the range
+  * @param end last timestamp of the range (inclusive)
+  * @param ids param ids to export (can be null, all series are exported in this case)
+  * @param nids number of param ids
+  * @param nthreads number of volumes processed concurrently (0 - one per volume)
+  * @param logger logger (can be null)
+  * @param rcv_stats optional stats destination (can be null)
+  * @returns status
+  */
+AKU_EXPORT aku_Status aku_export_columns(const char* file_name, const char* out_path,
+                                         aku_TimeStamp begin, aku_TimeStamp end,
+                                         const aku_ParamId* ids, size_t nids,
+                                         uint32_t nthreads, aku_logger_cb_t logger,
+                                         aku_MaintenanceStats* rcv_stats);
+
+
+/** Compact volumes of the storage.
+  * Database must not be opened by anybody. Every volume is decoded, its
+  * data is re-sorted by timestamp and param id and split into chunks of
+  * `compression_threshold` elements (chunks of the volume doesn't overlap
+  * after that), codecs of the chunks are selected by `codec_policy`.
+  * Compacted volume is written to a new file that replaces the original
+  * one only if all its chunks was written successfully. Volumes with blobs
+  * are left as is.
+  * @param file_name path to storage metadata file
+  * @param codec_policy codec selection policy (0 - default codecs,
+  *        1 - smallest output, 2 - fastest decoding)
+  * @param nthreads number of volumes processed concurrently (0 - one per volume)
+  * @param logger logger (can be null)
+  * @param rcv_stats optional stats destination (can be null)
+  * @returns status, volumes that was compacted before the error stay compacted
+  */
+AKU_EXPORT aku_Status aku_compact_database(const char* file_name, uint32_t codec_policy,
+                                           uint32_t nthreads, aku_logger_cb_t logger,
+                                           aku_MaintenanceStats* rcv_stats);
+
+
+/** Copy storage to another directory.
+  * Database must not be opened by anybody. Only used parts of the volumes
+  * (page header, page index and data) are copied, free space of the copy
+  * stays sparse. Volume paths of the copied metadata file point to the
+  * copied volumes.
+  * @param file_name path to storage metadata file
+  * @param dest_path destination directory (created if doesn't exist)
+  * @param nthreads number of volumes copied concurrently (0 - one per volume)
+  * @param logger logger (can be null)
+  * @param rcv_stats optional stats destination (can be null)
+  * @returns status
+  */
+AKU_EXPORT aku_Status aku_backup_database(const char* file_name, const char* dest_path,
+                                          uint32_t nthreads, aku_logger_cb_t logger,
+                                          aku_MaintenanceStats* rcv_stats);
+
+
 /** Open recenlty create storage.
   * @param path path to storage metadata file
   * @param parameters open parameters
@@ -222,24 +429,133 @@ AKU_EXPORT aku_Status aku_write_blob(aku_Database* db, aku_ParamId param_id, aku
   */
 AKU_EXPORT aku_Status aku_write_double_raw(aku_Database* db, aku_ParamId param_id, aku_TimeStamp timestamp, double value);
 
+/** Write integer measurement to DB.
+  * Value is stored without conversion to double (precise above 2^53, delta
+  * compression is used for integer values).
+  * @param db opened database instance
+  * @param param_id storage parameter id
+  * @param timestamp timestamp
+  * @param value parameter value
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_write_int64_raw(aku_Database* db, aku_ParamId param_id, aku_TimeStamp timestamp, int64_t value);
+
+/** Write batch of measurements to DB
+  * @param db opened database instance
+  * @param param_ids array of storage parameter ids
+  * @param timestamps array of timestamps
+  * @param values array of parameter values
+  * @param size number of measurements (size of every array)
+  * @param statuses optional array of per-measurement statuses (can be null),
+  *        it is filled only if operation fails
+  * @returns operation status, error code of the first failed measurement
+  */
+AKU_EXPORT aku_Status aku_write_batch(aku_Database* db, const aku_ParamId* param_ids, const aku_TimeStamp* timestamps,
+                                      const double* values, size_t size, aku_Status* statuses);
+
+/** Get upper bound of the size of the bulk frame.
+  * @param size number of measurements
+  */
+AKU_EXPORT size_t aku_bulk_max_size(size_t size);
+
+/** Encode measurements to bulk frame.
+  * Bulk frame is a compressed chunk (the same columnar format and codecs as in the
+  * volume pages) prefixed with a 16-byte header: AKU_BULK_MAGIC, number of measurements,
+  * codecs of the columns and size of the compressed data (four little endian uint32).
+  * Frame is sent by producers as a bulk string ("$<size>\r\n<frame>\r\n"). Measurements
+  * are sorted by timestamp inside the frame, codecs are chosen by the frame content.
+  * @param samples array of measurements
+  * @param size number of measurements
+  * @param dest output buffer, aku_bulk_max_size(size) bytes is always enough
+  * @param dest_size size of the output buffer
+  * @param out_size frame size
+  * @returns AKU_EOVERFLOW if frame doesn't fit the buffer, AKU_EBAD_ARG if size is zero
+  */
+AKU_EXPORT aku_Status aku_encode_bulk(const aku_Sample* samples, size_t size, void* dest, size_t dest_size,
+                                      size_t* out_size);
+
+/** Decode bulk frame.
+  * @param frame beginning of the frame
+  * @param frame_size size of the frame
+  * @param dest output array
+  * @param size in - size of the output array, out - number of measurements in the frame
+  * @returns AKU_EOVERFLOW if output array is too small (nothing is decoded in this
+  *          case), AKU_EBAD_DATA if frame is damaged
+  */
+AKU_EXPORT aku_Status aku_decode_bulk(const void* frame, size_t frame_size, aku_Sample* dest, size_t* size);
+
+/** Get number of storage shards. Writes to different shards can be
+  * performed concurrently without contention.
+  * @param db opened database instance
+  */
+AKU_EXPORT uint32_t aku_num_shards(aku_Database* db);
+
+/** Get index of the storage shard that stores param id
+  * @param db opened database instance
+  * @param param_id storage parameter id
+  * @returns index in range [0, aku_num_shards(db))
+  */
+AKU_EXPORT uint32_t aku_shard_index(aku_Database* db, aku_ParamId param_id);
+
+/** Convert series name to param id.
+  * Series name contains metric name and list of key-value pairs (at least one),
+  * e.g. "cpu host=web01 region=europe". Name is converted to normal form (pairs are
+  * sorted by key) so the order of the pairs doesn't matter. New series gets new id
+  * (ids starts from AKU_STARTING_SERIES_ID, smaller ids can be used with raw API),
+  * new names are saved to metadata storage in batches.
+  * @param db opened database instance
+  * @param begin series name
+  * @param end end of the series name
+  * @param out_id resulting param id
+  * @returns AKU_SUCCESS or AKU_EBAD_DATA if series name is malformed
+  */
+AKU_EXPORT aku_Status aku_series_to_param_id(aku_Database* db, const char* begin, const char* end,
+                                             aku_ParamId* out_id);
+
 /** Write measurement to DB
   * @param db opened database instance
-  * @param series_key string containing series name and key-value list
+  * @param series_key string containing series name and key-value list (see aku_series_to_param_id)
   * @param timestamp timestamp
   * @param value parameter value
   * @returns operation status
   */
 AKU_EXPORT aku_Status aku_write_double(aku_Database* db, const char* series_key, aku_TimeStamp timestamp, double value);
 
+/** Write integer measurement to DB
+  * @param db opened database instance
+  * @param series_key string containing series name and key-value list (see aku_series_to_param_id)
+  * @param timestamp timestamp
+  * @param value parameter value
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_write_int64(aku_Database* db, const char* series_key, aku_TimeStamp timestamp, int64_t value);
+
 //---------
 // Queries
 //---------
 
 /**
  * @brief Create select query with single parameter-id
+ * Query is unlimited by default, set `limit` field to return only first N results.
  */
 AKU_EXPORT aku_SelectQuery* aku_make_select_query(aku_TimeStamp begin, aku_TimeStamp end, uint32_t n_params, aku_ParamId* params);
 
+/**
+ * @brief Create select query for all series that match tag expression
+ * Expression consists of key=value tags combined with AND and OR operators (AND has
+ * higher precedence) and parentheses. Tag value can end with `*` to match all values
+ * with this prefix, metric name is matched by `metric` key, e.g.
+ * "metric=cpu AND (host=web* OR host=db01)". Query should be freed using aku_destroy.
+ * @param db opened database instance
+ * @param begin begin of the time range
+ * @param end end of the time range
+ * @param expression tag expression
+ * @param out_status optional operation status, AKU_EBAD_DATA if expression is malformed
+ * @return query or null on error
+ */
+AKU_EXPORT aku_SelectQuery* aku_make_tag_query(aku_Database* db, aku_TimeStamp begin, aku_TimeStamp end,
+                                               const char* expression, aku_Status* out_status);
+
 /**
  * @brief Execute query
  * @param query data structure representing search query
@@ -247,6 +563,30 @@ AKU_EXPORT aku_SelectQuery* aku_make_select_query(aku_TimeStamp begin, aku_TimeS
  */
 AKU_EXPORT aku_Cursor* aku_select(aku_Database* db, aku_SelectQuery* query);
 
+/**
+ * @brief Execute aggregate query.
+ * Double values are aggregated per time bucket and parameter inside the storage,
+ * cursor returns only aggregates (blobs are not aggregated). Buckets are aligned
+ * to multiples of the bucket width and returned in the direction of the query.
+ * @param query data structure representing search query
+ * @param bucket_width width of the time bucket (must be greater than zero)
+ * @return cursor, results should be read with `aku_cursor_read_aggregates`
+ */
+AKU_EXPORT aku_Cursor* aku_select_aggregate(aku_Database* db, aku_SelectQuery* query, aku_TimeStamp bucket_width);
+
+/** Get last (most recent) double values of the series.
+  * Values are served from in-memory table without search in common case.
+  * Integer values are converted to double.
+  * @param db opened database instance
+  * @param param_ids array of storage parameter ids
+  * @param n size of all arrays
+  * @param out_timestamps output array of timestamps, AKU_MIN_TIMESTAMP is written if param not found
+  * @param out_values output array of values, NaN is written if param not found
+  * @returns AKU_SUCCESS, AKU_ENOT_FOUND if some of the params wasn't found or error code
+  */
+AKU_EXPORT aku_Status aku_get_last_values(aku_Database* db, const aku_ParamId* param_ids, size_t n,
+                                          aku_TimeStamp* out_timestamps, double* out_values);
+
 /**
  * @brief Close cursor
  * @param pcursor pointer to cursor
@@ -270,6 +610,15 @@ AKU_EXPORT int aku_cursor_read_columns( aku_Cursor      *pcursor
                                       , uint32_t        *lengths
                                       , size_t           arrays_size );
 
+/**
+ * @brief Read results of the aggregate query.
+ * @param pcursor pointer to cursor created by `aku_select_aggregate`
+ * @param dest output buffer
+ * @param dest_size size of the output buffer
+ * @return number of results written to the buffer
+ */
+AKU_EXPORT int aku_cursor_read_aggregates(aku_Cursor* pcursor, aku_AggregateResult* dest, size_t dest_size);
+
 //! Check cursor state. Returns zero value if not done yet, non zero value otherwise.
 AKU_EXPORT int aku_cursor_is_done(aku_Cursor* pcursor);
 
@@ -287,8 +636,44 @@ AKU_EXPORT int aku_cursor_is_error(aku_Cursor* pcursor, int* out_error_code_or_n
   */
 AKU_EXPORT void aku_global_search_stats(aku_SearchStats* rcv_stats, int reset);
 
+/** Get search counters of the query.
+  * Counters of the page searches completed by the cursor so far are reported,
+  * `cache` counters show chunk cache hits and misses of this query and `stacks`
+  * counters are always zero. Global counters include all queries.
+  * @param pcursor pointer to cursor
+  * @param rcv_stats pointer to `aku_SearchStats` structure that will be filled with data
+  */
+AKU_EXPORT void aku_cursor_stats(aku_Cursor* pcursor, aku_SearchStats* rcv_stats);
+
+/** Get compression counters.
+  * @param rcv_stats pointer to `aku_CompressionStats` structure that will be filled with data.
+  * @param reset reset all counter if not zero
+  */
+AKU_EXPORT void aku_global_compression_stats(aku_CompressionStats* rcv_stats, int reset);
+
 /** Get storage stats.
   * @param db database instance.
   * @param rcv_stats pointer to destination
   */
 AKU_EXPORT void aku_global_storage_stats(aku_Database *db, aku_StorageStats* rcv_stats);
+
+/** Get hot path metrics (latency histograms, counters and gauges).
+  * Counters are recorded per thread and are merged by this call.
+  * @param db database instance.
+  * @param rcv_metrics pointer to destination
+  * @param reset reset latencies and counters if not zero
+  */
+AKU_EXPORT void aku_get_metrics(aku_Database *db, aku_Metrics* rcv_metrics, int reset);
+
+/** Get memory usage.
+  * Residency of the volumes is checked with mincore (one byte of temporary
+  * memory per page of the volume), other values are maintained by the
+  * components. Call is cheap enough to be made every few seconds.
+  * @param db database instance.
+  * @param rcv_stats pointer to destination
+  * @param volumes optional array that receives stats of the volumes (can be null)
+  * @param volumes_size size of the `volumes` array, stats of the first
+  *        min(volumes_size, rcv_stats->n_volumes) volumes are written
+  */
+AKU_EXPORT void aku_get_memory_stats(aku_Database *db, aku_MemoryStats* rcv_stats,
+                                     aku_VolumeMemoryStats* volumes, size_t volumes_size);
@@ -28,6 +28,8 @@
 #define AKU_DURABILITY_SPEED_TRADEOFF 2
 #define AKU_MAX_WRITE_SPEED           4
 
+#define AKU_MAX_ROLLUP_TIERS          2
+
 
 // Log levels
 #define AKU_LOG_TRACE                 7
@@ -50,11 +52,67 @@ typedef struct
     //! Pointer to logging function, can be null
     aku_logger_cb_t logger;
 
-    //! 0 - huge tlbs disabled, other value - enabled
+    //! 0 - huge tlbs disabled, other value - volumes are backed by huge pages if filesystem supports it
     uint32_t enable_huge_tlb;
 
     //! Consistency-speed tradeoff, 1 - max durability, 2 - tradeoff some durability for speed, 4 - max speed
     uint32_t durability;
 
+    //! Number of threads used to search volumes in parallel, 0 - search volumes sequentially in caller's thread
+    uint32_t search_threads;
+
+    //! Max time (ms) between write and flush, 0 - derived from durability parameter
+    uint32_t max_flush_latency;
+
+    //! Max number of unflushed bytes, 0 - unlimited
+    uint32_t max_flush_bytes;
+
+    //! Number of storage shards (each with its own active volume), 0 - one shard, limited by number of volumes
+    uint32_t num_shards;
+
+    //! Number of threads used to map volumes on open, 0 - map volumes sequentially without access hints
+    uint32_t open_threads;
+
+    //! Size of the decoded chunk cache in bytes (shared by all databases in process), 0 - default size
+    uint32_t chunk_cache_size;
+
+    //! Readahead distance for page scans in bytes, 0 - default distance
+    uint32_t readahead;
+
+    //! Bucket widths of the rollup tiers (in timestamp units), 0 - tier disabled
+    uint64_t rollup_tiers[AKU_MAX_ROLLUP_TIERS];
+
+    //! Max number of pooled coroutine stacks (shared by all databases in process), 0 - default size
+    uint32_t stack_pool_size;
+
+    //! 0 - writers of the shard share sorted runs of the sequencer, other value - each writer thread has its own sorted runs
+    uint32_t writer_runs;
+
+    //! Number of threads used to merge and compress sequencer data, 0 - merge in the merger thread only
+    uint32_t merge_threads;
+
+    //! Percentile of the samples lateness used to size late write window, 0 - fixed window (window size of the database)
+    uint32_t window_percentile;
+
+    //! Min size of the adaptive late write window, 0 - 1/64 of the max size
+    uint64_t min_window;
+
+    //! Max size of the adaptive late write window, 0 - window size of the database
+    uint64_t max_window;
+
+    //! Codecs of the new chunk columns: timestamps | param ids << 4 | values << 8. Timestamps: 0 - Delta-RLE,
+    //! 1 - Stream VByte (faster decoding), 2 - delta-of-delta (regular intervals). Param ids: 0 - Base128,
+    //! 1 - Stream VByte. Values: 0 - 4-bit XOR, 1 - Gorilla (slowly changing series). Zero - defaults.
+    uint32_t chunk_encoding;
+
+    //! Codec selection policy: 0 - always use chunk_encoding, 1 - smallest codecs, 2 - fastest decoding
+    //! codecs that are at most twice as large as the smallest ones. Codecs are selected using the sample
+    //! of every chunk.
+    uint32_t codec_policy;
+
+    //! 0 - memory is allocated on the node of the first touch, other value - active volumes and merge buffers
+    //! are allocated on the NUMA node of the writer threads, historical volumes are interleaved across nodes
+    uint32_t numa_policy;
+
 } aku_FineTuneParams;
 
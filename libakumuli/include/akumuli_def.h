@@ -28,10 +28,13 @@
 #define AKU_LIMITS_MAX_TAGS      32
 //! Longest possible series name
 #define AKU_LIMITS_MAX_SNAME  0x200
+//! First param id assigned to series name (smaller ids can be used with raw API)
+#define AKU_STARTING_SERIES_ID 1024ul
 #define AKU_MIN_TIMESTAMP         0
 #define AKU_MAX_TIMESTAMP       (~0)
 #define AKU_STACK_SIZE            0x100000
-#define AKU_HISTOGRAM_SIZE        0x10000
+#define AKU_PAGE_MODEL_SIZE       0x10000
+#define AKU_PAGE_MODEL_ERROR      8
 
 //! Max number of live generations in cache
 #define AKU_LIMITS_MAX_CACHES     8
@@ -103,10 +106,19 @@
 #define AKU_CHUNK_FWD_ID                0xFFFFFFFFFFFFFFFEul
 //! Id for backward scanning
 #define AKU_CHUNK_BWD_ID                0xFFFFFFFFFFFFFFFFul
+//! Length of the int64 value (in results and in chunk lengths), zero length means double value
+#define AKU_LENGTH_INT64                0xFFFFFFFFu
+//! First four bytes of the bulk frame ("AKB1", little endian)
+#define AKU_BULK_MAGIC                  0x31424B41u
+//! First four bytes of the exported column block ("AKC1", little endian)
+#define AKU_COLUMN_BLOCK_MAGIC          0x31434B41u
 
 // Defaults
 #define AKU_DEFAULT_COMPRESSION_THRESHOLD 0x1000u
 #define AKU_DEFAULT_WINDOW_SIZE 10000ul
-#define AKU_DEFAULT_MAX_CACHE_SIZE 0x100000u
+#define AKU_DEFAULT_MAX_CACHE_SIZE 0x10000000u
+#define AKU_DEFAULT_CHUNK_CACHE_SIZE 0x4000000u
+#define AKU_DEFAULT_READAHEAD 0x100000u
+#define AKU_DEFAULT_STACK_POOL_SIZE 0x20u
 
 #endif
@@ -17,14 +17,17 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <memory>
 #include <iostream>
+#include <algorithm>
 
 #include <apr_dbd.h>
 
 #include "akumuli.h"
 #include "storage.h"
+#include "compression.h"
 
 using namespace Akumuli;
 
@@ -80,47 +83,94 @@ void aku_console_logger(int tag, const char* msg) {
 }
 
 
-struct MatchPred {
-    std::vector<aku_ParamId> params_;
-    MatchPred(aku_ParamId* begin, uint32_t n)
-        : params_(begin, begin + n)
-    {
-    }
-
-    SearchQuery::ParamMatch operator () (aku_ParamId id) const {
-        return std::binary_search(params_.begin(), params_.end(), id) ? SearchQuery::MATCH : SearchQuery::NO_MATCH;
-    }
-};
-
-
 struct CursorImpl : aku_Cursor {
-    std::unique_ptr<ExternalCursor> cursor_;
+    LatencyTimer timer_;                        //< Query latency (recorded when cursor is closed)
+    std::unique_ptr<ExternalCursor> cursor_;    //< Cursor of the select query (null for aggregate query)
     int status_;
     std::unique_ptr<SearchQuery> query_;
+    std::vector<aku_AggregateResult> aggregates_;  //< Results of the aggregate query
+    size_t aggregates_pos_;                        //< Number of aggregates that was read
 
     CursorImpl(Storage& storage, std::unique_ptr<SearchQuery> query)
-        : query_(std::move(query))
+        : timer_(&storage.metrics_.query)
+        , query_(std::move(query))
+        , aggregates_pos_(0u)
     {
         status_ = AKU_SUCCESS;
-        cursor_ = CoroCursor::make(&Storage::search, &storage, *query_);
+        query_->stats = std::make_shared<SearchStats>();
+        cursor_ = storage.make_cursor(*query_);
+    }
+
+    //! Aggregate query c-tor, results are computed in place
+    CursorImpl(Storage& storage, std::unique_ptr<SearchQuery> query, aku_Duration bucket_width)
+        : timer_(&storage.metrics_.query)
+        , query_(std::move(query))
+        , aggregates_pos_(0u)
+    {
+        status_ = AKU_SUCCESS;
+        query_->stats = std::make_shared<SearchStats>();
+        if (bucket_width == 0u) {
+            status_ = AKU_EBAD_ARG;
+            return;
+        }
+        Aggregator aggregator(bucket_width);
+        status_ = storage.aggregate(*query_, &aggregator);
+        if (status_ == AKU_SUCCESS) {
+            for (auto const& kv: aggregator.get_results(query_->direction)) {
+                aku_AggregateResult res = {
+                    kv.first.first,
+                    kv.first.second,
+                    kv.second.count,
+                    kv.second.sum,
+                    kv.second.min,
+                    kv.second.max,
+                };
+                aggregates_.push_back(res);
+            }
+        }
     }
 
     ~CursorImpl() {
-        cursor_->close();
+        if (cursor_) {
+            cursor_->close();
+        }
     }
 
     bool is_done() const {
+        if (!cursor_) {
+            return status_ != AKU_SUCCESS || aggregates_pos_ == aggregates_.size();
+        }
         return cursor_->is_done();
     }
 
     bool is_error(int* out_error_code_or_null) const {
         if (status_ != AKU_SUCCESS) {
-            *out_error_code_or_null = status_;
+            if (out_error_code_or_null) {
+                *out_error_code_or_null = status_;
+            }
+            return true;
+        }
+        if (!cursor_) {
             return false;
         }
         return cursor_->is_error(out_error_code_or_null);
     }
 
+    //! Counters of the page searches performed by this query so far
+    void get_search_stats(aku_SearchStats* stats) const {
+        query_->stats->get(stats);
+    }
+
+    int read_aggregates(aku_AggregateResult* dest, size_t dest_size) {
+        if (cursor_ || status_ != AKU_SUCCESS) {
+            return 0;
+        }
+        auto n = std::min(dest_size, aggregates_.size() - aggregates_pos_);
+        std::copy(aggregates_.begin() + aggregates_pos_, aggregates_.begin() + aggregates_pos_ + n, dest);
+        aggregates_pos_ += n;
+        return static_cast<int>(n);
+    }
+
     int read_columns( aku_TimeStamp   *timestamps
                     , aku_ParamId     *params
                     , aku_PData       *pointers
@@ -128,24 +178,13 @@ struct CursorImpl : aku_Cursor {
                     , size_t           arrays_size )
     {
         // TODO: track PageHeader::open_count here
-        std::vector<CursorResult> results;
-        results.resize(arrays_size);  // TODO: pass all pointers to storage directly
-        int n_results = cursor_->read(results.data(), results.size());
-        for (int i = 0; i < n_results; i++) {
-            const CursorResult& result = results[i];
-            if (timestamps) {
-                timestamps[i] = result.timestamp;
-            }
-            if (params) {
-                params[i] = result.param_id;
-            }
-            if (pointers) {
-                pointers[i] = result.data;
-            }
-            if (lengths) {
-                lengths[i] = result.length;
-            }
+        // Results are written by fan-in cursor directly to user's arrays,
+        // blob pointers refer to mapped pages.
+        if (!cursor_) {
+            return 0;
         }
+        CursorColumns columns = { timestamps, params, pointers, lengths };
+        int n_results = cursor_->read_columns(columns, static_cast<int>(arrays_size));
         return n_results;
     }
 };
@@ -169,7 +208,7 @@ struct DatabaseImpl : public aku_Database
         return storage_.get_open_error();
     }
 
-    CursorImpl* select(aku_SelectQuery* query) {
+    static std::unique_ptr<SearchQuery> make_search_query(aku_SelectQuery* query) {
         uint32_t scan_dir;
         aku_TimeStamp begin, end;
         if (query->begin < query->end) {
@@ -181,13 +220,28 @@ struct DatabaseImpl : public aku_Database
             begin = query->end;
             scan_dir = AKU_CURSOR_DIR_BACKWARD;
         }
-        MatchPred pred(query->params, query->n_params);
+        std::vector<aku_ParamId> ids(query->params, query->params + query->n_params);
         std::unique_ptr<SearchQuery> search_query;
-        search_query.reset(new SearchQuery(pred, {begin}, {end}, scan_dir));
+        search_query.reset(new SearchQuery(std::move(ids), {begin}, {end}, scan_dir));
+        return search_query;
+    }
+
+    CursorImpl* select(aku_SelectQuery* query) {
+        auto search_query = make_search_query(query);
+        search_query->limit = query->limit;
         auto pcur = new CursorImpl(storage_, std::move(search_query));
         return pcur;
     }
 
+    CursorImpl* select_aggregate(aku_SelectQuery* query, aku_Duration bucket_width) {
+        auto pcur = new CursorImpl(storage_, make_search_query(query), bucket_width);
+        return pcur;
+    }
+
+    aku_Status get_last_values(const aku_ParamId* param_ids, size_t size, aku_TimeStamp* out_ts, double* out_values) const {
+        return storage_.get_last_values(param_ids, size, out_ts, out_values);
+    }
+
     aku_Status add_blob(aku_ParamId param_id, aku_TimeStamp ts, aku_MemRange value) {
         return storage_.write_blob(param_id, ts, value);
     }
@@ -196,10 +250,44 @@ struct DatabaseImpl : public aku_Database
         return storage_.write_double(param_id, ts, value);
     }
 
+    aku_Status series_to_param_id(const char* begin, const char* end, aku_ParamId* out_id) {
+        return storage_.series_to_param_id(begin, end, out_id);
+    }
+
+    aku_Status select_series(const char* expression, std::vector<aku_ParamId>* out) const {
+        return storage_.select_series(expression, out);
+    }
+
+    aku_Status add_int64(aku_ParamId param_id, aku_TimeStamp ts, int64_t value) {
+        return storage_.write_int64(param_id, ts, value);
+    }
+
+    aku_Status add_batch(const aku_ParamId* param_ids, const aku_TimeStamp* timestamps,
+                         const double* values, size_t size, aku_Status* statuses)
+    {
+        return storage_.write_batch(param_ids, timestamps, values, size, statuses);
+    }
+
+    uint32_t num_shards() const {
+        return static_cast<uint32_t>(storage_.shards_.size());
+    }
+
+    uint32_t shard_index(aku_ParamId param_id) const {
+        return storage_.get_shard_index(param_id);
+    }
+
     // Stats
     void get_storage_stats(aku_StorageStats* recv_stats) {
         storage_.get_stats(recv_stats);
     }
+
+    void get_memory_stats(aku_MemoryStats* recv_stats, aku_VolumeMemoryStats* volumes, size_t volumes_size) {
+        storage_.get_memory_stats(recv_stats, volumes, volumes_size);
+    }
+
+    void get_metrics(aku_Metrics* recv_metrics, bool reset) {
+        storage_.get_metrics(recv_metrics, reset);
+    }
 };
 
 apr_status_t aku_create_database( const char     *file_name
@@ -234,6 +322,45 @@ apr_status_t aku_remove_database(const char* file_name, aku_logger_cb_t logger)
     return Storage::remove_storage(file_name, logger);
 }
 
+aku_Status aku_export_columns(const char* file_name, const char* out_path,
+                              aku_TimeStamp begin, aku_TimeStamp end,
+                              const aku_ParamId* ids, size_t nids,
+                              uint32_t nthreads, aku_logger_cb_t logger,
+                              aku_MaintenanceStats* rcv_stats)
+{
+    if (logger == nullptr) {
+        logger = &aku_console_logger;
+    }
+    std::vector<aku_ParamId> idlist;
+    if (ids != nullptr) {
+        idlist.assign(ids, ids + nids);
+    }
+    return Storage::export_columns(file_name, out_path, begin, end, idlist, nthreads, logger, rcv_stats);
+}
+
+aku_Status aku_compact_database(const char* file_name, uint32_t codec_policy,
+                                uint32_t nthreads, aku_logger_cb_t logger,
+                                aku_MaintenanceStats* rcv_stats)
+{
+    if (logger == nullptr) {
+        logger = &aku_console_logger;
+    }
+    if (codec_policy > AKU_CODEC_FASTEST) {
+        return AKU_EBAD_ARG;
+    }
+    return Storage::compact_storage(file_name, codec_policy, nthreads, logger, rcv_stats);
+}
+
+aku_Status aku_backup_database(const char* file_name, const char* dest_path,
+                               uint32_t nthreads, aku_logger_cb_t logger,
+                               aku_MaintenanceStats* rcv_stats)
+{
+    if (logger == nullptr) {
+        logger = &aku_console_logger;
+    }
+    return Storage::backup_storage(file_name, dest_path, nthreads, logger, rcv_stats);
+}
+
 aku_Status aku_write_blob(aku_Database* db, aku_ParamId param_id, aku_TimeStamp ts, aku_MemRange value) {
     auto dbi = reinterpret_cast<DatabaseImpl*>(db);
     return dbi->add_blob(param_id, ts, value);
@@ -244,8 +371,68 @@ aku_Status aku_write_double_raw(aku_Database* db, aku_ParamId param_id, aku_Time
     return dbi->add_double(param_id, timestamp, value);
 }
 
+aku_Status aku_write_int64_raw(aku_Database* db, aku_ParamId param_id, aku_TimeStamp timestamp, int64_t value) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->add_int64(param_id, timestamp, value);
+}
+
+aku_Status aku_write_batch(aku_Database* db, const aku_ParamId* param_ids, const aku_TimeStamp* timestamps,
+                           const double* values, size_t size, aku_Status* statuses)
+{
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->add_batch(param_ids, timestamps, values, size, statuses);
+}
+
+size_t aku_bulk_max_size(size_t size) {
+    return CompressionUtil::max_bulk_size(size);
+}
+
+aku_Status aku_encode_bulk(const aku_Sample* samples, size_t size, void* dest, size_t dest_size, size_t* out_size) {
+    MemBuffer buffer(static_cast<unsigned char*>(dest), dest_size);
+    auto status = CompressionUtil::encode_bulk(samples, size, &buffer);
+    if (status == AKU_SUCCESS) {
+        *out_size = buffer.size();
+    }
+    return status;
+}
+
+aku_Status aku_decode_bulk(const void* frame, size_t frame_size, aku_Sample* dest, size_t* size) {
+    return CompressionUtil::decode_bulk(static_cast<const unsigned char*>(frame), frame_size, dest, size);
+}
+
+uint32_t aku_num_shards(aku_Database* db) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->num_shards();
+}
+
+uint32_t aku_shard_index(aku_Database* db, aku_ParamId param_id) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->shard_index(param_id);
+}
+
+aku_Status aku_series_to_param_id(aku_Database* db, const char* begin, const char* end, aku_ParamId* out_id) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->series_to_param_id(begin, end, out_id);
+}
+
 aku_Status aku_write_double(aku_Database* db, const char* series_key, aku_TimeStamp timestamp, double value) {
-    return AKU_ENOT_IMPLEMENTED; // Not implemented
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    aku_ParamId id = 0;
+    auto status = dbi->series_to_param_id(series_key, series_key + strlen(series_key), &id);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    return dbi->add_double(id, timestamp, value);
+}
+
+aku_Status aku_write_int64(aku_Database* db, const char* series_key, aku_TimeStamp timestamp, int64_t value) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    aku_ParamId id = 0;
+    auto status = dbi->series_to_param_id(series_key, series_key + strlen(series_key), &id);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    return dbi->add_int64(id, timestamp, value);
 }
 
 aku_Database* aku_open_database(const char* path, aku_FineTuneParams config)
@@ -283,12 +470,28 @@ aku_SelectQuery* aku_make_select_query(aku_TimeStamp begin, aku_TimeStamp end, u
     auto res = reinterpret_cast<aku_SelectQuery*>(p);
     res->begin = begin;
     res->end = end;
+    res->limit = 0u;
     res->n_params = n_params;
     memcpy(&res->params, params, n_params*sizeof(aku_ParamId));
     std::sort(res->params, res->params + n_params);
     return res;
 }
 
+aku_SelectQuery* aku_make_tag_query(aku_Database* db, aku_TimeStamp begin, aku_TimeStamp end,
+                                    const char* expression, aku_Status* out_status)
+{
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    std::vector<aku_ParamId> params;
+    auto status = dbi->select_series(expression, &params);
+    if (out_status) {
+        *out_status = status;
+    }
+    if (status != AKU_SUCCESS) {
+        return nullptr;
+    }
+    return aku_make_select_query(begin, end, static_cast<uint32_t>(params.size()), params.data());
+}
+
 void aku_destroy(void* any) {
     free(any);
 }
@@ -298,6 +501,18 @@ aku_Cursor* aku_select(aku_Database *db, aku_SelectQuery* query) {
     return dbi->select(query);
 }
 
+aku_Status aku_get_last_values(aku_Database* db, const aku_ParamId* param_ids, size_t n,
+                               aku_TimeStamp* out_timestamps, double* out_values)
+{
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->get_last_values(param_ids, n, out_timestamps, out_values);
+}
+
+aku_Cursor* aku_select_aggregate(aku_Database *db, aku_SelectQuery* query, aku_TimeStamp bucket_width) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->select_aggregate(query, bucket_width);
+}
+
 void aku_close_cursor(aku_Cursor* pcursor) {
     CursorImpl* pimpl = reinterpret_cast<CursorImpl*>(pcursor);
     delete pimpl;
@@ -315,6 +530,11 @@ int aku_cursor_read_columns( aku_Cursor      *pcursor
     return pimpl->read_columns(timestamps, params, pointers, lengths, arrays_size);
 }
 
+int aku_cursor_read_aggregates(aku_Cursor* pcursor, aku_AggregateResult* dest, size_t dest_size) {
+    CursorImpl* pimpl = reinterpret_cast<CursorImpl*>(pcursor);
+    return pimpl->read_aggregates(dest, dest_size);
+}
+
 int aku_cursor_is_done(aku_Cursor* pcursor) {
     CursorImpl* pimpl = reinterpret_cast<CursorImpl*>(pcursor);
     return static_cast<int>(pimpl->is_done());
@@ -329,11 +549,32 @@ int aku_cursor_is_error(aku_Cursor* pcursor, int* out_error_code_or_null) {
 //         Statistics
 //--------------------------------
 
+void aku_cursor_stats(aku_Cursor* pcursor, aku_SearchStats* rcv_stats) {
+    CursorImpl* pimpl = reinterpret_cast<CursorImpl*>(pcursor);
+    pimpl->get_search_stats(rcv_stats);
+}
+
 void aku_global_search_stats(aku_SearchStats* rcv_stats, int reset) {
     PageHeader::get_search_stats(rcv_stats, reset);
 }
 
+void aku_global_compression_stats(aku_CompressionStats* rcv_stats, int reset) {
+    CompressionUtil::get_stats(rcv_stats, reset);
+}
+
 void aku_global_storage_stats(aku_Database *db, aku_StorageStats* rcv_stats) {
     auto dbi = reinterpret_cast<DatabaseImpl*>(db);
     dbi->get_storage_stats(rcv_stats);
 }
+
+void aku_get_metrics(aku_Database *db, aku_Metrics* rcv_metrics, int reset) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    dbi->get_metrics(rcv_metrics, reset);
+}
+
+void aku_get_memory_stats(aku_Database *db, aku_MemoryStats* rcv_stats,
+                          aku_VolumeMemoryStats* volumes, size_t volumes_size)
+{
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    dbi->get_memory_stats(rcv_stats, volumes, volumes_size);
+}
@@ -1,16 +1,26 @@
 #include "compression.h"
 #include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AKU_STREAMVBYTE_SSSE3
+#include <tmmintrin.h>
+#endif
 
 namespace Akumuli {
 
 //! Stream that can be used to read/write data by 4-bits
+template<class Buffer>
 struct HalfByteStream {
-    ByteVector *data;
+    Buffer *data;
     size_t write_pos;
     size_t read_pos;
     unsigned char tmp;
 
-    HalfByteStream(ByteVector *d, size_t numblocks=0u) :
+    HalfByteStream(Buffer *d, size_t numblocks=0u) :
         data(d),
         write_pos(numblocks),
         read_pos(0),
@@ -42,15 +52,16 @@ struct HalfByteStream {
     }
 };
 
+template<class Buffer>
 size_t CompressionUtil::compress_doubles(std::vector<double> const& input,
                                          std::vector<aku_ParamId> const& params,
-                                         ByteVector *buffer)
+                                         Buffer *buffer)
 {
     std::unordered_map<aku_ParamId, uint64_t> prev_in_series;
     for (auto id: params) {
         prev_in_series[id] = 0ul;
     }
-    HalfByteStream stream(buffer);
+    HalfByteStream<Buffer> stream(buffer);
     for (size_t ix = 0u; ix != input.size(); ix++) {
         union {
             double real;
@@ -79,6 +90,13 @@ size_t CompressionUtil::compress_doubles(std::vector<double> const& input,
     return stream.write_pos;
 }
 
+template size_t CompressionUtil::compress_doubles(std::vector<double> const&,
+                                                  std::vector<aku_ParamId> const&,
+                                                  ByteVector*);
+template size_t CompressionUtil::compress_doubles(std::vector<double> const&,
+                                                  std::vector<aku_ParamId> const&,
+                                                  MemBuffer*);
+
 void CompressionUtil::decompress_doubles(ByteVector& buffer,
                                          size_t numblocks,
                                          std::vector<aku_ParamId> const& params,
@@ -88,7 +106,7 @@ void CompressionUtil::decompress_doubles(ByteVector& buffer,
     for (auto id: params) {
         prev_in_series[id] = 0ul;
     }
-    HalfByteStream stream(&buffer, numblocks);
+    HalfByteStream<ByteVector> stream(&buffer, numblocks);
     size_t ix = 0;
     while(numblocks) {
         aku_ParamId id = params.at(ix);
@@ -111,112 +129,705 @@ void CompressionUtil::decompress_doubles(ByteVector& buffer,
     }
 }
 
+template<class Buffer>
+size_t CompressionUtil::compress_integers(std::vector<int64_t> const& input,
+                                          std::vector<aku_ParamId> const& params,
+                                          Buffer *buffer)
+{
+    std::unordered_map<aku_ParamId, uint64_t> prev_in_series;
+    Base128StreamWriter<uint64_t, Buffer> stream(*buffer);
+    const size_t size = buffer->size();
+    for (size_t ix = 0u; ix != input.size(); ix++) {
+        uint64_t& prev = prev_in_series[params.at(ix)];  // zero-initialized
+        uint64_t curr = static_cast<uint64_t>(input[ix]);
+        // Unsigned arithmetic, difference can't overflow
+        uint64_t delta = curr - prev;
+        prev = curr;
+        stream.put((delta << 1) ^ (0ul - (delta >> 63)));
+    }
+    return buffer->size() - size;
+}
+
+template size_t CompressionUtil::compress_integers(std::vector<int64_t> const&,
+                                                   std::vector<aku_ParamId> const&,
+                                                   ByteVector*);
+template size_t CompressionUtil::compress_integers(std::vector<int64_t> const&,
+                                                   std::vector<aku_ParamId> const&,
+                                                   MemBuffer*);
+
+const unsigned char* CompressionUtil::decompress_integers(const unsigned char* begin,
+                                                          const unsigned char* end,
+                                                          std::vector<aku_ParamId> const& params,
+                                                          std::vector<int64_t> *output)
+{
+    std::unordered_map<aku_ParamId, uint64_t> prev_in_series;
+    for (auto id: params) {
+        uint64_t zigzag = 0ul;
+        for (int shift = 0;; shift += 7) {
+            if (begin == end || shift > 63) {
+                return nullptr;
+            }
+            auto byte = *begin++;
+            zigzag |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+        }
+        uint64_t& prev = prev_in_series[id];
+        prev += (zigzag >> 1) ^ (0ul - (zigzag & 1));
+        output->push_back(static_cast<int64_t>(prev));
+    }
+    return begin;
+}
+
+namespace {
+
+//! Bit stream writer, bits are written starting from the most significant
+template<class Buffer>
+struct BitStreamWriter {
+    Buffer       *data_;
+    unsigned char cur_;
+    int           used_;   //< Number of used bits in cur_
+    size_t        nbits_;
+
+    BitStreamWriter(Buffer *data)
+        : data_(data)
+        , cur_(0)
+        , used_(0)
+        , nbits_(0)
+    {
+    }
+
+    //! Write `width` (1-64) least significant bits of the value
+    void put(uint64_t value, int width) {
+        nbits_ += width;
+        while (width > 0) {
+            int free = 8 - used_;
+            int n = std::min(free, width);
+            auto bits = static_cast<unsigned char>((value >> (width - n)) & ((1u << n) - 1));
+            cur_ |= bits << (free - n);
+            used_ += n;
+            width -= n;
+            if (used_ == 8) {
+                data_->push_back(cur_);
+                cur_ = 0;
+                used_ = 0;
+            }
+        }
+    }
+
+    void close() {
+        if (used_ != 0) {
+            data_->push_back(cur_);
+        }
+    }
+};
+
+//! Bit stream reader
+struct BitStreamReader {
+    const unsigned char *pos_;
+    size_t               nbits_;  //< Number of remaining bits
+    int                  used_;   //< Number of consumed bits in *pos_
+
+    BitStreamReader(const unsigned char *begin, size_t nbits)
+        : pos_(begin)
+        , nbits_(nbits)
+        , used_(0)
+    {
+    }
+
+    //! Read `width` (1-64) bits, returns false if stream is too short
+    bool get(int width, uint64_t *value) {
+        if (nbits_ < static_cast<size_t>(width)) {
+            return false;
+        }
+        nbits_ -= width;
+        uint64_t result = 0;
+        while (width > 0) {
+            int avail = 8 - used_;
+            int n = std::min(avail, width);
+            uint64_t bits = (*pos_ >> (avail - n)) & ((1u << n) - 1);
+            result = (result << n) | bits;
+            used_ += n;
+            width -= n;
+            if (used_ == 8) {
+                pos_++;
+                used_ = 0;
+            }
+        }
+        *value = result;
+        return true;
+    }
+};
+
+//! Indexes of the values grouped by series, order of the values inside the series is preserved
+std::vector<uint32_t> order_by_series(std::vector<aku_ParamId> const& params) {
+    std::vector<uint32_t> order(params.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&params](uint32_t lhs, uint32_t rhs) {
+        return params[lhs] < params[rhs];
+    });
+    return order;
+}
+
+}  // namespace
+
+template<class Buffer>
+size_t CompressionUtil::compress_doubles_gorilla(std::vector<double> const& input,
+                                                 std::vector<aku_ParamId> const& params,
+                                                 Buffer *buffer)
+{
+    auto order = order_by_series(params);
+    BitStreamWriter<Buffer> stream(buffer);
+    uint64_t prev = 0ul;
+    int prev_lz = -1;  // window of the meaningful bits isn't set
+    int prev_tz = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        union {
+            double real;
+            uint64_t bits;
+        } curr = {};
+        curr.real = input.at(order[i]);
+        if (i == 0 || params[order[i]] != params[order[i - 1]]) {
+            // First value of the series is stored as is
+            stream.put(curr.bits, 64);
+            prev = curr.bits;
+            prev_lz = -1;
+            continue;
+        }
+        uint64_t diff = curr.bits ^ prev;
+        prev = curr.bits;
+        if (diff == 0) {
+            stream.put(0, 1);
+            continue;
+        }
+        int lz = std::min(__builtin_clzl(diff), 31);  // stored in 5 bits
+        int tz = __builtin_ctzl(diff);
+        if (prev_lz >= 0 && lz >= prev_lz && tz >= prev_tz) {
+            // Meaningful bits fits in the previous window
+            stream.put(2, 2);
+            stream.put(diff >> prev_tz, 64 - prev_lz - prev_tz);
+        } else {
+            int nbits = 64 - lz - tz;
+            stream.put(3, 2);
+            stream.put(lz, 5);
+            stream.put(nbits - 1, 6);
+            stream.put(diff >> tz, nbits);
+            prev_lz = lz;
+            prev_tz = tz;
+        }
+    }
+    stream.close();
+    return stream.nbits_;
+}
+
+template size_t CompressionUtil::compress_doubles_gorilla(std::vector<double> const&,
+                                                          std::vector<aku_ParamId> const&,
+                                                          ByteVector*);
+template size_t CompressionUtil::compress_doubles_gorilla(std::vector<double> const&,
+                                                          std::vector<aku_ParamId> const&,
+                                                          MemBuffer*);
+
+bool CompressionUtil::decompress_doubles_gorilla(const unsigned char* begin,
+                                                 size_t nbits,
+                                                 std::vector<aku_ParamId> const& params,
+                                                 std::vector<double> *output)
+{
+    auto order = order_by_series(params);
+    auto base = output->size();
+    output->resize(base + order.size());
+    BitStreamReader stream(begin, nbits);
+    uint64_t prev = 0ul;
+    int prev_lz = 0;
+    int prev_tz = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        uint64_t bits = 0ul;
+        if (i == 0 || params[order[i]] != params[order[i - 1]]) {
+            if (!stream.get(64, &bits)) {
+                return false;
+            }
+        } else {
+            uint64_t flag;
+            if (!stream.get(1, &flag)) {
+                return false;
+            }
+            bits = prev;
+            if (flag) {
+                if (!stream.get(1, &flag)) {
+                    return false;
+                }
+                if (flag) {
+                    uint64_t lz, nbits;
+                    if (!stream.get(5, &lz) || !stream.get(6, &nbits)) {
+                        return false;
+                    }
+                    prev_lz = static_cast<int>(lz);
+                    prev_tz = 64 - prev_lz - static_cast<int>(nbits + 1);
+                    if (prev_tz < 0) {
+                        return false;
+                    }
+                }
+                uint64_t diff;
+                if (!stream.get(64 - prev_lz - prev_tz, &diff)) {
+                    return false;
+                }
+                bits ^= diff << prev_tz;
+            }
+        }
+        prev = bits;
+        union {
+            uint64_t bits;
+            double real;
+        } curr = {};
+        curr.bits = bits;
+        (*output)[base + order[i]] = curr.real;
+    }
+    return true;
+}
+
+namespace {
+
+uint32_t codec_of(uint32_t encoding, int shift) {
+    return (encoding >> shift) & AKU_CHUNK_CODEC_MASK;
+}
+
+template<class Buffer>
+bool encode_timestamps(const aku_TimeStamp* ts, size_t n, uint32_t codec, Buffer* out) {
+    switch (codec) {
+    case AKU_TS_DELTA_RLE: {
+        DeltaRLETSWriterT<Buffer> stream(*out);
+        for (size_t i = 0; i < n; i++) {
+            stream.put(ts[i]);
+        }
+        stream.close();
+        return true;
+    }
+    case AKU_TS_STREAMVBYTE: {
+        std::vector<uint64_t> deltas;
+        deltas.reserve(n);
+        aku_TimeStamp prev = 0u;
+        for (size_t i = 0; i < n; i++) {
+            deltas.push_back(ts[i] - prev);
+            prev = ts[i];
+        }
+        StreamVByte::encode(deltas.data(), deltas.size(), out);
+        return true;
+    }
+    case AKU_TS_DELTA_DELTA:
+        DeltaDeltaCodec::encode(ts, n, out);
+        return true;
+    }
+    return false;
+}
+
+template<class Buffer>
+bool encode_paramids(const aku_ParamId* ids, size_t n, uint32_t codec, Buffer* out) {
+    switch (codec) {
+    case AKU_IDS_BASE128: {
+        Base128IdWriterT<Buffer> stream(*out);
+        for (size_t i = 0; i < n; i++) {
+            stream.put(ids[i]);
+        }
+        stream.close();
+        return true;
+    }
+    case AKU_IDS_STREAMVBYTE:
+        StreamVByte::encode(ids, n, out);
+        return true;
+    }
+    return false;
+}
+
+//! Returns number of encoded units (4-bit blocks or bits) or -1 if codec is unknown
+template<class Buffer>
+int64_t encode_values(std::vector<double> const& values,
+                      std::vector<aku_ParamId> const& params,
+                      uint32_t codec,
+                      Buffer* out)
+{
+    switch (codec) {
+    case AKU_VALUES_XOR4:
+        return static_cast<int64_t>(CompressionUtil::compress_doubles(values, params, out));
+    case AKU_VALUES_GORILLA:
+        // Number of bits is stored instead of number of 4-bit blocks
+        return static_cast<int64_t>(CompressionUtil::compress_doubles_gorilla(values, params, out));
+    }
+    return -1;
+}
+
+/** Choose codec from candidates ordered by decoding speed (fastest first).
+  * @param sizes encoded sample size of every candidate
+  */
+uint32_t choose_codec(const uint32_t* candidates, const size_t* sizes, int n, uint32_t policy) {
+    int smallest = 0;
+    for (int i = 1; i < n; i++) {
+        if (sizes[i] < sizes[smallest]) {
+            smallest = i;
+        }
+    }
+    if (policy == AKU_CODEC_FASTEST) {
+        for (int i = 0; i < n; i++) {
+            if (sizes[i] <= sizes[smallest]*CompressionUtil::FASTEST_MAX_OVERHEAD) {
+                return candidates[i];
+            }
+        }
+    }
+    return candidates[smallest];
+}
+
+//! Cumulative compression counters
+struct CompressionCounters {
+    std::atomic<uint64_t> n_chunks;
+    std::atomic<uint64_t> n_elements;
+    std::atomic<uint64_t> bytes[5];  // timestamps, param ids, lengths, offsets, values
+    std::atomic<uint64_t> ts_codecs[AKU_TS_NCODECS];
+    std::atomic<uint64_t> ids_codecs[AKU_IDS_NCODECS];
+    std::atomic<uint64_t> values_codecs[AKU_VALUES_NCODECS];
+};
+
+// Zero-initialized (static storage)
+CompressionCounters counters;
+
+uint64_t read_counter(std::atomic<uint64_t>& counter, bool reset) {
+    return reset ? counter.exchange(0) : counter.load();
+}
+
+//! Number of columns in compression stats
+const int NCOLUMNS = 5;
+
+void update_counters(uint32_t encoding, size_t n_elements, const size_t* column_sizes) {
+    counters.n_chunks++;
+    counters.n_elements += n_elements;
+    for (int i = 0; i < NCOLUMNS; i++) {
+        counters.bytes[i] += column_sizes[i];
+    }
+    counters.ts_codecs[codec_of(encoding, AKU_CHUNK_TS_SHIFT)]++;
+    counters.ids_codecs[codec_of(encoding, AKU_CHUNK_IDS_SHIFT)]++;
+    counters.values_codecs[codec_of(encoding, AKU_CHUNK_VALUES_SHIFT)]++;
+}
+
+/** Write all columns of the chunk to `out` one after another:
+  * timestamps, param ids, lengths, offsets, number of value blocks (8 bytes), values, integers.
+  * Integers has no size field, their number is defined by lengths.
+  * @param column_sizes out parameter - size of every column (see NCOLUMNS)
+  */
+template<class Buffer>
+aku_Status encode_columns(uint32_t *n_elements,
+                          aku_TimeStamp *ts_begin,
+                          aku_TimeStamp *ts_end,
+                          Buffer *out,
+                          const ChunkHeader& data,
+                          uint32_t encoding,
+                          size_t *column_sizes)
+{
+    const auto ts_codec = codec_of(encoding, AKU_CHUNK_TS_SHIFT);
+    const auto ids_codec = codec_of(encoding, AKU_CHUNK_IDS_SHIFT);
+    const auto values_codec = codec_of(encoding, AKU_CHUNK_VALUES_SHIFT);
+    if (ts_codec >= AKU_TS_NCODECS || ids_codec >= AKU_IDS_NCODECS || values_codec >= AKU_VALUES_NCODECS ||
+        data.timestamps.empty())
+    {
+        return AKU_EBAD_ARG;
+    }
+    const size_t n = data.timestamps.size();
+    size_t column_end[NCOLUMNS];
+
+    // Timestamps
+    if (!encode_timestamps(data.timestamps.data(), n, ts_codec, out)) {
+        return AKU_EBAD_ARG;
+    }
+    column_end[0] = out->size();
+
+    // Param-Ids
+    if (!encode_paramids(data.paramids.data(), n, ids_codec, out)) {
+        return AKU_EBAD_ARG;
+    }
+    column_end[1] = out->size();
+
+    // Lengths
+    RLELenWriterT<Buffer> length_stream(*out);
+    for (size_t i = 0; i < n; i++) {
+        length_stream.put(data.lengths[i]);
+    }
+    length_stream.close();
+    column_end[2] = out->size();
+
+    // Offsets
+    DeltaRLEOffWriterT<Buffer> offset_stream(*out);
+    for (size_t i = 0; i < n; i++) {
+        offset_stream.put(data.offsets[i]);
+    }
+    offset_stream.close();
+    column_end[3] = out->size();
+
+    // Doubles size, filled in when doubles are written
+    size_t nblocks_pos = out->size();
+    out->resize(nblocks_pos + sizeof(uint64_t), 0u);
+    uint64_t nblocks = 0ul;
+    if (!data.values.empty()) {
+        std::vector<aku_ParamId> params_with_zlen;
+        params_with_zlen.reserve(data.values.size());
+        for (size_t i = 0; i < n; i++) {
+            if (data.lengths[i] == 0) {
+                params_with_zlen.push_back(data.paramids[i]);
+            }
+        }
+        // Doubles
+        nblocks = static_cast<uint64_t>(encode_values(data.values, params_with_zlen, values_codec, out));
+    }
+    if (!data.integers.empty()) {
+        std::vector<aku_ParamId> params_of_ints;
+        params_of_ints.reserve(data.integers.size());
+        for (size_t i = 0; i < n; i++) {
+            if (data.lengths[i] == AKU_LENGTH_INT64) {
+                params_of_ints.push_back(data.paramids[i]);
+            }
+        }
+        if (params_of_ints.size() != data.integers.size()) {
+            return AKU_EBAD_ARG;
+        }
+        CompressionUtil::compress_integers(data.integers, params_of_ints, out);
+    }
+    column_end[4] = out->size();  // doubles and integers are accounted together
+    if (column_end[4] < nblocks_pos + sizeof(uint64_t)) {
+        return AKU_EOVERFLOW;
+    }
+    memcpy(out->data() + nblocks_pos, &nblocks, sizeof(nblocks));
+
+    *n_elements = static_cast<uint32_t>(n);
+    *ts_begin = data.timestamps.front();
+    *ts_end   = data.timestamps.back();
+    for (int i = 0; i < NCOLUMNS; i++) {
+        column_sizes[i] = column_end[i] - (i == 0 ? 0u : column_end[i - 1]);
+    }
+    return AKU_SUCCESS;
+}
+
+}  // namespace
+
+size_t CompressionUtil::max_encoded_size(size_t n_elements) {
+    // Per element: timestamp and offset - two 10-byte Base128 values each (RLE),
+    // param id - 10 bytes, length - two 5-byte values, value - 77 bits (Gorilla) or
+    // 10 bytes (integer)
+    const size_t MAX_BYTES_PER_ELEMENT = 20 + 10 + 10 + 20 + 10;
+    // DoD prologue, number of value blocks, unfinished RLE runs and bit streams
+    const size_t MAX_OVERHEAD = 0x40;
+    return n_elements*MAX_BYTES_PER_ELEMENT + MAX_OVERHEAD;
+}
+
+aku_Status CompressionUtil::encode_chunk( uint32_t           *n_elements
+                                        , aku_TimeStamp      *ts_begin
+                                        , aku_TimeStamp      *ts_end
+                                        , MemBuffer          *out
+                                        , const ChunkHeader&  data
+                                        , uint32_t            encoding)
+{
+    size_t column_sizes[NCOLUMNS];
+    auto status = encode_columns(n_elements, ts_begin, ts_end, out, data, encoding, column_sizes);
+    if (status == AKU_SUCCESS && out->overflow()) {
+        status = AKU_EOVERFLOW;
+    }
+    if (status == AKU_SUCCESS) {
+        update_counters(encoding, data.timestamps.size(), column_sizes);
+    }
+    return status;
+}
+
 aku_Status CompressionUtil::encode_chunk( uint32_t           *n_elements
                                         , aku_TimeStamp      *ts_begin
                                         , aku_TimeStamp      *ts_end
                                         , ChunkWriter        *writer
-                                        , const ChunkHeader&  data)
+                                        , const ChunkHeader&  data
+                                        , uint32_t            encoding)
 {
-    // NOTE: it is possible to avoid copying and write directly to page
-    // instead of temporary byte vectors
-    ByteVector timestamps;
-    ByteVector paramids;
-    ByteVector offsets;
-    ByteVector lengths;
-
-    DeltaRLETSWriter timestamp_stream(timestamps);
-    Base128IdWriter paramid_stream(paramids);
-    DeltaRLEOffWriter offset_stream(offsets);
-    RLELenWriter length_stream(lengths);
-
-    std::vector<aku_ParamId> params_with_zlen;
-
-    for (auto i = 0ul; i < data.timestamps.size(); i++) {
-        auto pid = data.paramids.at(i);
-        auto offset = data.offsets.at(i);
-        auto len = data.lengths.at(i);
-        auto ts = data.timestamps.at(i);
-        timestamp_stream.put(ts);
-        paramid_stream.put(pid);
-        offset_stream.put(offset);
-        length_stream.put(len);
-        if (len == 0) {
-            params_with_zlen.push_back(pid);
-        }
-    }
-
-    timestamp_stream.close();
-    paramid_stream.close();
-    offset_stream.close();
-    length_stream.close();
+    ByteVector buffer;
+    size_t column_sizes[NCOLUMNS];
+    auto status = encode_columns(n_elements, ts_begin, ts_end, &buffer, data, encoding, column_sizes);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    const aku_MemRange range = {
+        buffer.data(),
+        static_cast<uint32_t>(buffer.size())
+    };
+    status = writer->add_chunk(range, 0u);
+    if (status == AKU_SUCCESS) {
+        update_counters(encoding, data.timestamps.size(), column_sizes);
+    }
+    return status;
+}
 
-    uint32_t size_estimate =
-            static_cast<uint32_t>( timestamp_stream.size()
-                                 + paramid_stream.size()
-                                 + offset_stream.size()
-                                 + length_stream.size()
-                                 + sizeof(uint64_t)
-                                 );
+uint32_t CompressionUtil::select_encoding(const ChunkHeader& data, uint32_t policy, uint32_t fixed) {
+    if (policy != AKU_CODEC_SMALLEST && policy != AKU_CODEC_FASTEST) {
+        return fixed;
+    }
+    const size_t n = std::min(data.timestamps.size(), static_cast<size_t>(CODEC_SAMPLE_SIZE));
+    if (n == 0) {
+        return fixed;
+    }
+    ByteVector buffer;
+    uint32_t encoding = 0u;
 
-    aku_Status status = AKU_SUCCESS;
+    // Candidates are ordered by decoding speed
+    const uint32_t ts_codecs[] = { AKU_TS_DELTA_DELTA, AKU_TS_STREAMVBYTE, AKU_TS_DELTA_RLE };
+    size_t ts_sizes[AKU_TS_NCODECS];
+    for (int i = 0; i < AKU_TS_NCODECS; i++) {
+        buffer.clear();
+        encode_timestamps(data.timestamps.data(), n, ts_codecs[i], &buffer);
+        ts_sizes[i] = buffer.size();
+    }
+    encoding |= choose_codec(ts_codecs, ts_sizes, AKU_TS_NCODECS, policy) << AKU_CHUNK_TS_SHIFT;
 
-    switch(status) {
-    case AKU_SUCCESS:
-        // Doubles
-        uint64_t nblocks = 0ul;
-        if (!data.values.empty()) {
-            ByteVector compressed;
-            nblocks = CompressionUtil::compress_doubles(data.values, params_with_zlen, &compressed);
-            size_estimate += static_cast<uint32_t>(compressed.size());
-            const aku_MemRange compressed_mrange = {
-                compressed.data(),
-                static_cast<uint32_t>(compressed.size())
-            };
-            status = writer->add_chunk(compressed_mrange, size_estimate);
-            if (status != AKU_SUCCESS) {
-                break;
-            }
-            size_estimate -= compressed.size();
-        }
-        aku_MemRange nblocks_mrange = {
-            &nblocks,
-            sizeof(nblocks),
-        };
-        // Doubles size
-        status = writer->add_chunk(nblocks_mrange, size_estimate);
-        if (status != AKU_SUCCESS) {
-            break;
+    const uint32_t ids_codecs[] = { AKU_IDS_STREAMVBYTE, AKU_IDS_BASE128 };
+    size_t ids_sizes[AKU_IDS_NCODECS];
+    for (int i = 0; i < AKU_IDS_NCODECS; i++) {
+        buffer.clear();
+        encode_paramids(data.paramids.data(), n, ids_codecs[i], &buffer);
+        ids_sizes[i] = buffer.size();
+    }
+    encoding |= choose_codec(ids_codecs, ids_sizes, AKU_IDS_NCODECS, policy) << AKU_CHUNK_IDS_SHIFT;
+
+    // Values of the sample belong to zero length entries of the sample
+    std::vector<aku_ParamId> params;
+    for (size_t i = 0; i < n; i++) {
+        if (data.lengths.at(i) == 0) {
+            params.push_back(data.paramids.at(i));
         }
-        size_estimate -= sizeof(nblocks);
-        // Offsets
-        status = writer->add_chunk(offset_stream.get_memrange(), size_estimate);
-        if (status != AKU_SUCCESS) {
-            break;
+    }
+    if (!params.empty()) {
+        std::vector<double> values(data.values.begin(), data.values.begin() + params.size());
+        const uint32_t values_codecs[] = { AKU_VALUES_GORILLA, AKU_VALUES_XOR4 };
+        size_t values_sizes[AKU_VALUES_NCODECS];
+        for (int i = 0; i < AKU_VALUES_NCODECS; i++) {
+            buffer.clear();
+            encode_values(values, params, values_codecs[i], &buffer);
+            values_sizes[i] = buffer.size();
         }
-        size_estimate -= offset_stream.size();
-        // Lengths
-        status = writer->add_chunk(length_stream.get_memrange(), size_estimate);
-        if (status != AKU_SUCCESS) {
-            break;
+        encoding |= choose_codec(values_codecs, values_sizes, AKU_VALUES_NCODECS, policy) << AKU_CHUNK_VALUES_SHIFT;
+    }
+    return encoding;
+}
+
+void CompressionUtil::get_stats(aku_CompressionStats* rcv_stats, bool reset) {
+    rcv_stats->n_chunks = read_counter(counters.n_chunks, reset);
+    rcv_stats->n_elements = read_counter(counters.n_elements, reset);
+    rcv_stats->bytes.timestamps = read_counter(counters.bytes[0], reset);
+    rcv_stats->bytes.paramids = read_counter(counters.bytes[1], reset);
+    rcv_stats->bytes.lengths = read_counter(counters.bytes[2], reset);
+    rcv_stats->bytes.offsets = read_counter(counters.bytes[3], reset);
+    rcv_stats->bytes.values = read_counter(counters.bytes[4], reset);
+    rcv_stats->codecs.ts_delta_rle = read_counter(counters.ts_codecs[AKU_TS_DELTA_RLE], reset);
+    rcv_stats->codecs.ts_streamvbyte = read_counter(counters.ts_codecs[AKU_TS_STREAMVBYTE], reset);
+    rcv_stats->codecs.ts_delta_delta = read_counter(counters.ts_codecs[AKU_TS_DELTA_DELTA], reset);
+    rcv_stats->codecs.ids_base128 = read_counter(counters.ids_codecs[AKU_IDS_BASE128], reset);
+    rcv_stats->codecs.ids_streamvbyte = read_counter(counters.ids_codecs[AKU_IDS_STREAMVBYTE], reset);
+    rcv_stats->codecs.values_xor4 = read_counter(counters.values_codecs[AKU_VALUES_XOR4], reset);
+    rcv_stats->codecs.values_gorilla = read_counter(counters.values_codecs[AKU_VALUES_GORILLA], reset);
+}
+
+size_t CompressionUtil::max_bulk_size(size_t n_elements) {
+    return sizeof(BulkFrameHeader) + max_encoded_size(n_elements);
+}
+
+aku_Status CompressionUtil::encode_bulk(const aku_Sample* samples, size_t n, MemBuffer* out) {
+    if (n == 0 || n > std::numeric_limits<uint32_t>::max()) {
+        return AKU_EBAD_ARG;
+    }
+    std::vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = static_cast<uint32_t>(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [samples](uint32_t lhs, uint32_t rhs) {
+        return samples[lhs].timestamp < samples[rhs].timestamp;
+    });
+    ChunkHeader chunk;
+    chunk.timestamps.reserve(n);
+    chunk.paramids.reserve(n);
+    chunk.lengths.reserve(n);
+    chunk.offsets.resize(n, 0u);
+    for (auto ix: order) {
+        auto const& sample = samples[ix];
+        chunk.timestamps.push_back(sample.timestamp);
+        chunk.paramids.push_back(sample.paramid);
+        if (sample.is_int) {
+            chunk.lengths.push_back(AKU_LENGTH_INT64);
+            chunk.integers.push_back(sample.ivalue);
+        } else {
+            chunk.lengths.push_back(0u);
+            chunk.values.push_back(sample.value);
         }
-        size_estimate -= length_stream.size();
-        // Param-Ids
-        status = writer->add_chunk(paramid_stream.get_memrange(), size_estimate);
-        if (status != AKU_SUCCESS) {
-            break;
+    }
+    BulkFrameHeader header = {};
+    header.magic = AKU_BULK_MAGIC;
+    header.encoding = select_encoding(chunk, AKU_CODEC_SMALLEST, AKU_CHUNK_BASE128);
+    const size_t base = out->size();
+    out->resize(base + sizeof(header));
+    uint32_t n_elements;
+    aku_TimeStamp ts_begin, ts_end;
+    size_t column_sizes[NCOLUMNS];
+    auto status = encode_columns(&n_elements, &ts_begin, &ts_end, out, chunk, header.encoding, column_sizes);
+    if (status == AKU_SUCCESS && out->overflow()) {
+        status = AKU_EOVERFLOW;
+    }
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    header.count = n_elements;
+    header.size = static_cast<uint32_t>(out->size() - base - sizeof(header));
+    memcpy(out->data() + base, &header, sizeof(header));
+    return AKU_SUCCESS;
+}
+
+aku_Status CompressionUtil::decode_bulk(const unsigned char* begin, size_t size, aku_Sample* dest, size_t* n) {
+    BulkFrameHeader header;
+    if (size < sizeof(header)) {
+        return AKU_EBAD_DATA;
+    }
+    memcpy(&header, begin, sizeof(header));
+    if (header.magic != AKU_BULK_MAGIC || header.count == 0 || header.size != size - sizeof(header)) {
+        return AKU_EBAD_DATA;
+    }
+    if (header.count > *n) {
+        *n = header.count;
+        return AKU_EOVERFLOW;
+    }
+    ChunkHeader chunk;
+    const unsigned char* pbegin = begin + sizeof(header);
+    const unsigned char* pend = begin + size;
+    try {
+        if (decode_chunk(&chunk, &pbegin, pend, 0, 6, header.count, header.encoding) != 6) {
+            return AKU_EBAD_DATA;
         }
-        auto paramid_stream_size = paramid_stream.size();
-        size_estimate -= paramid_stream_size;
-        // Timestamps
-        status = writer->add_chunk(timestamp_stream.get_memrange(), size_estimate);
-        if (status != AKU_SUCCESS) {
-            break;
+    } catch (std::exception const&) {
+        // Damaged columns can make decoder go out of range
+        return AKU_EBAD_DATA;
+    }
+    if (chunk.timestamps.size() != header.count || chunk.paramids.size() != header.count ||
+        chunk.lengths.size() != header.count)
+    {
+        return AKU_EBAD_DATA;
+    }
+    size_t ix_value = 0, ix_int = 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+        auto& sample = dest[i];
+        sample.paramid = chunk.paramids[i];
+        sample.timestamp = chunk.timestamps[i];
+        if (chunk.lengths[i] == 0u && ix_value < chunk.values.size()) {
+            sample.value = chunk.values[ix_value++];
+            sample.ivalue = 0;
+            sample.is_int = 0;
+        } else if (chunk.lengths[i] == AKU_LENGTH_INT64 && ix_int < chunk.integers.size()) {
+            sample.value = 0.0;
+            sample.ivalue = chunk.integers[ix_int++];
+            sample.is_int = 1;
+        } else {
+            // Frames can't contain blobs
+            return AKU_EBAD_DATA;
         }
-        *n_elements = static_cast<uint32_t>(data.lengths.size());
-        *ts_begin = data.timestamps.front();
-        *ts_end   = data.timestamps.back();
     }
-    return status;
+    *n = header.count;
+    return AKU_SUCCESS;
 }
 
 int CompressionUtil::decode_chunk( ChunkHeader *header
@@ -224,30 +835,68 @@ int CompressionUtil::decode_chunk( ChunkHeader *header
                                  , const unsigned char *pend
                                  , int stage
                                  , int steps
-                                 , uint32_t probe_length)
+                                 , uint32_t probe_length
+                                 , uint32_t encoding)
 {
     if (steps <= 0) {
         return 0;
     }
+    const auto ts_codec = codec_of(encoding, AKU_CHUNK_TS_SHIFT);
+    const auto ids_codec = codec_of(encoding, AKU_CHUNK_IDS_SHIFT);
+    const auto values_codec = codec_of(encoding, AKU_CHUNK_VALUES_SHIFT);
+    if (ts_codec >= AKU_TS_NCODECS || ids_codec >= AKU_IDS_NCODECS || values_codec >= AKU_VALUES_NCODECS) {
+        return -1;
+    }
     switch(stage) {
     case 0: {
         // read timestamps
-        DeltaRLETSReader tst_reader(*pbegin, pend);
-        for (auto i = 0u; i < probe_length; i++) {
-            header->timestamps.push_back(tst_reader.next());
+        if (ts_codec == AKU_TS_DELTA_DELTA) {
+            auto base = header->timestamps.size();
+            header->timestamps.resize(base + probe_length);
+            *pbegin = DeltaDeltaCodec::decode(*pbegin, pend, probe_length, header->timestamps.data() + base);
+            if (*pbegin == nullptr) {
+                return -1;
+            }
+        } else if (ts_codec == AKU_TS_STREAMVBYTE) {
+            auto base = header->timestamps.size();
+            header->timestamps.resize(base + probe_length);
+            auto out = header->timestamps.data() + base;
+            *pbegin = StreamVByte::decode(*pbegin, pend, probe_length, out);
+            if (*pbegin == nullptr) {
+                return -1;
+            }
+            aku_TimeStamp prev = 0u;
+            for (auto i = 0u; i < probe_length; i++) {
+                prev += out[i];
+                out[i] = prev;
+            }
+        } else {
+            DeltaRLETSReader tst_reader(*pbegin, pend);
+            for (auto i = 0u; i < probe_length; i++) {
+                header->timestamps.push_back(tst_reader.next());
+            }
+            *pbegin = tst_reader.pos();
         }
-        *pbegin = tst_reader.pos();
         if (--steps == 0) {
             return 1;
         }
     }
     case 1: {
         // read paramids
-        Base128IdReader pid_reader(*pbegin, pend);
-        for (auto i = 0u; i < probe_length; i++) {
-            header->paramids.push_back(pid_reader.next());
+        if (ids_codec == AKU_IDS_STREAMVBYTE) {
+            auto base = header->paramids.size();
+            header->paramids.resize(base + probe_length);
+            *pbegin = StreamVByte::decode(*pbegin, pend, probe_length, header->paramids.data() + base);
+            if (*pbegin == nullptr) {
+                return -1;
+            }
+        } else {
+            Base128IdReader pid_reader(*pbegin, pend);
+            for (auto i = 0u; i < probe_length; i++) {
+                header->paramids.push_back(pid_reader.next());
+            }
+            *pbegin = pid_reader.pos();
         }
-        *pbegin = pid_reader.pos();
         if (--steps == 0) {
             return 2;
         }
@@ -276,7 +925,11 @@ int CompressionUtil::decode_chunk( ChunkHeader *header
     }
     case 4: {
         // read doubles
-        uint64_t nblocks = *reinterpret_cast<const uint64_t*>(*pbegin);
+        uint64_t nblocks;
+        if (static_cast<size_t>(pend - *pbegin) < sizeof(nblocks)) {
+            return -1;
+        }
+        memcpy(&nblocks, *pbegin, sizeof(nblocks));
         *pbegin += sizeof(uint64_t);
         if (nblocks) {
             std::vector<aku_ParamId> params;
@@ -286,18 +939,576 @@ int CompressionUtil::decode_chunk( ChunkHeader *header
                     params.push_back(pid);
                 }
             }
-            ByteVector buffer(*pbegin, *pbegin + (nblocks/2 + 1));
-            CompressionUtil::decompress_doubles(buffer, nblocks, params, &header->values);
-            *pbegin += static_cast<uint32_t>(buffer.size());
+            if (values_codec == AKU_VALUES_GORILLA) {
+                auto nbytes = (nblocks + 7)/8;
+                if (nbytes > static_cast<size_t>(pend - *pbegin) ||
+                    !CompressionUtil::decompress_doubles_gorilla(*pbegin, nblocks, params, &header->values))
+                {
+                    return -1;
+                }
+                *pbegin += nbytes;
+            } else {
+                // Integers can follow the doubles, half-filled last byte should be taken into account
+                auto nbytes = (nblocks + 1)/2;
+                if (nbytes > static_cast<size_t>(pend - *pbegin)) {
+                    return -1;
+                }
+                ByteVector buffer(*pbegin, *pbegin + nbytes);
+                CompressionUtil::decompress_doubles(buffer, nblocks, params, &header->values);
+                *pbegin += nbytes;
+            }
         }
         if (--steps == 0) {
             return 5;
         }
     }
+    case 5: {
+        // read integers
+        std::vector<aku_ParamId> params;
+        for (size_t i = 0; i != header->paramids.size(); i++) {
+            if (header->lengths.at(i) == AKU_LENGTH_INT64) {
+                params.push_back(header->paramids.at(i));
+            }
+        }
+        if (!params.empty()) {
+            *pbegin = CompressionUtil::decompress_integers(*pbegin, pend, params, &header->integers);
+            if (*pbegin == nullptr) {
+                return -1;
+            }
+        }
+        if (--steps == 0) {
+            return 6;
+        }
+    }
     default:
         break;
     }
     return -1;
 }
 
+
+// Stream VByte
+
+namespace {
+
+//! Length codes of the two values (control nibble) -> shuffle mask and number of data bytes
+struct StreamVByteTables {
+    alignas(16) unsigned char shuffle[16][16];
+    unsigned char length[16];
+
+    StreamVByteTables() {
+        for (int nibble = 0; nibble < 16; nibble++) {
+            int len0 = 1 << (nibble & 3);
+            int len1 = 1 << (nibble >> 2);
+            for (int j = 0; j < 8; j++) {
+                shuffle[nibble][j] = j < len0 ? j : 0x80;
+                shuffle[nibble][8 + j] = j < len1 ? len0 + j : 0x80;
+            }
+            length[nibble] = static_cast<unsigned char>(len0 + len1);
+        }
+    }
+};
+
+const StreamVByteTables svb_tables;
+
+//! Decode values [first, n) one by one, returns nullptr if data is truncated
+const unsigned char* svb_decode_tail(const unsigned char* control,
+                                     const unsigned char* data,
+                                     const unsigned char* end,
+                                     size_t first,
+                                     size_t n,
+                                     uint64_t* out)
+{
+    for (size_t i = first; i < n; i++) {
+        auto len = 1u << ((control[i/4] >> (2*(i%4))) & 3);
+        if (static_cast<size_t>(end - data) < len) {
+            return nullptr;
+        }
+        uint64_t value = 0u;
+        memcpy(&value, data, len);  // little endian
+        out[i] = value;
+        data += len;
+    }
+    return data;
+}
+
+#ifdef AKU_STREAMVBYTE_SSSE3
+__attribute__((target("ssse3")))
+const unsigned char* svb_decode_ssse3(const unsigned char* begin, const unsigned char* end,
+                                      size_t n, uint64_t* out)
+{
+    size_t ncontrol = (n + 3)/4;
+    if (static_cast<size_t>(end - begin) < ncontrol) {
+        return nullptr;
+    }
+    auto control = begin;
+    auto data = begin + ncontrol;
+    size_t i = 0;
+    // Two values are decoded per step, every step reads 16 bytes of data,
+    // values near the end of the buffer are decoded by scalar code
+    while (i + 2 <= n && end - data >= 16) {
+        unsigned nibble = (control[i/4] >> (4*((i/2)%2))) & 0xF;
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i*>(svb_tables.shuffle[nibble]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_shuffle_epi8(in, mask));
+        data += svb_tables.length[nibble];
+        i += 2;
+    }
+    return svb_decode_tail(control, data, end, i, n, out);
+}
+#endif
+
+typedef const unsigned char* (*SVBDecodeFn)(const unsigned char*, const unsigned char*, size_t, uint64_t*);
+
+SVBDecodeFn select_svb_decoder() {
+#ifdef AKU_STREAMVBYTE_SSSE3
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        return &svb_decode_ssse3;
+    }
+#endif
+    return &StreamVByte::decode_scalar;
+}
+
+}  // namespace
+
+template<class Buffer>
+void StreamVByte::encode(const uint64_t* values, size_t n, Buffer* out) {
+    auto control = out->size();
+    out->resize(control + (n + 3)/4, 0u);
+    if (out->size() != control + (n + 3)/4) {
+        return;  // output buffer is full
+    }
+    for (size_t i = 0; i < n; i++) {
+        auto value = values[i];
+        int code = value < 0x100ul ? 0 : value < 0x10000ul ? 1 : value < 0x100000000ul ? 2 : 3;
+        (*out)[control + i/4] |= static_cast<unsigned char>(code << (2*(i%4)));
+        unsigned char bytes[sizeof(uint64_t)];
+        memcpy(bytes, &value, sizeof(value));  // little endian
+        out->insert(out->end(), bytes, bytes + (1 << code));
+    }
+}
+
+template void StreamVByte::encode(const uint64_t*, size_t, ByteVector*);
+template void StreamVByte::encode(const uint64_t*, size_t, MemBuffer*);
+
+const unsigned char* StreamVByte::decode_scalar(const unsigned char* begin, const unsigned char* end,
+                                                size_t n, uint64_t* out)
+{
+    size_t ncontrol = (n + 3)/4;
+    if (static_cast<size_t>(end - begin) < ncontrol) {
+        return nullptr;
+    }
+    return svb_decode_tail(begin, begin + ncontrol, end, 0u, n, out);
+}
+
+const unsigned char* StreamVByte::decode(const unsigned char* begin, const unsigned char* end,
+                                         size_t n, uint64_t* out)
+{
+    static const SVBDecodeFn decode_fn = select_svb_decoder();
+    return decode_fn(begin, end, n, out);
+}
+
+
+// Delta-of-delta codec
+
+namespace {
+
+//! Number of bits needed to store the value
+int bit_width(uint64_t value) {
+    return value == 0 ? 0 : 64 - __builtin_clzl(value);
+}
+
+//! Append `n` values of `width` bits to `out` (little endian bit order)
+template<class Buffer>
+void pack_bits(const uint64_t* values, size_t n, int width, Buffer* out) {
+    size_t begin = out->size();
+    out->resize(begin + (n*width + 7)/8, 0u);
+    if (out->size() != begin + (n*width + 7)/8) {
+        return;  // output buffer is full
+    }
+    auto data = out->data() + begin;
+    for (size_t i = 0; i < n; i++) {
+        size_t bit = i*width;
+        for (int k = 0; k < width;) {
+            int shift = static_cast<int>((bit + k) % 8);
+            int nbits = std::min(8 - shift, width - k);
+            data[(bit + k)/8] |= static_cast<unsigned char>(((values[i] >> k) & ((1u << nbits) - 1)) << shift);
+            k += nbits;
+        }
+    }
+}
+
+/** Unpack `n` values of `width` bits.
+  * Buffer should have at least 8 readable bytes after the packed data.
+  * Loop doesn't have data dependent branches, compiler can vectorize it.
+  */
+void unpack_bits(const unsigned char* data, size_t n, int width, uint64_t* out) {
+    if (width == 0) {
+        std::fill(out, out + n, 0ul);
+        return;
+    }
+    const uint64_t mask = width == 64 ? ~0ul : (1ul << width) - 1;
+    if (width <= 56) {
+        // Every value fits in 8 bytes starting from its first byte
+        for (size_t i = 0; i < n; i++) {
+            size_t bit = i*width;
+            uint64_t word;
+            memcpy(&word, data + bit/8, sizeof(word));
+            out[i] = (word >> (bit % 8)) & mask;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            size_t bit = i*width;
+            uint64_t word;
+            memcpy(&word, data + bit/8, sizeof(word));
+            auto shift = bit % 8;
+            uint64_t value = word >> shift;
+            if (shift) {
+                value |= static_cast<uint64_t>(data[bit/8 + 8]) << (64 - shift);
+            }
+            out[i] = value & mask;
+        }
+    }
+}
+
+}  // namespace
+
+template<class Buffer>
+void DeltaDeltaCodec::encode(const aku_TimeStamp* values, size_t n, Buffer* out) {
+    if (n == 0) {
+        return;
+    }
+    auto it = std::back_inserter(*out);
+    Base128Int<uint64_t>(values[0]).put(it);
+    if (n == 1) {
+        return;
+    }
+    uint64_t prev_delta = values[1] - values[0];
+    Base128Int<uint64_t>(prev_delta).put(it);
+    uint64_t block[BLOCK_SIZE];
+    for (size_t first = 2; first < n; first += BLOCK_SIZE) {
+        size_t size = std::min(n - first, static_cast<size_t>(BLOCK_SIZE));
+        uint64_t min = ~0ul;
+        uint64_t max = 0ul;
+        for (size_t i = 0; i < size; i++) {
+            uint64_t delta = values[first + i] - values[first + i - 1];
+            int64_t dod = static_cast<int64_t>(delta - prev_delta);
+            prev_delta = delta;
+            block[i] = (static_cast<uint64_t>(dod) << 1) ^ static_cast<uint64_t>(dod >> 63);  // ZigZag
+            min = std::min(min, block[i]);
+            max = std::max(max, block[i]);
+        }
+        int width = bit_width(max - min);
+        for (size_t i = 0; i < size; i++) {
+            block[i] -= min;
+        }
+        Base128Int<uint64_t>(min).put(it);
+        out->push_back(static_cast<unsigned char>(width));
+        pack_bits(block, size, width, out);
+    }
+}
+
+template void DeltaDeltaCodec::encode(const aku_TimeStamp*, size_t, ByteVector*);
+template void DeltaDeltaCodec::encode(const aku_TimeStamp*, size_t, MemBuffer*);
+
+const unsigned char* DeltaDeltaCodec::decode(const unsigned char* begin, const unsigned char* end,
+                                             size_t n, aku_TimeStamp* out)
+{
+    if (n == 0) {
+        return begin;
+    }
+    Base128Int<uint64_t> value;
+    if (begin >= end) {
+        return nullptr;
+    }
+    begin = value.get(begin, end);
+    aku_TimeStamp ts = value;
+    out[0] = ts;
+    if (n == 1) {
+        return begin;
+    }
+    if (begin >= end) {
+        return nullptr;
+    }
+    begin = value.get(begin, end);
+    uint64_t delta = value;
+    ts += delta;
+    out[1] = ts;
+    // Packed data is copied to padded buffer, this way unpack_bits doesn't need bounds checks
+    unsigned char packed[BLOCK_SIZE*sizeof(uint64_t) + sizeof(uint64_t)];
+    uint64_t block[BLOCK_SIZE];
+    for (size_t first = 2; first < n; first += BLOCK_SIZE) {
+        size_t size = std::min(n - first, static_cast<size_t>(BLOCK_SIZE));
+        if (begin >= end) {
+            return nullptr;
+        }
+        begin = value.get(begin, end);
+        uint64_t min = value;
+        if (begin >= end) {
+            return nullptr;
+        }
+        int width = *begin++;
+        size_t nbytes = (size*width + 7)/8;
+        if (width > 64 || nbytes > static_cast<size_t>(end - begin)) {
+            return nullptr;
+        }
+        memcpy(packed, begin, nbytes);
+        memset(packed + nbytes, 0, sizeof(uint64_t));
+        begin += nbytes;
+        unpack_bits(packed, size, width, block);
+        for (size_t i = 0; i < size; i++) {
+            uint64_t zz = block[i] + min;
+            uint64_t dod = (zz >> 1) ^ (~(zz & 1) + 1);  // ZigZag
+            delta += dod;
+            ts += delta;
+            out[first + i] = ts;
+        }
+    }
+    return begin;
+}
+
+
+// Param id filter
+
+static uint64_t filter_hash(aku_ParamId id) {
+    uint64_t x = id;
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDul;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ul;
+    x ^= x >> 33;
+    return x;
+}
+
+void ParamIdFilter::build(std::vector<aku_ParamId> const& ids, ByteVector* out) {
+    out->clear();
+    if (ids.size() < 2) {
+        return;
+    }
+    std::vector<aku_ParamId> distinct;
+    auto minmax = std::minmax_element(ids.begin(), ids.end());
+    auto min_id = *minmax.first;
+    uint64_t range = *minmax.second - min_id + 1;
+    if (range <= ids.size()*8) {
+        // Dense ids, distinct values can be found without sorting
+        std::vector<uint64_t> bitmap((range + 63) / 64, 0ul);
+        for (auto id: ids) {
+            bitmap[(id - min_id) / 64] |= 1ul << ((id - min_id) % 64);
+        }
+        for (size_t i = 0; i < bitmap.size(); i++) {
+            for (auto word = bitmap[i]; word != 0; word &= word - 1) {
+                distinct.push_back(min_id + i*64 + __builtin_ctzll(word));
+            }
+        }
+        if (distinct.size() == range) {
+            // All ids from the range are present, chunk summary is enough
+            return;
+        }
+    } else {
+        distinct = ids;
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    }
+    if (distinct.size() < 2) {
+        // Chunk summary is enough
+        return;
+    }
+    // Size is a multiple of 8 bytes
+    size_t size = (distinct.size()*BITS_PER_ID + 63) / 64 * 8;
+    size = std::min(size, static_cast<size_t>(MAX_SIZE));
+    uint64_t nbits = size*8;
+    out->resize(size, 0u);
+    for (auto id: distinct) {
+        auto hash = filter_hash(id);
+        uint64_t h1 = hash & 0xFFFFFFFF, h2 = (hash >> 32) | 1;
+        for (int i = 0; i < NUM_HASHES; i++) {
+            auto bit = (h1 + i*h2) % nbits;
+            out->at(bit / 8) |= static_cast<unsigned char>(1 << (bit % 8));
+        }
+    }
+}
+
+bool ParamIdFilter::may_contain(const unsigned char* filter, size_t size, aku_ParamId id) {
+    uint64_t nbits = size*8;
+    auto hash = filter_hash(id);
+    uint64_t h1 = hash & 0xFFFFFFFF, h2 = (hash >> 32) | 1;
+    for (int i = 0; i < NUM_HASHES; i++) {
+        auto bit = (h1 + i*h2) % nbits;
+        if ((filter[bit / 8] & (1 << (bit % 8))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Encoded chunk
+
+EncodedChunk::EncodedChunk()
+    : n_elements(0u)
+    , ts_begin(0u)
+    , ts_end(0u)
+    , status(AKU_ENO_DATA)
+    , encoding(AKU_CHUNK_BASE128)
+    , in_place{nullptr, 0u}
+{
+}
+
+aku_Status EncodedChunk::add_chunk(aku_MemRange range, size_t size_estimate) {
+    auto begin = static_cast<const unsigned char*>(range.address);
+    parts.push_back({ByteVector(begin, begin + range.length), size_estimate});
+    return AKU_SUCCESS;
+}
+
+aku_Status EncodedChunk::encode(ChunkHeader const& data, uint32_t enc) {
+    parts.clear();
+    in_place = {nullptr, 0u};
+    encoding = enc;
+    status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, this, data, encoding);
+    if (status == AKU_SUCCESS) {
+        ParamIdFilter::build(data.paramids, &filter);
+    }
+    return status;
+}
+
+aku_Status EncodedChunk::encode(ChunkHeader const& data, uint32_t enc, aku_MemRange target) {
+    parts.clear();
+    in_place = {nullptr, 0u};
+    encoding = enc;
+    // Chunk is written near the end of the region and moved to the end, this
+    // way compressed data and its final location shares the same memory pages
+    auto end = static_cast<unsigned char*>(target.address) + target.length;
+    size_t capacity = std::min(static_cast<size_t>(target.length),
+                               CompressionUtil::max_encoded_size(data.timestamps.size()));
+    MemBuffer buffer(end - capacity, capacity);
+    status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &buffer, data, encoding);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    auto begin = end - buffer.size();
+    memmove(begin, buffer.data(), buffer.size());
+    in_place = {begin, static_cast<uint32_t>(buffer.size())};
+    ParamIdFilter::build(data.paramids, &filter);
+    return status;
+}
+
+aku_Status EncodedChunk::write_to(ChunkWriter *writer) const {
+    if (in_place.length) {
+        auto status = writer->add_chunk(in_place, 0u);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+    }
+    for (auto const& part: parts) {
+        aku_MemRange range = {
+            const_cast<unsigned char*>(part.data.data()),
+            static_cast<uint32_t>(part.data.size())
+        };
+        auto status = writer->add_chunk(range, part.size_estimate);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+    }
+    return status;
+}
+
+// Chunk cache
+
+size_t ChunkCache::KeyHash::operator () (Key const& key) const {
+    uint64_t hash = (static_cast<uint64_t>(key.page_id) << 32) ^ key.open_count;
+    hash = hash*0x9E3779B97F4A7C15ul ^ key.offset;
+    return static_cast<size_t>(hash*0x9E3779B97F4A7C15ul >> 16);
+}
+
+bool ChunkCache::KeyEqual::operator () (Key const& lhs, Key const& rhs) const {
+    return lhs.page_id == rhs.page_id && lhs.open_count == rhs.open_count && lhs.offset == rhs.offset;
+}
+
+ChunkCache::ChunkCache(size_t capacity)
+    : capacity_(capacity)
+    , size_(0u)
+    , n_hits_{0}
+    , n_misses_{0}
+{
+}
+
+ChunkCache::PChunk ChunkCache::get(Key const& key, uint32_t checksum) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end() || it->second->checksum != checksum) {
+        n_misses_++;
+        return PChunk();
+    }
+    // move to front
+    items_.splice(items_.begin(), items_, it->second);
+    n_hits_++;
+    return it->second->chunk;
+}
+
+void ChunkCache::put(Key const& key, uint32_t checksum, PChunk chunk) {
+    auto size = estimate_size(*chunk);
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (size > capacity_) {
+        return;
+    }
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        size_ -= it->second->size;
+        items_.erase(it->second);
+        index_.erase(it);
+    }
+    evict_(capacity_ - size);
+    Item item = { key, checksum, size, chunk };
+    items_.push_front(item);
+    index_[key] = items_.begin();
+    size_ += size;
+}
+
+void ChunkCache::evict_(size_t size) {
+    while (size_ > size && !items_.empty()) {
+        auto const& item = items_.back();
+        size_ -= item.size;
+        index_.erase(item.key);
+        items_.pop_back();
+    }
+}
+
+void ChunkCache::set_capacity(size_t capacity) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    capacity_ = capacity;
+    evict_(capacity_);
+}
+
+void ChunkCache::get_stats(uint64_t* n_hits, uint64_t* n_misses, bool reset) {
+    if (reset) {
+        *n_hits = n_hits_.exchange(0);
+        *n_misses = n_misses_.exchange(0);
+    } else {
+        *n_hits = n_hits_.load();
+        *n_misses = n_misses_.load();
+    }
+}
+
+void ChunkCache::get_usage(uint64_t* size, uint64_t* capacity, uint64_t* nitems) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    *size = size_;
+    *capacity = capacity_;
+    *nitems = items_.size();
+}
+
+size_t ChunkCache::estimate_size(ChunkHeader const& header) {
+    return sizeof(Item) + sizeof(ChunkHeader)
+         + header.timestamps.size()*sizeof(aku_TimeStamp)
+         + header.paramids.size()*sizeof(aku_ParamId)
+         + header.offsets.size()*sizeof(uint32_t)
+         + header.lengths.size()*sizeof(uint32_t)
+         + header.values.size()*sizeof(double)
+         + header.integers.size()*sizeof(int64_t);
+}
+
+ChunkCache& get_global_chunk_cache() {
+    static ChunkCache cache(AKU_DEFAULT_CHUNK_CACHE_SIZE);
+    return cache;
+}
+
 }
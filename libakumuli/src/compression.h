@@ -25,8 +25,14 @@
 #include <cassert>
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 #include <iterator>
 #include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
 
 #include "akumuli.h"
 
@@ -40,6 +46,130 @@ struct ChunkHeader {
     std::vector<uint32_t>       offsets;
     std::vector<uint32_t>       lengths;
     std::vector<double>         values;
+    std::vector<int64_t>        integers;  //< Values of the elements with AKU_LENGTH_INT64 length
+};
+
+/** Codec tags of the chunk columns.
+  * Encoding of the chunk (see ChunkDesc::encoding) contains codec tag of every
+  * column: timestamps | param ids << AKU_CHUNK_IDS_SHIFT | values << AKU_CHUNK_VALUES_SHIFT.
+  * Zero encoding means default codecs of all columns.
+  */
+enum ChunkEncoding {
+    AKU_CHUNK_BASE128      = 0,      //< Default codecs of all columns
+    AKU_CHUNK_TS_SHIFT     = 0,
+    AKU_CHUNK_IDS_SHIFT    = 4,
+    AKU_CHUNK_VALUES_SHIFT = 8,
+    AKU_CHUNK_CODEC_MASK   = 0xF,
+
+    // Timestamp codecs
+    AKU_TS_DELTA_RLE       = 0,      //< Delta -> RLE -> Base128
+    AKU_TS_STREAMVBYTE     = 1,      //< Delta -> StreamVByte
+    AKU_TS_DELTA_DELTA     = 2,      //< Delta-of-delta -> ZigZag -> frame of reference bit packing
+    AKU_TS_NCODECS         = 3,
+
+    // Param id codecs
+    AKU_IDS_BASE128        = 0,      //< Base128
+    AKU_IDS_STREAMVBYTE    = 1,      //< StreamVByte
+    AKU_IDS_NCODECS        = 2,
+
+    // Value codecs
+    AKU_VALUES_XOR4        = 0,      //< XOR with the previous value of the series -> 4-bit blocks
+    AKU_VALUES_GORILLA     = 1,      //< Grouped by series -> XOR -> leading/trailing zeros bit packing
+    AKU_VALUES_NCODECS     = 2,
+
+    // Presets
+    AKU_CHUNK_STREAMVBYTE  = AKU_TS_STREAMVBYTE | AKU_IDS_STREAMVBYTE << AKU_CHUNK_IDS_SHIFT,
+    AKU_CHUNK_DELTA_DELTA  = AKU_TS_DELTA_DELTA << AKU_CHUNK_TS_SHIFT,
+    AKU_CHUNK_GORILLA      = AKU_VALUES_GORILLA << AKU_CHUNK_VALUES_SHIFT,
+};
+
+//! Codec selection policy
+enum CodecPolicy {
+    AKU_CODEC_FIXED    = 0,  //< Use configured encoding
+    AKU_CODEC_SMALLEST = 1,  //< Codec that produces smallest output on a sample of the chunk
+    AKU_CODEC_FASTEST  = 2,  //< Fastest decoding codec that isn't much larger than the smallest one
+};
+
+/** Output buffer over fixed memory region (e.g. free space of the page).
+  * Implements the part of the ByteVector interface used by encoders, so
+  * they can write directly to the target memory. Data that doesn't fit
+  * is dropped and `overflow` flag is set.
+  */
+struct MemBuffer {
+    typedef unsigned char value_type;
+
+    unsigned char *begin_;
+    size_t         size_;
+    size_t         capacity_;
+    bool           overflow_;
+
+    MemBuffer(unsigned char* begin, size_t capacity)
+        : begin_(begin)
+        , size_(0u)
+        , capacity_(capacity)
+        , overflow_(false)
+    {
+    }
+
+    void push_back(unsigned char value) {
+        if (size_ < capacity_) {
+            begin_[size_++] = value;
+        } else {
+            overflow_ = true;
+        }
+    }
+
+    //! Append [first, last) to the buffer, `pos` must be equal to end()
+    void insert(unsigned char* pos, const unsigned char* first, const unsigned char* last) {
+        assert(pos == end());
+        size_t n = static_cast<size_t>(last - first);
+        if (n > capacity_ - size_) {
+            overflow_ = true;
+            return;
+        }
+        memcpy(pos, first, n);
+        size_ += n;
+    }
+
+    //! Resize buffer, new size is truncated to capacity on overflow
+    void resize(size_t n, unsigned char value = 0u) {
+        if (n > capacity_) {
+            overflow_ = true;
+            n = capacity_;
+        }
+        if (n > size_) {
+            memset(begin_ + size_, value, n - size_);
+        }
+        size_ = n;
+    }
+
+    unsigned char& operator [] (size_t ix) {
+        return begin_[ix];
+    }
+
+    unsigned char* data() const {
+        return begin_;
+    }
+
+    unsigned char* end() const {
+        return begin_ + size_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool overflow() const {
+        return overflow_;
+    }
+};
+
+//! Header of the bulk frame (see aku_encode_bulk), compressed chunk follows the header
+struct BulkFrameHeader {
+    uint32_t magic;         //< AKU_BULK_MAGIC
+    uint32_t count;         //< Number of elements
+    uint32_t encoding;      //< Codec tags of the chunk columns (see ChunkEncoding)
+    uint32_t size;          //< Size of the compressed chunk
 };
 
 struct ChunkWriter {
@@ -48,12 +178,41 @@ struct ChunkWriter {
 };
 
 struct CompressionUtil {
+    enum {
+        CODEC_SAMPLE_SIZE = 0x400,    //< Number of elements used to select codecs
+        FASTEST_MAX_OVERHEAD = 2,     //< Fastest codec output can be this times larger than the smallest
+    };
+
+    //! Upper bound of the compressed size of `n_elements` elements (any encoding)
+    static
+    size_t max_encoded_size(size_t n_elements);
+
+    /** Compress ChunkHeader directly to memory region.
+      * @brief Chunk has the same format as chunk written through ChunkWriter, columns
+      * goes one after another starting from the beginning of the buffer.
+      * @param n_elements out parameter - number of written elements
+      * @param ts_begin out parameter - first timestamp
+      * @param ts_end out parameter - last timestamp
+      * @param out output buffer
+      * @param data ChunkHeader to compress
+      * @param encoding codec tags of the chunk columns (see ChunkEncoding)
+      * @return AKU_EOVERFLOW if compressed chunk doesn't fit the buffer
+      */
+    static
+    aku_Status encode_chunk(uint32_t           *n_elements
+                           , aku_TimeStamp      *ts_begin
+                           , aku_TimeStamp      *ts_end
+                           , MemBuffer          *out
+                           , const ChunkHeader &data
+                           , uint32_t           encoding = AKU_CHUNK_BASE128
+                           );
 
     /** Compress and write ChunkHeader to memory stream.
       * @param n_elements out parameter - number of written elements
       * @param ts_begin out parameter - first timestamp
       * @param ts_end out parameter - last timestamp
       * @param data ChunkHeader to compress
+      * @param encoding codec tags of the chunk columns (see ChunkEncoding)
       */
     static
     aku_Status encode_chunk(uint32_t           *n_elements
@@ -61,17 +220,35 @@ struct CompressionUtil {
                            , aku_TimeStamp      *ts_end
                            , ChunkWriter        *writer
                            , const ChunkHeader &data
+                           , uint32_t           encoding = AKU_CHUNK_BASE128
                            );
 
+    /** Select encoding of the chunk.
+      * @brief Every column of the sample (first CODEC_SAMPLE_SIZE elements) is
+      * encoded by all codecs, codec of the column is chosen by policy.
+      * @param data ChunkHeader to compress
+      * @param policy codec selection policy (see CodecPolicy)
+      * @param fixed encoding used by AKU_CODEC_FIXED policy
+      * @return encoding of the chunk (see ChunkEncoding)
+      */
+    static
+    uint32_t select_encoding(const ChunkHeader& data, uint32_t policy, uint32_t fixed);
+
+    //! Get cumulative compression stats of all encoded chunks
+    static
+    void get_stats(aku_CompressionStats* rcv_stats, bool reset);
+
     /** Decompress ChunkHeader.
       * @brief Decode part of the ChunkHeader structure depending on stage and steps values.
-      * First goes list of timestamps, then all other values.
+      * First goes list of timestamps, then all other values. Integer values
+      * are decoded by the last (sixth) stage.
       * @param header out header
       * @param pbegin in - begining of the data, out - new begining of the data
       * @param end end of the data
       * @param stage current stage
       * @param steps number of stages to do
       * @param probe_length number of elements in header
+      * @param encoding codec tags of the chunk columns (stored in chunk descriptor)
       * @return current stage number
       */
     static
@@ -80,17 +257,46 @@ struct CompressionUtil {
                     , const unsigned char  *pend
                     , int                   stage
                     , int                   steps
-                    , uint32_t              probe_length);
+                    , uint32_t              probe_length
+                    , uint32_t              encoding = AKU_CHUNK_BASE128);
+
+    //! Upper bound of the bulk frame size
+    static
+    size_t max_bulk_size(size_t n_elements);
+
+    /** Encode bulk frame.
+      * @brief Samples are sorted by timestamp (stable), codecs of the chunk are
+      * selected by AKU_CODEC_SMALLEST policy. Compression stats aren't updated.
+      * @param samples array of samples
+      * @param n number of samples
+      * @param out output buffer
+      * @return AKU_EOVERFLOW if frame doesn't fit the buffer
+      */
+    static
+    aku_Status encode_bulk(const aku_Sample* samples, size_t n, MemBuffer* out);
+
+    /** Decode bulk frame.
+      * @brief Frame is received from the network and can be damaged, every
+      * column is validated before samples are written to `dest`.
+      * @param begin beginning of the frame
+      * @param size size of the frame
+      * @param dest output array
+      * @param n in - size of the output array, out - number of samples in the frame
+      * @return AKU_EOVERFLOW if output array is too small, AKU_EBAD_DATA if frame is damaged
+      */
+    static
+    aku_Status decode_bulk(const unsigned char* begin, size_t size, aku_Sample* dest, size_t* n);
 
     /** Compress list of doubles.
       * @param input array of doubles
       * @param params array of parameter ids
-      * @param buffer resulting byte array
+      * @param buffer resulting byte array (ByteVector or MemBuffer)
       */
+    template<class Buffer>
     static
     size_t compress_doubles(std::vector<double> const& input,
                             std::vector<aku_ParamId> const& params,
-                            ByteVector *buffer);  // TODO: maybe I should use plain old buffer here
+                            Buffer *buffer);
 
     /** Decompress list of doubles.
       * @param buffer input data
@@ -103,8 +309,250 @@ struct CompressionUtil {
                             size_t numblocks,
                             std::vector<aku_ParamId> const& params,
                             std::vector<double> *output);
+
+    /** Compress list of doubles (Gorilla codec).
+      * @brief Values are grouped by series (stable order by param id), every
+      * value is XORed with the previous value of the same series, meaningful
+      * bits of the result are stored using leading and trailing zeros count.
+      * @param input array of doubles
+      * @param params array of parameter ids
+      * @param buffer resulting byte array (ByteVector or MemBuffer)
+      * @returns number of bits written
+      */
+    template<class Buffer>
+    static
+    size_t compress_doubles_gorilla(std::vector<double> const& input,
+                                    std::vector<aku_ParamId> const& params,
+                                    Buffer *buffer);
+
+    /** Decompress list of doubles (Gorilla codec).
+      * @param begin beginning of the compressed data
+      * @param nbits number of bits written by compress_doubles_gorilla
+      * @param params list of parameter ids (one per value)
+      * @param output resulting array
+      * @returns false if data is damaged
+      */
+    static
+    bool decompress_doubles_gorilla(const unsigned char* begin,
+                                    size_t nbits,
+                                    std::vector<aku_ParamId> const& params,
+                                    std::vector<double> *output);
+
+    /** Compress list of integers.
+      * @brief Every value is replaced with the difference from the previous
+      * value of the same series, differences are ZigZag and Base128 encoded.
+      * @param input array of integers
+      * @param params array of parameter ids (one per value)
+      * @param buffer resulting byte array (ByteVector or MemBuffer)
+      * @returns number of bytes written
+      */
+    template<class Buffer>
+    static
+    size_t compress_integers(std::vector<int64_t> const& input,
+                             std::vector<aku_ParamId> const& params,
+                             Buffer *buffer);
+
+    /** Decompress list of integers.
+      * @param begin beginning of the compressed data
+      * @param end end of the data
+      * @param params list of parameter ids (one per value)
+      * @param output resulting array
+      * @returns end of the compressed data or nullptr if data is damaged
+      */
+    static
+    const unsigned char* decompress_integers(const unsigned char* begin,
+                                             const unsigned char* end,
+                                             std::vector<aku_ParamId> const& params,
+                                             std::vector<int64_t> *output);
+};
+
+
+/** Bloom filter of the param ids of the chunk.
+  * Filter is a plain bit array placed at the beginning of the chunk data,
+  * its size is stored in the chunk descriptor. Search checks it before
+  * decoding param ids of the chunk.
+  */
+struct ParamIdFilter {
+    enum {
+        BITS_PER_ID = 8,    //< Filter size per distinct id (~2.5% false positives)
+        NUM_HASHES  = 4,    //< Number of bits per id
+        MAX_SIZE    = 0x2000,  //< Max filter size in bytes
+    };
+
+    /** Build filter for the list of ids.
+      * @param ids list of param ids (can contain duplicates)
+      * @param out resulting bit array, empty if filter isn't needed (chunk summary is enough)
+      */
+    static void build(std::vector<aku_ParamId> const& ids, ByteVector* out);
+
+    //! Check if filter can contain id, returns false if id is definitely not in the set
+    static bool may_contain(const unsigned char* filter, size_t size, aku_ParamId id);
+};
+
+
+/** Stream VByte codec for 64-bit integers.
+  * Each value is stored in 1, 2, 4 or 8 bytes, 2-bit length codes of four
+  * consecutive values are packed into control byte. All control bytes goes
+  * first, data bytes follows them. Decoder doesn't have branches per byte,
+  * it shuffles data bytes of two values at a time using control nibble
+  * (SSSE3 version is selected at runtime if CPU supports it).
+  */
+struct StreamVByte {
+    //! Encode values and append them to `out` (ByteVector or MemBuffer)
+    template<class Buffer>
+    static void encode(const uint64_t* values, size_t n, Buffer* out);
+
+    /** Decode `n` values.
+      * @returns pointer to the end of encoded data or nullptr if data is truncated
+      */
+    static const unsigned char* decode(const unsigned char* begin, const unsigned char* end,
+                                       size_t n, uint64_t* out);
+
+    //! Scalar decoder (used if CPU doesn't support SSSE3 and to decode the tail)
+    static const unsigned char* decode_scalar(const unsigned char* begin, const unsigned char* end,
+                                              size_t n, uint64_t* out);
+};
+
+
+/** Delta-of-delta codec for sorted timestamps.
+  * First timestamp and first delta are stored in Base128 format, delta-of-delta
+  * values are ZigZag encoded and split into blocks of BLOCK_SIZE values. Every
+  * block stores min value (Base128), bit width (one byte) and values relative
+  * to min packed using this width. Regular series produces zero width blocks.
+  */
+struct DeltaDeltaCodec {
+    enum {
+        BLOCK_SIZE = 128,
+    };
+
+    //! Encode sorted timestamps and append them to `out` (ByteVector or MemBuffer)
+    template<class Buffer>
+    static void encode(const aku_TimeStamp* values, size_t n, Buffer* out);
+
+    /** Decode `n` timestamps.
+      * @returns pointer to the end of encoded data or nullptr if data is damaged
+      */
+    static const unsigned char* decode(const unsigned char* begin, const unsigned char* end,
+                                       size_t n, aku_TimeStamp* out);
+};
+
+
+/** Compressed chunk stored in memory.
+  * Chunk can be encoded in any thread and written to the page later
+  * (see PageHeader::complete_chunk). Parts are stored in the same order
+  * as they was passed to ChunkWriter by CompressionUtil::encode_chunk.
+  * Chunk can also be encoded in place, directly to the free space of the
+  * page, in this case it doesn't have parts and isn't copied by the page.
+  */
+struct EncodedChunk : ChunkWriter {
+    struct Part {
+        ByteVector data;
+        size_t     size_estimate;
+    };
+    std::vector<Part> parts;
+    ByteVector        filter;       //< Param id filter (see ParamIdFilter)
+    uint32_t          n_elements;
+    aku_TimeStamp     ts_begin;
+    aku_TimeStamp     ts_end;
+    aku_Status        status;
+    uint32_t          encoding;     //< Codec tags of the chunk columns (see ChunkEncoding)
+    aku_MemRange      in_place;     //< Compressed data written in place (empty if chunk has parts)
+
+    EncodedChunk();
+
+    virtual aku_Status add_chunk(aku_MemRange range, size_t size_estimate);
+
+    //! Compress chunk header and build param id filter
+    aku_Status encode(ChunkHeader const& data, uint32_t encoding = AKU_CHUNK_BASE128);
+
+    /** Compress chunk header directly to the end of the memory region and build param id filter.
+      * @param target memory region (see PageHeader::get_chunk_space)
+      * @return AKU_EOVERFLOW if compressed chunk doesn't fit the region
+      */
+    aku_Status encode(ChunkHeader const& data, uint32_t encoding, aku_MemRange target);
+
+    //! Write all parts (or data written in place) to another writer
+    aku_Status write_to(ChunkWriter *writer) const;
+};
+
+
+/** Cache of decoded chunks shared by all cursors.
+  * Chunk is identified by page id, page open count and offset of the
+  * compressed data inside the page. Chunk's checksum is stored alongside
+  * decoded data and checked on lookup, this prevents stale entries (page
+  * was reopened or belongs to other database) from being used.
+  * Cache size in bytes is limited, least recently used chunks are evicted
+  * first.
+  */
+class ChunkCache {
+public:
+    typedef std::shared_ptr<const ChunkHeader> PChunk;
+
+    struct Key {
+        uint32_t page_id;     //< Page index in storage
+        uint32_t open_count;  //< Page open count
+        uint32_t offset;      //< Offset of the compressed data
+    };
+
+private:
+    struct Item {
+        Key      key;
+        uint32_t checksum;    //< Checksum of the compressed data
+        size_t   size;        //< Estimated size of the decoded chunk
+        PChunk   chunk;
+    };
+
+    struct KeyHash {
+        size_t operator () (Key const& key) const;
+    };
+
+    struct KeyEqual {
+        bool operator () (Key const& lhs, Key const& rhs) const;
+    };
+
+    typedef std::list<Item> ItemList;
+    typedef std::unordered_map<Key, ItemList::iterator, KeyHash, KeyEqual> ItemIndex;
+
+    std::mutex            mutex_;
+    size_t                capacity_;    //< Max size of the cache in bytes
+    size_t                size_;        //< Current size of the cache in bytes
+    ItemList              items_;       //< Cached chunks, most recently used first
+    ItemIndex             index_;
+    std::atomic<uint64_t> n_hits_;
+    std::atomic<uint64_t> n_misses_;
+
+    //! Remove least recently used items until cache size is not greater than `size`
+    void evict_(size_t size);
+
+public:
+    ChunkCache(size_t capacity);
+
+    /** Find decoded chunk.
+      * @param key chunk key
+      * @param checksum checksum of the compressed data
+      * @return decoded chunk or empty pointer if chunk is not in cache
+      */
+    PChunk get(Key const& key, uint32_t checksum);
+
+    //! Add decoded chunk to cache (chunk with the same key is replaced)
+    void put(Key const& key, uint32_t checksum, PChunk chunk);
+
+    //! Change max size of the cache, 0 - disable cache
+    void set_capacity(size_t capacity);
+
+    //! Get number of cache hits and misses
+    void get_stats(uint64_t* n_hits, uint64_t* n_misses, bool reset=false);
+
+    //! Get current size, max size (in bytes) and number of cached chunks
+    void get_usage(uint64_t* size, uint64_t* capacity, uint64_t* nitems);
+
+    //! Amount of memory used by decoded chunk
+    static size_t estimate_size(ChunkHeader const& header);
 };
 
+//! Get decoded chunk cache instance shared by all pages
+ChunkCache& get_global_chunk_cache();
+
 
 //! Base 128 encoded integer
 template<class TVal>
@@ -122,18 +570,20 @@ public:
 
     /** Read base 128 encoded integer from the binary stream
     *  FwdIter - forward iterator
+    *  Damaged data (e.g. received from the network) can't move the iterator
+    *  past the end, value of the truncated integer is undefined.
     */
     template<class FwdIter>
     FwdIter get(FwdIter begin, FwdIter end) {
-        assert(begin < end);
-
         auto acc = TVal();
-        auto cnt = TVal();
+        auto cnt = 0u;
         FwdIter p = begin;
 
-        while (true) {
+        while (p != end) {
             auto i = static_cast<byte_t>(*p & 0x7F);
-            acc |= TVal(i) << cnt;
+            if (cnt < sizeof(TVal)*8) {
+                acc |= TVal(i) << cnt;
+            }
             if ((*p++ & 0x80) == 0) {
                 break;
             }
@@ -196,13 +646,13 @@ public:
     }
 };
 
-//! Base128 encoder
-template<class TVal>
+//! Base128 encoder (Buffer - ByteVector or MemBuffer)
+template<class TVal, class Buffer = ByteVector>
 struct Base128StreamWriter {
     // underlying memory region
-    ByteVector& data_;
+    Buffer& data_;
 
-    Base128StreamWriter(ByteVector& data) : data_(data) {}
+    Base128StreamWriter(Buffer& data) : data_(data) {}
 
     /** Put value into stream.
      */
@@ -254,7 +704,8 @@ template<class Stream, class TVal>
 struct ZigZagStreamWriter {
     Stream stream_;
 
-    ZigZagStreamWriter(ByteVector& container)
+    template<class Buffer>
+    ZigZagStreamWriter(Buffer& container)
             : stream_(container) {
     }
     void put(TVal value) {
@@ -298,7 +749,8 @@ struct DeltaStreamWriter {
     Stream stream_;
     TVal prev_;
 
-    DeltaStreamWriter(ByteVector& container)
+    template<class Buffer>
+    DeltaStreamWriter(Buffer& container)
         : stream_(container)
         , prev_()
     {
@@ -357,7 +809,8 @@ struct RLEStreamWriter {
     TVal prev_;
     TVal reps_;
 
-    RLEStreamWriter(ByteVector& container)
+    template<class Buffer>
+    RLEStreamWriter(Buffer& container)
         : stream_(container)
         , prev_()
         , reps_()
@@ -450,6 +903,21 @@ typedef ZigZagStreamWriter<__RLEOffWriter, int64_t> __ZigZagOffWriter;      // i
 typedef DeltaStreamWriter<__ZigZagOffWriter, int64_t> DeltaRLEOffWriter;    // after delta encoding (ZigZag coding
                                                                             // solves this issue).
 
+// Writers of the same formats with arbitrary output buffer
+template<class Buffer>
+using DeltaRLETSWriterT = DeltaStreamWriter<RLEStreamWriter<Base128StreamWriter<aku_TimeStamp, Buffer>,
+                                                            aku_TimeStamp>,
+                                            aku_TimeStamp>;
+template<class Buffer>
+using Base128IdWriterT = Base128StreamWriter<aku_ParamId, Buffer>;
+template<class Buffer>
+using RLELenWriterT = RLEStreamWriter<Base128StreamWriter<uint32_t, Buffer>, uint32_t>;
+template<class Buffer>
+using DeltaRLEOffWriterT = DeltaStreamWriter<ZigZagStreamWriter<RLEStreamWriter<Base128StreamWriter<int64_t, Buffer>,
+                                                                                int64_t>,
+                                                                int64_t>,
+                                             int64_t>;
+
 // Base128 -> RLE -> ZigZag -> Delta -> Offset
 //typedef Base128StreamReader<uint32_t, const unsigned char*> Base128OffReader;
 typedef Base128StreamReader<uint64_t, const unsigned char*> __Base128OffReader;
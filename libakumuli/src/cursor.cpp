@@ -19,6 +19,9 @@
 #include "search.h"
 
 #include <iostream>
+#include <new>
+
+#include <sys/mman.h>
 
 #include <algorithm>
 #include <boost/crc.hpp>
@@ -30,6 +33,8 @@ namespace Akumuli {
 
 CursorFSM::CursorFSM()
     : usr_buffer_(nullptr)
+    , usr_columns_()
+    , use_columns_(false)
     , usr_buffer_len_(0)
     , write_index_(0)
     , error_(false)
@@ -49,22 +54,90 @@ CursorFSM::~CursorFSM() {
 
 void CursorFSM::update_buffer(CursorResult* buf, int buf_len) {
     usr_buffer_ = buf;
+    use_columns_ = false;
+    usr_buffer_len_ = buf_len;
+    write_index_ = 0;
+}
+
+void CursorFSM::update_buffer(CursorColumns const& columns, int buf_len) {
+    usr_buffer_ = nullptr;
+    usr_columns_ = columns;
+    use_columns_ = true;
     usr_buffer_len_ = buf_len;
     write_index_ = 0;
 }
 
 void CursorFSM::update_buffer(CursorFSM *other_fsm) {
     usr_buffer_ = other_fsm->usr_buffer_;
+    usr_columns_ = other_fsm->usr_columns_;
+    use_columns_ = other_fsm->use_columns_;
     usr_buffer_len_ = other_fsm->usr_buffer_len_;
     write_index_ = other_fsm->write_index_;
 }
 
 bool CursorFSM::can_put() const {
-    return usr_buffer_ != nullptr && write_index_ < usr_buffer_len_;
+    return (usr_buffer_ != nullptr || use_columns_) && write_index_ < usr_buffer_len_;
 }
 
 void CursorFSM::put(CursorResult const& result) {
-    usr_buffer_[write_index_++] = result;
+    if (!use_columns_) {
+        usr_buffer_[write_index_++] = result;
+        return;
+    }
+    auto ix = write_index_++;
+    if (usr_columns_.timestamps) {
+        usr_columns_.timestamps[ix] = result.timestamp;
+    }
+    if (usr_columns_.params) {
+        usr_columns_.params[ix] = result.param_id;
+    }
+    if (usr_columns_.pointers) {
+        usr_columns_.pointers[ix] = result.data;
+    }
+    if (usr_columns_.lengths) {
+        usr_columns_.lengths[ix] = result.length;
+    }
+}
+
+void CursorFSM::put(CursorColumns const& columns, int begin, int n) {
+    auto ix = write_index_;
+    write_index_ += n;
+    auto end = begin + n;
+    if (!use_columns_) {
+        for (auto i = begin; i < end; i++, ix++) {
+            usr_buffer_[ix].timestamp = columns.timestamps[i];
+            usr_buffer_[ix].param_id = columns.params[i];
+            usr_buffer_[ix].data = columns.pointers[i];
+            usr_buffer_[ix].length = columns.lengths[i];
+        }
+        return;
+    }
+    if (usr_columns_.timestamps) {
+        std::copy(columns.timestamps + begin, columns.timestamps + end, usr_columns_.timestamps + ix);
+    }
+    if (usr_columns_.params) {
+        std::copy(columns.params + begin, columns.params + end, usr_columns_.params + ix);
+    }
+    if (usr_columns_.pointers) {
+        std::copy(columns.pointers + begin, columns.pointers + end, usr_columns_.pointers + ix);
+    }
+    if (usr_columns_.lengths) {
+        std::copy(columns.lengths + begin, columns.lengths + end, usr_columns_.lengths + ix);
+    }
+}
+
+// ExternalCursor
+
+int ExternalCursor::read_columns(CursorColumns const& columns, int buf_len) {
+    std::vector<CursorResult> results(buf_len);
+    int n_results = read(results.data(), buf_len);
+    CursorFSM fsm;
+    fsm.update_buffer(columns, buf_len);
+    for (int i = 0; i < n_results; i++) {
+        fsm.put(results[i]);
+    }
+    fsm.close();
+    return n_results;
 }
 
 bool CursorFSM::close() {
@@ -83,6 +156,10 @@ void CursorFSM::set_error(int error_code) {
     complete_ = true;
 }
 
+int CursorFSM::space_left() const {
+    return can_put() ? usr_buffer_len_ - write_index_ : 0;
+}
+
 bool CursorFSM::is_done() const {
     return complete_ || closed_;
 }
@@ -101,14 +178,105 @@ int CursorFSM::get_data_len() const {
 
 // CoroCursor
 
+// CoroStackPool
+
+CoroStackPool::CoroStackPool(size_t capacity)
+    : capacity_(capacity)
+    , n_hits_{0u}
+    , n_misses_{0u}
+{
+}
+
+CoroStackPool::~CoroStackPool() {
+    shrink_(0u);
+}
+
+void* CoroStackPool::allocate(size_t size) {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        for (auto it = stacks_.rbegin(); it != stacks_.rend(); it++) {
+            if (it->second == size) {
+                auto stack = it->first;
+                stacks_.erase(std::next(it).base());
+                n_hits_++;
+                return stack;
+            }
+        }
+    }
+    n_misses_++;
+    auto guard_size = get_page_size();
+    auto ptr = mmap(nullptr, size + guard_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    // Stack overflow hits the guard page instead of the adjacent memory
+    if (mprotect(ptr, guard_size, PROT_NONE) != 0) {
+        munmap(ptr, size + guard_size);
+        throw std::bad_alloc();
+    }
+    return static_cast<char*>(ptr) + guard_size;
+}
+
+void CoroStackPool::deallocate(void* stack, size_t size) {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (stacks_.size() < capacity_) {
+            stacks_.push_back(std::make_pair(static_cast<char*>(stack), size));
+            return;
+        }
+    }
+    auto guard_size = get_page_size();
+    munmap(static_cast<char*>(stack) - guard_size, size + guard_size);
+}
+
+void CoroStackPool::shrink_(size_t size) {
+    std::vector<Stack> unused;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        while (stacks_.size() > size) {
+            unused.push_back(stacks_.back());
+            stacks_.pop_back();
+        }
+    }
+    auto guard_size = get_page_size();
+    for (auto const& stack: unused) {
+        munmap(stack.first - guard_size, stack.second + guard_size);
+    }
+}
+
+void CoroStackPool::set_capacity(size_t capacity) {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        capacity_ = capacity;
+    }
+    shrink_(capacity);
+}
+
+void CoroStackPool::get_stats(uint64_t* n_hits, uint64_t* n_misses, bool reset) {
+    if (reset) {
+        *n_hits = n_hits_.exchange(0);
+        *n_misses = n_misses_.exchange(0);
+    } else {
+        *n_hits = n_hits_.load();
+        *n_misses = n_misses_.load();
+    }
+}
+
+CoroStackPool& get_global_stack_pool() {
+    static CoroStackPool pool(AKU_DEFAULT_STACK_POOL_SIZE);
+    return pool;
+}
+
+// CoroCursorStackAllocator
+
 void CoroCursorStackAllocator::allocate(boost::coroutines::stack_context& ctx, size_t size) const
 {
     ctx.size = size;
-    ctx.sp = reinterpret_cast<char*>(malloc(size)) + size;
+    ctx.sp = static_cast<char*>(get_global_stack_pool().allocate(size)) + size;
 }
 
 void CoroCursorStackAllocator::deallocate(boost::coroutines::stack_context& ctx) const {
-    free(reinterpret_cast<char*>(ctx.sp) - ctx.size);
+    get_global_stack_pool().deallocate(static_cast<char*>(ctx.sp) - ctx.size, ctx.size);
 }
 
 // External cursor implementation
@@ -119,6 +287,12 @@ int CoroCursor::read(CursorResult* buf, int buf_len) {
     return cursor_fsm_.get_data_len();
 }
 
+int CoroCursor::read_columns(CursorColumns const& columns, int buf_len) {
+    cursor_fsm_.update_buffer(columns, buf_len);
+    coroutine_->operator()(this);
+    return cursor_fsm_.get_data_len();
+}
+
 bool CoroCursor::is_done() const {
     return cursor_fsm_.is_done();
 }
@@ -167,11 +341,44 @@ void CoroCursor::complete(Caller& caller) {
 StacklessFanInCursorCombinator::StacklessFanInCursorCombinator(
         ExternalCursor** in_cursors,
         int size,
-        int direction)
+        int direction,
+        uint64_t limit)
     : direction_(direction)
     , in_cursors_(in_cursors, in_cursors + size)
-    , pred_{direction}
+    , buffers_(size)
+    , tree_(size)
+    , n_active_(0)
+    , limit_(limit)
+    , count_(0u)
 {
+    init_();
+}
+
+static std::vector<ExternalCursor*> get_pointers(std::vector<std::unique_ptr<ExternalCursor>> const& cursors) {
+    std::vector<ExternalCursor*> result;
+    for (auto const& cur: cursors) {
+        result.push_back(cur.get());
+    }
+    return result;
+}
+
+StacklessFanInCursorCombinator::StacklessFanInCursorCombinator(
+        std::vector<std::unique_ptr<ExternalCursor>> cursors,
+        int direction,
+        uint64_t limit)
+    : direction_(direction)
+    , owned_cursors_(std::move(cursors))
+    , in_cursors_(get_pointers(owned_cursors_))
+    , buffers_(in_cursors_.size())
+    , tree_(in_cursors_.size())
+    , n_active_(0)
+    , limit_(limit)
+    , count_(0u)
+{
+    init_();
+}
+
+void StacklessFanInCursorCombinator::init_() {
     int error = AKU_SUCCESS;
     for (auto cursor: in_cursors_) {
         if (cursor->is_error(&error)) {
@@ -179,64 +386,111 @@ StacklessFanInCursorCombinator::StacklessFanInCursorCombinator(
             return;
         }
     }
+    if (direction_ != AKU_CURSOR_DIR_FORWARD && direction_ != AKU_CURSOR_DIR_BACKWARD) {
+        AKU_PANIC("bad direction of the fan-in cursor")
+    }
 
     const int BUF_LEN = 0x200;
-    CursorResult buffer[BUF_LEN];
-    for(auto cur_index = 0u; cur_index < in_cursors_.size(); cur_index++) {
-        if (!in_cursors_[cur_index]->is_done()) {
-            ExternalCursor* cursor = in_cursors_[cur_index];
-            int nwrites = cursor->read(buffer, BUF_LEN);
-            if (cursor->is_error(&error)) {
-                set_error(error);
-                return;
-            }
-            for (int buf_ix = 0; buf_ix < nwrites; buf_ix++) {
-                auto cur_count = nwrites - buf_ix;
-                auto key = std::make_tuple(buffer[buf_ix], cur_index, cur_count);
-                heap_.push_back(key);
-            }
+    for (int index = 0; index < static_cast<int>(in_cursors_.size()); index++) {
+        buffers_[index].results.resize(BUF_LEN);
+        if (refill_(index)) {
+            tree_.set(index, key_(index));
+            n_active_++;
+        } else if (cursor_fsm_.is_done()) {
+            return;
+        }
+    }
+    if (direction_ == AKU_CURSOR_DIR_FORWARD) {
+        tree_.build(MergeOrder<CursorResultLess, AKU_CURSOR_DIR_FORWARD>());
+    } else {
+        tree_.build(MergeOrder<CursorResultLess, AKU_CURSOR_DIR_BACKWARD>());
+    }
+}
+
+bool StacklessFanInCursorCombinator::refill_(int index) {
+    auto cursor = in_cursors_[index];
+    auto& buffer = buffers_[index];
+    buffer.size = 0;
+    buffer.pos = 0;
+    int error = AKU_SUCCESS;
+    while (buffer.size == 0 && !cursor->is_done()) {
+        buffer.size = cursor->read_columns(buffer.results.columns(), static_cast<int>(buffer.results.size()));
+        if (cursor->is_error(&error)) {
+            set_error(error);
+            return false;
         }
     }
+    return buffer.size != 0;
+}
 
-    std::make_heap(heap_.begin(), heap_.end(), pred_);
+StacklessFanInCursorCombinator::MergeKey StacklessFanInCursorCombinator::key_(int index) const {
+    auto const& buffer = buffers_[index];
+    MergeKey key = { buffer.results.timestamps[buffer.pos], buffer.results.params[buffer.pos] };
+    return key;
 }
 
+template<class Order>
 void StacklessFanInCursorCombinator::read_impl_() {
-    // Check preconditions
-    int error = 0;
-    bool proceed = true;
-    const int BUF_LEN = 0x200;
-    CursorResult buffer[BUF_LEN];
-    while(proceed && !heap_.empty()) {
-        std::pop_heap(heap_.begin(), heap_.end(), pred_);
-        auto item = heap_.back();
-        const CursorResult& cur_result = std::get<0>(item);
-        int cur_index = std::get<1>(item);
-        int cur_count = std::get<2>(item);
-        proceed = put(cur_result);
-        heap_.pop_back();
-        if (cur_count == 1 && !in_cursors_[cur_index]->is_done()) {
-            ExternalCursor* cursor = in_cursors_[cur_index];
-            int nwrites = cursor->read(buffer, BUF_LEN);
-            if (cursor->is_error(&error)) {
-                set_error(error);
-                return;
+    Order order;
+    while(!tree_.empty() && cursor_fsm_.can_put()) {
+        int index = tree_.winner();
+        auto& buffer = buffers_[index];
+        int n = 1;
+        if (n_active_ == 1) {
+            // Only one input left, results can be copied without merging
+            n = std::min(buffer.size - buffer.pos, cursor_fsm_.space_left());
+            if (limit_ != 0u && limit_ - count_ < static_cast<uint64_t>(n)) {
+                n = static_cast<int>(limit_ - count_);
             }
-            for (int buf_ix = 0; buf_ix < nwrites; buf_ix++) {
-                auto key = std::make_tuple(buffer[buf_ix], cur_index, nwrites - buf_ix);
-                heap_.push_back(key);
-                std::push_heap(heap_.begin(), heap_.end(), pred_);
+        }
+        cursor_fsm_.put(buffer.results.columns(), buffer.pos, n);
+        count_ += static_cast<uint64_t>(n);
+        if (limit_ != 0u && count_ == limit_) {
+            // Limit is reached, inputs can stop producing results
+            for (auto cursor: in_cursors_) {
+                cursor->close();
             }
+            tree_.clear();
+            break;
+        }
+        buffer.pos += n;
+        if (buffer.pos < buffer.size) {
+            tree_.replace_top(key_(index), order);
+        } else if (refill_(index)) {
+            tree_.replace_top(key_(index), order);
+        } else if (cursor_fsm_.is_done()) {
+            // Input failed
+            return;
+        } else {
+            tree_.pop_top(order);
+            n_active_--;
         }
     }
-    if (heap_.empty()) {
+    if (tree_.empty()) {
         complete();
     }
 }
 
+void StacklessFanInCursorCombinator::read_dispatch_() {
+    if (cursor_fsm_.is_done()) {
+        return;
+    }
+    if (direction_ == AKU_CURSOR_DIR_FORWARD) {
+        read_impl_<MergeOrder<CursorResultLess, AKU_CURSOR_DIR_FORWARD>>();
+    } else {
+        read_impl_<MergeOrder<CursorResultLess, AKU_CURSOR_DIR_BACKWARD>>();
+    }
+}
+
 int StacklessFanInCursorCombinator::read(CursorResult *buf, int buf_len) {
     cursor_fsm_.update_buffer(buf, buf_len);
-    read_impl_();
+    read_dispatch_();
+    return cursor_fsm_.get_data_len();
+}
+
+int StacklessFanInCursorCombinator::read_columns(CursorColumns const& columns, int buf_len) {
+    cursor_fsm_.update_buffer(columns, buf_len);
+    read_dispatch_();
     return cursor_fsm_.get_data_len();
 }
 
@@ -259,13 +513,6 @@ void StacklessFanInCursorCombinator::set_error(int error_code) {
     cursor_fsm_.set_error(error_code);
 }
 
-bool StacklessFanInCursorCombinator::put(CursorResult const& result) {
-    if (cursor_fsm_.can_put()) {
-        cursor_fsm_.put(result);
-    }
-    return cursor_fsm_.is_done();
-}
-
 void StacklessFanInCursorCombinator::complete() {
     cursor_fsm_.complete();
 }
@@ -282,6 +529,17 @@ FanInCursorCombinator::FanInCursorCombinator(ExternalCursor **cursors, int size,
 }
 
 void FanInCursorCombinator::read_impl_(Caller& caller) {
+    if (direction_ == AKU_CURSOR_DIR_FORWARD) {
+        merge_<HeapPred<AKU_CURSOR_DIR_FORWARD>>(caller);
+    } else if (direction_ == AKU_CURSOR_DIR_BACKWARD) {
+        merge_<HeapPred<AKU_CURSOR_DIR_BACKWARD>>(caller);
+    } else {
+        AKU_PANIC("bad direction of the fan-in cursor")
+    }
+}
+
+template<class Pred>
+void FanInCursorCombinator::merge_(Caller& caller) {
 #ifdef DEBUG
     CursorResult dbg_prev_item;
     bool dbg_first_item = true;
@@ -298,7 +556,7 @@ void FanInCursorCombinator::read_impl_(Caller& caller) {
 
     typedef std::vector<HeapItem> Heap;
     Heap heap;
-    HeapPred pred = { direction_ };
+    Pred pred;
 
     const int BUF_LEN = 0x200;
     CursorResult buffer[BUF_LEN];
@@ -386,4 +644,143 @@ void FanInCursorCombinator::close()
     return out_cursor_.close();
 }
 
+// CursorWorkerPool
+
+CursorWorkerPool::CursorWorkerPool(int nthreads, bool interleave)
+    : stop_(false)
+    , interleave_(interleave)
+{
+    for (int i = 0; i < nthreads; i++) {
+        threads_.emplace_back(std::bind(&CursorWorkerPool::worker_, this));
+    }
+}
+
+CursorWorkerPool::~CursorWorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stop_ = true;
+    }
+    cvar_.notify_all();
+    for (auto& thread: threads_) {
+        thread.join();
+    }
+}
+
+void CursorWorkerPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        tasks_.push(std::move(task));
+    }
+    cvar_.notify_one();
+}
+
+void CursorWorkerPool::worker_() {
+    if (interleave_) {
+        // Workers search historical volumes, their pages are faulted in by workers
+        set_numa_policy(AKU_NUMA_INTERLEAVE);
+    }
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cvar_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                // stop_ is set and all tasks are done
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop();
+        }
+        task();
+    }
+}
+
+// PrefetchCursor
+
+PrefetchCursor::PrefetchCursor(std::unique_ptr<ExternalCursor> source, CursorWorkerPool& pool, size_t capacity)
+    : source_(std::move(source))
+    , pool_(pool)
+    , capacity_(capacity)
+    , scheduled_(false)
+    , source_done_(false)
+    , error_code_(AKU_SUCCESS)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    schedule_();
+}
+
+PrefetchCursor::~PrefetchCursor() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cvar_.wait(lock, [this]() { return !scheduled_; });
+}
+
+void PrefetchCursor::schedule_() {
+    if (!scheduled_ && !source_done_) {
+        scheduled_ = true;
+        pool_.submit(std::bind(&PrefetchCursor::fill_, this));
+    }
+}
+
+void PrefetchCursor::fill_() {
+    // Only one fill task can be active at a time, so source_
+    // can be accessed without locking.
+    const int BUF_LEN = 0x200;
+    CursorResult buffer[BUF_LEN];
+    while (true) {
+        int nwrites = source_->read(buffer, BUF_LEN);
+        int error = AKU_SUCCESS;
+        bool failed = source_->is_error(&error);
+        bool done = source_->is_done();
+        std::lock_guard<std::mutex> guard(mutex_);
+        buffer_.insert(buffer_.end(), buffer, buffer + nwrites);
+        if (failed) {
+            error_code_ = error;
+        }
+        source_done_ = done || failed;
+        if (source_done_ || buffer_.size() + BUF_LEN > capacity_) {
+            scheduled_ = false;
+            cvar_.notify_all();
+            return;
+        }
+        cvar_.notify_all();
+    }
+}
+
+int PrefetchCursor::read(CursorResult *buf, int buf_len) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cvar_.wait(lock, [this]() { return !buffer_.empty() || source_done_; });
+    auto nresults = std::min(static_cast<size_t>(buf_len), buffer_.size());
+    auto end = buffer_.begin() + nresults;
+    std::copy(buffer_.begin(), end, buf);
+    buffer_.erase(buffer_.begin(), end);
+    if (buffer_.size() < capacity_ / 2) {
+        schedule_();
+    }
+    return static_cast<int>(nresults);
+}
+
+bool PrefetchCursor::is_done() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return source_done_ && buffer_.empty();
+}
+
+bool PrefetchCursor::is_error(int *out_error_code_or_null) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (error_code_ != AKU_SUCCESS) {
+        if (out_error_code_or_null) {
+            *out_error_code_or_null = error_code_;
+        }
+        return true;
+    }
+    return false;
+}
+
+void PrefetchCursor::close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cvar_.wait(lock, [this]() { return !scheduled_; });
+    source_done_ = true;
+    buffer_.clear();
+    source_->close();
+}
+
 }
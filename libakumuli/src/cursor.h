@@ -24,10 +24,18 @@
 
 #include <vector>
 #include <memory>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
 
 #include "akumuli.h"
 #include "internal_cursor.h"
 #include "page.h"
+#include "loser_tree.h"
 
 namespace Akumuli {
 
@@ -36,6 +44,8 @@ std::ostream& operator << (std::ostream& st, CursorResult res);
 class CursorFSM {
     // user data
     CursorResult*   usr_buffer_;        //! User owned buffer for output
+    CursorColumns   usr_columns_;       //! User owned columns for output (used if usr_buffer_ is null)
+    bool            use_columns_;       //! Output goes to usr_columns_
     int             usr_buffer_len_;    //! Size of the user owned buffer
     // cursor state
     int             write_index_;       //! Current write position in usr_buffer_
@@ -48,13 +58,18 @@ public:
     ~CursorFSM();
     // modifiers
     void put(CursorResult const& result);
+    //! Put `n` rows of the columns starting from `begin` (caller checks that there is enough space)
+    void put(CursorColumns const& columns, int begin, int n);
     void complete();
     void set_error(int error_code);
     void update_buffer(CursorResult* buf, int buf_len);
+    void update_buffer(CursorColumns const& columns, int buf_len);
     void update_buffer(CursorFSM *other_fsm);
     bool close();
     // accessors
     bool can_put() const;
+    //! Number of results that can be put to the buffer
+    int space_left() const;
     bool is_done() const;
     bool get_error(int *error_code) const;
     int get_data_len() const;
@@ -67,6 +82,10 @@ public:
 struct ExternalCursor {
     //! Read portion of the data to the buffer
     virtual int read(CursorResult* buf, int buf_len) = 0;
+    /** Read portion of the data directly to the user owned columns.
+      * Default implementation reads data to temporary buffer first.
+      */
+    virtual int read_columns(CursorColumns const& columns, int buf_len);
     //! Check is everything done
     virtual bool is_done() const = 0;
     //! Check is error occured and (optionally) get the error code
@@ -82,6 +101,42 @@ struct ExternalCursor {
 struct Cursor : InternalCursor, ExternalCursor {};
 
 
+/** Pool of coroutine stacks.
+  * Stacks are mapped with mmap, the lowest page of each stack is a guard page
+  * (stack grows down). Released stacks are kept for reuse until the number of
+  * pooled stacks reaches the pool capacity, the rest are unmapped.
+  */
+class CoroStackPool {
+    typedef std::pair<char*, size_t> Stack;       //< Usable region of the stack (begin, size)
+
+    std::mutex            mutex_;
+    size_t                capacity_;    //< Max number of pooled stacks
+    std::vector<Stack>    stacks_;      //< Pooled stacks
+    std::atomic<uint64_t> n_hits_;
+    std::atomic<uint64_t> n_misses_;
+
+    //! Unmap stacks until number of pooled stacks is not greater than `size`
+    void shrink_(size_t size);
+public:
+    CoroStackPool(size_t capacity);
+    ~CoroStackPool();
+
+    //! Get stack with `size` usable bytes, returns lowest usable address
+    void* allocate(size_t size);
+
+    //! Return stack to the pool
+    void deallocate(void* stack, size_t size);
+
+    //! Change max number of pooled stacks, 0 - disable pooling
+    void set_capacity(size_t capacity);
+
+    //! Get number of pool hits and misses
+    void get_stats(uint64_t* n_hits, uint64_t* n_misses, bool reset=false);
+};
+
+//! Get coroutine stack pool shared by all cursors
+CoroStackPool& get_global_stack_pool();
+
 struct CoroCursorStackAllocator {
     void allocate(boost::coroutines::stack_context& ctx, size_t size) const;
     void deallocate(boost::coroutines::stack_context& ctx) const;
@@ -95,6 +150,8 @@ struct CoroCursor : Cursor {
 
     virtual int read(CursorResult* buf, int buf_len);
 
+    virtual int read_columns(CursorColumns const& columns, int buf_len);
+
     virtual bool is_done() const;
 
     virtual bool is_error(int* out_error_code_or_null=nullptr) const;
@@ -147,25 +204,98 @@ struct CoroCursor : Cursor {
     }
 };
 
+/** Cursor for stackless search procedures (PageSearch, SequencerSearch).
+  * Search procedure fills caller's buffer directly, coroutine is not needed.
+  */
+template<class Search>
+class StacklessCursor : public ExternalCursor {
+    Search search_;
+public:
+    template<class... Args>
+    StacklessCursor(Args&&... args)
+        : search_(std::forward<Args>(args)...)
+    {
+    }
+
+    virtual int read(CursorResult* buf, int buf_len) {
+        return search_.read(buf, buf_len);
+    }
+
+    virtual int read_columns(CursorColumns const& columns, int buf_len) {
+        if (columns.timestamps && columns.params && columns.pointers && columns.lengths) {
+            return search_.read_columns(columns, buf_len);
+        }
+        return ExternalCursor::read_columns(columns, buf_len);
+    }
+
+    virtual bool is_done() const {
+        return search_.is_done();
+    }
+
+    virtual bool is_error(int* out_error_code_or_null=nullptr) const {
+        return search_.get_error(out_error_code_or_null);
+    }
+
+    virtual void close() {
+        search_.close();
+    }
+};
+
+/** Run stackless search procedure and send results to internal cursor.
+  * Compatibility adapter for code that uses InternalCursor interface.
+  */
+template<class Search>
+void run_search(Caller& caller, InternalCursor* cursor, Search& search) {
+    const int BUF_LEN = 0x100;
+    CursorResult buffer[BUF_LEN];
+    while (!search.is_done()) {
+        int nresults = search.read(buffer, BUF_LEN);
+        for (int i = 0; i < nresults; i++) {
+            if (!cursor->put(caller, buffer[i])) {
+                // Cursor was closed
+                search.close();
+                break;
+            }
+        }
+    }
+    int error_code = AKU_SUCCESS;
+    if (search.get_error(&error_code)) {
+        cursor->set_error(caller, error_code);
+    } else {
+        cursor->complete(caller);
+    }
+}
+
+//! Forward order of the results or merge keys (timestamp, param id)
+struct CursorResultLess {
+    template<class T>
+    bool operator () (T const& lhs, T const& rhs) const {
+        return lhs.timestamp < rhs.timestamp ||
+              (lhs.timestamp == rhs.timestamp && lhs.param_id < rhs.param_id);
+    }
+};
+
 typedef std::tuple<CursorResult, int, int> HeapItem;
 
-struct HeapPred {
-    int dir;
+/** Heap order of the fan-in cursor.
+  * Top of the std heap is the greatest item, it goes first.
+  */
+template<int dir>
+struct HeapPred;
+
+template<>
+struct HeapPred<AKU_CURSOR_DIR_FORWARD> {
     bool operator () (HeapItem const& lhs, HeapItem const& rhs) const {
-        bool result = false;
-        const CursorResult& lres = std::get<0>(lhs);
-        const CursorResult& rres = std::get<0>(rhs);
-        const auto lkey = std::make_tuple(lres.timestamp, lres.param_id);
-        const auto rkey = std::make_tuple(rres.timestamp, rres.param_id);
-        if (dir == AKU_CURSOR_DIR_BACKWARD) {
-            // Min heap is used
-            result = lkey < rkey;
-        } else if (dir == AKU_CURSOR_DIR_FORWARD) {
-            result = lkey > rkey;
-        } else {
-            AKU_PANIC("bad direction of the fan-in cursor")
-        }
-        return result;
+        // Min heap is used
+        return CursorResultLess()(std::get<0>(rhs), std::get<0>(lhs));
+    }
+};
+
+template<>
+struct HeapPred<AKU_CURSOR_DIR_BACKWARD> {
+    bool operator () (HeapItem const& lhs, HeapItem const& rhs) const {
+        // Max heap is used
+        return CursorResultLess()(std::get<0>(lhs), std::get<0>(rhs));
     }
 };
 
@@ -175,17 +305,38 @@ struct HeapPred {
  * results from this cursors in one ordered
  * sequence of events.
  */
-class StacklessFanInCursorCombinator : ExternalCursor {
-    typedef std::vector<HeapItem> Heap;
+class StacklessFanInCursorCombinator : public ExternalCursor {
+    //! Results read from the input cursor
+    struct InputBuffer {
+        ColumnBuffer                    results;
+        int                             size;       //< Number of results in buffer
+        int                             pos;        //< Next result
+    };
+    //! Part of the result used by the merge
+    struct MergeKey {
+        aku_TimeStamp                   timestamp;
+        aku_ParamId                     param_id;
+    };
     const int                           direction_;
+    std::vector<std::unique_ptr<ExternalCursor>> owned_cursors_;
     const std::vector<ExternalCursor*>  in_cursors_;
-    const HeapPred                      pred_;
-    Heap                                heap_;
+    std::vector<InputBuffer>            buffers_;
+    LoserTree<MergeKey>                 tree_;      //< Current result of every input
+    int                                 n_active_;  //< Number of inputs that are not exhausted
     CursorFSM                           cursor_fsm_;
-
+    const uint64_t                      limit_;     //< Max number of results (0 - unlimited)
+    uint64_t                            count_;     //< Number of results produced
+
+    void init_();
+    //! Read next portion of results of the input, returns false if input is done or failed
+    bool refill_(int index);
+    //! Merge key of the current result of the input
+    MergeKey key_(int index) const;
+    template<class Order>
     void read_impl_();
+    //! Run read_impl_ specialized on direction
+    void read_dispatch_();
     void set_error(int error_code);
-    bool put(CursorResult const& result);
     void complete();
 public:
     /**
@@ -193,14 +344,27 @@ public:
      * @param cursors array of pointer to cursors
      * @param size size of the cursors array
      * @param direction direction of the cursor (forward or backward)
+     * @param limit max number of results, input cursors are closed when limit is reached (0 - unlimited)
      */
     StacklessFanInCursorCombinator( ExternalCursor** in_cursors
                                   , int size
-                                  , int direction);
+                                  , int direction
+                                  , uint64_t limit = 0u);
+
+    /**
+     * @brief C-tor
+     * @param cursors cursors owned by combinator
+     * @param direction direction of the cursor (forward or backward)
+     * @param limit max number of results, input cursors are closed when limit is reached (0 - unlimited)
+     */
+    StacklessFanInCursorCombinator( std::vector<std::unique_ptr<ExternalCursor>> cursors
+                                  , int direction
+                                  , uint64_t limit = 0u);
 
     // ExternalCursor interface
 public:
     virtual int read(CursorResult *buf, int buf_len);
+    virtual int read_columns(CursorColumns const& columns, int buf_len);
     virtual bool is_done() const;
     virtual bool is_error(int *out_error_code_or_null) const;
     virtual void close();
@@ -218,6 +382,10 @@ class FanInCursorCombinator : ExternalCursor {
     CoroCursor                          out_cursor_;
 
     void read_impl_(Caller& caller);
+
+    //! Merge inputs using heap order `Pred` (direction is known at compile time)
+    template<class Pred>
+    void merge_(Caller& caller);
 public:
     /**
      * @brief C-tor
@@ -237,4 +405,71 @@ public:
     virtual void close();
 };
 
+/** Fixed size pool of worker threads.
+  * Used to run several cursors in parallel.
+  */
+class CursorWorkerPool {
+    std::vector<std::thread>            threads_;
+    std::queue<std::function<void()>>   tasks_;
+    std::mutex                          mutex_;
+    std::condition_variable             cvar_;
+    bool                                stop_;
+    const bool                          interleave_;
+
+    void worker_();
+public:
+    /** C-tor, starts `nthreads` worker threads.
+      * @param interleave if set, memory touched by workers is interleaved across NUMA nodes
+      */
+    CursorWorkerPool(int nthreads, bool interleave = false);
+
+    //! D-tor, completes all submitted tasks and joins worker threads
+    ~CursorWorkerPool();
+
+    //! Submit task for execution, task must not block
+    void submit(std::function<void()> task);
+};
+
+/**
+ * @brief Prefetching cursor.
+ * Reads underlying cursor on a worker pool thread and stores
+ * results in bounded buffer. Fill task never blocks, it stops
+ * when buffer is full and gets rescheduled by reader when
+ * buffer is half empty.
+ */
+class PrefetchCursor : public ExternalCursor {
+    std::unique_ptr<ExternalCursor>     source_;
+    CursorWorkerPool&                   pool_;
+    const size_t                        capacity_;
+    std::deque<CursorResult>            buffer_;
+    bool                                scheduled_;     //< Fill task is running or queued
+    bool                                source_done_;   //< Source cursor is done or failed
+    int                                 error_code_;
+    mutable std::mutex                  mutex_;
+    std::condition_variable             cvar_;
+
+    //! Schedule fill task (mutex_ must be locked)
+    void schedule_();
+    void fill_();
+public:
+    /**
+     * @brief C-tor (starts prefetching immediately)
+     * @param source underlying cursor
+     * @param pool worker pool
+     * @param capacity max number of buffered results
+     */
+    PrefetchCursor( std::unique_ptr<ExternalCursor> source
+                  , CursorWorkerPool& pool
+                  , size_t capacity = 0x4000);
+
+    ~PrefetchCursor();
+
+    // ExternalCursor interface
+public:
+    virtual int read(CursorResult *buf, int buf_len);
+    virtual bool is_done() const;
+    virtual bool is_error(int *out_error_code_or_null) const;
+    virtual void close();
+};
+
 }  // namespace
@@ -24,6 +24,8 @@
 
 #include "akumuli.h"
 
+#include <vector>
+
 namespace Akumuli {
 
 
@@ -43,6 +45,56 @@ struct CursorResult {
     aku_PData         data;           //< pointer to data
 };
 
+//! User owned column arrays, any array can be null
+struct CursorColumns {
+    aku_TimeStamp  *timestamps;
+    aku_ParamId    *params;
+    aku_PData      *pointers;
+    uint32_t       *lengths;
+};
+
+/** Block of results in columnar form.
+  * Used to pass results between search procedures, merge and user
+  * in blocks without per-element calls.
+  */
+struct ColumnBuffer {
+    std::vector<aku_TimeStamp>  timestamps;
+    std::vector<aku_ParamId>    params;
+    std::vector<aku_PData>      pointers;
+    std::vector<uint32_t>       lengths;
+
+    ColumnBuffer(size_t size = 0u) {
+        resize(size);
+    }
+
+    void resize(size_t size) {
+        timestamps.resize(size);
+        params.resize(size);
+        pointers.resize(size);
+        lengths.resize(size);
+    }
+
+    size_t size() const {
+        return timestamps.size();
+    }
+
+    //! Columns that point to the buffer
+    CursorColumns columns() {
+        CursorColumns result = { timestamps.data(), params.data(), pointers.data(), lengths.data() };
+        return result;
+    }
+
+    //! Convert first `n` rows to results
+    void to_results(CursorResult* results, int n) const {
+        for (int i = 0; i < n; i++) {
+            results[i].length = lengths[i];
+            results[i].timestamp = timestamps[i];
+            results[i].param_id = params[i];
+            results[i].data = pointers[i];
+        }
+    }
+};
+
 /** Interface used by different search procedures
  *  in akumuli. Must be used only inside library.
  */
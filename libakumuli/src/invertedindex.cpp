@@ -0,0 +1,396 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "invertedindex.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Akumuli {
+
+//                        //
+//      Posting List      //
+//                        //
+
+PostingList::Container::Container(uint64_t key)
+    : key(key)
+    , cardinality(0u)
+{
+}
+
+bool PostingList::Container::is_bitmap() const {
+    return !bitmap.empty();
+}
+
+bool PostingList::Container::contains(uint16_t low) const {
+    if (is_bitmap()) {
+        return (bitmap[low >> 6] >> (low & 63)) & 1;
+    }
+    return std::binary_search(array.begin(), array.end(), low);
+}
+
+void PostingList::Container::add(uint16_t low) {
+    if (is_bitmap()) {
+        uint64_t bit = 1ul << (low & 63);
+        if ((bitmap[low >> 6] & bit) == 0) {
+            bitmap[low >> 6] |= bit;
+            cardinality++;
+        }
+        return;
+    }
+    // Ids are added in increasing order most of the time
+    if (array.empty() || array.back() < low) {
+        array.push_back(low);
+    } else {
+        auto it = std::lower_bound(array.begin(), array.end(), low);
+        if (*it == low) {
+            return;
+        }
+        array.insert(it, low);
+    }
+    cardinality++;
+    if (cardinality > ARRAY_MAX_SIZE) {
+        to_bitmap();
+    }
+}
+
+void PostingList::Container::to_bitmap() {
+    if (is_bitmap()) {
+        return;
+    }
+    bitmap.assign(BITMAP_WORDS, 0ul);
+    for (auto low: array) {
+        bitmap[low >> 6] |= 1ul << (low & 63);
+    }
+    std::vector<uint16_t>().swap(array);
+}
+
+void PostingList::Container::optimize() {
+    if (!is_bitmap() || cardinality > ARRAY_MAX_SIZE) {
+        return;
+    }
+    array.reserve(cardinality);
+    for (int word = 0; word < BITMAP_WORDS; word++) {
+        uint64_t bits = bitmap[word];
+        while (bits) {
+            array.push_back(static_cast<uint16_t>(word*64 + __builtin_ctzl(bits)));
+            bits &= bits - 1;
+        }
+    }
+    std::vector<uint64_t>().swap(bitmap);
+}
+
+void PostingList::Container::unite(Container const& other) {
+    if (!is_bitmap() && !other.is_bitmap() && cardinality + other.cardinality <= ARRAY_MAX_SIZE) {
+        std::vector<uint16_t> result;
+        result.reserve(cardinality + other.cardinality);
+        std::set_union(array.begin(), array.end(), other.array.begin(), other.array.end(),
+                       std::back_inserter(result));
+        array.swap(result);
+        cardinality = static_cast<uint32_t>(array.size());
+        return;
+    }
+    to_bitmap();
+    if (other.is_bitmap()) {
+        uint32_t count = 0;
+        for (int word = 0; word < BITMAP_WORDS; word++) {
+            bitmap[word] |= other.bitmap[word];
+            count += __builtin_popcountl(bitmap[word]);
+        }
+        cardinality = count;
+    } else {
+        for (auto low: other.array) {
+            add(low);
+        }
+    }
+}
+
+void PostingList::Container::intersect(Container const& other) {
+    if (is_bitmap() && other.is_bitmap()) {
+        uint32_t count = 0;
+        for (int word = 0; word < BITMAP_WORDS; word++) {
+            bitmap[word] &= other.bitmap[word];
+            count += __builtin_popcountl(bitmap[word]);
+        }
+        cardinality = count;
+        optimize();
+        return;
+    }
+    if (is_bitmap()) {
+        // Result can't be larger than other's array
+        std::vector<uint16_t> result;
+        for (auto low: other.array) {
+            if (contains(low)) {
+                result.push_back(low);
+            }
+        }
+        std::vector<uint64_t>().swap(bitmap);
+        array.swap(result);
+    } else if (other.is_bitmap()) {
+        auto it = std::remove_if(array.begin(), array.end(), [&other](uint16_t low) {
+            return !other.contains(low);
+        });
+        array.erase(it, array.end());
+    } else {
+        std::vector<uint16_t> result;
+        std::set_intersection(array.begin(), array.end(), other.array.begin(), other.array.end(),
+                              std::back_inserter(result));
+        array.swap(result);
+    }
+    cardinality = static_cast<uint32_t>(array.size());
+}
+
+void PostingList::Container::get_ids(std::vector<uint64_t>* out) const {
+    uint64_t high = key << 16;
+    if (is_bitmap()) {
+        for (int word = 0; word < BITMAP_WORDS; word++) {
+            uint64_t bits = bitmap[word];
+            while (bits) {
+                out->push_back(high | static_cast<uint64_t>(word*64 + __builtin_ctzl(bits)));
+                bits &= bits - 1;
+            }
+        }
+    } else {
+        for (auto low: array) {
+            out->push_back(high | low);
+        }
+    }
+}
+
+void PostingList::add(uint64_t id) {
+    uint64_t key = id >> 16;
+    uint16_t low = static_cast<uint16_t>(id & 0xFFFF);
+    if (containers_.empty() || containers_.back().key < key) {
+        containers_.emplace_back(key);
+        containers_.back().add(low);
+        return;
+    }
+    auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                               [](Container const& c, uint64_t key) { return c.key < key; });
+    if (it == containers_.end() || it->key != key) {
+        it = containers_.insert(it, Container(key));
+    }
+    it->add(low);
+}
+
+bool PostingList::contains(uint64_t id) const {
+    uint64_t key = id >> 16;
+    auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                               [](Container const& c, uint64_t key) { return c.key < key; });
+    return it != containers_.end() && it->key == key && it->contains(static_cast<uint16_t>(id & 0xFFFF));
+}
+
+size_t PostingList::cardinality() const {
+    size_t result = 0;
+    for (auto const& c: containers_) {
+        result += c.cardinality;
+    }
+    return result;
+}
+
+void PostingList::unite(PostingList const& other) {
+    std::vector<Container> result;
+    result.reserve(containers_.size() + other.containers_.size());
+    auto lhs = containers_.begin();
+    auto rhs = other.containers_.begin();
+    while (lhs != containers_.end() || rhs != other.containers_.end()) {
+        if (rhs == other.containers_.end() || (lhs != containers_.end() && lhs->key < rhs->key)) {
+            result.push_back(std::move(*lhs++));
+        } else if (lhs == containers_.end() || rhs->key < lhs->key) {
+            result.push_back(*rhs++);
+        } else {
+            lhs->unite(*rhs++);
+            result.push_back(std::move(*lhs++));
+        }
+    }
+    containers_.swap(result);
+}
+
+void PostingList::intersect(PostingList const& other) {
+    std::vector<Container> result;
+    auto lhs = containers_.begin();
+    auto rhs = other.containers_.begin();
+    while (lhs != containers_.end() && rhs != other.containers_.end()) {
+        if (lhs->key < rhs->key) {
+            lhs++;
+        } else if (rhs->key < lhs->key) {
+            rhs++;
+        } else {
+            lhs->intersect(*rhs++);
+            if (lhs->cardinality != 0) {
+                result.push_back(std::move(*lhs));
+            }
+            lhs++;
+        }
+    }
+    containers_.swap(result);
+}
+
+void PostingList::get_ids(std::vector<uint64_t>* out) const {
+    out->reserve(out->size() + cardinality());
+    for (auto const& c: containers_) {
+        c.get_ids(out);
+    }
+}
+
+size_t PostingList::memory_use() const {
+    size_t result = sizeof(PostingList) + containers_.capacity()*sizeof(Container);
+    for (auto const& c: containers_) {
+        result += c.array.capacity()*sizeof(uint16_t) + c.bitmap.capacity()*sizeof(uint64_t);
+    }
+    return result;
+}
+
+
+//                          //
+//      Inverted Index      //
+//                          //
+
+void InvertedIndex::add(const char* begin, const char* end, uint64_t id) {
+    // Normal form: metric name followed by tags, separated by single space
+    auto metric_end = std::find(begin, end, ' ');
+    std::string tag = "metric=";
+    tag.append(begin, metric_end);
+    std::lock_guard<std::mutex> guard(mutex_);
+    index_[tag].add(id);
+    for (auto it = metric_end; it < end;) {
+        auto tag_begin = it + 1;
+        auto tag_end = std::find(tag_begin, end, ' ');
+        if (tag_begin < tag_end) {
+            tag.assign(tag_begin, tag_end);
+            index_[tag].add(id);
+        }
+        it = tag_end;
+    }
+}
+
+PostingList InvertedIndex::prefix_union_(std::string const& prefix) const {
+    PostingList result;
+    for (auto it = index_.lower_bound(prefix); it != index_.end(); it++) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0) {
+            break;
+        }
+        result.unite(it->second);
+    }
+    return result;
+}
+
+/** Recursive descent parser of the query expression.
+  * expr    := and_expr ('OR' and_expr)*
+  * and_expr:= primary ('AND' primary)*
+  * primary := '(' expr ')' | tag
+  */
+struct InvertedIndex::Parser {
+    InvertedIndex const& index;
+    const char* pos;
+    const char* end;
+    bool error;
+
+    void skip_space() {
+        while (pos < end && (*pos == ' ' || *pos == '\t')) {
+            pos++;
+        }
+    }
+
+    //! Get next token without consuming it
+    std::string peek() {
+        skip_space();
+        if (pos == end) {
+            return std::string();
+        }
+        if (*pos == '(' || *pos == ')') {
+            return std::string(pos, pos + 1);
+        }
+        auto p = pos;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '(' && *p != ')') {
+            p++;
+        }
+        return std::string(pos, p);
+    }
+
+    void consume(std::string const& token) {
+        skip_space();
+        pos += token.size();
+    }
+
+    PostingList primary() {
+        auto token = peek();
+        if (token == "(") {
+            consume(token);
+            auto result = expr();
+            if (peek() != ")") {
+                error = true;
+            } else {
+                consume(")");
+            }
+            return result;
+        }
+        auto eq = token.find('=');
+        if (token.empty() || eq == std::string::npos || eq == 0 || token == "AND" || token == "OR") {
+            error = true;
+            return PostingList();
+        }
+        consume(token);
+        if (token.back() == '*') {
+            return index.prefix_union_(token.substr(0, token.size() - 1));
+        }
+        auto it = index.index_.find(token);
+        return it == index.index_.end() ? PostingList() : it->second;
+    }
+
+    PostingList and_expr() {
+        auto result = primary();
+        while (!error && peek() == "AND") {
+            consume("AND");
+            auto rhs = primary();
+            result.intersect(rhs);
+        }
+        return result;
+    }
+
+    PostingList expr() {
+        auto result = and_expr();
+        while (!error && peek() == "OR") {
+            consume("OR");
+            auto rhs = and_expr();
+            result.unite(rhs);
+        }
+        return result;
+    }
+};
+
+aku_Status InvertedIndex::query(const char* expression, std::vector<uint64_t>* out) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Parser parser = { *this, expression, expression + strlen(expression), false };
+    auto result = parser.expr();
+    if (parser.error || !parser.peek().empty()) {
+        return AKU_EBAD_DATA;
+    }
+    result.get_ids(out);
+    return AKU_SUCCESS;
+}
+
+size_t InvertedIndex::memory_use() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    size_t result = 0;
+    for (auto const& kv: index_) {
+        result += kv.first.capacity() + kv.second.memory_use();
+    }
+    return result;
+}
+
+}
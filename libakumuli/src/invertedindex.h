@@ -0,0 +1,135 @@
+/**
+ * PRIVATE HEADER
+ *
+ * Inverted index of the series tags.
+ *
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+#include "akumuli.h"
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+
+namespace Akumuli {
+
+/** Compressed sorted list of ids (roaring bitmap).
+  * Ids are split into containers by the high bits (id >> 16). Container
+  * stores the low 16 bits of its ids as a sorted array if it has at most
+  * ARRAY_MAX_SIZE elements and as a bitmap (8KB) otherwise.
+  */
+class PostingList {
+public:
+    enum {
+        ARRAY_MAX_SIZE = 4096,
+        BITMAP_WORDS = 0x10000/64,
+    };
+
+    struct Container {
+        uint64_t              key;          //< High bits of the ids
+        uint32_t              cardinality;  //< Number of ids in container
+        std::vector<uint16_t> array;        //< Sorted low bits (if bitmap is empty)
+        std::vector<uint64_t> bitmap;       //< Low bits as a bitmap (BITMAP_WORDS words)
+
+        Container(uint64_t key);
+
+        bool is_bitmap() const;
+
+        bool contains(uint16_t low) const;
+
+        void add(uint16_t low);
+
+        //! Convert array to bitmap
+        void to_bitmap();
+
+        //! Convert bitmap to array (if cardinality is small enough)
+        void optimize();
+
+        void unite(Container const& other);
+
+        void intersect(Container const& other);
+
+        //! Append ids of the container to `out`
+        void get_ids(std::vector<uint64_t>* out) const;
+    };
+
+private:
+    std::vector<Container> containers_;  //< Sorted by key
+
+public:
+    //! Add id to the list
+    void add(uint64_t id);
+
+    bool contains(uint64_t id) const;
+
+    //! Number of ids in the list
+    size_t cardinality() const;
+
+    //! Add all ids of the other list to this one
+    void unite(PostingList const& other);
+
+    //! Remove ids that are not in the other list
+    void intersect(PostingList const& other);
+
+    //! Append sorted ids to `out`
+    void get_ids(std::vector<uint64_t>* out) const;
+
+    //! Amount of memory used by the list
+    size_t memory_use() const;
+};
+
+
+/** Inverted index of the series tags.
+  * Maps every tag (key=value pair) of the series name to the list of
+  * ids of the series with this tag. Metric name is indexed as tag with
+  * `metric` key. Thread safe.
+  */
+class InvertedIndex {
+    std::map<std::string, PostingList> index_;  //< Sorted by tag, prefix search uses this
+    mutable std::mutex mutex_;
+
+    //! Get union of the lists of the tags that start with `prefix` (mutex should be locked)
+    PostingList prefix_union_(std::string const& prefix) const;
+
+    struct Parser;
+public:
+    /** Add series to index.
+      * @param begin series name in normal form
+      * @param end end of the series name
+      * @param id series id
+      */
+    void add(const char* begin, const char* end, uint64_t id);
+
+    /** Find series that match the expression.
+      * Expression consists of tags combined by AND and OR operators
+      * (AND has higher precedence) and parentheses, tag value can end
+      * with `*` to match all values with this prefix. Example:
+      * "metric=cpu AND (host=web* OR host=db01)".
+      * @param expression query expression
+      * @param out sorted list of matching series ids
+      * @returns AKU_SUCCESS or AKU_EBAD_DATA if expression is malformed
+      */
+    aku_Status query(const char* expression, std::vector<uint64_t>* out) const;
+
+    //! Amount of memory used by posting lists
+    size_t memory_use() const;
+};
+
+}
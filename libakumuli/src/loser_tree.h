@@ -0,0 +1,174 @@
+/**
+ * PRIVATE HEADER
+ *
+ * Tournament tree for k-way merges.
+ *
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+#include "akumuli_def.h"
+
+namespace Akumuli {
+
+/** Merge order of the keys.
+  * `Less` defines forward order, direction is resolved at compile time.
+  */
+template<class Less, int dir>
+struct MergeOrder;
+
+template<class Less>
+struct MergeOrder<Less, AKU_CURSOR_DIR_FORWARD> {
+    Less less;
+    template<class T>
+    bool operator () (T const& lhs, T const& rhs) const {
+        return less(lhs, rhs);
+    }
+};
+
+template<class Less>
+struct MergeOrder<Less, AKU_CURSOR_DIR_BACKWARD> {
+    Less less;
+    template<class T>
+    bool operator () (T const& lhs, T const& rhs) const {
+        return less(rhs, lhs);
+    }
+};
+
+/** Tournament (loser) tree.
+  * Each input of the merge is a leaf, internal node stores index of the input
+  * that lost the match in this node and the winner is stored separately. When
+  * the key of the winner is replaced, matches are replayed only on the path from
+  * its leaf to the root, this takes log2(k) comparisons (binary heap needs up to
+  * two comparisons per level). Exhausted inputs lose every match.
+  * Order is passed to every modifying method so merge loops can be specialized
+  * on direction at compile time.
+  */
+template<class Key>
+class LoserTree {
+    std::vector<Key>    keys_;      //< Current key of each input
+    std::vector<char>   active_;    //< Input is not exhausted
+    std::vector<int>    losers_;    //< Loser of the match in the node (nodes 1..k-1, leaves k..2k-1)
+    int                 winner_;    //< Input that won the tournament
+
+    //! Returns true if input `lhs` wins the match with input `rhs`
+    template<class Order>
+    bool wins_(int lhs, int rhs, Order const& order) const {
+        if (!active_[rhs]) {
+            return true;
+        }
+        if (!active_[lhs]) {
+            return false;
+        }
+        return !order(keys_[rhs], keys_[lhs]);
+    }
+
+    //! Replay matches on the path from the leaf of the input to the root
+    template<class Order>
+    void replay_(int input, Order const& order) {
+        auto k = keys_.size();
+        int cur = input;
+        for (auto node = (input + k) / 2; node > 0; node /= 2) {
+            if (wins_(losers_[node], cur, order)) {
+                std::swap(losers_[node], cur);
+            }
+        }
+        winner_ = cur;
+    }
+
+public:
+    //! C-tor, all inputs are exhausted until keys are set
+    LoserTree(size_t k)
+        : keys_(k)
+        , active_(k, 0)
+        , losers_(k, 0)
+        , winner_(0)
+    {
+    }
+
+    //! Set first key of the input (before `build`)
+    void set(int input, Key const& key) {
+        keys_[input] = key;
+        active_[input] = 1;
+    }
+
+    //! Play the tournament, must be called after all first keys are set
+    template<class Order>
+    void build(Order const& order) {
+        auto k = keys_.size();
+        if (k == 0) {
+            return;
+        }
+        // Winners of the matches, leaves contain inputs
+        std::vector<int> winners(2*k);
+        for (size_t i = 0; i < k; i++) {
+            winners[k + i] = static_cast<int>(i);
+        }
+        for (auto node = k - 1; node > 0; node--) {
+            int lhs = winners[2*node];
+            int rhs = winners[2*node + 1];
+            if (wins_(lhs, rhs, order)) {
+                winners[node] = lhs;
+                losers_[node] = rhs;
+            } else {
+                winners[node] = rhs;
+                losers_[node] = lhs;
+            }
+        }
+        winner_ = k == 1 ? 0 : winners[1];
+    }
+
+    //! Returns true if all inputs are exhausted
+    bool empty() const {
+        return keys_.empty() || !active_[winner_];
+    }
+
+    //! Input with the smallest key (in merge order)
+    int winner() const {
+        return winner_;
+    }
+
+    //! Smallest key (in merge order)
+    Key const& top() const {
+        return keys_[winner_];
+    }
+
+    //! Replace smallest key with the next key of the same input
+    template<class Order>
+    void replace_top(Key const& key, Order const& order) {
+        keys_[winner_] = key;
+        replay_(winner_, order);
+    }
+
+    //! Remove smallest key, input of the key is exhausted
+    template<class Order>
+    void pop_top(Order const& order) {
+        active_[winner_] = 0;
+        replay_(winner_, order);
+    }
+
+    //! Mark all inputs as exhausted
+    void clear() {
+        std::fill(active_.begin(), active_.end(), 0);
+    }
+};
+
+}  // namespace Akumuli
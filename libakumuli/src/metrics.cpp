@@ -0,0 +1,158 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "metrics.h"
+
+#include <cstring>
+
+namespace Akumuli {
+
+uint32_t get_metrics_shard() {
+    static std::atomic<uint32_t> n_threads = {0};
+    static thread_local uint32_t shard = n_threads.fetch_add(1) % METRICS_NUM_SHARDS;
+    return shard;
+}
+
+//---------------------------------ShardedCounter----------------------------------
+
+ShardedCounter::ShardedCounter() {
+    for (auto& shard: shards_) {
+        shard.value = 0u;
+    }
+}
+
+uint64_t ShardedCounter::get(bool reset) {
+    uint64_t result = 0u;
+    for (auto& shard: shards_) {
+        result += reset ? shard.value.exchange(0u) : shard.value.load();
+    }
+    return result;
+}
+
+//--------------------------------LatencyHistogram---------------------------------
+
+LatencyHistogram::LatencyHistogram() {
+    for (auto& shard: shards_) {
+        shard.sum = 0u;
+        for (auto& bucket: shard.buckets) {
+            bucket = 0u;
+        }
+    }
+}
+
+int LatencyHistogram::bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return static_cast<int>(value);
+    }
+    // Position of the highest set bit selects the power of two range,
+    // next SUB_BUCKET_BITS bits select the bucket inside the range
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1)*SUB_BUCKETS + static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound(int index) {
+    int range = index / SUB_BUCKETS;
+    if (range == 0) {
+        return static_cast<uint64_t>(index);
+    }
+    uint64_t sub = static_cast<uint64_t>(index % SUB_BUCKETS);
+    uint64_t lower = (SUB_BUCKETS + sub) << (range - 1);
+    return lower + ((1ull << (range - 1)) - 1);
+}
+
+void LatencyHistogram::get_stats(aku_LatencyStats* stats, bool reset) {
+    uint64_t counts[NUM_BUCKETS] = {};
+    uint64_t sum = 0u;
+    for (auto& shard: shards_) {
+        sum += reset ? shard.sum.exchange(0u) : shard.sum.load();
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            counts[i] += reset ? shard.buckets[i].exchange(0u) : shard.buckets[i].load();
+        }
+    }
+    memset(stats, 0, sizeof(aku_LatencyStats));
+    for (auto count: counts) {
+        stats->count += count;
+    }
+    if (stats->count == 0) {
+        return;
+    }
+    stats->mean = sum / stats->count;
+    // Percentiles are taken in one pass, each one is a bucket
+    // that contains the element with corresponding rank
+    struct { double quantile; uint64_t* dest; } percentiles[] = {
+        { 0.5,   &stats->p50 },
+        { 0.9,   &stats->p90 },
+        { 0.99,  &stats->p99 },
+        { 0.999, &stats->p999 },
+    };
+    size_t next = 0;
+    const size_t npercentiles = sizeof(percentiles)/sizeof(percentiles[0]);
+    uint64_t rank = 0;
+    bool first = true;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        auto value = bucket_upper_bound(i);
+        if (first) {
+            stats->min = value;
+            first = false;
+        }
+        stats->max = value;
+        rank += counts[i];
+        while (next < npercentiles && rank >= percentiles[next].quantile*stats->count) {
+            *percentiles[next].dest = value;
+            next++;
+        }
+    }
+}
+
+//---------------------------------LatencyTimer------------------------------------
+
+LatencyTimer::LatencyTimer(LatencyHistogram* hist)
+    : hist_(hist)
+{
+    if (hist_) {
+        start_ = Clock::now();
+    }
+}
+
+LatencyTimer::~LatencyTimer() {
+    if (hist_) {
+        auto elapsed = Clock::now() - start_;
+        hist_->record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+}
+
+//-----------------------------------Metrics---------------------------------------
+
+LatencyHistogram* Metrics::sample_write() {
+    static thread_local uint32_t counter = 0u;
+    return counter++ % WRITE_SAMPLE_RATE == 0 ? &write : nullptr;
+}
+
+void Metrics::get_metrics(aku_Metrics* rcv_metrics, bool reset) {
+    write.get_stats(&rcv_metrics->write, reset);
+    checkpoint.get_stats(&rcv_metrics->checkpoint, reset);
+    flush.get_stats(&rcv_metrics->flush, reset);
+    query.get_stats(&rcv_metrics->query, reset);
+    rcv_metrics->n_writes = n_writes.get(reset);
+    rcv_metrics->n_write_errors = n_write_errors.get(reset);
+}
+
+}
@@ -0,0 +1,138 @@
+/**
+ * PRIVATE HEADER
+ *
+ * Hot path metrics
+ *
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "akumuli.h"
+
+namespace Akumuli {
+
+/** Index of the calling thread's counter shard.
+  * Threads get sequential indexes on first use, this way threads
+  * that record concurrently don't share cache lines (unless there
+  * is more than METRICS_NUM_SHARDS threads).
+  */
+uint32_t get_metrics_shard();
+
+//! Number of per-thread shards of the counters and histograms
+static const uint32_t METRICS_NUM_SHARDS = 16;
+
+
+//! Event counter, incremented without contention, summed up on read
+class ShardedCounter {
+    struct Shard {
+        std::atomic<uint64_t> value;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];  //< Shards are placed on different cache lines
+    };
+    Shard shards_[METRICS_NUM_SHARDS];
+public:
+    ShardedCounter();
+
+    void add(uint64_t n) {
+        shards_[get_metrics_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    //! Sum of all shards
+    uint64_t get(bool reset = false);
+};
+
+
+/** Latency histogram with log-linear buckets (HDR-style).
+  * Every power of two range is divided into SUB_BUCKETS buckets,
+  * relative error of the reported values is below 1/SUB_BUCKETS.
+  * Recording is two relaxed increments on the thread's own shard,
+  * shards are merged when histogram is read.
+  */
+class LatencyHistogram {
+public:
+    enum {
+        SUB_BUCKET_BITS = 3,
+        SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+        NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1)*SUB_BUCKETS,
+    };
+private:
+    struct Shard {
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> buckets[NUM_BUCKETS];
+        char padding[64];                                   //< Shards don't share cache lines
+    };
+    Shard shards_[METRICS_NUM_SHARDS];
+public:
+    LatencyHistogram();
+
+    //! Index of the bucket that holds value
+    static int bucket_index(uint64_t value);
+
+    //! Largest value that falls into bucket
+    static uint64_t bucket_upper_bound(int index);
+
+    //! Record latency in nanoseconds
+    void record(uint64_t nsec) {
+        auto& shard = shards_[get_metrics_shard()];
+        shard.buckets[bucket_index(nsec)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(nsec, std::memory_order_relaxed);
+    }
+
+    /** Merge all shards and compute percentiles.
+      * Values are reported with bucket precision.
+      */
+    void get_stats(aku_LatencyStats* stats, bool reset = false);
+};
+
+
+/** Records time between construction and destruction to histogram.
+  * Does nothing if histogram is null.
+  */
+class LatencyTimer {
+    typedef std::chrono::steady_clock Clock;
+    LatencyHistogram* hist_;
+    Clock::time_point start_;
+public:
+    explicit LatencyTimer(LatencyHistogram* hist);
+    ~LatencyTimer();
+};
+
+
+//! Storage metrics
+struct Metrics {
+    enum {
+        //! One out of WRITE_SAMPLE_RATE writes is timed (per thread)
+        WRITE_SAMPLE_RATE = 16,
+    };
+    LatencyHistogram write;             //< Write call latency (sampled)
+    LatencyHistogram checkpoint;        //< Sequencer checkpoint (merge and compress) duration
+    LatencyHistogram flush;             //< Group commit flush duration
+    LatencyHistogram query;             //< Time between query start and cursor close
+    ShardedCounter   n_writes;          //< Number of written values
+    ShardedCounter   n_write_errors;    //< Number of values that wasn't written
+
+    //! Returns write histogram if the calling thread's write should be timed or null
+    LatencyHistogram* sample_write();
+
+    //! Get latencies and counters (gauges are not set)
+    void get_metrics(aku_Metrics* rcv_metrics, bool reset = false);
+};
+
+}
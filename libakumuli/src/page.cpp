@@ -22,11 +22,14 @@
 #include <apr_time.h>
 #include "timsort.hpp"
 #include "page.h"
+#include "cursor.h"
 #include "compression.h"
 #include "akumuli_def.h"
 #include "search.h"
 
 #include <random>
+#include <limits>
+#include <cassert>
 #include <iostream>
 #include <boost/crc.hpp>
 
@@ -37,7 +40,7 @@ static SearchQuery::ParamMatch single_param_matcher(aku_ParamId a, aku_ParamId b
     if (a == b) {
         return SearchQuery::MATCH;
     }
-    return SearchQuery::NO_MATCH;
+    return b < a ? SearchQuery::LT_ALL : SearchQuery::GT_ALL;
 }
 
 SearchQuery::SearchQuery( aku_ParamId   param_id
@@ -48,6 +51,9 @@ SearchQuery::SearchQuery( aku_ParamId   param_id
     , upperbound(upp)
     , param_pred(std::bind(&single_param_matcher, param_id, std::placeholders::_1))
     , direction(scan_dir)
+    , id_set(std::make_shared<ParamIdSet>(std::vector<aku_ParamId>(1, param_id)))
+    , readahead(0u)
+    , limit(0u)
 {
 }
 
@@ -59,9 +65,287 @@ SearchQuery::SearchQuery(MatcherFn matcher
     , upperbound(upp)
     , param_pred(matcher)
     , direction(scan_dir)
+    , readahead(0u)
+    , limit(0u)
+{
+}
+
+SearchQuery::SearchQuery( std::vector<aku_ParamId> ids
+                        , aku_TimeStamp low
+                        , aku_TimeStamp upp
+                        , int           scan_dir)
+    : lowerbound(low)
+    , upperbound(upp)
+    , direction(scan_dir)
+    , id_set(std::make_shared<ParamIdSet>(std::move(ids)))
+    , readahead(0u)
+    , limit(0u)
+{
+    auto set = id_set;
+    param_pred = [set](aku_ParamId id) {
+        return set->match(id);
+    };
+}
+
+// ParamIdSet
+// ----------
+
+ParamIdSet::ParamIdSet(std::vector<aku_ParamId> ids)
+    : ids_(std::move(ids))
+    , min_(0u)
+    , max_(0u)
+{
+    std::sort(ids_.begin(), ids_.end());
+    ids_.erase(std::unique(ids_.begin(), ids_.end()), ids_.end());
+    if (!ids_.empty()) {
+        min_ = ids_.front();
+        max_ = ids_.back();
+        uint64_t range = max_ - min_ + 1;
+        if (ids_.size() > SMALL_SET && range <= BITS_PER_ID*ids_.size()) {
+            bitmap_.resize((range + 63) / 64);
+            for (auto id: ids_) {
+                auto off = id - min_;
+                bitmap_[off >> 6] |= 1ull << (off & 63);
+            }
+        }
+    }
+}
+
+std::vector<aku_ParamId> const& ParamIdSet::get_ids() const {
+    return ids_;
+}
+
+bool ParamIdSet::is_bitmap() const {
+    return !bitmap_.empty();
+}
+
+void ParamIdSet::match_block(const aku_ParamId* ids, size_t n, unsigned char* out) const {
+    if (ids_.empty()) {
+        std::fill(out, out + n, 0);
+        return;
+    }
+    // Loops are branchless (except the binary search) to let the compiler vectorize them
+    if (!bitmap_.empty()) {
+        const uint64_t range = max_ - min_;
+        const uint64_t* bits = bitmap_.data();
+        for (size_t i = 0; i < n; i++) {
+            uint64_t off = ids[i] - min_;  // ids less than min_ wrap around
+            uint64_t in_range = off <= range;
+            uint64_t word = bits[(off & -in_range) >> 6];
+            out[i] = static_cast<unsigned char>(in_range & (word >> (off & 63)));
+        }
+    } else if (ids_.size() <= SMALL_SET) {
+        const auto nids = ids_.size();
+        const aku_ParamId* set = ids_.data();
+        for (size_t i = 0; i < n; i++) {
+            unsigned char found = 0;
+            for (size_t j = 0; j < nids; j++) {
+                found |= ids[i] == set[j];
+            }
+            out[i] = found;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = ids[i] >= min_ && ids[i] <= max_ && std::binary_search(ids_.begin(), ids_.end(), ids[i]);
+        }
+    }
+}
+
+// Aggregator
+// ----------
+
+Aggregator::Value::Value()
+    : count(0u)
+    , sum(0.0)
+    , min(std::numeric_limits<double>::max())
+    , max(-std::numeric_limits<double>::max())
 {
 }
 
+void Aggregator::Value::add(double value) {
+    count++;
+    sum += value;
+    min = std::min(min, value);
+    max = std::max(max, value);
+}
+
+void Aggregator::Value::merge(Value const& other) {
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+}
+
+Aggregator::Aggregator(aku_Duration width)
+    : width_(width)
+{
+    assert(width_ != 0u);
+    for (auto& slot: cache_) {
+        slot.second = ~0ul;
+    }
+}
+
+size_t Aggregator::get_bucket_(Key const& key) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        return it->second;
+    }
+    values_.push_back(Value());
+    index_.insert(std::make_pair(key, values_.size() - 1));
+    return values_.size() - 1;
+}
+
+void Aggregator::add(Key const& key, Value const& value) {
+    Key bucket(key.first - key.first % width_, key.second);
+    values_[get_bucket_(bucket)].merge(value);
+}
+
+void Aggregator::merge(Aggregator const& other) {
+    for (auto const& kv: other.index_) {
+        add(kv.first, other.values_[kv.second]);
+    }
+}
+
+std::vector<std::pair<Aggregator::Key, Aggregator::Value>> Aggregator::get_results(int direction) const {
+    std::vector<std::pair<Key, Value>> results;
+    results.reserve(index_.size());
+    for (auto const& kv: index_) {
+        results.push_back(std::make_pair(kv.first, values_[kv.second]));
+    }
+    if (direction == AKU_CURSOR_DIR_BACKWARD) {
+        // Buckets are sorted by timestamp in reverse order, param ids are always sorted
+        std::stable_sort(results.begin(), results.end(),
+            [](std::pair<Key, Value> const& lhs, std::pair<Key, Value> const& rhs) {
+                return lhs.first.first > rhs.first.first;
+            });
+    }
+    return results;
+}
+
+// Page index model
+// ----------------
+
+void PageModel::reset() {
+    size = 0;
+    last = PageModelKnot();
+    start_segment_();
+}
+
+void PageModel::start_segment_() {
+    // Page index grows with timestamp, slope can't be negative
+    slope_lo = 0.0;
+    slope_hi = std::numeric_limits<double>::max();
+}
+
+void PageModel::push_knot_(PageModelKnot knot) {
+    if (size < AKU_PAGE_MODEL_SIZE) {
+        knots[size++] = knot;
+    }
+    // Otherwise the last segment grows without error guarantee, this is
+    // fine because predicted range is always checked by the search algorithm.
+}
+
+bool PageModel::extend_(PageModelKnot point) {
+    auto const& origin = knots[size - 1];
+    if (point.timestamp < last.timestamp) {
+        return false;
+    }
+    uint32_t di = point.index - origin.index;
+    if (point.timestamp == origin.timestamp) {
+        // All entries of the segment have the same timestamp, any line that
+        // starts from origin predicts origin's index for them
+        return di <= AKU_PAGE_MODEL_ERROR;
+    }
+    double dt = static_cast<double>(point.timestamp - origin.timestamp);
+    double slope = di / dt;
+    if (slope < slope_lo || slope > slope_hi) {
+        return false;
+    }
+    // Line from origin to any subsequent entry should be within error bound from this entry
+    slope_lo = std::max(slope_lo, (static_cast<double>(di) - AKU_PAGE_MODEL_ERROR) / dt);
+    slope_hi = std::min(slope_hi, (static_cast<double>(di) + AKU_PAGE_MODEL_ERROR) / dt);
+    return true;
+}
+
+void PageModel::add(aku_TimeStamp timestamp, uint32_t index) {
+    PageModelKnot point = { timestamp, index };
+    if (size == 0) {
+        push_knot_(point);
+        start_segment_();
+        last = point;
+        return;
+    }
+    if (!extend_(point)) {
+        // Close open segment at the last added entry and start new one
+        if (last.index != knots[size - 1].index) {
+            push_knot_(last);
+        }
+        start_segment_();
+        if (!extend_(point)) {
+            // Timestamps are out of order or too many duplicates
+            push_knot_(point);
+        }
+    }
+    last = point;
+}
+
+uint32_t PageModel::truncate(uint32_t count) {
+    if (size != 0 && knots[size - 1].index < count && last.index + 1 == count) {
+        // Model covers all entries
+        return count;
+    }
+    // Knot can be added because of the next entry, the segment that ends
+    // at the entry `count - 1` should be reopened
+    while (size != 0 && knots[size - 1].index + 1 >= count) {
+        size--;
+    }
+    if (size == 0) {
+        reset();
+        return 0u;
+    }
+    last = knots[size - 1];
+    start_segment_();
+    return last.index + 1;
+}
+
+bool PageModel::predict(aku_TimeStamp key, uint32_t* begin, uint32_t* end) const {
+    if (size == 0) {
+        return false;
+    }
+    // Model points are closed knots followed by the end of the open segment
+    uint32_t npoints = last.index != knots[size - 1].index ? size + 1 : size;
+    auto point_at = [this](uint32_t ix) -> PageModelKnot const& {
+        return ix < size ? knots[ix] : last;
+    };
+    // Find first point with timestamp greater than key
+    uint32_t lo = 0, hi = npoints;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (point_at(mid).timestamp <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        *end = point_at(0).index;
+        return true;
+    }
+    if (lo == npoints) {
+        *begin = point_at(npoints - 1).index;
+        return true;
+    }
+    auto const& a = point_at(lo - 1);
+    auto const& b = point_at(lo);
+    auto pred = a.index + static_cast<uint32_t>(static_cast<double>(key - a.timestamp) * (b.index - a.index)
+                                                / static_cast<double>(b.timestamp - a.timestamp));
+    // Entries that surround key lie within error bound (plus one) from predicted position
+    const uint32_t margin = AKU_PAGE_MODEL_ERROR + 1;
+    *begin = std::max(a.index, pred > a.index + margin ? pred - margin : a.index);
+    *end = std::min(b.index, pred + margin + 1);
+    return true;
+}
+
 // Page
 // ----
 
@@ -93,8 +377,9 @@ PageHeader::PageHeader(uint32_t count, uint64_t length, uint32_t page_id)
     , length(length)
     , bbox()
 {
-    // zero out histogram
-    memset(&histogram, 0, sizeof(histogram));
+    // zero out index model
+    memset(&model, 0, sizeof(model));
+    model.reset();
 }
 
 std::pair<aku_EntryOffset, int> PageHeader::index_to_offset(uint32_t index) const {
@@ -145,7 +430,7 @@ void PageHeader::reuse() {
     open_count++;
     last_offset = length - 1;
     bbox = PageBoundingBox();
-    histogram.size = 0;
+    model.reset();
 }
 
 void PageHeader::close() {
@@ -179,7 +464,10 @@ int PageHeader::add_entry( const aku_ParamId param
     last_offset = free_slot - cdata();
     page_index[count] = last_offset;
     count++;
-    update_bounding_box(param, timestamp);
+    if (param < AKU_ID_COMPRESSED) {
+        update_bounding_box(param, timestamp);
+    }
+    // Bounding box of the compressed chunk is updated in complete_chunk
     return AKU_WRITE_STATUS_SUCCESS;
 }
 
@@ -192,26 +480,70 @@ int PageHeader::add_chunk(const aku_MemRange range, const uint32_t free_space_re
     }
     char* free_slot = data() + last_offset;
     free_slot -= SPACE_NEEDED;
-    memcpy((void*)free_slot, range.address, SPACE_NEEDED);
+    if (free_slot != range.address) {
+        // Range can be inside the free space (see EncodedChunk::encode)
+        memmove((void*)free_slot, range.address, SPACE_NEEDED);
+    }
     last_offset = free_slot - cdata();
     return AKU_SUCCESS;
 }
 
+aku_MemRange PageHeader::get_chunk_space() {
+    const size_t entries_space = 2*(sizeof(aku_Entry) + sizeof(ChunkDesc) + sizeof(aku_EntryOffset));
+    auto free_space = get_free_space();
+    uint32_t size = free_space > entries_space ? static_cast<uint32_t>(free_space - entries_space) : 0u;
+    aku_MemRange range = { data() + last_offset - size, size };
+    return range;
+}
+
+namespace {
+
+//! Writes compressed chunk directly to the page
+struct PageChunkWriter : ChunkWriter {
+    PageHeader *header;
+    PageChunkWriter(PageHeader *h) : header(h) {}
+    virtual aku_Status add_chunk(aku_MemRange range, size_t size_estimate) {
+        return header->add_chunk(range, size_estimate);
+    }
+};
+
+}
+
 int PageHeader::complete_chunk(const ChunkHeader& data) {
+    // Compressed data is written directly to the free space
+    EncodedChunk encoded;
+    encoded.encode(data, AKU_CHUNK_BASE128, get_chunk_space());
+    return complete_chunk(data, encoded);
+}
+
+int PageHeader::complete_chunk(const ChunkHeader& data, const EncodedChunk& encoded) {
     ChunkDesc desc;
-    Rand rand;
-    aku_TimeStamp first_ts;
-    aku_TimeStamp last_ts;
-    struct Writer : ChunkWriter {
-        PageHeader *header;
-        Writer(PageHeader *h) : header(h) {}
-        virtual aku_Status add_chunk(aku_MemRange range, size_t size_estimate) {
-            return header->add_chunk(range, size_estimate);
-        }
-    } writer(this);
+    desc.n_elements = encoded.n_elements;
+    desc.encoding = encoded.encoding;
+    PageChunkWriter writer(this);
 
-    // Write compressed data
-    aku_Status status = CompressionUtil::encode_chunk(&desc.n_elements, &first_ts, &last_ts, &writer, data);
+    // Copy compressed data
+    aku_Status status = encoded.write_to(&writer);
+    return complete_chunk_(data, encoded.filter, status, desc, encoded.ts_begin, encoded.ts_end);
+}
+
+int PageHeader::complete_chunk_(const ChunkHeader& data,
+                                const ByteVector& filter,
+                                aku_Status status,
+                                ChunkDesc& desc,
+                                aku_TimeStamp first_ts,
+                                aku_TimeStamp last_ts)
+{
+    // Write param id filter before compressed data, filter is optional and
+    // isn't written if there is not enough space for it
+    desc.filter_size = 0u;
+    if (status == AKU_SUCCESS) {
+        const uint32_t entries_space = 2*(sizeof(aku_Entry) + sizeof(ChunkDesc) + sizeof(aku_EntryOffset));
+        aku_MemRange range = {const_cast<unsigned char*>(filter.data()), static_cast<uint32_t>(filter.size())};
+        if (!filter.empty() && add_chunk(range, entries_space) == AKU_SUCCESS) {
+            desc.filter_size = static_cast<uint32_t>(filter.size());
+        }
+    }
 
     // Calculate checksum of the new compressed data
     boost::crc_32_type checksum;
@@ -230,23 +562,87 @@ int PageHeader::complete_chunk(const ChunkHeader& data) {
     desc.checksum = checksum.checksum();
     desc.begin_offset = begin;
     desc.end_offset = end;
+    desc.min_timestamp = first_ts;
+    desc.max_timestamp = last_ts;
+    desc.min_id = 0u;
+    desc.max_id = AKU_ID_COMPRESSED - 1;
+    if (!data.paramids.empty()) {
+        auto minmax = std::minmax_element(data.paramids.begin(), data.paramids.end());
+        desc.min_id = *minmax.first;
+        desc.max_id = *minmax.second;
+    }
     aku_MemRange head;
     head = {&desc, sizeof(desc)};
     status = add_entry(AKU_CHUNK_BWD_ID, first_ts, head);
     if (status != AKU_SUCCESS) {
         return status;
     }
-    sync_next_index(last_offset, rand(), false);
+    sync_next_index(last_offset);
     status = add_entry(AKU_CHUNK_FWD_ID, last_ts, head);
     if (status != AKU_SUCCESS) {
         return status;
     }
-    sync_next_index(last_offset, rand(), false);
-    // Sort histogram
-    sync_next_index(0, 0, true);
+    sync_next_index(last_offset);
+    // Update bounding box using real param ids instead of chunk ids
+    if (!data.paramids.empty()) {
+        update_bounding_box(desc.min_id, first_ts);
+        update_bounding_box(desc.max_id, last_ts);
+    }
     return status;
 }
 
+uint32_t PageHeader::recover() {
+    // Page index entries goes in pairs (BWD and FWD entries of the same chunk),
+    // chunk data is placed right before the previous chunk.
+    uint32_t valid = std::min(checkpoint, count);
+    while (valid + 1 < count) {
+        uint64_t index_end = reinterpret_cast<const char*>(page_index + count) - cdata();
+        uint64_t prev_end = valid == 0 ? length - 1 : page_index[valid - 1];
+        uint64_t bwd_offset = page_index[valid];
+        uint64_t fwd_offset = page_index[valid + 1];
+        if (fwd_offset < index_end || fwd_offset >= bwd_offset || bwd_offset + sizeof(aku_Entry) > prev_end) {
+            break;
+        }
+        auto bwd = read_entry(static_cast<aku_EntryOffset>(bwd_offset));
+        auto fwd = read_entry(static_cast<aku_EntryOffset>(fwd_offset));
+        auto desc_size = bwd->length;
+        uint64_t entry_size = sizeof(aku_Entry) + desc_size;
+        if ((desc_size != sizeof(ChunkDesc) && desc_size != AKU_CHUNK_DESC_NOENCODING_SIZE &&
+             desc_size != AKU_CHUNK_DESC_NOFILTER_SIZE && desc_size != AKU_CHUNK_DESC_NOSUMMARY_SIZE) ||
+            fwd_offset + entry_size != bwd_offset || bwd_offset + entry_size > prev_end)
+        {
+            break;
+        }
+        if (bwd->param_id != AKU_CHUNK_BWD_ID || fwd->param_id != AKU_CHUNK_FWD_ID ||
+            fwd->length != desc_size || memcmp(bwd->value, fwd->value, desc_size) != 0)
+        {
+            break;
+        }
+        ChunkDesc desc = {};
+        memcpy(&desc, bwd->value, desc_size);
+        if (desc.end_offset != prev_end || desc.begin_offset != bwd_offset + entry_size) {
+            break;
+        }
+        boost::crc_32_type checksum;
+        checksum.process_block(cdata() + desc.begin_offset, cdata() + desc.end_offset);
+        if (checksum.checksum() != desc.checksum) {
+            break;
+        }
+        valid += 2;
+    }
+    uint32_t removed = count - valid;
+    count = valid;
+    sync_count = valid;
+    checkpoint = valid;
+    last_offset = valid == 0 ? static_cast<uint32_t>(length - 1) : page_index[valid - 1];
+    // Model can refer to removed entries or miss some entries if the header
+    // wasn't flushed completely, only the open segment is rebuilt
+    for (auto ix = model.truncate(valid); ix < valid; ix++) {
+        model.add(read_entry_at(ix)->time, ix);
+    }
+    return removed;
+}
+
 const aku_Entry *PageHeader::read_entry_at(uint32_t index) const {
     if (index < count) {
         auto offset = page_index[index];
@@ -320,15 +716,59 @@ static bool validate_query(SearchQuery const& query) {
     return true;
 }
 
-SearchStats& get_global_search_stats() {
-    static SearchStats stats;
+SearchStats::SearchStats() {
+    for (auto& counter: counters_) {
+        counter = 0u;
+    }
+}
+
+void SearchStats::add(aku_SearchStats const& stats) {
+    static_assert(sizeof(aku_SearchStats) % sizeof(uint64_t) == 0, "aku_SearchStats should contain only counters");
+    uint64_t values[NCOUNTERS];
+    memcpy(values, &stats, sizeof(values));
+    for (int i = 0; i < NCOUNTERS; i++) {
+        if (values[i]) {
+            counters_[i].fetch_add(values[i], std::memory_order_relaxed);
+        }
+    }
+}
+
+void SearchStats::get(aku_SearchStats* stats, bool reset) {
+    uint64_t values[NCOUNTERS];
+    for (int i = 0; i < NCOUNTERS; i++) {
+        values[i] = reset ? counters_[i].exchange(0u, std::memory_order_relaxed)
+                          : counters_[i].load(std::memory_order_relaxed);
+    }
+    memcpy(stats, values, sizeof(values));
+}
+
+void GlobalSearchStats::add(aku_SearchStats const& stats) {
+    shards_[get_metrics_shard()].stats.add(stats);
+}
+
+void GlobalSearchStats::get(aku_SearchStats* stats, bool reset) {
+    memset(stats, 0, sizeof(aku_SearchStats));
+    auto out = reinterpret_cast<uint64_t*>(stats);
+    for (auto& shard: shards_) {
+        aku_SearchStats part;
+        shard.stats.get(&part, reset);
+        auto in = reinterpret_cast<const uint64_t*>(&part);
+        for (size_t i = 0; i < sizeof(aku_SearchStats)/sizeof(uint64_t); i++) {
+            out[i] += in[i];
+        }
+    }
+}
+
+GlobalSearchStats& get_global_search_stats() {
+    static GlobalSearchStats stats;
     return stats;
 }
 
 namespace {
     struct ChunkHeaderSearcher : InterpolationSearch<ChunkHeaderSearcher> {
         ChunkHeader const& header;
-        ChunkHeaderSearcher(ChunkHeader const& h) : header(h) {}
+        aku_SearchStats& stats;
+        ChunkHeaderSearcher(ChunkHeader const& h, aku_SearchStats& s) : header(h), stats(s) {}
 
         // Interpolation search supporting functions
         bool read_at(aku_TimeStamp* out_timestamp, uint32_t ix) const {
@@ -343,33 +783,118 @@ namespace {
             return false;
         }
 
-        SearchStats& get_search_stats() {
-            return get_global_search_stats();
+        aku_SearchStats& get_search_stats() {
+            return stats;
         }
     };
 }
 
-struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
+/** Page search algorithm (direction independent part).
+  * Search state is stored explicitly, `read` resumes the scan at the
+  * entry (or at the element of the decoded chunk) where the previous
+  * call stopped and fills caller's buffer in a loop.
+  */
+struct SearchAlgorithm
+{
+    //! Search state
+    enum State {
+        START,      //< Search is not started
+        SCAN,       //< Page index is scanned, probe_index_ points to the next entry
+        CHUNK,      //< Elements of the decoded chunk are sent to the output
+        DONE,       //< Search is completed or failed
+    };
+
+    State    state_;
+    int      error_code_;
+
+    //! Partially consumed chunk
+    ChunkCache::PChunk chunk_;
+
+    SearchAlgorithm()
+        : state_(START)
+        , error_code_(AKU_SUCCESS)
+    {
+    }
+
+    virtual ~SearchAlgorithm() {}
+
+    virtual int read_columns(CursorColumns const& columns, int buf_len) = 0;
+
+    virtual int read(CursorResult* buf, int buf_len) = 0;
+};
+
+/** Page search specialized on direction.
+  * Direction is selected once per query, scan loops don't check it.
+  */
+template<int DIR>
+struct DirectedSearch : SearchAlgorithm, InterpolationSearch<DirectedSearch<DIR>>
 {
     PageHeader const* page_;
-    Caller& caller_;
-    InternalCursor* cursor_;
     SearchQuery query_;
 
     const uint32_t MAX_INDEX_;
-    const bool IS_BACKWARD_;
+    static constexpr bool IS_BACKWARD_ = DIR == AKU_CURSOR_DIR_BACKWARD;
+    //! Index entry of the chunk that can be read in this direction
+    static constexpr aku_ParamId CHUNK_ID_ = IS_BACKWARD_ ? AKU_CHUNK_BWD_ID : AKU_CHUNK_FWD_ID;
+    //! Max number of ids checked against chunk filter
+    enum { MAX_FILTER_PROBES = 0x100 };
     const aku_TimeStamp key_;
 
     SearchRange range_;
 
-    SearchAlgorithm(PageHeader const* page, Caller& caller, InternalCursor* cursor, SearchQuery query)
+    //! Entries are placed from high to low addresses, forward scan goes down in memory
+    Readahead readahead_;
+
+    //! Param id match results for the decoded chunk
+    std::vector<unsigned char> match_mask_;
+
+    //! Aggregator that receives double values instead of cursor (optional)
+    Aggregator* aggregator_;
+
+    //! Number of results sent to output
+    uint64_t n_results_;
+
+    uint32_t probe_index_;          //< Index of the next entry to scan
+
+    // Partially consumed chunk
+    size_t   chunk_lo_;             //< First element of the chunk inside the time range
+    size_t   chunk_hi_;             //< Last element of the chunk inside the time range + 1
+    size_t   chunk_pos_;            //< Next element (forward) or next element + 1 (backward)
+    size_t   chunk_ix_value_;       //< Index of the double value of the element at chunk_pos_
+    size_t   chunk_ix_int_;         //< Index of the integer value of the element at chunk_pos_
+    bool     chunk_proceed_;        //< Scan should proceed when chunk is consumed
+    bool     chunk_doubles_;        //< All elements of the chunk are doubles (value index = element index)
+
+    // Output columns
+    CursorColumns out_;
+    int           out_len_;
+    int           out_pos_;
+
+    //! Buffer used to convert output columns to results
+    ColumnBuffer  rows_;
+
+    //! Counters of this search, published when the search is destroyed
+    aku_SearchStats stats_;
+
+    DirectedSearch(PageHeader const* page, SearchQuery query, Aggregator* aggregator, uint32_t max_count)
         : page_(page)
-        , caller_(caller)
-        , cursor_(cursor)
         , query_(query)
-        , MAX_INDEX_(page->sync_count)
-        , IS_BACKWARD_(query.direction == AKU_CURSOR_DIR_BACKWARD)
+        , MAX_INDEX_(std::min(page->sync_count, max_count))
         , key_(IS_BACKWARD_ ? query.upperbound : query.lowerbound)
+        , readahead_(page->cdata(), page->length, query.readahead, !IS_BACKWARD_)
+        , aggregator_(aggregator)
+        , n_results_(0u)
+        , probe_index_(0u)
+        , chunk_lo_(0u)
+        , chunk_hi_(0u)
+        , chunk_pos_(0u)
+        , chunk_ix_value_(0u)
+        , chunk_ix_int_(0u)
+        , chunk_proceed_(false)
+        , chunk_doubles_(false)
+        , out_()
+        , out_len_(0)
+        , out_pos_(0)
     {
         if (MAX_INDEX_) {
             range_.begin = 0u;
@@ -378,16 +903,28 @@ struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
             range_.begin = 0u;
             range_.end = 0u;
         }
+        memset(&stats_, 0, sizeof(stats_));
+    }
+
+    ~DirectedSearch() {
+        get_global_search_stats().add(stats_);
+        if (query_.stats) {
+            query_.stats->add(stats_);
+        }
+    }
+
+    void set_error(int error_code) {
+        error_code_ = error_code;
+        state_ = DONE;
     }
 
     bool fast_path() {
         if (!MAX_INDEX_) {
-            cursor_->complete(caller_);
             return true;
         }
 
         if (!validate_query(query_)) {
-            cursor_->set_error(caller_, AKU_SEARCH_EBAD_ARG);
+            set_error(AKU_SEARCH_EBAD_ARG);
             return true;
         }
 
@@ -399,7 +936,6 @@ struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
                     return false;
                 } else {
                     // return empty result
-                    cursor_->complete(caller_);
                     return true;
                 }
             }
@@ -409,7 +945,6 @@ struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
                     return false;
                 } else {
                     // return empty result
-                    cursor_->complete(caller_);
                     return true;
                 }
             }
@@ -417,25 +952,22 @@ struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
         return false;
     }
 
-    void histogram() {
-        auto const& h = page_->histogram;
-        auto pred = [](PageHistogramEntry const& a, PageHistogramEntry const& b) {
-            return a.timestamp < b.timestamp;
-        };
-        PageHistogramEntry hkey = { key_, 0 };
-        auto begin = h.entries;
-        auto end = begin + h.size;
-        auto upper = std::upper_bound(begin, end, hkey, pred);
-        auto lower = std::lower_bound(begin, end, hkey, pred);
-        if (lower != end) {
-            if (lower != begin && lower->timestamp > hkey.timestamp) {
-                lower--;
-            }
-            range_.begin = lower->index;
+    //! Narrow search range using page index model
+    void model() {
+        SearchRange range = range_;
+        if (!page_->model.predict(key_, &range.begin, &range.end)) {
+            return;
         }
-        if (upper != end) {
-            range_.end = upper->index;
+        // Model is never trusted blindly, entries from the page are checked
+        aku_TimeStamp begin_ts, end_ts;
+        if (range.begin > range.end || range.end >= MAX_INDEX_ ||
+            !read_at(&begin_ts, range.begin) || !read_at(&end_ts, range.end) ||
+            (range.begin != range_.begin && begin_ts > key_) ||
+            (range.end != range_.end && end_ts < key_))
+        {
+            return;
         }
+        range_ = range;
     }
 
     // Interpolation search supporting functions
@@ -454,13 +986,13 @@ struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
         return b == e;
     }
 
-    SearchStats& get_search_stats() {
-        return get_global_search_stats();
+    aku_SearchStats& get_search_stats() {
+        return stats_;
     }
 
     bool interpolation() {
-        if (!run(key_, &range_)) {
-            cursor_->set_error(caller_, AKU_ENOT_FOUND);
+        if (!this->run(key_, &range_)) {
+            set_error(AKU_ENOT_FOUND);
             return false;
         }
         return true;
@@ -476,7 +1008,7 @@ struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
             steps++;
             probe_index = range_.begin + ((range_.end - range_.begin) / 2u);
             if (probe_index >= MAX_INDEX_) {
-                cursor_->set_error(caller_, AKU_EOVERFLOW);
+                set_error(AKU_EOVERFLOW);
                 range_.begin = range_.end = MAX_INDEX_;
                 return;
             }
@@ -501,205 +1033,473 @@ struct SearchAlgorithm : InterpolationSearch<SearchAlgorithm>
         range_.begin = probe_index;
         range_.end = probe_index;
 
-        auto& stats = get_global_search_stats();
-        std::lock_guard<std::mutex> guard(stats.mutex);
-        auto& bst = stats.stats.bstats;
-        bst.n_times += 1;
-        bst.n_steps += steps;
+        stats_.bstats.n_times += 1;
+        stats_.bstats.n_steps += steps;
     }
 
-    bool scan_compressed_entries(aku_Entry const* probe_entry, bool binary_search=false)
-    {
-        ChunkHeader header;
+    //! Find first entry of interest, called before the first result is produced
+    void start() {
+        state_ = DONE;
+        if (fast_path()) {
+            return;
+        }
+        model();
+        if (!interpolation()) {
+            return;
+        }
+        binary_search();
+        if (error_code_ != AKU_SUCCESS) {
+            return;
+        }
+        if (range_.begin != range_.end) {
+            set_error(AKU_EGENERAL);
+            return;
+        }
+        if (range_.begin >= MAX_INDEX_) {
+            set_error(AKU_EOVERFLOW);
+            return;
+        }
+        probe_index_ = range_.begin;
+        state_ = SCAN;
+    }
 
-        auto pdesc = reinterpret_cast<ChunkDesc const*>(&probe_entry->value[0]);
-        auto pbegin = (const unsigned char*)(page_->cdata() + pdesc->begin_offset);
-        auto pend = (const unsigned char*)(page_->cdata() + pdesc->end_offset);
-        auto probe_length = pdesc->n_elements;
+    //! Complete the scan
+    void finish() {
+        state_ = DONE;
+        chunk_.reset();
+        stats_.scan.n_readahead += readahead_.get_advised();
+        stats_.scan.n_readahead_resident += readahead_.get_resident();
+    }
 
-        // TODO:checksum!
-        boost::crc_32_type checksum;
-        checksum.process_block(pbegin, pend);
-        if (checksum.checksum() != pdesc->checksum) {
-            AKU_PANIC("File damaged!");
-            // TODO: report error
+    //! Write result to output columns, returns false if search should be stopped
+    bool put(CursorResult const& result) {
+        out_.timestamps[out_pos_] = result.timestamp;
+        out_.params[out_pos_] = result.param_id;
+        out_.pointers[out_pos_] = result.data;
+        out_.lengths[out_pos_] = result.length;
+        out_pos_++;
+        n_results_++;
+        return query_.limit == 0u || n_results_ < query_.limit;
+    }
+
+    //! Max output position that doesn't exceed the limit
+    int output_end() const {
+        if (query_.limit == 0u || query_.limit - n_results_ >= static_cast<uint64_t>(out_len_ - out_pos_)) {
+            return out_len_;
+        }
+        return out_pos_ + static_cast<int>(query_.limit - n_results_);
+    }
+
+    //! Check chunk summary, returns false if chunk doesn't contain data of interest
+    bool chunk_overlaps(ChunkDesc const& desc) const {
+        if (desc.max_timestamp < query_.lowerbound || desc.min_timestamp > query_.upperbound) {
+            return false;
+        }
+        // Matcher can tell that all ids in range are less (or greater) than all values of interest
+        if (query_.match(desc.max_id) == SearchQuery::LT_ALL ||
+            query_.match(desc.min_id) == SearchQuery::GT_ALL)
+        {
             return false;
         }
+        return desc.min_id != desc.max_id || query_.match(desc.min_id) == SearchQuery::MATCH;
+    }
 
-        // read timestamps
-        CompressionUtil::decode_chunk(&header, &pbegin, pend, 0, 1, probe_length);
+    //! Check chunk's param id filter, returns false if chunk doesn't contain ids of interest
+    bool filter_matches(ChunkDesc const& desc) const {
+        // Only ids inside chunk's range are checked
+        if (!query_.id_set) {
+            return true;
+        }
+        auto const& ids = query_.id_set->get_ids();
+        auto begin = std::lower_bound(ids.begin(), ids.end(), desc.min_id);
+        auto end = std::upper_bound(begin, ids.end(), desc.max_id);
+        if (end - begin > MAX_FILTER_PROBES) {
+            return true;
+        }
+        auto filter = reinterpret_cast<const unsigned char*>(page_->cdata() + desc.begin_offset);
+        for (auto it = begin; it != end; it++) {
+            if (ParamIdFilter::may_contain(filter, desc.filter_size, *it)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Decode compressed chunk and prepare its elements for output.
+      * State is changed to CHUNK if chunk contains elements of interest.
+      * @returns true if scan should proceed after the chunk
+      */
+    bool open_chunk(aku_Entry const* probe_entry)
+    {
+        auto pdesc = reinterpret_cast<ChunkDesc const*>(&probe_entry->value[0]);
+        bool has_summary = probe_entry->length >= AKU_CHUNK_DESC_NOFILTER_SIZE;
+        bool has_filter = probe_entry->length >= AKU_CHUNK_DESC_NOENCODING_SIZE && pdesc->filter_size != 0;
+        auto encoding = probe_entry->length >= sizeof(ChunkDesc) ? pdesc->encoding : AKU_CHUNK_BASE128;
+        if ((has_summary && !chunk_overlaps(*pdesc)) || (has_filter && !filter_matches(*pdesc))) {
+            // Elements of the chunk are sorted by timestamp, scan continues
+            // if it didn't reach the end of the time range.
+            return IS_BACKWARD_ ? query_.lowerbound <= pdesc->min_timestamp
+                                : query_.upperbound >= pdesc->max_timestamp;
+        }
+        auto probe_length = pdesc->n_elements;
+
+        // Decoded chunk can be shared with other cursors
+        auto& cache = get_global_chunk_cache();
+        ChunkCache::Key key = { page_->page_id, page_->open_count, pdesc->begin_offset };
+        auto pheader = cache.get(key, pdesc->checksum);
+        stats_.cache.n_hits += pheader != nullptr;
+        stats_.cache.n_misses += pheader == nullptr;
+        if (!pheader) {
+            auto pbegin = (const unsigned char*)(page_->cdata() + pdesc->begin_offset);
+            auto pend = (const unsigned char*)(page_->cdata() + pdesc->end_offset);
+
+            boost::crc_32_type checksum;
+            checksum.process_block(pbegin, pend);
+            if (checksum.checksum() != pdesc->checksum) {
+                AKU_PANIC("File damaged!");
+                // TODO: report error
+                return false;
+            }
+            if (has_filter) {
+                pbegin += pdesc->filter_size;
+            }
+
+            // Decode timestamps, param ids, lengths, offsets, values and integers
+            auto decoded = std::make_shared<ChunkHeader>();
+            CompressionUtil::decode_chunk(decoded.get(), &pbegin, pend, 0, 6, probe_length, encoding);
+            cache.put(key, pdesc->checksum, decoded);
+            pheader = decoded;
+        }
+        ChunkHeader const& header = *pheader;
 
         size_t start_pos = 0;
         if (IS_BACKWARD_) {
             start_pos = static_cast<int>(probe_length - 1);
         }
         // test timestamp range
-        if (binary_search) {
-            ChunkHeaderSearcher int_searcher(header);
-            SearchRange sr = { 0, static_cast<uint32_t>(header.timestamps.size())};
-            int_searcher.run(key_, &sr);
-            auto begin = header.timestamps.begin() + sr.begin;
-            auto end = header.timestamps.begin() + sr.end;
-            auto it = std::lower_bound(begin, end, key_);
-            // TODO: stop if key is out of range
-            if (IS_BACKWARD_) {
-                if (!header.timestamps.empty()) {
-                    auto last = header.timestamps.begin() + start_pos;
-                    auto delta = last - it;
-                    start_pos -= delta;
-                }
+        ChunkHeaderSearcher int_searcher(header, stats_);
+        SearchRange sr = { 0, static_cast<uint32_t>(header.timestamps.size())};
+        int_searcher.run(key_, &sr);
+        auto begin = header.timestamps.begin() + sr.begin;
+        auto end = header.timestamps.begin() + sr.end;
+        auto it = std::lower_bound(begin, end, key_);
+        // TODO: stop if key is out of range
+        if (IS_BACKWARD_) {
+            // Start from the last element that is not greater than key_,
+            // `it` can point past the end of the chunk here.
+            it = std::upper_bound(it, header.timestamps.end(), key_);
+            if (it != header.timestamps.begin()) {
+                start_pos = static_cast<size_t>(it - header.timestamps.begin()) - 1;
             } else {
-                start_pos += it - header.timestamps.begin();
+                start_pos = 0;
             }
+        } else {
+            start_pos += it - header.timestamps.begin();
         }
 
-        // Read lengths, param ids and offsets.
-        CompressionUtil::decode_chunk(&header, &pbegin, pend, 1, 4, probe_length);
-
-        bool probe_in_time_range = true;
-
-        auto cursor = cursor_;
-        auto& caller = caller_;
-        auto page = page_;
-        auto ix_value = 0u;
-        auto put_entry = [&header, cursor, &caller, page, &ix_value] (uint32_t i) {
-            auto len = header.lengths[i];
-            CursorResult result = {
-                len,
-                header.timestamps[i],
-                header.paramids[i],
-            };
-            if (len == 0) {
-                result.data.float64 = header.values[ix_value++];
-            } else {
-                result.data.ptr = page->read_entry_data(header.offsets[i]);
+        if (probe_length == 0) {
+            return true;
+        }
+
+        // Elements of the chunk are sorted by timestamp, only the range [lo, hi)
+        // of the elements is inside the time range of the query.
+        auto ts_begin = header.timestamps.begin();
+        auto ts_end = IS_BACKWARD_ ? ts_begin + start_pos + 1 : header.timestamps.end();
+        auto ts_lo = std::lower_bound(IS_BACKWARD_ ? ts_begin : ts_begin + start_pos, ts_end, query_.lowerbound);
+        auto ts_hi = std::upper_bound(ts_lo, ts_end, query_.upperbound);
+        auto lo = static_cast<size_t>(ts_lo - ts_begin);
+        auto hi = static_cast<size_t>(ts_hi - ts_begin);
+        // Scan should proceed if chunk didn't reach the end of the time range
+        bool probe_in_time_range = IS_BACKWARD_ ? ts_lo == ts_begin
+                                                : ts_hi == header.timestamps.end();
+
+        // Match param ids of the whole range at once
+        match_mask_.resize(hi - lo);
+        if (query_.id_set) {
+            query_.id_set->match_block(header.paramids.data() + lo, hi - lo, match_mask_.data());
+        } else {
+            for (auto i = lo; i < hi; i++) {
+                match_mask_[i - lo] = query_.match(header.paramids[i]) == SearchQuery::MATCH;
             }
-            cursor->put(caller, result);
-        };
+        }
 
-        if (IS_BACKWARD_) {
-            for (int i = static_cast<int>(start_pos); i >= 0; i--) {
-                probe_in_time_range = query_.lowerbound <= header.timestamps[i] &&
-                                      query_.upperbound >= header.timestamps[i];
-                if (probe_in_time_range && query_.param_pred(header.paramids[i])) {
-                    put_entry(i);
-                } else {
-                    probe_in_time_range = query_.lowerbound <= header.timestamps[i];
-                    if (!probe_in_time_range) {
-                        break;
-                    }
+        // Double values are stored only for elements with zero length, integers - for
+        // elements with AKU_LENGTH_INT64 length, ix_value and ix_int points to the value
+        // of the element i (or i - 1 in backward direction). If all elements are doubles
+        // value index is the same as element index.
+        bool doubles = header.values.size() == header.lengths.size();
+        size_t ix_pos = IS_BACKWARD_ && !aggregator_ ? hi : lo;
+        size_t ix_value = ix_pos;
+        size_t ix_int = 0u;
+        if (!doubles) {
+            auto lengths_end = header.lengths.begin() + ix_pos;
+            ix_value = std::count(header.lengths.begin(), lengths_end, 0u);
+            ix_int = header.integers.empty()
+                   ? 0u
+                   : std::count(header.lengths.begin(), lengths_end, AKU_LENGTH_INT64);
+        }
+        if (aggregator_ && doubles) {
+            for (auto i = lo; i != hi; i++) {
+                if (match_mask_[i - lo]) {
+                    aggregator_->add(header.paramids[i], header.timestamps[i], header.values[i]);
                 }
             }
-        } else {
-            for (auto i = start_pos; i != probe_length; i++) {
-                probe_in_time_range = query_.lowerbound <= header.timestamps[i] &&
-                                      query_.upperbound >= header.timestamps[i];
-                if (probe_in_time_range && query_.param_pred(header.paramids[i])) {
-                    put_entry(i);
-                } else {
-                    probe_in_time_range = query_.upperbound >= header.timestamps[i];
-                    if (!probe_in_time_range) {
-                        break;
+            return probe_in_time_range;
+        }
+        if (aggregator_) {
+            // Direction doesn't matter, results are not passed to the output
+            for (auto i = lo; i != hi; i++) {
+                bool is_value = header.lengths[i] == 0;
+                bool is_int = header.lengths[i] == AKU_LENGTH_INT64;
+                if (match_mask_[i - lo]) {
+                    if (is_value) {
+                        aggregator_->add(header.paramids[i], header.timestamps[i], header.values[ix_value]);
+                    } else if (is_int) {
+                        aggregator_->add(header.paramids[i], header.timestamps[i],
+                                         static_cast<double>(header.integers[ix_int]));
                     }
                 }
+                ix_value += is_value;
+                ix_int += is_int;
             }
+            return probe_in_time_range;
         }
-        return probe_in_time_range;
+        if (lo == hi) {
+            return probe_in_time_range;
+        }
+        chunk_ = pheader;
+        chunk_lo_ = lo;
+        chunk_hi_ = hi;
+        chunk_pos_ = IS_BACKWARD_ ? hi : lo;
+        chunk_ix_value_ = ix_value;
+        chunk_ix_int_ = ix_int;
+        chunk_proceed_ = probe_in_time_range;
+        chunk_doubles_ = doubles;
+        state_ = CHUNK;
+        return true;
     }
 
-    std::tuple<uint64_t, uint64_t> scan_impl(uint32_t probe_index) {
-#ifdef DEBUG
-        // Debug variables
-        aku_TimeStamp dbg_prev_ts;
-        long dbg_count = 0;
-#endif
-        int index_increment = IS_BACKWARD_ ? -1 : 1;
-        while (true) {
-            auto current_index = probe_index;
-            probe_index += index_increment;
-            auto probe_offset = page_->page_index[current_index];
-            auto probe_entry = page_->read_entry(probe_offset);
-            auto probe = probe_entry->param_id;
-            bool proceed = false;
-            bool probe_in_time_range = query_.lowerbound <= probe_entry->time &&
-                                       query_.upperbound >= probe_entry->time;
-            if (probe < AKU_ID_COMPRESSED) {
-                if (query_.param_pred(probe) == SearchQuery::MATCH && probe_in_time_range) {
-#ifdef DEBUG
-                    if (dbg_count) {
-                        // check for backward direction
-                        auto is_ok = IS_BACKWARD_ ? (dbg_prev_ts >= probe_entry->time)
-                                                  : (dbg_prev_ts <= probe_entry->time);
-                        assert(is_ok);
-                    }
-                    dbg_prev_ts = probe_entry->time;
-                    dbg_count++;
-#endif
-                    auto offset = static_cast<aku_EntryOffset>(probe_offset + sizeof(aku_Entry));
-                    CursorResult result = {
-                        probe_entry->length,
-                        probe_entry->time,
-                        probe,//id
-                        page_->read_entry_data(offset)
-                    };
-                    if (!cursor_->put(caller_, result)) {
-                        break;
-                    }
-                }
-                proceed = IS_BACKWARD_ ? query_.lowerbound <= probe_entry->time
-                                       : query_.upperbound >= probe_entry->time;
+    /** Copy `n` elements of the chunk to output starting from chunk_pos_, output must have
+      * space for `n` results. Every element is written to output, output position is advanced
+      * only if element matches (non matching elements are overwritten).
+      */
+    template<bool DOUBLES>
+    void copy_chunk_elements(ChunkHeader const& header, size_t n) {
+        // Members are copied to locals, otherwise compiler has to reload them
+        // after every write to the output columns (they can alias)
+        auto timestamps = out_.timestamps;
+        auto params = out_.params;
+        auto pointers = out_.pointers;
+        auto lengths = out_.lengths;
+        auto mask = match_mask_.data();
+        auto lo = chunk_lo_;
+        auto pos = chunk_pos_;
+        auto ix_value = chunk_ix_value_;
+        auto ix_int = chunk_ix_int_;
+        auto out_pos = out_pos_;
+        for (size_t k = 0; k < n; k++) {
+            size_t i = IS_BACKWARD_ ? --pos : pos++;
+            timestamps[out_pos] = header.timestamps[i];
+            params[out_pos] = header.paramids[i];
+            if (DOUBLES) {
+                lengths[out_pos] = 0u;
+                pointers[out_pos].float64 = header.values[i];
             } else {
-                if (probe == AKU_CHUNK_FWD_ID && IS_BACKWARD_ == false) {
-                    proceed = scan_compressed_entries(probe_entry, true);
-                } else if (probe == AKU_CHUNK_BWD_ID && IS_BACKWARD_ == true) {
-                    proceed = scan_compressed_entries(probe_entry, true);
+                auto len = header.lengths[i];
+                if (IS_BACKWARD_) {
+                    ix_value -= len == 0;
+                    ix_int -= len == AKU_LENGTH_INT64;
+                }
+                lengths[out_pos] = len;
+                if (len == 0) {
+                    pointers[out_pos].float64 = header.values[ix_value];
+                } else if (len == AKU_LENGTH_INT64) {
+                    pointers[out_pos].int64 = header.integers[ix_int];
                 } else {
-                    proceed = IS_BACKWARD_ ? query_.lowerbound <= probe_entry->time
-                                           : query_.upperbound >= probe_entry->time;
+                    pointers[out_pos].ptr = page_->read_entry_data(header.offsets[i]);
+                }
+                if (!IS_BACKWARD_) {
+                    ix_value += len == 0;
+                    ix_int += len == AKU_LENGTH_INT64;
                 }
             }
-            if (!proceed || probe_index >= MAX_INDEX_) {
-                // When scanning forward probe_index will be equal to MAX_INDEX_ at the end of the page
-                // When scanning backward probe_index will be equal to ~0 (probe_index > MAX_INDEX_)
-                // at the end of the page
-                break;
-            }
+            out_pos += mask[i - lo];
         }
-        return std::make_tuple(0ul, 0ul);
+        chunk_pos_ = pos;
+        chunk_ix_value_ = ix_value;
+        chunk_ix_int_ = ix_int;
+        out_pos_ = out_pos;
     }
 
-    void scan() {
-        if (range_.begin != range_.end) {
-            cursor_->set_error(caller_, AKU_EGENERAL);
+    //! Send elements of the open chunk to output until output is full
+    void read_chunk() {
+        ChunkHeader const& header = *chunk_;
+        auto out_begin = out_pos_;
+        auto out_end = output_end();
+        auto chunk_end = IS_BACKWARD_ ? chunk_lo_ : chunk_hi_;
+        while (chunk_pos_ != chunk_end && out_pos_ < out_end) {
+            // Output can take this many elements even if all of them match
+            size_t n = std::min(IS_BACKWARD_ ? chunk_pos_ - chunk_lo_ : chunk_hi_ - chunk_pos_,
+                                static_cast<size_t>(out_end - out_pos_));
+            if (chunk_doubles_) {
+                copy_chunk_elements<true>(header, n);
+            } else {
+                copy_chunk_elements<false>(header, n);
+            }
+        }
+        n_results_ += static_cast<uint64_t>(out_pos_ - out_begin);
+        if (query_.limit != 0u && n_results_ == query_.limit) {
+            finish();
             return;
         }
-        if (range_.begin >= MAX_INDEX_) {
-            cursor_->set_error(caller_, AKU_EOVERFLOW);
+        if (chunk_pos_ != chunk_end) {
+            // Output is full
             return;
         }
+        chunk_.reset();
+        next_entry(chunk_proceed_);
+    }
 
-        auto sums = scan_impl(range_.begin);
+    //! Move to the next entry of the page or complete the scan
+    void next_entry(bool proceed) {
+        if (!proceed || probe_index_ >= MAX_INDEX_) {
+            // When scanning forward probe_index_ will be equal to MAX_INDEX_ at the end of the page
+            // When scanning backward probe_index_ will be equal to ~0 (probe_index_ > MAX_INDEX_)
+            // at the end of the page
+            finish();
+        } else {
+            state_ = SCAN;
+        }
+    }
 
-        auto& stats = get_global_search_stats();
-        {
-            std::lock_guard<std::mutex> guard(stats.mutex);
-            stats.stats.scan.fwd_bytes += std::get<0>(sums);
-            stats.stats.scan.bwd_bytes += std::get<1>(sums);
+    //! Scan one entry of the page, output must have space for at least one result
+    void scan_entry() {
+        auto current_index = probe_index_;
+        probe_index_ += IS_BACKWARD_ ? -1 : 1;
+        auto probe_offset = page_->page_index[current_index];
+        auto probe_entry = page_->read_entry(probe_offset);
+        readahead_.touch(probe_entry);
+        auto probe = probe_entry->param_id;
+        bool proceed = false;
+        if (probe < AKU_ID_COMPRESSED) {
+            bool probe_in_time_range = query_.lowerbound <= probe_entry->time &&
+                                       query_.upperbound >= probe_entry->time;
+            // Uncompressed entries contain blobs, they're not aggregated
+            if (!aggregator_ && query_.match(probe) == SearchQuery::MATCH && probe_in_time_range) {
+                auto offset = static_cast<aku_EntryOffset>(probe_offset + sizeof(aku_Entry));
+                CursorResult result = {
+                    probe_entry->length,
+                    probe_entry->time,
+                    probe,//id
+                    page_->read_entry_data(offset)
+                };
+                if (!put(result)) {
+                    finish();
+                    return;
+                }
+            }
+            proceed = IS_BACKWARD_ ? query_.lowerbound <= probe_entry->time
+                                   : query_.upperbound >= probe_entry->time;
+        } else if (probe == CHUNK_ID_) {
+            proceed = open_chunk(probe_entry);
+            if (state_ == CHUNK) {
+                // Scan resumes when chunk is consumed
+                return;
+            }
+        } else {
+            proceed = IS_BACKWARD_ ? query_.lowerbound <= probe_entry->time
+                                   : query_.upperbound >= probe_entry->time;
+        }
+        next_entry(proceed);
+    }
+
+    //! Fill output columns, aggregating search runs to completion regardless of the output size
+    virtual int read_columns(CursorColumns const& columns, int buf_len) {
+        out_ = columns;
+        out_len_ = buf_len;
+        out_pos_ = 0;
+        if (state_ == START) {
+            start();
+        }
+        while (state_ != DONE && (aggregator_ || out_pos_ < out_len_)) {
+            if (state_ == CHUNK) {
+                read_chunk();
+            } else {
+                scan_entry();
+            }
         }
-        cursor_->complete(caller_);
+        return out_pos_;
+    }
+
+    virtual int read(CursorResult* buf, int buf_len) {
+        if (rows_.size() < static_cast<size_t>(buf_len)) {
+            rows_.resize(buf_len);
+        }
+        auto n = read_columns(rows_.columns(), buf_len);
+        rows_.to_results(buf, n);
+        return n;
     }
 };
 
-void PageHeader::search(Caller& caller, InternalCursor* cursor, SearchQuery query) const
+template<int DIR>
+constexpr bool DirectedSearch<DIR>::IS_BACKWARD_;
+
+template<int DIR>
+constexpr aku_ParamId DirectedSearch<DIR>::CHUNK_ID_;
+
+// PageSearch
+
+PageSearch::PageSearch(PageHeader const* page, SearchQuery const& query, Aggregator* aggregator,
+                       uint32_t max_count)
 {
-    SearchAlgorithm search_alg(this, caller, cursor, query);
-    if (search_alg.fast_path() == false) {
-        search_alg.histogram();
-        if (search_alg.interpolation()) {
-            search_alg.binary_search();
-            search_alg.scan();
+    if (query.direction == AKU_CURSOR_DIR_BACKWARD) {
+        impl_.reset(new DirectedSearch<AKU_CURSOR_DIR_BACKWARD>(page, query, aggregator, max_count));
+    } else {
+        // Bad direction is reported by the search
+        impl_.reset(new DirectedSearch<AKU_CURSOR_DIR_FORWARD>(page, query, aggregator, max_count));
+    }
+}
+
+PageSearch::~PageSearch() {
+}
+
+int PageSearch::read(CursorResult* buf, int buf_len) {
+    return impl_->read(buf, buf_len);
+}
+
+int PageSearch::read_columns(CursorColumns const& columns, int buf_len) {
+    return impl_->read_columns(columns, buf_len);
+}
+
+bool PageSearch::is_done() const {
+    return impl_->state_ == SearchAlgorithm::DONE;
+}
+
+bool PageSearch::get_error(int* error_code) const {
+    if (impl_->error_code_ != AKU_SUCCESS) {
+        if (error_code) {
+            *error_code = impl_->error_code_;
         }
+        return true;
     }
+    return false;
+}
+
+void PageSearch::close() {
+    impl_->state_ = SearchAlgorithm::DONE;
+    impl_->chunk_.reset();
+}
+
+void PageHeader::search(Caller& caller, InternalCursor* cursor, SearchQuery query) const
+{
+    PageSearch search(this, query);
+    run_search(caller, cursor, search);
+}
+
+void PageHeader::aggregate(Caller& caller, InternalCursor* cursor, SearchQuery query, Aggregator* aggregator) const
+{
+    PageSearch search(this, query, aggregator);
+    run_search(caller, cursor, search);
 }
 
 void PageHeader::_sort() {
@@ -717,49 +1517,21 @@ void PageHeader::_sort() {
     sync_count = count;
 }
 
-void PageHeader::sync_next_index(aku_EntryOffset offset, uint32_t rand_val, bool sort_histogram) {
-    // sync_count updated only here! 
-    if (!sort_histogram) {
-        if (sync_count >= count) {
-            AKU_PANIC("sync_index out of range");
-        }
-        auto index = sync_count++;
-        page_index[index] = offset;
-
-        if (histogram.size < AKU_HISTOGRAM_SIZE) {
-            // first AKU_HISTOGRAM_SIZE samples
-            auto& h = histogram.entries[histogram.size++];
-            h.index = index;
-            h.timestamp = read_entry(offset)->time;
-        } else {
-            // reservoir sampling
-            auto rindex = static_cast<uint32_t>(rand_val % sync_count);
-            if (rindex < histogram.size) {
-                auto& h = histogram.entries[rindex];
-                h.index = index;
-                h.timestamp = read_entry(offset)->time;
-            }
-        }
-    } else {
-        gfx::timsort(histogram.entries, histogram.entries + histogram.size,
-                  [](PageHistogramEntry const& a, PageHistogramEntry const& b) {
-                        return a.timestamp < b.timestamp;
-                  }
-        );
+void PageHeader::sync_next_index(aku_EntryOffset offset) {
+    // sync_count updated only here!
+    if (sync_count >= count) {
+        AKU_PANIC("sync_index out of range");
     }
+    auto index = sync_count++;
+    page_index[index] = offset;
+    model.add(read_entry(offset)->time, index);
 }
 
 void PageHeader::get_search_stats(aku_SearchStats* stats, bool reset) {
-    auto& gstats = get_global_search_stats();
-    std::lock_guard<std::mutex> guard(gstats.mutex);
-
-    memcpy( reinterpret_cast<void*>(stats)
-          , reinterpret_cast<void*>(&gstats.stats)
-          , sizeof(aku_SearchStats));
-
-    if (reset) {
-        memset(reinterpret_cast<void*>(&gstats.stats), 0, sizeof(aku_SearchStats));
-    }
+    get_global_search_stats().get(stats, reset);
+    // Cache counters are maintained by the caches themselves (sequencer searches use them too)
+    get_global_chunk_cache().get_stats(&stats->cache.n_hits, &stats->cache.n_misses, reset);
+    get_global_stack_pool().get_stats(&stats->stacks.n_hits, &stats->stacks.n_misses, reset);
 }
 
 }  // namepsace
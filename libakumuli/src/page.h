@@ -25,10 +25,15 @@
 #include <functional>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <map>
 #include "akumuli.h"
 #include "util.h"
 #include "internal_cursor.h"
 #include "compression.h"
+#include "metrics.h"
 
 const int64_t AKU_MAX_PAGE_SIZE   = 0x100000000;
 const int64_t AKU_MAX_PAGE_OFFSET =  0xFFFFFFFF;
@@ -44,8 +49,28 @@ struct ChunkDesc {
     uint32_t begin_offset;      //< Data begin offset
     uint32_t end_offset;        //< Data end offset
     uint32_t checksum;          //< Checksum
+    // Chunk summary, search uses it to skip chunks without decoding.
+    // Chunks written by older versions doesn't have summary.
+    aku_TimeStamp min_timestamp;  //< Smallest timestamp in a chunk
+    aku_TimeStamp max_timestamp;  //< Largest timestamp in a chunk
+    aku_ParamId   min_id;         //< Smallest param id in a chunk
+    aku_ParamId   max_id;         //< Largest param id in a chunk
+    // Param id filter (see ParamIdFilter) placed at the beginning of the chunk
+    // data, compressed data follows it.
+    uint32_t      filter_size;    //< Size of the param id filter in bytes (0 - no filter)
+    // Chunks written by older versions always use AKU_CHUNK_BASE128 encoding.
+    uint32_t      encoding;       //< Codec tags of the chunk columns (see ChunkEncoding)
 } __attribute__((packed));
 
+//! Size of the ChunkDesc without summary
+const uint32_t AKU_CHUNK_DESC_NOSUMMARY_SIZE = 4*sizeof(uint32_t);
+
+//! Size of the ChunkDesc without encoding
+const uint32_t AKU_CHUNK_DESC_NOENCODING_SIZE = sizeof(ChunkDesc) - sizeof(uint32_t);
+
+//! Size of the ChunkDesc without param id filter
+const uint32_t AKU_CHUNK_DESC_NOFILTER_SIZE = AKU_CHUNK_DESC_NOENCODING_SIZE - sizeof(uint32_t);
+
 //! Storage configuration
 struct aku_Config {
     uint32_t compression_threshold;
@@ -55,6 +80,27 @@ struct aku_Config {
 
     //! Maximum cache size in bytes
     uint32_t max_cache_size;
+
+    //! Sequencer mode, 0 - sorted runs are shared by all writers, 1 - each writer thread has its own sorted runs
+    uint32_t writer_runs;
+
+    //! Number of threads used to merge and compress sequencer data (0 or 1 - single thread)
+    uint32_t merge_threads;
+
+    //! Percentile of the samples lateness used to size late write window (0 - fixed window)
+    uint32_t window_percentile;
+
+    //! Min size of the adaptive late write window (0 - 1/64 of the max size)
+    uint64_t min_window;
+
+    //! Max size of the adaptive late write window (0 - window_size)
+    uint64_t max_window;
+
+    //! Codec tags of the new chunks (see ChunkEncoding)
+    uint32_t chunk_encoding;
+
+    //! Codec selection policy (see CodecPolicy)
+    uint32_t codec_policy;
 };
 
 struct aku_Entry {
@@ -81,29 +127,89 @@ struct PageBoundingBox {
 };
 
 
-struct PageHistogramEntry {
+//! Knot of the page index model (timestamp and index of the page entry)
+struct PageModelKnot {
     aku_TimeStamp timestamp;
     uint32_t index;
 };
 
 
-/** Page histogram for approximation search */
-struct PageHistogram {
-    uint32_t size;
-    PageHistogramEntry entries[AKU_HISTOGRAM_SIZE];
+/** Piecewise-linear model of the page index.
+  * Maps timestamp to the index of the page entry. Knots are real page entries,
+  * every entry between two adjacent knots lies within AKU_PAGE_MODEL_ERROR
+  * positions from the line that connects them. Model is built incrementally
+  * (shrinking cone algorithm) when entries are added to the page index, the
+  * last segment of the model is open and ends at the last added entry.
+  */
+struct PageModel {
+    uint32_t size;                              //< Number of closed knots
+    PageModelKnot last;                         //< Last added entry (end of the open segment)
+    double slope_lo;                            //< Lower bound of the open segment's slope
+    double slope_hi;                            //< Upper bound of the open segment's slope
+    PageModelKnot knots[AKU_PAGE_MODEL_SIZE];   //< Closed knots
+
+    //! Remove all knots
+    void reset();
+
+    //! Add next entry of the page index (entries should be added in timestamp order)
+    void add(aku_TimeStamp timestamp, uint32_t index);
+
+    /** Remove entries with index not less than `count`.
+      * @return number of entries covered by the model, entries starting from
+      *         this index should be added again
+      */
+    uint32_t truncate(uint32_t count);
+
+    /** Predict page index range that contains timestamp.
+      * @param key timestamp
+      * @param begin out parameter, index of the entry with timestamp not greater than key
+      * @param end out parameter, index of the entry with timestamp not less than key
+      * @return false if model doesn't cover key (range is not changed in this case)
+      */
+    bool predict(aku_TimeStamp key, uint32_t* begin, uint32_t* end) const;
+
+private:
+    void start_segment_();
+    void push_knot_(PageModelKnot knot);
+    //! Try to add entry to the open segment
+    bool extend_(PageModelKnot point);
 };
 
 
-struct SearchStats {
-    aku_SearchStats stats;
-    std::mutex mutex;
+/** Search counters.
+  * Search procedures count events in their own `aku_SearchStats` and add
+  * them here once, when the search is completed, so counters are updated
+  * without locks. One instance is created per query (see SearchQuery::stats).
+  */
+class SearchStats {
+    enum { NCOUNTERS = sizeof(aku_SearchStats)/sizeof(uint64_t) };
+    std::atomic<uint64_t> counters_[NCOUNTERS];
+public:
+    SearchStats();
 
-    SearchStats() {
-        memset(&stats, 0, sizeof(stats));
-    }
+    void add(aku_SearchStats const& stats);
+
+    void get(aku_SearchStats* stats, bool reset = false);
+};
+
+/** Process-wide search counters.
+  * Every thread adds counters to its own shard, shards are summed up on read.
+  */
+class GlobalSearchStats {
+    struct Shard {
+        SearchStats stats;
+        char padding[64];  //< Shards don't share cache lines
+    };
+    Shard shards_[METRICS_NUM_SHARDS];
+public:
+    void add(aku_SearchStats const& stats);
+
+    void get(aku_SearchStats* stats, bool reset = false);
 };
 
-SearchStats& get_global_search_stats();
+GlobalSearchStats& get_global_search_stats();
+
+class ParamIdSet;
 
 /** Search query */
 struct SearchQuery {
@@ -128,8 +234,12 @@ struct SearchQuery {
     // search query
     aku_TimeStamp lowerbound;     //< begining of the time interval (0 for -inf) to search
     aku_TimeStamp upperbound;     //< end of the time interval (0 for inf) to search
-    MatcherFn     param_pred;     //< parmeter search predicate
+    MatcherFn     param_pred;     //< parmeter search predicate (fallback if id_set is not set)
     int            direction;     //< scan direction
+    std::shared_ptr<const ParamIdSet> id_set;  //< param ids of interest if known
+    size_t         readahead;     //< readahead distance for page scans in bytes (0 - disabled)
+    uint64_t       limit;         //< max number of results produced by each search procedure (0 - unlimited)
+    std::shared_ptr<SearchStats> stats;  //< counters of this query (optional, shared by the query copies)
 
     /** Query c-tor for single parameter searching
      *  @param pid parameter id
@@ -153,6 +263,142 @@ struct SearchQuery {
                , aku_TimeStamp low
                , aku_TimeStamp upp
                , int           scan_dir);
+
+    /** Query c-tor for the set of parameters
+     *  @param ids list of parameter ids (can be unsorted)
+     *  @param low time lowerbound (0 for -inf)
+     *  @param upp time upperbound (MAX_TIMESTAMP for inf)
+     *  @param scan_dir scan direction
+     */
+    SearchQuery( std::vector<aku_ParamId> ids
+               , aku_TimeStamp low
+               , aku_TimeStamp upp
+               , int           scan_dir);
+
+    //! Match param id using id_set or param_pred
+    ParamMatch match(aku_ParamId id) const;
+};
+
+
+/** Set of param ids of interest.
+  * Concrete matcher representation that doesn't need indirect call per
+  * element. Small or sparse sets are stored as sorted array, large dense
+  * sets as bitmap (representation is chosen by cardinality). Scan loops
+  * test whole blocks of decoded param ids using `match_block`.
+  */
+class ParamIdSet {
+    enum {
+        SMALL_SET = 8,           //< Sets not larger than this are scanned linearly
+        BITS_PER_ID = 64,        //< Max bitmap size per id
+    };
+    std::vector<aku_ParamId> ids_;     //< Sorted unique ids
+    std::vector<uint64_t>    bitmap_;  //< Dense representation, bit `id - min` is set for each id
+    aku_ParamId              min_;
+    aku_ParamId              max_;
+public:
+    ParamIdSet(std::vector<aku_ParamId> ids);
+
+    //! Sorted list of ids
+    std::vector<aku_ParamId> const& get_ids() const;
+
+    //! Is bitmap is used to represent the set
+    bool is_bitmap() const;
+
+    SearchQuery::ParamMatch match(aku_ParamId id) const {
+        if (ids_.empty()) {
+            return SearchQuery::NO_MATCH;
+        }
+        if (id < min_) {
+            return SearchQuery::LT_ALL;
+        }
+        if (id > max_) {
+            return SearchQuery::GT_ALL;
+        }
+        bool found = false;
+        if (!bitmap_.empty()) {
+            auto off = id - min_;
+            found = (bitmap_[off >> 6] >> (off & 63)) & 1;
+        } else if (ids_.size() <= SMALL_SET) {
+            found = std::find(ids_.begin(), ids_.end(), id) != ids_.end();
+        } else {
+            found = std::binary_search(ids_.begin(), ids_.end(), id);
+        }
+        return found ? SearchQuery::MATCH : SearchQuery::NO_MATCH;
+    }
+
+    /** Match block of ids.
+      * @param ids array of ids
+      * @param n size of the array
+      * @param out output array, out[i] is set to 1 if ids[i] is in set, 0 otherwise
+      */
+    void match_block(const aku_ParamId* ids, size_t n, unsigned char* out) const;
+};
+
+inline SearchQuery::ParamMatch SearchQuery::match(aku_ParamId id) const {
+    return id_set ? id_set->match(id) : param_pred(id);
+}
+
+
+/** Aggregator of the double values.
+  * Accumulates min, max, sum and count per time bucket and param id.
+  * Buckets are aligned to multiples of the bucket width. Values can be
+  * added in any order, partial results can be merged.
+  */
+struct Aggregator {
+    //! Aggregated values of the bucket
+    struct Value {
+        uint64_t count;
+        double   sum;
+        double   min;
+        double   max;
+
+        Value();
+        void add(double value);
+        void merge(Value const& other);
+    };
+
+    //! Bucket key (bucket begin timestamp, param id)
+    typedef std::pair<aku_TimeStamp, aku_ParamId> Key;
+
+    enum {
+        CACHE_SIZE = 0x40,  //< Number of recently used buckets cached by param id
+    };
+
+    const aku_Duration           width_;
+    std::map<Key, size_t>        index_;   //< Bucket index (position in values_)
+    std::vector<Value>           values_;
+    std::pair<Key, size_t>       cache_[CACHE_SIZE];
+
+    //! C-tor, width must be greater than zero
+    Aggregator(aku_Duration width);
+
+    //! Add value to the bucket
+    void add(aku_ParamId param, aku_TimeStamp ts, double value) {
+        Key key(ts - ts % width_, param);
+        auto& slot = cache_[param & (CACHE_SIZE - 1)];
+        if (slot.first != key || slot.second == ~0ul) {
+            slot.first = key;
+            slot.second = get_bucket_(key);
+        }
+        values_[slot.second].add(value);
+    }
+
+    /** Add partial result of the bucket.
+      * Key can belong to another aggregator with smaller bucket width
+      * (that divides width of this aggregator).
+      */
+    void add(Key const& key, Value const& value);
+
+    //! Merge partial results
+    void merge(Aggregator const& other);
+
+    /** Get results in order of the bucket timestamps.
+      * @param direction AKU_CURSOR_DIR_FORWARD or AKU_CURSOR_DIR_BACKWARD
+      */
+    std::vector<std::pair<Key, Value>> get_results(int direction) const;
+
+private:
+    size_t get_bucket_(Key const& key);
 };
 
 
@@ -177,7 +423,7 @@ struct PageHeader {
     uint64_t length;            //< page size
     // NOTE: maybe it is possible to get this data from page_index?
     PageBoundingBox bbox;       //< page data limits
-    PageHistogram histogram;    //< histogram
+    PageModel model;            //< page index model
     aku_EntryOffset page_index[];   //< page index
 
     //! Convert entry index to entry offset
@@ -223,6 +469,13 @@ struct PageHeader {
      */
     int add_chunk(const aku_MemRange data, const uint32_t free_space_required);
 
+    /**
+     * Get free space that can be used to compress the next chunk in place
+     * (see EncodedChunk::encode), space needed by the chunk index entries
+     * is excluded.
+     */
+    aku_MemRange get_chunk_space();
+
     /**
      * Complete chunk. Add compressed header and index.
      * @param data chunk header data (list of sorted timestamps, param ids, offsets and lengths
@@ -230,6 +483,30 @@ struct PageHeader {
      */
     int complete_chunk(const ChunkHeader& data);
 
+    /**
+     * Complete chunk that was compressed in advance (possibly in another thread).
+     * @param data chunk header data used to compress the chunk
+     * @param encoded compressed chunk data and param id filter
+     * @returns operation status
+     */
+    int complete_chunk(const ChunkHeader& data, const EncodedChunk& encoded);
+
+    //! Write param id filter, chunk descriptor and index entries of the chunk
+    int complete_chunk_(const ChunkHeader& data,
+                        const ByteVector& filter,
+                        aku_Status status,
+                        ChunkDesc& desc,
+                        aku_TimeStamp first_ts,
+                        aku_TimeStamp last_ts);
+
+    /**
+     * Validate chunks added after the last checkpoint and truncate page
+     * at the first damaged chunk (bad checksum or incomplete entry).
+     * Only unsynced tail of the page is read, older data isn't touched.
+     * @returns number of removed entries
+     */
+    uint32_t recover();
+
     /**
      * Get length of the entry.
      * @param entry_index index of the entry.
@@ -291,16 +568,62 @@ struct PageHeader {
       */
     void search(Caller& caller, InternalCursor* cursor, SearchQuery query) const;
 
+    /**
+      * Aggregate double values that match search query. Values are added to
+      * aggregator directly, cursor receives only completion or error.
+      */
+    void aggregate(Caller& caller, InternalCursor* cursor, SearchQuery query, Aggregator* aggregator) const;
+
     // Only for testing
     void _sort();
 
-    /** Update page index.
-      * @param offsets ordered offsets
-      * @param num_offsets number of values in buffer
+    /** Update page index and page index model.
+      * @param offset offset of the next entry (entries should be synced in timestamp order)
       */
-    void sync_next_index(aku_EntryOffset offsets, uint32_t rand_val, bool sort_histogram);
+    void sync_next_index(aku_EntryOffset offset);
 
     static void get_search_stats(aku_SearchStats* stats, bool reset=false);
 };
 
+
+struct SearchAlgorithm;
+
+/** Stackless page search.
+  * Search state is stored explicitly (scan position and partially consumed
+  * chunk). Each `read` call resumes the scan where the previous call stopped
+  * and fills caller's buffer without switching stacks.
+  */
+class PageSearch {
+    std::unique_ptr<SearchAlgorithm> impl_;
+public:
+    /** C-tor
+      * @param page page to search
+      * @param query search query
+      * @param aggregator aggregator that receives double values (optional), if set
+      *        search produces no results and runs to completion on the first `read` call
+      * @param max_count max number of page entries to search (entries added later are
+      *        not searched), used to pair page search with sequencer snapshot
+      */
+    PageSearch(PageHeader const* page, SearchQuery const& query, Aggregator* aggregator = nullptr,
+               uint32_t max_count = ~0u);
+    ~PageSearch();
+
+    //! Read portion of the results to the buffer, returns number of results
+    int read(CursorResult* buf, int buf_len);
+
+    /** Read portion of the results to columns, returns number of results.
+      * All column arrays must be set.
+      */
+    int read_columns(CursorColumns const& columns, int buf_len);
+
+    //! Check is search completed (or failed)
+    bool is_done() const;
+
+    //! Check is error occured and (optionally) get the error code
+    bool get_error(int* error_code) const;
+
+    //! Stop the search
+    void close();
+};
+
 }  // namespaces
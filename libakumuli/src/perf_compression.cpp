@@ -0,0 +1,299 @@
+#include "compression.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <functional>
+#include <cstring>
+
+using namespace Akumuli;
+
+/** Compression codecs benchmark.
+  * Usage: perf_compression [--json] [--size N] [--iterations N]
+  * Every benchmark is repeated `iterations` times and the best time is reported.
+  */
+
+namespace {
+
+int N_ITERATIONS = 20;
+int CHUNK_SIZE = 0x10000;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+//! Run `fn` N_ITERATIONS times and return best time in seconds
+double measure(std::function<void()> const& fn) {
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i < N_ITERATIONS; i++) {
+        auto start = Clock::now();
+        fn();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+//! Size of the uncompressed chunk data
+size_t raw_size(ChunkHeader const& header) {
+    return header.timestamps.size()*(sizeof(aku_TimeStamp) + sizeof(aku_ParamId) + 2*sizeof(uint32_t))
+         + header.values.size()*sizeof(double)
+         + header.integers.size()*sizeof(int64_t);
+}
+
+enum ValueKind {
+    GAUGE,
+    COUNTER,
+    BLOB,
+};
+
+/** Generate chunk with `nseries` interleaved series.
+  * @param jitter max random deviation of the timestamp from the regular grid
+  * @param kinds value kind of the series (series i has kind kinds[i % kinds.size()])
+  */
+ChunkHeader generate(int nseries, int jitter, std::vector<ValueKind> const& kinds) {
+    std::mt19937_64 rand(42);
+    std::normal_distribution<double> step(0.0, 1.0);
+    std::vector<double> gauges(nseries, 100.0);
+    std::vector<int64_t> counters(nseries, 1000000);
+    ChunkHeader header;
+    aku_TimeStamp ts = 1000000000ul;
+    uint32_t offset = 0x1000u;
+    for (int i = 0; i < CHUNK_SIZE; i++) {
+        if (i % nseries == 0) {
+            ts += 1000u;
+        }
+        auto series = i % nseries;
+        header.timestamps.push_back(ts + (jitter ? rand() % jitter : 0u));
+        header.paramids.push_back(static_cast<aku_ParamId>(1000u + series*7u));
+        switch (kinds[series % kinds.size()]) {
+        case GAUGE:
+            // Random walk rounded to two digits
+            gauges[series] += step(rand);
+            header.values.push_back(static_cast<int64_t>(gauges[series]*100)/100.0);
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            break;
+        case COUNTER:
+            counters[series] += rand() % 100;
+            header.integers.push_back(counters[series]);
+            header.lengths.push_back(AKU_LENGTH_INT64);
+            header.offsets.push_back(0u);
+            break;
+        case BLOB:
+            header.lengths.push_back(16u + rand() % 16);
+            header.offsets.push_back(offset);
+            offset += header.lengths.back();
+            break;
+        }
+    }
+    // Jitter can break the order of the timestamps
+    for (size_t i = 1; i < header.timestamps.size(); i++) {
+        header.timestamps[i] = std::max(header.timestamps[i], header.timestamps[i - 1]);
+    }
+    return header;
+}
+
+struct Dataset {
+    std::string name;
+    ChunkHeader header;
+};
+
+struct Result {
+    std::string dataset;
+    std::string benchmark;
+    uint32_t    encoding;
+    size_t      npoints;
+    size_t      raw_bytes;
+    size_t      encoded_bytes;
+    double      seconds;
+};
+
+std::vector<Result> results;
+
+void report(Dataset const& ds, std::string benchmark, uint32_t encoding, size_t encoded, double seconds) {
+    Result r = {
+        ds.name,
+        benchmark,
+        encoding,
+        ds.header.timestamps.size(),
+        raw_size(ds.header),
+        encoded,
+        seconds
+    };
+    results.push_back(r);
+}
+
+void run_chunk_benchmarks(Dataset const& ds, uint32_t encoding) {
+    auto const& header = ds.header;
+    std::vector<unsigned char> buffer(CompressionUtil::max_encoded_size(header.timestamps.size()));
+    uint32_t n_elements = 0;
+    aku_TimeStamp ts_begin, ts_end;
+    size_t encoded_size = 0;
+    auto seconds = measure([&]() {
+        MemBuffer out(buffer.data(), buffer.size());
+        auto status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &out, header, encoding);
+        if (status != AKU_SUCCESS) {
+            throw std::runtime_error("encode_chunk failed");
+        }
+        encoded_size = out.size();
+    });
+    report(ds, "encode_chunk", encoding, encoded_size, seconds);
+
+    // Every stage is measured separately
+    const char* stages[] = {
+        "decode_timestamps",
+        "decode_paramids",
+        "decode_lengths",
+        "decode_offsets",
+        "decode_values",
+        "decode_integers",
+    };
+    const unsigned char* end = buffer.data() + encoded_size;
+    double stage_time[6] = {};
+    for (int i = 0; i < N_ITERATIONS; i++) {
+        ChunkHeader decoded;
+        const unsigned char* pbegin = buffer.data();
+        for (int stage = 0; stage < 6; stage++) {
+            auto start = Clock::now();
+            auto next = CompressionUtil::decode_chunk(&decoded, &pbegin, end, stage, 1, n_elements, encoding);
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+            if (next != stage + 1) {
+                throw std::runtime_error("decode_chunk failed");
+            }
+            stage_time[stage] = i == 0 ? elapsed.count() : std::min(stage_time[stage], elapsed.count());
+        }
+        if (decoded.values != header.values || decoded.integers != header.integers) {
+            throw std::runtime_error("decoded chunk doesn't match");
+        }
+    }
+    double total = 0;
+    for (int stage = 0; stage < 6; stage++) {
+        report(ds, stages[stage], encoding, encoded_size, stage_time[stage]);
+        total += stage_time[stage];
+    }
+    report(ds, "decode_chunk", encoding, encoded_size, total);
+}
+
+void run_doubles_benchmarks(Dataset const& ds) {
+    auto const& header = ds.header;
+    if (header.values.empty()) {
+        return;
+    }
+    std::vector<aku_ParamId> params;
+    for (size_t i = 0; i < header.lengths.size(); i++) {
+        if (header.lengths[i] == 0) {
+            params.push_back(header.paramids[i]);
+        }
+    }
+    ByteVector buffer;
+    size_t nblocks = 0;
+    auto seconds = measure([&]() {
+        buffer.clear();
+        nblocks = CompressionUtil::compress_doubles(header.values, params, &buffer);
+    });
+    report(ds, "compress_doubles", AKU_VALUES_XOR4 << AKU_CHUNK_VALUES_SHIFT, buffer.size(), seconds);
+    seconds = measure([&]() {
+        std::vector<double> output;
+        output.reserve(header.values.size());
+        CompressionUtil::decompress_doubles(buffer, nblocks, params, &output);
+    });
+    report(ds, "decompress_doubles", AKU_VALUES_XOR4 << AKU_CHUNK_VALUES_SHIFT, buffer.size(), seconds);
+}
+
+std::string encoding_name(uint32_t encoding) {
+    std::stringstream str;
+    str << "0x" << std::hex << std::setw(3) << std::setfill('0') << encoding;
+    return str.str();
+}
+
+void print_table(std::ostream& out) {
+    out << std::left << std::setw(12) << "dataset"
+        << std::setw(20) << "benchmark"
+        << std::setw(10) << "encoding"
+        << std::right << std::setw(10) << "ratio"
+        << std::setw(12) << "MB/s"
+        << std::setw(12) << "ns/point" << std::endl;
+    for (auto const& r: results) {
+        out << std::left << std::setw(12) << r.dataset
+            << std::setw(20) << r.benchmark
+            << std::setw(10) << encoding_name(r.encoding)
+            << std::right << std::fixed << std::setprecision(2)
+            << std::setw(10) << double(r.raw_bytes)/r.encoded_bytes
+            << std::setw(12) << r.raw_bytes/r.seconds/1000000.0
+            << std::setw(12) << r.seconds*1000000000.0/r.npoints << std::endl;
+    }
+}
+
+void print_json(std::ostream& out) {
+    out << "[" << std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        auto const& r = results[i];
+        out << "  {\"dataset\": \"" << r.dataset << "\""
+            << ", \"benchmark\": \"" << r.benchmark << "\""
+            << ", \"encoding\": " << r.encoding
+            << ", \"points\": " << r.npoints
+            << ", \"raw_bytes\": " << r.raw_bytes
+            << ", \"encoded_bytes\": " << r.encoded_bytes
+            << ", \"mb_per_sec\": " << r.raw_bytes/r.seconds/1000000.0
+            << ", \"ns_per_point\": " << r.seconds*1000000000.0/r.npoints
+            << "}" << (i + 1 == results.size() ? "" : ",") << std::endl;
+    }
+    out << "]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    bool json = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            json = true;
+        } else if (arg == "--size" && i + 1 < argc) {
+            CHUNK_SIZE = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            N_ITERATIONS = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: perf_compression [--json] [--size N] [--iterations N]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Dataset> datasets = {
+        { "regular",  generate(100,  0,   { GAUGE }) },
+        { "jittered", generate(100,  100, { GAUGE }) },
+        { "series10k", generate(10000, 100, { GAUGE }) },
+        { "counters", generate(100,  100, { COUNTER }) },
+        { "mixed",    generate(100,  100, { GAUGE, COUNTER, BLOB }) },
+    };
+    const uint32_t encodings[] = {
+        AKU_CHUNK_BASE128,
+        AKU_CHUNK_STREAMVBYTE,
+        AKU_CHUNK_DELTA_DELTA,
+        AKU_CHUNK_GORILLA,
+        AKU_CHUNK_STREAMVBYTE | AKU_CHUNK_GORILLA,
+    };
+    try {
+        for (auto const& ds: datasets) {
+            for (auto encoding: encodings) {
+                run_chunk_benchmarks(ds, encoding);
+            }
+            auto selected = CompressionUtil::select_encoding(ds.header, AKU_CODEC_SMALLEST, 0u);
+            run_chunk_benchmarks(ds, selected);
+            run_doubles_benchmarks(ds);
+        }
+    } catch (std::exception const& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    if (json) {
+        print_json(std::cout);
+    } else {
+        print_table(std::cout);
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "seriesparser.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+using namespace Akumuli;
+
+/** Series matcher benchmark.
+  * Usage: perf_seriesmatcher [--size N]
+  * Reports time per operation and memory per series.
+  */
+
+namespace {
+
+int N_SERIES = 1000000;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+std::vector<std::string> generate(int nseries, const char* metric) {
+    std::vector<std::string> names;
+    names.reserve(nseries);
+    for (int i = 0; i < nseries; i++) {
+        names.push_back(std::string(metric)
+                        + " host=host" + std::to_string(i % 10000)
+                        + " instance=" + std::to_string(i)
+                        + " region=region" + std::to_string(i % 16));
+    }
+    return names;
+}
+
+template<class Fn>
+double measure_ns(size_t nops, Fn const& fn) {
+    auto start = Clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return elapsed.count()*1000000000.0/nops;
+}
+
+void report(std::string const& name, double value, const char* units) {
+    std::cout << std::left << std::setw(24) << name
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << value << " " << units << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            N_SERIES = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: perf_seriesmatcher [--size N]" << std::endl;
+            return 1;
+        }
+    }
+    auto names = generate(N_SERIES, "cpu");
+    auto unknown = generate(N_SERIES, "mem");
+    // Lookups in random order
+    std::vector<int> order(N_SERIES);
+    for (int i = 0; i < N_SERIES; i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+    SeriesMatcher matcher(AKU_STARTING_SERIES_ID);
+    report("add", measure_ns(names.size(), [&]() {
+        for (auto const& name: names) {
+            matcher.add(name.data(), name.data() + name.size());
+        }
+    }), "ns/op");
+
+    uint64_t checksum = 0;
+    report("match (hit)", measure_ns(names.size(), [&]() {
+        for (auto ix: order) {
+            auto const& name = names[ix];
+            checksum += matcher.match(name.data(), name.data() + name.size());
+        }
+    }), "ns/op");
+    report("match (miss)", measure_ns(unknown.size(), [&]() {
+        for (auto ix: order) {
+            auto const& name = unknown[ix];
+            checksum += matcher.match(name.data(), name.data() + name.size());
+        }
+    }), "ns/op");
+
+    // Startup path
+    std::vector<std::pair<std::string, uint64_t>> series;
+    series.reserve(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        series.push_back(std::make_pair(names[i], AKU_STARTING_SERIES_ID + i));
+    }
+    SeriesMatcher loaded(AKU_STARTING_SERIES_ID);
+    report("bulk load", measure_ns(series.size(), [&]() {
+        loaded._add(series);
+    }), "ns/op");
+
+    size_t name_bytes = 0;
+    for (auto const& name: names) {
+        name_bytes += name.size();
+    }
+    report("name length", double(name_bytes)/names.size(), "bytes/series");
+    report("matcher memory", double(loaded.memory_use())/names.size(), "bytes/series");
+    report("inverted index memory", double(loaded.index.memory_use())/names.size(), "bytes/series");
+    if (checksum == 0) {
+        std::cerr << "Error: series not found" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,6 +1,5 @@
 #pragma once
 #include "util.h"
-#include <mutex>
 
 namespace Akumuli {
 
@@ -18,7 +17,7 @@ struct InterpolationSearch {
     // Derived class must implement:
     // - bool read_at(aku_TimeStamp* out_timestamp, uint32_t ix);
     // - bool is_small(SearchRange range);
-    // - get_search_stats();
+    // - aku_SearchStats& get_search_stats();
 
     //! Interpolation search state
     enum I10nState {
@@ -124,18 +123,18 @@ struct InterpolationSearch {
                 break;
             }
         }
+        // Counters of the search procedure, not shared with other threads
         auto& stats = derived->get_search_stats();
-        std::lock_guard<std::mutex> lock(stats.mutex);
-        stats.stats.istats.n_matches += exact_match;
-        stats.stats.istats.n_overshoots += overshoot;
-        stats.stats.istats.n_undershoots += undershoot;
-        stats.stats.istats.n_times += 1;
-        stats.stats.istats.n_steps += steps_count;
-        stats.stats.istats.n_reduced_to_one_page += small_range_finish;
-        stats.stats.istats.n_page_in_core_checks += page_scan_steps_num;
-        stats.stats.istats.n_page_in_core_errors += page_scan_errors;
-        stats.stats.istats.n_pages_in_core_found += page_scan_success;
-        stats.stats.istats.n_pages_in_core_miss += page_miss;
+        stats.istats.n_matches += exact_match;
+        stats.istats.n_overshoots += overshoot;
+        stats.istats.n_undershoots += undershoot;
+        stats.istats.n_times += 1;
+        stats.istats.n_steps += steps_count;
+        stats.istats.n_reduced_to_one_page += small_range_finish;
+        stats.istats.n_page_in_core_checks += page_scan_steps_num;
+        stats.istats.n_page_in_core_errors += page_scan_errors;
+        stats.istats.n_pages_in_core_found += page_scan_success;
+        stats.istats.n_pages_in_core_miss += page_miss;
         return true;
     }
 };
@@ -21,7 +21,8 @@
 #include "compression.h"
 
 #include <thread>
-#include <boost/heap/skew_heap.hpp>
+#include <exception>
+#include <cstring>
 #include <boost/range.hpp>
 #include <boost/range/iterator_range.hpp>
 
@@ -44,7 +45,13 @@ bool top_element_more(const RunType& x, const RunType& y)
     return top_element_less(y, x);
 }
 
-TimeSeriesValue::TimeSeriesValue() {}
+TimeSeriesValue::TimeSeriesValue()
+    : key_ts_(0u)
+    , key_id_(0u)
+    , type_(BLOB)
+{
+    memset(&payload, 0, sizeof(payload));
+}
 
 TimeSeriesValue::TimeSeriesValue(aku_TimeStamp ts, aku_ParamId id, aku_EntryOffset value, uint32_t value_length)
     : key_ts_(ts)
@@ -63,6 +70,14 @@ TimeSeriesValue::TimeSeriesValue(aku_TimeStamp ts, aku_ParamId id, double value)
     payload.value = value;
 }
 
+TimeSeriesValue::TimeSeriesValue(aku_TimeStamp ts, aku_ParamId id, int64_t value)
+    : key_ts_(ts)
+    , key_id_(id)
+    , type_(INT64)
+{
+    payload.ivalue = value;
+}
+
 aku_TimeStamp TimeSeriesValue::get_timestamp() const {
     return key_ts_;
 }
@@ -76,6 +91,9 @@ CursorResult TimeSeriesValue::to_result(PageHeader const *page) const {
     if (type_ == BLOB) {
         res.data.ptr = page->read_entry_data(payload.blob.value);
         res.length = payload.blob.value_length;
+    } else if (type_ == INT64) {
+        res.data.int64 = payload.ivalue;
+        res.length = AKU_LENGTH_INT64;
     } else {
         res.data.float64 = payload.value;
         res.length = 0;  // Indicates that res contains double value
@@ -91,6 +109,10 @@ void TimeSeriesValue::add_to_header(ChunkHeader *chunk_header) const {
     if (type_ == BLOB) {
         chunk_header->offsets.push_back(payload.blob.value);
         chunk_header->lengths.push_back(payload.blob.value_length);
+    } else if (type_ == INT64) {
+        chunk_header->offsets.push_back(0u);
+        chunk_header->lengths.push_back(AKU_LENGTH_INT64);
+        chunk_header->integers.push_back(payload.ivalue);
     } else {
         chunk_header->offsets.push_back(0u);
         chunk_header->lengths.push_back(0u);
@@ -102,37 +124,180 @@ bool TimeSeriesValue::is_blob() const {
     return type_ == BLOB;
 }
 
+double TimeSeriesValue::get_double() const {
+    return type_ == INT64 ? static_cast<double>(payload.ivalue) : payload.value;
+}
+
 bool operator < (TimeSeriesValue const& lhs, TimeSeriesValue const& rhs) {
     auto lhstup = std::make_tuple(lhs.key_ts_, lhs.key_id_);
     auto rhstup = std::make_tuple(rhs.key_ts_, rhs.key_id_);
     return lhstup < rhstup;
 }
 
+// RunArena
+
+RunArena::RunArena(size_t limit)
+    : used_ {0u}
+    , reserved_ {0u}
+    , limit_(limit)
+{
+}
+
+RunArena::~RunArena() {
+    release_cached_();
+}
+
+int RunArena::block_index_(size_t size) {
+    int ix = 0;
+    while ((static_cast<size_t>(1) << (ix + MIN_BLOCK_SHIFT)) < size) {
+        ix++;
+    }
+    return ix;
+}
+
+void RunArena::release_cached_() {
+    for (int ix = 0; ix < NUM_SIZES; ix++) {
+        for (auto ptr: free_[ix]) {
+            ::operator delete(ptr);
+            reserved_ -= static_cast<size_t>(1) << (ix + MIN_BLOCK_SHIFT);
+        }
+        free_[ix].clear();
+    }
+}
+
+void* RunArena::allocate(size_t size) {
+    auto ix = block_index_(size);
+    if (ix >= NUM_SIZES) {
+        throw std::bad_alloc();
+    }
+    auto block_size = static_cast<size_t>(1) << (ix + MIN_BLOCK_SHIFT);
+    used_ += block_size;
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!free_[ix].empty()) {
+        auto ptr = free_[ix].back();
+        free_[ix].pop_back();
+        return ptr;
+    }
+    if (limit_ != 0 && reserved_.load() + block_size > limit_) {
+        // Cached blocks of other sizes can't be used
+        release_cached_();
+    }
+    reserved_ += block_size;
+    return ::operator new(block_size);
+}
+
+void RunArena::deallocate(void* ptr, size_t size) {
+    auto ix = block_index_(size);
+    used_ -= static_cast<size_t>(1) << (ix + MIN_BLOCK_SHIFT);
+    std::lock_guard<std::mutex> guard(mutex_);
+    free_[ix].push_back(ptr);
+}
+
+size_t RunArena::get_used() const {
+    return used_.load();
+}
+
+size_t RunArena::get_reserved() const {
+    return reserved_.load();
+}
+
 // Sequencer
 
 Sequencer::Sequencer(PageHeader const* page, aku_Config config)
-    : window_size_(config.window_size)
+    : freeze_count_ {0}
+    , arena_(std::make_shared<RunArena>(config.max_cache_size))
+    , max_cache_size_(config.max_cache_size)
+    , early_bound_(0u)
+    , window_size_ {config.window_size}
+    , window_percentile_(std::min(config.window_percentile, 100u))
+    , max_window_(config.max_window ? config.max_window : config.window_size)
+    , min_window_(config.min_window ? std::min(config.min_window, max_window_)
+                                    : std::max(max_window_/LATENESS_BUCKETS, aku_Duration(1u)))
+    , lateness_(LATENESS_BUCKETS + 1, 0u)
+    , n_lateness_(0u)
+    , ready_bound_(0u)
     , page_(page)
     , top_timestamp_()
     , checkpoint_(0u)
     , sequence_number_ {0}
     , run_locks_(RUN_LOCK_FLAGS_SIZE)
-    , space_estimate_(0u)
+    , space_estimate_ {0u}
+    , ready_estimate_ {0u}
     , c_threshold_(config.compression_threshold)
+    , merge_threads_(config.merge_threads)
+    , chunk_encoding_(config.chunk_encoding)
+    , codec_policy_(config.codec_policy)
 {
     key_.reset(new SortedRun());
     key_->push_back(TimeSeriesValue());
+    if (config.writer_runs) {
+        for (int i = 0; i < WRITER_SLOTS; i++) {
+            writers_.emplace_back(new WriterRuns());
+        }
+    }
+    if (window_percentile_) {
+        window_size_.store(std::min(std::max(window_size_.load(), min_window_), max_window_));
+    }
+}
+
+Sequencer::WriterRuns& Sequencer::writer_slot_() {
+    static std::atomic<int> n_writers {0};
+    static thread_local int writer_index = n_writers.fetch_add(1);
+    return *writers_[writer_index % WRITER_SLOTS];
+}
+
+Sequencer::PSortedRun Sequencer::make_run_() const {
+    return std::make_shared<SortedRun>(RunAllocator<TimeSeriesValue>(arena_));
+}
+
+void Sequencer::insert_(std::vector<PSortedRun>* runs, TimeSeriesValue const& value) const {
+    // Runs are ordered by top element in descending order
+    auto insert_it = lower_bound(runs->begin(), runs->end(), value,
+                                 [](PSortedRun const& run, TimeSeriesValue const& val) {
+                                     return val < run->back();
+                                 });
+    if (insert_it == runs->end()) {
+        PSortedRun new_pile = make_run_();
+        new_pile->push_back(value);
+        runs->push_back(move(new_pile));
+    } else {
+        (*insert_it)->push_back(value);
+    }
+}
+
+vector<Sequencer::PSortedRun> Sequencer::split_runs_(vector<PSortedRun>& runs, aku_TimeStamp old_top) {
+    vector<PSortedRun> new_runs;
+    for (auto& sorted_run: runs) {
+        auto it = lower_bound(sorted_run->begin(), sorted_run->end(), TimeSeriesValue(old_top, AKU_LIMITS_MAX_ID, 0u, 0u));
+        if (it == sorted_run->begin()) {
+            // all timestamps are newer than old_top, do nothing
+            new_runs.push_back(move(sorted_run));
+            continue;
+        } else if (it == sorted_run->end()) {
+            // all timestamps are older than old_top, move them
+            ready_.push_back(move(sorted_run));
+        } else {
+            // it is in between of the sorted run - split
+            PSortedRun run = make_run_();
+            run->assign(sorted_run->begin(), it);  // copy old
+            ready_.push_back(move(run));
+            run = make_run_();
+            run->assign(it, sorted_run->end());  // copy new
+            new_runs.push_back(move(run));
+        }
+    }
+    return new_runs;
 }
 
 //! Checkpoint id = ⌊timestamp/window_size⌋
 uint32_t Sequencer::get_checkpoint_(aku_TimeStamp ts) const {
     // TODO: use fast integer division (libdivision or else)
-    return ts / window_size_;
+    return ts / window_size_.load();
 }
 
 //! Convert checkpoint id to timestamp
 aku_TimeStamp Sequencer::get_timestamp_(uint32_t cp) const {
-    return cp*window_size_;
+    return cp*window_size_.load();
 }
 
 // move sorted runs to ready_ collection
@@ -141,46 +306,128 @@ int Sequencer::make_checkpoint_(uint32_t new_checkpoint) {
     if (flag % 2 != 0) {
         auto old_top = get_timestamp_(checkpoint_);
         checkpoint_ = new_checkpoint;
-        vector<PSortedRun> new_runs;
-        for (auto& sorted_run: runs_) {
-            auto it = lower_bound(sorted_run->begin(), sorted_run->end(), TimeSeriesValue(old_top, AKU_LIMITS_MAX_ID, 0u, 0u));
-            if (it == sorted_run->begin()) {
-                // all timestamps are newer than old_top, do nothing
-                new_runs.push_back(move(sorted_run));
-                continue;
-            } else if (it == sorted_run->end()) {
-                // all timestamps are older than old_top, move them
-                ready_.push_back(move(sorted_run));
-            } else {
-                // it is in between of the sorted run - split
-                PSortedRun run(new SortedRun());
-                copy(sorted_run->begin(), it, back_inserter(*run));  // copy old
-                ready_.push_back(move(run));
-                run.reset(new SortedRun());
-                copy(it, sorted_run->end(), back_inserter(*run));  // copy new
-                new_runs.push_back(move(run));
-            }
-        }
-        Lock guard(runs_resize_lock_);
-        space_estimate_ = 0u;
-        for (auto& sorted_run: new_runs) {
-            space_estimate_ += sorted_run->size() * SPACE_PER_ELEMENT;
+        if (window_percentile_) {
+            // Checkpoint id depends on window size, it's recalculated
+            // to point to the same (or earlier) timestamp
+            auto cp_timestamp = get_timestamp_(checkpoint_);
+            update_window_();
+            checkpoint_ = get_checkpoint_(cp_timestamp);
         }
-        swap(runs_, new_runs);
+        // If ready doesn't contains enough data compression wouldn't be efficient,
+        //  we need to wait for more data to come
+        flag = move_to_ready_(old_top, c_threshold_, flag);
+    }
+    return flag;
+}
+
+void Sequencer::add_lateness_(aku_Duration lateness) {
+    // Bucket width is chosen to cover [0, max_window_), larger
+    // values (rejected late writes) goes to the overflow bucket
+    auto width = std::max(max_window_/LATENESS_BUCKETS, aku_Duration(1u));
+    auto ix = std::min(lateness/width, aku_Duration(LATENESS_BUCKETS));
+    lateness_[ix]++;
+    n_lateness_++;
+}
 
-        size_t ready_size = 0u;
-        for (auto& sorted_run: ready_) {
-            ready_size += sorted_run->size();
+void Sequencer::update_window_() {
+    if (n_lateness_ < WINDOW_MIN_SAMPLES) {
+        // Not enough data, histogram is accumulated until next checkpoint
+        return;
+    }
+    auto width = std::max(max_window_/LATENESS_BUCKETS, aku_Duration(1u));
+    auto target = (n_lateness_*window_percentile_ + 99u)/100u;
+    uint64_t count = 0u;
+    aku_Duration window = max_window_;
+    for (int ix = 0; ix < LATENESS_BUCKETS; ix++) {
+        count += lateness_[ix];
+        if (count >= target) {
+            window = (ix + 1)*width;
+            break;
         }
-        if (ready_size < c_threshold_) {
-            // If ready doesn't contains enough data compression wouldn't be efficient,
-            //  we need to wait for more data to come
-            flag = sequence_number_.fetch_add(1) + 1;
+    }
+    window_size_.store(std::min(std::max(window, min_window_), max_window_));
+    std::fill(lateness_.begin(), lateness_.end(), 0u);
+    n_lateness_ = 0u;
+}
+
+int Sequencer::make_early_checkpoint_() {
+    // Samples older than top_timestamp_ - window_size_ can't be followed by
+    // late writes, chunks written by early checkpoints doesn't overlap
+    auto window = window_size_.load();
+    if (top_timestamp_ < window) {
+        return 0;
+    }
+    auto bound = top_timestamp_ - window;
+    if (bound < early_bound_ + window/EARLY_CHECKPOINT_STEPS) {
+        return 0;
+    }
+    int flag = sequence_number_.fetch_add(1) + 1;
+    if (flag % 2 != 0) {
+        early_bound_ = bound;
+        // Merge is needed to recycle memory regardless of compression threshold
+        flag = move_to_ready_(bound, 1u, flag);
+    }
+    return flag;
+}
+
+int Sequencer::move_to_ready_(aku_TimeStamp bound, size_t threshold, int flag) {
+    uint32_t space_estimate = 0u;
+    // Search shouldn't see samples in both active runs and ready_
+    Lock guard(runs_resize_lock_);
+    ready_bound_ = std::max(ready_bound_, bound);
+    for (auto& writer: writers_) {
+        writer->lock.wrlock();
+        auto new_runs = split_runs_(writer->runs, bound);
+        for (auto& sorted_run: new_runs) {
+            space_estimate += sorted_run->size() * SPACE_PER_ELEMENT;
         }
+        swap(writer->runs, new_runs);
+        writer->lock.unlock();
+    }
+    auto new_runs = split_runs_(runs_, bound);
+    for (auto& sorted_run: new_runs) {
+        space_estimate += sorted_run->size() * SPACE_PER_ELEMENT;
+    }
+    swap(runs_, new_runs);
+    new_runs = split_runs_(frozen_, bound);
+    for (auto& sorted_run: new_runs) {
+        space_estimate += sorted_run->size() * SPACE_PER_ELEMENT;
+    }
+    swap(frozen_, new_runs);
+    space_estimate_.store(space_estimate);
+
+    size_t ready_size = 0u;
+    for (auto& sorted_run: ready_) {
+        ready_size += sorted_run->size();
+    }
+    ready_estimate_.store(ready_size * SPACE_PER_ELEMENT);
+    // Empty checkpoint can't be merged (window size can change between checkpoints)
+    if (ready_size == 0 || ready_size < threshold) {
+        flag = sequence_number_.fetch_add(1) + 1;
     }
     return flag;
 }
 
+bool Sequencer::over_budget_() const {
+    return max_cache_size_ != 0 && arena_->get_used() >= max_cache_size_;
+}
+
+std::tuple<int, int> Sequencer::check_budget_(aku_TimeStamp ts) {
+    if (!over_budget_()) {
+        return make_tuple(AKU_SUCCESS, 0);
+    }
+    int flag = 0;
+    if (sequence_number_.load() % 2 == 0) {
+        flag = make_early_checkpoint_();
+    }
+    if (ts < top_timestamp_) {
+        // Late writes are rejected until memory is recycled, new samples
+        // are accepted, they move the late write window forward
+        return make_tuple(AKU_EBUSY, flag);
+    }
+    return make_tuple(AKU_SUCCESS, flag);
+}
+
 /** Check timestamp and make checkpoint if timestamp is large enough.
   * @returns error code and flag that indicates whether or not new checkpoint is created
   */
@@ -188,19 +435,27 @@ std::tuple<int, int> Sequencer::check_timestamp_(aku_TimeStamp ts) {
     int error_code = AKU_SUCCESS;
     if (ts < top_timestamp_) {
         auto delta = top_timestamp_ - ts;
-        if (delta > window_size_) {
+        if (window_percentile_) {
+            add_lateness_(delta);
+        }
+        // Window can grow after checkpoint, samples older than ready_bound_
+        // can't be added anyway (they can be merged already)
+        if (delta > window_size_.load() || ts < ready_bound_) {
             error_code = AKU_ELATE_WRITE;
         }
         return make_tuple(error_code, 0);
     }
+    if (window_percentile_) {
+        add_lateness_(0u);
+    }
     auto point = get_checkpoint_(ts);
     int flag = 0;
     if (point > checkpoint_) {
-        // Create new checkpoint
-        flag = make_checkpoint_(point);
-        if (flag % 2 == 0) {
-            // Previous checkpoint not completed
-            error_code = AKU_EBUSY;
+        // Create new checkpoint only if previous one is merged, otherwise
+        // new values stays in runs_ until merge is completed. Merge can be
+        // performed by another thread.
+        if (sequence_number_.load() % 2 == 0) {
+            flag = make_checkpoint_(point);
         }
     }
     top_timestamp_ = ts;
@@ -208,46 +463,165 @@ std::tuple<int, int> Sequencer::check_timestamp_(aku_TimeStamp ts) {
 }
 
 std::tuple<int, int> Sequencer::add(TimeSeriesValue const& value) {
-    // FIXME: max_cache_size_ is not used
     int status = 0;
     int lock = 0;
     tie(status, lock) = check_timestamp_(value.get_timestamp());
     if (status != AKU_SUCCESS) {
         return make_tuple(status, lock);
     }
+    if (lock % 2 == 0) {
+        int budget_lock = 0;
+        tie(status, budget_lock) = check_budget_(value.get_timestamp());
+        if (budget_lock % 2 == 1) {
+            lock = budget_lock;
+        }
+        if (status != AKU_SUCCESS) {
+            return make_tuple(status, lock);
+        }
+    }
+
+    if (!writers_.empty()) {
+        // Only writers that share the slot can contend with each other
+        auto& writer = writer_slot_();
+        writer.lock.wrlock();
+        insert_(&writer.runs, value);
+        writer.lock.unlock();
+        space_estimate_ += SPACE_PER_ELEMENT;
+        return make_tuple(AKU_SUCCESS, lock);
+    }
 
     key_->pop_back();
     key_->push_back(value);
 
     Lock guard(runs_resize_lock_);
     space_estimate_ += SPACE_PER_ELEMENT;
-    auto begin = runs_.begin();
-    auto end = runs_.end();
-    auto insert_it = lower_bound(begin, end, key_, top_element_more<PSortedRun>);
-    int run_ix = distance(begin, insert_it);
-    bool new_run_needed = insert_it == runs_.end();
-    SortedRun* run = nullptr;
-    if (!new_run_needed) {
-        run = insert_it->get();
-    }
-    guard.unlock();
+    while (true) {
+        auto freeze_count = freeze_count_.load();
+        auto begin = runs_.begin();
+        auto end = runs_.end();
+        auto insert_it = lower_bound(begin, end, key_, top_element_more<PSortedRun>);
+        if (insert_it == end) {
+            PSortedRun new_pile = make_run_();
+            new_pile->push_back(value);
+            runs_.push_back(move(new_pile));
+            break;
+        }
+        int run_ix = distance(begin, insert_it);
+        SortedRun* run = insert_it->get();
+        guard.unlock();
 
-    if (!new_run_needed) {
         auto ix = run_ix & RUN_LOCK_FLAGS_MASK;
         auto& rwlock = run_locks_.at(ix);
         rwlock.wrlock();
-        run->push_back(value);
+        if (freeze_count == freeze_count_.load()) {
+            run->push_back(value);
+            rwlock.unlock();
+            break;
+        }
+        // Run was frozen by search in between, it can't be changed
         rwlock.unlock();
-    } else {
         guard.lock();
-        PSortedRun new_pile(new SortedRun());
-        new_pile->push_back(value);
-        runs_.push_back(move(new_pile));
-        guard.unlock();
     }
     return make_tuple(AKU_SUCCESS, lock);
 }
 
+std::tuple<int, int> Sequencer::add_batch(TimeSeriesValue const* begin, size_t size, int* statuses) {
+    int first_error = AKU_SUCCESS;
+    int merge_lock = 0;
+    std::vector<TimeSeriesValue> sequence;
+    size_t ix = 0;
+    while (ix < size) {
+        sequence.clear();
+        // Memory budget is checked once per sequence, early checkpoint (if any)
+        // is made before the sequence is added
+        bool over_budget = over_budget_();
+        if (over_budget && sequence_number_.load() % 2 == 0) {
+            int lock = make_early_checkpoint_();
+            if (lock % 2 == 1) {
+                merge_lock = lock;
+            }
+        }
+        for (; ix < size; ix++) {
+            auto ts = begin[ix].get_timestamp();
+            bool checkpoint = ts >= top_timestamp_
+                           && get_checkpoint_(ts) > checkpoint_
+                           && sequence_number_.load() % 2 == 0;
+            if (checkpoint && !sequence.empty()) {
+                // Previous samples must be added before the checkpoint
+                break;
+            }
+            int status = 0;
+            int lock = 0;
+            tie(status, lock) = check_timestamp_(ts);
+            if (status == AKU_SUCCESS && over_budget && ts < top_timestamp_) {
+                status = AKU_EBUSY;
+            }
+            if (status != AKU_SUCCESS) {
+                statuses[ix] = status;
+                if (first_error == AKU_SUCCESS) {
+                    first_error = status;
+                }
+                continue;
+            }
+            if (lock % 2 == 1) {
+                merge_lock = lock;
+            }
+            sequence.push_back(begin[ix]);
+        }
+        add_sorted_(sequence);
+    }
+    return make_tuple(first_error, merge_lock);
+}
+
+void Sequencer::add_sorted_(std::vector<TimeSeriesValue> const& values) {
+    if (values.size() >= BULK_RUN_SIZE) {
+        PSortedRun run = make_run_();
+        run->assign(values.begin(), values.end());
+        add_run_(move(run));
+        return;
+    }
+    if (!writers_.empty()) {
+        auto& writer = writer_slot_();
+        writer.lock.wrlock();
+        for (auto const& value: values) {
+            insert_(&writer.runs, value);
+        }
+        writer.lock.unlock();
+        space_estimate_ += values.size() * SPACE_PER_ELEMENT;
+        return;
+    }
+    Lock guard(runs_resize_lock_);
+    space_estimate_ += values.size() * SPACE_PER_ELEMENT;
+    RWLock* wrlock = nullptr;
+    for (auto const& value: values) {
+        key_->pop_back();
+        key_->push_back(value);
+        auto begin = runs_.begin();
+        auto end = runs_.end();
+        auto insert_it = lower_bound(begin, end, key_, top_element_more<PSortedRun>);
+        if (insert_it == end) {
+            PSortedRun new_pile = make_run_();
+            new_pile->push_back(value);
+            runs_.push_back(move(new_pile));
+            continue;
+        }
+        // Consecutive samples usually goes to the same run
+        auto ix = distance(begin, insert_it) & RUN_LOCK_FLAGS_MASK;
+        auto rwlock = &run_locks_.at(ix);
+        if (rwlock != wrlock) {
+            if (wrlock) {
+                wrlock->unlock();
+            }
+            rwlock->wrlock();
+            wrlock = rwlock;
+        }
+        (*insert_it)->push_back(value);
+    }
+    if (wrlock) {
+        wrlock->unlock();
+    }
+}
+
 template<class Cont>
 void wrlock_all(Cont& cont) {
     for (auto& rwlock: cont) {
@@ -262,39 +636,60 @@ void unlock_all(Cont& cont) {
     }
 }
 
+void Sequencer::add_run_(PSortedRun run) {
+    auto nelements = run->size();
+    if (!writers_.empty()) {
+        auto& writer = writer_slot_();
+        writer.lock.wrlock();
+        auto it = upper_bound(writer.runs.begin(), writer.runs.end(), run, top_element_more<PSortedRun>);
+        writer.runs.insert(it, move(run));
+        writer.lock.unlock();
+        space_estimate_ += nelements * SPACE_PER_ELEMENT;
+        return;
+    }
+    Lock guard(runs_resize_lock_);
+    space_estimate_ += nelements * SPACE_PER_ELEMENT;
+    auto it = upper_bound(runs_.begin(), runs_.end(), run, top_element_more<PSortedRun>);
+    if (it == runs_.end()) {
+        runs_.push_back(move(run));
+        return;
+    }
+    // Runs are shifted and run_locks_ indexes become invalid, writers
+    // that locked the run before the shift will retry
+    wrlock_all(run_locks_);
+    runs_.insert(it, move(run));
+    freeze_count_++;
+    unlock_all(run_locks_);
+}
+
 int Sequencer::reset() {
+    Lock guard(runs_resize_lock_);
+    for (auto& writer: writers_) {
+        writer->lock.wrlock();
+        for (auto& sorted_run: writer->runs) {
+            ready_.push_back(move(sorted_run));
+        }
+        writer->runs.clear();
+        writer->lock.unlock();
+    }
     wrlock_all(run_locks_);
     for (auto& sorted_run: runs_) {
         ready_.push_back(move(sorted_run));
     }
+    runs_.clear();
     unlock_all(run_locks_);
+    for (auto& sorted_run: frozen_) {
+        ready_.push_back(move(sorted_run));
+    }
+    frozen_.clear();
 
-    runs_resize_lock_.lock();
-    runs_.clear();
-    runs_resize_lock_.unlock();
+    ready_estimate_.store(ready_estimate_.load() + space_estimate_.load());
+    space_estimate_.store(0u);
+    guard.unlock();
     sequence_number_.store(1);
     return 1;
 }
 
-template<class TKey, int dir>
-struct MergePred;
-
-template<class TKey>
-struct MergePred<TKey, AKU_CURSOR_DIR_FORWARD> {
-    greater<TKey> greater_;
-    bool operator () (TKey const& lhs, TKey const& rhs) const {
-        return greater_(lhs, rhs);
-    }
-};
-
-template<class TKey>
-struct MergePred<TKey, AKU_CURSOR_DIR_BACKWARD> {
-    less<TKey> less_;
-    bool operator () (TKey const& lhs, TKey const& rhs) const {
-        return less_(lhs, rhs);
-    }
-};
-
 template<class TRun, int dir>
 struct RunIter;
 
@@ -316,49 +711,84 @@ struct RunIter<std::shared_ptr<TRun>, AKU_CURSOR_DIR_BACKWARD> {
     }
 };
 
-/** Merge sequences and push it to consumer */
-template <int dir, class Consumer>
-void kway_merge(vector<Sequencer::PSortedRun> const& runs, Consumer& cons) {
-    typedef RunIter<Sequencer::PSortedRun, dir> RIter;
-    typedef typename RIter::range_type range_t;
-    typedef typename RIter::value_type KeyType;
-    std::vector<range_t> ranges;
-    for(auto i = runs.begin(); i != runs.end(); i++) {
-        ranges.push_back(RIter::make_range(*i));
-    }
-
-    typedef tuple<KeyType, int> HeapItem;
-    typedef MergePred<HeapItem, dir> Comp;
-    typedef boost::heap::skew_heap<HeapItem, boost::heap::compare<Comp>> Heap;
-    Heap heap;
+/** Merge ranges of sorted runs and push it to consumer */
+template <int dir, class Range, class Consumer>
+void kway_merge_ranges(std::vector<Range>& ranges, Consumer& cons) {
+    typedef typename Range::value_type KeyType;
+    MergeOrder<std::less<KeyType>, dir> order;
+    LoserTree<KeyType> tree(ranges.size());
 
     int index = 0;
     for(auto& range: ranges) {
         if (!range.empty()) {
-            KeyType value = range.front();
+            tree.set(index, range.front());
             range.advance_begin(1);
-            heap.push(make_tuple(value, index));
         }
         index++;
     }
+    tree.build(order);
 
-    while(!heap.empty()) {
-        HeapItem item = heap.top();
-        KeyType point = get<0>(item);
-        int index = get<1>(item);
-        if (!cons(point)) {
+    while(!tree.empty()) {
+        if (!cons(tree.top())) {
             // Interrupted
             return;
         }
-        heap.pop();
-        if (!ranges[index].empty()) {
-            KeyType point = ranges[index].front();
-            ranges[index].advance_begin(1);
-            heap.push(make_tuple(point, index));
+        auto& range = ranges[tree.winner()];
+        if (!range.empty()) {
+            tree.replace_top(range.front(), order);
+            range.advance_begin(1);
+        } else {
+            tree.pop_top(order);
         }
     }
 }
 
+/** Merge sequences and push it to consumer */
+template <int dir, class Consumer>
+void kway_merge(vector<Sequencer::PSortedRun> const& runs, Consumer& cons) {
+    typedef RunIter<Sequencer::PSortedRun, dir> RIter;
+    typedef typename RIter::range_type range_t;
+    std::vector<range_t> ranges;
+    for(auto i = runs.begin(); i != runs.end(); i++) {
+        ranges.push_back(RIter::make_range(*i));
+    }
+    kway_merge_ranges<dir>(ranges, cons);
+}
+
+Sequencer::PSnapshot Sequencer::get_snapshot() const {
+    auto snapshot = std::make_shared<Snapshot>();
+    Lock guard(runs_resize_lock_);
+    // Active runs become immutable, new samples are added to new runs
+    freeze_count_++;
+    wrlock_all(run_locks_);
+    move(runs_.begin(), runs_.end(), back_inserter(frozen_));
+    runs_.clear();
+    unlock_all(run_locks_);
+    for (auto& writer: writers_) {
+        writer->lock.wrlock();
+        move(writer->runs.begin(), writer->runs.end(), back_inserter(frozen_));
+        writer->runs.clear();
+        writer->lock.unlock();
+    }
+    if (frozen_.size() > FROZEN_RUNS_MAX) {
+        // Every snapshot adds new frozen runs, they are compacted to keep
+        // the number of runs (and search cost) bounded
+        PSortedRun compacted = make_run_();
+        auto consumer = [&compacted](TimeSeriesValue const& val) {
+            compacted->push_back(val);
+            return true;
+        };
+        kway_merge<AKU_CURSOR_DIR_FORWARD>(frozen_, consumer);
+        frozen_.clear();
+        frozen_.push_back(move(compacted));
+    }
+    snapshot->runs = frozen_;
+    copy(ready_.begin(), ready_.end(), back_inserter(snapshot->runs));
+    snapshot->page = page_;
+    snapshot->page_count = page_ ? page_->sync_count : 0u;
+    return snapshot;
+}
+
 void Sequencer::merge(Caller& caller, InternalCursor* cur) {
     bool owns_lock = sequence_number_.load() % 2;  // progress_flag_ must be odd to start
     if (!owns_lock) {
@@ -381,121 +811,370 @@ void Sequencer::merge(Caller& caller, InternalCursor* cur) {
 
     kway_merge<AKU_CURSOR_DIR_FORWARD>(ready_, consumer);
 
+    Lock guard(runs_resize_lock_);
     ready_.clear();
+    guard.unlock();
     cur->complete(caller);
 
     sequence_number_.fetch_add(1);  // progress_flag_ is even again
 }
 
-aku_Status Sequencer::merge_and_compress(PageHeader* target) {
+aku_Status Sequencer::merge_and_compress(PageHeader* target,
+                                         std::function<void(ChunkHeader const&)> const& on_complete)
+{
     bool owns_lock = sequence_number_.load() % 2;  // progress_flag_ must be odd to start
     if (!owns_lock) {
         return AKU_EBUSY;
     }
     if (ready_.size() == 0) {
+        sequence_number_.fetch_add(1);  // nothing to merge, release the lock
         return AKU_ENO_DATA;
     }
 
-    ChunkHeader chunk_header;
+    // Chunks are compressed without the lock
+    std::vector<ChunkHeader> headers;
+    std::vector<EncodedChunk> chunks;
+    merge_partitions_(target, &headers, &chunks);
 
-    auto consumer = [&](TimeSeriesValue const& val) {
-        val.add_to_header(&chunk_header);
-        return true;
-    };
-
-    kway_merge<AKU_CURSOR_DIR_FORWARD>(ready_, consumer);
+    // Chunks are written to the page and ready_ is cleared under the lock,
+    // snapshot contains either runs from ready_ or chunks, never both
+    aku_Status status = AKU_SUCCESS;
+    size_t nwritten = 0u;
+    Lock guard(runs_resize_lock_);
+    for (; nwritten < headers.size(); nwritten++) {
+        if (headers[nwritten].timestamps.empty()) {
+            // Partition can be empty if bounds are skewed
+            continue;
+        }
+        status = target->complete_chunk(headers[nwritten], chunks[nwritten]);
+        if (status != AKU_SUCCESS) {
+            break;
+        }
+    }
     ready_.clear();
+    guard.unlock();
 
-    auto status = target->complete_chunk(chunk_header);
-    if (status != AKU_SUCCESS) {
-        return status;
+    if (on_complete) {
+        for (size_t ix = 0; ix < nwritten; ix++) {
+            if (!headers[ix].timestamps.empty()) {
+                on_complete(headers[ix]);
+            }
+        }
     }
+    // ready_ is cleared even if page is full, lock should be released
+    // anyway or all subsequent checkpoints will be postponed forever
+    ready_estimate_.store(0u);
     sequence_number_.fetch_add(1);  // progress_flag_ is even again
-    return AKU_SUCCESS;
+    return status;
+}
+
+std::vector<TimeSeriesValue> Sequencer::partition_ready_(size_t nparts) const {
+    // Partition bounds are quantiles of the sample taken from all runs
+    const size_t SAMPLES_PER_PARTITION = 0x40;
+    size_t total = 0u;
+    for (auto const& run: ready_) {
+        total += run->size();
+    }
+    size_t step = std::max(total / (nparts*SAMPLES_PER_PARTITION), static_cast<size_t>(1u));
+    std::vector<TimeSeriesValue> samples;
+    for (auto const& run: ready_) {
+        for (size_t ix = step / 2; ix < run->size(); ix += step) {
+            samples.push_back(run->at(ix));
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    std::vector<TimeSeriesValue> bounds;
+    for (size_t i = 1; i < nparts; i++) {
+        auto const& bound = samples.at(i*samples.size()/nparts);
+        if (bounds.empty() || bounds.back() < bound) {
+            bounds.push_back(bound);
+        }
+    }
+    return bounds;
+}
+
+void Sequencer::merge_partitions_(PageHeader* target,
+                                  std::vector<ChunkHeader>* headers,
+                                  std::vector<EncodedChunk>* chunks) const
+{
+    typedef RunIter<PSortedRun, AKU_CURSOR_DIR_FORWARD>::range_type range_t;
+    size_t total = 0u;
+    for (auto const& run: ready_) {
+        total += run->size();
+    }
+    size_t nparts = std::min(static_cast<size_t>(merge_threads_), total / MERGE_PARTITION_SIZE);
+    if (nparts < 2) {
+        headers->resize(1);
+        chunks->resize(1);
+        auto& header = headers->front();
+        auto consumer = [&header](TimeSeriesValue const& val) {
+            val.add_to_header(&header);
+            return true;
+        };
+        kway_merge<AKU_CURSOR_DIR_FORWARD>(ready_, consumer);
+        if (!header.timestamps.empty()) {
+            // Page can't be changed until merge_and_compress completes, chunk
+            // data isn't visible to readers until it is completed by the page
+            auto encoding = CompressionUtil::select_encoding(header, codec_policy_, chunk_encoding_);
+            chunks->front().encode(header, encoding, target->get_chunk_space());
+        }
+        return;
+    }
+
+    auto bounds = partition_ready_(nparts);
+    nparts = bounds.size() + 1;
+    headers->resize(nparts);
+    chunks->resize(nparts);
+
+    // Partition `i` contains elements from [bounds[i - 1], bounds[i]) of every run
+    auto merge_partition = [&](size_t i) {
+        std::vector<range_t> ranges;
+        for (auto const& run: ready_) {
+            auto begin = i == 0 ? run->cbegin() : lower_bound(run->cbegin(), run->cend(), bounds[i - 1]);
+            auto end = i == bounds.size() ? run->cend() : lower_bound(begin, run->cend(), bounds[i]);
+            ranges.push_back(boost::make_iterator_range(begin, end));
+        }
+        auto& header = headers->at(i);
+        auto consumer = [&header](TimeSeriesValue const& val) {
+            val.add_to_header(&header);
+            return true;
+        };
+        kway_merge_ranges<AKU_CURSOR_DIR_FORWARD>(ranges, consumer);
+        if (!header.timestamps.empty()) {
+            auto encoding = CompressionUtil::select_encoding(header, codec_policy_, chunk_encoding_);
+            chunks->at(i).encode(header, encoding);
+        }
+    };
+
+    // Errors are rethrown in merger thread
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(nparts);
+    for (size_t i = 0; i < nparts; i++) {
+        threads.emplace_back([&merge_partition, &errors, i]() {
+            try {
+                merge_partition(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    for (auto& err: errors) {
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
 }
 
 std::tuple<aku_TimeStamp, int> Sequencer::get_window() const {
-    return std::make_tuple(top_timestamp_ - window_size_, sequence_number_.load());
+    return std::make_tuple(top_timestamp_ - window_size_.load(), sequence_number_.load());
 }
 
 uint32_t Sequencer::get_space_estimate() const {
-    // ready_ must be empty here
-    return space_estimate_ + SPACE_PER_ELEMENT;
+    return space_estimate_.load() + ready_estimate_.load() + SPACE_PER_ELEMENT;
 }
 
-struct SearchPredicate {
-    SearchQuery const& query;
-    SearchPredicate(SearchQuery const& q) : query(q) {}
+size_t Sequencer::get_memory_usage() const {
+    return arena_->get_used();
+}
 
-    bool operator () (TimeSeriesValue const& value) const {
-        if (query.lowerbound <= value.get_timestamp() &&
-            query.upperbound >= value.get_timestamp())
-        {
-            if (query.param_pred(value.get_paramid()) == SearchQuery::MATCH) {
-                return true;
-            }
+void Sequencer::get_memory_stats(aku_MemoryStats* rcv_stats) const {
+    auto add_runs = [rcv_stats](std::vector<PSortedRun> const& runs) {
+        for (auto const& run: runs) {
+            uint64_t bytes = run->capacity()*sizeof(TimeSeriesValue);
+            rcv_stats->sequencer_runs++;
+            rcv_stats->sequencer_run_bytes += bytes;
+            rcv_stats->sequencer_max_run_bytes = std::max(rcv_stats->sequencer_max_run_bytes, bytes);
         }
-        return false;
+    };
+    Lock guard(runs_resize_lock_);
+    // Writers hold run locks only while runs are changed, readers don't block them for long
+    for (auto& rwlock: run_locks_) {
+        rwlock.rdlock();
     }
-};
-
-void Sequencer::filter(PSortedRun run, SearchQuery const& q, std::vector<PSortedRun>* results) const {
-    if (run->empty()) {
-        return;
+    add_runs(runs_);
+    for (auto& rwlock: run_locks_) {
+        rwlock.unlock();
+    }
+    for (auto& writer: writers_) {
+        writer->lock.rdlock();
+        add_runs(writer->runs);
+        writer->lock.unlock();
+    }
+    add_runs(frozen_);
+    for (auto const& run: ready_) {
+        rcv_stats->sequencer_ready++;
+        rcv_stats->sequencer_ready_bytes += run->capacity()*sizeof(TimeSeriesValue);
     }
-    SearchPredicate search_pred(q);
-    PSortedRun result(new SortedRun);
-    auto lkey = TimeSeriesValue(q.lowerbound, 0u, 0u, 0u);
-    auto rkey = TimeSeriesValue(q.upperbound, ~0u, 0u, 0u);
-    auto begin = std::lower_bound(run->begin(), run->end(), lkey);
-    auto end = std::upper_bound(run->begin(), run->end(), rkey);
-    copy_if(begin, end, std::back_inserter(*result), search_pred);
-    results->push_back(move(result));
+    rcv_stats->sequencer_arena_bytes += arena_->get_reserved();
+}
+
+aku_Duration Sequencer::get_window_size() const {
+    return window_size_.load();
 }
 
 void Sequencer::search(Caller& caller, InternalCursor* cur, SearchQuery query, int sequence_number) const {
-    int seq_id = sequence_number_.load();
+    SequencerSearch search(this, query, sequence_number);
+    run_search(caller, cur, search);
+}
+
+// SequencerSearch
+
+SequencerSearch::SequencerSearch(Sequencer const* seq, SearchQuery const& query, int sequence_number)
+    : seq_(seq)
+    , seq_id_(sequence_number)
+    , query_(query)
+    , limit_(query.limit)
+    , n_results_(0u)
+    , tree_(0u)
+    , done_(false)
+    , error_code_(AKU_SUCCESS)
+{
+    int seq_id = seq->sequence_number_.load();
     if (seq_id % 2 != 0 || sequence_number != seq_id) {
-        cur->set_error(caller, AKU_EBUSY);
+        error_code_ = AKU_EBUSY;
+        done_ = true;
         return;
     }
-    std::vector<PSortedRun> filtered;
-    std::vector<PSortedRun> pruns;
-    Lock runs_guard(runs_resize_lock_);
-    pruns = runs_;
-    runs_guard.unlock();
-    int run_ix = 0;
-    for (auto const& run: pruns) {
-        auto ix = run_ix & RUN_LOCK_FLAGS_MASK;
-        auto& rwlock = run_locks_.at(ix);
-        rwlock.rdlock();
-        filter(run, query, &filtered);
-        rwlock.unlock();
-        run_ix++;
-    }
+    snapshot_ = seq->get_snapshot();
+    init_();
+}
 
-    auto page = page_;
-    auto consumer = [&caller, cur, page](TimeSeriesValue const& val) {
-        CursorResult result = {
-            val.payload.blob.value_length,
-            val.get_timestamp(),
-            val.get_paramid(),
-            page->read_entry_data(val.payload.blob.value)
-        };
-        return cur->put(caller, result);
-    };
+SequencerSearch::SequencerSearch(Sequencer::PSnapshot snapshot, SearchQuery const& query)
+    : seq_(nullptr)
+    , snapshot_(snapshot)
+    , seq_id_(0)
+    , query_(query)
+    , limit_(query.limit)
+    , n_results_(0u)
+    , tree_(0u)
+    , done_(false)
+    , error_code_(AKU_SUCCESS)
+{
+    init_();
+}
 
-    if (query.direction == AKU_CURSOR_DIR_FORWARD) {
-        kway_merge<AKU_CURSOR_DIR_FORWARD>(filtered, consumer);
+void SequencerSearch::init_() {
+    auto lkey = TimeSeriesValue(query_.lowerbound, 0u, 0u, 0u);
+    auto rkey = TimeSeriesValue(query_.upperbound, AKU_LIMITS_MAX_ID, 0u, 0u);
+    for (auto const& run: snapshot_->runs) {
+        auto begin = std::lower_bound(run->begin(), run->end(), lkey);
+        auto end = std::upper_bound(begin, run->end(), rkey);
+        if (begin != end) {
+            RunRange range = {
+                run.get(),
+                static_cast<size_t>(begin - run->begin()),
+                static_cast<size_t>(end - run->begin())
+            };
+            ranges_.push_back(range);
+        }
+    }
+    tree_ = LoserTree<TimeSeriesValue>(ranges_.size());
+    TimeSeriesValue value;
+    for (int i = 0; i < static_cast<int>(ranges_.size()); i++) {
+        if (next_(i, &value)) {
+            tree_.set(i, value);
+        }
+    }
+    if (query_.direction == AKU_CURSOR_DIR_FORWARD) {
+        tree_.build(MergeOrder<std::less<TimeSeriesValue>, AKU_CURSOR_DIR_FORWARD>());
     } else {
-        kway_merge<AKU_CURSOR_DIR_BACKWARD>(filtered, consumer);
+        tree_.build(MergeOrder<std::less<TimeSeriesValue>, AKU_CURSOR_DIR_BACKWARD>());
     }
+}
 
-    if (seq_id != sequence_number_.load()) {
-        cur->set_error(caller, AKU_EBUSY);
-        return;
+bool SequencerSearch::next_(int run_index, TimeSeriesValue* value) {
+    auto& range = ranges_[run_index];
+    auto const& run = *range.run;
+    while (range.begin != range.end) {
+        auto ix = query_.direction == AKU_CURSOR_DIR_FORWARD ? range.begin++ : --range.end;
+        if (query_.match(run[ix].get_paramid()) == SearchQuery::MATCH) {
+            *value = run[ix];
+            return true;
+        }
+    }
+    return false;
+}
+
+void SequencerSearch::complete_() {
+    done_ = true;
+    if (seq_ && seq_id_ != seq_->sequence_number_.load()) {
+        error_code_ = AKU_EBUSY;
+    }
+}
+
+template<class Order>
+int SequencerSearch::read_(CursorColumns const& columns, int buf_len) {
+    Order order;
+    TimeSeriesValue value;
+    int nresults = 0;
+    while (nresults < buf_len && !tree_.empty()) {
+        auto result = tree_.top().to_result(snapshot_->page);
+        columns.timestamps[nresults] = result.timestamp;
+        columns.params[nresults] = result.param_id;
+        columns.pointers[nresults] = result.data;
+        columns.lengths[nresults] = result.length;
+        nresults++;
+        n_results_++;
+        if (limit_ != 0u && n_results_ == limit_) {
+            tree_.clear();
+            break;
+        }
+        if (next_(tree_.winner(), &value)) {
+            tree_.replace_top(value, order);
+        } else {
+            tree_.pop_top(order);
+        }
+    }
+    return nresults;
+}
+
+int SequencerSearch::read(CursorResult* buf, int buf_len) {
+    if (rows_.size() < static_cast<size_t>(buf_len)) {
+        rows_.resize(buf_len);
+    }
+    auto nresults = read_columns(rows_.columns(), buf_len);
+    rows_.to_results(buf, nresults);
+    return nresults;
+}
+
+int SequencerSearch::read_columns(CursorColumns const& columns, int buf_len) {
+    if (done_) {
+        return 0;
+    }
+    int nresults = 0;
+    if (query_.direction == AKU_CURSOR_DIR_FORWARD) {
+        nresults = read_<MergeOrder<std::less<TimeSeriesValue>, AKU_CURSOR_DIR_FORWARD>>(columns, buf_len);
     } else {
-        cur->complete(caller);
+        nresults = read_<MergeOrder<std::less<TimeSeriesValue>, AKU_CURSOR_DIR_BACKWARD>>(columns, buf_len);
+    }
+    if (tree_.empty()) {
+        complete_();
+    }
+    return nresults;
+}
+
+bool SequencerSearch::is_done() const {
+    return done_;
+}
+
+bool SequencerSearch::get_error(int* error_code) const {
+    if (error_code_ != AKU_SUCCESS) {
+        if (error_code) {
+            *error_code = error_code_;
+        }
+        return true;
     }
+    return false;
+}
+
+void SequencerSearch::close() {
+    done_ = true;
+    tree_.clear();
+    ranges_.clear();
+    snapshot_.reset();
 }
+
 }  // namespace Akumuli
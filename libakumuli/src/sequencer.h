@@ -23,12 +23,14 @@
 #pragma once
 #include "page.h"
 #include "cursor.h"
+#include "loser_tree.h"
 
 #include <tuple>
 #include <vector>
 #include <algorithm>
 #include <memory>
 #include <mutex>
+#include <functional>
 
 namespace Akumuli {
 
@@ -43,6 +45,7 @@ struct TimeSeriesValue {
     enum ValueType {
         BLOB,
         DOUBLE,
+        INT64,
     };
 
     // Data members
@@ -52,6 +55,7 @@ struct TimeSeriesValue {
     union {
             Blob                            blob;     // Binary payload
             double                          value;    // Numeric payload
+            int64_t                         ivalue;   // Integer payload
     } payload;
     // NOTE: this structure can be packed better without tuple.
     // Tuple needed only for comparison and can be created on the stack.
@@ -62,6 +66,8 @@ struct TimeSeriesValue {
 
     TimeSeriesValue(aku_TimeStamp ts, aku_ParamId id, double value);
 
+    TimeSeriesValue(aku_TimeStamp ts, aku_ParamId id, int64_t value);
+
     aku_TimeStamp get_timestamp() const;
 
     aku_ParamId get_paramid() const;
@@ -72,11 +78,97 @@ struct TimeSeriesValue {
 
     bool is_blob() const;
 
+    //! Numeric payload converted to double (for doubles and integers)
+    double get_double() const;
+
     friend bool operator < (TimeSeriesValue const& lhs, TimeSeriesValue const& rhs);
 
 } __attribute__((packed));
 
 
+/** Memory arena of the sequencer runs.
+  * Memory is allocated in blocks of fixed (power of two) sizes. Freed blocks are
+  * kept in per-size free lists and reused by new runs, this way memory of the runs
+  * that was merged by merge_and_compress is recycled instead of being returned to
+  * the system. Cached blocks are released if arena grows beyond the limit.
+  */
+class RunArena {
+    enum {
+        MIN_BLOCK_SHIFT = 8,   //< Smallest block is 256 bytes
+        NUM_SIZES = 32,
+    };
+    std::mutex          mutex_;
+    std::vector<void*>  free_[NUM_SIZES];  //< Cached blocks of each size
+    std::atomic<size_t> used_;             //< Size of the blocks used by runs
+    std::atomic<size_t> reserved_;         //< Size of all blocks (used and cached)
+    const size_t        limit_;            //< Max size of all blocks (0 - unlimited)
+
+    //! Release cached blocks, mutex_ should be locked
+    void release_cached_();
+
+    //! Index of the smallest block that can hold `size` bytes
+    static int block_index_(size_t size);
+public:
+    /** C-tor
+      * @param limit cached blocks are released if arena size goes beyond the limit (0 - never)
+      */
+    RunArena(size_t limit);
+    ~RunArena();
+
+    void* allocate(size_t size);
+    void deallocate(void* ptr, size_t size);
+
+    //! Size of the memory used by runs in bytes
+    size_t get_used() const;
+
+    //! Size of the memory owned by arena in bytes
+    size_t get_reserved() const;
+};
+
+
+/** Allocator of the sorted runs.
+  * Default constructed allocator doesn't use arena (temporary runs created by search).
+  */
+template<class T>
+struct RunAllocator {
+    typedef T value_type;
+
+    std::shared_ptr<RunArena> arena;
+
+    RunAllocator() {}
+
+    RunAllocator(std::shared_ptr<RunArena> const& a) : arena(a) {}
+
+    template<class U>
+    RunAllocator(RunAllocator<U> const& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (arena) {
+            return static_cast<T*>(arena->allocate(n*sizeof(T)));
+        }
+        return static_cast<T*>(::operator new(n*sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (arena) {
+            arena->deallocate(ptr, n*sizeof(T));
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+};
+
+template<class T, class U>
+bool operator == (RunAllocator<T> const& lhs, RunAllocator<U> const& rhs) {
+    return lhs.arena == rhs.arena;
+}
+
+template<class T, class U>
+bool operator != (RunAllocator<T> const& lhs, RunAllocator<U> const& rhs) {
+    return lhs.arena != rhs.arena;
+}
+
+
 /** Time-series sequencer.
   * @brief Akumuli can accept unordered time-series (this is the case when
   * clocks of the different time-series sources are slightly out of sync).
@@ -84,7 +176,7 @@ struct TimeSeriesValue {
   * all the remaining samples by timestamp and parameter id.
   */
 struct Sequencer {
-    typedef std::vector<TimeSeriesValue> SortedRun;
+    typedef std::vector<TimeSeriesValue, RunAllocator<TimeSeriesValue>> SortedRun;
     typedef std::shared_ptr<SortedRun>   PSortedRun;
     typedef std::mutex                   Mutex;
     typedef std::unique_lock<Mutex>      Lock;
@@ -93,11 +185,48 @@ struct Sequencer {
     static const int RUN_LOCK_BUSY_COUNT = 0xFFF;
     static const int RUN_LOCK_FLAGS_MASK = 0x0FF;
     static const int RUN_LOCK_FLAGS_SIZE = 0x100;
+    static const int WRITER_SLOTS = 0x10;
+    static const size_t MERGE_PARTITION_SIZE = 0x4000;  //< Min number of elements in parallel merge partition
+    static const int EARLY_CHECKPOINT_STEPS = 0x10;     //< Early checkpoints per window (at most)
+    static const size_t FROZEN_RUNS_MAX = 0x40;         //< Frozen runs are compacted beyond this number
+    static const int LATENESS_BUCKETS = 0x40;           //< Number of buckets in lateness histogram
+    static const uint64_t WINDOW_MIN_SAMPLES = 0x100;   //< Min number of samples needed to resize the window
+    static const size_t BULK_RUN_SIZE = 0x100;          //< Min number of sorted samples added as a separate run
+
+    /** Immutable state of the sequencer used by search.
+      * Runs of the snapshot are never changed, merges and checkpoints
+      * create new runs instead. Snapshot is reference counted, data is
+      * released when the last search that uses it is closed.
+      */
+    struct Snapshot {
+        std::vector<PSortedRun>  runs;        //< Frozen and ready to merge runs
+        PageHeader const*        page;        //< Page used to convert samples to results
+        uint32_t                 page_count;  //< Number of page entries that doesn't overlap with runs
+    };
+    typedef std::shared_ptr<const Snapshot> PSnapshot;
 
-    std::vector<PSortedRun>      runs_;           //< Active sorted runs
+    //! Sorted runs of the writer threads that share the slot
+    struct WriterRuns {
+        std::vector<PSortedRun>  runs;            //< Active sorted runs of the writers
+        RWLock                   lock;            //< Taken for writing by the writers, for reading by searches
+    };
+
+    mutable std::vector<PSortedRun> runs_;        //< Active sorted runs (moved to frozen_ by search)
+    mutable std::vector<PSortedRun> frozen_;      //< Runs referenced by snapshots, never changed
+    mutable std::atomic_int      freeze_count_;   //< Incremented every time active runs are frozen or reordered
+    std::vector<std::unique_ptr<WriterRuns>> writers_;  //< Per-writer sorted runs (empty if runs_ is used)
     std::vector<PSortedRun>      ready_;          //< Ready to merge
+    std::shared_ptr<RunArena>    arena_;          //< Memory of the active and ready runs
+    const size_t                 max_cache_size_; //< Memory budget of the runs in bytes (0 - unlimited)
+    aku_TimeStamp                early_bound_;    //< Bound of the last early checkpoint
     PSortedRun                   key_;
-    const aku_Duration           window_size_;
+    std::atomic<aku_Duration>    window_size_;    //< Late write window (changed only by checkpoint in adaptive mode)
+    const uint32_t               window_percentile_;  //< Percentile of the lateness (0 - fixed window)
+    const aku_Duration           max_window_;     //< Max size of the adaptive window
+    const aku_Duration           min_window_;     //< Min size of the adaptive window
+    std::vector<uint64_t>        lateness_;       //< Lateness histogram of the current checkpoint (last bucket - overflow)
+    uint64_t                     n_lateness_;     //< Number of samples in lateness histogram
+    aku_TimeStamp                ready_bound_;    //< Samples older than this bound was moved to ready_
     const PageHeader* const      page_;
     aku_TimeStamp                top_timestamp_;  //< Largest timestamp ever seen
     uint32_t                     checkpoint_;     //< Last checkpoint timestamp
@@ -107,25 +236,46 @@ struct Sequencer {
                                                   //< even - there is no merge and search will work correctly.
     mutable Mutex                runs_resize_lock_;
     mutable std::vector<RWLock>  run_locks_;
-    uint32_t                     space_estimate_; //< Space estimate for storing all data
+    std::atomic<uint32_t>        space_estimate_; //< Space estimate for storing all data
+    std::atomic<uint32_t>        ready_estimate_; //< Space estimate for storing data from ready_
     const size_t                 c_threshold_;    //< Compression threshold
+    const uint32_t               merge_threads_;  //< Number of threads used by merge_and_compress
+    const uint32_t               chunk_encoding_; //< Encoding of the chunks written by merge_and_compress
+    const uint32_t               codec_policy_;   //< Codec selection policy of merge_and_compress
 
     Sequencer(PageHeader const* page, aku_Config config);
 
     /** Add new sample to sequence.
       * @brief Timestamp of the sample can be out of order.
+      * If runs use more memory than max_cache_size, samples older than the
+      * late write window are moved to ready_ (early checkpoint) and late
+      * writes are rejected with AKU_EBUSY until memory is recycled by merge.
       * @returns error code and flag that indicates whether of not new checkpoint is createf
       */
     std::tuple<int, int> add(TimeSeriesValue const& value);
 
+    /** Add batch of samples to sequence.
+      * @param begin pointer to the first sample
+      * @param size number of samples, samples must be sorted by timestamp and param id
+      * @param statuses array of per-element statuses, each element is set only on error
+      * @returns error code of the first failed sample (or AKU_SUCCESS) and the same flag as add
+      */
+    std::tuple<int, int> add_batch(TimeSeriesValue const* begin, size_t size, int* statuses);
+
     //! Simple merge and sync without compression. (depricated)
     void merge(Caller& caller, InternalCursor* cur);
 
     /** Merge all values (ts, id, offset, length)
       * and write it to target page.
-      * caller and cur parameters used for communication with storage (error reporting).
+      * If there is enough data and merge_threads is set, values are split into
+      * partitions by key, each partition is merged and compressed in its own
+      * thread and written to the page as a separate chunk (in order).
+      * @param on_complete optional callback that receives every written chunk before
+      *        sequence number is changed (while merge is still in progress)
+      * @note merge lock is released even if merge fails (data that wasn't written is lost)
       */
-    aku_Status merge_and_compress(PageHeader* target);
+    aku_Status merge_and_compress(PageHeader* target,
+                                  std::function<void(ChunkHeader const&)> const& on_complete = nullptr);
 
     /** Reset sequencer.
       * All runs are ready for merging.
@@ -133,6 +283,13 @@ struct Sequencer {
       */
     int reset();
 
+    /** Make snapshot of the sequencer.
+      * Active runs are frozen (new samples are added to new runs). Snapshot
+      * contains all samples that was added to sequencer and wasn't written to
+      * page entries [0, page_count), it can be searched while sequencer is merged.
+      */
+    PSnapshot get_snapshot() const;
+
     /** Search in sequencer data.
       * @param caller represents caller
       * @param cur search cursor
@@ -150,11 +307,21 @@ struct Sequencer {
     std::tuple<aku_TimeStamp, int> get_window() const;
 
     /** Returns number of bytes needed to store all data from the checkpoint
-     *  in compressed mode. This number can be more than actually needed but
-     *  can't be less (only overshoot is ok, undershoot is error).
+     *  in compressed mode (including data that waits for merge in ready_).
+     *  This number can be more than actually needed but can't be less (only
+     *  overshoot is ok, undershoot is error).
      */
     uint32_t get_space_estimate() const;
 
+    //! Returns number of bytes used by sorted runs (active and ready to merge)
+    size_t get_memory_usage() const;
+
+    //! Add number and size of the sorted runs to `rcv_stats`
+    void get_memory_stats(aku_MemoryStats* rcv_stats) const;
+
+    //! Returns current size of the late write window
+    aku_Duration get_window_size() const;
+
 private:
     //! Checkpoint id = ⌊timestamp/window_size⌋
     uint32_t get_checkpoint_(aku_TimeStamp ts) const;
@@ -165,11 +332,136 @@ private:
     // move sorted runs to ready_ collection
     int make_checkpoint_(uint32_t new_checkpoint);
 
+    //! Add lateness of the sample to histogram (adaptive mode)
+    void add_lateness_(aku_Duration lateness);
+
+    /** Resize late write window using lateness histogram of the last checkpoint (adaptive mode).
+      * Window is set to configured percentile of the samples lateness within [min_window, max_window].
+      */
+    void update_window_();
+
+    //! Move samples older than the late write window to ready_ if memory budget is exceeded
+    int make_early_checkpoint_();
+
+    /** Move samples older than `bound` to ready_, merge is started if ready_
+      * contains at least `threshold` samples.
+      * @param flag sequence number (odd)
+      * @returns new sequence number
+      */
+    int move_to_ready_(aku_TimeStamp bound, size_t threshold, int flag);
+
+    /** Check memory budget, make early checkpoint if needed.
+      * @returns error code and flag that indicates whether or not new checkpoint is created
+      */
+    std::tuple<int, int> check_budget_(aku_TimeStamp ts);
+
+    //! Check if runs use more memory than max_cache_size
+    bool over_budget_() const;
+
+    //! Create new empty run
+    PSortedRun make_run_() const;
+
     /** Check timestamp and make checkpoint if timestamp is large enough.
       * @returns error code and flag that indicates whether or not new checkpoint is created
       */
     std::tuple<int, int> check_timestamp_(aku_TimeStamp ts);
 
-    void filter(PSortedRun run, SearchQuery const& q, std::vector<PSortedRun> *results) const;
+    /** Add sorted samples to sorted runs, runs_resize_lock_ is acquired only once.
+      * Large sequences are added as a new run without per-sample run selection.
+      */
+    void add_sorted_(std::vector<TimeSeriesValue> const& values);
+
+    //! Insert new sorted run, order of the runs (by top element) is preserved
+    void add_run_(PSortedRun run);
+
+    //! Sorted runs of the calling thread (per-writer mode)
+    WriterRuns& writer_slot_();
+
+    //! Add sample to the run with largest top element not greater than sample (or to the new run)
+    void insert_(std::vector<PSortedRun>* runs, TimeSeriesValue const& value) const;
+
+    //! Move samples older than `old_top` to ready_, returns runs with the remaining samples
+    std::vector<PSortedRun> split_runs_(std::vector<PSortedRun>& runs, aku_TimeStamp old_top);
+
+    //! Split ready_ into `nparts` key ranges, returns lower bounds of the partitions (except the first one)
+    std::vector<TimeSeriesValue> partition_ready_(size_t nparts) const;
+
+    /** Merge and compress ready_ in parallel, chunks are returned in key order.
+      * Single chunk is compressed in place, directly to the free space of the target page.
+      */
+    void merge_partitions_(PageHeader* target,
+                           std::vector<ChunkHeader>* headers,
+                           std::vector<EncodedChunk>* chunks) const;
+
+    friend class SequencerSearch;
+};
+
+
+/** Stackless sequencer search.
+  * Search scans runs of the sequencer snapshot in place, `read` merges
+  * matching samples lazily and fills caller's buffer. Search of the snapshot
+  * is never aborted by merge. If search is created with sequence number
+  * it follows the same optimistic concurrency control as Sequencer::search,
+  * it fails with AKU_EBUSY if sequencer was merged before search is completed.
+  */
+class SequencerSearch {
+    //! Unconsumed part of the run inside the time range
+    struct RunRange {
+        Sequencer::SortedRun const* run;
+        size_t                      begin;
+        size_t                      end;
+    };
+
+    Sequencer const*                    seq_;          //< Sequencer (null if sequence number isn't checked)
+    Sequencer::PSnapshot                snapshot_;
+    const int                           seq_id_;
+    SearchQuery                         query_;
+    const uint64_t                      limit_;        //< Max number of results (0 - unlimited)
+    uint64_t                            n_results_;
+    std::vector<RunRange>               ranges_;
+    LoserTree<TimeSeriesValue>          tree_;         //< Current sample of every run
+    bool                                done_;
+    int                                 error_code_;
+    ColumnBuffer                        rows_;         //< Buffer used to convert columns to results
+
+    //! Find ranges of the snapshot runs and fill loser tree
+    void init_();
+
+    //! Get next matching sample of the run in scan direction, returns false if run is consumed
+    bool next_(int run_index, TimeSeriesValue* value);
+
+    //! Complete search, check sequence number
+    void complete_();
+
+    template<class Order>
+    int read_(CursorColumns const& columns, int buf_len);
+public:
+    /** C-tor
+      * @param seq sequencer to search
+      * @param query search query
+      * @param sequence_number sequence number obtained with Sequencer::get_window
+      */
+    SequencerSearch(Sequencer const* seq, SearchQuery const& query, int sequence_number);
+
+    /** C-tor
+      * @param snapshot sequencer snapshot to search
+      * @param query search query
+      */
+    SequencerSearch(Sequencer::PSnapshot snapshot, SearchQuery const& query);
+
+    //! Read portion of the results to the buffer, returns number of results
+    int read(CursorResult* buf, int buf_len);
+
+    //! Read portion of the results to columns (all columns must be set), returns number of results
+    int read_columns(CursorColumns const& columns, int buf_len);
+
+    //! Check is search completed (or failed)
+    bool is_done() const;
+
+    //! Check is error occured and (optionally) get the error code
+    bool get_error(int* error_code) const;
+
+    //! Stop the search
+    void close();
 };
 }
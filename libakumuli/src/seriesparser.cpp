@@ -3,6 +3,7 @@
 #include <string>
 #include <map>
 #include <algorithm>
+#include <cassert>
 
 namespace Akumuli {
 
@@ -26,12 +27,18 @@ StringPool::StringT StringPool::add(const char* begin, const char* end) {
         bin = &pool.back();
         bin->reserve(MAX_BIN_SIZE);
     }
-    for(auto i = begin; i < end; i++) {
-        bin->push_back(*i);
+    // Capacity is reserved, insert doesn't reallocate
+    auto offset = bin->size();
+    bin->insert(bin->end(), begin, end);
+    return std::make_pair(bin->data() + offset, size);
+}
+
+size_t StringPool::memory_use() const {
+    size_t result = 0;
+    for (auto const& bin: pool) {
+        result += bin.capacity();
     }
-    const char* p = &bin->back();
-    p -= size - 1;
-    return std::make_pair(p, size);
+    return result;
 }
 
 
@@ -50,7 +57,13 @@ size_t SeriesMatcher::hash(SeriesMatcher::StringT str) {
         c = *begin++;
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
     }
-    return hash;
+    // Mix bits, low bits are used as a slot index and high bits as a fingerprint
+    hash *= 0x9E3779B97F4A7C15ul;
+    return hash ^ (hash >> 29);
+}
+
+uint8_t SeriesMatcher::fingerprint(size_t hash) {
+    return static_cast<uint8_t>(0x80 | (hash >> 57));
 }
 
 bool SeriesMatcher::equal(StringT lhs, StringT rhs) {
@@ -60,28 +73,146 @@ bool SeriesMatcher::equal(StringT lhs, StringT rhs) {
     return std::equal(lhs.first, lhs.first + lhs.second, rhs.first);
 }
 
+SeriesMatcher::Table::Table(size_t capacity)
+    : mask(capacity - 1)
+    , ctrl(new std::atomic<uint8_t>[capacity]())
+    , slots(new std::atomic<const Entry*>[capacity]())
+{
+    assert((capacity & mask) == 0);
+}
+
 SeriesMatcher::SeriesMatcher(uint64_t starting_id)
-    : table(0x1000, &SeriesMatcher::hash, &SeriesMatcher::equal)
+    : table(nullptr)
     , series_id(starting_id)
 {
     if (starting_id == 0u) {
         AKU_PANIC("Bad series ID");
     }
+    tables.emplace_back(new Table(0x1000));
+    table.store(tables.back().get());
+}
+
+const SeriesMatcher::Entry* SeriesMatcher::find_(const Table* table, StringT name, size_t hash) {
+    auto fp = fingerprint(hash);
+    for (size_t ix = hash & table->mask;; ix = (ix + 1) & table->mask) {
+        auto ctrl = table->ctrl[ix].load(std::memory_order_acquire);
+        if (ctrl == 0) {
+            return nullptr;
+        }
+        if (ctrl == fp) {
+            const Entry* entry = table->slots[ix].load(std::memory_order_relaxed);
+            if (entry->hash == hash && equal(entry->name, name)) {
+                return entry;
+            }
+        }
+    }
 }
 
-void SeriesMatcher::add(const char* begin, const char* end) {
-    StringT pstr = pool.add(begin, end);
-    table[pstr] = series_id++;
+//! Store entry to the first empty slot, control byte is published last
+static void store_entry(SeriesMatcher::Table const* table, SeriesMatcher::Entry const* entry, uint8_t fp) {
+    size_t ix = entry->hash & table->mask;
+    while (table->ctrl[ix].load(std::memory_order_relaxed) != 0) {
+        ix = (ix + 1) & table->mask;
+    }
+    table->slots[ix].store(entry, std::memory_order_relaxed);
+    table->ctrl[ix].store(fp, std::memory_order_release);
 }
 
-uint64_t SeriesMatcher::match(const char* begin, const char* end) {
-    int len = end - begin;
-    StringT str = std::make_pair(begin, len);
-    auto it = table.find(str);
-    if (it == table.end()) {
-        return 0ul;
+void SeriesMatcher::reserve_(size_t nentries) {
+    const Table* current = table.load(std::memory_order_relaxed);
+    if (nentries*2 <= current->mask + 1) {
+        return;
+    }
+    // Load factor is kept below 0.5, new table is filled before it's published
+    size_t capacity = (current->mask + 1)*2;
+    while (nentries*2 > capacity) {
+        capacity *= 2;
     }
-    return it->second;
+    std::unique_ptr<Table> grown(new Table(capacity));
+    for (auto const& entry: entries) {
+        store_entry(grown.get(), &entry, fingerprint(entry.hash));
+    }
+    tables.push_back(std::move(grown));
+    table.store(tables.back().get(), std::memory_order_release);
+}
+
+void SeriesMatcher::insert_(StringT name, uint64_t id, size_t hash) {
+    reserve_(entries.size() + 1);
+    entries.push_back({ pool.add(name.first, name.first + name.second), id, hash });
+    store_entry(table.load(std::memory_order_relaxed), &entries.back(), fingerprint(hash));
+    auto const& stored = entries.back().name;
+    index.add(stored.first, stored.first + stored.second, id);
+}
+
+uint64_t SeriesMatcher::add(const char* begin, const char* end) {
+    StringT str = std::make_pair(begin, static_cast<int>(end - begin));
+    auto h = hash(str);
+    std::lock_guard<std::mutex> guard(mutex);
+    auto entry = find_(table.load(std::memory_order_relaxed), str, h);
+    if (entry != nullptr) {
+        return entry->id;
+    }
+    auto id = series_id++;
+    insert_(str, id, h);
+    auto const& name = entries.back().name;
+    new_names.push_back(std::make_tuple(name.first, name.second, id));
+    return id;
+}
+
+void SeriesMatcher::_add(std::string const& series, uint64_t id) {
+    StringT str = std::make_pair(series.data(), static_cast<int>(series.size()));
+    auto h = hash(str);
+    std::lock_guard<std::mutex> guard(mutex);
+    if (find_(table.load(std::memory_order_relaxed), str, h) != nullptr) {
+        return;
+    }
+    insert_(str, id, h);
+    series_id = std::max(series_id, id + 1);
+}
+
+void SeriesMatcher::_add(std::vector<std::pair<std::string, uint64_t>> const& series) {
+    std::lock_guard<std::mutex> guard(mutex);
+    reserve_(entries.size() + series.size());
+    for (auto const& item: series) {
+        StringT str = std::make_pair(item.first.data(), static_cast<int>(item.first.size()));
+        auto h = hash(str);
+        if (find_(table.load(std::memory_order_relaxed), str, h) != nullptr) {
+            continue;
+        }
+        insert_(str, item.second, h);
+        series_id = std::max(series_id, item.second + 1);
+    }
+}
+
+uint64_t SeriesMatcher::match(const char* begin, const char* end) const {
+    StringT str = std::make_pair(begin, static_cast<int>(end - begin));
+    auto entry = find_(table.load(std::memory_order_acquire), str, hash(str));
+    return entry ? entry->id : 0ul;
+}
+
+void SeriesMatcher::pull_new_names(std::vector<SeriesNameT>* buffer) {
+    std::lock_guard<std::mutex> guard(mutex);
+    buffer->insert(buffer->end(), new_names.begin(), new_names.end());
+    new_names.clear();
+}
+
+size_t SeriesMatcher::memory_use() {
+    std::lock_guard<std::mutex> guard(mutex);
+    size_t result = pool.memory_use() + entries.size()*sizeof(Entry);
+    for (auto const& t: tables) {
+        result += (t->mask + 1)*(sizeof(std::atomic<uint8_t>) + sizeof(std::atomic<const Entry*>));
+    }
+    return result;
+}
+
+void SeriesMatcher::get_pool_stats(uint64_t* nseries, uint64_t* pool_bytes) {
+    std::lock_guard<std::mutex> guard(mutex);
+    *nseries = entries.size();
+    *pool_bytes = pool.memory_use();
+}
+
+aku_Status SeriesMatcher::select(const char* expression, std::vector<uint64_t>* out) const {
+    return index.query(expression, out);
 }
 
 //                         //
@@ -1,48 +1,129 @@
 #pragma once
 #include "akumuli_def.h"
+#include "invertedindex.h"
 
 #include <stdint.h>
 #include <map>
 #include <unordered_map>
 #include <vector>
 #include <deque>
+#include <tuple>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
 
 
 namespace Akumuli {
 
+/** Arena for series names. Names are stored back to back in large
+  * bins that never reallocate, so returned pointers stay valid.
+  */
 struct StringPool {
     typedef std::pair<const char*, int> StringT;
     const int MAX_BIN_SIZE = AKU_LIMITS_MAX_SNAME*0x1000;
     std::deque<std::vector<char>> pool;
     StringT add(const char* begin, const char *end);
+
+    //! Amount of memory used by the pool
+    size_t memory_use() const;
 };
 
 /** Series matcher. Table that maps series names to series
   * ids. Should be initialized on startup from sqlite table.
+  * Matcher is read-mostly: lookups are lock-free, new names are
+  * added under the lock. Table is an insert-only open addressing
+  * hash table. When it grows, new table is published atomically
+  * and the old one is retired but not deleted because concurrent
+  * readers can still use it (retired tables are at most as large
+  * as the current one in total).
+  * Every slot has a control byte with 7 bits of the hash (like in
+  * Swiss tables), probing scans the compact control bytes array and
+  * touches entries only on fingerprint match.
   */
 struct SeriesMatcher {
     // TODO: add LRU cache
     typedef std::pair<const char*, int> StringT;
+    typedef std::tuple<const char*, int, uint64_t> SeriesNameT;  //< Name, name length, id
     static size_t hash(StringT str);
     static bool equal(StringT lhs, StringT rhs);
-    typedef std::unordered_map<StringT, uint64_t,
-                               decltype(&SeriesMatcher::hash),
-                               decltype(&SeriesMatcher::equal)> TableT;
+
+    //! Table entry, never changes after insertion
+    struct Entry {
+        StringT  name;
+        uint64_t id;
+        size_t   hash;
+    };
+
+    //! Hash table, every slot is written only once
+    struct Table {
+        const size_t mask;
+        std::unique_ptr<std::atomic<uint8_t>[]> ctrl;       //< Control bytes, 0 - empty slot
+        std::unique_ptr<std::atomic<const Entry*>[]> slots;
+
+        Table(size_t capacity);
+    };
 
     // Variables
-    StringPool pool;
-    TableT table;
-    uint64_t series_id;
+    StringPool pool;                            //< Names storage (guarded by mutex)
+    std::deque<Entry> entries;                  //< Entries storage (guarded by mutex)
+    std::vector<std::unique_ptr<Table>> tables; //< Current and retired tables (guarded by mutex)
+    std::atomic<const Table*> table;            //< Current table
+    uint64_t series_id;                         //< Next series id (guarded by mutex)
+    std::vector<SeriesNameT> new_names;         //< Names that wasn't pulled yet (guarded by mutex)
+    InvertedIndex index;                        //< Tags of all added series
+    std::mutex mutex;
 
     SeriesMatcher(uint64_t starting_id);
 
     /** Add new string to matcher.
+      * @return id of the new string or id of the existing one
       */
-    void add(const char* begin, const char* end);
+    uint64_t add(const char* begin, const char* end);
+
+    /** Add string with known id to matcher (used on startup).
+      * New strings will get ids greater than `id`.
+      */
+    void _add(std::string const& series, uint64_t id);
+
+    /** Add many strings with known ids to matcher (used on startup).
+      * Table is resized only once.
+      */
+    void _add(std::vector<std::pair<std::string, uint64_t>> const& series);
 
     /** Match string and return it's id. If string is new return 0.
+      * Thread safe, doesn't lock.
       */
-    uint64_t match(const char* begin, const char* end);
+    uint64_t match(const char* begin, const char* end) const;
+
+    /** Move all names added by `add` since previous call to `buffer`
+      * (names are persisted in batches).
+      */
+    void pull_new_names(std::vector<SeriesNameT>* buffer);
+
+    /** Find ids of the series that match tag expression
+      * (see InvertedIndex::query).
+      */
+    aku_Status select(const char* expression, std::vector<uint64_t>* out) const;
+
+    //! Amount of memory used by names, entries and tables (excluding inverted index)
+    size_t memory_use();
+
+    //! Get number of series and amount of memory used by names
+    void get_pool_stats(uint64_t* nseries, uint64_t* pool_bytes);
+
+private:
+    //! Control byte of the hash (never zero)
+    static uint8_t fingerprint(size_t hash);
+
+    //! Publish larger table if it can't fit `nentries` entries (mutex should be locked)
+    void reserve_(size_t nentries);
+
+    //! Insert entry to the current table (mutex should be locked)
+    void insert_(StringT name, uint64_t id, size_t hash);
+
+    //! Find entry in the table
+    static const Entry* find_(const Table* table, StringT name, size_t hash);
 };
 
 /** Namespace class to store all parsing related things.
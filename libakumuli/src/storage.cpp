@@ -19,10 +19,14 @@
 #include "storage.h"
 #include "util.h"
 #include "cursor.h"
+#include "compression.h"
+#include "timsort.hpp"
 
 #include <cstdlib>
+#include <cstring>
 #include <cstdarg>
 #include <stdexcept>
+#include <exception>
 #include <algorithm>
 #include <new>
 #include <atomic>
@@ -30,12 +34,18 @@
 #include <cassert>
 #include <functional>
 #include <sstream>
+#include <limits>
+#include <iomanip>
+#include <cmath>
+#include <queue>
+#include <set>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/bind.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/crc.hpp>
 
 namespace Akumuli {
 
@@ -66,6 +76,10 @@ MetadataStorage::MetadataStorage(const char* db, aku_logger_cb_t logger)
     , driver_(nullptr)
     , handle_(nullptr, AprHandleDeleter(nullptr))
     , logger_(logger)
+    , tx_mutex_(new std::mutex())
+    , stmt_pool_(nullptr, &delete_apr_pool)
+    , insert_series_(nullptr)
+    , select_series_(nullptr)
 {
     apr_pool_t *pool = nullptr;
     auto status = apr_pool_create(&pool, NULL);
@@ -89,7 +103,36 @@ MetadataStorage::MetadataStorage(const char* db, aku_logger_cb_t logger)
     }
     handle_ = HandleT(handle, AprHandleDeleter(driver_));
 
+    // Readers don't block the writer, commit appends to the log and syncs only on checkpoint
+    auto mode = select_query("PRAGMA journal_mode=WAL;");
+    if (mode.empty() || mode.front().empty() || mode.front().front() != "wal") {
+        (*logger_)(AKU_LOG_INFO, "WAL mode is not available, default journal is used");
+    }
+    execute_query("PRAGMA synchronous=NORMAL;");
+
     create_tables();
+
+    apr_pool_t* stmt_pool = nullptr;
+    status = apr_pool_create(&stmt_pool, pool);
+    if (status != APR_SUCCESS) {
+        throw std::runtime_error("Can't create memory pool");
+    }
+    stmt_pool_.reset(stmt_pool);
+    insert_series_ = prepare("INSERT INTO akumuli_series (series_id, keyslist, storage_id) VALUES (%s, %s, %lld);");
+    // Names without tags are stored with empty keyslist, they shouldn't get trailing space
+    select_series_ = prepare("SELECT series_id || CASE WHEN IFNULL(keyslist, '') = '' THEN '' ELSE ' ' || keyslist END, "
+                             "storage_id FROM akumuli_series;");
+}
+
+MetadataStorage::PreparedT MetadataStorage::prepare(const char* query) {
+    (*logger_)(AKU_LOG_TRACE, query);
+    apr_dbd_prepared_t* statement = nullptr;
+    int status = apr_dbd_prepare(driver_, stmt_pool_.get(), handle_.get(), query, nullptr, &statement);
+    if (status != 0) {
+        (*logger_)(AKU_LOG_ERROR, "Error preparing statement");
+        throw std::runtime_error(apr_dbd_error(driver_, handle_.get(), status));
+    }
+    return statement;
 }
 
 int MetadataStorage::execute_query(const char* query) {
@@ -132,6 +175,27 @@ void MetadataStorage::create_tables() {
             "storage_id INTEGER UNIQUE"
             ");";
     execute_query(query);
+
+    // Rollup tiers and their first buckets
+    query =
+            "CREATE TABLE IF NOT EXISTS akumuli_rollup_tiers("
+            "width INTEGER UNIQUE,"
+            "begin INTEGER"
+            ");";
+    execute_query(query);
+
+    query =
+            "CREATE TABLE IF NOT EXISTS akumuli_rollups("
+            "width INTEGER,"
+            "param_id INTEGER,"
+            "bucket INTEGER,"
+            "count INTEGER,"
+            "sum REAL,"
+            "min REAL,"
+            "max REAL,"
+            "PRIMARY KEY (width, param_id, bucket)"
+            ");";
+    execute_query(query);
 }
 
 void MetadataStorage::init_config(uint32_t compression_threshold,
@@ -212,6 +276,18 @@ void MetadataStorage::get_configs(uint32_t *compression_threshold,
     }
 }
 
+void MetadataStorage::checkpoint_wal() {
+    // Result is (busy, log frames, checkpointed frames), the same
+    // for the default journal
+    auto results = select_query("PRAGMA wal_checkpoint(TRUNCATE);");
+    if (results.size() != 1 || results.at(0).empty()) {
+        throw std::runtime_error("Invalid checkpoint query");
+    }
+    if (results.at(0).at(0) != "0") {
+        throw std::runtime_error("Can't checkpoint metadata, database is in use");
+    }
+}
+
 void MetadataStorage::init_volumes(std::vector<VolumeDesc> volumes) {
     std::stringstream query;
     query << "INSERT INTO akumuli_volumes (id, path)" << std::endl;
@@ -228,6 +304,195 @@ void MetadataStorage::init_volumes(std::vector<VolumeDesc> volumes) {
     execute_query(full_query.c_str());
 }
 
+void MetadataStorage::set_volumes(std::vector<VolumeDesc> volumes) {
+    std::lock_guard<std::mutex> guard(*tx_mutex_);
+    execute_query("BEGIN TRANSACTION;");
+    try {
+        execute_query("DELETE FROM akumuli_volumes;");
+        init_volumes(volumes);
+    } catch (...) {
+        execute_query("ROLLBACK;");
+        throw;
+    }
+    execute_query("COMMIT;");
+}
+
+
+//! Format double value as sql literal (sqlite stores doubles with full precision)
+static std::string sql_double(double value) {
+    std::stringstream str;
+    if (std::isnan(value)) {
+        str << "NULL";
+    } else if (std::isinf(value)) {
+        str << (value > 0 ? "9e999" : "-9e999");
+    } else {
+        str << std::setprecision(17) << value;
+    }
+    return str.str();
+}
+
+//! Unsigned values are stored as signed 64-bit integers
+static int64_t sql_int(uint64_t value) {
+    return static_cast<int64_t>(value);
+}
+
+std::map<aku_Duration, aku_TimeStamp> MetadataStorage::init_rollup_tiers(std::vector<aku_Duration> const& widths) {
+    std::stringstream list;
+    for (size_t i = 0; i < widths.size(); i++) {
+        list << (i ? ", " : "") << sql_int(widths[i]);
+    }
+    {
+        std::stringstream query;
+        query << "DELETE FROM akumuli_rollups WHERE width NOT IN (" << list.str() << ");";
+        execute_query(query.str().c_str());
+    }
+    {
+        std::stringstream query;
+        query << "DELETE FROM akumuli_rollup_tiers WHERE width NOT IN (" << list.str() << ");";
+        execute_query(query.str().c_str());
+    }
+    for (auto width: widths) {
+        std::stringstream query;
+        query << "INSERT OR IGNORE INTO akumuli_rollup_tiers (width, begin) VALUES ("
+              << sql_int(width) << ", " << sql_int(AKU_MAX_TIMESTAMP) << ");";
+        execute_query(query.str().c_str());
+    }
+    std::map<aku_Duration, aku_TimeStamp> result;
+    for (auto const& tuple: select_query("SELECT width, begin FROM akumuli_rollup_tiers;")) {
+        auto width = static_cast<aku_Duration>(boost::lexical_cast<int64_t>(tuple.at(0)));
+        auto begin = static_cast<aku_TimeStamp>(boost::lexical_cast<int64_t>(tuple.at(1)));
+        result[width] = begin;
+    }
+    return result;
+}
+
+void MetadataStorage::set_rollup_tier_begin(aku_Duration width, aku_TimeStamp begin) {
+    std::stringstream query;
+    query << "UPDATE akumuli_rollup_tiers SET begin = " << sql_int(begin)
+          << " WHERE width = " << sql_int(width) << ";";
+    execute_query(query.str().c_str());
+}
+
+void MetadataStorage::add_rollups(Aggregator const& rollups) {
+    auto width = sql_int(rollups.width_);
+    std::lock_guard<std::mutex> guard(*tx_mutex_);
+    execute_query("BEGIN TRANSACTION;");
+    try {
+        for (auto const& kv: rollups.get_results(AKU_CURSOR_DIR_FORWARD)) {
+            // Partial bucket is merged with the stored one
+            std::stringstream where;
+            where << "WHERE width = " << width << " AND param_id = " << sql_int(kv.first.second)
+                  << " AND bucket = " << sql_int(kv.first.first);
+            auto cond = where.str();
+            auto min = sql_double(kv.second.min);
+            auto max = sql_double(kv.second.max);
+            std::stringstream query;
+            query << "INSERT OR REPLACE INTO akumuli_rollups VALUES ("
+                  << width << ", " << sql_int(kv.first.second) << ", " << sql_int(kv.first.first) << ", "
+                  << kv.second.count << " + COALESCE((SELECT count FROM akumuli_rollups " << cond << "), 0), "
+                  << sql_double(kv.second.sum) << " + COALESCE((SELECT sum FROM akumuli_rollups " << cond << "), 0), "
+                  << "MIN(" << min << ", COALESCE((SELECT min FROM akumuli_rollups " << cond << "), " << min << ")), "
+                  << "MAX(" << max << ", COALESCE((SELECT max FROM akumuli_rollups " << cond << "), " << max << ")));";
+            execute_query(query.str().c_str());
+        }
+    } catch (...) {
+        execute_query("ROLLBACK;");
+        throw;
+    }
+    execute_query("COMMIT;");
+}
+
+void MetadataStorage::insert_new_names(std::vector<SeriesMatcher::SeriesNameT> const& items) {
+    // Queries allocate from the temporary pool, it's released after the batch
+    apr_pool_t* pool = nullptr;
+    if (apr_pool_create(&pool, pool_.get()) != APR_SUCCESS) {
+        throw std::runtime_error("Can't create memory pool");
+    }
+    PoolT tmp_pool(pool, &delete_apr_pool);
+    std::lock_guard<std::mutex> guard(*tx_mutex_);
+    execute_query("BEGIN TRANSACTION;");
+    try {
+        // Parameters should be null-terminated, buffers are reused
+        std::string metric, keys;
+        for (auto const& item: items) {
+            const char* name = std::get<0>(item);
+            const char* end = name + std::get<1>(item);
+            // Metric name is separated from the list of keys by one space (normal form)
+            const char* sep = std::find(name, end, ' ');
+            metric.assign(name, sep);
+            keys.assign(sep == end ? end : sep + 1, end);
+            apr_int64_t storage_id = sql_int(std::get<2>(item));
+            const void* args[] = { metric.c_str(), keys.c_str(), &storage_id };
+            int nrows = 0;
+            int status = apr_dbd_pbquery(driver_, pool, handle_.get(), &nrows, insert_series_, args);
+            if (status != 0) {
+                (*logger_)(AKU_LOG_ERROR, "Error inserting series name");
+                throw std::runtime_error(apr_dbd_error(driver_, handle_.get(), status));
+            }
+        }
+    } catch (...) {
+        execute_query("ROLLBACK;");
+        throw;
+    }
+    execute_query("COMMIT;");
+}
+
+void MetadataStorage::load_matcher_data(SeriesMatcher& matcher) {
+    (*logger_)(AKU_LOG_TRACE, "Loading series names");
+    // Result set is allocated in the temporary pool, it's released after load
+    apr_pool_t* pool = nullptr;
+    if (apr_pool_create(&pool, pool_.get()) != APR_SUCCESS) {
+        throw std::runtime_error("Can't create memory pool");
+    }
+    PoolT tmp_pool(pool, &delete_apr_pool);
+    apr_dbd_results_t* results = nullptr;
+    int status = apr_dbd_pbselect(driver_, pool, handle_.get(), &results, select_series_, 0, nullptr);
+    if (status != 0) {
+        (*logger_)(AKU_LOG_ERROR, "Error loading series names");
+        throw std::runtime_error(apr_dbd_error(driver_, handle_.get(), status));
+    }
+    std::vector<std::pair<std::string, uint64_t>> series;
+    auto ntuples = apr_dbd_num_tuples(driver_, results);
+    series.reserve(ntuples > 0 ? static_cast<size_t>(ntuples) : 0u);
+    apr_dbd_row_t* row = nullptr;
+    while (apr_dbd_get_row(driver_, pool, results, &row, -1) == 0) {
+        const char* name = apr_dbd_get_entry(driver_, row, 0);
+        apr_int64_t id = 0;
+        if (name == nullptr || apr_dbd_datum_get(driver_, row, 1, APR_DBD_TYPE_LONGLONG, &id) != APR_SUCCESS) {
+            throw std::runtime_error("Invalid series name");
+        }
+        series.push_back(std::make_pair(std::string(name), static_cast<uint64_t>(id)));
+    }
+    // Table is built at once
+    matcher._add(series);
+}
+
+void MetadataStorage::get_rollups(aku_Duration width, aku_TimeStamp begin, aku_TimeStamp end,
+                                  std::vector<aku_ParamId> const& ids, Aggregator* out) const
+{
+    if (ids.empty() || begin >= end) {
+        return;
+    }
+    std::stringstream query;
+    query << "SELECT param_id, bucket, count, printf('%.17g', sum), printf('%.17g', min), printf('%.17g', max) "
+          << "FROM akumuli_rollups WHERE width = " << sql_int(width)
+          << " AND bucket >= " << sql_int(begin) << " AND bucket < " << sql_int(end)
+          << " AND param_id IN (";
+    for (size_t i = 0; i < ids.size(); i++) {
+        query << (i ? ", " : "") << sql_int(ids[i]);
+    }
+    query << ");";
+    for (auto const& tuple: select_query(query.str().c_str())) {
+        Aggregator::Key key(static_cast<aku_TimeStamp>(boost::lexical_cast<int64_t>(tuple.at(1))),
+                            static_cast<aku_ParamId>(boost::lexical_cast<int64_t>(tuple.at(0))));
+        Aggregator::Value value;
+        value.count = boost::lexical_cast<uint64_t>(tuple.at(2));
+        value.sum = strtod(tuple.at(3).c_str(), nullptr);
+        value.min = strtod(tuple.at(4).c_str(), nullptr);
+        value.max = strtod(tuple.at(5).c_str(), nullptr);
+        out->add(key, value);
+    }
+}
 
 std::vector<MetadataStorage::UntypedTuple> MetadataStorage::select_query(const char* query) const {
     (*logger_)(AKU_LOG_TRACE, query);
@@ -299,6 +564,8 @@ Volume::Volume(const char* file_name,
     mmap_.panic_if_bad();  // panic if can't mmap volume
     page_ = reinterpret_cast<PageHeader*>(mmap_.get_pointer());
     cache_.reset(new Sequencer(page_, conf));
+    flushed_count_ = page_->count;
+    flushed_offset_ = page_->last_offset;
 }
 
 Volume::~Volume() {
@@ -341,26 +608,383 @@ std::shared_ptr<Volume> Volume::safe_realloc() {
     return newvol;
 }
 
+std::shared_ptr<Volume> Volume::prepare_realloc() const {
+    std::string standby_file_name = file_path_;
+                standby_file_name += ".standby";
+
+    auto status = create_page_file(standby_file_name.c_str(), page_->page_id, logger_);
+    if (status != AKU_SUCCESS) {
+        (*logger_)(AKU_LOG_ERROR, "Failed to create new volume");
+        AKU_PANIC("can't create new page file (out of space?)");
+    }
+
+    std::shared_ptr<Volume> newvol;
+    newvol.reset(new Volume(standby_file_name.c_str(), config_, huge_tlb_, logger_));
+    // file should be deleted if standby volume wouldn't be used
+    newvol->is_temporary_.store(true);
+
+    // prefault page header and begining of the data area (data grows from the end of the page)
+    const size_t DATA_PREFETCH_SIZE = 0x1000000;
+    auto page = newvol->page_;
+    prefetch_mem(page->cdata(), sizeof(PageHeader));
+    auto data_size = std::min<size_t>(DATA_PREFETCH_SIZE, page->length);
+    prefetch_mem(page->cdata() + page->length - data_size, data_size);
+    return newvol;
+}
+
+std::shared_ptr<Volume> Volume::finish_realloc(std::shared_ptr<Volume> newvol) {
+    newvol->page_->open_count = page_->open_count;
+    newvol->page_->close_count = page_->close_count;
+
+    std::string new_file_name = file_path_;
+                new_file_name += ".tmp";
+
+    // this volume is temporary and should live until
+    // somebody is reading its data
+    mmap_.move_file(new_file_name.c_str());
+    mmap_.panic_if_bad();
+    is_temporary_.store(true);
+
+    newvol->mmap_.move_file(file_path_.c_str());
+    newvol->mmap_.panic_if_bad();
+    newvol->file_path_ = file_path_;
+    newvol->is_temporary_.store(false);
+    return newvol;
+}
+
 void Volume::open() {
     page_->reuse();
     mmap_.flush();
+    flushed_count_ = page_->count;
+    flushed_offset_ = page_->last_offset;
 }
 
 void Volume::close() {
     page_->close();
     mmap_.flush();
+    flushed_count_ = page_->count;
+    flushed_offset_ = page_->last_offset;
 }
 
 void Volume::flush() {
-    mmap_.flush();
+    auto count = page_->count;
+    auto last_offset = page_->last_offset;
+    if (count < flushed_count_ || last_offset > flushed_offset_) {
+        // Page was reused without open
+        mmap_.flush();
+    } else {
+        // Data grows from the end of the page to the begining
+        if (last_offset < flushed_offset_) {
+            mmap_.flush(last_offset, flushed_offset_);
+        }
+        // Index grows from the page header to the end of the page
+        if (count > flushed_count_) {
+            auto index_begin = reinterpret_cast<const char*>(page_->page_index + flushed_count_) - page_->cdata();
+            auto index_end = reinterpret_cast<const char*>(page_->page_index + count) - page_->cdata();
+            mmap_.flush(index_begin, index_end);
+        }
+    }
+    flushed_count_ = count;
+    flushed_offset_ = last_offset;
     page_->checkpoint = page_->sync_count;
     mmap_.flush(0, sizeof(PageHeader));
 }
 
+size_t Volume::get_dirty_size() const {
+    auto count = page_->count;
+    auto last_offset = page_->last_offset;
+    if (count < flushed_count_ || last_offset > flushed_offset_) {
+        return page_->length;
+    }
+    return (flushed_offset_ - last_offset) + (count - flushed_count_)*sizeof(aku_EntryOffset);
+}
+
+uint32_t Volume::recover() {
+    auto removed = page_->recover();
+    // Tail of the page was already written to disk (or lost), only header is updated
+    flushed_count_ = page_->count;
+    flushed_offset_ = page_->last_offset;
+    mmap_.flush(0, sizeof(PageHeader));
+    return removed;
+}
+
+void Volume::advise(MemAdvice advice) const {
+    auto index_end = reinterpret_cast<const char*>(page_->page_index + page_->count);
+    advise_mem(page_->cdata(), index_end - page_->cdata(), advice);
+    advise_mem(page_->cdata() + page_->last_offset, page_->length - page_->last_offset, advice);
+}
+
 void Volume::search(Caller& caller, InternalCursor* cursor, SearchQuery query) const {
     page_->search(caller, cursor, query);
 }
 
+void Volume::aggregate(Caller& caller, InternalCursor* cursor, SearchQuery query, Aggregator* aggregator) const {
+    page_->aggregate(caller, cursor, query, aggregator);
+}
+
+void Volume::get_memory_stats(aku_VolumeMemoryStats* rcv_stats) const {
+    rcv_stats->mapped = mmap_.get_size();
+    PageInfo info(mmap_.get_pointer(), mmap_.get_size());
+    rcv_stats->resident = info.resident_bytes();
+}
+
+//----------------------------------FlushScheduler--------------------------------------
+
+FlushScheduler::FlushScheduler(Clock::duration max_latency, size_t max_bytes)
+    : max_latency_(max_latency)
+    , max_bytes_(max_bytes)
+    , dirty_bytes_(0u)
+    , durable_ts_ {AKU_MIN_TIMESTAMP}
+    , n_flushes_ {0u}
+    , latency_(nullptr)
+{
+}
+
+void FlushScheduler::add(PVolume volume, size_t dirty_bytes, Clock::time_point now) {
+    if (volume_ && volume_ != volume) {
+        // Volume was switched, previous volume must be flushed by now
+        flush();
+    }
+    if (!volume_) {
+        oldest_write_ = now;
+    }
+    volume_ = volume;
+    dirty_bytes_ = dirty_bytes;
+}
+
+bool FlushScheduler::has_pending() const {
+    return static_cast<bool>(volume_);
+}
+
+FlushScheduler::Clock::time_point FlushScheduler::deadline() const {
+    return oldest_write_ + max_latency_;
+}
+
+bool FlushScheduler::is_ready(Clock::time_point now) const {
+    if (!volume_) {
+        return false;
+    }
+    if (max_bytes_ != 0 && dirty_bytes_ >= max_bytes_) {
+        return true;
+    }
+    return now >= deadline();
+}
+
+void FlushScheduler::flush() {
+    if (!volume_) {
+        return;
+    }
+    {
+        LatencyTimer timer(latency_);
+        volume_->flush();
+    }
+    set_durable_(volume_->get_page()->bbox.max_timestamp);
+    n_flushes_++;
+    volume_.reset();
+    dirty_bytes_ = 0u;
+}
+
+void FlushScheduler::discard(aku_TimeStamp durable_ts) {
+    set_durable_(durable_ts);
+    volume_.reset();
+    dirty_bytes_ = 0u;
+}
+
+void FlushScheduler::set_durable_(aku_TimeStamp ts) {
+    // Durable timestamp can only grow
+    if (ts > durable_ts_.load()) {
+        durable_ts_.store(ts);
+    }
+}
+
+//----------------------------------VolumeCatalog---------------------------------------
+
+void VolumeCatalog::resize(size_t nvolumes) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    boxes_.clear();
+    boxes_.resize(nvolumes);
+}
+
+void VolumeCatalog::update(size_t index, PageBoundingBox const& bbox) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    boxes_.at(index) = bbox;
+}
+
+void VolumeCatalog::select(SearchQuery const& query, std::vector<size_t> *out) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (size_t ix = 0; ix < boxes_.size(); ix++) {
+        if (overlaps(boxes_[ix], query)) {
+            out->push_back(ix);
+        }
+    }
+}
+
+bool VolumeCatalog::overlaps(PageBoundingBox const& bbox, SearchQuery const& query) {
+    if (bbox.min_timestamp > bbox.max_timestamp) {
+        // Empty volume
+        return false;
+    }
+    if (bbox.max_timestamp < query.lowerbound || bbox.min_timestamp > query.upperbound) {
+        return false;
+    }
+    // Matcher can tell that all params of interest lies outside of the bbox
+    if (query.match(bbox.max_id) == SearchQuery::LT_ALL) {
+        return false;
+    }
+    if (query.match(bbox.min_id) == SearchQuery::GT_ALL) {
+        return false;
+    }
+    return true;
+}
+
+// LastValueTable
+
+void LastValueTable::update(aku_ParamId param, aku_TimeStamp ts, double value) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!absent_.empty()) {
+        absent_.erase(param);
+    }
+    auto it = values_.find(param);
+    if (it == values_.end()) {
+        Value val = { ts, value };
+        values_.insert(std::make_pair(param, val));
+    } else if (it->second.timestamp <= ts) {
+        it->second.timestamp = ts;
+        it->second.value = value;
+    }
+}
+
+void LastValueTable::update(TimeSeriesValue const* batch, size_t size, aku_Status const* statuses) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (size_t i = 0; i < size; i++) {
+        if (statuses[i] != AKU_SUCCESS) {
+            continue;
+        }
+        if (!absent_.empty()) {
+            absent_.erase(batch[i].get_paramid());
+        }
+        // Batch is sorted by timestamp, later elements overwrite earlier ones
+        Value val = { batch[i].get_timestamp(), batch[i].get_double() };
+        auto it = values_.insert(std::make_pair(batch[i].get_paramid(), val));
+        if (!it.second && it.first->second.timestamp <= val.timestamp) {
+            it.first->second = val;
+        }
+    }
+}
+
+bool LastValueTable::get(aku_ParamId param, Value* out) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = values_.find(param);
+    if (it == values_.end()) {
+        return false;
+    }
+    *out = it->second;
+    return true;
+}
+
+void LastValueTable::set_absent(aku_ParamId param) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    // Series could be written after search
+    if (values_.count(param) != 0) {
+        return;
+    }
+    if (absent_.size() >= MAX_ABSENT) {
+        absent_.clear();
+    }
+    absent_.insert(param);
+}
+
+bool LastValueTable::is_absent(aku_ParamId param) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return absent_.count(param) != 0;
+}
+
+// RollupStore
+
+RollupStore::RollupStore(PMetadataStorage metadata, std::vector<aku_Duration> widths)
+    : metadata_(metadata)
+    , last_save_(Clock::now())
+{
+    std::sort(widths.begin(), widths.end());
+    widths.erase(std::unique(widths.begin(), widths.end()), widths.end());
+    auto begins = metadata_->init_rollup_tiers(widths);
+    for (auto width: widths) {
+        Tier tier = { begins[width], std::unique_ptr<Aggregator>(new Aggregator(width)) };
+        tiers_.push_back(std::move(tier));
+    }
+}
+
+void RollupStore::add(ChunkHeader const& header) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (header.timestamps.empty()) {
+        return;
+    }
+    for (auto& tier: tiers_) {
+        auto& agg = *tier.pending;
+        if (tier.begin == static_cast<aku_TimeStamp>(AKU_MAX_TIMESTAMP)) {
+            // Tier starts from the first bucket that is fully covered
+            auto first = header.timestamps.front();
+            tier.begin = first % agg.width_ == 0 ? first : first - first % agg.width_ + agg.width_;
+            metadata_->set_rollup_tier_begin(agg.width_, tier.begin);
+        }
+        size_t ix_value = 0;
+        size_t ix_int = 0;
+        for (size_t i = 0; i < header.timestamps.size(); i++) {
+            if (header.lengths[i] == 0) {
+                agg.add(header.paramids[i], header.timestamps[i], header.values[ix_value++]);
+            } else if (header.lengths[i] == AKU_LENGTH_INT64) {
+                agg.add(header.paramids[i], header.timestamps[i], static_cast<double>(header.integers[ix_int++]));
+            }
+        }
+    }
+}
+
+bool RollupStore::is_save_needed(Clock::time_point now) const {
+    // Rollups are saved at least once per second
+    std::lock_guard<std::mutex> guard(mutex_);
+    return now - last_save_ > std::chrono::seconds(1);
+}
+
+void RollupStore::save() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto& tier: tiers_) {
+        auto width = tier.pending->width_;
+        if (!tier.pending->index_.empty()) {
+            metadata_->add_rollups(*tier.pending);
+            tier.pending.reset(new Aggregator(width));
+        }
+    }
+    last_save_ = Clock::now();
+}
+
+int RollupStore::select_tier(aku_Duration width) const {
+    for (int ix = static_cast<int>(tiers_.size()); ix --> 0;) {
+        if (width % tiers_[ix].pending->width_ == 0) {
+            return ix;
+        }
+    }
+    return -1;
+}
+
+std::pair<aku_Duration, aku_TimeStamp> RollupStore::get_tier(int tier) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return std::make_pair(tiers_.at(tier).pending->width_, tiers_.at(tier).begin);
+}
+
+void RollupStore::aggregate(int tier, aku_TimeStamp begin, aku_TimeStamp end,
+                            std::vector<aku_ParamId> const& ids, Aggregator* out) const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto const& pending = *tiers_.at(tier).pending;
+    metadata_->get_rollups(pending.width_, begin, end, ids, out);
+    for (auto const& kv: pending.index_) {
+        auto const& key = kv.first;
+        if (key.first >= begin && key.first < end && std::binary_search(ids.begin(), ids.end(), key.second)) {
+            out->add(key, pending.values_[kv.second]);
+        }
+    }
+}
+
 //----------------------------------Storage---------------------------------------------
 
 struct VolumeIterator {
@@ -419,13 +1043,44 @@ struct VolumeIterator {
 };
 
 
+//! Get group commit latency from config
+static std::chrono::milliseconds get_flush_latency(aku_FineTuneParams const& params) {
+    if (params.max_flush_latency != 0) {
+        return std::chrono::milliseconds(params.max_flush_latency);
+    }
+    switch(params.durability) {
+    case AKU_DURABILITY_SPEED_TRADEOFF:
+        // Compromice some durability for speed
+        return std::chrono::milliseconds(100);
+    case AKU_MAX_WRITE_SPEED:
+        // Max speed
+        return std::chrono::milliseconds(1000);
+    };
+    // Max durability, flush after each merge
+    return std::chrono::milliseconds(0);
+}
+
 Storage::Storage(const char* path, aku_FineTuneParams const& params)
     : compression(true)
     , open_error_code_(AKU_SUCCESS)
     , logger_(params.logger)
     , durability_(params.durability)
     , huge_tlb_(params.enable_huge_tlb != 0)
+    , open_threads_(params.open_threads)
+    , numa_(params.numa_policy != 0)
+    , readahead_(params.readahead ? params.readahead : AKU_DEFAULT_READAHEAD)
+    , matcher_(AKU_STARTING_SERIES_ID)
 {
+    auto phase_start = Clock::now();
+    auto open_start = phase_start;
+
+    if (params.chunk_cache_size != 0) {
+        get_global_chunk_cache().set_capacity(params.chunk_cache_size);
+    }
+    if (params.stack_pool_size != 0) {
+        get_global_stack_pool().set_capacity(params.stack_pool_size);
+    }
+
     // 0. Check that file exists
     auto filedesc = std::fopen(const_cast<char*>(path), "r");
     if (filedesc == nullptr) {
@@ -456,93 +1111,184 @@ Storage::Storage(const char* path, aku_FineTuneParams const& params)
     // TODO: convert conf.max_cache_size from bytes
     config_.max_cache_size = v_iter.max_cache_size;
     config_.window_size = v_iter.window_size;
+    config_.writer_runs = params.writer_runs;
+    config_.merge_threads = params.merge_threads;
+    config_.window_percentile = params.window_percentile;
+    config_.min_window = params.min_window;
+    config_.max_window = params.max_window;
+    config_.chunk_encoding = params.chunk_encoding;
+    config_.codec_policy = params.codec_policy;
     ttl_ = v_iter.window_size;
+    log_open_phase_("metadata", &phase_start);
 
     // create volumes list
-    for(auto path: v_iter.volume_names) {
-        PVolume vol;
-        vol.reset(new Volume(path.c_str(), config_, huge_tlb_, logger_));
-        volumes_.push_back(vol);
+    map_volumes_(v_iter.volume_names);
+    log_open_phase_("map volumes", &phase_start);
+
+    catalog_.resize(volumes_.size());
+    for (size_t ix = 0; ix < volumes_.size(); ix++) {
+        catalog_.update(ix, volumes_[ix]->get_page()->bbox);
     }
 
-    select_active_page();
+    if (params.search_threads != 0) {
+        search_pool_.reset(new CursorWorkerPool(static_cast<int>(params.search_threads), numa_));
+    }
 
-    prepopulate_cache(config_.max_cache_size);
-}
+    try {
+        metadata_->load_matcher_data(matcher_);
+    } catch (std::exception const& err) {
+        (*logger_)(AKU_LOG_ERROR, err.what());
+        open_error_code_ = AKU_EGENERAL;
+        return;
+    }
+    log_open_phase_("series names", &phase_start);
 
-void Storage::select_active_page() {
-    // volume with max overwrites_count and max index must be active
-    int max_index = -1;
-    int64_t max_overwrites = -1;
-    for(int i = 0; i < (int)volumes_.size(); i++) {
-        PageHeader* page = volumes_.at(i)->get_page();
-        if (static_cast<int64_t>(page->open_count) >= max_overwrites) {
-            max_overwrites = static_cast<int64_t>(page->open_count);
-            max_index = i;
+    std::vector<aku_Duration> rollup_tiers;
+    for (auto width: params.rollup_tiers) {
+        if (width != 0u) {
+            rollup_tiers.push_back(width);
         }
-        prefetch_mem(page->histogram.entries, sizeof(page->histogram.entries));
+    }
+    try {
+        // Rollups of removed tiers are deleted
+        rollups_.reset(new RollupStore(metadata_, rollup_tiers));
+        if (rollup_tiers.empty()) {
+            rollups_.reset();
+        }
+    } catch (std::exception const& err) {
+        (*logger_)(AKU_LOG_ERROR, err.what());
+        open_error_code_ = AKU_EGENERAL;
+        return;
     }
 
-    active_volume_index_ = max_index;
-    active_volume_ = volumes_.at(max_index);
-    active_page_ = active_volume_->get_page();
-
-    if (active_page_->close_count == active_page_->open_count) {
-        // Application was interrupted during volume
-        // switching procedure
-        advance_volume_(active_volume_index_.load());
+    // split volumes between shards
+    auto nshards = get_num_shards(params.num_shards, volumes_.size());
+    for (uint32_t shard = 0; shard < nshards; shard++) {
+        std::vector<size_t> volume_ixs;
+        for (size_t ix = shard; ix < volumes_.size(); ix += nshards) {
+            volume_ixs.push_back(ix);
+        }
+        shards_.emplace_back(new StorageShard(*this, volume_ixs, params));
     }
-}
+    if (nshards > 1) {
+        log_message("number of shards", nshards);
+    }
+    for (auto& shard: shards_) {
+        shard->start();
+    }
+    log_open_phase_("recovery", &phase_start);
 
-void Storage::prepopulate_cache(int64_t max_cache_size) {
-    // All entries between sync_index (included) and count must
-    // be cached.
-    if (active_page_->sync_count != active_page_->checkpoint) {
-        active_page_->sync_count = active_page_->checkpoint;
-        active_volume_->flush();
+    if (open_threads_ != 0) {
+        advise_volumes_();
+        log_open_phase_("madvise", &phase_start);
     }
+    log_open_phase_("total", &open_start);
 }
 
-aku_Status Storage::get_open_error() const {
-    return open_error_code_;
+void Storage::log_open_phase_(const char* phase, Clock::time_point* start) {
+    auto now = Clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - *start).count();
+    std::stringstream fmt;
+    fmt << "open, " << phase << " (ms)";
+    log_message(fmt.str().c_str(), static_cast<uint64_t>(elapsed));
+    *start = now;
 }
 
-void Storage::advance_volume_(int local_rev) {
-    if (local_rev == active_volume_index_.load()) {
-        log_message("advance volume, current:");
-        log_message("....page ID", active_volume_->page_->page_id);
-        log_message("....close count", active_volume_->page_->close_count);
-        log_message("....open count", active_volume_->page_->open_count);
-
-        auto old_page_id = active_page_->page_id;
-        AKU_UNUSED(old_page_id);
-
-        int close_lock = active_volume_->cache_->reset();
-        if (close_lock % 2 == 1) {
-            active_volume_->cache_->merge_and_compress(active_page_);
+void Storage::map_volumes_(std::vector<std::string> const& paths) {
+    volumes_.resize(paths.size());
+    auto map_range = [this, &paths](size_t begin, size_t step) {
+        if (numa_) {
+            // Most of the volumes are historical
+            set_numa_policy(AKU_NUMA_INTERLEAVE);
         }
-        active_volume_->close();
-        log_message("page complete");
-
-        // select next page in round robin order
-        active_volume_index_++;
-        auto last_volume = volumes_[active_volume_index_ % volumes_.size()];
-        volumes_[active_volume_index_ % volumes_.size()] = last_volume->safe_realloc();
-        active_volume_ = volumes_[active_volume_index_ % volumes_.size()];
-        active_volume_->open();
-        active_page_ = active_volume_->page_;
+        for (size_t ix = begin; ix < paths.size(); ix += step) {
+            volumes_[ix].reset(new Volume(paths[ix].c_str(), config_, huge_tlb_, logger_));
+        }
+    };
+    size_t nthreads = std::min(static_cast<size_t>(open_threads_), paths.size());
+    if (nthreads < 2) {
+        map_range(0, 1);
+        return;
+    }
+    // Volume c-tor panics on error, error is rethrown in caller's thread
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(nthreads);
+    for (size_t i = 0; i < nthreads; i++) {
+        threads.emplace_back([&map_range, &errors, i, nthreads]() {
+            try {
+                map_range(i, nthreads);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    for (auto& err: errors) {
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+}
 
-        auto new_page_id = active_page_->page_id;
-        AKU_UNUSED(new_page_id);
-        assert(new_page_id != old_page_id);
+void Storage::advise_volumes_() {
+    // Active volume of the shard is written and searched first, previous
+    // volume of the shard is searched by most queries too. Older volumes
+    // are accessed randomly by search, readahead is useless there.
+    std::vector<bool> recent(volumes_.size(), false);
+    for (auto const& shard: shards_) {
+        auto n = shard->volume_ixs_.size();
+        auto active = shard->active_volume_index_.load() % n;
+        recent[shard->volume_ixs_[active]] = true;
+        recent[shard->volume_ixs_[(active + n - 1) % n]] = true;
+    }
+    if (numa_) {
+        // Readahead of the previous volumes is started by this thread,
+        // active volumes are placed on the first touch by the writers
+        set_numa_policy(AKU_NUMA_INTERLEAVE);
+    }
+    for (size_t ix = 0; ix < volumes_.size(); ix++) {
+        volumes_[ix]->advise(recent[ix] ? AKU_MEM_WILLNEED : AKU_MEM_RANDOM);
+    }
+    if (numa_) {
+        set_numa_policy(AKU_NUMA_DEFAULT);
+    }
+}
 
-        log_message("next volume opened");
-        log_message("....page ID", active_volume_->page_->page_id);
-        log_message("....close count", active_volume_->page_->close_count);
-        log_message("....open count", active_volume_->page_->open_count);
+Storage::~Storage() {
+    // Shards must be stopped before volumes are released
+    shards_.clear();
+    if (metadata_) {
+        save_series_names();
     }
-    // Or other thread already done all the switching
-    // just redo all the things
+    if (rollups_) {
+        try {
+            rollups_->save();
+        } catch (std::exception const& err) {
+            log_error(err.what());
+        }
+    }
+}
+
+uint32_t Storage::get_num_shards(uint32_t requested, size_t nvolumes) {
+    if (requested == 0u) {
+        return 1u;
+    }
+    return static_cast<uint32_t>(std::min(static_cast<size_t>(requested), nvolumes));
+}
+
+uint32_t Storage::get_shard_index(aku_ParamId param) const {
+    if (shards_.size() < 2) {
+        return 0u;
+    }
+    // Fibonacci hashing, consecutive ids goes to different shards
+    uint64_t hash = static_cast<uint64_t>(param) * 0x9E3779B97F4A7C15ull;
+    return static_cast<uint32_t>((hash >> 32) % shards_.size());
+}
+
+aku_Status Storage::get_open_error() const {
+    return open_error_code_;
 }
 
 void Storage::log_message(const char* message) {
@@ -560,49 +1306,538 @@ void Storage::log_message(const char* message, uint64_t value) {
     (*logger_)(AKU_LOG_INFO, fmt.str().c_str());
 }
 
+//----------------------------------StorageShard----------------------------------------
+
+StorageShard::StorageShard(Storage& storage, std::vector<size_t> volume_ixs, aku_FineTuneParams const& params)
+    : storage_(storage)
+    , volume_ixs_(volume_ixs)
+    , active_page_(nullptr)
+    , active_volume_index_(0)
+    , flusher_(get_flush_latency(params), params.max_flush_bytes)
+    , merge_stop_(false)
+    , merge_error_(AKU_SUCCESS)
+    , ingest_node_(-1)
+{
+    flusher_.latency_ = &storage_.metrics_.flush;
+}
+
+StorageShard::~StorageShard() {
+    if (standby_thread_.joinable()) {
+        standby_thread_.join();
+    }
+    if (merger_.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(merge_mutex_);
+            merge_stop_ = true;
+        }
+        merge_cvar_.notify_all();
+        merger_.join();
+    }
+}
+
+void StorageShard::start() {
+    select_active_page();
+
+    recover_active_page();
+
+    prepare_standby_();
+
+    merger_ = std::thread(std::bind(&StorageShard::merge_worker_, this));
+}
+
+size_t StorageShard::get_volume_index() const {
+    return volume_ixs_[active_volume_index_.load() % volume_ixs_.size()];
+}
+
+void StorageShard::select_active_page() {
+    // volume with max overwrites_count and max index must be active
+    int max_index = -1;
+    int64_t max_overwrites = -1;
+    for(int i = 0; i < (int)volume_ixs_.size(); i++) {
+        PageHeader* page = storage_.volumes_.at(volume_ixs_[i])->get_page();
+        if (static_cast<int64_t>(page->open_count) >= max_overwrites) {
+            max_overwrites = static_cast<int64_t>(page->open_count);
+            max_index = i;
+        }
+        if (storage_.open_threads_ == 0) {
+            // Otherwise hints are applied by Storage::advise_volumes_
+            prefetch_mem(page->model.knots, sizeof(page->model.knots));
+        }
+    }
+
+    active_volume_index_ = max_index;
+    active_volume_ = storage_.volumes_.at(get_volume_index());
+    active_page_ = active_volume_->get_page();
+
+    if (active_page_->open_count == 0) {
+        // Shard was never used before (new storage has only
+        // one active volume that belongs to the first shard)
+        active_volume_->open();
+        update_catalog_();
+    } else if (active_page_->close_count == active_page_->open_count) {
+        // Application was interrupted during volume
+        // switching procedure
+        advance_volume_(active_volume_index_.load());
+    }
+}
+
+void StorageShard::recover_active_page() {
+    // Everything before checkpoint is durable, only data written
+    // after the last flush should be checked.
+    if (active_page_->checkpoint != active_page_->count ||
+        active_page_->sync_count != active_page_->count)
+    {
+        storage_.log_message("recovery, checkpoint", active_page_->checkpoint);
+        storage_.log_message("....page ID", active_page_->page_id);
+        storage_.log_message("....entries count", active_page_->count);
+        auto removed = active_volume_->recover();
+        storage_.log_message("....entries removed", removed);
+        update_catalog_();
+    }
+}
+
+void StorageShard::advance_volume_(int local_rev) {
+    if (local_rev == active_volume_index_.load()) {
+        // Merger thread can write to active page
+        wait_for_merge_();
+
+        storage_.log_message("advance volume, current:");
+        storage_.log_message("....page ID", active_volume_->page_->page_id);
+        storage_.log_message("....close count", active_volume_->page_->close_count);
+        storage_.log_message("....open count", active_volume_->page_->open_count);
+
+        auto old_page_id = active_page_->page_id;
+        AKU_UNUSED(old_page_id);
+
+        std::unique_lock<std::mutex> page_lock(page_mutex_);
+        int close_lock = active_volume_->cache_->reset();
+        if (close_lock % 2 == 1) {
+            merge_and_compress_(*active_volume_);
+        }
+        active_volume_->close();
+        // Merge error belongs to the closed volume
+        merge_error_.store(AKU_SUCCESS);
+        // All data is flushed by close
+        flusher_.discard(active_page_->bbox.max_timestamp);
+        update_catalog_();
+        page_lock.unlock();
+        storage_.log_message("page complete");
+
+        // select next page in round robin order
+        active_volume_index_++;
+        auto& volumes = storage_.volumes_;
+        auto ix = get_volume_index();
+        volumes[ix] = take_standby_(volumes[ix]);
+        active_volume_ = volumes[ix];
+        active_volume_->open();
+        active_page_ = active_volume_->page_;
+        update_catalog_();
+
+        auto new_page_id = active_page_->page_id;
+        AKU_UNUSED(new_page_id);
+        assert(new_page_id != old_page_id || volume_ixs_.size() == 1);
+
+        storage_.log_message("next volume opened");
+        storage_.log_message("....page ID", active_volume_->page_->page_id);
+        storage_.log_message("....close count", active_volume_->page_->close_count);
+        storage_.log_message("....open count", active_volume_->page_->open_count);
+
+        prepare_standby_();
+    }
+    // Or other thread already done all the switching
+    // just redo all the things
+}
+
+void StorageShard::update_catalog_() {
+    storage_.catalog_.update(get_volume_index(), active_page_->bbox);
+}
+
+void StorageShard::prepare_standby_() {
+    if (storage_.open_error_code_ != AKU_SUCCESS || volume_ixs_.size() < 2) {
+        // Next volume is the active one, it can't be prepared in advance
+        return;
+    }
+    if (standby_thread_.joinable()) {
+        standby_thread_.join();
+    }
+    auto next_ix = volume_ixs_[(active_volume_index_.load() + 1) % volume_ixs_.size()];
+    auto next_volume = storage_.volumes_[next_ix];
+    standby_source_ = next_volume;
+    standby_.reset();
+    standby_thread_ = std::thread([this, next_volume]() {
+        int node = ingest_node_.load();
+        if (node >= 0) {
+            // Standby volume becomes active, writers will use it
+            set_numa_policy(AKU_NUMA_PREFERRED, node);
+        }
+        standby_ = next_volume->prepare_realloc();
+    });
+}
+
+StorageShard::PVolume StorageShard::take_standby_(PVolume volume) {
+    if (standby_thread_.joinable()) {
+        standby_thread_.join();
+    }
+    PVolume standby;
+    std::swap(standby, standby_);
+    bool prepared = standby && standby_source_ == volume;
+    standby_source_.reset();
+    if (!prepared) {
+        return volume->safe_realloc();
+    }
+    return volume->finish_realloc(standby);
+}
+
+void StorageShard::schedule_merge_(PVolume volume, int merge_lock) {
+    if (storage_.numa_) {
+        // Called by the writer, merger follows it
+        ingest_node_.store(get_numa_node());
+    }
+    MergeRequest request = { volume, merge_lock, Clock::now() };
+    {
+        std::lock_guard<std::mutex> guard(merge_mutex_);
+        merge_queue_.push_back(request);
+    }
+    merge_cvar_.notify_all();
+}
+
+void StorageShard::wait_for_merge_() {
+    std::unique_lock<std::mutex> lock(merge_mutex_);
+    merge_cvar_.wait(lock, [this]() { return merge_queue_.empty(); });
+}
+
+void StorageShard::merge_worker_() {
+    // Merge buffers and compressed chunks of the active page should be
+    // allocated on the node of the writers (merge threads inherit policy)
+    int numa_node = -1;
+    while (true) {
+        MergeRequest request;
+        bool flush_pending = false;
+        Clock::time_point flush_deadline;
+        {
+            std::lock_guard<std::mutex> guard(page_mutex_);
+            flush_pending = flusher_.has_pending();
+            flush_deadline = flusher_.deadline();
+        }
+        bool stop = false;
+        {
+            std::unique_lock<std::mutex> lock(merge_mutex_);
+            auto pred = [this]() { return merge_stop_ || !merge_queue_.empty(); };
+            if (flush_pending) {
+                merge_cvar_.wait_until(lock, flush_deadline, pred);
+            } else {
+                merge_cvar_.wait(lock, pred);
+            }
+            if (merge_queue_.empty()) {
+                // Stop requested and all merges are done or
+                // group commit deadline is reached
+                stop = merge_stop_;
+            } else {
+                // Request stays in queue until merge is completed
+                request = merge_queue_.front();
+            }
+        }
+        if (!request.volume) {
+            std::lock_guard<std::mutex> guard(page_mutex_);
+            if (stop || flusher_.is_ready(Clock::now())) {
+                flusher_.flush();
+            }
+            if (stop) {
+                return;
+            }
+            continue;
+        }
+        int node = ingest_node_.load();
+        if (node != numa_node) {
+            set_numa_policy(AKU_NUMA_PREFERRED, node);
+            numa_node = node;
+        }
+        merge_(request);
+        {
+            std::lock_guard<std::mutex> guard(merge_mutex_);
+            merge_queue_.pop_front();
+        }
+        merge_cvar_.notify_all();
+    }
+}
+
+aku_Status StorageShard::merge_and_compress_(Volume& volume) {
+    auto rollups = storage_.rollups_.get();
+    if (!rollups) {
+        return volume.cache_->merge_and_compress(volume.get_page());
+    }
+    // Rollups are updated before merge completion, search can't see
+    // the same values in sequencer and in rollups
+    auto add_rollups = [this, rollups](ChunkHeader const& header) {
+        try {
+            rollups->add(header);
+        } catch (std::exception const& err) {
+            storage_.log_error(err.what());
+        }
+    };
+    return volume.cache_->merge_and_compress(volume.get_page(), add_rollups);
+}
+
+void StorageShard::merge_(MergeRequest const& request) {
+    auto volume = request.volume;
+    bool flushed = false;
+    // Merged data can refer to new series
+    storage_.save_series_names();
+    {
+        std::lock_guard<std::mutex> guard(page_mutex_);
+        aku_Status status = AKU_SUCCESS;
+        {
+            LatencyTimer timer(&storage_.metrics_.checkpoint);
+            status = merge_and_compress_(*volume);
+        }
+        if (status != AKU_SUCCESS) {
+            // Sequencer is unlocked, writers will get the error
+            storage_.log_error(aku_error_message(status));
+            merge_error_.store(status);
+            return;
+        }
+        // Volume can't be switched while merge is in progress
+        update_catalog_();
+        auto now = Clock::now();
+        flusher_.add(volume, volume->get_dirty_size(), now);
+        if (flusher_.is_ready(now)) {
+            flusher_.flush();
+            flushed = true;
+        }
+    }
+    // Rollups are saved when merged data becomes durable (or periodically)
+    auto rollups = storage_.rollups_.get();
+    if (rollups && (flushed || rollups->is_save_needed(Clock::now()))) {
+        try {
+            rollups->save();
+        } catch (std::exception const& err) {
+            storage_.log_error(err.what());
+        }
+    }
+}
+
+void StorageShard::get_stats(aku_StorageStats* rcv_stats) {
+    {
+        std::lock_guard<std::mutex> guard(merge_mutex_);
+        rcv_stats->merge_queue_depth += merge_queue_.size();
+        if (!merge_queue_.empty()) {
+            auto lag = Clock::now() - merge_queue_.front().timestamp;
+            uint64_t lag_us = std::chrono::duration_cast<std::chrono::microseconds>(lag).count();
+            rcv_stats->merge_lag = std::max(rcv_stats->merge_lag, lag_us);
+        }
+    }
+    // Data is durable only if it's durable in all shards
+    rcv_stats->durable_timestamp = std::min(rcv_stats->durable_timestamp, flusher_.durable_ts_.load());
+    rcv_stats->n_flushes += flusher_.n_flushes_.load();
+    rcv_stats->window_size = std::max(rcv_stats->window_size, active_volume_->cache_->get_window_size());
+}
+
+void StorageShard::get_metrics(aku_Metrics* rcv_metrics) {
+    {
+        std::lock_guard<std::mutex> guard(merge_mutex_);
+        rcv_metrics->merge_queue_depth += merge_queue_.size();
+        if (!merge_queue_.empty()) {
+            auto lag = Clock::now() - merge_queue_.front().timestamp;
+            uint64_t lag_us = std::chrono::duration_cast<std::chrono::microseconds>(lag).count();
+            rcv_metrics->merge_lag = std::max(rcv_metrics->merge_lag, lag_us);
+        }
+    }
+    rcv_metrics->sequencer_size += active_volume_->cache_->get_memory_usage();
+}
+
+void StorageShard::get_memory_stats(aku_MemoryStats* rcv_stats, aku_VolumeMemoryStats* volumes, size_t volumes_size) {
+    // Volumes are replaced by the writer on volume switch, mincore is called without the lock
+    std::vector<PVolume> shard_volumes;
+    PVolume active;
+    {
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        for (auto ix: volume_ixs_) {
+            shard_volumes.push_back(storage_.volumes_.at(ix));
+        }
+        active = active_volume_;
+    }
+    for (size_t i = 0; i < shard_volumes.size(); i++) {
+        auto const& volume = shard_volumes[i];
+        // Volumes that wait for merge still have data in the sequencer
+        volume->cache_->get_memory_stats(rcv_stats);
+        aku_VolumeMemoryStats vstats;
+        volume->get_memory_stats(&vstats);
+        vstats.is_active = volume == active;
+        rcv_stats->mapped_bytes += vstats.mapped;
+        rcv_stats->resident_bytes += vstats.resident;
+        auto ix = volume_ixs_[i];
+        if (volumes && ix < volumes_size) {
+            volumes[ix] = vstats;
+        }
+    }
+}
+
+// Writing
+
+aku_Status StorageShard::write(TimeSeriesValue &ts_value, aku_MemRange data) {
+    auto& metrics = storage_.metrics_;
+    LatencyTimer timer(metrics.sample_write());
+    std::lock_guard<std::mutex> guard(write_mutex_);
+    auto status = _write_impl(ts_value, data);
+    metrics.n_writes.add(1);
+    if (status != AKU_SUCCESS) {
+        metrics.n_write_errors.add(1);
+    }
+    return status;
+}
+
+aku_Status StorageShard::_write_impl(TimeSeriesValue &ts_value, aku_MemRange data) {
+    while (true) {
+        int local_rev = active_volume_index_.load();
+        auto space_required = active_volume_->cache_->get_space_estimate();
+        int status = merge_error_.load();
+        if (status == AKU_SUCCESS && ts_value.is_blob()) {
+            std::lock_guard<std::mutex> guard(page_mutex_);
+            status = active_page_->add_chunk(data, space_required);
+            ts_value.payload.blob.value = active_page_->last_offset;
+        }
+        switch (status) {
+            case AKU_SUCCESS: {
+                int merge_lock = 0;
+                std::tie(status, merge_lock) = active_volume_->cache_->add(ts_value);
+                if (merge_lock % 2 == 1) {
+                    // Slow path is performed by merger thread
+                    schedule_merge_(active_volume_, merge_lock);
+                }
+                if (status == AKU_SUCCESS && !ts_value.is_blob()) {
+                    last_values_.update(ts_value.get_paramid(), ts_value.get_timestamp(), ts_value.get_double());
+                }
+                return status;
+            }
+            case AKU_EOVERFLOW:
+                advance_volume_(local_rev);
+                break;  // retry
+            case AKU_ELATE_WRITE:
+                // Branch for rare and unexpected errors
+            default:
+                storage_.log_error(aku_error_message(status));
+                return status;
+        }
+    }
+}
+
+aku_Status StorageShard::write_sorted(TimeSeriesValue const* batch, size_t size, aku_Status* statuses) {
+    auto& metrics = storage_.metrics_;
+    LatencyTimer timer(&metrics.write);
+    std::lock_guard<std::mutex> guard(write_mutex_);
+    int status = merge_error_.load();
+    if (status == AKU_EOVERFLOW) {
+        // Merger ran out of space, switch to the next volume
+        advance_volume_(active_volume_index_.load());
+        status = merge_error_.load();
+    }
+    if (status != AKU_SUCCESS) {
+        std::fill(statuses, statuses + size, status);
+        metrics.n_writes.add(size);
+        metrics.n_write_errors.add(size);
+        return status;
+    }
+    int merge_lock = 0;
+    std::tie(status, merge_lock) = active_volume_->cache_->add_batch(batch, size, statuses);
+    if (merge_lock % 2 == 1) {
+        // Slow path is performed by merger thread
+        schedule_merge_(active_volume_, merge_lock);
+    }
+    last_values_.update(batch, size, statuses);
+    metrics.n_writes.add(size);
+    if (status != AKU_SUCCESS) {
+        metrics.n_write_errors.add(std::count_if(statuses, statuses + size, [](aku_Status s) {
+            return s != AKU_SUCCESS;
+        }));
+    }
+    return status;
+}
+
+//----------------------------------Storage---------------------------------------------
+
 // Reading
 
-void Storage::search(Caller &caller, InternalCursor *cur, const SearchQuery &query) const {
+namespace {
+
+//! Stackless cursor that keeps searched volume alive
+template<class Search>
+struct VolumeCursor : StacklessCursor<Search> {
+    std::shared_ptr<Volume> volume_;
+
+    template<class... Args>
+    VolumeCursor(std::shared_ptr<Volume> volume, Args&&... args)
+        : StacklessCursor<Search>(std::forward<Args>(args)...)
+        , volume_(volume)
+    {
+    }
+};
+
+}  // namespace
+
+std::unique_ptr<ExternalCursor> Storage::make_cursor(SearchQuery const& user_query) const {
     using namespace std;
-    // Find pages
-    // at this stage of development - simply get all pages :)
+    SearchQuery query(user_query);
+    query.readahead = readahead_;
+    // Find pages that can contain data of interest, active
+    // volumes are always searched because their bounding boxes
+    // can be updated concurrently.
+    vector<size_t> overlapping;
+    catalog_.select(query, &overlapping);
+    vector<PVolume> active_volumes;
+    for (auto const& shard: shards_) {
+        active_volumes.push_back(shard->active_volume_);
+    }
+    // Volumes are searched in parallel only if there is more than one
+    // volume to search, results are merged by fan-in cursor in order.
+    bool parallel = search_pool_ && (overlapping.size() > 1 || shards_.size() > 1);
     vector<unique_ptr<ExternalCursor>> cursors;
-    for(auto vol: volumes_) {
-        // Search cache (optional, only for active page)
-        if (vol == this->active_volume_) {
+    for(size_t ix = 0; ix < volumes_.size(); ix++) {
+        auto vol = volumes_[ix];
+        bool is_active = find(active_volumes.begin(), active_volumes.end(), vol) != active_volumes.end();
+        if (!is_active && !binary_search(overlapping.begin(), overlapping.end(), ix)) {
+            continue;
+        }
+        // Search cache (optional, only for active pages)
+        uint32_t max_count = ~0u;
+        if (is_active) {
             aku_TimeStamp window;
             int seq_id;
-            tie(window, seq_id) = active_volume_->cache_->get_window();
+            tie(window, seq_id) = vol->cache_->get_window();
             if (query.direction == AKU_CURSOR_DIR_BACKWARD &&              // Cache searched only if cursor
                (query.lowerbound > window || query.upperbound > window))    // direction is backward.
             {
-                auto ccur = CoroCursor::make(&Sequencer::search,            // Cache has optimistic concurrency
-                                             active_volume_->cache_.get(),  // control and can easily return
-                                             query, seq_id);                // AKU_EBUSY, because of that it
-                cursors.push_back(move(ccur));                              // must be searched in a first place.
+                // Snapshot isn't affected by merge, page is searched up to the entries
+                // that was written before snapshot, merged data is found only once
+                auto snapshot = vol->cache_->get_snapshot();
+                max_count = snapshot->page_count;
+                unique_ptr<ExternalCursor> ccur;
+                ccur.reset(new VolumeCursor<SequencerSearch>(vol, snapshot, query));
+                cursors.push_back(move(ccur));
             }
         }
         // Search pages
-        auto pcur = CoroCursor::make(&Volume::search, vol, query);
+        unique_ptr<ExternalCursor> pcur;
+        pcur.reset(new VolumeCursor<PageSearch>(vol, vol->get_page(), query, nullptr, max_count));
+        if (parallel) {
+            pcur.reset(new PrefetchCursor(move(pcur), *search_pool_));
+        }
         cursors.push_back(move(pcur));
     }
+    assert(cursors.size());
+    unique_ptr<ExternalCursor> fan_in_cursor;
+    fan_in_cursor.reset(new StacklessFanInCursorCombinator(move(cursors), query.direction, query.limit));
+    return fan_in_cursor;
+}
 
-    vector<ExternalCursor*> pcursors;
-    transform( cursors.begin(), cursors.end()
-             , back_inserter(pcursors)
-             , [](unique_ptr<ExternalCursor>& v) { return v.get(); });
-
-    assert(pcursors.size());
-    StacklessFanInCursorCombinator fan_in_cursor(&pcursors[0], pcursors.size(), query.direction);
-
-    // TODO: remove excessive copying
-    // to do this I need to pass cur to fan_in_cursor somehow
+void Storage::search(Caller &caller, InternalCursor *cur, const SearchQuery &query) const {
+    auto fan_in_cursor = make_cursor(query);
     const int results_len = 0x1000;
     CursorResult results[results_len];
-    while(!fan_in_cursor.is_done()) {
-        int s = fan_in_cursor.read(results, results_len);
+    while(!fan_in_cursor->is_done()) {
+        int s = fan_in_cursor->read(results, results_len);
         int err_code = 0;
-        if (fan_in_cursor.is_error(&err_code)) {
+        if (fan_in_cursor->is_error(&err_code)) {
+            fan_in_cursor->close();
             cur->set_error(caller, err_code);
             return;
         }
@@ -610,10 +1845,234 @@ void Storage::search(Caller &caller, InternalCursor *cur, const SearchQuery &que
             cur->put(caller, results[i]);
         }
     }
-    fan_in_cursor.close();
+    fan_in_cursor->close();
     cur->complete(caller);
 }
 
+namespace {
+
+/** Cursor that passes double values to aggregator.
+  * Page aggregation sends only completion and errors to cursor.
+  */
+struct AggregatingCursor : InternalCursor {
+    Aggregator* aggregator;
+    int error_code;
+
+    AggregatingCursor(Aggregator* agg)
+        : aggregator(agg)
+        , error_code(AKU_SUCCESS)
+    {
+    }
+
+    virtual bool put(Caller&, CursorResult const& result) {
+        if (result.length == 0) {
+            aggregator->add(result.param_id, result.timestamp, result.data.float64);
+        } else if (result.length == AKU_LENGTH_INT64) {
+            aggregator->add(result.param_id, result.timestamp, static_cast<double>(result.data.int64));
+        }
+        return true;
+    }
+
+    virtual void complete(Caller&) {
+    }
+
+    virtual void set_error(Caller&, int code) {
+        error_code = code;
+    }
+};
+
+}  // namespace
+
+aku_Status Storage::aggregate(SearchQuery const& user_query, Aggregator* aggregator) const {
+    using namespace std;
+    // Number of attempts to aggregate active volume concurrently with merge
+    const int MAX_BUSY_RETRIES = 0x1000;
+    SearchQuery query(user_query);
+    query.readahead = readahead_;
+
+    // Query planner, buckets that are fully covered by the coarsest suitable rollup
+    // tier are read from rollups, the rest of the time range is aggregated from pages.
+    int tier = (rollups_ && query.id_set) ? rollups_->select_tier(aggregator->width_) : -1;
+    aku_TimeStamp rollup_begin = 0u, rollup_end = 0u;
+    if (tier >= 0) {
+        aku_Duration width;
+        aku_TimeStamp tier_begin;
+        tie(width, tier_begin) = rollups_->get_tier(tier);
+        auto lowerbound = query.lowerbound;
+        if (lowerbound % width != 0) {
+            lowerbound = lowerbound - lowerbound % width + width;
+            if (lowerbound < query.lowerbound) {
+                lowerbound = AKU_MAX_TIMESTAMP;  // overflow
+            }
+        }
+        rollup_begin = max(lowerbound, tier_begin);
+        // Bucket that contains upperbound is fully covered only if upperbound is the last element
+        rollup_end = query.upperbound - query.upperbound % width;
+        if (query.upperbound % width == width - 1) {
+            rollup_end = query.upperbound == static_cast<aku_TimeStamp>(AKU_MAX_TIMESTAMP) ? rollup_end : query.upperbound + 1;
+        }
+        if (rollup_begin >= rollup_end) {
+            tier = -1;
+        }
+    }
+    vector<SearchQuery> raw_queries;
+    if (tier < 0) {
+        raw_queries.push_back(query);
+    } else {
+        if (query.lowerbound < rollup_begin) {
+            raw_queries.push_back(query);
+            raw_queries.back().upperbound = rollup_begin - 1;
+        }
+        if (rollup_end <= query.upperbound) {
+            raw_queries.push_back(query);
+            raw_queries.back().lowerbound = rollup_end;
+        }
+    }
+
+    vector<PVolume> active_volumes;
+    for (auto const& shard: shards_) {
+        active_volumes.push_back(shard->active_volume_);
+    }
+    Caller caller;
+    for (auto const& raw_query: raw_queries) {
+        vector<size_t> overlapping;
+        catalog_.select(raw_query, &overlapping);
+        for (auto ix: overlapping) {
+            auto vol = volumes_[ix];
+            if (find(active_volumes.begin(), active_volumes.end(), vol) != active_volumes.end()) {
+                continue;
+            }
+            AggregatingCursor cursor(aggregator);
+            vol->aggregate(caller, &cursor, raw_query, aggregator);
+            if (cursor.error_code != AKU_SUCCESS) {
+                return cursor.error_code;
+            }
+        }
+    }
+
+    // Active volumes, page, sequencer and rollups are aggregated together, if sequencer
+    // was merged in between results are discarded and shard is aggregated again.
+    for (uint32_t shard_ix = 0; shard_ix < shards_.size(); shard_ix++) {
+        auto vol = active_volumes.at(shard_ix);
+        vector<aku_ParamId> shard_ids;
+        if (tier >= 0) {
+            for (auto id: query.id_set->get_ids()) {
+                if (get_shard_index(id) == shard_ix) {
+                    shard_ids.push_back(id);
+                }
+            }
+        }
+        int status = AKU_EBUSY;
+        for (int i = 0; i < MAX_BUSY_RETRIES && status == AKU_EBUSY; i++) {
+            Aggregator partial(aggregator->width_);
+            AggregatingCursor cursor(&partial);
+            aku_TimeStamp window;
+            int seq_id;
+            tie(window, seq_id) = vol->cache_->get_window();
+            if (seq_id % 2 != 0) {
+                // Merge in progress
+                this_thread::yield();
+                continue;
+            }
+            for (auto const& raw_query: raw_queries) {
+                if (cursor.error_code == AKU_SUCCESS) {
+                    vol->aggregate(caller, &cursor, raw_query, &partial);
+                }
+            }
+            if (tier >= 0) {
+                try {
+                    rollups_->aggregate(tier, rollup_begin, rollup_end, shard_ids, &partial);
+                } catch (std::exception const& err) {
+                    (*logger_)(AKU_LOG_ERROR, err.what());
+                    return AKU_EGENERAL;
+                }
+            }
+            if (cursor.error_code == AKU_SUCCESS && query.upperbound > window) {
+                vol->cache_->search(caller, &cursor, query, seq_id);
+            }
+            status = cursor.error_code;
+            if (status == AKU_SUCCESS) {
+                aggregator->merge(partial);
+            }
+        }
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status Storage::get_last_values(const aku_ParamId* params, size_t size,
+                                    aku_TimeStamp* out_ts, double* out_values) const
+{
+    std::vector<aku_ParamId> missing;
+    std::vector<size_t> missing_ixs;
+    aku_Status status = AKU_SUCCESS;
+    for (size_t i = 0; i < size; i++) {
+        LastValueTable::Value val;
+        auto const& table = shards_[get_shard_index(params[i])]->last_values_;
+        if (table.get(params[i], &val)) {
+            out_ts[i] = val.timestamp;
+            out_values[i] = val.value;
+        } else if (table.is_absent(params[i])) {
+            out_ts[i] = AKU_MIN_TIMESTAMP;
+            out_values[i] = std::numeric_limits<double>::quiet_NaN();
+            status = AKU_ENOT_FOUND;
+        } else {
+            missing.push_back(params[i]);
+            missing_ixs.push_back(i);
+        }
+    }
+    if (missing.empty()) {
+        return status;
+    }
+
+    // Slow path, first double value of each missing series in backward direction is the last one
+    std::unordered_map<aku_ParamId, LastValueTable::Value> found;
+    SearchQuery query(missing, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, AKU_CURSOR_DIR_BACKWARD);
+    auto nmissing = query.id_set->get_ids().size();
+    auto cursor = make_cursor(query);
+    const int results_len = 0x100;
+    CursorResult results[results_len];
+    int err_code = AKU_SUCCESS;
+    while (found.size() < nmissing && !cursor->is_done()) {
+        int n = cursor->read(results, results_len);
+        if (cursor->is_error(&err_code)) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (results[i].length == 0 || results[i].length == AKU_LENGTH_INT64) {
+                double value = results[i].length == 0 ? results[i].data.float64
+                                                      : static_cast<double>(results[i].data.int64);
+                LastValueTable::Value val = { results[i].timestamp, value };
+                found.insert(std::make_pair(results[i].param_id, val));
+            }
+        }
+    }
+    cursor->close();
+    if (err_code != AKU_SUCCESS) {
+        return err_code;
+    }
+    for (auto const& kv: found) {
+        shards_[get_shard_index(kv.first)]->last_values_.update(kv.first, kv.second.timestamp, kv.second.value);
+    }
+
+    for (auto i: missing_ixs) {
+        auto it = found.find(params[i]);
+        if (it != found.end()) {
+            out_ts[i] = it->second.timestamp;
+            out_values[i] = it->second.value;
+        } else {
+            // Series isn't searched again until it's written
+            shards_[get_shard_index(params[i])]->last_values_.set_absent(params[i]);
+            out_ts[i] = AKU_MIN_TIMESTAMP;
+            out_values[i] = std::numeric_limits<double>::quiet_NaN();
+            status = AKU_ENOT_FOUND;
+        }
+    }
+    return status;
+}
+
 void Storage::get_stats(aku_StorageStats* rcv_stats) {
     uint64_t used_space = 0,
              free_space = 0,
@@ -626,76 +2085,162 @@ void Storage::get_stats(aku_StorageStats* rcv_stats) {
         free_space += free;
         n_entries += vol->page_->count;
     }
+    rcv_stats->merge_queue_depth = 0u;
+    rcv_stats->merge_lag = 0u;
+    rcv_stats->durable_timestamp = shards_.empty() ? 0u : AKU_MAX_TIMESTAMP;
+    rcv_stats->n_flushes = 0u;
+    rcv_stats->window_size = 0u;
+    for (auto& shard: shards_) {
+        shard->get_stats(rcv_stats);
+    }
     rcv_stats->n_volumes = volumes_.size();
     rcv_stats->free_space = free_space;
     rcv_stats->used_space = used_space;
     rcv_stats->n_entries = n_entries;
 }
 
+void Storage::get_memory_stats(aku_MemoryStats* rcv_stats, aku_VolumeMemoryStats* volumes, size_t volumes_size) {
+    memset(rcv_stats, 0, sizeof(aku_MemoryStats));
+    rcv_stats->n_volumes = volumes_.size();
+    for (auto& shard: shards_) {
+        shard->get_memory_stats(rcv_stats, volumes, volumes_size);
+    }
+    matcher_.get_pool_stats(&rcv_stats->series_count, &rcv_stats->string_pool_bytes);
+    rcv_stats->series_table_bytes = matcher_.memory_use();
+    rcv_stats->index_bytes = matcher_.index.memory_use();
+    get_global_chunk_cache().get_usage(&rcv_stats->chunk_cache_bytes,
+                                       &rcv_stats->chunk_cache_capacity,
+                                       &rcv_stats->chunk_cache_items);
+}
+
+void Storage::get_metrics(aku_Metrics* rcv_metrics, bool reset) {
+    metrics_.get_metrics(rcv_metrics, reset);
+    rcv_metrics->sequencer_size = 0u;
+    rcv_metrics->merge_queue_depth = 0u;
+    rcv_metrics->merge_lag = 0u;
+    for (auto& shard: shards_) {
+        shard->get_metrics(rcv_metrics);
+    }
+}
+
 // Writing
 
-aku_Status Storage::_write_impl(TimeSeriesValue &ts_value, aku_MemRange data) {
-    while (true) {
-        int local_rev = active_volume_index_.load();
-        auto space_required = active_volume_->cache_->get_space_estimate();
-        int status = AKU_SUCCESS;
-        if (ts_value.is_blob()) {
-            status = active_page_->add_chunk(data, space_required);
-            ts_value.payload.blob.value = active_page_->last_offset;
-        }
-        switch (status) {
-            case AKU_SUCCESS: {
-                int merge_lock = 0;
-                std::tie(status, merge_lock) = active_volume_->cache_->add(ts_value);
-                if (merge_lock % 2 == 1) {
-                    // Slow path
-                    status = active_volume_->cache_->merge_and_compress(active_volume_->get_page());
-                    if (status == AKU_SUCCESS) {
-                        switch(durability_) {
-                        case AKU_MAX_DURABILITY:
-                            // Max durability
-                            active_volume_->flush();
-                            break;
-                        case AKU_DURABILITY_SPEED_TRADEOFF:
-                            // Compromice some durability for speed
-                            if ((merge_lock % 8) == 1) {
-                                active_volume_->flush();
-                            }
-                            break;
-                        case AKU_MAX_WRITE_SPEED:
-                            // Max speed
-                            if ((merge_lock % 32) == 1) {
-                                active_volume_->flush();
-                            }
-                            break;
-                        };
-                    }
-                }
-                return status;
-            }
-            case AKU_EOVERFLOW:
-                advance_volume_(local_rev);
-                break;  // retry
-            case AKU_ELATE_WRITE:
-                // Branch for rare and unexpected errors
-            default:
-                log_error(aku_error_message(status));
-                return status;
-        }
+//! write binary data
+aku_Status Storage::write_blob(aku_ParamId param, aku_TimeStamp ts, aku_MemRange data) {
+    // Offset is assigned by the shard
+    TimeSeriesValue ts_value(ts, param, 0u, data.length);
+    return shards_[get_shard_index(param)]->write(ts_value, data);
+}
+
+//! write binary data
+aku_Status Storage::write_double(aku_ParamId param, aku_TimeStamp ts, double value) {
+    aku_MemRange m = {};
+    TimeSeriesValue ts_value(ts, param, value);
+    return shards_[get_shard_index(param)]->write(ts_value, m);
+}
+
+aku_Status Storage::series_to_param_id(const char* begin, const char* end, aku_ParamId* out_id) {
+    char buffer[AKU_LIMITS_MAX_SNAME + 1];  // normal form is zero terminated
+    const char* keystr = nullptr;
+    auto status = SeriesParser::to_normal_form(begin, end, buffer, buffer + AKU_LIMITS_MAX_SNAME, &keystr);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    auto name_end = buffer + strlen(buffer);
+    auto id = matcher_.match(buffer, name_end);
+    if (id == 0u) {
+        id = matcher_.add(buffer, name_end);
     }
+    *out_id = id;
+    return AKU_SUCCESS;
 }
 
-//! write binary data
-aku_Status Storage::write_blob(aku_ParamId param, aku_TimeStamp ts, aku_MemRange data) {
-    TimeSeriesValue ts_value(ts, param, active_page_->last_offset, data.length);
-    return _write_impl(ts_value, data);
+aku_Status Storage::select_series(const char* expression, std::vector<aku_ParamId>* out) const {
+    return matcher_.select(expression, out);
 }
 
-//! write binary data
-aku_Status Storage::write_double(aku_ParamId param, aku_TimeStamp ts, double value) {
+void Storage::save_series_names() {
+    std::lock_guard<std::mutex> guard(series_mutex_);
+    matcher_.pull_new_names(&unsaved_series_);
+    if (unsaved_series_.empty()) {
+        return;
+    }
+    try {
+        metadata_->insert_new_names(unsaved_series_);
+        unsaved_series_.clear();
+    } catch (std::exception const& err) {
+        // Names will be saved next time
+        log_error(err.what());
+    }
+}
+
+aku_Status Storage::write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t value) {
     aku_MemRange m = {};
     TimeSeriesValue ts_value(ts, param, value);
-    return _write_impl(ts_value, m);
+    return shards_[get_shard_index(param)]->write(ts_value, m);
+}
+
+//! write batch of doubles
+aku_Status Storage::write_batch(const aku_ParamId* params, const aku_TimeStamp* timestamps,
+                                const double* values, size_t size, aku_Status* statuses)
+{
+    using namespace std;
+    if (size == 0) {
+        return AKU_SUCCESS;
+    }
+    // Batch is split between shards, sequencer accepts sorted batches only
+    vector<uint32_t> shard_ixs(size);
+    vector<uint32_t> order(size);
+    for (uint32_t i = 0; i < size; i++) {
+        shard_ixs[i] = get_shard_index(params[i]);
+        order[i] = i;
+    }
+    // Timsort is stable and takes linear time on presorted data (replayed
+    // or backfilled blocks usually consist of a few long ordered runs)
+    gfx::timsort(order.begin(), order.end(), [&shard_ixs, timestamps, params](uint32_t lhs, uint32_t rhs) {
+        return make_tuple(shard_ixs[lhs], timestamps[lhs], params[lhs])
+             < make_tuple(shard_ixs[rhs], timestamps[rhs], params[rhs]);
+    });
+    vector<TimeSeriesValue> batch;
+    batch.reserve(size);
+    for (auto ix: order) {
+        batch.push_back(TimeSeriesValue(timestamps[ix], params[ix], values[ix]));
+    }
+    vector<aku_Status> sorted_statuses(size, AKU_SUCCESS);
+
+    int status = AKU_SUCCESS;
+    size_t begin = 0;
+    while (begin < size) {
+        auto shard_ix = shard_ixs[order[begin]];
+        size_t end = begin + 1;
+        while (end < size && shard_ixs[order[end]] == shard_ix) {
+            end++;
+        }
+        auto shard_status = shards_[shard_ix]->write_sorted(batch.data() + begin, end - begin,
+                                                             sorted_statuses.data() + begin);
+        if (status == AKU_SUCCESS) {
+            status = shard_status;
+        }
+        begin = end;
+    }
+    if (status != AKU_SUCCESS) {
+        // Shards are written in shard order, result is the status of the
+        // first failed measurement in input order
+        uint32_t first_failed = static_cast<uint32_t>(size);
+        for (size_t i = 0; i < size; i++) {
+            if (sorted_statuses[i] != AKU_SUCCESS && order[i] < first_failed) {
+                first_failed = order[i];
+                status = sorted_statuses[i];
+            }
+        }
+        log_error(aku_error_message(status));
+        if (statuses) {
+            for (size_t i = 0; i < size; i++) {
+                statuses[order[i]] = sorted_statuses[i];
+            }
+        }
+    }
+    return status;
 }
 
 
@@ -958,11 +2503,17 @@ apr_status_t Storage::remove_storage(const char* file_name, aku_logger_cb_t logg
         return APR_EBADPATH;
     }
 
-    VolumeIterator v_iter(db, logger);
+    std::vector<std::string> volume_names;
+    {
+        VolumeIterator v_iter(db, logger);
 
-    if (v_iter.is_bad()) {
-        return v_iter.error_code;
+        if (v_iter.is_bad()) {
+            return v_iter.error_code;
+        }
+        volume_names.swap(v_iter.volume_names);
     }
+    // Connection should be closed before the metadata file is removed (WAL is checkpointed)
+    db.reset();
 
     apr_pool_t* mempool;
     apr_status_t status = apr_pool_create(&mempool, NULL);
@@ -973,7 +2524,7 @@ apr_status_t Storage::remove_storage(const char* file_name, aku_logger_cb_t logg
     }
 
     // create volumes list
-    for(auto path: v_iter.volume_names) {
+    for(auto path: volume_names) {
         status = apr_file_remove(path.c_str(), mempool);
         if (status != APR_SUCCESS) {
             std::stringstream fmt;
@@ -983,8 +2534,819 @@ apr_status_t Storage::remove_storage(const char* file_name, aku_logger_cb_t logg
     }
 
     status = apr_file_remove(file_name, mempool);
+    // WAL and shared memory index are normally removed by sqlite when the
+    // last connection is closed, they are left on disk after a crash
+    for (auto suffix: { "-wal", "-shm" }) {
+        std::string path = std::string(file_name) + suffix;
+        auto wal_status = apr_file_remove(path.c_str(), mempool);
+        if (wal_status != APR_SUCCESS && !APR_STATUS_IS_ENOENT(wal_status)) {
+            std::stringstream fmt;
+            fmt << "can't remove file " << path;
+            (*logger)(AKU_LOG_ERROR, fmt.str().c_str());
+        }
+    }
     apr_pool_destroy(mempool);
     return status;
 }
 
+
+//----------------------------------Offline maintenance---------------------------------
+
+namespace {
+
+//! Volume that is accessed directly, without Volume and Sequencer (database isn't open)
+struct OfflineVolume {
+    MemoryMappedFile mmap;
+    PageHeader*      page;
+
+    OfflineVolume(const char* path, aku_logger_cb_t logger)
+        : mmap(path, false, logger)
+        , page(mmap.is_bad() ? nullptr : reinterpret_cast<PageHeader*>(mmap.get_pointer()))
+    {
+    }
+
+    //! End of the page header and page index (data is placed at [last_offset, length))
+    size_t index_end() const {
+        return reinterpret_cast<const char*>(page->page_index + page->count) - page->cdata();
+    }
+
+    //! Check that page header is consistent with the file
+    bool is_valid() const {
+        return page != nullptr
+            && page->length <= mmap.get_size()
+            && page->last_offset < page->length
+            && index_end() <= page->last_offset;
+    }
+
+    //! Apply access pattern hint to used part of the page
+    void advise(MemAdvice advice) const {
+        advise_mem(page->cdata(), index_end(), advice);
+        advise_mem(page->cdata() + page->last_offset, page->length - page->last_offset, advice);
+    }
+};
+
+/** Visit descriptors of all chunks of the page in page index order.
+  * Descriptors written by older versions are extended to the current format
+  * (missing summary covers everything, missing filter and encoding are zero).
+  * @param visit called for every chunk, returns false to stop
+  * @param n_blobs out parameter, number of uncompressed entries of the page
+  * @return AKU_EBAD_DATA if page index or chunk descriptor is damaged
+  */
+template<class Visitor>
+aku_Status visit_chunks(PageHeader const* page, Visitor const& visit, uint64_t* n_blobs) {
+    for (uint32_t ix = 0; ix < page->count; ix++) {
+        auto offset = page->page_index[ix];
+        if (offset < page->last_offset || offset + sizeof(aku_Entry) > page->length) {
+            return AKU_EBAD_DATA;
+        }
+        auto entry = page->read_entry(offset);
+        if (entry->param_id < AKU_ID_COMPRESSED) {
+            (*n_blobs)++;
+            continue;
+        }
+        if (entry->param_id != AKU_CHUNK_FWD_ID) {
+            continue;
+        }
+        if (entry->length < AKU_CHUNK_DESC_NOSUMMARY_SIZE || offset + sizeof(aku_Entry) + entry->length > page->length) {
+            return AKU_EBAD_DATA;
+        }
+        ChunkDesc desc;
+        memset(&desc, 0, sizeof(desc));
+        memcpy(&desc, entry->value, std::min(static_cast<size_t>(entry->length), sizeof(desc)));
+        if (entry->length < AKU_CHUNK_DESC_NOFILTER_SIZE) {
+            desc.min_timestamp = AKU_MIN_TIMESTAMP;
+            desc.max_timestamp = AKU_MAX_TIMESTAMP;
+            desc.min_id = 0u;
+            desc.max_id = AKU_ID_COMPRESSED - 1;
+        }
+        if (desc.begin_offset > desc.end_offset || desc.end_offset > page->length ||
+            desc.filter_size > desc.end_offset - desc.begin_offset)
+        {
+            return AKU_EBAD_DATA;
+        }
+        if (!visit(desc)) {
+            break;
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+//! Verify checksum and decode the chunk (decoded columns are appended to `out`)
+aku_Status decode_page_chunk(PageHeader const* page, ChunkDesc const& desc, ChunkHeader* out) {
+    auto pbegin = reinterpret_cast<const unsigned char*>(page->cdata() + desc.begin_offset);
+    auto pend = reinterpret_cast<const unsigned char*>(page->cdata() + desc.end_offset);
+    boost::crc_32_type checksum;
+    checksum.process_block(pbegin, pend);
+    if (checksum.checksum() != desc.checksum) {
+        return AKU_EBAD_DATA;
+    }
+    pbegin += desc.filter_size;
+    try {
+        if (CompressionUtil::decode_chunk(out, &pbegin, pend, 0, 6, desc.n_elements, desc.encoding) < 0) {
+            return AKU_EBAD_DATA;
+        }
+    } catch (std::exception const&) {
+        return AKU_EBAD_DATA;
+    }
+    if (out->timestamps.size() != desc.n_elements || out->lengths.size() != desc.n_elements) {
+        return AKU_EBAD_DATA;
+    }
+    return AKU_SUCCESS;
+}
+
+//! Clear columns of the chunk header, memory is reused by the next chunk
+void clear_header(ChunkHeader* header) {
+    header->timestamps.clear();
+    header->paramids.clear();
+    header->offsets.clear();
+    header->lengths.clear();
+    header->values.clear();
+    header->integers.clear();
+}
+
+/** Chunks of the page with disjoint and increasing time ranges.
+  * Chunks are decoded one at a time, so merge of the runs needs
+  * only one decoded chunk per run.
+  */
+class ChunkRun {
+    std::vector<ChunkDesc>          chunks_;  //< Chunks of the run in time order
+    size_t                          next_;    //< Next chunk to decode
+    std::vector<TimeSeriesValue>    values_;  //< Values of the current chunk
+    size_t                          pos_;     //< Next value of the current chunk
+    ChunkHeader                     header_;  //< Decoding buffer
+public:
+    aku_Status                      status;   //< Decoding error
+    uint64_t                        n_blobs;  //< Number of uncompressed values found in chunks
+
+    ChunkRun()
+        : next_(0u)
+        , pos_(0u)
+        , status(AKU_SUCCESS)
+        , n_blobs(0u)
+    {
+    }
+
+    //! Add chunk to the end of the run
+    void add(ChunkDesc const& desc) {
+        chunks_.push_back(desc);
+    }
+
+    //! Time range of the last chunk
+    aku_TimeStamp back_timestamp() const {
+        return chunks_.back().max_timestamp;
+    }
+
+    //! Get next value of the run, returns false if run is done or chunk can't be decoded (see `status`)
+    bool next(PageHeader const* page, TimeSeriesValue* value, aku_MaintenanceStats* stats) {
+        while (pos_ == values_.size()) {
+            if (next_ == chunks_.size() || status != AKU_SUCCESS || n_blobs != 0u) {
+                return false;
+            }
+            auto const& desc = chunks_[next_++];
+            clear_header(&header_);
+            values_.clear();
+            pos_ = 0u;
+            status = decode_page_chunk(page, desc, &header_);
+            if (status != AKU_SUCCESS) {
+                return false;
+            }
+            stats->n_chunks++;
+            stats->bytes_read += desc.end_offset - desc.begin_offset;
+            size_t ndoubles = 0u, nints = 0u;
+            for (size_t i = 0; i < header_.timestamps.size(); i++) {
+                auto length = header_.lengths[i];
+                if (length == 0u) {
+                    values_.emplace_back(header_.timestamps[i], header_.paramids[i], header_.values.at(ndoubles++));
+                } else if (length == AKU_LENGTH_INT64) {
+                    values_.emplace_back(header_.timestamps[i], header_.paramids[i], header_.integers.at(nints++));
+                } else {
+                    n_blobs++;
+                }
+            }
+            // Chunk is mostly sorted already
+            gfx::timsort(values_.begin(), values_.end());
+        }
+        *value = values_[pos_++];
+        return true;
+    }
+};
+
+void add_maintenance_stats(aku_MaintenanceStats* sum, aku_MaintenanceStats const& stats) {
+    sum->n_volumes         += stats.n_volumes;
+    sum->n_skipped_volumes += stats.n_skipped_volumes;
+    sum->n_chunks          += stats.n_chunks;
+    sum->n_elements        += stats.n_elements;
+    sum->n_skipped         += stats.n_skipped;
+    sum->bytes_read        += stats.bytes_read;
+    sum->bytes_written     += stats.bytes_written;
+}
+
+void log_volume_error(aku_logger_cb_t logger, std::string const& path, const char* what, aku_Status status) {
+    std::stringstream fmt;
+    fmt << "Can't " << what << " volume " << path << ": " << aku_error_message(status);
+    (*logger)(AKU_LOG_ERROR, fmt.str().c_str());
+}
+
+/** Process volumes using `nthreads` threads, every volume is processed by one thread.
+  * @param fn volume processing function, receives index of the volume
+  * @return first error in volume order
+  */
+aku_Status for_each_volume(size_t nvolumes, uint32_t nthreads, aku_logger_cb_t logger,
+                           std::function<aku_Status(size_t)> const& fn)
+{
+    if (nthreads == 0 || nthreads > nvolumes) {
+        nthreads = static_cast<uint32_t>(nvolumes);
+    }
+    std::atomic<size_t> next = {0u};
+    std::vector<aku_Status> statuses(nvolumes, AKU_SUCCESS);
+    auto worker = [&]() {
+        size_t ix;
+        while ((ix = next.fetch_add(1)) < nvolumes) {
+            try {
+                statuses[ix] = fn(ix);
+            } catch (std::exception const& err) {
+                (*logger)(AKU_LOG_ERROR, err.what());
+                statuses[ix] = AKU_EGENERAL;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < nthreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& th: threads) {
+        th.join();
+    }
+    for (auto status: statuses) {
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+/** Read configuration and list of volumes from metadata file.
+  * Connection is closed on return. If `checkpoint` is set, the write-ahead
+  * log is checkpointed first, metadata file alone contains all data.
+  */
+aku_Status read_volumes(const char* file_name, aku_logger_cb_t logger, std::unique_ptr<VolumeIterator>* out,
+                        bool checkpoint = false)
+{
+    std::shared_ptr<MetadataStorage> db;
+    try {
+        db = std::make_shared<MetadataStorage>(file_name, logger);
+    } catch(std::exception const& err) {
+        (*logger)(AKU_LOG_ERROR, err.what());
+        return AKU_ENOT_FOUND;
+    }
+    out->reset(new VolumeIterator(db, logger));
+    if ((*out)->error_code == AKU_SUCCESS && checkpoint) {
+        try {
+            db->checkpoint_wal();
+        } catch(std::exception const& err) {
+            (*logger)(AKU_LOG_ERROR, err.what());
+            return AKU_EBUSY;
+        }
+    }
+    return (*out)->error_code;
+}
+
+//! Output file of the export, blocks of all threads are appended to it
+class ColumnFileWriter {
+    apr_pool_t*  pool_;
+    apr_file_t*  file_;
+    apr_status_t status_;
+    std::mutex   mutex_;
+public:
+    ColumnFileWriter(const char* path)
+        : pool_(nullptr)
+        , file_(nullptr)
+    {
+        status_ = apr_pool_create(&pool_, NULL);
+        if (status_ == APR_SUCCESS) {
+            status_ = apr_file_open(&file_, path, APR_CREATE|APR_WRITE|APR_TRUNCATE, APR_OS_DEFAULT, pool_);
+        }
+    }
+
+    ~ColumnFileWriter() {
+        if (file_) {
+            apr_file_close(file_);
+        }
+        if (pool_) {
+            apr_pool_destroy(pool_);
+        }
+    }
+
+    apr_status_t status() const {
+        return status_;
+    }
+
+    //! Append content of the buffer to the file
+    apr_status_t append(ByteVector const& buffer) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return apr_file_write_full(file_, buffer.data(), buffer.size(), nullptr);
+    }
+};
+
+template<class T>
+void append_column(std::vector<T> const& column, ByteVector* out) {
+    auto begin = reinterpret_cast<const unsigned char*>(column.data());
+    out->insert(out->end(), begin, begin + column.size()*sizeof(T));
+}
+
+/** Convert elements of the decoded chunk that match the time range and ids to
+  * column block (see aku_ColumnBlockHeader) and append it to the buffer.
+  */
+void append_column_block(ChunkHeader const& header, aku_TimeStamp begin, aku_TimeStamp end,
+                         std::vector<aku_ParamId> const& ids, ByteVector* out, aku_MaintenanceStats* stats)
+{
+    // Elements are sorted by timestamp, only [lo, hi) is inside the time range
+    auto ts_lo = std::lower_bound(header.timestamps.begin(), header.timestamps.end(), begin);
+    auto ts_hi = std::upper_bound(ts_lo, header.timestamps.end(), end);
+    auto lo = static_cast<size_t>(ts_lo - header.timestamps.begin());
+    auto hi = static_cast<size_t>(ts_hi - header.timestamps.begin());
+    std::vector<aku_TimeStamp> timestamps;
+    std::vector<aku_ParamId> paramids;
+    std::vector<uint64_t> values;
+    std::vector<uint8_t> types;
+    // Doubles and integers are stored in separate columns of the header
+    size_t ndoubles = 0u, nints = 0u;
+    for (size_t i = 0; i < hi; i++) {
+        auto length = header.lengths[i];
+        bool is_double = length == 0u;
+        bool is_int = length == AKU_LENGTH_INT64;
+        uint64_t bits = 0u;
+        if (is_double) {
+            memcpy(&bits, &header.values.at(ndoubles++), sizeof(bits));
+        } else if (is_int) {
+            bits = static_cast<uint64_t>(header.integers.at(nints++));
+        }
+        auto param = header.paramids[i];
+        if (i < lo || (!ids.empty() && !std::binary_search(ids.begin(), ids.end(), param))) {
+            continue;
+        }
+        if (!is_double && !is_int) {
+            stats->n_skipped++;
+            continue;
+        }
+        timestamps.push_back(header.timestamps[i]);
+        paramids.push_back(param);
+        values.push_back(bits);
+        types.push_back(is_int ? 1u : 0u);
+    }
+    if (timestamps.empty()) {
+        return;
+    }
+    aku_ColumnBlockHeader block;
+    block.magic = AKU_COLUMN_BLOCK_MAGIC;
+    block.count = static_cast<uint32_t>(timestamps.size());
+    block.min_timestamp = timestamps.front();
+    block.max_timestamp = timestamps.back();
+    types.resize((types.size() + 7u) & ~size_t(7u), 0u);
+    auto pblock = reinterpret_cast<const unsigned char*>(&block);
+    out->insert(out->end(), pblock, pblock + sizeof(block));
+    append_column(timestamps, out);
+    append_column(paramids, out);
+    append_column(values, out);
+    append_column(types, out);
+    stats->n_elements += block.count;
+}
+
+}
+
+aku_Status Storage::export_columns(const char* file_name, const char* out_path,
+                                   aku_TimeStamp begin, aku_TimeStamp end,
+                                   std::vector<aku_ParamId> ids, uint32_t nthreads,
+                                   aku_logger_cb_t logger, aku_MaintenanceStats* rcv_stats)
+{
+    // Output is written by large blocks, threads doesn't wait for each other often
+    const size_t WRITE_BUFFER_SIZE = 0x800000;
+
+    std::unique_ptr<VolumeIterator> v_iter;
+    auto status = read_volumes(file_name, logger, &v_iter);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    ColumnFileWriter writer(out_path);
+    if (writer.status() != APR_SUCCESS) {
+        std::stringstream fmt;
+        fmt << "Can't open output file " << out_path << ": " << apr_error_message(writer.status());
+        (*logger)(AKU_LOG_ERROR, fmt.str().c_str());
+        return AKU_EGENERAL;
+    }
+
+    auto const& paths = v_iter->volume_names;
+    std::vector<aku_MaintenanceStats> stats(paths.size());
+    auto export_volume = [&](size_t ix) -> aku_Status {
+        auto& vstats = stats[ix];
+        memset(&vstats, 0, sizeof(vstats));
+        OfflineVolume volume(paths[ix].c_str(), logger);
+        if (!volume.is_valid()) {
+            log_volume_error(logger, paths[ix], "export", AKU_EBAD_DATA);
+            return AKU_EBAD_DATA;
+        }
+        vstats.n_volumes = 1u;
+        auto page = volume.page;
+        auto const& bbox = page->bbox;
+        if (page->count == 0 || bbox.min_timestamp > bbox.max_timestamp ||
+            bbox.max_timestamp < begin || bbox.min_timestamp > end)
+        {
+            vstats.n_skipped_volumes = 1u;
+            return AKU_SUCCESS;
+        }
+        volume.advise(AKU_MEM_SEQUENTIAL);
+
+        ChunkHeader header;
+        ByteVector buffer;
+        aku_Status status = AKU_SUCCESS;
+        auto flush = [&]() {
+            if (writer.append(buffer) != APR_SUCCESS) {
+                status = AKU_EGENERAL;
+            }
+            vstats.bytes_written += buffer.size();
+            buffer.clear();
+        };
+        auto visit = [&](ChunkDesc const& desc) {
+            // Summary allows to skip chunks without decoding
+            if (desc.max_timestamp < begin || desc.min_timestamp > end ||
+                (!ids.empty() && (desc.max_id < ids.front() || desc.min_id > ids.back())))
+            {
+                return true;
+            }
+            clear_header(&header);
+            status = decode_page_chunk(page, desc, &header);
+            if (status != AKU_SUCCESS) {
+                return false;
+            }
+            vstats.n_chunks++;
+            vstats.bytes_read += desc.end_offset - desc.begin_offset;
+            append_column_block(header, begin, end, ids, &buffer, &vstats);
+            if (buffer.size() >= WRITE_BUFFER_SIZE) {
+                flush();
+            }
+            return status == AKU_SUCCESS;
+        };
+        auto visit_status = visit_chunks(page, visit, &vstats.n_skipped);
+        if (status == AKU_SUCCESS && !buffer.empty()) {
+            flush();
+        }
+        if (visit_status != AKU_SUCCESS) {
+            status = visit_status;
+        }
+        if (status != AKU_SUCCESS) {
+            log_volume_error(logger, paths[ix], "export", status);
+        }
+        return status;
+    };
+    status = for_each_volume(paths.size(), nthreads, logger, export_volume);
+
+    if (rcv_stats) {
+        memset(rcv_stats, 0, sizeof(aku_MaintenanceStats));
+        for (auto const& vstats: stats) {
+            add_maintenance_stats(rcv_stats, vstats);
+        }
+    }
+    return status;
+}
+
+aku_Status Storage::compact_storage(const char* file_name, uint32_t codec_policy, uint32_t nthreads,
+                                    aku_logger_cb_t logger, aku_MaintenanceStats* rcv_stats)
+{
+    std::unique_ptr<VolumeIterator> v_iter;
+    auto status = read_volumes(file_name, logger, &v_iter);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    const size_t chunk_size = std::max(v_iter->compression_threshold, 1u);
+
+    auto const& paths = v_iter->volume_names;
+    std::vector<aku_MaintenanceStats> stats(paths.size());
+    auto compact_volume = [&](size_t ix) -> aku_Status {
+        auto& vstats = stats[ix];
+        memset(&vstats, 0, sizeof(vstats));
+        auto const& path = paths[ix];
+
+        // Source stays intact until the end
+        std::unique_ptr<OfflineVolume> source(new OfflineVolume(path.c_str(), logger));
+        if (!source->is_valid()) {
+            log_volume_error(logger, path, "compact", AKU_EBAD_DATA);
+            return AKU_EBAD_DATA;
+        }
+        vstats.n_volumes = 1u;
+        auto spage = source->page;
+        if (spage->count == 0) {
+            vstats.n_skipped_volumes = 1u;
+            return AKU_SUCCESS;
+        }
+        source->advise(AKU_MEM_SEQUENTIAL);
+
+        // Descriptors are small, chunks are decoded during the merge
+        std::vector<ChunkDesc> descs;
+        uint64_t nblobs = 0u;
+        auto collect = [&](ChunkDesc const& desc) {
+            descs.push_back(desc);
+            return true;
+        };
+        aku_Status status = visit_chunks(spage, collect, &nblobs);
+        // Chunks written by older versions doesn't have summary, time range is taken from data
+        ChunkHeader header;
+        for (auto& desc: descs) {
+            if (status != AKU_SUCCESS) {
+                break;
+            }
+            if (desc.min_timestamp == AKU_MIN_TIMESTAMP &&
+                desc.max_timestamp == static_cast<aku_TimeStamp>(AKU_MAX_TIMESTAMP))
+            {
+                clear_header(&header);
+                status = decode_page_chunk(spage, desc, &header);
+                if (status == AKU_SUCCESS && !header.timestamps.empty()) {
+                    auto minmax = std::minmax_element(header.timestamps.begin(), header.timestamps.end());
+                    desc.min_timestamp = *minmax.first;
+                    desc.max_timestamp = *minmax.second;
+                }
+            }
+        }
+        if (status != AKU_SUCCESS) {
+            log_volume_error(logger, path, "compact", status);
+            return status;
+        }
+        auto skip_blobs = [&](uint64_t count) {
+            // Blob data is referenced by offset, it can't be moved
+            std::stringstream fmt;
+            fmt << "Volume " << path << " contains blobs, it is left as is";
+            (*logger)(AKU_LOG_INFO, fmt.str().c_str());
+            vstats.n_skipped_volumes = 1u;
+            vstats.n_skipped = count;
+            return AKU_SUCCESS;
+        };
+        if (nblobs != 0u) {
+            return skip_blobs(nblobs);
+        }
+
+        // Chunks are split into the smallest number of runs (interval partitioning), number
+        // of runs is a number of chunks that overlap in time (small, chunks are written in time order)
+        std::sort(descs.begin(), descs.end(), [](ChunkDesc const& lhs, ChunkDesc const& rhs) {
+            return lhs.min_timestamp < rhs.min_timestamp;
+        });
+        std::vector<ChunkRun> runs;
+        typedef std::pair<aku_TimeStamp, size_t> RunEnd;  // Max timestamp and index of the run
+        std::priority_queue<RunEnd, std::vector<RunEnd>, std::greater<RunEnd>> run_ends;
+        for (auto const& desc: descs) {
+            size_t ix = runs.size();
+            if (!run_ends.empty() && run_ends.top().first < desc.min_timestamp) {
+                ix = run_ends.top().second;
+                run_ends.pop();
+            } else {
+                runs.emplace_back();
+            }
+            runs[ix].add(desc);
+            run_ends.emplace(desc.max_timestamp, ix);
+        }
+        descs.clear();
+        descs.shrink_to_fit();
+
+        std::string target_path = path + ".compact";
+        if (create_page_file(target_path.c_str(), spage->page_id, logger) != APR_SUCCESS) {
+            log_volume_error(logger, path, "compact", AKU_EGENERAL);
+            return AKU_EGENERAL;
+        }
+        OfflineVolume target(target_path.c_str(), logger);
+        if (!target.is_valid()) {
+            log_volume_error(logger, path, "compact", AKU_EGENERAL);
+            return AKU_EGENERAL;
+        }
+        auto page = target.page;
+
+        // K-way merge of the runs, new chunks are written as soon as they're full
+        MergeOrder<std::less<TimeSeriesValue>, AKU_CURSOR_DIR_FORWARD> order;
+        LoserTree<TimeSeriesValue> tree(runs.size());
+        TimeSeriesValue value;
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (runs[i].next(spage, &value, &vstats)) {
+                tree.set(static_cast<int>(i), value);
+            }
+        }
+        tree.build(order);
+        size_t nvalues = 0u;
+        auto write_chunk = [&]() {
+            auto encoding = CompressionUtil::select_encoding(header, codec_policy, AKU_CHUNK_BASE128);
+            EncodedChunk chunk;
+            chunk.encode(header, encoding, page->get_chunk_space());
+            vstats.n_elements += nvalues;
+            nvalues = 0u;
+            return page->complete_chunk(header, chunk);
+        };
+        clear_header(&header);
+        TimeSeriesValue last;
+        bool first = true;
+        while (status == AKU_SUCCESS && !tree.empty()) {
+            auto const& top = tree.top();
+            if (!first && top < last) {
+                // Chunk summary doesn't match its data
+                status = AKU_EBAD_DATA;
+                break;
+            }
+            first = false;
+            last = top;
+            top.add_to_header(&header);
+            if (++nvalues == chunk_size) {
+                status = write_chunk();
+                clear_header(&header);
+            }
+            auto& run = runs[tree.winner()];
+            if (run.next(spage, &value, &vstats)) {
+                tree.replace_top(value, order);
+            } else if (run.status != AKU_SUCCESS || run.n_blobs != 0u) {
+                break;
+            } else {
+                tree.pop_top(order);
+            }
+        }
+        for (auto const& run: runs) {
+            if (status == AKU_SUCCESS) {
+                status = run.status;
+            }
+            nblobs += run.n_blobs;
+        }
+        if (nblobs != 0u) {
+            target.mmap.delete_file();
+            return skip_blobs(nblobs);
+        }
+        if (status == AKU_SUCCESS && nvalues != 0u) {
+            status = write_chunk();
+        }
+        page->open_count = spage->open_count;
+        page->close_count = spage->close_count;
+        source.reset();
+        if (status == AKU_SUCCESS) {
+            page->checkpoint = page->sync_count;
+            status = target.mmap.flush();
+        }
+        if (status == AKU_SUCCESS) {
+            vstats.bytes_written = target.index_end() + (page->length - page->last_offset);
+            // Rename is atomic, volume is either old or compacted
+            target.mmap.move_file(path.c_str());
+            if (target.mmap.is_bad()) {
+                status = AKU_EGENERAL;
+            }
+        }
+        if (status != AKU_SUCCESS) {
+            target.mmap.delete_file();
+            log_volume_error(logger, path, "compact", status);
+        }
+        return status;
+    };
+    status = for_each_volume(paths.size(), nthreads, logger, compact_volume);
+
+    if (rcv_stats) {
+        memset(rcv_stats, 0, sizeof(aku_MaintenanceStats));
+        for (auto const& vstats: stats) {
+            add_maintenance_stats(rcv_stats, vstats);
+        }
+    }
+    return status;
+}
+
+aku_Status Storage::backup_storage(const char* file_name, const char* dest_path, uint32_t nthreads,
+                                   aku_logger_cb_t logger, aku_MaintenanceStats* rcv_stats)
+{
+    // Ranges are copied and flushed by parts, page cache isn't flooded with dirty pages
+    const size_t COPY_STEP = 0x4000000;
+
+    // Only the metadata file is copied, data that is still in its WAL (e.g. after
+    // a crash) is moved to the file and the connection is closed before the copy
+    std::unique_ptr<VolumeIterator> v_iter;
+    auto status = read_volumes(file_name, logger, &v_iter, true);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+
+    apr_pool_t* mempool;
+    if (apr_pool_create(&mempool, NULL) != APR_SUCCESS) {
+        (*logger)(AKU_LOG_ERROR, "can't create memory pool");
+        return AKU_ENO_MEM;
+    }
+    std::unique_ptr<apr_pool_t, decltype(&delete_apr_pool)> pool(mempool, &delete_apr_pool);
+    auto apr_status = apr_dir_make_recursive(dest_path, APR_OS_DEFAULT, mempool);
+    if (apr_status != APR_SUCCESS) {
+        std::stringstream fmt;
+        fmt << "Can't create backup dir " << dest_path << ": " << apr_error_message(apr_status);
+        (*logger)(AKU_LOG_ERROR, fmt.str().c_str());
+        return AKU_EGENERAL;
+    }
+    auto dest_name = [&](std::string const& path) {
+        char* result = nullptr;
+        auto name = apr_filepath_name_get(path.c_str());
+        if (apr_filepath_merge(&result, dest_path, name, APR_FILEPATH_NATIVE, mempool) != APR_SUCCESS) {
+            return std::string();
+        }
+        return std::string(result);
+    };
+    auto const& paths = v_iter->volume_names;
+    std::vector<MetadataStorage::VolumeDesc> dest_volumes;
+    for (size_t ix = 0; ix < paths.size(); ix++) {
+        auto path = dest_name(paths[ix]);
+        if (path.empty()) {
+            (*logger)(AKU_LOG_ERROR, "Invalid backup path");
+            return AKU_EBAD_ARG;
+        }
+        dest_volumes.push_back(std::make_pair(static_cast<int>(ix), path));
+    }
+    auto dest_metadata = dest_name(file_name);
+    if (dest_metadata.empty()) {
+        (*logger)(AKU_LOG_ERROR, "Invalid backup path");
+        return AKU_EBAD_ARG;
+    }
+    // Files are copied to one directory, files with the same name from
+    // different directories would overwrite each other
+    std::set<std::string> dest_names = { dest_metadata };
+    for (auto const& desc: dest_volumes) {
+        if (!dest_names.insert(desc.second).second) {
+            std::stringstream fmt;
+            fmt << "Can't backup storage, file name " << desc.second << " isn't unique";
+            (*logger)(AKU_LOG_ERROR, fmt.str().c_str());
+            return AKU_EBAD_ARG;
+        }
+    }
+
+    std::vector<aku_MaintenanceStats> stats(paths.size());
+    auto backup_volume = [&](size_t ix) -> aku_Status {
+        auto& vstats = stats[ix];
+        memset(&vstats, 0, sizeof(vstats));
+        auto const& target_path = dest_volumes[ix].second;
+        OfflineVolume source(paths[ix].c_str(), logger);
+        if (!source.is_valid()) {
+            log_volume_error(logger, paths[ix], "copy", AKU_EBAD_DATA);
+            return AKU_EBAD_DATA;
+        }
+        if (create_file(target_path.c_str(), source.mmap.get_size(), logger) != APR_SUCCESS) {
+            log_volume_error(logger, paths[ix], "copy", AKU_EGENERAL);
+            return AKU_EGENERAL;
+        }
+        MemoryMappedFile target(target_path.c_str(), false, logger);
+        if (target.is_bad()) {
+            log_volume_error(logger, paths[ix], "copy", AKU_EGENERAL);
+            return AKU_EGENERAL;
+        }
+        vstats.n_volumes = 1u;
+        source.advise(AKU_MEM_SEQUENTIAL);
+        auto page = source.page;
+        auto src = page->cdata();
+        auto dst = static_cast<char*>(target.get_pointer());
+        // Header and page index grows from the beginning of the page, data grows from the end,
+        // free space between them isn't copied
+        std::pair<size_t, size_t> ranges[] = {
+            std::make_pair(size_t(0u), source.index_end()),
+            std::make_pair(size_t(page->last_offset), size_t(page->length)),
+        };
+        for (auto const& range: ranges) {
+            for (auto pos = range.first; pos < range.second; pos += COPY_STEP) {
+                auto next = std::min(range.second, pos + COPY_STEP);
+                memcpy(dst + pos, src + pos, next - pos);
+                auto status = target.flush(pos, next);
+                if (status != AKU_SUCCESS) {
+                    log_volume_error(logger, paths[ix], "copy", status);
+                    return static_cast<aku_Status>(status);
+                }
+                vstats.bytes_read += next - pos;
+                vstats.bytes_written += next - pos;
+            }
+        }
+        return AKU_SUCCESS;
+    };
+    status = for_each_volume(paths.size(), nthreads, logger, backup_volume);
+
+    if (status == AKU_SUCCESS) {
+        // Metadata goes last, backup without it can't be opened
+        apr_status = apr_file_copy(file_name, dest_metadata.c_str(), APR_FILE_SOURCE_PERMS, mempool);
+        if (apr_status != APR_SUCCESS) {
+            std::stringstream fmt;
+            fmt << "Can't copy metadata file " << file_name << ": " << apr_error_message(apr_status);
+            (*logger)(AKU_LOG_ERROR, fmt.str().c_str());
+            status = AKU_EGENERAL;
+        }
+    }
+    if (status == AKU_SUCCESS) {
+        try {
+            MetadataStorage metadata(dest_metadata.c_str(), logger);
+            metadata.set_volumes(dest_volumes);
+        } catch (std::exception const& err) {
+            (*logger)(AKU_LOG_ERROR, err.what());
+            status = AKU_EGENERAL;
+        }
+    }
+
+    if (rcv_stats) {
+        memset(rcv_stats, 0, sizeof(aku_MaintenanceStats));
+        for (auto const& vstats: stats) {
+            add_maintenance_stats(rcv_stats, vstats);
+        }
+    }
+    return status;
+}
+
 }
@@ -26,10 +26,15 @@
 #include <queue>
 #include <list>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <atomic>
 #include <thread>
 #include <memory>
 #include <mutex>
+#include <deque>
+#include <chrono>
+#include <condition_variable>
 
 // APR headers
 #include <apr_dbd.h>
@@ -40,6 +45,8 @@
 #include "util.h"
 #include "sequencer.h"
 #include "cursor.h"
+#include "seriesparser.h"
+#include "metrics.h"
 #include "akumuli_def.h"
 
 namespace Akumuli {
@@ -60,12 +67,16 @@ struct AprHandleDeleter {
   * - Volumes list
   * - Conviguration data
   * - Key to id mapping
+  * Database is opened in WAL mode with synchronous=NORMAL, commit doesn't
+  * wait for fsync of the main database file. Series names are inserted and
+  * loaded using prepared statements.
   */
 struct MetadataStorage {
     // Typedefs
     typedef std::unique_ptr<apr_pool_t, decltype(&delete_apr_pool)>         PoolT;
     typedef const apr_dbd_driver_t*                                         DriverT;
     typedef std::unique_ptr<apr_dbd_t, AprHandleDeleter>                    HandleT;
+    typedef apr_dbd_prepared_t*                                             PreparedT;
     typedef std::pair<int, std::string>                                     VolumeDesc;
 
     // Members
@@ -73,6 +84,10 @@ struct MetadataStorage {
     DriverT driver_;
     HandleT handle_;
     aku_logger_cb_t logger_;
+    std::unique_ptr<std::mutex> tx_mutex_;  //< Transactions can't be interleaved (pointer keeps storage movable)
+    PoolT stmt_pool_;          //< Prepared statements (finalized before the connection is closed)
+    PreparedT insert_series_;  //< Insert one series name
+    PreparedT select_series_;  //< Select all series names
 
     /** Create new or open existing db.
       * @throw std::runtime_error in a case of error
@@ -91,6 +106,11 @@ struct MetadataStorage {
       */
     void init_volumes(std::vector<VolumeDesc> volumes);
 
+    /** Replace volumes table content (e.g. volumes was moved)
+      * @throw std::runtime_error in a case of error
+      */
+    void set_volumes(std::vector<VolumeDesc> volumes);
+
     void init_config(uint32_t compression_threshold,
                      uint32_t max_cache_size,
                      uint64_t window_size, const char *creation_datetime);
@@ -106,7 +126,56 @@ struct MetadataStorage {
                      uint32_t *max_cache_size,
                      uint64_t *window_size, std::string *creation_datetime);
 
+    /** Move all transactions from the write-ahead log to the database file
+      * and truncate the log (file can be copied after that).
+      * @throw std::runtime_error in a case of error or if log is in use by other connection
+      */
+    void checkpoint_wal();
+
+    // Rollups //
+
+    /** Set list of rollup tiers. Tiers that are not in the list are removed
+      * together with their rollups.
+      * @return map from tier width to the timestamp of the first bucket of the tier
+      *         (AKU_MAX_TIMESTAMP if tier doesn't have any data yet)
+      */
+    std::map<aku_Duration, aku_TimeStamp> init_rollup_tiers(std::vector<aku_Duration> const& widths);
+
+    //! Set timestamp of the first bucket of the tier
+    void set_rollup_tier_begin(aku_Duration width, aku_TimeStamp begin);
+
+    //! Add partial results to the stored rollups of the tier (in one transaction)
+    void add_rollups(Aggregator const& rollups);
+
+    // Series names //
+
+    /** Insert new series names (in one transaction).
+      * Names should be in normal form.
+      * @throw std::runtime_error in a case of error
+      */
+    void insert_new_names(std::vector<SeriesMatcher::SeriesNameT> const& items);
+
+    /** Load all series names to matcher.
+      * @throw std::runtime_error in a case of error
+      */
+    void load_matcher_data(SeriesMatcher& matcher);
+
+    /** Read rollups of the tier.
+      * @param width width of the tier
+      * @param begin timestamp of the first bucket
+      * @param end timestamp of the bucket after the last one
+      * @param ids sorted list of param ids
+      * @param out destination
+      */
+    void get_rollups(aku_Duration width, aku_TimeStamp begin, aku_TimeStamp end,
+                     std::vector<aku_ParamId> const& ids, Aggregator* out) const;
+
 private:
+    /** Prepare statement, parameters are specified using apr_dbd format (`%s`, `%lld`, etc).
+      * @throw std::runtime_error in a case of error
+      */
+    PreparedT prepare(const char* query);
+
     /** Execute query that doesn't return anything.
       * @throw std::runtime_error in a case of error
       * @return number of rows changed
@@ -138,6 +207,8 @@ struct Volume : std::enable_shared_from_this<Volume>
     aku_logger_cb_t logger_;
     std::atomic_bool is_temporary_;  //< True if this is temporary volume and underlying file should be deleted
     const bool huge_tlb_;
+    uint32_t flushed_count_;         //< Number of page index entries flushed to disk
+    uint32_t flushed_offset_;        //< Offset of the last data element flushed to disk
 
     //! Create new volume stored in file
     Volume(const char           *file_path,
@@ -153,17 +224,342 @@ struct Volume : std::enable_shared_from_this<Volume>
     //! Reallocate space safely
     std::shared_ptr<Volume> safe_realloc();
 
+    /** Create empty replacement for this volume in a separate file.
+      * This volume stays intact and can be used until the replacement
+      * is installed using finish_realloc.
+      */
+    std::shared_ptr<Volume> prepare_realloc() const;
+
+    /** Replace this volume with the prepared one. Only files are renamed,
+      * this volume becomes temporary and lives until somebody reads it.
+      */
+    std::shared_ptr<Volume> finish_realloc(std::shared_ptr<Volume> standby);
+
     //! Open page for writing
     void open();
 
     //! Flush all data and close volume for write until reallocation
     void close();
 
-    //! Flush page
+    //! Flush data written since previous flush
     void flush();
 
+    //! Get number of bytes written since previous flush
+    size_t get_dirty_size() const;
+
+    /** Validate data written after the last flush and drop damaged tail.
+      * @returns number of removed entries
+      */
+    uint32_t recover();
+
+    /** Apply access pattern hint to used part of the page
+      * (header, page index and data), free space isn't affected.
+      */
+    void advise(MemAdvice advice) const;
+
     //! Search volume page (not cache)
     void search(Caller& caller, InternalCursor* cursor, SearchQuery query) const;
+
+    //! Aggregate double values of the volume page (not cache)
+    void aggregate(Caller& caller, InternalCursor* cursor, SearchQuery query, Aggregator* aggregator) const;
+
+    //! Get size of the mapping and its resident part (is_active isn't set)
+    void get_memory_stats(aku_VolumeMemoryStats* rcv_stats) const;
+};
+
+/** In-memory catalog of volume bounding boxes.
+  * Used by search to skip volumes that can't contain
+  * data of interest without creating cursors for them.
+  */
+struct VolumeCatalog {
+    std::vector<PageBoundingBox> boxes_;
+    mutable std::mutex           mutex_;
+
+    //! Set number of volumes (all bounding boxes become empty)
+    void resize(size_t nvolumes);
+
+    //! Update bounding box of the volume
+    void update(size_t index, PageBoundingBox const& bbox);
+
+    /** Find volumes that overlaps with the query.
+      * @param query search query
+      * @param out vector of volume indexes
+      */
+    void select(SearchQuery const& query, std::vector<size_t> *out) const;
+
+    //! Check if bounding box overlaps with the query
+    static bool overlaps(PageBoundingBox const& bbox, SearchQuery const& query);
+};
+
+/** Table of the last (most recent) double values of the series.
+  * Updated by the writers of the shard and used to answer "current value"
+  * queries without search. The table isn't persistent, values that are
+  * missing (e.g. after restart) are populated by search. Series that
+  * wasn't found by search are remembered as absent until the next write,
+  * so they're not searched again.
+  */
+struct LastValueTable {
+    enum {
+        MAX_ABSENT = 0x100000,  //< Absent series are forgotten if there are more of them
+    };
+    struct Value {
+        aku_TimeStamp timestamp;
+        double        value;
+    };
+    std::unordered_map<aku_ParamId, Value> values_;
+    std::unordered_set<aku_ParamId>        absent_;  //< Series without values
+    mutable std::mutex                     mutex_;
+
+    //! Update value of the series if it's not older than the stored one
+    void update(aku_ParamId param, aku_TimeStamp ts, double value);
+
+    /** Update values using batch of writes.
+      * @param statuses per-element statuses, failed elements are skipped
+      */
+    void update(TimeSeriesValue const* batch, size_t size, aku_Status const* statuses);
+
+    //! Get last value of the series, returns false if value isn't known
+    bool get(aku_ParamId param, Value* out) const;
+
+    //! Remember that series doesn't have values (ignored if the value is known)
+    void set_absent(aku_ParamId param);
+
+    //! Check if series is known to have no values
+    bool is_absent(aku_ParamId param) const;
+};
+
+/** Rollups of the double values computed at merge time.
+  * Each tier aggregates merged values with its own bucket width. Recently
+  * updated buckets are kept in memory and periodically added to the rollup
+  * table of the metadata storage. Rollups don't depend on volumes and are
+  * not lost when volume is reused. Tier covers only data that was merged
+  * after tier creation, buckets before `begin` can't be read from the tier.
+  */
+struct RollupStore {
+    typedef std::chrono::steady_clock Clock;
+    typedef std::shared_ptr<MetadataStorage> PMetadataStorage;
+
+    struct Tier {
+        aku_TimeStamp              begin;    //< First bucket of the tier
+        std::unique_ptr<Aggregator> pending; //< Buckets that wasn't saved yet
+    };
+
+    PMetadataStorage          metadata_;
+    std::vector<Tier>         tiers_;        //< Tiers sorted by width
+    Clock::time_point         last_save_;
+    mutable std::mutex        mutex_;
+
+    /** C-tor.
+      * @param metadata metadata storage
+      * @param widths bucket widths of the tiers
+      * @throw std::runtime_error in a case of metadata storage error
+      */
+    RollupStore(PMetadataStorage metadata, std::vector<aku_Duration> widths);
+
+    //! Add values of the merged chunk to all tiers
+    void add(ChunkHeader const& header);
+
+    //! Check if pending buckets should be saved
+    bool is_save_needed(Clock::time_point now) const;
+
+    //! Save pending buckets to metadata storage
+    void save();
+
+    /** Select tier that can be used to compute buckets of the width.
+      * @return index of the coarsest tier which width divides `width` or -1
+      */
+    int select_tier(aku_Duration width) const;
+
+    //! Get width and first bucket of the tier
+    std::pair<aku_Duration, aku_TimeStamp> get_tier(int tier) const;
+
+    /** Add rollups of the tier to aggregator.
+      * @param tier tier index
+      * @param begin first bucket (should be aligned to tier width)
+      * @param end bucket after the last one (should be aligned to tier width)
+      * @param ids sorted param ids
+      * @param out destination
+      */
+    void aggregate(int tier, aku_TimeStamp begin, aku_TimeStamp end,
+                   std::vector<aku_ParamId> const& ids, Aggregator* out) const;
+};
+
+/** Group commit scheduler.
+  * Writes are not flushed one by one. Dirty range of the volume is
+  * flushed when amount of unflushed data exceeds the limit or when
+  * oldest unflushed write becomes too old, all writes accumulated in
+  * between are made durable by one flush.
+  * Not thread safe, must be guarded by caller.
+  */
+struct FlushScheduler {
+    typedef std::chrono::steady_clock Clock;
+    typedef std::shared_ptr<Volume> PVolume;
+
+    const Clock::duration     max_latency_;   //< Max time between write and flush
+    const size_t              max_bytes_;     //< Max number of unflushed bytes (0 - unlimited)
+    PVolume                   volume_;        //< Volume with unflushed writes
+    size_t                    dirty_bytes_;   //< Number of unflushed bytes
+    Clock::time_point         oldest_write_;  //< Time of the oldest unflushed write
+    std::atomic<uint64_t>     durable_ts_;    //< All merged data not newer than that is durable
+    std::atomic<uint64_t>     n_flushes_;
+    LatencyHistogram*         latency_;       //< Flush duration histogram (optional)
+
+    FlushScheduler(Clock::duration max_latency, size_t max_bytes);
+
+    /** Register write.
+      * @param volume volume that was written
+      * @param dirty_bytes number of unflushed bytes in volume
+      * @param now time of the write
+      */
+    void add(PVolume volume, size_t dirty_bytes, Clock::time_point now);
+
+    //! Returns true if there is unflushed writes
+    bool has_pending() const;
+
+    //! Time when pending writes must be flushed
+    Clock::time_point deadline() const;
+
+    //! Returns true if pending writes should be flushed
+    bool is_ready(Clock::time_point now) const;
+
+    //! Flush pending writes
+    void flush();
+
+    /** Forget pending writes (volume was flushed by other means)
+      * @param durable_ts max timestamp of the flushed data
+      */
+    void discard(aku_TimeStamp durable_ts);
+
+private:
+    void set_durable_(aku_TimeStamp ts);
+};
+
+struct Storage;
+
+/** Storage shard.
+  * Volumes are split between shards, each shard has its own active
+  * volume (with sequencer), merger thread and group commit scheduler,
+  * volumes of the shard are reused in round robin manner. Writes to
+  * different shards doesn't contend with each other.
+  */
+struct StorageShard
+{
+    typedef std::shared_ptr<Volume> PVolume;
+    typedef std::chrono::steady_clock Clock;
+
+    //! Handoff from writer to merger thread
+    struct MergeRequest {
+        PVolume           volume;         //< Volume with ready to merge sequencer
+        int               merge_lock;     //< Sequence number returned by Sequencer::add
+        Clock::time_point timestamp;      //< Time of the handoff
+    };
+
+    Storage&                  storage_;                   //< Owner
+    const std::vector<size_t> volume_ixs_;                //< Indexes of the shard's volumes in Storage::volumes_
+
+    // Active volume state
+    PVolume                   active_volume_;
+    PageHeader*               active_page_;
+    std::atomic<int>          active_volume_index_;       //< Round robin counter
+    std::mutex                write_mutex_;               //< Serializes writers of the shard
+
+    // Background merge
+    std::mutex                page_mutex_;                //< Serializes page writes of writer and merger
+    FlushScheduler            flusher_;                   //< Group commit scheduler (guarded by page_mutex_)
+    std::deque<MergeRequest>  merge_queue_;               //< Pending merge requests (front is in progress)
+    std::mutex                merge_mutex_;
+    std::condition_variable   merge_cvar_;
+    bool                      merge_stop_;
+    std::atomic<int>          merge_error_;               //< Status of the failed merge, returned to writers until volume is switched
+    std::thread               merger_;
+
+    // Standby volume
+    PVolume                   standby_;                   //< Prepared replacement for the next volume in round robin
+    PVolume                   standby_source_;            //< Volume that will be replaced by standby_
+    std::thread               standby_thread_;            //< Background task that prepares standby_
+
+    // NUMA placement
+    std::atomic<int>          ingest_node_;               //< NUMA node of the last writer (numa_policy only)
+
+    LastValueTable            last_values_;               //< Last values of the shard's series
+
+    /** Shard c-tor.
+      * @param storage owner of the volumes
+      * @param volume_ixs indexes of the volumes that belongs to shard
+      */
+    StorageShard(Storage& storage, std::vector<size_t> volume_ixs, aku_FineTuneParams const& params);
+
+    //! D-tor, waits for background merge completion
+    ~StorageShard();
+
+    //! Select active volume, prepare standby and start merger thread
+    void start();
+
+    //! Select page that was active last time
+    void select_active_page();
+
+    /** Recover active page after crash. Chunks written after the last
+      * flush are validated, page is truncated at the first damaged chunk.
+      */
+    void recover_active_page();
+
+    //! Get index of the active volume in Storage::volumes_
+    size_t get_volume_index() const;
+
+    // Writing
+
+    /** Switch volume in round robin manner
+      * @param ix current volume index
+      */
+    void advance_volume_(int ix);
+
+    //! Copy bounding box of the active volume to catalog
+    void update_catalog_();
+
+    //! Start preparing replacement for the volume that goes after the active one
+    void prepare_standby_();
+
+    //! Replace the volume with prepared standby (or reallocate it if standby isn't prepared)
+    PVolume take_standby_(PVolume volume);
+
+    //! Pass volume to merger thread
+    void schedule_merge_(PVolume volume, int merge_lock);
+
+    //! Wait until all scheduled merges are completed
+    void wait_for_merge_();
+
+    //! Merger thread main loop
+    void merge_worker_();
+
+    /** Merge and compress sequencer data of the volume, flush volume if needed.
+      * On failure error status is saved to merge_error_.
+      */
+    void merge_(MergeRequest const& request);
+
+    //! Merge and compress sequencer data of the volume to its page, update rollups
+    aku_Status merge_and_compress_(Volume& volume);
+
+    //! Write value (and blob data) to the active volume
+    aku_Status write(TimeSeriesValue &value, aku_MemRange data);
+
+    /** Write batch of values sorted by timestamp and param id.
+      * @param statuses array of per-element statuses, filled only on error
+      * @returns error code of the first failed element or AKU_SUCCESS
+      */
+    aku_Status write_sorted(TimeSeriesValue const* batch, size_t size, aku_Status* statuses);
+
+    aku_Status _write_impl(TimeSeriesValue &value, aku_MemRange data);
+
+    //! Add shard's stats to rcv_stats
+    void get_stats(aku_StorageStats* rcv_stats);
+
+    //! Add shard's gauges to rcv_metrics
+    void get_metrics(aku_Metrics* rcv_metrics);
+
+    /** Add memory usage of the shard's volumes and sequencers to rcv_stats.
+      * Volume stats are written to `volumes` by volume index (if index < volumes_size).
+      */
+    void get_memory_stats(aku_MemoryStats* rcv_stats, aku_VolumeMemoryStats* volumes, size_t volumes_size);
 };
 
 /** Interface to page manager
@@ -173,16 +569,14 @@ struct Storage
     typedef std::mutex      LockType;
     typedef std::shared_ptr<Volume> PVolume;
     typedef std::shared_ptr<MetadataStorage> PMetadataStorage;
+    typedef std::chrono::steady_clock Clock;
 
-    // Active volume state
     aku_Config                config_;
-    PVolume                   active_volume_;
-    PageHeader*               active_page_;
-    std::atomic<int>          active_volume_index_;
     aku_Duration              ttl_;                       //< Late write limit
     bool                      compression;                //< Compression enabled
     aku_Status                open_error_code_;           //< Open op-n error code
     std::vector<PVolume>      volumes_;                   //< List of all volumes
+    VolumeCatalog             catalog_;                   //< Volume bounding boxes
     PMetadataStorage          metadata_;                  //< Metadata storage
 
     LockType                  mutex_;                     //< Storage lock (used by worker thread)
@@ -192,17 +586,24 @@ struct Storage
     Rand                      rand_;
     const uint32_t            durability_;                //< Copy of the durability parameter
     const bool                huge_tlb_;                  //< Copy of enable_huge_tlb parameter
+    const uint32_t            open_threads_;              //< Copy of open_threads parameter
+    const bool                numa_;                      //< Copy of numa_policy parameter
+    const size_t              readahead_;                 //< Readahead distance for page scans
+    std::unique_ptr<CursorWorkerPool> search_pool_;       //< Worker pool for parallel search (optional)
+    std::unique_ptr<RollupStore> rollups_;                //< Rollup tiers (optional)
+    std::vector<std::unique_ptr<StorageShard>> shards_;   //< Write side of the storage, param ids routed by hash
+    SeriesMatcher             matcher_;                   //< Series name to param id mapping
+    std::mutex                series_mutex_;              //< Guards unsaved_series_
+    std::vector<SeriesMatcher::SeriesNameT> unsaved_series_;  //< New series names that wasn't saved yet
+    mutable Metrics           metrics_;                   //< Latency histograms and counters
 
     /** Storage c-tor.
       * @param file_name path to metadata file
       */
     Storage(const char *path, aku_FineTuneParams const& conf);
 
-    //! Select page that was active last time
-    void select_active_page();
-
-    //! Prepopulate cache
-    void prepopulate_cache(int64_t max_cache_size);
+    //! D-tor, waits for background merge completion
+    ~Storage();
 
     void log_message(const char* message);
 
@@ -210,12 +611,46 @@ struct Storage
 
     void log_message(const char* message, uint64_t value);
 
-    // Writing
+    //! Log duration of the startup phase and reset phase start time
+    void log_open_phase_(const char* phase, Clock::time_point* start);
 
-    /** Switch volume in round robin manner
-      * @param ix current volume index
+    /** Map all volumes (in parallel if open_threads != 0).
+      * @param paths paths of the volumes
       */
-    void advance_volume_(int ix);
+    void map_volumes_(std::vector<std::string> const& paths);
+
+    //! Apply madvise hints, active and most recent volumes are needed first
+    void advise_volumes_();
+
+    /** Get number of shards that can be used with nvolumes volumes.
+      * Each shard gets at least one volume, volume `i` belongs to shard `i % nshards`.
+      */
+    static uint32_t get_num_shards(uint32_t requested, size_t nvolumes);
+
+    //! Get index of the shard that stores param
+    uint32_t get_shard_index(aku_ParamId param) const;
+
+    // Series names
+
+    /** Convert series name to param id.
+      * Name is converted to normal form first, new series gets new id.
+      * New names are saved to metadata storage in batches by save_series_names.
+      */
+    aku_Status series_to_param_id(const char* begin, const char* end, aku_ParamId* out_id);
+
+    /** Find param ids of the series that match tag expression.
+      * Expression consists of key=value tags combined with AND, OR and parentheses,
+      * e.g. "metric=cpu AND (host=web* OR host=db01)". Metric name is matched by `metric` key.
+      * @returns AKU_SUCCESS or AKU_EBAD_DATA if expression is malformed
+      */
+    aku_Status select_series(const char* expression, std::vector<aku_ParamId>* out) const;
+
+    /** Save new series names to metadata storage.
+      * Called before merged data is flushed, this way data can't refer to unknown series.
+      */
+    void save_series_names();
+
+    // Writing
 
     //! Write binary data.
     aku_Status write_blob(aku_ParamId param, aku_TimeStamp ts, aku_MemRange data);
@@ -223,13 +658,49 @@ struct Storage
     //! Write double.
     aku_Status write_double(aku_ParamId param, aku_TimeStamp ts, double value);
 
-    aku_Status _write_impl(TimeSeriesValue &value, aku_MemRange data);
+    //! Write 64-bit integer.
+    aku_Status write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t value);
+
+    /** Write batch of doubles.
+      * @param statuses optional array of per-element statuses, filled only on error
+      * @returns error code of the first failed element (in input order) or AKU_SUCCESS
+      */
+    aku_Status write_batch(const aku_ParamId* params, const aku_TimeStamp* timestamps,
+                           const double* values, size_t size, aku_Status* statuses);
 
     // Reading
 
+    /** Create cursor that reads query results directly from the volumes
+      * and sequencers (without intermediate copying).
+      * Cursor must be closed by the caller.
+      */
+    std::unique_ptr<ExternalCursor> make_cursor(SearchQuery const& query) const;
+
     //! Search storage using cursor
     void search(Caller &caller, InternalCursor *cur, SearchQuery const& query) const;
 
+    /** Get last double values of the series.
+      * Values are taken from the shard's last value tables, series that
+      * are not present there are searched in backward direction. Series
+      * that wasn't found are not searched again until they're written.
+      * @param params array of param ids
+      * @param size size of the arrays
+      * @param out_ts output array of timestamps (AKU_MIN_TIMESTAMP if param not found)
+      * @param out_values output array of values (NaN if param not found)
+      * @returns AKU_SUCCESS, AKU_ENOT_FOUND if some params wasn't found or search error code
+      */
+    aku_Status get_last_values(const aku_ParamId* params, size_t size,
+                               aku_TimeStamp* out_ts, double* out_values) const;
+
+    /** Aggregate double values that match the query.
+      * Volumes pages and sequencers are aggregated in place, only
+      * aggregated values are returned.
+      * @param query search query
+      * @param aggregator destination
+      * @returns AKU_SUCCESS or error code
+      */
+    aku_Status aggregate(SearchQuery const& query, Aggregator* aggregator) const;
+
     // Static interface
 
     /** Create new storage and initialize it.
@@ -253,9 +724,29 @@ struct Storage
       */
     static apr_status_t remove_storage(const char* file_name, aku_logger_cb_t logger);
 
+    //! Export time range of the volumes to columnar file (see aku_export_columns)
+    static aku_Status export_columns(const char* file_name, const char* out_path,
+                                     aku_TimeStamp begin, aku_TimeStamp end,
+                                     std::vector<aku_ParamId> ids, uint32_t nthreads,
+                                     aku_logger_cb_t logger, aku_MaintenanceStats* rcv_stats);
+
+    //! Re-sort and re-encode chunks of the volumes (see aku_compact_database)
+    static aku_Status compact_storage(const char* file_name, uint32_t codec_policy, uint32_t nthreads,
+                                      aku_logger_cb_t logger, aku_MaintenanceStats* rcv_stats);
+
+    //! Copy metadata and used parts of the volumes (see aku_backup_database)
+    static aku_Status backup_storage(const char* file_name, const char* dest_path, uint32_t nthreads,
+                                     aku_logger_cb_t logger, aku_MaintenanceStats* rcv_stats);
+
     // Stats
     void get_stats(aku_StorageStats* rcv_stats);
 
+    //! Get hot path metrics
+    void get_metrics(aku_Metrics* rcv_metrics, bool reset);
+
+    //! Get memory usage (see aku_get_memory_stats)
+    void get_memory_stats(aku_MemoryStats* rcv_stats, aku_VolumeMemoryStats* volumes, size_t volumes_size);
+
     aku_Status get_open_error() const;
 };
 
@@ -4,6 +4,7 @@
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <vector>
+#include <algorithm>
 
 #include "compression.h"
 
@@ -164,3 +165,492 @@ BOOST_AUTO_TEST_CASE(Test_doubles_compression_2_series) {
     };
     test_doubles_compression(input, params);
 }
+
+BOOST_AUTO_TEST_CASE(Test_chunk_cache_lru) {
+    auto make_chunk = [](int n) {
+        auto chunk = std::make_shared<ChunkHeader>();
+        for (int i = 0; i < n; i++) {
+            chunk->timestamps.push_back(i);
+            chunk->paramids.push_back(i);
+        }
+        return chunk;
+    };
+    auto chunk_size = ChunkCache::estimate_size(*make_chunk(100));
+
+    // Cache can hold only two chunks
+    ChunkCache cache(2*chunk_size);
+    ChunkCache::Key k0 = { 0u, 1u, 0u },
+                    k1 = { 0u, 1u, 100u },
+                    k2 = { 1u, 1u, 0u };
+    cache.put(k0, 42u, make_chunk(100));
+    cache.put(k1, 43u, make_chunk(100));
+    BOOST_REQUIRE(cache.get(k0, 42u));   // k1 is least recently used now
+    cache.put(k2, 44u, make_chunk(100));
+
+    BOOST_REQUIRE(cache.get(k0, 42u));
+    BOOST_REQUIRE(!cache.get(k1, 43u));
+    BOOST_REQUIRE(cache.get(k2, 44u));
+
+    // Checksum mismatch is a miss
+    BOOST_REQUIRE(!cache.get(k2, 45u));
+
+    uint64_t n_hits, n_misses;
+    cache.get_stats(&n_hits, &n_misses, true);
+    BOOST_REQUIRE_EQUAL(n_hits, 3u);
+    BOOST_REQUIRE_EQUAL(n_misses, 2u);
+
+    uint64_t size, capacity, nitems;
+    cache.get_usage(&size, &capacity, &nitems);
+    BOOST_REQUIRE_EQUAL(size, 2*chunk_size);
+    BOOST_REQUIRE_EQUAL(capacity, 2*chunk_size);
+    BOOST_REQUIRE_EQUAL(nitems, 2u);
+
+    cache.set_capacity(0u);
+    BOOST_REQUIRE(!cache.get(k0, 42u));
+    cache.put(k0, 42u, make_chunk(100));
+    BOOST_REQUIRE(!cache.get(k0, 42u));
+}
+
+BOOST_AUTO_TEST_CASE(Test_param_id_filter) {
+    ByteVector filter;
+
+    // Single id or dense range of ids doesn't need filter
+    ParamIdFilter::build({ 42, 42, 42 }, &filter);
+    BOOST_REQUIRE(filter.empty());
+    ParamIdFilter::build({ 3, 1, 2, 0, 1, 2 }, &filter);
+    BOOST_REQUIRE(filter.empty());
+
+    // Sparse ids
+    std::vector<aku_ParamId> ids;
+    for (aku_ParamId i = 0; i < 1000; i++) {
+        ids.push_back(i*1000003ul);
+    }
+    ParamIdFilter::build(ids, &filter);
+    BOOST_REQUIRE(!filter.empty());
+    BOOST_REQUIRE(filter.size() <= ParamIdFilter::MAX_SIZE);
+    int nfalse_positives = 0;
+    for (auto id: ids) {
+        BOOST_REQUIRE(ParamIdFilter::may_contain(filter.data(), filter.size(), id));
+        if (ParamIdFilter::may_contain(filter.data(), filter.size(), id + 1)) {
+            nfalse_positives++;
+        }
+    }
+    BOOST_REQUIRE(nfalse_positives < 100);
+}
+
+BOOST_AUTO_TEST_CASE(Test_stream_vbyte) {
+    std::vector<uint64_t> input;
+    for (int i = 0; i < 1000; i++) {
+        // Values of all sizes
+        input.push_back(EXPECTED[i % EXPECTED_SIZE] << (8*(i % 5)));
+    }
+    ByteVector data;
+    StreamVByte::encode(input.data(), input.size(), &data);
+
+    std::vector<uint64_t> scalar(input.size());
+    auto end = StreamVByte::decode_scalar(data.data(), data.data() + data.size(), input.size(), scalar.data());
+    BOOST_REQUIRE(end == data.data() + data.size());
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(input.begin(), input.end(), scalar.begin(), scalar.end());
+
+    // Decode from the middle of the larger buffer, odd number of values
+    for (size_t n: { 1ul, 7ul, 999ul }) {
+        ByteVector buffer;
+        StreamVByte::encode(input.data(), n, &buffer);
+        auto size = buffer.size();
+        buffer.resize(size + 100, 0xFF);
+        std::vector<uint64_t> output(n);
+        end = StreamVByte::decode(buffer.data(), buffer.data() + buffer.size(), n, output.data());
+        BOOST_REQUIRE(end == buffer.data() + size);
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(input.begin(), input.begin() + n, output.begin(), output.end());
+    }
+
+    // Truncated data
+    std::vector<uint64_t> output(input.size());
+    end = StreamVByte::decode(data.data(), data.data() + data.size() - 1, input.size(), output.data());
+    BOOST_REQUIRE(end == nullptr);
+}
+
+struct ChunkBuffer : ChunkWriter {
+    ByteVector data;
+
+    virtual aku_Status add_chunk(aku_MemRange range, size_t) {
+        // Parts are written in reverse order (like in page)
+        auto begin = static_cast<const unsigned char*>(range.address);
+        data.insert(data.begin(), begin, begin + range.length);
+        return AKU_SUCCESS;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(Test_chunk_encodings) {
+    ChunkHeader header;
+    for (int i = 0; i < 1000; i++) {
+        header.timestamps.push_back(1000000000ul + i/3);
+        header.paramids.push_back(i % 3 == 0 ? 1ul << 40 : i % 3);
+        header.offsets.push_back(0u);
+        header.lengths.push_back(0u);
+        header.values.push_back(i*0.5);
+    }
+    std::vector<uint32_t> encodings;
+    for (uint32_t ts = 0u; ts < AKU_TS_NCODECS; ts++) {
+        for (uint32_t ids = 0u; ids < AKU_IDS_NCODECS; ids++) {
+            for (uint32_t values = 0u; values < AKU_VALUES_NCODECS; values++) {
+                encodings.push_back(ts << AKU_CHUNK_TS_SHIFT
+                                  | ids << AKU_CHUNK_IDS_SHIFT
+                                  | values << AKU_CHUNK_VALUES_SHIFT);
+            }
+        }
+    }
+    for (auto encoding: encodings) {
+        ChunkBuffer buffer;
+        uint32_t n_elements;
+        aku_TimeStamp ts_begin, ts_end;
+        auto status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &buffer, header, encoding);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(n_elements, 1000u);
+
+        ChunkHeader decoded;
+        const unsigned char* pbegin = buffer.data.data();
+        CompressionUtil::decode_chunk(&decoded, &pbegin, buffer.data.data() + buffer.data.size(),
+                                      0, 5, n_elements, encoding);
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(header.timestamps.begin(), header.timestamps.end(),
+                                        decoded.timestamps.begin(), decoded.timestamps.end());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(header.paramids.begin(), header.paramids.end(),
+                                        decoded.paramids.begin(), decoded.paramids.end());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(header.values.begin(), header.values.end(),
+                                        decoded.values.begin(), decoded.values.end());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_chunk_integers) {
+    // Counters (integers) mixed with doubles and blobs
+    ChunkHeader header;
+    for (int i = 0; i < 1000; i++) {
+        header.timestamps.push_back(1000000000ul + i);
+        header.paramids.push_back(i % 4);
+        switch (i % 4) {
+        case 0:
+            header.offsets.push_back(0u);
+            header.lengths.push_back(0u);
+            header.values.push_back(i*0.5);
+            break;
+        case 1:
+            header.offsets.push_back(100u + i);
+            header.lengths.push_back(10u);
+            break;
+        case 2:
+            header.offsets.push_back(0u);
+            header.lengths.push_back(AKU_LENGTH_INT64);
+            header.integers.push_back((1l << 60) + i*100);  // can't be represented by double
+            break;
+        case 3:
+            header.offsets.push_back(0u);
+            header.lengths.push_back(AKU_LENGTH_INT64);
+            header.integers.push_back(i % 8 == 3 ? INT64_MIN : INT64_MAX);
+            break;
+        }
+    }
+    for (uint32_t encoding: { 0u, 0x100u, 0x12u }) {
+        ChunkBuffer buffer;
+        uint32_t n_elements;
+        aku_TimeStamp ts_begin, ts_end;
+        auto status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &buffer, header, encoding);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+        ChunkHeader decoded;
+        const unsigned char* pbegin = buffer.data.data();
+        const unsigned char* pend = buffer.data.data() + buffer.data.size();
+        auto stage = CompressionUtil::decode_chunk(&decoded, &pbegin, pend, 0, 6, n_elements, encoding);
+        BOOST_REQUIRE_EQUAL(stage, 6);
+        BOOST_REQUIRE(pbegin == pend);
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(header.lengths.begin(), header.lengths.end(),
+                                        decoded.lengths.begin(), decoded.lengths.end());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(header.offsets.begin(), header.offsets.end(),
+                                        decoded.offsets.begin(), decoded.offsets.end());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(header.values.begin(), header.values.end(),
+                                        decoded.values.begin(), decoded.values.end());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(header.integers.begin(), header.integers.end(),
+                                        decoded.integers.begin(), decoded.integers.end());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_integers_compression) {
+    // Monotonic counter is stored using one byte per value
+    std::vector<int64_t> input;
+    std::vector<aku_ParamId> params;
+    for (int64_t i = 0; i < 1000; i++) {
+        input.push_back(1000000000l + i*10);
+        params.push_back(42u);
+    }
+    ByteVector buffer;
+    auto size = CompressionUtil::compress_integers(input, params, &buffer);
+    BOOST_REQUIRE_EQUAL(size, buffer.size());
+    BOOST_REQUIRE(size < input.size() + 10);
+
+    std::vector<int64_t> output;
+    auto end = CompressionUtil::decompress_integers(buffer.data(), buffer.data() + buffer.size(), params, &output);
+    BOOST_REQUIRE(end == buffer.data() + buffer.size());
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(input.begin(), input.end(), output.begin(), output.end());
+
+    // Truncated data
+    output.clear();
+    end = CompressionUtil::decompress_integers(buffer.data(), buffer.data() + buffer.size() - 1, params, &output);
+    BOOST_REQUIRE(end == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(Test_chunk_encoding_in_place) {
+    ChunkHeader header;
+    for (int i = 0; i < 1000; i++) {
+        header.timestamps.push_back(1000000000ul + i*10 + i % 7);
+        header.paramids.push_back(i % 5);
+        header.offsets.push_back(0u);
+        header.lengths.push_back(0u);
+        header.values.push_back(i*0.25);
+    }
+    for (uint32_t encoding: { 0u, 0x111u, 0x12u }) {
+        ChunkBuffer expected;
+        uint32_t n_elements;
+        aku_TimeStamp ts_begin, ts_end;
+        auto status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &expected, header, encoding);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+        // Same data is written directly to memory region
+        const size_t GUARD = 0x10;
+        ByteVector memory(CompressionUtil::max_encoded_size(header.timestamps.size()) + GUARD, 0xAA);
+        MemBuffer buffer(memory.data(), memory.size() - GUARD);
+        status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &buffer, header, encoding);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(n_elements, 1000u);
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(expected.data.begin(), expected.data.end(),
+                                        buffer.data(), buffer.end());
+
+        // Region is too small
+        std::fill(memory.begin(), memory.end(), 0xAA);
+        MemBuffer small(memory.data(), expected.data.size() - 1);
+        status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &small, header, encoding);
+        BOOST_REQUIRE_EQUAL(status, AKU_EOVERFLOW);
+        for (size_t i = expected.data.size() - 1; i < memory.size(); i++) {
+            BOOST_REQUIRE_EQUAL(memory[i], 0xAA);
+        }
+    }
+}
+
+void test_doubles_gorilla(std::vector<double> input, std::vector<aku_ParamId> params) {
+    ByteVector buffer;
+    size_t nbits = CompressionUtil::compress_doubles_gorilla(input, params, &buffer);
+    BOOST_REQUIRE_EQUAL(buffer.size(), (nbits + 7)/8);
+    std::vector<double> output;
+    BOOST_REQUIRE(CompressionUtil::decompress_doubles_gorilla(buffer.data(), nbits, params, &output));
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(input.begin(), input.end(), output.begin(), output.end());
+
+    // Truncated data
+    if (nbits > 1) {
+        output.clear();
+        BOOST_REQUIRE(!CompressionUtil::decompress_doubles_gorilla(buffer.data(), nbits - 1, params, &output));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_doubles_gorilla_1_series) {
+    std::vector<double> input;
+    std::vector<aku_ParamId> params;
+    for (int i = 0; i < 1000; i++) {
+        input.push_back(i % 10 == 0 ? 1.0/i : 42.0 + (i/100)*0.25);
+        params.push_back(42u);
+    }
+    test_doubles_gorilla(input, params);
+}
+
+BOOST_AUTO_TEST_CASE(Test_doubles_gorilla_interleaved_series) {
+    // Slowly changing gauges, values of different series are interleaved
+    std::vector<double> input;
+    std::vector<aku_ParamId> params;
+    for (int i = 0; i < 3000; i++) {
+        auto id = static_cast<aku_ParamId>(i % 3);
+        input.push_back(100.0*id + (i/300)*0.5);
+        params.push_back(id);
+    }
+    test_doubles_gorilla(input, params);
+
+    ByteVector gorilla;
+    size_t nbits = CompressionUtil::compress_doubles_gorilla(input, params, &gorilla);
+    ByteVector nibbles;
+    CompressionUtil::compress_doubles(input, params, &nibbles);
+    BOOST_REQUIRE_LT(gorilla.size(), nibbles.size());
+    BOOST_REQUIRE_LT(nbits, input.size()*2);  // less than two bits per value
+}
+
+BOOST_AUTO_TEST_CASE(Test_delta_delta_timestamps) {
+    std::vector<aku_TimeStamp> input;
+    aku_TimeStamp ts = 1000000000000ul;
+    for (int i = 0; i < 1000; i++) {
+        // Regular interval with jitter and few large gaps
+        ts += 1000u + (i % 100 == 0 ? 5u : 0u) + (i % 333 == 0 ? 1ul << 40 : 0u);
+        input.push_back(ts);
+    }
+    for (size_t n: { 0ul, 1ul, 2ul, 3ul, 130ul, 1000ul }) {
+        ByteVector data;
+        DeltaDeltaCodec::encode(input.data(), n, &data);
+        std::vector<aku_TimeStamp> output(n);
+        auto end = DeltaDeltaCodec::decode(data.data(), data.data() + data.size(), n, output.data());
+        BOOST_REQUIRE(end == data.data() + data.size());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(input.begin(), input.begin() + n, output.begin(), output.end());
+        if (n > 2) {
+            // Truncated data
+            end = DeltaDeltaCodec::decode(data.data(), data.data() + data.size() - 1, n, output.data());
+            BOOST_REQUIRE(end == nullptr);
+        }
+    }
+
+    // Perfectly regular series needs few bytes per block
+    std::vector<aku_TimeStamp> regular;
+    for (int i = 0; i < 1000; i++) {
+        regular.push_back(1000000000000ul + i*60000u);
+    }
+    ByteVector data;
+    DeltaDeltaCodec::encode(regular.data(), regular.size(), &data);
+    BOOST_REQUIRE_LT(data.size(), 40u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_codec_selection) {
+    // Regular timestamps with jitter and slowly changing values of the single series
+    ChunkHeader header;
+    for (int i = 0; i < 10000; i++) {
+        header.timestamps.push_back(1000000000ul + i*1000 + i % 3);
+        header.paramids.push_back(42u);
+        header.offsets.push_back(0u);
+        header.lengths.push_back(0u);
+        header.values.push_back(100.0 + (i / 100));
+    }
+    BOOST_REQUIRE_EQUAL(CompressionUtil::select_encoding(header, AKU_CODEC_FIXED, AKU_CHUNK_STREAMVBYTE),
+                        static_cast<uint32_t>(AKU_CHUNK_STREAMVBYTE));
+
+    auto encoding = CompressionUtil::select_encoding(header, AKU_CODEC_SMALLEST, 0u);
+    BOOST_REQUIRE_EQUAL((encoding >> AKU_CHUNK_TS_SHIFT) & AKU_CHUNK_CODEC_MASK, AKU_TS_DELTA_DELTA);
+    BOOST_REQUIRE_EQUAL((encoding >> AKU_CHUNK_VALUES_SHIFT) & AKU_CHUNK_CODEC_MASK, AKU_VALUES_GORILLA);
+
+    encoding = CompressionUtil::select_encoding(header, AKU_CODEC_FASTEST, 0u);
+    BOOST_REQUIRE_EQUAL((encoding >> AKU_CHUNK_TS_SHIFT) & AKU_CHUNK_CODEC_MASK, AKU_TS_DELTA_DELTA);
+    BOOST_REQUIRE_EQUAL((encoding >> AKU_CHUNK_IDS_SHIFT) & AKU_CHUNK_CODEC_MASK, AKU_IDS_STREAMVBYTE);
+
+    // Selected encoding should be decodable and counted in stats
+    aku_CompressionStats stats;
+    CompressionUtil::get_stats(&stats, true);
+    ChunkBuffer buffer;
+    uint32_t n_elements;
+    aku_TimeStamp ts_begin, ts_end;
+    auto status = CompressionUtil::encode_chunk(&n_elements, &ts_begin, &ts_end, &buffer, header, encoding);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+    CompressionUtil::get_stats(&stats, false);
+    BOOST_REQUIRE_EQUAL(stats.n_chunks, 1u);
+    BOOST_REQUIRE_EQUAL(stats.n_elements, 10000u);
+    BOOST_REQUIRE_EQUAL(stats.codecs.ts_delta_delta, 1u);
+    BOOST_REQUIRE_EQUAL(stats.codecs.ids_streamvbyte, 1u);
+    BOOST_REQUIRE_EQUAL(stats.codecs.ts_delta_rle + stats.codecs.ts_streamvbyte, 0u);
+    BOOST_REQUIRE_EQUAL(stats.bytes.timestamps + stats.bytes.paramids + stats.bytes.lengths
+                        + stats.bytes.offsets + stats.bytes.values, buffer.data.size());
+
+    ChunkHeader decoded;
+    const unsigned char* pbegin = buffer.data.data();
+    CompressionUtil::decode_chunk(&decoded, &pbegin, buffer.data.data() + buffer.data.size(),
+                                  0, 5, n_elements, encoding);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(header.values.begin(), header.values.end(),
+                                    decoded.values.begin(), decoded.values.end());
+
+    CompressionUtil::get_stats(&stats, true);
+    CompressionUtil::get_stats(&stats, false);
+    BOOST_REQUIRE_EQUAL(stats.n_chunks, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_bulk_frame) {
+    std::vector<aku_Sample> samples;
+    for (int i = 0; i < 1000; i++) {
+        aku_Sample sample = {};
+        sample.paramid = 100u + i % 7;
+        // Timestamps of the batch aren't sorted
+        sample.timestamp = 1000000u + i*10 - (i % 3)*25;
+        sample.is_int = i % 5 == 0;
+        if (sample.is_int) {
+            sample.ivalue = -1000 + i;
+        } else {
+            sample.value = 0.5*i;
+        }
+        samples.push_back(sample);
+    }
+    std::vector<unsigned char> frame(CompressionUtil::max_bulk_size(samples.size()));
+    MemBuffer buffer(frame.data(), frame.size());
+    auto status = CompressionUtil::encode_bulk(samples.data(), samples.size(), &buffer);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE(buffer.size() < samples.size()*sizeof(aku_Sample)/4);
+
+    // Output array is too small
+    std::vector<aku_Sample> decoded(10);
+    size_t n = decoded.size();
+    status = CompressionUtil::decode_bulk(frame.data(), buffer.size(), decoded.data(), &n);
+    BOOST_REQUIRE_EQUAL(status, AKU_EOVERFLOW);
+    BOOST_REQUIRE_EQUAL(n, samples.size());
+
+    decoded.resize(n);
+    status = CompressionUtil::decode_bulk(frame.data(), buffer.size(), decoded.data(), &n);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(n, samples.size());
+
+    // Samples are sorted by timestamp, order of the samples with equal timestamps is preserved
+    std::stable_sort(samples.begin(), samples.end(), [](aku_Sample const& lhs, aku_Sample const& rhs) {
+        return lhs.timestamp < rhs.timestamp;
+    });
+    for (size_t i = 0; i < n; i++) {
+        BOOST_REQUIRE_EQUAL(decoded[i].paramid, samples[i].paramid);
+        BOOST_REQUIRE_EQUAL(decoded[i].timestamp, samples[i].timestamp);
+        BOOST_REQUIRE_EQUAL(decoded[i].is_int, samples[i].is_int);
+        if (samples[i].is_int) {
+            BOOST_REQUIRE_EQUAL(decoded[i].ivalue, samples[i].ivalue);
+        } else {
+            BOOST_REQUIRE_EQUAL(decoded[i].value, samples[i].value);
+        }
+    }
+
+    // Frame doesn't fit the buffer
+    MemBuffer small(frame.data(), 100u);
+    status = CompressionUtil::encode_bulk(samples.data(), samples.size(), &small);
+    BOOST_REQUIRE_EQUAL(status, AKU_EOVERFLOW);
+}
+
+BOOST_AUTO_TEST_CASE(Test_bulk_frame_damaged) {
+    std::vector<aku_Sample> samples;
+    for (int i = 0; i < 100; i++) {
+        aku_Sample sample = {};
+        sample.paramid = 42u + i % 3;
+        sample.timestamp = 1000u + i;
+        sample.is_int = i % 2;
+        sample.value = i*1.5;
+        sample.ivalue = i;
+        samples.push_back(sample);
+    }
+    std::vector<unsigned char> frame(CompressionUtil::max_bulk_size(samples.size()));
+    MemBuffer buffer(frame.data(), frame.size());
+    auto status = CompressionUtil::encode_bulk(samples.data(), samples.size(), &buffer);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    frame.resize(buffer.size());
+
+    std::vector<aku_Sample> decoded(samples.size());
+    size_t n = decoded.size();
+    // Truncated frame
+    for (size_t size = 0; size < frame.size(); size++) {
+        n = decoded.size();
+        status = CompressionUtil::decode_bulk(frame.data(), size, decoded.data(), &n);
+        BOOST_REQUIRE_EQUAL(status, AKU_EBAD_DATA);
+    }
+    // Corrupted compressed data (size in the header is valid) can't crash the decoder
+    for (size_t i = sizeof(BulkFrameHeader); i < frame.size(); i++) {
+        auto damaged = frame;
+        damaged[i] ^= 0xFF;
+        n = decoded.size();
+        CompressionUtil::decode_bulk(damaged.data(), damaged.size(), decoded.data(), &n);
+    }
+    // Bad magic
+    auto damaged = frame;
+    damaged[0] = 'X';
+    n = decoded.size();
+    BOOST_REQUIRE_EQUAL(CompressionUtil::decode_bulk(damaged.data(), damaged.size(), decoded.data(), &n),
+                        AKU_EBAD_DATA);
+}
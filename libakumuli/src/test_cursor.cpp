@@ -4,6 +4,7 @@
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <vector>
+#include <cstring>
 
 #include "cursor.h"
 #include "page.h"
@@ -119,6 +120,94 @@ BOOST_AUTO_TEST_CASE(Test_cursor_error_100_7)
     test_cursor_error(100, 7);
 }
 
+BOOST_AUTO_TEST_CASE(Test_stack_pool)
+{
+    const size_t STACK_SIZE = 0x10000;
+    CoroStackPool pool(2);
+    std::vector<void*> stacks;
+    for (int i = 0; i < 3; i++) {
+        auto stack = pool.allocate(STACK_SIZE);
+        // Whole usable region can be written
+        memset(stack, 0xAA, STACK_SIZE);
+        stacks.push_back(stack);
+    }
+    uint64_t n_hits, n_misses;
+    pool.get_stats(&n_hits, &n_misses);
+    BOOST_REQUIRE_EQUAL(n_hits, 0u);
+    BOOST_REQUIRE_EQUAL(n_misses, 3u);
+    for (auto stack: stacks) {
+        pool.deallocate(stack, STACK_SIZE);
+    }
+    // Only two stacks are pooled, stacks of other size are not reused
+    std::vector<void*> reused;
+    for (int i = 0; i < 3; i++) {
+        reused.push_back(pool.allocate(STACK_SIZE));
+    }
+    auto other = pool.allocate(STACK_SIZE*2);
+    pool.get_stats(&n_hits, &n_misses, true);
+    BOOST_REQUIRE_EQUAL(n_hits, 2u);
+    BOOST_REQUIRE_EQUAL(n_misses, 5u);
+    BOOST_REQUIRE(std::find(stacks.begin(), stacks.end(), reused[0]) != stacks.end());
+    BOOST_REQUIRE(std::find(stacks.begin(), stacks.end(), reused[1]) != stacks.end());
+    pool.deallocate(other, STACK_SIZE*2);
+    for (auto stack: reused) {
+        pool.deallocate(stack, STACK_SIZE);
+    }
+    pool.get_stats(&n_hits, &n_misses);
+    BOOST_REQUIRE_EQUAL(n_hits, 0u);
+    BOOST_REQUIRE_EQUAL(n_misses, 0u);
+}
+
+template<int dir>
+void test_loser_tree(int k) {
+    std::vector<std::vector<int>> inputs(k);
+    std::vector<int> expected;
+    for (auto& input: inputs) {
+        int n = rand() % 100;  // some inputs are empty
+        for (int i = 0; i < n; i++) {
+            input.push_back(rand() % 1000);
+        }
+        std::sort(input.begin(), input.end());
+        if (dir == AKU_CURSOR_DIR_BACKWARD) {
+            std::reverse(input.begin(), input.end());
+        }
+        expected.insert(expected.end(), input.begin(), input.end());
+    }
+    std::sort(expected.begin(), expected.end());
+    if (dir == AKU_CURSOR_DIR_BACKWARD) {
+        std::reverse(expected.begin(), expected.end());
+    }
+
+    MergeOrder<std::less<int>, dir> order;
+    LoserTree<int> tree(k);
+    std::vector<size_t> pos(k, 0u);
+    for (int i = 0; i < k; i++) {
+        if (!inputs[i].empty()) {
+            tree.set(i, inputs[i][pos[i]++]);
+        }
+    }
+    tree.build(order);
+    std::vector<int> actual;
+    while (!tree.empty()) {
+        actual.push_back(tree.top());
+        auto ix = tree.winner();
+        if (pos[ix] < inputs[ix].size()) {
+            tree.replace_top(inputs[ix][pos[ix]++], order);
+        } else {
+            tree.pop_top(order);
+        }
+    }
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(Test_loser_tree)
+{
+    for (int k: { 0, 1, 2, 3, 7, 8, 33 }) {
+        test_loser_tree<AKU_CURSOR_DIR_FORWARD>(k);
+        test_loser_tree<AKU_CURSOR_DIR_BACKWARD>(k);
+    }
+}
+
 struct SortPred {
     uint32_t dir;
     bool operator () (int64_t lhs, int64_t rhs) {
@@ -325,3 +414,179 @@ BOOST_AUTO_TEST_CASE(Test_stackless_fan_in_cursor_4_b)
     test_fan_in_cursor<StacklessFanInCursorCombinator>(AKU_CURSOR_DIR_BACKWARD, 10, 100000 + sizeof(PageHeader));
 }
 
+
+void test_fan_in_cursor_limit(uint32_t dir, int n_cursors, int page_size, uint64_t limit) {
+    std::vector<PageWrapper> pages;
+    pages.reserve(n_cursors);
+    for (int i = 0; i < n_cursors; i++) {
+        pages.emplace_back(page_size, (uint32_t)i);
+    }
+
+    auto match_all = [](aku_ParamId) { return SearchQuery::MATCH; };
+    SearchQuery q(match_all, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, dir);
+    q.limit = limit;
+
+    std::vector<CoroCursor> cursors(n_cursors);
+    for (int i = 0; i < n_cursors; i++) {
+        PageHeader* page = pages[i].page;
+        CoroCursor* cursor = &cursors[i];
+        cursor->start(std::bind(&PageHeader::search, page, std::placeholders::_1, cursor, q));
+    }
+
+    std::vector<ExternalCursor*> ecur;
+    std::transform(cursors.begin(), cursors.end(),
+                   std::back_inserter(ecur),
+                   [](Cursor& c) { return &c; });
+
+    StacklessFanInCursorCombinator cursor(&ecur[0], n_cursors, (int)dir, limit);
+
+    CursorResult results[0x100];
+    std::vector<int64_t> actual_results;
+    while(!cursor.is_done()) {
+        int n_read = cursor.read(results, 0x100);
+        for (int i = 0; i < n_read; i++) {
+            actual_results.push_back(results[i].timestamp);
+        }
+    }
+    BOOST_REQUIRE(!cursor.is_error(nullptr));
+    for (auto in_cursor: ecur) {
+        BOOST_REQUIRE(in_cursor->is_done());
+    }
+    cursor.close();
+
+    std::vector<int64_t> expected_results;
+    for(auto& pagewrapper: pages) {
+        PageHeader* page = pagewrapper.page;
+        for (auto i = 0u; i < pagewrapper.count; i++) {
+            const aku_Entry* entry = page->read_entry_at(i);
+            expected_results.push_back(entry->time);
+        }
+    }
+    SortPred s = {dir};
+    std::sort(expected_results.begin(), expected_results.end(), s);
+    expected_results.resize(std::min<size_t>(expected_results.size(), limit));
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual_results.begin(), actual_results.end(), expected_results.begin(), expected_results.end());
+}
+
+BOOST_AUTO_TEST_CASE(Test_stackless_fan_in_cursor_limit_f)
+{
+    test_fan_in_cursor_limit(AKU_CURSOR_DIR_FORWARD, 10, 100000 + sizeof(PageHeader), 1000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_stackless_fan_in_cursor_limit_b)
+{
+    test_fan_in_cursor_limit(AKU_CURSOR_DIR_BACKWARD, 10, 100000 + sizeof(PageHeader), 1000);
+}
+
+
+// Prefetch cursor
+
+void test_prefetch_fan_in_cursor(uint32_t dir, int n_cursors, int page_size, int n_threads, size_t capacity) {
+    std::vector<PageWrapper> pages;
+    pages.reserve(n_cursors);
+    for (int i = 0; i < n_cursors; i++) {
+        pages.emplace_back(page_size, (uint32_t)i);
+    }
+
+    auto match_all = [](aku_ParamId) { return SearchQuery::MATCH; };
+    SearchQuery q(match_all, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, dir);
+
+    CursorWorkerPool pool(n_threads);
+    std::vector<std::unique_ptr<ExternalCursor>> cursors;
+    for (int i = 0; i < n_cursors; i++) {
+        auto cursor = CoroCursor::make(&PageHeader::search, pages[i].page, q);
+        cursors.emplace_back(new PrefetchCursor(std::move(cursor), pool, capacity));
+    }
+
+    std::vector<ExternalCursor*> ecur;
+    std::transform(cursors.begin(), cursors.end(),
+                   std::back_inserter(ecur),
+                   [](std::unique_ptr<ExternalCursor>& c) { return c.get(); });
+
+    StacklessFanInCursorCombinator cursor(&ecur[0], n_cursors, (int)dir);
+
+    CursorResult results[0x100];
+    std::vector<int64_t> actual_results;
+    while(!cursor.is_done()) {
+        int n_read = cursor.read(results, 0x100);
+        for (int i = 0; i < n_read; i++) {
+            actual_results.push_back(results[i].timestamp);
+        }
+    }
+    cursor.close();
+
+    std::vector<int64_t> expected_results;
+    for(auto& pagewrapper: pages) {
+        std::copy(pagewrapper.timestamps.begin(), pagewrapper.timestamps.end(), std::back_inserter(expected_results));
+    }
+    SortPred s = {dir};
+    std::sort(expected_results.begin(), expected_results.end(), s);
+    s.check_order(actual_results.begin(), actual_results.end());
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual_results.begin(), actual_results.end(), expected_results.begin(), expected_results.end());
+}
+
+BOOST_AUTO_TEST_CASE(Test_prefetch_fan_in_cursor_f)
+{
+    test_prefetch_fan_in_cursor(AKU_CURSOR_DIR_FORWARD, 10, 100000 + sizeof(PageHeader), 4, 0x4000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_prefetch_fan_in_cursor_b)
+{
+    test_prefetch_fan_in_cursor(AKU_CURSOR_DIR_BACKWARD, 10, 100000 + sizeof(PageHeader), 4, 0x4000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_prefetch_fan_in_cursor_small_buffer)
+{
+    // More cursors than threads, buffer is smaller than page
+    test_prefetch_fan_in_cursor(AKU_CURSOR_DIR_FORWARD, 10, 100000 + sizeof(PageHeader), 2, 0x400);
+}
+
+void test_fan_in_cursor_read_columns(uint32_t dir, int n_cursors, int page_size) {
+    std::vector<PageWrapper> pages;
+    pages.reserve(n_cursors);
+    for (int i = 0; i < n_cursors; i++) {
+        pages.emplace_back(page_size, (uint32_t)i);
+    }
+
+    auto match_all = [](aku_ParamId) { return SearchQuery::MATCH; };
+    SearchQuery q(match_all, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, dir);
+
+    // Combinator owns its input cursors
+    std::vector<std::unique_ptr<ExternalCursor>> cursors;
+    for (int i = 0; i < n_cursors; i++) {
+        cursors.push_back(CoroCursor::make(&PageHeader::search, pages[i].page, q));
+    }
+    StacklessFanInCursorCombinator cursor(std::move(cursors), (int)dir);
+
+    const int BUF_LEN = 0x100;
+    aku_TimeStamp timestamps[BUF_LEN];
+    uint32_t lengths[BUF_LEN];
+    CursorColumns columns = { timestamps, nullptr, nullptr, lengths };
+    std::vector<int64_t> actual_results;
+    while(!cursor.is_done()) {
+        int n_read = cursor.read_columns(columns, BUF_LEN);
+        for (int i = 0; i < n_read; i++) {
+            BOOST_REQUIRE(lengths[i] != 0u);
+            actual_results.push_back(timestamps[i]);
+        }
+    }
+    cursor.close();
+
+    std::vector<int64_t> expected_results;
+    for(auto& pagewrapper: pages) {
+        std::copy(pagewrapper.timestamps.begin(), pagewrapper.timestamps.end(), std::back_inserter(expected_results));
+    }
+    SortPred s = {dir};
+    std::sort(expected_results.begin(), expected_results.end(), s);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual_results.begin(), actual_results.end(), expected_results.begin(), expected_results.end());
+}
+
+BOOST_AUTO_TEST_CASE(Test_stackless_fan_in_cursor_read_columns_f)
+{
+    test_fan_in_cursor_read_columns(AKU_CURSOR_DIR_FORWARD, 10, 100000 + sizeof(PageHeader));
+}
+
+BOOST_AUTO_TEST_CASE(Test_stackless_fan_in_cursor_read_columns_b)
+{
+    test_fan_in_cursor_read_columns(AKU_CURSOR_DIR_BACKWARD, 10, 100000 + sizeof(PageHeader));
+}
@@ -0,0 +1,161 @@
+#include <iostream>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Main
+#include <boost/test/unit_test.hpp>
+
+#include "invertedindex.h"
+
+#include <cstring>
+#include <set>
+#include <sstream>
+
+using namespace Akumuli;
+
+static std::vector<uint64_t> get_ids(PostingList const& list) {
+    std::vector<uint64_t> ids;
+    list.get_ids(&ids);
+    return ids;
+}
+
+BOOST_AUTO_TEST_CASE(Test_postinglist_add) {
+
+    PostingList list;
+    std::set<uint64_t> expected;
+    // Sparse ids in many containers and dense ids in one container (bitmap)
+    for (uint64_t i = 0; i < 100000; i += 7) {
+        list.add(i*31);
+        expected.insert(i*31);
+    }
+    for (uint64_t i = 0x50000; i < 0x58000; i++) {
+        list.add(i);
+        expected.insert(i);
+    }
+    // Duplicates and out of order ids
+    list.add(0x50000);
+    list.add(31);
+    expected.insert(31);
+    BOOST_REQUIRE_EQUAL(list.cardinality(), expected.size());
+    auto ids = get_ids(list);
+    BOOST_REQUIRE(std::equal(ids.begin(), ids.end(), expected.begin()));
+    BOOST_REQUIRE(list.contains(0x50001));
+    BOOST_REQUIRE(list.contains(31));
+    BOOST_REQUIRE(!list.contains(32));
+}
+
+BOOST_AUTO_TEST_CASE(Test_postinglist_unite_intersect) {
+
+    // Every container type combination: array-array, array-bitmap, bitmap-bitmap
+    PostingList even, odd, threes;
+    for (uint64_t i = 0; i < 0x30000; i++) {
+        if (i % 2 == 0 && (i < 0x10000 || i >= 0x20000)) {
+            even.add(i);
+        }
+        if (i % 2 == 1 && i >= 0x10000) {
+            odd.add(i);
+        }
+        if (i % 3 == 0 && i < 0x20000 && (i % 300 == 0 || i >= 0x10000)) {
+            threes.add(i);
+        }
+    }
+    auto all = even;
+    all.unite(odd);
+    BOOST_REQUIRE_EQUAL(all.cardinality(), even.cardinality() + odd.cardinality());
+
+    auto evens_and_threes = even;
+    evens_and_threes.intersect(threes);
+    for (auto id: get_ids(evens_and_threes)) {
+        BOOST_REQUIRE(id % 300 == 0);
+        BOOST_REQUIRE(id < 0x10000);
+    }
+    BOOST_REQUIRE_EQUAL(evens_and_threes.cardinality(), 0x10000/300 + 1);
+
+    auto odds_and_threes = odd;
+    odds_and_threes.intersect(threes);
+    for (auto id: get_ids(odds_and_threes)) {
+        BOOST_REQUIRE(id % 3 == 0);
+        BOOST_REQUIRE(id % 2 == 1);
+        BOOST_REQUIRE(id >= 0x10000 && id < 0x20000);
+    }
+
+    auto nothing = even;
+    nothing.intersect(odd);
+    BOOST_REQUIRE_EQUAL(nothing.cardinality(), 0u);
+    BOOST_REQUIRE(get_ids(nothing).empty());
+}
+
+static std::vector<uint64_t> query(InvertedIndex const& index, const char* expression) {
+    std::vector<uint64_t> ids;
+    auto status = index.query(expression, &ids);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    return ids;
+}
+
+static void add(InvertedIndex& index, const char* series, uint64_t id) {
+    index.add(series, series + strlen(series), id);
+}
+
+BOOST_AUTO_TEST_CASE(Test_invertedindex_query) {
+
+    InvertedIndex index;
+    add(index, "cpu host=db01 region=europe", 1);
+    add(index, "cpu host=web01 region=europe", 2);
+    add(index, "cpu host=web02 region=asia", 3);
+    add(index, "mem host=web01 region=europe", 4);
+    add(index, "mem host=db01 region=asia", 5);
+
+    typedef std::vector<uint64_t> Ids;
+    BOOST_REQUIRE(query(index, "metric=cpu") == Ids({1, 2, 3}));
+    BOOST_REQUIRE(query(index, "host=web01") == Ids({2, 4}));
+    BOOST_REQUIRE(query(index, "metric=cpu AND region=europe") == Ids({1, 2}));
+    BOOST_REQUIRE(query(index, "host=db01 OR host=web02") == Ids({1, 3, 5}));
+    BOOST_REQUIRE(query(index, "host=web*") == Ids({2, 3, 4}));
+    // AND has higher precedence
+    BOOST_REQUIRE(query(index, "metric=mem OR metric=cpu AND region=asia") == Ids({3, 4, 5}));
+    BOOST_REQUIRE(query(index, "(metric=mem OR metric=cpu) AND region=asia") == Ids({3, 5}));
+    BOOST_REQUIRE(query(index, "metric=cpu AND (host=web* OR host=db01)") == Ids({1, 2, 3}));
+    BOOST_REQUIRE(query(index, "host=unknown").empty());
+    BOOST_REQUIRE(query(index, "metric=cpu AND host=unknown").empty());
+}
+
+BOOST_AUTO_TEST_CASE(Test_invertedindex_malformed) {
+
+    InvertedIndex index;
+    add(index, "cpu host=db01", 1);
+    const char* expressions[] = {
+        "",
+        "host",
+        "=db01",
+        "host=db01 AND",
+        "OR host=db01",
+        "(host=db01",
+        "host=db01)",
+        "host=db01 host=db02",
+        "host=db01 XOR host=db02",
+    };
+    for (auto expr: expressions) {
+        std::vector<uint64_t> ids;
+        BOOST_REQUIRE_EQUAL(index.query(expr, &ids), AKU_EBAD_DATA);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_invertedindex_many_series) {
+
+    InvertedIndex index;
+    const uint64_t N = 100000;
+    for (uint64_t id = 0; id < N; id++) {
+        std::stringstream str;
+        str << (id % 2 ? "cpu" : "mem") << " host=host" << id % 1000 << " region=r" << id % 10;
+        auto series = str.str();
+        index.add(series.data(), series.data() + series.size(), id);
+    }
+    auto ids = query(index, "metric=cpu AND region=r3");
+    BOOST_REQUIRE_EQUAL(ids.size(), N/10);
+    for (auto id: ids) {
+        BOOST_REQUIRE(id % 2 == 1 && id % 10 == 3);
+    }
+    ids = query(index, "host=host99*");
+    // host99, host990 .. host999
+    BOOST_REQUIRE_EQUAL(ids.size(), 11*N/1000);
+    BOOST_REQUIRE(index.memory_use() > 0u);
+}
@@ -0,0 +1,100 @@
+#include <iostream>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Main
+#include <boost/test/unit_test.hpp>
+
+#include "metrics.h"
+
+#include <thread>
+#include <vector>
+
+using namespace Akumuli;
+
+BOOST_AUTO_TEST_CASE(Test_histogram_buckets) {
+
+    // Buckets are contiguous and every value falls into bucket with
+    // upper bound that is not less than the value (with 1/8 precision)
+    int prev = 0;
+    for (uint64_t value = 0; value < 0x100000; value++) {
+        int ix = LatencyHistogram::bucket_index(value);
+        BOOST_REQUIRE(ix == prev || ix == prev + 1);
+        auto upper = LatencyHistogram::bucket_upper_bound(ix);
+        BOOST_REQUIRE(upper >= value);
+        BOOST_REQUIRE(upper - value <= value/LatencyHistogram::SUB_BUCKETS);
+        BOOST_REQUIRE(LatencyHistogram::bucket_index(upper) == ix);
+        prev = ix;
+    }
+    int last = LatencyHistogram::bucket_index(~0ull);
+    BOOST_REQUIRE_EQUAL(last, LatencyHistogram::NUM_BUCKETS - 1);
+    BOOST_REQUIRE_EQUAL(LatencyHistogram::bucket_upper_bound(last), ~0ull);
+}
+
+BOOST_AUTO_TEST_CASE(Test_histogram_percentiles) {
+
+    LatencyHistogram hist;
+    aku_LatencyStats stats;
+    hist.get_stats(&stats);
+    BOOST_REQUIRE_EQUAL(stats.count, 0u);
+    BOOST_REQUIRE_EQUAL(stats.p99, 0u);
+
+    // 1..10000 microseconds
+    for (uint64_t i = 1; i <= 10000; i++) {
+        hist.record(i*1000);
+    }
+    hist.get_stats(&stats);
+    auto near = [](uint64_t actual, uint64_t expected) {
+        return actual >= expected && actual - expected <= expected/LatencyHistogram::SUB_BUCKETS;
+    };
+    BOOST_REQUIRE_EQUAL(stats.count, 10000u);
+    BOOST_REQUIRE_EQUAL(stats.mean, 5000500u);
+    BOOST_REQUIRE(near(stats.min, 1000));
+    BOOST_REQUIRE(near(stats.p50, 5000000));
+    BOOST_REQUIRE(near(stats.p90, 9000000));
+    BOOST_REQUIRE(near(stats.p99, 9900000));
+    BOOST_REQUIRE(near(stats.p999, 9990000));
+    BOOST_REQUIRE(near(stats.max, 10000000));
+
+    // Reset
+    hist.get_stats(&stats, true);
+    BOOST_REQUIRE_EQUAL(stats.count, 10000u);
+    hist.get_stats(&stats);
+    BOOST_REQUIRE_EQUAL(stats.count, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_metrics_many_threads) {
+
+    // Values recorded by different threads are merged on read
+    Metrics metrics;
+    const int NTHREADS = 2*METRICS_NUM_SHARDS;
+    const int N = 10000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NTHREADS; t++) {
+        threads.push_back(std::thread([&metrics, t]() {
+            for (int i = 0; i < N; i++) {
+                LatencyTimer timer(metrics.sample_write());
+                metrics.n_writes.add(1);
+                metrics.query.record(static_cast<uint64_t>(t));
+            }
+            metrics.n_write_errors.add(1);
+        }));
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    aku_Metrics result;
+    metrics.get_metrics(&result);
+    BOOST_REQUIRE_EQUAL(result.n_writes, static_cast<uint64_t>(NTHREADS*N));
+    BOOST_REQUIRE_EQUAL(result.n_write_errors, static_cast<uint64_t>(NTHREADS));
+    BOOST_REQUIRE_EQUAL(result.write.count, static_cast<uint64_t>(NTHREADS*N/Metrics::WRITE_SAMPLE_RATE));
+    BOOST_REQUIRE_EQUAL(result.query.count, static_cast<uint64_t>(NTHREADS*N));
+    BOOST_REQUIRE_EQUAL(result.query.min, 0u);
+    BOOST_REQUIRE_EQUAL(result.query.max, static_cast<uint64_t>(NTHREADS - 1));
+    BOOST_REQUIRE_EQUAL(result.checkpoint.count, 0u);
+    BOOST_REQUIRE_EQUAL(result.flush.count, 0u);
+
+    metrics.get_metrics(&result, true);
+    metrics.get_metrics(&result);
+    BOOST_REQUIRE_EQUAL(result.n_writes, 0u);
+    BOOST_REQUIRE_EQUAL(result.query.count, 0u);
+}
@@ -4,6 +4,8 @@
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <apr.h>
+#include <sys/mman.h>
+#include <vector>
 
 #include "akumuli_def.h"
 #include "util.h"
@@ -132,3 +134,79 @@ BOOST_AUTO_TEST_CASE(TestMmap4)
 
     delete_tmp_file(tmp_file);
 }
+
+BOOST_AUTO_TEST_CASE(Test_mmap_huge_tlb)
+{
+    // huge pages are only a hint, mapping should work on any filesystem
+    const char* tmp_file = "testfile";
+    delete_tmp_file(tmp_file);
+    create_tmp_file(tmp_file, 0x10000);
+    {
+        MemoryMappedFile mmap(tmp_file, true, &test_logger);
+        BOOST_REQUIRE(mmap.is_bad() == false);
+        BOOST_REQUIRE(mmap.get_size() == 0x10000);
+        char* begin = (char*)mmap.get_pointer();
+        *begin = 42;
+    }
+    {
+        MemoryMappedFile mmap(tmp_file, false, &test_logger);
+        BOOST_REQUIRE(*(char*)mmap.get_pointer() == 42);
+    }
+    delete_tmp_file(tmp_file);
+}
+
+BOOST_AUTO_TEST_CASE(Test_numa_policy)
+{
+    int nnodes = get_numa_nodes_count();
+    BOOST_REQUIRE(nnodes >= 1);
+    int node = get_numa_node();
+    BOOST_REQUIRE(node >= 0 && node < nnodes);
+    // memory should be usable under every policy
+    for (auto policy: { AKU_NUMA_PREFERRED, AKU_NUMA_INTERLEAVE, AKU_NUMA_DEFAULT }) {
+        set_numa_policy(policy, node);
+        std::vector<char> buffer(0x100000, 1);
+        BOOST_REQUIRE(buffer.back() == 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_readahead_resident_backoff)
+{
+    const size_t page_size = get_page_size();
+    const size_t size = 256*page_size;
+    const size_t distance = 8*page_size;
+    std::vector<char> mem(size, 1);  // all pages are in core
+
+    Readahead readahead(mem.data(), size, distance, false);
+    for (size_t i = 0; i < size; i += 64) {
+        readahead.touch(mem.data() + i);
+    }
+    BOOST_REQUIRE_EQUAL(readahead.get_advised(), 0u);
+    BOOST_REQUIRE(readahead.get_resident() > 0u);
+    // check every half-window without backoff
+    BOOST_REQUIRE(readahead.get_resident() < size/(distance/2)/4);
+}
+
+BOOST_AUTO_TEST_CASE(Test_readahead_cold_backward_scan)
+{
+    const size_t page_size = get_page_size();
+    const size_t size = 256*page_size;
+    const size_t distance = 8*page_size;
+    // anonymous mapping that is never written to, pages are not resident
+    void* mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    BOOST_REQUIRE(mem != MAP_FAILED);
+    auto begin = static_cast<const char*>(mem);
+
+    Readahead readahead(mem, size, distance, true);
+    for (size_t i = size; i --> 0;) {
+        readahead.touch(begin + i);
+    }
+    BOOST_REQUIRE_EQUAL(readahead.get_resident(), 0u);
+    BOOST_REQUIRE(readahead.get_advised() >= size/(distance/2) - 1);
+
+    // disabled readahead
+    Readahead disabled(mem, size, 0u, true);
+    disabled.touch(begin + size - 1);
+    BOOST_REQUIRE_EQUAL(disabled.get_advised(), 0u);
+    BOOST_REQUIRE_EQUAL(disabled.get_resident(), 0u);
+    munmap(mem, size);
+}
@@ -6,6 +6,7 @@
 #include <boost/test/unit_test.hpp>
 #include <apr.h>
 #include <vector>
+#include <thread>
 #include <iostream>
 
 #include "akumuli_def.h"
@@ -578,3 +579,809 @@ BOOST_AUTO_TEST_CASE(Test_Compression_backward_0) {
 BOOST_AUTO_TEST_CASE(Test_Compression_backward_1) {
     generic_compression_test(1u, 0ul, AKU_CURSOR_DIR_BACKWARD, 100);
 }
+
+BOOST_AUTO_TEST_CASE(Test_Compression_backward_doubles) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x10000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    // Few chunks of double values
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 4; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 100; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(1u);
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    // Upperbound is larger than all timestamps stored in page
+    SearchQuery query(1u, 1u, ts + 1000u, AKU_CURSOR_DIR_BACKWARD);
+    Caller caller;
+    RecordingCursor cur;
+    page->search(caller, &cur, query);
+
+    BOOST_REQUIRE_EQUAL(cur.results.size(), ts);
+    for (auto const& res: cur.results) {
+        BOOST_REQUIRE_EQUAL(res.timestamp, ts);
+        BOOST_REQUIRE_EQUAL(res.data.float64, static_cast<double>(ts));
+        ts--;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_Compression_mixed_encodings) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x10000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    // Chunks with different encodings in the same page
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 4; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 100; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(1u);
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        aku_Status status = AKU_SUCCESS;
+        if (chunk % 2 == 0) {
+            status = page->complete_chunk(header);
+        } else {
+            EncodedChunk encoded;
+            uint32_t encoding = chunk == 1 ? AKU_CHUNK_STREAMVBYTE : AKU_CHUNK_DELTA_DELTA|AKU_CHUNK_GORILLA;
+            BOOST_REQUIRE_EQUAL(encoded.encode(header, encoding), AKU_SUCCESS);
+            status = page->complete_chunk(header, encoded);
+        }
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    SearchQuery query(1u, 1u, ts + 1000u, AKU_CURSOR_DIR_BACKWARD);
+    Caller caller;
+    RecordingCursor cur;
+    page->search(caller, &cur, query);
+
+    BOOST_REQUIRE_EQUAL(cur.results.size(), ts);
+    for (auto const& res: cur.results) {
+        BOOST_REQUIRE_EQUAL(res.timestamp, ts);
+        BOOST_REQUIRE_EQUAL(res.data.float64, static_cast<double>(ts));
+        ts--;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_Compression_in_place) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x10000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 4; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 100; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(1u);
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        // Compressed data is placed right below the previous chunk and isn't copied
+        auto top = page->cdata() + page->last_offset;
+        EncodedChunk encoded;
+        BOOST_REQUIRE_EQUAL(encoded.encode(header, AKU_CHUNK_STREAMVBYTE, page->get_chunk_space()), AKU_SUCCESS);
+        BOOST_REQUIRE(encoded.parts.empty());
+        BOOST_REQUIRE(static_cast<const char*>(encoded.in_place.address) + encoded.in_place.length == top);
+        BOOST_REQUIRE_EQUAL(page->complete_chunk(header, encoded), AKU_SUCCESS);
+    }
+
+    SearchQuery query(1u, 1u, ts + 1000u, AKU_CURSOR_DIR_BACKWARD);
+    Caller caller;
+    RecordingCursor cur;
+    page->search(caller, &cur, query);
+
+    BOOST_REQUIRE_EQUAL(cur.results.size(), ts);
+    for (auto const& res: cur.results) {
+        BOOST_REQUIRE_EQUAL(res.timestamp, ts);
+        BOOST_REQUIRE_EQUAL(res.data.float64, static_cast<double>(ts));
+        ts--;
+    }
+
+    // Chunk that doesn't fit the page
+    ChunkHeader header;
+    for (int i = 0; i < 0x10000; i++) {
+        header.lengths.push_back(0u);
+        header.offsets.push_back(0u);
+        header.paramids.push_back(i);
+        header.timestamps.push_back(1000u + i*i);
+        header.values.push_back(i*3.14);
+    }
+    auto count = page->count;
+    BOOST_REQUIRE_EQUAL(page->complete_chunk(header), AKU_EOVERFLOW);
+    BOOST_REQUIRE_EQUAL(page->count, count);
+}
+
+BOOST_AUTO_TEST_CASE(Test_page_recovery) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x10000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    const int NCHUNKS = 4;
+    const int NVALUES = 100;
+    aku_TimeStamp ts = 0u;
+    std::vector<ChunkDesc> chunks;
+    for (int chunk = 0; chunk < NCHUNKS; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < NVALUES; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(1u);
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        ChunkDesc desc;
+        memcpy(&desc, page->read_entry_at(page->count - 1)->value, sizeof(desc));
+        chunks.push_back(desc);
+        if (chunk == 1) {
+            // First two chunks are flushed
+            page->checkpoint = page->sync_count;
+        }
+    }
+
+    // Nothing to truncate
+    auto count = page->count;
+    BOOST_REQUIRE_EQUAL(page->recover(), 0u);
+    BOOST_REQUIRE_EQUAL(page->count, count);
+    BOOST_REQUIRE_EQUAL(page->checkpoint, count);
+
+    // Damage third chunk, page should be truncated after second chunk
+    page->checkpoint = 4u;
+    page_mem.at(chunks.at(2).begin_offset) ^= 0xFF;
+    BOOST_REQUIRE_EQUAL(page->recover(), count - 4u);
+    BOOST_REQUIRE_EQUAL(page->count, 4u);
+    BOOST_REQUIRE_EQUAL(page->sync_count, 4u);
+    BOOST_REQUIRE_EQUAL(page->last_offset, page->page_index[3]);
+
+    SearchQuery query(1u, 1u, ts, AKU_CURSOR_DIR_BACKWARD);
+    Caller caller;
+    RecordingCursor cur;
+    page->search(caller, &cur, query);
+    BOOST_REQUIRE_EQUAL(cur.results.size(), 2u*NVALUES);
+    BOOST_REQUIRE_EQUAL(cur.results.front().timestamp, 2u*NVALUES);
+}
+
+BOOST_AUTO_TEST_CASE(Test_Compression_chunk_summary_skip) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x10000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    // Each chunk contains values of the single param
+    const int NCHUNKS = 4;
+    const int NVALUES = 100;
+    aku_TimeStamp ts = 0u;
+    std::vector<ChunkDesc> chunks;
+    for (int chunk = 0; chunk < NCHUNKS; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < NVALUES; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(static_cast<aku_ParamId>(chunk + 1));
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        ChunkDesc desc;
+        memcpy(&desc, page->read_entry_at(page->count - 1)->value, sizeof(desc));
+        BOOST_REQUIRE_EQUAL(desc.min_timestamp, ts - NVALUES + 1);
+        BOOST_REQUIRE_EQUAL(desc.max_timestamp, ts);
+        BOOST_REQUIRE_EQUAL(desc.min_id, chunk + 1);
+        BOOST_REQUIRE_EQUAL(desc.max_id, chunk + 1);
+        chunks.push_back(desc);
+    }
+
+    // Damaged chunks can't be decoded, search should skip them using summary
+    page_mem.at(chunks.at(0).begin_offset) ^= 0xFF;
+    page_mem.at(chunks.at(3).begin_offset) ^= 0xFF;
+
+    for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+        for (aku_ParamId id = 2u; id < 4u; id++) {
+            SearchQuery query(id, 1u, ts, dir);
+            Caller caller;
+            RecordingCursor cur;
+            page->search(caller, &cur, query);
+            BOOST_REQUIRE_EQUAL(cur.error_code, RecordingCursor::NO_ERROR);
+            BOOST_REQUIRE_EQUAL(cur.results.size(), NVALUES);
+            for (auto const& res: cur.results) {
+                BOOST_REQUIRE_EQUAL(res.param_id, id);
+                BOOST_REQUIRE_EQUAL(res.data.float64, static_cast<double>(res.timestamp));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_Compression_chunk_cache) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x10000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 42);
+
+    const int NCHUNKS = 4;
+    const int NVALUES = 100;
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < NCHUNKS; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < NVALUES; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(static_cast<aku_ParamId>(i % 2));
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    aku_SearchStats stats;
+    PageHeader::get_search_stats(&stats, true);
+
+    // First query decodes all chunks, second one should use cached chunks
+    std::vector<CursorResult> expected;
+    for (int i = 0; i < 2; i++) {
+        SearchQuery query(1u, 1u, ts, AKU_CURSOR_DIR_BACKWARD);
+        Caller caller;
+        RecordingCursor cur;
+        page->search(caller, &cur, query);
+        BOOST_REQUIRE_EQUAL(cur.error_code, RecordingCursor::NO_ERROR);
+        BOOST_REQUIRE_EQUAL(cur.results.size(), NCHUNKS*NVALUES/2);
+        PageHeader::get_search_stats(&stats, true);
+        if (i == 0) {
+            BOOST_REQUIRE_EQUAL(stats.cache.n_hits, 0u);
+            BOOST_REQUIRE_EQUAL(stats.cache.n_misses, NCHUNKS);
+            expected = cur.results;
+        } else {
+            BOOST_REQUIRE_EQUAL(stats.cache.n_hits, NCHUNKS);
+            BOOST_REQUIRE_EQUAL(stats.cache.n_misses, 0u);
+            for (auto k = 0u; k < expected.size(); k++) {
+                BOOST_REQUIRE_EQUAL(cur.results[k].timestamp, expected[k].timestamp);
+                BOOST_REQUIRE_EQUAL(cur.results[k].param_id, expected[k].param_id);
+                BOOST_REQUIRE_EQUAL(cur.results[k].data.float64, expected[k].data.float64);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_search_stats_per_query) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x10000);
+    auto page = init_search_range_test(page_mem.data(), page_mem.size(), 100);
+
+    aku_SearchStats before;
+    PageHeader::get_search_stats(&before);
+
+    // Every thread runs its own query, counters of the queries shouldn't mix
+    const int NTHREADS = 4;
+    const int NSEARCHES = 100;
+    std::vector<std::shared_ptr<SearchStats>> counters;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < NTHREADS; i++) {
+        counters.push_back(std::make_shared<SearchStats>());
+        auto stats = counters.back();
+        threads.emplace_back([page, stats]() {
+            SearchQuery query(1u, 1010u, 1050u, AKU_CURSOR_DIR_FORWARD);
+            query.stats = stats;
+            for (int j = 0; j < NSEARCHES; j++) {
+                Caller caller;
+                RecordingCursor cur;
+                page->search(caller, &cur, query);
+                BOOST_REQUIRE_EQUAL(cur.results.size(), 41u);
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    // Searches are identical, global counters should grow by the sum of the query counters
+    aku_SearchStats after;
+    PageHeader::get_search_stats(&after);
+    aku_SearchStats first;
+    counters.front()->get(&first);
+    BOOST_REQUIRE_GT(first.istats.n_times, 0u);
+    for (auto stats: counters) {
+        aku_SearchStats qstats;
+        stats->get(&qstats);
+        BOOST_REQUIRE_EQUAL(qstats.istats.n_times, first.istats.n_times);
+        BOOST_REQUIRE_EQUAL(qstats.istats.n_steps, first.istats.n_steps);
+        BOOST_REQUIRE_EQUAL(qstats.bstats.n_times, first.bstats.n_times);
+        BOOST_REQUIRE_EQUAL(qstats.bstats.n_steps, first.bstats.n_steps);
+        BOOST_REQUIRE_EQUAL(qstats.stacks.n_hits + qstats.stacks.n_misses, 0u);
+    }
+    BOOST_REQUIRE_EQUAL(after.istats.n_times - before.istats.n_times, NTHREADS*first.istats.n_times);
+    BOOST_REQUIRE_EQUAL(after.istats.n_steps - before.istats.n_steps, NTHREADS*first.istats.n_steps);
+    BOOST_REQUIRE_EQUAL(after.bstats.n_times - before.bstats.n_times, NTHREADS*first.bstats.n_times);
+    BOOST_REQUIRE_EQUAL(after.bstats.n_steps - before.bstats.n_steps, NTHREADS*first.bstats.n_steps);
+
+    PageHeader::get_search_stats(&after, true);
+    PageHeader::get_search_stats(&after);
+    BOOST_REQUIRE_EQUAL(after.istats.n_times, 0u);
+    BOOST_REQUIRE_EQUAL(after.istats.n_steps, 0u);
+    BOOST_REQUIRE_EQUAL(after.bstats.n_times, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_page_model_error_bound) {
+    std::unique_ptr<PageModel> model(new PageModel());
+    model->reset();
+
+    // Bursty timestamps: dense bursts separated by long gaps, some duplicates
+    std::vector<aku_TimeStamp> timestamps;
+    aku_TimeStamp ts = 1000u;
+    for (int burst = 0; burst < 100; burst++) {
+        int burst_size = 1 + rand() % 200;
+        for (int i = 0; i < burst_size; i++) {
+            ts += rand() % 3;
+            timestamps.push_back(ts);
+        }
+        ts += 1000u + rand() % 100000u;
+    }
+    for (uint32_t i = 0; i < timestamps.size(); i++) {
+        model->add(timestamps[i], i);
+    }
+    BOOST_REQUIRE(model->size < timestamps.size());
+
+    const uint32_t max_range = 2*AKU_PAGE_MODEL_ERROR + 3;
+    auto check = [&](aku_TimeStamp key) {
+        uint32_t begin = 0u, end = static_cast<uint32_t>(timestamps.size() - 1);
+        BOOST_REQUIRE(model->predict(key, &begin, &end));
+        BOOST_REQUIRE(begin <= end);
+        BOOST_REQUIRE(end - begin <= max_range);
+        // Range should surround key
+        auto it = std::upper_bound(timestamps.begin(), timestamps.end(), key);
+        if (it != timestamps.begin()) {
+            BOOST_REQUIRE(timestamps.at(begin) <= key);
+        }
+        if (it != timestamps.end()) {
+            BOOST_REQUIRE(timestamps.at(end) >= key);
+        }
+    };
+    for (aku_TimeStamp key = timestamps.front(); key <= timestamps.back(); key += 1 + rand() % 97) {
+        check(key);
+    }
+    for (auto key: timestamps) {
+        check(key);
+    }
+
+    // Truncated model should be equal to the model of the truncated sequence
+    uint32_t count = static_cast<uint32_t>(timestamps.size() / 2);
+    std::unique_ptr<PageModel> expected(new PageModel());
+    expected->reset();
+    for (uint32_t i = 0; i < count; i++) {
+        expected->add(timestamps[i], i);
+    }
+    for (auto ix = model->truncate(count); ix < count; ix++) {
+        model->add(timestamps[ix], ix);
+    }
+    BOOST_REQUIRE_EQUAL(model->size, expected->size);
+    BOOST_REQUIRE_EQUAL(model->last.index, expected->last.index);
+    for (uint32_t i = 0; i < model->size; i++) {
+        BOOST_REQUIRE_EQUAL(model->knots[i].index, expected->knots[i].index);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_Compression_param_id_filter) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x40000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    // Many interleaved series with even ids, ids are dense in range but
+    // odd ids are never present
+    const int NSERIES = 500;
+    const int NVALUES = 4*NSERIES;
+    ChunkHeader header;
+    for (int i = 0; i < NVALUES; i++) {
+        header.lengths.push_back(0u);
+        header.offsets.push_back(0u);
+        header.paramids.push_back(static_cast<aku_ParamId>(2*(i % NSERIES)));
+        header.timestamps.push_back(static_cast<aku_TimeStamp>(i + 1));
+        header.values.push_back(static_cast<double>(i));
+    }
+    auto status = page->complete_chunk(header);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    ChunkDesc desc;
+    memcpy(&desc, page->read_entry_at(page->count - 1)->value, sizeof(desc));
+    BOOST_REQUIRE(desc.filter_size != 0u);
+    auto filter = reinterpret_cast<const unsigned char*>(page->cdata() + desc.begin_offset);
+
+    // No false negatives and few false positives
+    int nfalse_positives = 0;
+    aku_ParamId absent_id = 0u;
+    for (int i = 0; i < NSERIES; i++) {
+        BOOST_REQUIRE(ParamIdFilter::may_contain(filter, desc.filter_size, 2*i));
+        if (ParamIdFilter::may_contain(filter, desc.filter_size, 2*i + 1)) {
+            nfalse_positives++;
+        } else if (absent_id == 0u) {
+            absent_id = 2*i + 1;
+        }
+    }
+    BOOST_REQUIRE(nfalse_positives < NSERIES/10);
+    BOOST_REQUIRE(absent_id != 0u);
+
+    for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+        SearchQuery query(42u, 1u, NVALUES, dir);
+        Caller caller;
+        RecordingCursor cur;
+        page->search(caller, &cur, query);
+        BOOST_REQUIRE_EQUAL(cur.error_code, RecordingCursor::NO_ERROR);
+        BOOST_REQUIRE_EQUAL(cur.results.size(), NVALUES/NSERIES);
+        for (auto const& res: cur.results) {
+            BOOST_REQUIRE_EQUAL(res.param_id, 42u);
+        }
+    }
+
+    // Damaged chunk can't be decoded, search should skip it using filter
+    page_mem.at(desc.begin_offset + desc.filter_size) ^= 0xFF;
+    for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+        SearchQuery query(absent_id, 1u, NVALUES, dir);
+        Caller caller;
+        RecordingCursor cur;
+        page->search(caller, &cur, query);
+        BOOST_REQUIRE_EQUAL(cur.error_code, RecordingCursor::NO_ERROR);
+        BOOST_REQUIRE_EQUAL(cur.results.size(), 0u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_param_id_set_match_block) {
+    std::vector<std::vector<aku_ParamId>> sets = {
+        {},
+        { 7u },
+        { 3u, 7u, 5u, 3u },                                    // small set, unsorted, with duplicates
+        { 10u, 11u, 12u, 13u, 14u, 15u, 16u, 17u, 18u, 20u },  // dense set
+        { 1u, 100u, 1000u, 10000u, 20000u, 30000u, 40000u,
+          50000u, 60000u, 70000u },                            // sparse set
+    };
+    std::vector<aku_ParamId> probes;
+    for (aku_ParamId id = 0u; id < 200u; id++) {
+        probes.push_back(id);
+    }
+    probes.push_back(10000u);
+    probes.push_back(70000u);
+    probes.push_back(~0ull);
+    for (auto const& ids: sets) {
+        ParamIdSet set(ids);
+        BOOST_REQUIRE(std::is_sorted(set.get_ids().begin(), set.get_ids().end()));
+        std::vector<unsigned char> mask(probes.size(), 0xFF);
+        set.match_block(probes.data(), probes.size(), mask.data());
+        for (size_t i = 0; i < probes.size(); i++) {
+            bool expected = std::find(ids.begin(), ids.end(), probes[i]) != ids.end();
+            BOOST_REQUIRE_EQUAL(mask[i] == 1, expected);
+            BOOST_REQUIRE_EQUAL(set.match(probes[i]) == SearchQuery::MATCH, expected);
+        }
+    }
+    BOOST_REQUIRE(ParamIdSet(sets[3]).is_bitmap());
+    BOOST_REQUIRE(!ParamIdSet(sets[4]).is_bitmap());
+}
+
+BOOST_AUTO_TEST_CASE(Test_Compression_multi_series_values) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x40000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    // Chunks of interleaved series, value of each element is equal to its timestamp
+    const int NSERIES = 16;
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 4; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 400; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(static_cast<aku_ParamId>(ts % NSERIES));
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    std::vector<std::vector<aku_ParamId>> sets = {
+        { 5u },
+        { 2u, 11u },
+        { 0u, 1u, 2u, 3u, 4u, 5u, 6u, 8u, 9u, 10u, 12u, 15u },
+    };
+    for (auto const& ids: sets) {
+        for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+            std::vector<aku_ParamId> sorted(ids);
+            std::sort(sorted.begin(), sorted.end());
+            auto fn = [sorted](aku_ParamId id) {
+                return std::binary_search(sorted.begin(), sorted.end(), id) ? SearchQuery::MATCH
+                                                                            : SearchQuery::NO_MATCH;
+            };
+            SearchQuery fn_query(fn, 333u, 1444u, dir);
+            SearchQuery set_query(ids, 333u, 1444u, dir);
+            Caller caller;
+            RecordingCursor fn_cur, set_cur;
+            page->search(caller, &fn_cur, fn_query);
+            page->search(caller, &set_cur, set_query);
+            BOOST_REQUIRE_EQUAL(fn_cur.error_code, RecordingCursor::NO_ERROR);
+            BOOST_REQUIRE_EQUAL(set_cur.error_code, RecordingCursor::NO_ERROR);
+            BOOST_REQUIRE_EQUAL(fn_cur.results.size(), set_cur.results.size());
+            BOOST_REQUIRE(!set_cur.results.empty());
+            for (size_t i = 0; i < set_cur.results.size(); i++) {
+                auto const& res = set_cur.results[i];
+                BOOST_REQUIRE_EQUAL(res.timestamp, fn_cur.results[i].timestamp);
+                BOOST_REQUIRE_EQUAL(res.param_id, fn_cur.results[i].param_id);
+                BOOST_REQUIRE_EQUAL(res.data.float64, static_cast<double>(res.timestamp));
+                BOOST_REQUIRE(res.timestamp >= 333u && res.timestamp <= 1444u);
+                BOOST_REQUIRE(std::binary_search(sorted.begin(), sorted.end(), res.param_id));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_Compression_aggregate) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x40000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    const int NSERIES = 4;
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 4; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 400; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(static_cast<aku_ParamId>(ts % NSERIES));
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+        std::vector<aku_ParamId> ids = { 1u, 3u };
+        SearchQuery query(ids, 150u, 1250u, dir);
+        Caller caller;
+        RecordingCursor cur;
+        page->search(caller, &cur, query);
+
+        // Expected results computed from raw values
+        Aggregator expected(100u);
+        for (auto const& res: cur.results) {
+            expected.add(res.param_id, res.timestamp, res.data.float64);
+        }
+
+        Aggregator aggregator(100u);
+        RecordingCursor agg_cur;
+        page->aggregate(caller, &agg_cur, query, &aggregator);
+        BOOST_REQUIRE_EQUAL(agg_cur.error_code, RecordingCursor::NO_ERROR);
+        BOOST_REQUIRE(agg_cur.results.empty());
+
+        auto expected_results = expected.get_results(dir);
+        auto results = aggregator.get_results(dir);
+        BOOST_REQUIRE_EQUAL(results.size(), 12u*ids.size());
+        BOOST_REQUIRE_EQUAL(results.size(), expected_results.size());
+        uint64_t total = 0u;
+        for (size_t i = 0; i < results.size(); i++) {
+            auto const& key = results[i].first;
+            auto const& val = results[i].second;
+            BOOST_REQUIRE(key == expected_results[i].first);
+            BOOST_REQUIRE_EQUAL(val.count, expected_results[i].second.count);
+            BOOST_REQUIRE_EQUAL(val.sum, expected_results[i].second.sum);
+            BOOST_REQUIRE_EQUAL(val.min, expected_results[i].second.min);
+            BOOST_REQUIRE_EQUAL(val.max, expected_results[i].second.max);
+            BOOST_REQUIRE(val.min >= key.first && val.max < key.first + 100u);
+            if (i > 0) {
+                auto prev = results[i - 1].first.first;
+                BOOST_REQUIRE(dir == AKU_CURSOR_DIR_FORWARD ? prev <= key.first : prev >= key.first);
+            }
+            total += val.count;
+        }
+        BOOST_REQUIRE_EQUAL(total, cur.results.size());
+
+        // Partial results can be merged
+        Aggregator merged(100u);
+        merged.merge(aggregator);
+        merged.merge(aggregator);
+        auto merged_results = merged.get_results(dir);
+        BOOST_REQUIRE_EQUAL(merged_results.size(), results.size());
+        for (size_t i = 0; i < results.size(); i++) {
+            BOOST_REQUIRE_EQUAL(merged_results[i].second.count, 2*results[i].second.count);
+            BOOST_REQUIRE_EQUAL(merged_results[i].second.min, results[i].second.min);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_page_search_resumable) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x40000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    const int NSERIES = 8;
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 4; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 400; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(static_cast<aku_ParamId>(ts % NSERIES));
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+        std::vector<aku_ParamId> ids = { 1u, 2u, 6u };
+        SearchQuery query(ids, 250u, 1350u, dir);
+        Caller caller;
+        RecordingCursor cur;
+        page->search(caller, &cur, query);
+        BOOST_REQUIRE_EQUAL(cur.error_code, RecordingCursor::NO_ERROR);
+        BOOST_REQUIRE(!cur.results.empty());
+
+        // Search is resumed inside chunks when buffer is small
+        for (int buf_len: { 1, 7, 0x100 }) {
+            for (uint64_t limit: { 0ul, 50ul }) {
+                SearchQuery limited(query);
+                limited.limit = limit;
+                PageSearch search(page, limited);
+                std::vector<CursorResult> buffer(buf_len);
+                std::vector<CursorResult> results;
+                while (!search.is_done()) {
+                    int n = search.read(buffer.data(), buf_len);
+                    BOOST_REQUIRE(n <= buf_len);
+                    results.insert(results.end(), buffer.begin(), buffer.begin() + n);
+                }
+                BOOST_REQUIRE(!search.get_error(nullptr));
+                auto expected_size = limit ? std::min<size_t>(limit, cur.results.size()) : cur.results.size();
+                BOOST_REQUIRE_EQUAL(results.size(), expected_size);
+                for (size_t i = 0; i < results.size(); i++) {
+                    BOOST_REQUIRE_EQUAL(results[i].timestamp, cur.results[i].timestamp);
+                    BOOST_REQUIRE_EQUAL(results[i].param_id, cur.results[i].param_id);
+                    BOOST_REQUIRE_EQUAL(results[i].data.float64, cur.results[i].data.float64);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_page_search_read_columns) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x40000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    const int NSERIES = 5;
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 3; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 300; i++) {
+            ts++;
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.paramids.push_back(static_cast<aku_ParamId>(ts % NSERIES));
+            header.timestamps.push_back(ts);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+        std::vector<aku_ParamId> ids = { 0u, 3u };
+        SearchQuery query(ids, 100u, 800u, dir);
+        Caller caller;
+        RecordingCursor cur;
+        page->search(caller, &cur, query);
+        BOOST_REQUIRE_EQUAL(cur.error_code, RecordingCursor::NO_ERROR);
+        BOOST_REQUIRE(!cur.results.empty());
+
+        // Columns are filled directly, results are the same as with row output
+        for (int buf_len: { 1, 13, 0x200 }) {
+            PageSearch search(page, query);
+            ColumnBuffer buffer(buf_len);
+            ColumnBuffer results;
+            size_t size = 0;
+            while (!search.is_done()) {
+                int n = search.read_columns(buffer.columns(), buf_len);
+                BOOST_REQUIRE(n <= buf_len);
+                results.resize(size + n);
+                std::copy(buffer.timestamps.begin(), buffer.timestamps.begin() + n, results.timestamps.begin() + size);
+                std::copy(buffer.params.begin(), buffer.params.begin() + n, results.params.begin() + size);
+                std::copy(buffer.pointers.begin(), buffer.pointers.begin() + n, results.pointers.begin() + size);
+                std::copy(buffer.lengths.begin(), buffer.lengths.begin() + n, results.lengths.begin() + size);
+                size += n;
+            }
+            BOOST_REQUIRE(!search.get_error(nullptr));
+            BOOST_REQUIRE_EQUAL(size, cur.results.size());
+            for (size_t i = 0; i < size; i++) {
+                BOOST_REQUIRE_EQUAL(results.timestamps[i], cur.results[i].timestamp);
+                BOOST_REQUIRE_EQUAL(results.params[i], cur.results[i].param_id);
+                BOOST_REQUIRE_EQUAL(results.lengths[i], 0u);
+                BOOST_REQUIRE_EQUAL(results.pointers[i].float64, cur.results[i].data.float64);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_page_search_mixed_values) {
+    std::vector<char> page_mem;
+    page_mem.resize(sizeof(PageHeader) + 0x40000);
+    auto page = new (page_mem.data()) PageHeader(0, page_mem.size(), 0);
+
+    // Every third element is an integer, chunks can't use double only kernel
+    const int NSERIES = 4;
+    aku_TimeStamp ts = 0u;
+    for (int chunk = 0; chunk < 3; chunk++) {
+        ChunkHeader header;
+        for (int i = 0; i < 300; i++) {
+            ts++;
+            header.paramids.push_back(static_cast<aku_ParamId>(ts % NSERIES));
+            header.timestamps.push_back(ts);
+            header.offsets.push_back(0u);
+            if (ts % 3 == 0) {
+                header.lengths.push_back(AKU_LENGTH_INT64);
+                header.integers.push_back(static_cast<int64_t>(ts)*10);
+            } else {
+                header.lengths.push_back(0u);
+                header.values.push_back(static_cast<double>(ts));
+            }
+        }
+        auto status = page->complete_chunk(header);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    const aku_TimeStamp begin = 150u, end = 750u;
+    std::vector<aku_ParamId> ids = { 1u, 2u };
+    for (auto dir: { AKU_CURSOR_DIR_BACKWARD, AKU_CURSOR_DIR_FORWARD }) {
+        std::vector<aku_TimeStamp> expected;
+        for (aku_TimeStamp t = begin; t <= end; t++) {
+            auto id = t % NSERIES;
+            if (id == 1u || id == 2u) {
+                expected.push_back(t);
+            }
+        }
+        if (dir == AKU_CURSOR_DIR_BACKWARD) {
+            std::reverse(expected.begin(), expected.end());
+        }
+        SearchQuery query(ids, begin, end, dir);
+        for (int buf_len: { 1, 7, 0x100 }) {
+            PageSearch search(page, query);
+            std::vector<CursorResult> buffer(buf_len);
+            std::vector<CursorResult> results;
+            while (!search.is_done()) {
+                int n = search.read(buffer.data(), buf_len);
+                BOOST_REQUIRE(n <= buf_len);
+                results.insert(results.end(), buffer.begin(), buffer.begin() + n);
+            }
+            BOOST_REQUIRE(!search.get_error(nullptr));
+            BOOST_REQUIRE_EQUAL(results.size(), expected.size());
+            for (size_t i = 0; i < results.size(); i++) {
+                auto t = expected[i];
+                BOOST_REQUIRE_EQUAL(results[i].timestamp, t);
+                BOOST_REQUIRE_EQUAL(results[i].param_id, t % NSERIES);
+                if (t % 3 == 0) {
+                    BOOST_REQUIRE_EQUAL(results[i].length, AKU_LENGTH_INT64);
+                    BOOST_REQUIRE_EQUAL(results[i].data.int64, static_cast<int64_t>(t)*10);
+                } else {
+                    BOOST_REQUIRE_EQUAL(results[i].length, 0u);
+                    BOOST_REQUIRE_EQUAL(results[i].data.float64, static_cast<double>(t));
+                }
+            }
+        }
+    }
+}
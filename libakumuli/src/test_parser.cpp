@@ -6,6 +6,8 @@
 
 #include "seriesparser.h"
 
+#include <thread>
+
 using namespace Akumuli;
 
 BOOST_AUTO_TEST_CASE(Test_stringpool_0) {
@@ -102,3 +104,95 @@ BOOST_AUTO_TEST_CASE(Test_seriesparser_5) {
     int status = SeriesParser::to_normal_form(series, series + len, out, out + 10, &pend);
     BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
 }
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_add_existing) {
+
+    SeriesMatcher matcher(10ul);
+    const char* foo = "foo";
+    auto foo_id = matcher.add(foo, foo + 3);
+    BOOST_REQUIRE_EQUAL(foo_id, 10ul);
+    BOOST_REQUIRE_EQUAL(matcher.add(foo, foo + 3), 10ul);
+
+    // Loaded names are not pulled, new ids are greater than loaded ones
+    matcher._add("bar", 100ul);
+    BOOST_REQUIRE_EQUAL(matcher.match("bar", "bar" + 3), 100ul);
+    const char* buz = "buz";
+    BOOST_REQUIRE_EQUAL(matcher.add(buz, buz + 3), 101ul);
+
+    std::vector<SeriesMatcher::SeriesNameT> names;
+    matcher.pull_new_names(&names);
+    BOOST_REQUIRE_EQUAL(names.size(), 2u);
+    BOOST_REQUIRE_EQUAL(std::string(std::get<0>(names[0]), std::get<1>(names[0])), "foo");
+    BOOST_REQUIRE_EQUAL(std::get<2>(names[0]), 10ul);
+    BOOST_REQUIRE_EQUAL(std::string(std::get<0>(names[1]), std::get<1>(names[1])), "buz");
+    BOOST_REQUIRE_EQUAL(std::get<2>(names[1]), 101ul);
+    names.clear();
+    matcher.pull_new_names(&names);
+    BOOST_REQUIRE(names.empty());
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_concurrent) {
+
+    // Table grows while other threads are reading it
+    const int NNAMES = 100000;
+    const int NTHREADS = 4;
+    SeriesMatcher matcher(1ul);
+    std::vector<std::string> names;
+    for (int i = 0; i < NNAMES; i++) {
+        names.push_back("cpu host=" + std::to_string(i));
+    }
+    std::vector<std::vector<uint64_t>> ids(NTHREADS, std::vector<uint64_t>(NNAMES));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NTHREADS; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < NNAMES; i++) {
+                auto const& name = names[(i + t*NNAMES/NTHREADS) % NNAMES];
+                auto begin = name.data();
+                auto end = begin + name.size();
+                auto id = matcher.match(begin, end);
+                if (id == 0) {
+                    id = matcher.add(begin, end);
+                }
+                ids[t][(i + t*NNAMES/NTHREADS) % NNAMES] = id;
+            }
+        });
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    for (int i = 0; i < NNAMES; i++) {
+        auto const& name = names[i];
+        auto id = matcher.match(name.data(), name.data() + name.size());
+        BOOST_REQUIRE(id != 0ul);
+        for (int t = 0; t < NTHREADS; t++) {
+            BOOST_REQUIRE_EQUAL(ids[t][i], id);
+        }
+    }
+    std::vector<SeriesMatcher::SeriesNameT> new_names;
+    matcher.pull_new_names(&new_names);
+    BOOST_REQUIRE_EQUAL(new_names.size(), static_cast<size_t>(NNAMES));
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_bulk_load) {
+
+    SeriesMatcher matcher(1ul);
+    std::vector<std::pair<std::string, uint64_t>> series;
+    for (uint64_t i = 0; i < 10000; i++) {
+        series.push_back(std::make_pair("cpu host=" + std::to_string(i), 1000ul + i*2));
+    }
+    // Duplicates are ignored
+    series.push_back(std::make_pair("cpu host=0", 5ul));
+    matcher._add(series);
+    for (uint64_t i = 0; i < 10000; i++) {
+        auto name = "cpu host=" + std::to_string(i);
+        BOOST_REQUIRE_EQUAL(matcher.match(name.data(), name.data() + name.size()), 1000ul + i*2);
+    }
+    const char* foo = "foo";
+    BOOST_REQUIRE_EQUAL(matcher.match(foo, foo + 3), 0ul);
+    BOOST_REQUIRE_EQUAL(matcher.add(foo, foo + 3), 1000ul + 9999*2 + 1);
+    // Loaded names are not pulled
+    std::vector<SeriesMatcher::SeriesNameT> names;
+    matcher.pull_new_names(&names);
+    BOOST_REQUIRE_EQUAL(names.size(), 1u);
+    BOOST_REQUIRE(matcher.memory_use() > 10000*sizeof(SeriesMatcher::Entry));
+}
@@ -8,6 +8,9 @@
 #include <apr.h>
 #include <vector>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "sequencer.h"
 
@@ -100,10 +103,10 @@ BOOST_AUTO_TEST_CASE(Test_sequencer_correct_busy_behavior)
                 BOOST_REQUIRE_EQUAL(other_lock % 2, 0);
             }
 
-            // future write (ts > last checkpoint)
+            // future write (ts > last checkpoint), checkpoint is postponed until merge
             int other_lock = 0;
             tie(status, other_lock) = seq.add(TimeSeriesValue(static_cast<aku_TimeStamp>(i + SMALL_LOOP), 24u, 0u, 0u));
-            BOOST_REQUIRE_EQUAL(status, AKU_EBUSY);
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
             BOOST_REQUIRE_EQUAL(other_lock % 2, 0);
 
             // merge
@@ -226,3 +229,495 @@ BOOST_AUTO_TEST_CASE(Test_sequencer_search_backward) {
 BOOST_AUTO_TEST_CASE(Test_sequencer_search_forward) {
     test_sequencer_searching(AKU_CURSOR_DIR_FORWARD);
 }
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_add_batch)
+{
+    const int LARGE_LOOP = 1000;
+    const int SMALL_LOOP = 10;
+    const int BATCH_SIZE = 7;
+
+    Sequencer seq(nullptr, {0u, SMALL_LOOP, 0u});
+    Sequencer batch_seq(nullptr, {0u, SMALL_LOOP, 0u});
+
+    vector<CursorResult> expected;
+    vector<CursorResult> actual;
+    auto merge_to = [](Sequencer& s, vector<CursorResult>* out) {
+        RecordingCursor rec;
+        Caller caller;
+        s.merge(caller, &rec);
+        BOOST_REQUIRE_EQUAL(rec.error_code, RecordingCursor::NO_ERROR);
+        copy(rec.results.begin(), rec.results.end(), back_inserter(*out));
+    };
+
+    for (int i = 0; i < LARGE_LOOP; i += BATCH_SIZE) {
+        vector<TimeSeriesValue> batch;
+        for (int j = i; j < i + BATCH_SIZE && j < LARGE_LOOP; j++) {
+            batch.push_back(TimeSeriesValue(static_cast<aku_TimeStamp>(j), j % 3, j, 0u));
+        }
+        if (i > 100 && i % 5 == 0) {
+            // late write
+            batch.insert(batch.begin(), TimeSeriesValue(static_cast<aku_TimeStamp>(i - 100), 0u, 0u, 0u));
+        }
+
+        // Add samples one by one
+        vector<int> expected_statuses;
+        for (auto const& value: batch) {
+            int status;
+            int lock;
+            tie(status, lock) = seq.add(value);
+            expected_statuses.push_back(status);
+            if (lock % 2 == 1) {
+                merge_to(seq, &expected);
+            }
+        }
+
+        // Add the whole batch
+        vector<int> statuses(batch.size(), AKU_SUCCESS);
+        int status;
+        int lock;
+        tie(status, lock) = batch_seq.add_batch(batch.data(), batch.size(), statuses.data());
+        if (lock % 2 == 1) {
+            merge_to(batch_seq, &actual);
+        }
+        BOOST_REQUIRE(statuses == expected_statuses);
+        bool has_errors = find_if(statuses.begin(), statuses.end(), [](int s) { return s != AKU_SUCCESS; }) != statuses.end();
+        BOOST_REQUIRE_EQUAL(status == AKU_SUCCESS, !has_errors);
+    }
+
+    seq.reset();
+    merge_to(seq, &expected);
+    batch_seq.reset();
+    merge_to(batch_seq, &actual);
+
+    BOOST_REQUIRE_EQUAL(actual.size(), expected.size());
+    for (auto k = 0u; k < expected.size(); k++) {
+        BOOST_REQUIRE_EQUAL(actual[k].timestamp, expected[k].timestamp);
+        BOOST_REQUIRE_EQUAL(actual[k].param_id, expected[k].param_id);
+        BOOST_REQUIRE_EQUAL(actual[k].data.ptr, expected[k].data.ptr);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_writer_runs)
+{
+    const int NTHREADS = 4;
+    const int NVALUES = 1000;
+    const int WINDOW = 100;
+
+    aku_Config config = {0u, WINDOW, 0u, 1u};
+    Sequencer seq(nullptr, config);
+
+    // Writes are serialized the same way as in storage shard, writers take
+    // turns so timestamps are ordered (unordered writes could be too late)
+    std::mutex write_mutex;
+    std::condition_variable turn_cvar;
+    aku_TimeStamp next_ts = 0u;
+    vector<CursorResult> merged;
+    auto merge = [&]() {
+        RecordingCursor rec;
+        Caller caller;
+        seq.merge(caller, &rec);
+        BOOST_REQUIRE_EQUAL(rec.error_code, RecordingCursor::NO_ERROR);
+        copy(rec.results.begin(), rec.results.end(), back_inserter(merged));
+    };
+    auto writer = [&](int thread_ix) {
+        for (int i = 0; i < NVALUES; i++) {
+            std::unique_lock<std::mutex> guard(write_mutex);
+            auto ts = static_cast<aku_TimeStamp>(i*NTHREADS + thread_ix);
+            turn_cvar.wait(guard, [&]() { return next_ts == ts; });
+            int status;
+            int lock;
+            tie(status, lock) = seq.add(TimeSeriesValue(ts, thread_ix, ts, 0u));
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            if (lock % 2 == 1) {
+                merge();
+            }
+            next_ts++;
+            turn_cvar.notify_all();
+        }
+    };
+    vector<std::thread> threads;
+    for (int i = 0; i < NTHREADS; i++) {
+        threads.emplace_back(writer, i);
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+
+    // Search collects runs of all writers
+    RecordingCursor cursor;
+    Caller caller;
+    std::vector<aku_ParamId> ids = { 0u, 1u, 2u, 3u };
+    SearchQuery query(ids, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, AKU_CURSOR_DIR_FORWARD);
+    aku_TimeStamp window;
+    int seq_id;
+    std::tie(window, seq_id) = seq.get_window();
+    seq.search(caller, &cursor, query, seq_id);
+    BOOST_REQUIRE_EQUAL(cursor.error_code, RecordingCursor::NO_ERROR);
+    BOOST_REQUIRE(!cursor.results.empty());
+    for (auto i = 1u; i < cursor.results.size(); i++) {
+        BOOST_REQUIRE(cursor.results[i - 1].timestamp < cursor.results[i].timestamp);
+    }
+
+    seq.reset();
+    merge();
+    BOOST_REQUIRE_EQUAL(merged.size(), static_cast<size_t>(NTHREADS*NVALUES));
+    for (auto i = 0u; i < merged.size(); i++) {
+        BOOST_REQUIRE_EQUAL(merged[i].timestamp, i);
+        BOOST_REQUIRE_EQUAL(merged[i].param_id, i % NTHREADS);
+    }
+    BOOST_REQUIRE_EQUAL(cursor.results.back().timestamp, merged.back().timestamp);
+}
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_parallel_merge_and_compress)
+{
+    const size_t NVALUES = 4*Sequencer::MERGE_PARTITION_SIZE;
+    const aku_ParamId NPARAMS = 3u;
+
+    auto fill = [&](Sequencer& seq) {
+        for (size_t i = 0; i < NVALUES; i++) {
+            // adjacent elements are swapped to produce many sorted runs
+            auto ts = static_cast<aku_TimeStamp>(i % 2 == 0 ? i + 1 : i - 1);
+            int status;
+            int lock;
+            tie(status, lock) = seq.add(TimeSeriesValue(ts, ts % NPARAMS, static_cast<double>(ts)));
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            BOOST_REQUIRE_EQUAL(lock, 0);
+        }
+        seq.reset();
+    };
+    auto merge = [&](Sequencer& seq, std::vector<char>* page_mem, size_t* nchunks) {
+        page_mem->resize(sizeof(PageHeader) + 64*NVALUES);
+        auto page = new (page_mem->data()) PageHeader(0, page_mem->size(), 0);
+        aku_TimeStamp last_ts = 0u;
+        auto on_complete = [&](ChunkHeader const& header) {
+            BOOST_REQUIRE(!header.timestamps.empty());
+            BOOST_REQUIRE(last_ts <= header.timestamps.front());
+            last_ts = header.timestamps.back();
+            *nchunks += 1;
+        };
+        auto status = seq.merge_and_compress(page, on_complete);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        RecordingCursor cursor;
+        Caller caller;
+        std::vector<aku_ParamId> ids = { 0u, 1u, 2u };
+        SearchQuery query(ids, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, AKU_CURSOR_DIR_FORWARD);
+        page->search(caller, &cursor, query);
+        BOOST_REQUIRE_EQUAL(cursor.error_code, RecordingCursor::NO_ERROR);
+        return cursor.results;
+    };
+
+    Sequencer seq(nullptr, {0u, 10*NVALUES, 0u, 0u, 0u});
+    Sequencer par_seq(nullptr, {0u, 10*NVALUES, 0u, 0u, 4u});
+    fill(seq);
+    fill(par_seq);
+
+    std::vector<char> page_mem;
+    std::vector<char> par_page_mem;
+    size_t nchunks = 0u;
+    size_t par_nchunks = 0u;
+    auto expected = merge(seq, &page_mem, &nchunks);
+    auto actual = merge(par_seq, &par_page_mem, &par_nchunks);
+
+    BOOST_REQUIRE_EQUAL(nchunks, 1u);
+    BOOST_REQUIRE(par_nchunks > 1u);
+    BOOST_REQUIRE_EQUAL(expected.size(), NVALUES);
+    BOOST_REQUIRE_EQUAL(actual.size(), NVALUES);
+    for (auto k = 0u; k < NVALUES; k++) {
+        BOOST_REQUIRE_EQUAL(actual[k].timestamp, k);
+        BOOST_REQUIRE_EQUAL(actual[k].param_id, k % NPARAMS);
+        BOOST_REQUIRE_EQUAL(actual[k].data.float64, expected[k].data.float64);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_run_arena_recycling)
+{
+    RunArena arena(0u);
+    auto p1 = arena.allocate(1000);
+    auto p2 = arena.allocate(100);
+    BOOST_REQUIRE_EQUAL(arena.get_used(), 1024u + 256u);
+    arena.deallocate(p1, 1000);
+    BOOST_REQUIRE_EQUAL(arena.get_used(), 256u);
+    BOOST_REQUIRE_EQUAL(arena.get_reserved(), 1024u + 256u);
+
+    // Block of the same size is reused
+    auto p3 = arena.allocate(1024);
+    BOOST_REQUIRE_EQUAL(p3, p1);
+    BOOST_REQUIRE_EQUAL(arena.get_reserved(), 1024u + 256u);
+    arena.deallocate(p2, 100);
+    arena.deallocate(p3, 1024);
+    BOOST_REQUIRE_EQUAL(arena.get_used(), 0u);
+
+    // Cached blocks are released if arena goes beyond the limit
+    RunArena small_arena(2048u);
+    auto p4 = small_arena.allocate(1024);
+    small_arena.deallocate(p4, 1024);
+    auto p5 = small_arena.allocate(2048);
+    BOOST_REQUIRE_EQUAL(small_arena.get_reserved(), 2048u);
+    small_arena.deallocate(p5, 2048);
+}
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_memory_budget)
+{
+    const int WINDOW = 1000;
+    const uint32_t BUDGET = 0x2000;
+    const int NVALUES = 10*WINDOW;
+
+    Sequencer seq(nullptr, {1u, WINDOW, BUDGET, 0u, 0u});
+
+    vector<CursorResult> merged;
+    int nmerges = 0;
+    auto merge = [&]() {
+        RecordingCursor rec;
+        Caller caller;
+        seq.merge(caller, &rec);
+        BOOST_REQUIRE_EQUAL(rec.error_code, RecordingCursor::NO_ERROR);
+        copy(rec.results.begin(), rec.results.end(), back_inserter(merged));
+        nmerges++;
+    };
+
+    size_t naccepted = 0u;
+    size_t nbusy = 0u;
+    auto add = [&](aku_TimeStamp ts) {
+        int status;
+        int lock;
+        tie(status, lock) = seq.add(TimeSeriesValue(ts, 0u, ts, 0u));
+        if (status == AKU_SUCCESS) {
+            naccepted++;
+        } else {
+            BOOST_REQUIRE_EQUAL(status, AKU_EBUSY);
+            nbusy++;
+        }
+        if (lock % 2 == 1) {
+            merge();
+        }
+    };
+    for (int i = 0; i < NVALUES; i++) {
+        add(static_cast<aku_TimeStamp>(i));
+        if (i > WINDOW/2 && i % 10 == 0) {
+            // late write
+            add(static_cast<aku_TimeStamp>(i - WINDOW/2));
+        }
+    }
+
+    // Late writes are rejected when budget is exceeded, in order writes are not
+    BOOST_REQUIRE(nbusy > 0u);
+    BOOST_REQUIRE(naccepted >= static_cast<size_t>(NVALUES));
+    // Data older than the late write window is merged by early checkpoints
+    BOOST_REQUIRE(nmerges > NVALUES/WINDOW);
+
+    seq.reset();
+    merge();
+    BOOST_REQUIRE_EQUAL(seq.get_memory_usage(), 0u);
+
+    // Chunks produced by early checkpoints doesn't overlap
+    BOOST_REQUIRE_EQUAL(merged.size(), naccepted);
+    for (auto i = 1u; i < merged.size(); i++) {
+        BOOST_REQUIRE(merged[i - 1].timestamp <= merged[i].timestamp);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_snapshot_search)
+{
+    const int NVALUES = 1000;
+    const int WINDOW = 100;
+
+    Sequencer seq(nullptr, {0u, WINDOW, 0u});
+    auto read_all = [](SequencerSearch& search) {
+        vector<CursorResult> results;
+        CursorResult buf[0x10];
+        while (!search.is_done()) {
+            auto n = search.read(buf, 0x10);
+            copy(buf, buf + n, back_inserter(results));
+        }
+        BOOST_REQUIRE(!search.get_error(nullptr));
+        return results;
+    };
+
+    std::vector<aku_ParamId> ids = { 1u };
+    SearchQuery query(ids, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, AKU_CURSOR_DIR_BACKWARD);
+    int nchecked = 0;
+    for (int i = 0; i < NVALUES; i++) {
+        int status;
+        int lock;
+        tie(status, lock) = seq.add(TimeSeriesValue(static_cast<aku_TimeStamp>(i), i % 2, i, 0u));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        if (lock % 2 == 1) {
+            // Snapshot contains samples that wait for merge
+            SequencerSearch search(seq.get_snapshot(), query);
+
+            // Samples added after snapshot are not visible, merge doesn't abort search
+            tie(status, lock) = seq.add(TimeSeriesValue(static_cast<aku_TimeStamp>(i + 1), 1u, i + 1, 0u));
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            RecordingCursor rec;
+            Caller caller;
+            seq.merge(caller, &rec);
+            BOOST_REQUIRE_EQUAL(rec.error_code, RecordingCursor::NO_ERROR);
+
+            auto results = read_all(search);
+            BOOST_REQUIRE(!results.empty());
+            BOOST_REQUIRE_EQUAL(results.front().timestamp, static_cast<aku_TimeStamp>(i % 2 ? i : i - 1));
+            for (auto k = 0u; k < results.size(); k++) {
+                BOOST_REQUIRE_EQUAL(results[k].param_id, 1u);
+                if (k > 0) {
+                    BOOST_REQUIRE(results[k - 1].timestamp >= results[k].timestamp);
+                }
+            }
+            // Merged data and new data is visible to the next snapshot
+            SequencerSearch next(seq.get_snapshot(), query);
+            auto next_results = read_all(next);
+            BOOST_REQUIRE(!next_results.empty());
+            BOOST_REQUIRE_EQUAL(next_results.front().timestamp, static_cast<aku_TimeStamp>(i + 1));
+            nchecked++;
+        }
+    }
+    BOOST_REQUIRE(nchecked > 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_adaptive_window)
+{
+    const int MAX_WINDOW = 1000;
+    const int NVALUES = 20*MAX_WINDOW;
+
+    aku_Config config = {0u, MAX_WINDOW, 0u, 0u, 0u, 99u, 0u, 0u};
+    Sequencer seq(nullptr, config);
+    BOOST_REQUIRE_EQUAL(seq.get_window_size(), static_cast<aku_Duration>(MAX_WINDOW));
+
+    vector<CursorResult> merged;
+    auto merge = [&]() {
+        RecordingCursor rec;
+        Caller caller;
+        seq.merge(caller, &rec);
+        BOOST_REQUIRE_EQUAL(rec.error_code, RecordingCursor::NO_ERROR);
+        copy(rec.results.begin(), rec.results.end(), back_inserter(merged));
+    };
+
+    size_t naccepted = 0u;
+    auto add = [&](aku_TimeStamp ts) {
+        int status;
+        int lock;
+        tie(status, lock) = seq.add(TimeSeriesValue(ts, 0u, ts, 0u));
+        if (status == AKU_SUCCESS) {
+            naccepted++;
+        } else {
+            BOOST_REQUIRE_EQUAL(status, AKU_ELATE_WRITE);
+        }
+        if (lock % 2 == 1) {
+            merge();
+        }
+        return status;
+    };
+
+    // Window shrinks to fit small lateness
+    for (int i = 0; i < NVALUES; i++) {
+        add(static_cast<aku_TimeStamp>(i));
+        if (i >= 30 && i % 10 == 0) {
+            BOOST_REQUIRE_EQUAL(add(static_cast<aku_TimeStamp>(i - 30)), AKU_SUCCESS);
+        }
+    }
+    BOOST_REQUIRE(seq.get_window_size() > 30u);
+    BOOST_REQUIRE(seq.get_window_size() < 100u);
+
+    // Window grows if late writes are rejected
+    size_t nlate = 0u;
+    for (int i = NVALUES; i < 2*NVALUES; i++) {
+        add(static_cast<aku_TimeStamp>(i));
+        if (i % 5 == 0) {
+            if (add(static_cast<aku_TimeStamp>(i - 500)) == AKU_SUCCESS) {
+                nlate++;
+            }
+        }
+    }
+    BOOST_REQUIRE(seq.get_window_size() >= 500u);
+    BOOST_REQUIRE(seq.get_window_size() <= static_cast<aku_Duration>(MAX_WINDOW));
+    BOOST_REQUIRE(nlate > 0u);
+
+    seq.reset();
+    merge();
+
+    // Chunks doesn't overlap when window changes
+    BOOST_REQUIRE_EQUAL(merged.size(), naccepted);
+    for (auto i = 1u; i < merged.size(); i++) {
+        BOOST_REQUIRE(merged[i - 1].timestamp <= merged[i].timestamp);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_bulk_runs)
+{
+    const int NBLOCKS = 4;
+    const int BLOCK_SIZE = 0x400;
+    const int NVALUES = NBLOCKS*BLOCK_SIZE;
+
+    Sequencer seq(nullptr, {0u, 10*NVALUES, 0u});
+
+    // Blocks are interleaved, each block is added as a single run
+    int block_order[NBLOCKS] = { 2, 0, 3, 1 };
+    for (auto k: block_order) {
+        vector<TimeSeriesValue> block;
+        for (int i = k; i < NVALUES; i += NBLOCKS) {
+            block.push_back(TimeSeriesValue(static_cast<aku_TimeStamp>(i), 1u, i, 0u));
+        }
+        vector<int> statuses(block.size(), AKU_SUCCESS);
+        int status;
+        int lock;
+        tie(status, lock) = seq.add_batch(block.data(), block.size(), statuses.data());
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(lock % 2, 0);
+    }
+    BOOST_REQUIRE_EQUAL(seq.get_snapshot()->runs.size(), static_cast<size_t>(NBLOCKS));
+
+    // Single samples are added to the same runs
+    for (int i = 0; i < NBLOCKS; i++) {
+        int status;
+        int lock;
+        tie(status, lock) = seq.add(TimeSeriesValue(static_cast<aku_TimeStamp>(NVALUES + i), 0u, 0u, 0u));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    seq.reset();
+    RecordingCursor rec;
+    Caller caller;
+    seq.merge(caller, &rec);
+    BOOST_REQUIRE_EQUAL(rec.error_code, RecordingCursor::NO_ERROR);
+    BOOST_REQUIRE_EQUAL(rec.results.size(), static_cast<size_t>(NVALUES + NBLOCKS));
+    for (auto i = 0u; i < rec.results.size(); i++) {
+        BOOST_REQUIRE_EQUAL(rec.results[i].timestamp, static_cast<aku_TimeStamp>(i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_sequencer_memory_stats)
+{
+    const int NVALUES = 0x1000;
+    Sequencer seq(nullptr, {0u, 10*NVALUES, 0u});
+
+    for (int i = 0; i < NVALUES; i++) {
+        // out of order writes create several runs
+        aku_TimeStamp ts = static_cast<aku_TimeStamp>(i % 2 ? i : NVALUES - i);
+        int status;
+        int lock;
+        tie(status, lock) = seq.add(TimeSeriesValue(ts, 0u, ts, 0u));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+
+    aku_MemoryStats stats = {};
+    seq.get_memory_stats(&stats);
+    BOOST_REQUIRE(stats.sequencer_runs > 1u);
+    BOOST_REQUIRE(stats.sequencer_run_bytes >= NVALUES*sizeof(TimeSeriesValue));
+    BOOST_REQUIRE(stats.sequencer_max_run_bytes <= stats.sequencer_run_bytes);
+    BOOST_REQUIRE_EQUAL(stats.sequencer_ready, 0u);
+
+    seq.reset();
+    stats = {};
+    seq.get_memory_stats(&stats);
+    BOOST_REQUIRE_EQUAL(stats.sequencer_runs, 0u);
+    BOOST_REQUIRE(stats.sequencer_ready > 1u);
+    BOOST_REQUIRE(stats.sequencer_ready_bytes >= NVALUES*sizeof(TimeSeriesValue));
+
+    RecordingCursor rec;
+    Caller caller;
+    seq.merge(caller, &rec);
+    BOOST_REQUIRE_EQUAL(rec.results.size(), static_cast<size_t>(NVALUES));
+    stats = {};
+    seq.get_memory_stats(&stats);
+    BOOST_REQUIRE_EQUAL(stats.sequencer_runs, 0u);
+    BOOST_REQUIRE_EQUAL(stats.sequencer_ready, 0u);
+}
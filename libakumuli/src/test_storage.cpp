@@ -4,6 +4,9 @@
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <vector>
+#include <fstream>
+#include <tuple>
+#include <algorithm>
 
 #include "storage.h"
 
@@ -18,6 +21,33 @@ struct AkumuliInitializer {
 
 void logger_stub(int tag, const char* msg) {}
 
+void create_tmp_file(const char* file_path, int len) {
+    apr_pool_t* pool = NULL;
+    apr_file_t* file = NULL;
+    apr_status_t status = apr_pool_create(&pool, NULL);
+    if (status == APR_SUCCESS) {
+        status = apr_file_open(&file, file_path, APR_WRITE|APR_CREATE, APR_OS_DEFAULT, pool);
+        if (status == APR_SUCCESS) {
+            status = apr_file_trunc(file, len);
+            if (status == APR_SUCCESS) {
+                status = apr_file_close(file);
+            }
+        }
+    }
+    if (pool)
+        apr_pool_destroy(pool);
+    if (status != APR_SUCCESS) {
+        BOOST_FAIL(apr_error_message(status));
+    }
+}
+
+void delete_tmp_file(const char* file_path) {
+    apr_pool_t* pool = NULL;
+    apr_pool_create(&pool, NULL);
+    apr_file_remove(file_path, pool);
+    apr_pool_destroy(pool);
+}
+
 AkumuliInitializer initializer;
 
 BOOST_AUTO_TEST_CASE(Test_metadata_storage_volumes_config) {
@@ -54,3 +84,411 @@ BOOST_AUTO_TEST_CASE(Test_metadata_storage_numeric_config) {
     BOOST_REQUIRE_EQUAL(creation_datetime, actual_dt);
 }
 
+BOOST_AUTO_TEST_CASE(Test_metadata_storage_series_names) {
+
+    auto db = std::make_shared<MetadataStorage>(":memory:", &logger_stub);
+    SeriesMatcher matcher(1ul);
+    std::vector<std::string> names;
+    for (int i = 0; i < 10000; i++) {
+        names.push_back("cpu host=h" + std::to_string(i) + " region=it's");
+    }
+    names.push_back("metric");  // no tags
+    for (auto const& name: names) {
+        matcher.add(name.data(), name.data() + name.size());
+    }
+    std::vector<SeriesMatcher::SeriesNameT> items;
+    matcher.pull_new_names(&items);
+    BOOST_REQUIRE_EQUAL(items.size(), names.size());
+    db->insert_new_names(items);
+
+    SeriesMatcher loaded(1ul);
+    db->load_matcher_data(loaded);
+    for (auto const& name: names) {
+        auto expected = matcher.match(name.data(), name.data() + name.size());
+        BOOST_REQUIRE_NE(expected, 0u);
+        BOOST_REQUIRE_EQUAL(loaded.match(name.data(), name.data() + name.size()), expected);
+    }
+    // Duplicate ids are rejected, transaction is rolled back
+    BOOST_REQUIRE_THROW(db->insert_new_names(items), std::runtime_error);
+    SeriesMatcher reloaded(1ul);
+    db->load_matcher_data(reloaded);
+    BOOST_REQUIRE_EQUAL(reloaded.entries.size(), names.size());
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_volume_catalog_select) {
+
+    VolumeCatalog catalog;
+    catalog.resize(3);
+
+    PageBoundingBox first;
+    first.min_id = 10;
+    first.max_id = 20;
+    first.min_timestamp = 100;
+    first.max_timestamp = 200;
+    catalog.update(0, first);
+
+    PageBoundingBox second;
+    second.min_id = 10;
+    second.max_id = 20;
+    second.min_timestamp = 200;
+    second.max_timestamp = 300;
+    catalog.update(1, second);
+
+    // third volume is empty
+
+    std::vector<size_t> actual;
+    catalog.select(SearchQuery(15, 150, 160, AKU_CURSOR_DIR_FORWARD), &actual);
+    BOOST_REQUIRE_EQUAL(actual.size(), 1u);
+    BOOST_REQUIRE_EQUAL(actual.at(0), 0u);
+
+    actual.clear();
+    catalog.select(SearchQuery(15, 150, 250, AKU_CURSOR_DIR_BACKWARD), &actual);
+    BOOST_REQUIRE_EQUAL(actual.size(), 2u);
+    BOOST_REQUIRE_EQUAL(actual.at(0), 0u);
+    BOOST_REQUIRE_EQUAL(actual.at(1), 1u);
+
+    // time range doesn't overlap
+    actual.clear();
+    catalog.select(SearchQuery(15, 301, 400, AKU_CURSOR_DIR_FORWARD), &actual);
+    BOOST_REQUIRE(actual.empty());
+
+    // param id is out of range
+    actual.clear();
+    catalog.select(SearchQuery(21, 0, AKU_MAX_TIMESTAMP, AKU_CURSOR_DIR_FORWARD), &actual);
+    BOOST_REQUIRE(actual.empty());
+    catalog.select(SearchQuery(9, 0, AKU_MAX_TIMESTAMP, AKU_CURSOR_DIR_FORWARD), &actual);
+    BOOST_REQUIRE(actual.empty());
+}
+
+BOOST_AUTO_TEST_CASE(Test_flush_scheduler) {
+    const char* tmp_file = "test_flush_scheduler_volume";
+    const int volume_size = sizeof(PageHeader) + 0x10000;
+    delete_tmp_file(tmp_file);
+    create_tmp_file(tmp_file, volume_size);
+    {
+        aku_Config config = { 1u, 1000u, 0u };
+        auto volume = std::make_shared<Volume>(tmp_file, config, false, &logger_stub);
+        new (volume->get_page()) PageHeader(0, volume_size, 0);
+        volume->open();
+        BOOST_REQUIRE_EQUAL(volume->get_dirty_size(), 0u);
+
+        typedef FlushScheduler::Clock Clock;
+        FlushScheduler flusher(std::chrono::milliseconds(100), 0x100);
+        BOOST_REQUIRE(!flusher.has_pending());
+
+        double value = 1.0;
+        aku_MemRange range = { &value, sizeof(value) };
+        BOOST_REQUIRE_EQUAL(volume->get_page()->add_entry(1u, 100u, range), AKU_WRITE_STATUS_SUCCESS);
+        auto dirty = volume->get_dirty_size();
+        BOOST_REQUIRE_EQUAL(dirty, sizeof(aku_Entry) + sizeof(value) + sizeof(aku_EntryOffset));
+
+        // Small write, latency limit isn't reached
+        auto now = Clock::now();
+        flusher.add(volume, dirty, now);
+        BOOST_REQUIRE(flusher.has_pending());
+        BOOST_REQUIRE(!flusher.is_ready(now));
+        BOOST_REQUIRE(flusher.is_ready(now + std::chrono::milliseconds(100)));
+
+        // Many writes, bytes limit is reached
+        for (int i = 0; i < 0x10; i++) {
+            BOOST_REQUIRE_EQUAL(volume->get_page()->add_entry(1u, 101u + i, range), AKU_WRITE_STATUS_SUCCESS);
+        }
+        flusher.add(volume, volume->get_dirty_size(), now + std::chrono::milliseconds(10));
+        BOOST_REQUIRE(flusher.is_ready(now + std::chrono::milliseconds(10)));
+        // Deadline is defined by the oldest write
+        BOOST_REQUIRE(flusher.deadline() == now + std::chrono::milliseconds(100));
+
+        flusher.flush();
+        BOOST_REQUIRE(!flusher.has_pending());
+        BOOST_REQUIRE_EQUAL(volume->get_dirty_size(), 0u);
+        BOOST_REQUIRE_EQUAL(flusher.durable_ts_.load(), 116u);
+        BOOST_REQUIRE_EQUAL(flusher.n_flushes_.load(), 1u);
+    }
+    delete_tmp_file(tmp_file);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_num_shards) {
+    // Sharding disabled
+    BOOST_REQUIRE_EQUAL(Storage::get_num_shards(0u, 4u), 1u);
+    BOOST_REQUIRE_EQUAL(Storage::get_num_shards(1u, 4u), 1u);
+    BOOST_REQUIRE_EQUAL(Storage::get_num_shards(2u, 4u), 2u);
+    // Each shard should have at least one volume
+    BOOST_REQUIRE_EQUAL(Storage::get_num_shards(8u, 3u), 3u);
+    BOOST_REQUIRE_EQUAL(Storage::get_num_shards(8u, 1u), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_last_value_table) {
+    LastValueTable table;
+    LastValueTable::Value val;
+    BOOST_REQUIRE(!table.get(1u, &val));
+
+    table.update(1u, 100u, 1.0);
+    table.update(1u, 90u, 2.0);  // late write doesn't change the last value
+    BOOST_REQUIRE(table.get(1u, &val));
+    BOOST_REQUIRE_EQUAL(val.timestamp, 100u);
+    BOOST_REQUIRE_EQUAL(val.value, 1.0);
+
+    std::vector<TimeSeriesValue> batch = {
+        TimeSeriesValue(101u, 2u, 3.0),
+        TimeSeriesValue(102u, 1u, 4.0),
+        TimeSeriesValue(103u, 2u, 5.0),
+        TimeSeriesValue(104u, 1u, 6.0),
+    };
+    std::vector<aku_Status> statuses = { AKU_SUCCESS, AKU_SUCCESS, AKU_SUCCESS, AKU_ELATE_WRITE };
+    table.update(batch.data(), batch.size(), statuses.data());
+    BOOST_REQUIRE(table.get(1u, &val));
+    BOOST_REQUIRE_EQUAL(val.timestamp, 102u);
+    BOOST_REQUIRE_EQUAL(val.value, 4.0);
+    BOOST_REQUIRE(table.get(2u, &val));
+    BOOST_REQUIRE_EQUAL(val.timestamp, 103u);
+    BOOST_REQUIRE_EQUAL(val.value, 5.0);
+
+    // Absent series are remembered until the next write
+    table.set_absent(1u);
+    BOOST_REQUIRE(!table.is_absent(1u));
+    table.set_absent(3u);
+    table.set_absent(4u);
+    BOOST_REQUIRE(table.is_absent(3u));
+    BOOST_REQUIRE(table.is_absent(4u));
+    table.update(3u, 105u, 7.0);
+    BOOST_REQUIRE(!table.is_absent(3u));
+    BOOST_REQUIRE(table.get(3u, &val));
+    std::vector<TimeSeriesValue> batch4 = { TimeSeriesValue(106u, 4u, 8.0) };
+    std::vector<aku_Status> statuses4 = { AKU_SUCCESS };
+    table.update(batch4.data(), batch4.size(), statuses4.data());
+    BOOST_REQUIRE(!table.is_absent(4u));
+    BOOST_REQUIRE(table.get(4u, &val));
+}
+
+BOOST_AUTO_TEST_CASE(Test_rollup_store) {
+    auto metadata = std::make_shared<MetadataStorage>(":memory:", &logger_stub);
+    auto make_chunk = [](aku_TimeStamp begin, aku_TimeStamp end) {
+        ChunkHeader header;
+        for (aku_TimeStamp ts = begin; ts < end; ts++) {
+            header.timestamps.push_back(ts);
+            header.paramids.push_back(1u + ts % 2);
+            header.lengths.push_back(0u);
+            header.offsets.push_back(0u);
+            header.values.push_back(static_cast<double>(ts));
+        }
+        return header;
+    };
+    // Expected rollups of param 1 (even timestamps) in range [begin, end)
+    auto check = [](Aggregator const& agg, aku_TimeStamp begin, aku_TimeStamp end) {
+        auto results = agg.get_results(AKU_CURSOR_DIR_FORWARD);
+        BOOST_REQUIRE_EQUAL(results.size(), (end - begin) / agg.width_);
+        for (auto const& kv: results) {
+            auto bucket = kv.first.first;
+            BOOST_REQUIRE_EQUAL(kv.first.second, 1u);
+            BOOST_REQUIRE_EQUAL(kv.second.count, agg.width_ / 2);
+            BOOST_REQUIRE_EQUAL(kv.second.min, static_cast<double>(bucket));
+            BOOST_REQUIRE_EQUAL(kv.second.max, static_cast<double>(bucket + agg.width_ - 2));
+            double sum = 0.0;
+            for (auto ts = bucket; ts < bucket + agg.width_; ts += 2) {
+                sum += static_cast<double>(ts);
+            }
+            BOOST_REQUIRE_EQUAL(kv.second.sum, sum);
+        }
+    };
+    {
+        RollupStore rollups(metadata, { 100u, 10u });
+        BOOST_REQUIRE_EQUAL(rollups.select_tier(200u), 1);
+        BOOST_REQUIRE_EQUAL(rollups.select_tier(30u), 0);
+        BOOST_REQUIRE_EQUAL(rollups.select_tier(7u), -1);
+        BOOST_REQUIRE_EQUAL(rollups.get_tier(0).second, AKU_MAX_TIMESTAMP);
+
+        rollups.add(make_chunk(5u, 1005u));
+        BOOST_REQUIRE_EQUAL(rollups.get_tier(0).second, 10u);
+        BOOST_REQUIRE_EQUAL(rollups.get_tier(1).second, 100u);
+        rollups.save();
+        // Saved and pending buckets are combined
+        rollups.add(make_chunk(1005u, 1500u));
+
+        Aggregator tier1(200u);
+        rollups.aggregate(1, 100u, 1500u, { 1u }, &tier1);
+        BOOST_REQUIRE_EQUAL(tier1.index_.size(), 8u);  // [0, 1600), first and last buckets are partial
+        Aggregator tier0(10u);
+        rollups.aggregate(0, 100u, 1500u, { 1u }, &tier0);
+        check(tier0, 100u, 1500u);
+        rollups.save();
+    }
+    {
+        // Rollups are persistent, removed tier is deleted
+        RollupStore rollups(metadata, { 10u });
+        BOOST_REQUIRE_EQUAL(rollups.get_tier(0).second, 10u);
+        Aggregator tier0(10u);
+        rollups.aggregate(0, 10u, 1490u, { 1u }, &tier0);
+        check(tier0, 10u, 1490u);
+    }
+    {
+        RollupStore rollups(metadata, { 100u });
+        BOOST_REQUIRE_EQUAL(rollups.get_tier(0).second, AKU_MAX_TIMESTAMP);
+        Aggregator tier0(100u);
+        rollups.aggregate(0, 0u, 2000u, { 1u, 2u }, &tier0);
+        BOOST_REQUIRE(tier0.index_.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_backup_duplicate_names) {
+    const char* metadata = "/tmp/test_backup_dup.akumuli";
+    const char* moved_dir = "/tmp/test_backup_dup_moved";
+    const char* backup_dir = "/tmp/test_backup_dup_backup";
+    auto status = Storage::new_storage("test_backup_dup", "/tmp", "/tmp", 2, 0x100u, 10000u, 0x100000u, &logger_stub);
+    BOOST_REQUIRE_EQUAL(status, APR_SUCCESS);
+
+    // Second volume is moved to another directory under the name of the first one
+    apr_pool_t* pool = NULL;
+    apr_pool_create(&pool, NULL);
+    apr_dir_make(moved_dir, APR_OS_DEFAULT, pool);
+    std::string moved = std::string(moved_dir) + "/test_backup_dup_0.volume";
+    BOOST_REQUIRE_EQUAL(apr_file_rename("/tmp/test_backup_dup_1.volume", moved.c_str(), pool), APR_SUCCESS);
+    {
+        MetadataStorage db(metadata, &logger_stub);
+        db.set_volumes({ std::make_pair(0, std::string("/tmp/test_backup_dup_0.volume")),
+                         std::make_pair(1, moved) });
+    }
+
+    aku_MaintenanceStats stats;
+    BOOST_REQUIRE_EQUAL(Storage::backup_storage(metadata, backup_dir, 0u, &logger_stub, &stats), AKU_EBAD_ARG);
+
+    Storage::remove_storage(metadata, &logger_stub);
+    apr_dir_remove(backup_dir, pool);
+    apr_dir_remove(moved_dir, pool);
+    apr_pool_destroy(pool);
+}
+
+BOOST_AUTO_TEST_CASE(Test_offline_maintenance) {
+    typedef std::tuple<aku_TimeStamp, aku_ParamId, double> Row;
+    const char* metadata = "/tmp/test_offline.akumuli";
+    const char* volume = "/tmp/test_offline_0.volume";
+    const char* backup_dir = "/tmp/test_offline_backup";
+    const char* backup_metadata = "/tmp/test_offline_backup/test_offline.akumuli";
+    const char* export_file = "/tmp/test_offline.columns";
+    const aku_TimeStamp NVALUES = 1000u;
+
+    auto status = Storage::new_storage("test_offline", "/tmp", "/tmp", 1, 0x100u, 10000u, 0x100000u, &logger_stub);
+    BOOST_REQUIRE_EQUAL(status, APR_SUCCESS);
+    {
+        // Two chunks that overlap in time, doubles and integers
+        MemoryMappedFile mmap(volume, false, &logger_stub);
+        auto page = reinterpret_cast<PageHeader*>(mmap.get_pointer());
+        for (aku_TimeStamp k = 0; k < 2; k++) {
+            ChunkHeader header;
+            for (aku_TimeStamp ts = k; ts < NVALUES; ts += 2) {
+                header.timestamps.push_back(ts);
+                header.paramids.push_back(1u + ts % 3);
+                header.offsets.push_back(0u);
+                if (k == 0) {
+                    header.lengths.push_back(0u);
+                    header.values.push_back(static_cast<double>(ts));
+                } else {
+                    header.lengths.push_back(AKU_LENGTH_INT64);
+                    header.integers.push_back(static_cast<int64_t>(ts));
+                }
+            }
+            BOOST_REQUIRE_EQUAL(page->complete_chunk(header), AKU_SUCCESS);
+        }
+        mmap.flush();
+    }
+
+    auto read_export = [](const char* path) {
+        std::vector<Row> rows;
+        std::ifstream input(path, std::ios::binary);
+        aku_ColumnBlockHeader block;
+        while (input.read(reinterpret_cast<char*>(&block), sizeof(block))) {
+            BOOST_REQUIRE_EQUAL(block.magic, AKU_COLUMN_BLOCK_MAGIC);
+            std::vector<uint64_t> timestamps(block.count), ids(block.count), values(block.count);
+            std::vector<uint8_t> types((block.count + 7u) & ~7u);
+            input.read(reinterpret_cast<char*>(timestamps.data()), block.count*sizeof(uint64_t));
+            input.read(reinterpret_cast<char*>(ids.data()), block.count*sizeof(uint64_t));
+            input.read(reinterpret_cast<char*>(values.data()), block.count*sizeof(uint64_t));
+            input.read(reinterpret_cast<char*>(types.data()), types.size());
+            BOOST_REQUIRE(input.good());
+            BOOST_REQUIRE_EQUAL(block.min_timestamp, timestamps.front());
+            BOOST_REQUIRE_EQUAL(block.max_timestamp, timestamps.back());
+            for (uint32_t i = 0; i < block.count; i++) {
+                double value;
+                if (types[i] == 1u) {
+                    value = static_cast<double>(static_cast<int64_t>(values[i]));
+                } else {
+                    memcpy(&value, &values[i], sizeof(value));
+                }
+                rows.push_back(std::make_tuple(timestamps[i], ids[i], value));
+            }
+        }
+        std::sort(rows.begin(), rows.end());
+        return rows;
+    };
+
+    // Time range and ids are filtered
+    aku_MaintenanceStats stats;
+    BOOST_REQUIRE_EQUAL(Storage::export_columns(metadata, export_file, 100u, 199u, { 2u, 1u }, 0u,
+                                                &logger_stub, &stats), AKU_SUCCESS);
+    std::vector<Row> expected;
+    for (aku_TimeStamp ts = 100u; ts < 200u; ts++) {
+        if (1u + ts % 3 != 3u) {
+            expected.push_back(std::make_tuple(ts, 1u + ts % 3, static_cast<double>(ts)));
+        }
+    }
+    auto actual = read_export(export_file);
+    BOOST_REQUIRE(actual == expected);
+    BOOST_REQUIRE_EQUAL(stats.n_elements, expected.size());
+    BOOST_REQUIRE_EQUAL(stats.n_chunks, 2u);
+
+    BOOST_REQUIRE_EQUAL(Storage::export_columns(metadata, export_file, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, {}, 0u,
+                                                &logger_stub, &stats), AKU_SUCCESS);
+    auto all_rows = read_export(export_file);
+    BOOST_REQUIRE_EQUAL(all_rows.size(), NVALUES);
+
+    // Compacted volume contains the same data in non overlapping chunks of compression_threshold elements
+    BOOST_REQUIRE_EQUAL(Storage::compact_storage(metadata, AKU_CODEC_SMALLEST, 0u, &logger_stub, &stats), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(stats.n_volumes, 1u);
+    BOOST_REQUIRE_EQUAL(stats.n_skipped_volumes, 0u);
+    BOOST_REQUIRE_EQUAL(stats.n_elements, NVALUES);
+    {
+        MemoryMappedFile mmap(volume, false, &logger_stub);
+        auto page = reinterpret_cast<PageHeader*>(mmap.get_pointer());
+        BOOST_REQUIRE_EQUAL(page->count, 2*((NVALUES + 0xFFu)/0x100u));
+        BOOST_REQUIRE_EQUAL(page->bbox.min_timestamp, 0u);
+        BOOST_REQUIRE_EQUAL(page->bbox.max_timestamp, NVALUES - 1);
+    }
+    BOOST_REQUIRE_EQUAL(Storage::export_columns(metadata, export_file, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP, {}, 0u,
+                                                &logger_stub, &stats), AKU_SUCCESS);
+    BOOST_REQUIRE(read_export(export_file) == all_rows);
+    BOOST_REQUIRE_EQUAL(stats.n_chunks, (NVALUES + 0xFFu)/0x100u);
+
+    // Backup points to copied volumes, it contains names that are only in the WAL
+    // of the metadata file (connection isn't closed)
+    std::string series_name = "cpu host=backup";
+    aku_ParamId series_id = 0u;
+    {
+        MetadataStorage live(metadata, &logger_stub);
+        SeriesMatcher matcher(1ul);
+        series_id = matcher.add(series_name.data(), series_name.data() + series_name.size());
+        std::vector<SeriesMatcher::SeriesNameT> items;
+        matcher.pull_new_names(&items);
+        live.insert_new_names(items);
+        BOOST_REQUIRE_EQUAL(Storage::backup_storage(metadata, backup_dir, 0u, &logger_stub, &stats), AKU_SUCCESS);
+    }
+    {
+        MetadataStorage db(backup_metadata, &logger_stub);
+        auto volumes = db.get_volumes();
+        BOOST_REQUIRE_EQUAL(volumes.size(), 1u);
+        BOOST_REQUIRE_EQUAL(volumes.at(0).second, std::string(backup_dir) + "/test_offline_0.volume");
+        SeriesMatcher loaded(1ul);
+        db.load_matcher_data(loaded);
+        BOOST_REQUIRE_EQUAL(loaded.match(series_name.data(), series_name.data() + series_name.size()), series_id);
+    }
+    BOOST_REQUIRE_EQUAL(Storage::export_columns(backup_metadata, export_file, AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP,
+                                                {}, 0u, &logger_stub, &stats), AKU_SUCCESS);
+    BOOST_REQUIRE(read_export(export_file) == all_rows);
+
+    Storage::remove_storage(backup_metadata, &logger_stub);
+    Storage::remove_storage(metadata, &logger_stub);
+    delete_tmp_file(export_file);
+    apr_pool_t* pool = NULL;
+    apr_pool_create(&pool, NULL);
+    apr_dir_remove(backup_dir, pool);
+    apr_pool_destroy(pool);
+}
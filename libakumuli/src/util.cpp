@@ -18,12 +18,15 @@
 #include "util.h"
 #include <stdio.h>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
 #include <thread>
 #include <sstream>
 #include <iostream>
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "akumuli_def.h"
 
 namespace Akumuli
@@ -109,13 +112,17 @@ apr_status_t MemoryMappedFile::map_file() {
             if (status_ == APR_SUCCESS) {
                 success_count++;
                 apr_int32_t flags = APR_MMAP_WRITE | APR_MMAP_READ;
-                if (enable_huge_tlb_) {
-                    flags |= MAP_HUGETLB;
-                }
                 status_ = apr_mmap_create(&mmap_, fp_, 0, finfo_.size, flags, mem_pool_);
                 if (status_ == APR_SUCCESS)
                     success_count++; }}}
 
+    if (status_ == APR_SUCCESS && enable_huge_tlb_) {
+        // MAP_HUGETLB works only for anonymous mappings, files from hugetlbfs
+        // are always mapped by huge pages, other filesystems can use
+        // transparent huge pages on request
+        advise_mem(mmap_->mm, mmap_->size, AKU_MEM_HUGEPAGE);
+    }
+
     if (status_ != APR_SUCCESS) {
         free_resources(success_count);
         stringstream err;
@@ -234,8 +241,10 @@ apr_status_t MemoryMappedFile::flush() {
 }
 
 apr_status_t MemoryMappedFile::flush(size_t from, size_t to) {
-    void* p = align_to_page(static_cast<char*>(mmap_->mm) + from, get_page_size());
-    size_t len = to - from;
+    char* begin = static_cast<char*>(mmap_->mm) + from;
+    void* p = align_to_page(begin, get_page_size());
+    // msync requires page aligned address, range is extended to the page boundary
+    size_t len = to - from + static_cast<size_t>(begin - static_cast<char*>(p));
     if (msync(p, len, MS_SYNC) == 0) {
         return AKU_SUCCESS;
     }
@@ -271,7 +280,11 @@ void* align_to_page(void* ptr, size_t page_size) {
 
 void prefetch_mem(const void* ptr, size_t mem_size) {
     auto aptr = align_to_page(ptr, get_page_size());
-    int err = madvise(const_cast<void*>(aptr), mem_size, MADV_WILLNEED);
+    mem_size += static_cast<const char*>(ptr) - static_cast<const char*>(aptr);
+    int err = 0;
+    if (madvise(const_cast<void*>(aptr), mem_size, MADV_WILLNEED) != 0) {
+        err = errno;
+    }
     switch(err) {
     case EBADF:
         AKU_PANIC("(madvise) the map exists, but the area maps something that isn't a file");
@@ -281,9 +294,12 @@ void prefetch_mem(const void* ptr, size_t mem_size) {
         AKU_PANIC("(madvise) the value is negative | addr is not page-aligned | advice is not a valid value |...");
         break;
 
+    case ENOMEM: // Not enough memory: paging in failed | addresses are not mapped.
+        // Range can't be touched safely
+        return;
+
     case EAGAIN: //  A kernel resource was temporarily unavailable.
     case EIO:    // Paging  in  this  area  would  exceed  the process's maximum resident set size.
-    case ENOMEM: // Not enough memory: paging in failed.
     default:
         break;
     };
@@ -297,6 +313,111 @@ void prefetch_mem(const void* ptr, size_t mem_size) {
     }
 }
 
+void advise_mem(const void* ptr, size_t mem_size, MemAdvice advice) {
+    auto aptr = align_to_page(ptr, get_page_size());
+    mem_size += static_cast<const char*>(ptr) - static_cast<const char*>(aptr);
+    int flag = MADV_NORMAL;
+    switch(advice) {
+    case AKU_MEM_RANDOM:
+        flag = MADV_RANDOM;
+        break;
+    case AKU_MEM_WILLNEED:
+        flag = MADV_WILLNEED;
+        break;
+    case AKU_MEM_SEQUENTIAL:
+        flag = MADV_SEQUENTIAL;
+        break;
+    case AKU_MEM_HUGEPAGE:
+#ifdef MADV_HUGEPAGE
+        flag = MADV_HUGEPAGE;
+        break;
+#else
+        return;
+#endif
+    case AKU_MEM_NORMAL:
+        break;
+    };
+    madvise(const_cast<void*>(aptr), mem_size, flag);
+}
+
+// <numaif.h> is a part of libnuma, constants are defined by the kernel ABI
+static const int AKU_MPOL_DEFAULT = 0;
+static const int AKU_MPOL_PREFERRED = 1;
+static const int AKU_MPOL_INTERLEAVE = 3;
+static const int AKU_MAX_NUMA_NODES = 1024;
+
+static int read_numa_nodes_count() {
+    // Format of the file is a list of ranges, e.g. "0-1,3"
+    FILE* file = fopen("/sys/devices/system/node/online", "r");
+    if (file == nullptr) {
+        return 1;
+    }
+    int max_node = 0;
+    int first = 0, last = 0;
+    char sep = 0;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(file, "%c", &sep) == 1 && sep == '-') {
+            if (fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+            if (fscanf(file, "%c", &sep) != 1) {
+                sep = 0;
+            }
+        }
+        max_node = std::max(max_node, last);
+        if (sep != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return std::min(max_node + 1, AKU_MAX_NUMA_NODES);
+}
+
+int get_numa_nodes_count() {
+    static const int count = read_numa_nodes_count();
+    return count;
+}
+
+int get_numa_node() {
+    if (get_numa_nodes_count() < 2) {
+        return 0;
+    }
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return 0;
+    }
+    return static_cast<int>(node);
+}
+
+void set_numa_policy(NumaPolicy policy, int node) {
+    int nnodes = get_numa_nodes_count();
+    if (nnodes < 2) {
+        return;
+    }
+    const size_t BITS = sizeof(unsigned long)*8;
+    unsigned long mask[AKU_MAX_NUMA_NODES/BITS] = {};
+    int mode = AKU_MPOL_DEFAULT;
+    switch (policy) {
+    case AKU_NUMA_PREFERRED:
+        mode = AKU_MPOL_PREFERRED;
+        node = std::min(std::max(node, 0), nnodes - 1);
+        mask[node/BITS] |= 1ul << (node % BITS);
+        break;
+    case AKU_NUMA_INTERLEAVE:
+        mode = AKU_MPOL_INTERLEAVE;
+        for (int i = 0; i < nnodes; i++) {
+            mask[i/BITS] |= 1ul << (i % BITS);
+        }
+        break;
+    case AKU_NUMA_DEFAULT:
+        break;
+    };
+    // Error means that policy stays the same, this is not critical
+    syscall(SYS_set_mempolicy, mode, mode == AKU_MPOL_DEFAULT ? nullptr : mask,
+            static_cast<unsigned long>(AKU_MAX_NUMA_NODES));
+}
+
 static const unsigned char MINCORE_MASK = 1;
 
 PageInfo::PageInfo(const void* start_addr, size_t len_bytes)
@@ -319,7 +440,7 @@ bool PageInfo::swapped() {
 
 aku_Status PageInfo::refresh(const void *addr) {
     base_addr_ = align_to_page(addr, page_size_);
-    int error = mincore(const_cast<void*>(base_addr_), len_bytes_, data_.data());
+    int error = mincore(const_cast<void*>(base_addr_), len_bytes_, data_.data()) == 0 ? 0 : errno;
     aku_Status status = AKU_SUCCESS;
     switch(error) {
     case EFAULT:
@@ -338,6 +459,17 @@ aku_Status PageInfo::refresh(const void *addr) {
     return status;
 }
 
+size_t PageInfo::resident_bytes() {
+    if (refresh(base_addr_) != AKU_SUCCESS) {
+        return 0u;
+    }
+    size_t npages = 0;
+    for (auto flag: data_) {
+        npages += flag & MINCORE_MASK;
+    }
+    return std::min(npages*page_size_, len_bytes_);
+}
+
 bool PageInfo::in_core(const void* addr) {
     auto req = reinterpret_cast<const unsigned char*>(addr);
     auto base = reinterpret_cast<const unsigned char*>(base_addr_);
@@ -356,6 +488,49 @@ void PageInfo::fill_mem() {
     std::fill(data_.begin(), data_.end(), MINCORE_MASK);
 }
 
+Readahead::Readahead(const void* begin, size_t size, size_t distance, bool backward)
+    : begin_(static_cast<const char*>(begin))
+    , end_(begin_ + size)
+    , distance_(distance < size ? distance : 0u)
+    , backward_(backward)
+    , next_(backward ? end_ : begin_)
+    , backoff_(1u)
+    , info_(begin, distance_)
+    , n_advised_(0u)
+    , n_resident_(0u)
+{
+}
+
+void Readahead::check_(const char* wbegin) {
+    info_.refresh(wbegin);
+    auto page_size = get_page_size();
+    auto base = static_cast<const char*>(align_to_page(wbegin, page_size));
+    auto npages = (distance_ + page_size - 1) / page_size;
+    bool resident = true;
+    for (size_t i = 0; i < npages; i++) {
+        if (!info_.in_core(base + i*page_size)) {
+            resident = false;
+            break;
+        }
+    }
+    if (resident) {
+        n_resident_++;
+        backoff_ = std::min(backoff_*2, static_cast<size_t>(MAX_BACKOFF));
+    } else {
+        advise_mem(wbegin, distance_, AKU_MEM_WILLNEED);
+        n_advised_++;
+        backoff_ = 1u;
+    }
+}
+
+uint64_t Readahead::get_advised() const {
+    return n_advised_;
+}
+
+uint64_t Readahead::get_resident() const {
+    return n_resident_;
+}
+
 size_t get_page_size() {
     auto page_size = sysconf(_SC_PAGESIZE);
     return page_size;
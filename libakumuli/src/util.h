@@ -30,6 +30,7 @@
 #include <vector>
 #include <tuple>
 #include <random>
+#include <algorithm>
 #include <boost/throw_exception.hpp>
 #include "akumuli.h"
 
@@ -119,6 +120,42 @@ namespace Akumuli
 
     void prefetch_mem(const void* ptr, size_t mem_size);
 
+    //! Memory access pattern (madvise hint)
+    enum MemAdvice {
+        AKU_MEM_NORMAL,    //< Default readahead
+        AKU_MEM_RANDOM,    //< Random access, readahead is disabled
+        AKU_MEM_WILLNEED,  //< Memory will be accessed soon, readahead starts in background
+        AKU_MEM_SEQUENTIAL,  //< Sequential scan, aggressive readahead, pages can be freed soon after access
+        AKU_MEM_HUGEPAGE,  //< Back memory with transparent huge pages (if filesystem supports it)
+    };
+
+    /** Apply madvise hint to memory range. Unlike prefetch_mem this
+      * function doesn't touch memory and doesn't block on IO.
+      * Errors are ignored, this is only a hint.
+      */
+    void advise_mem(const void* ptr, size_t mem_size, MemAdvice advice);
+
+    //! NUMA memory placement of the calling thread
+    enum NumaPolicy {
+        AKU_NUMA_DEFAULT,     //< Memory is allocated on the node of the first touch
+        AKU_NUMA_PREFERRED,   //< Memory is allocated on the specified node if possible
+        AKU_NUMA_INTERLEAVE,  //< Memory is interleaved across all nodes
+    };
+
+    //! Get number of NUMA nodes (1 if system is not NUMA)
+    int get_numa_nodes_count();
+
+    //! Get NUMA node of the CPU that runs calling thread
+    int get_numa_node();
+
+    /** Set NUMA memory policy of the calling thread (set_mempolicy syscall).
+      * Policy applies to all memory allocated by the thread after the call,
+      * including page cache pages of the mapped files on page fault. Does
+      * nothing on single node systems, errors are ignored.
+      * @param node node of AKU_NUMA_PREFERRED policy
+      */
+    void set_numa_policy(NumaPolicy policy, int node = 0);
+
     /** Wrapper for mincore syscall.
      * If everything is OK works as simple wrapper
      * (memory needed for mincore syscall managed by wrapper itself).
@@ -148,6 +185,65 @@ namespace Akumuli
 
         //! Check if underlying memory is swapped to disk
         bool swapped();
+
+        //! Query data from OS and count bytes of the region that are in core
+        size_t resident_bytes();
+    };
+
+    /** Readahead for sequential scans of the memory mapped region.
+      * Memory range that lies `distance` bytes ahead of the scan position (in
+      * scan direction) is checked with mincore and advised with MADV_WILLNEED
+      * if some of its pages are not resident. If the whole range is already
+      * in core readahead backs off, next check is postponed exponentially.
+      */
+    class Readahead {
+        enum {
+            MAX_BACKOFF = 64,  //< Max number of half-windows between checks
+        };
+        const char*  begin_;       //< Beginning of the region
+        const char*  end_;         //< End of the region
+        const size_t distance_;    //< Readahead window size in bytes (0 - disabled)
+        const bool   backward_;    //< True if scan goes from high to low addresses
+        const char*  next_;        //< Scan position of the next check
+        size_t       backoff_;     //< Current check interval in half-windows
+        PageInfo     info_;
+        uint64_t     n_advised_;   //< Number of madvise calls
+        uint64_t     n_resident_;  //< Number of checks that found the window in core
+
+        //! Check residency of the window that starts at `wbegin` and advise it if needed
+        void check_(const char* wbegin);
+    public:
+        /** C-tor.
+          * @param begin beginning of the mapped region
+          * @param size size of the region in bytes
+          * @param distance readahead window size in bytes, 0 - readahead disabled
+          * @param backward scan direction in memory (true - addresses decrease)
+          */
+        Readahead(const void* begin, size_t size, size_t distance, bool backward);
+
+        //! Scan reached memory at `addr`, cheap if no readahead is needed
+        void touch(const void* addr) {
+            auto p = static_cast<const char*>(addr);
+            if (distance_ != 0 && (backward_ ? p <= next_ : p >= next_)) {
+                if (backward_) {
+                    check_(static_cast<size_t>(p - begin_) > distance_ ? p - distance_ : begin_);
+                } else {
+                    check_(std::min(p, end_ - distance_));
+                }
+                auto step = backoff_*distance_/2;
+                if (backward_) {
+                    next_ = static_cast<size_t>(p - begin_) > step ? p - step : begin_;
+                } else {
+                    next_ = static_cast<size_t>(end_ - p) > step ? p + step : end_;
+                }
+            }
+        }
+
+        //! Number of madvise calls
+        uint64_t get_advised() const;
+
+        //! Number of checks that found the readahead window in core
+        uint64_t get_resident() const;
     };
 
     class Rand {
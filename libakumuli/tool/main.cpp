@@ -4,7 +4,9 @@
  *  Functions:
  *  - create storage;
  *  - delete storage;
- *  - incremental backup;
+ *  - backup storage;
+ *  - compact volumes;
+ *  - export time range to columnar file;
  *  - resize storage;
  *  - view stats;
  *
@@ -25,14 +27,123 @@
  */
 
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 
 #include <akumuli.h>
 #include <apr.h>
 #include <apr_getopt.h>
 
+namespace {
+
+//! Offline commands, database must not be opened by the server
+enum Command {
+    CMD_NONE,
+    CMD_BACKUP,
+    CMD_COMPACT,
+    CMD_EXPORT,
+};
+
+struct ToolOptions {
+    Command                  command = CMD_NONE;
+    std::string              path;          //< Path to metadata file
+    std::string              target;        //< Backup dir or export file
+    aku_TimeStamp            begin = AKU_MIN_TIMESTAMP;
+    aku_TimeStamp            end = AKU_MAX_TIMESTAMP;
+    std::vector<aku_ParamId> ids;
+    uint32_t                 nthreads = 0u;
+    uint32_t                 codec_policy = 1u;  // smallest
+};
+
 void show_help() {
     std::cout << "Akumuli-tool - simple storage manager and viewer with cli interface for akumuli." << std::endl;
-    // TODO: show help
+    std::cout << std::endl;
+    std::cout << "Offline commands (server must be stopped):" << std::endl;
+    std::cout << "  -p, --path <file>      path to storage metadata file" << std::endl;
+    std::cout << "  -b, --backup <dir>     copy metadata and used parts of the volumes to dir" << std::endl;
+    std::cout << "  -C, --compact          re-sort and re-encode chunks of the volumes" << std::endl;
+    std::cout << "  -k, --codecs <policy>  codecs of the compacted chunks: default, smallest (default) or fastest" << std::endl;
+    std::cout << "  -e, --export <file>    export time range to columnar file (see aku_ColumnBlockHeader)" << std::endl;
+    std::cout << "  -f, --from <ts>        first timestamp of the exported range" << std::endl;
+    std::cout << "  -t, --to <ts>          last timestamp of the exported range" << std::endl;
+    std::cout << "  -i, --ids <a,b,c>      export only these param ids" << std::endl;
+    std::cout << "  -j, --threads <n>      number of volumes processed concurrently (default - all)" << std::endl;
+}
+
+bool parse_uint(const char* str, uint64_t* out) {
+    char* end = nullptr;
+    *out = strtoull(str, &end, 10);
+    return *str != '\0' && *end == '\0';
+}
+
+bool parse_ids(const char* str, std::vector<aku_ParamId>* out) {
+    std::stringstream stream(str);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        uint64_t id;
+        if (!parse_uint(item.c_str(), &id)) {
+            return false;
+        }
+        out->push_back(id);
+    }
+    return !out->empty();
+}
+
+void print_stats(const char* what, aku_MaintenanceStats const& stats, double seconds) {
+    const double MB = 1024.0*1024.0;
+    std::cout << what << " completed in " << seconds << " sec" << std::endl;
+    std::cout << "  volumes:        " << stats.n_volumes << " (" << stats.n_skipped_volumes << " skipped)" << std::endl;
+    std::cout << "  chunks:         " << stats.n_chunks << std::endl;
+    std::cout << "  elements:       " << stats.n_elements << " (" << stats.n_skipped << " skipped)" << std::endl;
+    std::cout << "  read:           " << stats.bytes_read/MB << " MB";
+    if (seconds > 0) {
+        std::cout << " (" << stats.bytes_read/MB/seconds << " MB/s)";
+    }
+    std::cout << std::endl;
+    std::cout << "  written:        " << stats.bytes_written/MB << " MB" << std::endl;
+}
+
+int run_command(ToolOptions const& opts) {
+    if (opts.path.empty()) {
+        std::cout << "Storage path is not specified" << std::endl;
+        return 1;
+    }
+    aku_MaintenanceStats stats;
+    memset(&stats, 0, sizeof(stats));
+    aku_Status status = AKU_SUCCESS;
+    const char* what = "";
+    auto start = std::chrono::steady_clock::now();
+    switch (opts.command) {
+    case CMD_BACKUP:
+        what = "Backup";
+        status = aku_backup_database(opts.path.c_str(), opts.target.c_str(), opts.nthreads, nullptr, &stats);
+        break;
+    case CMD_COMPACT:
+        what = "Compaction";
+        status = aku_compact_database(opts.path.c_str(), opts.codec_policy, opts.nthreads, nullptr, &stats);
+        break;
+    case CMD_EXPORT:
+        what = "Export";
+        status = aku_export_columns(opts.path.c_str(), opts.target.c_str(), opts.begin, opts.end,
+                                    opts.ids.empty() ? nullptr : opts.ids.data(), opts.ids.size(),
+                                    opts.nthreads, nullptr, &stats);
+        break;
+    case CMD_NONE:
+        return 0;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (status != AKU_SUCCESS) {
+        std::cout << what << " failed: " << aku_error_message(status) << std::endl;
+        return 1;
+    }
+    print_stats(what, stats, elapsed.count());
+    return 0;
+}
+
 }
 
 int main(int argc, char** argv) {
@@ -46,8 +157,17 @@ int main(int argc, char** argv) {
         { "volumes", 'v', TRUE, "number of volumes" },
         // Delete
         { "delete", 'd', FALSE, "delete storage" },
-        // Backup (TODO)
-        { "backup", 'b', FALSE, "backup storage" },
+        // Backup
+        { "backup", 'b', TRUE, "backup storage" },
+        // Compaction
+        { "compact", 'C', FALSE, "compact volumes" },
+        { "codecs", 'k', TRUE, "codec selection policy" },
+        // Export
+        { "export", 'e', TRUE, "export to columnar file" },
+        { "from", 'f', TRUE, "first timestamp" },
+        { "to", 't', TRUE, "last timestamp" },
+        { "ids", 'i', TRUE, "list of param ids" },
+        { "threads", 'j', TRUE, "number of threads" },
         // Resize (TODO)
         { "resize", 'r', FALSE, "resize storage" },
         { "stats", 's', FALSE, "view stats" },
@@ -56,6 +176,9 @@ int main(int argc, char** argv) {
     apr_getopt_t *opt;
     int optch;
     const char *optarg;
+    ToolOptions opts;
+    bool bad_args = false;
+    uint64_t value;
 
     aku_initialize(nullptr);
     apr_pool_create(&pool, NULL);
@@ -67,11 +190,46 @@ int main(int argc, char** argv) {
     while ((status = apr_getopt_long(opt, options, &optch, &optarg)) == APR_SUCCESS) {
         switch (optch) {
         case 'p':
-            std::cout << "Path: " << optarg << std::endl;
+            opts.path = optarg;
             break;
         case 'c':
             std::cout << "Create storage " << std::endl;
             break;
+        case 'b':
+            opts.command = CMD_BACKUP;
+            opts.target = optarg;
+            break;
+        case 'C':
+            opts.command = CMD_COMPACT;
+            break;
+        case 'k':
+            if (strcmp(optarg, "default") == 0) {
+                opts.codec_policy = 0u;
+            } else if (strcmp(optarg, "smallest") == 0) {
+                opts.codec_policy = 1u;
+            } else if (strcmp(optarg, "fastest") == 0) {
+                opts.codec_policy = 2u;
+            } else {
+                bad_args = true;
+            }
+            break;
+        case 'e':
+            opts.command = CMD_EXPORT;
+            opts.target = optarg;
+            break;
+        case 'f':
+            bad_args |= !parse_uint(optarg, &opts.begin);
+            break;
+        case 't':
+            bad_args |= !parse_uint(optarg, &opts.end);
+            break;
+        case 'i':
+            bad_args |= !parse_ids(optarg, &opts.ids);
+            break;
+        case 'j':
+            bad_args |= !parse_uint(optarg, &value);
+            opts.nthreads = static_cast<uint32_t>(value);
+            break;
         case 'h':
             show_help();
             break;
@@ -79,10 +237,14 @@ int main(int argc, char** argv) {
             break;
         }
     }
-    if (status != APR_EOF) {
+    int result = 0;
+    if (status != APR_EOF || bad_args) {
         std::cout << "Invalid arguments" << std::endl;
         show_help();
+        result = 1;
+    } else {
+        result = run_command(opts);
     }
     apr_terminate();
-    return 0;
+    return result;
 };
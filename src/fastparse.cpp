@@ -0,0 +1,256 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fastparse.h"
+#include "utility.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace Akumuli {
+
+namespace {
+
+//! Value of the digit or value greater than 9 if character is not a digit
+inline unsigned digit(char c) {
+    return static_cast<unsigned>(static_cast<unsigned char>(c)) - static_cast<unsigned>('0');
+}
+
+/** Parse fixed number of digits.
+  * Characters are validated all at once, `invalid` is set if any of them is not a digit.
+  */
+inline unsigned fixed_digits(const char* p, int n, unsigned* invalid) {
+    unsigned result = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned d = digit(p[i]);
+        *invalid |= d > 9;
+        result = result*10 + d;
+    }
+    return result;
+}
+
+//! Number of days since epoch (proleptic Gregorian calendar, branchless)
+inline int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era*400);
+    const unsigned doy = (153*(m > 2 ? m - 3 : m + 9) + 2)/5 + d - 1;
+    const unsigned doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    return era*146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+inline unsigned days_in_month(unsigned y, unsigned m) {
+    static const unsigned char DAYS[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return DAYS[m - 1] + (m == 2 && leap);
+}
+
+const uint64_t NSEC_PER_SEC = 1000000000ull;
+
+//! Powers of ten that are exactly representable as double
+const double POW10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+const int MAX_EXACT_POW10 = 22;
+const uint64_t MAX_EXACT_MANTISSA = 1ull << 53;
+const int MAX_MANTISSA_DIGITS = 19;
+const size_t MAX_NUMBER_LENGTH = 0x400;
+
+bool parse_double_slow(const char* begin, const char* end, double* out_value) {
+    size_t length = static_cast<size_t>(end - begin);
+    if (length == 0 || length > MAX_NUMBER_LENGTH || isspace(static_cast<unsigned char>(*begin))) {
+        // strtod skips leading whitespace
+        return false;
+    }
+    // strtod needs null-terminated string
+    char buffer[MAX_NUMBER_LENGTH + 1];
+    memcpy(buffer, begin, length);
+    buffer[length] = '\0';
+    char* last = nullptr;
+    *out_value = strtod(buffer, &last);
+    return last == buffer + length;
+}
+
+}
+
+bool parse_iso8601(const char* begin, const char* end, aku_TimeStamp* out_ts) {
+    const auto length = end - begin;
+    unsigned invalid = 0;
+    unsigned year, month, day, hour, minute, second;
+    const char* p;
+    // Fixed-width prefix, separators are checked together with digits
+    if (length >= 19 && begin[4] == '-') {
+        // YYYY-MM-DDThh:mm:ss
+        year   = fixed_digits(begin,      4, &invalid);
+        month  = fixed_digits(begin + 5,  2, &invalid);
+        day    = fixed_digits(begin + 8,  2, &invalid);
+        hour   = fixed_digits(begin + 11, 2, &invalid);
+        minute = fixed_digits(begin + 14, 2, &invalid);
+        second = fixed_digits(begin + 17, 2, &invalid);
+        invalid |= (begin[7] != '-') | (begin[10] != 'T' && begin[10] != ' ')
+                 | (begin[13] != ':') | (begin[16] != ':');
+        p = begin + 19;
+    } else if (length >= 15) {
+        // YYYYMMDDThhmmss
+        year   = fixed_digits(begin,      4, &invalid);
+        month  = fixed_digits(begin + 4,  2, &invalid);
+        day    = fixed_digits(begin + 6,  2, &invalid);
+        hour   = fixed_digits(begin + 9,  2, &invalid);
+        minute = fixed_digits(begin + 11, 2, &invalid);
+        second = fixed_digits(begin + 13, 2, &invalid);
+        invalid |= begin[8] != 'T' && begin[8] != ' ';
+        p = begin + 15;
+    } else {
+        return false;
+    }
+    invalid |= (month - 1 > 11) | (hour > 23) | (minute > 59) | (second > 60);
+    if (AKU_UNLIKELY(invalid) || day - 1 >= days_in_month(year, month)) {
+        return false;
+    }
+    // Fraction
+    uint64_t nsec = 0;
+    if (p < end && (*p == '.' || *p == ',')) {
+        p++;
+        auto first = p;
+        uint64_t scale = NSEC_PER_SEC;
+        for (; p < end && digit(*p) <= 9; p++) {
+            if (scale > 1) {
+                scale /= 10;
+                nsec += digit(*p)*scale;
+            }
+        }
+        if (p == first) {
+            return false;
+        }
+    }
+    // Zone designator
+    int64_t offset = 0;
+    if (p < end) {
+        if (*p == 'Z' || *p == 'z') {
+            p++;
+        } else if (*p == '+' || *p == '-') {
+            int sign = *p == '-' ? -1 : 1;
+            p++;
+            auto rest = end - p;
+            unsigned off_hour, off_min = 0;
+            if (rest == 2 || rest == 4 || rest == 5) {
+                off_hour = fixed_digits(p, 2, &invalid);
+                if (rest == 4) {
+                    off_min = fixed_digits(p + 2, 2, &invalid);
+                } else if (rest == 5) {
+                    invalid |= p[2] != ':';
+                    off_min = fixed_digits(p + 3, 2, &invalid);
+                }
+            } else {
+                return false;
+            }
+            if (invalid || off_hour > 23 || off_min > 59) {
+                return false;
+            }
+            offset = sign*static_cast<int64_t>(off_hour*3600 + off_min*60);
+            p = end;
+        }
+    }
+    if (p != end) {
+        return false;
+    }
+    int64_t seconds = days_from_civil(year, month, day)*86400 + hour*3600 + minute*60 + second - offset;
+    if (seconds < 0) {
+        return false;
+    }
+    *out_ts = static_cast<aku_TimeStamp>(seconds)*NSEC_PER_SEC + nsec;
+    return true;
+}
+
+bool parse_double(const char* begin, const char* end, double* out_value) {
+    auto p = begin;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int ndigits = 0;      // significant digits in the mantissa
+    int exponent = 0;
+    bool truncated = false;
+    auto digits = p;
+    for (; p < end && digit(*p) <= 9; p++) {
+        if (ndigits < MAX_MANTISSA_DIGITS) {
+            mantissa = mantissa*10 + digit(*p);
+            ndigits += mantissa != 0;
+        } else {
+            exponent++;
+            truncated = true;
+        }
+    }
+    auto ndigits_total = p - digits;
+    if (p < end && *p == '.') {
+        p++;
+        auto fraction = p;
+        for (; p < end && digit(*p) <= 9; p++) {
+            if (ndigits < MAX_MANTISSA_DIGITS) {
+                mantissa = mantissa*10 + digit(*p);
+                ndigits += mantissa != 0;
+                exponent--;
+            } else {
+                truncated |= *p != '0';
+            }
+        }
+        ndigits_total += p - fraction;
+    }
+    if (ndigits_total == 0) {
+        // nan, inf and malformed numbers
+        return parse_double_slow(begin, end, out_value);
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int sign = 1;
+        if (p < end && (*p == '-' || *p == '+')) {
+            sign = *p == '-' ? -1 : 1;
+            p++;
+        }
+        auto first = p;
+        int exp = 0;
+        for (; p < end && digit(*p) <= 9; p++) {
+            if (exp < 100000) {
+                exp = exp*10 + static_cast<int>(digit(*p));
+            }
+        }
+        if (p == first) {
+            return parse_double_slow(begin, end, out_value);
+        }
+        exponent += sign*exp;
+    }
+    if (p != end) {
+        // Hexadecimal or malformed number
+        return parse_double_slow(begin, end, out_value);
+    }
+    if (AKU_LIKELY(!truncated && mantissa <= MAX_EXACT_MANTISSA
+                   && exponent >= -MAX_EXACT_POW10 && exponent <= MAX_EXACT_POW10))
+    {
+        // Mantissa and power of ten are exact, result of one operation is correctly rounded
+        double value = static_cast<double>(mantissa);
+        value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+        *out_value = negative ? -value : value;
+        return true;
+    }
+    return parse_double_slow(begin, end, out_value);
+}
+
+}  // namespace
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "akumuli.h"
+
+namespace Akumuli {
+
+/** Parse ISO 8601 (RFC 3339) date-time string.
+  * Extended (`2015-03-14T15:09:26.535897932+03:00`) and basic (`20150314T150926.535`)
+  * formats are supported, date and time can be separated by 'T' or space. Fraction is
+  * optional (digits after the ninth are ignored), time without zone designator is UTC.
+  * String isn't copied and nothing is allocated.
+  * @param out_ts nanoseconds since epoch
+  * @return false if string is malformed or date is before the epoch
+  */
+bool parse_iso8601(const char* begin, const char* end, aku_TimeStamp* out_ts);
+
+/** Parse decimal floating point number.
+  * Numbers with up to 19 significant digits and small exponents (the vast majority
+  * of the input) are converted by one multiplication or division that is exact
+  * (Clinger's fast path), other numbers are converted by strtod. Result is
+  * correctly rounded in both cases.
+  * @return false if string isn't a number
+  */
+bool parse_double(const char* begin, const char* end, double* out_value);
+
+}  // namespace
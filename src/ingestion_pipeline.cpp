@@ -3,6 +3,8 @@
 #include "utility.h"
 
 #include <thread>
+#include <algorithm>
+#include <cstring>
 
 #include <boost/exception/all.hpp>
 
@@ -15,7 +17,7 @@ static void db_logger(int tag, const char *msg) {
     db_logger_.error() << "(" << tag << ") " << msg;
 }
 
-AkumuliConnection::AkumuliConnection(const char *path, bool hugetlb, Durability durability)
+AkumuliConnection::AkumuliConnection(const char *path, bool hugetlb, bool numa, Durability durability)
     : dbpath_(path)
 {
     aku_FineTuneParams params = {
@@ -26,142 +28,539 @@ AkumuliConnection::AkumuliConnection(const char *path, bool hugetlb, Durability
         // huge tlbs
         (hugetlb ? 1u : 0u),
         // durability
-        (uint32_t)durability
+        (uint32_t)durability,
+        // search threads
+        0u,
+        // max flush latency (derived from durability)
+        0u,
+        // max flush bytes
+        0u,
+        // number of shards
+        0u,
+        // open threads
+        0u,
+        // chunk cache size (default)
+        0u,
+        // readahead distance (default)
+        0u,
+        // rollup tiers (disabled)
+        { 0u, 0u },
+        // coroutine stack pool size (default)
+        0u,
+        // shared sorted runs
+        0u,
+        // merge in the merger thread
+        0u,
+        // fixed late write window
+        0u,
+        // min adaptive window (default)
+        0u,
+        // max adaptive window (default)
+        0u,
+        // default chunk encoding
+        0u,
+        // fixed codecs
+        0u,
+        // NUMA placement
+        (numa ? 1u : 0u)
     };
     db_ = aku_open_database(dbpath_.c_str(), params);
 }
 
+aku_Status DbConnection::write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data) {
+    return write_double(param, ts, static_cast<double>(data));
+}
+
+aku_Status DbConnection::series_to_param_id(const char*, size_t, aku_ParamId*) {
+    return AKU_ENOT_IMPLEMENTED;
+}
+
+aku_Status DbConnection::write_batch(const aku_ParamId* params, const aku_TimeStamp* ts,
+                                     const double* data, size_t size, aku_Status* statuses)
+{
+    aku_Status result = AKU_SUCCESS;
+    for (size_t i = 0; i < size; i++) {
+        auto status = write_double(params[i], ts[i], data[i]);
+        statuses[i] = status;
+        if (status != AKU_SUCCESS && result == AKU_SUCCESS) {
+            result = status;
+        }
+    }
+    return result;
+}
+
+uint32_t DbConnection::num_shards() {
+    return 1u;
+}
+
+uint32_t DbConnection::shard_index(aku_ParamId) {
+    return 0u;
+}
+
+void DbConnection::get_metrics(aku_Metrics* rcv_metrics) {
+    memset(rcv_metrics, 0, sizeof(aku_Metrics));
+}
+
+aku_Status DbConnection::select(QueryRequest const&, std::unique_ptr<DbCursor>*) {
+    return AKU_ENOT_IMPLEMENTED;
+}
+
 aku_Status AkumuliConnection::write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
     return aku_write_double_raw(db_, param, ts, data);
 }
 
+aku_Status AkumuliConnection::write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data) {
+    return aku_write_int64_raw(db_, param, ts, data);
+}
+
+aku_Status AkumuliConnection::series_to_param_id(const char* name, size_t size, aku_ParamId* out_id) {
+    return aku_series_to_param_id(db_, name, name + size, out_id);
+}
+
+aku_Status AkumuliConnection::write_batch(const aku_ParamId* params, const aku_TimeStamp* ts,
+                                          const double* data, size_t size, aku_Status* statuses)
+{
+    return aku_write_batch(db_, params, ts, data, size, statuses);
+}
+
+uint32_t AkumuliConnection::num_shards() {
+    return aku_num_shards(db_);
+}
+
+uint32_t AkumuliConnection::shard_index(aku_ParamId param) {
+    return aku_shard_index(db_, param);
+}
+
+void AkumuliConnection::get_metrics(aku_Metrics* rcv_metrics) {
+    aku_get_metrics(db_, rcv_metrics, 0);
+}
+
+namespace {
+
+//! Cursor of the libakumuli query
+struct AkumuliCursor : DbCursor {
+    aku_Cursor* cursor_;
+
+    AkumuliCursor(aku_Cursor* cursor)
+        : cursor_(cursor)
+    {
+    }
+
+    ~AkumuliCursor() {
+        aku_close_cursor(cursor_);
+    }
+
+    virtual size_t read(aku_TimeStamp* ts, aku_ParamId* ids, aku_PData* values, uint32_t* lengths, size_t size) {
+        int n = aku_cursor_read_columns(cursor_, ts, ids, values, lengths, size);
+        return n > 0 ? static_cast<size_t>(n) : 0u;
+    }
+
+    virtual bool is_done() {
+        return aku_cursor_is_done(cursor_) != 0;
+    }
+
+    virtual aku_Status get_error() {
+        int error = AKU_SUCCESS;
+        if (aku_cursor_is_error(cursor_, &error) && error == AKU_SUCCESS) {
+            error = AKU_EGENERAL;
+        }
+        return static_cast<aku_Status>(error);
+    }
+};
+
+}
+
+aku_Status AkumuliConnection::select(QueryRequest const& query, std::unique_ptr<DbCursor>* out_cursor) {
+    aku_SelectQuery* select = nullptr;
+    if (query.ids.empty()) {
+        aku_Status status = AKU_SUCCESS;
+        select = aku_make_tag_query(db_, query.begin, query.end, query.expression.c_str(), &status);
+        if (select == nullptr) {
+            return status;
+        }
+    } else {
+        auto ids = query.ids;
+        select = aku_make_select_query(query.begin, query.end, static_cast<uint32_t>(ids.size()), ids.data());
+    }
+    select->limit = query.limit;
+    out_cursor->reset(new AkumuliCursor(aku_select(db_, select)));
+    aku_destroy(select);
+    return AKU_SUCCESS;
+}
+
+// Worker signal
+
+WorkerSignal::WorkerSignal()
+    : parked{false}
+    , nwakeups{0}
+    , nparks{0}
+    , spin_ns{0}
+    , park_ns{0}
+{
+}
+
+void WorkerSignal::notify() {
+    // Pairs with the fence in `park`, either spout sees the flag or worker sees the value
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (parked.exchange(false)) {
+            nwakeups++;
+            cond.notify_one();
+        }
+    }
+}
+
+void WorkerSignal::park(std::function<bool()> const& is_empty, std::chrono::milliseconds timeout) {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    parked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (is_empty()) {
+        nparks++;
+        cond.wait_for(lock, timeout, [this]() { return !parked.load(); });
+    }
+    parked.store(false);
+    park_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
 // Pipeline spout
-PipelineSpout::PipelineSpout(std::shared_ptr<Queue> q, BackoffPolicy bp)
-    : created_{0}
-    , deleted_{0}
-    , pool_()
-    , queue_(q)
+
+PipelineSpout::Ring::Ring()
+    : closed{false}
+{
+}
+
+PipelineSpout::PipelineSpout(std::vector<PRing> rings, std::vector<std::shared_ptr<WorkerSignal>> signals,
+                             std::shared_ptr<DbConnection> con, BackoffPolicy bp)
+    : rings_(rings)
+    , signals_(signals)
+    , con_(con)
+    , nshards_(std::max(con->num_shards(), 1u))
     , backoff_(bp)
     , logger_("pipeline-spout", 32)
+    , backlog_pos_(0)
+    , flow_control_(false)
+    , ndropped_(0)
 {
-    pool_.resize(POOL_SIZE);
-    for(int ix = POOL_SIZE; ix --> 0;) {
-        pool_.at(ix).reset(new TVal());
-    }
 }
 
 PipelineSpout::~PipelineSpout() {
+    if (backlog_pos_ != backlog_.size()) {
+        logger_.error() << "Spout destroyed, " << (backlog_.size() - backlog_pos_) << " values weren't written";
+    }
+    // Workers will remove rings after they're drained
+    for (auto& ring: rings_) {
+        ring->closed.store(true, std::memory_order_release);
+    }
 }
 
 void PipelineSpout::set_error_cb(PipelineErrorCb cb) {
-    on_error_ = cb;
+    for (auto& ring: rings_) {
+        ring->on_error = cb;
+    }
 }
 
-void PipelineSpout::write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
-    int ix = get_index_of_empty_slot();
-    while (AKU_UNLIKELY(ix < 0)) {
-        ix = get_index_of_empty_slot();
-        if (ix < 0 && backoff_ == AKU_LINEAR_BACKOFF) {
-            std::this_thread::yield();
-            continue;
-        } else if ( ix < 0 && backoff_ == AKU_THROTTLE) {
+void PipelineSpout::set_flow_control(bool enabled) {
+    flow_control_ = enabled;
+}
+
+bool PipelineSpout::flush_backlog() {
+    while (backlog_pos_ != backlog_.size()) {
+        auto const& value = backlog_[backlog_pos_];
+        auto worker = get_worker_index(value.id);
+        if (!rings_[worker]->values.push(value)) {
+            return false;
+        }
+        signals_[worker]->notify();
+        backlog_pos_++;
+    }
+    backlog_.clear();
+    backlog_pos_ = 0;
+    return true;
+}
+
+uint32_t PipelineSpout::get_worker_index(aku_ParamId param) const {
+    auto nworkers = static_cast<uint32_t>(rings_.size());
+    if (nworkers == 1) {
+        return 0u;
+    }
+    auto shard = con_->shard_index(param);
+    if (nworkers <= nshards_) {
+        return shard % nworkers;
+    }
+    // Hash shouldn't correlate with the shard index (storage uses Fibonacci hashing)
+    auto workers_per_shard = nworkers / nshards_;
+    uint64_t hash = (static_cast<uint64_t>(param) * 0xFF51AFD7ED558CCDull) >> 40;
+    return static_cast<uint32_t>((shard + nshards_*(hash % workers_per_shard)) % nworkers);
+}
+
+size_t PipelineSpout::get_pending() const {
+    size_t result = 0;
+    for (auto& ring: rings_) {
+        result = std::max(result, ring->values.size());
+    }
+    return result;
+}
+
+bool PipelineSpout::is_overloaded() const {
+    return backlog_pos_ != backlog_.size() || get_pending() > HIGH_WATER_MARK;
+}
+
+bool PipelineSpout::is_drained() const {
+    return backlog_pos_ == backlog_.size() && get_pending() < LOW_WATER_MARK;
+}
+
+uint64_t PipelineSpout::get_dropped() const {
+    return ndropped_;
+}
+
+void PipelineSpout::push_value(TVal const& value) {
+    if (AKU_UNLIKELY(backlog_pos_ != backlog_.size())) {
+        // Values can't overtake the backlog (order of the series should be preserved)
+        backlog_.push_back(value);
+        return;
+    }
+    auto worker = get_worker_index(value.id);
+    auto& ring = rings_[worker]->values;
+    while (AKU_UNLIKELY(!ring.push(value))) {
+        if (flow_control_) {
+            backlog_.push_back(value);
+            return;
+        }
+        if (backoff_ == AKU_THROTTLE) {
             std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            ndropped_++;
             return;
         }
+        std::this_thread::yield();
     }
+    signals_[worker]->notify();
+}
 
-    auto pvalue = pool_.at(ix).get();
+void PipelineSpout::write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
+    TVal value;
+    value.id       =      param;
+    value.ts       =         ts;
+    value.value    =       data;
+    value.is_int   =      false;
+    push_value(value);
+}
 
-    pvalue->id       =      param;
-    pvalue->ts       =         ts;
-    pvalue->value    =       data;
-    pvalue->cnt      =  &deleted_;
-    pvalue->on_error = &on_error_;
+void PipelineSpout::write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data) {
+    TVal value;
+    value.id       =      param;
+    value.ts       =         ts;
+    value.ivalue   =       data;
+    value.is_int   =       true;
+    push_value(value);
+}
 
-    while (!queue_->push(pvalue)) {
-        std::this_thread::yield();
+void PipelineSpout::write_samples(ProtocolSample const* samples, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        push_value(samples[i]);
     }
 }
 
-void PipelineSpout::add_bulk_string(const Byte *buffer, size_t n) {
-    // Shouldn't be implemented
+aku_Status PipelineSpout::series_to_param_id(const char* name, size_t size, aku_ParamId* out_id) {
+    return con_->series_to_param_id(name, size, out_id);
+}
+
+static ProtocolSample to_protocol_sample(aku_Sample const& sample) {
+    ProtocolSample value;
+    value.id       =  sample.paramid;
+    value.ts       = sample.timestamp;
+    value.is_int   =  sample.is_int != 0;
+    if (value.is_int) {
+        value.ivalue = sample.ivalue;
+    } else {
+        value.value  =  sample.value;
+    }
+    return value;
 }
 
-int PipelineSpout::get_index_of_empty_slot() {
-    if (created_ - deleted_ < POOL_SIZE) {
-        // There is some space in the pool
-        auto result = created_  % POOL_SIZE;
-        created_++;
-        return result;
+aku_Status PipelineSpout::add_bulk_string(const Byte *buffer, size_t n) {
+    size_t count = bulk_.size();
+    auto status = aku_decode_bulk(buffer, n, bulk_.data(), &count);
+    if (status == AKU_EOVERFLOW && count <= BULK_MAX_SAMPLES) {
+        bulk_.resize(count);
+        status = aku_decode_bulk(buffer, n, bulk_.data(), &count);
     }
-    return -1;
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    size_t i = 0;
+    for (; i < count && backlog_pos_ == backlog_.size(); i++) {
+        push_value(to_protocol_sample(bulk_[i]));
+    }
+    if (i < count) {
+        // Flow control is enabled and rings are full, rest of the frame is pushed from the backlog
+        backlog_.reserve(backlog_.size() + count - i);
+        for (; i < count; i++) {
+            backlog_.push_back(to_protocol_sample(bulk_[i]));
+        }
+    }
+    return AKU_SUCCESS;
 }
 
 // Ingestion pipeline
 
-IngestionPipeline::IngestionPipeline(std::shared_ptr<DbConnection> con, BackoffPolicy bp)
+IngestionPipeline::Registry::Registry()
+    : version{0}
+{
+}
+
+IngestionPipeline::IngestionPipeline(std::shared_ptr<DbConnection> con, BackoffPolicy bp, uint32_t nworkers,
+                                     WaitStrategy ws)
     : con_(con)
-    , ixmake_{0}
-    , stopbar_(2)
-    , startbar_(2)
+    , nworkers_(nworkers ? nworkers : std::max(con->num_shards(), 1u))
+    , stop_{false}
+    , stopbar_(nworkers_ + 1)
+    , startbar_(nworkers_ + 1)
     , backoff_(bp)
+    , wait_(ws)
     , logger_("ingestion-pipeline", 32)
 
 {
-    for (int i = N_QUEUES; i --> 0;) {
-        queues_.push_back(std::make_shared<PipelineSpout::Queue>(PipelineSpout::QCAP));
+    for (uint32_t i = 0; i < nworkers_; i++) {
+        registries_.emplace_back(new Registry());
+        signals_.push_back(std::make_shared<WorkerSignal>());
     }
 }
 
 void IngestionPipeline::start() {
     auto self = shared_from_this();
-    auto worker = [self]() {
+    auto worker = [self](uint32_t worker_ix) {
         try {
             self->logger_.info() << "Starting pipeline worker";
             self->startbar_.wait();
             self->logger_.info() << "Pipeline worker started";
 
-            // Write loop (should be unique)
-            PipelineSpout::TVal *val;
-            int poison_cnt = 0;
-            std::vector<PipelineSpout::PQueue> queues = self->queues_;
-            const int IDLE_THRESHOLD = 0x10000;
+            // Write loop (series are written by one worker only)
+            auto& registry = *self->registries_.at(worker_ix);
+            std::vector<PipelineSpout::PRing> rings;  // Local copy of the registry
+            uint64_t version = 0;
+            // Number of empty rounds before worker is parked
+            const int IDLE_THRESHOLD = self->wait_ == AKU_WAIT_BLOCKING ? 1 : 0x2000;
+            // Parked worker wakes up periodically even if nobody notifies it
+            const std::chrono::milliseconds PARK_TIMEOUT(100);
             int idle_count = 0;
-            for (int ix = 0; true; ix++) {
-                auto& qref = queues.at(ix % N_QUEUES);
-                if (qref->pop(val)) {
-                    idle_count = 0;
-                    // New write
-                    if (AKU_UNLIKELY(val->cnt == nullptr)) {  //poisoned
-                        poison_cnt++;
-                        if (poison_cnt == N_QUEUES) {
-                            // Check
-                            for (auto& x: self->queues_) {
-                                if (!x->empty()) {
-                                    self->logger_.error() << "Queue not empty, some data will be lost.";
-                                }
-                            }
-                            // Stop
-                            self->logger_.info() << "Stopping pipeline worker";
-                            self->stopbar_.wait();
-                            self->logger_.info() << "Pipeline worker stopped";
-                            return;
-                        }
-                    } else {
-                        auto error = self->con_->write_double(val->id, val->ts, val->value);
-                        (*val->cnt)++;
-                        if (AKU_UNLIKELY(error != AKU_SUCCESS)) {
-                            (*val->on_error)(error, *val->cnt);
-                        }
+            auto& signal = *self->signals_.at(worker_ix);
+            std::chrono::steady_clock::time_point spin_start;
+            auto is_empty = [&rings]() {
+                for (auto& ring: rings) {
+                    if (!ring->values.empty()) {
+                        return false;
                     }
+                }
+                return true;
+            };
+
+            // Batch of values popped from the rings
+            std::vector<PipelineSpout::TVal>  batch(BATCH_SIZE);
+            std::vector<PipelineSpout::Ring*> batch_rings(BATCH_SIZE);  // Source of the value
+            size_t                            batch_size = 0;
+            std::vector<aku_ParamId>          batch_ids(BATCH_SIZE);
+            std::vector<aku_TimeStamp>        batch_ts(BATCH_SIZE);
+            std::vector<double>               batch_values(BATCH_SIZE);
+            std::vector<aku_Status>           batch_statuses(BATCH_SIZE);
+            // Consecutive doubles [first, last) of the batch are written at once
+            auto write_doubles = [&](size_t first, size_t last) {
+                if (first == last) {
+                    return;
+                }
+                for (size_t i = first; i < last; i++) {
+                    batch_ids[i] = batch[i].id;
+                    batch_ts[i] = batch[i].ts;
+                    batch_values[i] = batch[i].value;
+                }
+                auto error = self->con_->write_batch(batch_ids.data() + first, batch_ts.data() + first,
+                                                     batch_values.data() + first, last - first,
+                                                     batch_statuses.data() + first);
+                if (error == AKU_SUCCESS) {
+                    std::fill(batch_statuses.begin() + first, batch_statuses.begin() + last, AKU_SUCCESS);
+                }
+            };
+            auto write_batch = [&]() {
+                // Integers are written one by one, order of the values is preserved
+                size_t first = 0;
+                for (size_t i = 0; i < batch_size; i++) {
+                    auto const& val = batch[i];
+                    if (val.is_int) {
+                        write_doubles(first, i);
+                        batch_statuses[i] = self->con_->write_int64(val.id, val.ts, val.ivalue);
+                        first = i + 1;
+                    }
+                }
+                write_doubles(first, batch_size);
+                for (size_t i = 0; i < batch_size; i++) {
+                    auto ring = batch_rings[i];
+                    if (AKU_UNLIKELY(batch_statuses[i] != AKU_SUCCESS) && ring->on_error) {
+                        ring->on_error(batch_statuses[i], ring->values.npopped());
+                    }
+                }
+                batch_size = 0;
+            };
+            // Rings of the destroyed spouts are removed after they're drained
+            auto remove_closed_rings = [&]() {
+                std::lock_guard<std::mutex> guard(registry.mutex);
+                auto it = std::remove_if(registry.rings.begin(), registry.rings.end(),
+                                         [](PipelineSpout::PRing const& ring) {
+                    return ring->closed.load(std::memory_order_acquire) && ring->values.empty();
+                });
+                if (it != registry.rings.end()) {
+                    registry.rings.erase(it, registry.rings.end());
+                    registry.version++;
+                }
+            };
+
+            for (size_t round = 0; true; round++) {
+                if (registry.version.load(std::memory_order_acquire) != version) {
+                    std::lock_guard<std::mutex> guard(registry.mutex);
+                    rings = registry.rings;
+                    version = registry.version.load();
+                }
+                // Values written before stop are visible after this point
+                bool stopping = self->stop_.load(std::memory_order_acquire);
+                bool has_closed = false;
+                // All rings of the worker are drained into one batch, first
+                // ring is rotated so busy rings can't starve others
+                for (size_t i = 0; i < rings.size() && batch_size < BATCH_SIZE; i++) {
+                    auto ring = rings[(round + i) % rings.size()].get();
+                    auto n = ring->values.pop(batch.data() + batch_size, BATCH_SIZE - batch_size);
+                    std::fill(batch_rings.begin() + batch_size, batch_rings.begin() + batch_size + n, ring);
+                    batch_size += n;
+                    has_closed |= ring->closed.load(std::memory_order_relaxed);
+                }
+                if (has_closed) {
+                    remove_closed_rings();
+                }
+                if (batch_size != 0) {
+                    if (idle_count) {
+                        signal.spin_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              std::chrono::steady_clock::now() - spin_start).count();
+                    }
+                    idle_count = 0;
+                    write_batch();
+                } else if (stopping) {
+                    // Stop
+                    self->logger_.info() << "Stopping pipeline worker";
+                    self->stopbar_.wait();
+                    self->logger_.info() << "Pipeline worker stopped";
+                    return;
                 } else {
-                    idle_count++;
-                    if (idle_count > IDLE_THRESHOLD) {
-                        if (idle_count % N_QUEUES == 0) {
-                            // in idle state
-                            // check all queues and go idle again
-                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                        }
+                    if (idle_count++ == 0) {
+                        spin_start = std::chrono::steady_clock::now();
+                    }
+                    if (idle_count >= IDLE_THRESHOLD && self->wait_ != AKU_WAIT_BUSY_SPIN) {
+                        signal.spin_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              std::chrono::steady_clock::now() - spin_start).count();
+                        signal.park([&]() {
+                            // New spouts are registered while worker is parked
+                            return is_empty() && registry.version.load() == version
+                                              && !self->stop_.load();
+                        }, PARK_TIMEOUT);
+                        idle_count = 0;
                     }
                 }
             }
@@ -173,32 +572,60 @@ void IngestionPipeline::start() {
         }
     };
 
-    std::thread th(worker);
-    th.detach();
+    for (uint32_t i = 0; i < nworkers_; i++) {
+        std::thread th(worker, i);
+        th.detach();
+    }
 
-    logger_.info() << "Starting pipeline";
+    logger_.info() << "Starting pipeline, " << nworkers_ << " workers";
     startbar_.wait();
     logger_.info() << "Pipeline started";
 }
 
 std::shared_ptr<PipelineSpout> IngestionPipeline::make_spout() {
-    ixmake_++;
-    return std::make_shared<PipelineSpout>(queues_.at(ixmake_ % N_QUEUES), backoff_);
+    std::vector<PipelineSpout::PRing> rings;
+    for (uint32_t i = 0; i < nworkers_; i++) {
+        auto ring = std::make_shared<PipelineSpout::Ring>();
+        auto& registry = *registries_.at(i);
+        std::lock_guard<std::mutex> guard(registry.mutex);
+        registry.rings.push_back(ring);
+        registry.version++;
+        rings.push_back(ring);
+    }
+    return std::make_shared<PipelineSpout>(rings, signals_, con_, backoff_);
 }
 
-PipelineSpout::TVal* IngestionPipeline::POISON = new PipelineSpout::TVal{0, 0, 0, nullptr};
 int IngestionPipeline::TIMEOUT = 15000;  // 15 seconds
 
 void IngestionPipeline::stop() {
-    logger_.info() << "Trying to stop pipeline, pushing poison to nodes";
-    for (auto& q: queues_) {
-        while(!q->push(POISON)) {
-            std::this_thread::yield();
-        }
+    logger_.info() << "Trying to stop pipeline";
+    stop_.store(true, std::memory_order_release);
+    for (auto& signal: signals_) {
+        signal->notify();
     }
-    logger_.info() << "Trying to stop pipeline, waiting for worker to stop";
+    logger_.info() << "Trying to stop pipeline, waiting for workers to stop";
     stopbar_.wait();
     logger_.info() << "Pipeline stopped (IngestionPipeline::stop)";
 }
 
+PipelineStats IngestionPipeline::get_stats() const {
+    PipelineStats stats = {};
+    for (auto& signal: signals_) {
+        stats.nwakeups += signal->nwakeups;
+        stats.nparks   += signal->nparks;
+        stats.spin_ns  += signal->spin_ns;
+        stats.park_ns  += signal->park_ns;
+    }
+    for (auto& registry: registries_) {
+        std::lock_guard<std::mutex> guard(registry->mutex);
+        for (auto& ring: registry->rings) {
+            auto size = ring->values.size();
+            stats.nrings++;
+            stats.queue_depth += size;
+            stats.max_queue_depth = std::max<uint64_t>(stats.max_queue_depth, size);
+        }
+    }
+    return stats;
+}
+
 }
@@ -19,8 +19,11 @@
 #include <memory>
 #include <atomic>
 #include <functional>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 
-#include <boost/lockfree/queue.hpp>
 #include <boost/thread/barrier.hpp>
 
 #include "protocol_consumer.h"
@@ -31,9 +34,60 @@
 
 namespace Akumuli {
 
+//! Select query parameters
+struct QueryRequest {
+    aku_TimeStamp            begin;       //< Begin of the time range
+    aku_TimeStamp            end;         //< End of the time range (results are returned backward if end < begin)
+    uint64_t                 limit;       //< Max number of results (0 - unlimited)
+    std::vector<aku_ParamId> ids;         //< Param ids
+    std::string              expression;  //< Tag expression (used if `ids` is empty)
+};
+
+//! Query results
+struct DbCursor {
+    virtual ~DbCursor() {}
+
+    /** Read next portion of results, blob pointers stay valid until the next call.
+      * @return number of results written to arrays (zero if cursor is done or failed)
+      */
+    virtual size_t read(aku_TimeStamp* ts, aku_ParamId* ids, aku_PData* values, uint32_t* lengths, size_t size) = 0;
+
+    //! Check if all results was read
+    virtual bool is_done() = 0;
+
+    //! Get error code (AKU_SUCCESS if there is no error)
+    virtual aku_Status get_error() = 0;
+};
+
 struct DbConnection {
     virtual ~DbConnection() {}
     virtual aku_Status write_double(aku_ParamId param, aku_TimeStamp ts, double data) = 0;
+
+    //! Write integer value, default implementation converts value to double
+    virtual aku_Status write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data);
+
+    //! Convert series name to param id, default implementation doesn't support series names
+    virtual aku_Status series_to_param_id(const char* name, size_t size, aku_ParamId* out_id);
+
+    /** Write batch of values.
+      * Default implementation writes values one by one.
+      * @param statuses array of per-element statuses, filled only on error
+      * @returns status of the first failed element or AKU_SUCCESS
+      */
+    virtual aku_Status write_batch(const aku_ParamId* params, const aku_TimeStamp* ts,
+                                   const double* data, size_t size, aku_Status* statuses);
+
+    //! Number of shards that can be written concurrently
+    virtual uint32_t num_shards();
+
+    //! Index of the shard that stores param
+    virtual uint32_t shard_index(aku_ParamId param);
+
+    //! Get storage metrics, default implementation sets everything to zero
+    virtual void get_metrics(aku_Metrics* rcv_metrics);
+
+    //! Execute select query, default implementation doesn't support queries
+    virtual aku_Status select(QueryRequest const& query, std::unique_ptr<DbCursor>* out_cursor);
 };
 
 
@@ -50,83 +104,256 @@ private:
     std::string     dbpath_;
     aku_Database   *db_;
 public:
-    AkumuliConnection(const char* path, bool hugetlb, Durability durability);
+    /** C-tor, opens database.
+      * @param hugetlb back volumes with huge pages
+      * @param numa NUMA aware placement of the volumes
+      */
+    AkumuliConnection(const char* path, bool hugetlb, bool numa, Durability durability);
 
     // ProtocolConsumer interface
 public:
     virtual aku_Status write_double(aku_ParamId param, aku_TimeStamp ts, double data);
+    virtual aku_Status write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data);
+    virtual aku_Status series_to_param_id(const char* name, size_t size, aku_ParamId* out_id);
+    virtual aku_Status write_batch(const aku_ParamId* params, const aku_TimeStamp* ts,
+                                   const double* data, size_t size, aku_Status* statuses);
+    virtual uint32_t num_shards();
+    virtual uint32_t shard_index(aku_ParamId param);
+    virtual void get_metrics(aku_Metrics* rcv_metrics);
+    virtual aku_Status select(QueryRequest const& query, std::unique_ptr<DbCursor>* out_cursor);
 };
 
-using boost::lockfree::queue;
-using boost::lockfree::capacity;
-
-
 enum BackoffPolicy {
     AKU_THROTTLE,
     AKU_LINEAR_BACKOFF,
 };
 
 
+/** Strategy of the idle pipeline worker.
+  * Busy-spin gives the lowest latency but burns a core, parked workers
+  * sleep until spout wakes them up (wakeup costs a syscall).
+  */
+enum WaitStrategy {
+    AKU_WAIT_BUSY_SPIN,       //< Never sleep
+    AKU_WAIT_SPIN_THEN_PARK,  //< Spin for a while, then park
+    AKU_WAIT_BLOCKING,        //< Park as soon as queues are empty
+};
+
+
+/** Parking spot of the pipeline worker.
+  * Spouts check `parked` flag after every push and notify worker only
+  * if it's parked, so there are no syscalls on the hot path.
+  */
+struct WorkerSignal {
+    std::mutex              mutex;
+    std::condition_variable cond;
+    std::atomic<bool>       parked;
+    std::atomic<uint64_t>   nwakeups;  //< Number of notifications sent by spouts
+    std::atomic<uint64_t>   nparks;    //< Number of times worker was parked
+    std::atomic<uint64_t>   spin_ns;   //< Time spent spinning on empty queues
+    std::atomic<uint64_t>   park_ns;   //< Time spent parked
+
+    WorkerSignal();
+
+    //! Wake up worker if it's parked
+    void notify();
+
+    /** Park worker until notified or until timeout expires.
+      * @param is_empty should return false if new work is available (checked after
+      *        `parked` flag is set to prevent lost wakeups)
+      */
+    void park(std::function<bool()> const& is_empty, std::chrono::milliseconds timeout);
+};
+
+
+//! Pipeline's idle statistics and queue depths (sum over all workers)
+struct PipelineStats {
+    uint64_t nwakeups;
+    uint64_t nparks;
+    uint64_t spin_ns;
+    uint64_t park_ns;
+    uint64_t nrings;           //< Number of spout rings (spouts times workers)
+    uint64_t queue_depth;      //< Number of values that wasn't written yet
+    uint64_t max_queue_depth;  //< Size of the largest ring
+};
+
+
 //! Callback from pipeline to session
 typedef std::function<void(aku_Status, uint64_t)> PipelineErrorCb;
 
 
+/** Single producer single consumer ring buffer.
+  * Producer and consumer indexes are placed on different cache lines,
+  * producer caches consumer's index to avoid touching its cache line
+  * on every push.
+  */
+template<class T, size_t N>
+class SpscRing {
+    static_assert((N & (N - 1)) == 0, "Ring size should be a power of two");
+    typedef struct { char emptybits[64]; } Padding;
+
+    Padding               pad0;
+    std::atomic<uint64_t> head_;         //< Next position to write (producer)
+    uint64_t              cached_tail_;  //< Last seen value of tail_ (producer)
+    Padding               pad1;
+    std::atomic<uint64_t> tail_;         //< Next position to read (consumer)
+    Padding               pad2;
+    T                     values_[N];
+public:
+    SpscRing()
+        : head_{0}
+        , cached_tail_(0)
+        , tail_{0}
+    {
+    }
+
+    //! Add value to ring, return false if ring is full (producer only)
+    bool push(T const& value) {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head - cached_tail_ == N) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head - cached_tail_ == N) {
+                return false;
+            }
+        }
+        values_[head & (N - 1)] = value;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    //! Move up to `n` values to `out`, return number of values (consumer only)
+    size_t pop(T* out, size_t n) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        auto size = std::min(static_cast<size_t>(head_.load(std::memory_order_acquire) - tail), n);
+        for (size_t i = 0; i < size; i++) {
+            out[i] = values_[(tail + i) & (N - 1)];
+        }
+        tail_.store(tail + size, std::memory_order_release);
+        return size;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    //! Number of values in the ring
+    size_t size() const {
+        auto tail = tail_.load(std::memory_order_acquire);
+        return static_cast<size_t>(head_.load(std::memory_order_acquire) - tail);
+    }
+
+    //! Number of values popped so far
+    uint64_t npopped() const {
+        return tail_.load(std::memory_order_relaxed);
+    }
+};
+
+
 /** Pipeline's spout.
   * Object of this class can be used to ingest data to pipeline.
-  * It should be connected with IngestionPipeline instance with
-  * the shared queue. Pooling is used to simplify allocator's
-  * life. All TVals should be deleted in the same thread where
-  * they was created. This shuld minimize contention inside
-  * allocator and limit overall memory usage (no need to create
-  * pool of objects beforehand).
+  * Spout owns one SPSC ring per pipeline worker, values are stored
+  * in rings by value. Rings are registered in the workers and are
+  * removed by them after the spout is destroyed and the ring is
+  * drained. Values are routed to workers by shard index and param
+  * id (values of the same series are always written by the same worker).
+  * If flow control is enabled, values that don't fit into the rings are
+  * kept in the spout's backlog until the producer flushes it.
   */
 struct PipelineSpout : ProtocolConsumer {
 
     // Constants
     enum {
-        //! PVal pool size
-        POOL_SIZE = 0x200,
-        QCAP      = 0x10,
+        //! Ring size (per worker)
+        RING_SIZE = 0x400,
+        //! Session should stop reading if any ring has more values than this
+        HIGH_WATER_MARK = RING_SIZE/2,
+        //! Session can continue reading when all rings have less values than this
+        LOW_WATER_MARK = RING_SIZE/8,
+        //! Max number of samples in the bulk frame (frame can be larger than the rings, see `add_bulk_string`)
+        BULK_MAX_SAMPLES = 0x10000,
     };
 
     // Typedefs
-    typedef struct { char emptybits[64]; }       Padding;        //< Padding
-    typedef std::atomic<uint64_t>                SpoutCounter;   //< Shared counter
-    typedef struct {
-        aku_ParamId            id;                               //< Measurement ID
-        aku_TimeStamp          ts;                               //< Measurement timestamp
-        double                 value;                            //< Value (TODO: should be variant type)
-        SpoutCounter          *cnt;                              //< Pointer to spout's shared counter
-        PipelineErrorCb       *on_error;                         //< On error callback
-    }                                            TVal;           //< Value
-    typedef std::shared_ptr<TVal>                PVal;           //< Pointer to value
-    typedef queue<TVal*>                         Queue;          //< Queue class
-    typedef std::shared_ptr<Queue>               PQueue;         //< Pointer to queue
+    typedef ProtocolSample                       TVal;           //< Value
+
+    //! Channel between spout and one of the workers
+    struct Ring {
+        SpscRing<TVal, RING_SIZE> values;
+        std::atomic<bool>         closed;                        //< Set when spout is destroyed
+        PipelineErrorCb           on_error;                      //< Session callback
+
+        Ring();
+    };
+    typedef std::shared_ptr<Ring>                PRing;          //< Pointer to ring
 
     // Data
-    SpoutCounter        created_;                                //< Created elements counter
-    Padding             pad0;
-    SpoutCounter        deleted_;                                //< Deleted elements counter
-    std::vector<PVal>   pool_;                                   //< TVal pool
-    Padding             pad1;
-    PQueue              queue_;                                  //< Queue
+    std::vector<PRing>  rings_;                                  //< Rings (one per worker)
+    std::vector<std::shared_ptr<WorkerSignal>> signals_;         //< Signals (one per worker)
+    std::shared_ptr<DbConnection> con_;                          //< Connection (used for routing)
+    const uint32_t      nshards_;                                //< Number of storage shards
     const BackoffPolicy backoff_;
     Logger              logger_;                                 //< Logger instance
-    PipelineErrorCb     on_error_;                               //< Session callback
+    std::vector<aku_Sample> bulk_;                               //< Decoded bulk frame (allocated on demand)
+    std::vector<TVal>   backlog_;                                //< Values that didn't fit into the rings
+    size_t              backlog_pos_;                            //< Number of backlog values pushed to the rings
+    bool                flow_control_;                           //< Use backlog instead of backoff policy
+    uint64_t            ndropped_;                               //< Values dropped because the ring was full (AKU_THROTTLE)
 
     // C-tor
-    PipelineSpout(std::shared_ptr<Queue> q, BackoffPolicy bp);
+    PipelineSpout(std::vector<PRing> rings, std::vector<std::shared_ptr<WorkerSignal>> signals,
+                  std::shared_ptr<DbConnection> con, BackoffPolicy bp);
    ~PipelineSpout();
 
+    //! Set error callback (should be called before the first write)
     void set_error_cb(PipelineErrorCb cb);
 
+    /** Enable flow control (should be called before the first write).
+      * Values that don't fit into the rings are stored in the backlog instead
+      * of spinning or dropping them, producer should stop writing while spout
+      * is overloaded and call `flush_backlog` until it's drained. Amount of
+      * memory used by the backlog is bounded by what producer writes after
+      * `is_overloaded` was checked last time.
+      */
+    void set_flow_control(bool enabled);
+
+    //! Push backlog to the rings (producer only), return true if backlog is empty
+    bool flush_backlog();
+
     // ProtocolConsumer
     virtual void write_double(aku_ParamId param, aku_TimeStamp ts, double data);
-    virtual void add_bulk_string(const Byte *buffer, size_t n);
+    virtual void write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data);
+    virtual void write_samples(ProtocolSample const* samples, size_t size);
+    virtual aku_Status series_to_param_id(const char* name, size_t size, aku_ParamId* out_id);
+    /** Decode bulk frame and send its samples to the workers. If flow control is enabled,
+      * samples that don't fit into the rings are kept in the backlog, otherwise the
+      * backoff policy is applied to every sample.
+      */
+    virtual aku_Status add_bulk_string(const Byte *buffer, size_t n);
 
     // Utility
-    //! Reserve index for the next TVal in the pool or negative value on error.
-    int get_index_of_empty_slot();
+    /** Send value to the worker of its series. If ring is full the value is added to the backlog
+      * (flow control is enabled) or dropped (backoff is AKU_THROTTLE).
+      */
+    void push_value(TVal const& value);
+
+    /** Get index of the worker that writes param.
+      * If there are fewer workers than shards every worker writes several shards,
+      * otherwise every shard is written by nworkers/nshards workers and series
+      * are spread between them by param id.
+      */
+    uint32_t get_worker_index(aku_ParamId param) const;
+
+    //! Number of values that wasn't written yet (max over all rings)
+    size_t get_pending() const;
+
+    //! Check if backlog is not empty or pending count crossed the high-water mark
+    bool is_overloaded() const;
+
+    //! Check if backlog is empty and pending count is below the low-water mark
+    bool is_drained() const;
+
+    //! Number of values dropped by backoff policy (producer only)
+    uint64_t get_dropped() const;
 
     /** Dump all errors to ostr or report that everything is OK
       * @param ostr stream to write
@@ -137,22 +364,37 @@ struct PipelineSpout : ProtocolConsumer {
 class IngestionPipeline : public std::enable_shared_from_this<IngestionPipeline>
 {
     enum {
-        N_QUEUES = 8,
+        BATCH_SIZE = 0x100,  //< Max number of values passed to DbConnection at once
+    };
+    //! Rings of the worker (spouts register new rings here)
+    struct Registry {
+        std::mutex                        mutex;
+        std::vector<PipelineSpout::PRing> rings;    //< Guarded by mutex
+        std::atomic<uint64_t>             version;  //< Incremented on every change
+
+        Registry();
     };
     typedef boost::barrier             Barr;
     std::shared_ptr<DbConnection>      con_;        //< DB connection
-    std::vector<PipelineSpout::PQueue> queues_;     //< Queues collection
-    std::atomic<int>                   ixmake_;     //< Index for the make_spout mehtod
+    const uint32_t                     nworkers_;   //< Number of worker threads
+    std::vector<std::unique_ptr<Registry>> registries_;  //< Ring registries (one per worker)
+    std::vector<std::shared_ptr<WorkerSignal>> signals_;  //< Worker signals (one per worker)
+    std::atomic<bool>                  stop_;       //< Set when pipeline is stopping
     Barr                               stopbar_;    //< Stopping barrier
     Barr                               startbar_;   //< Stopping barrier
-    static PipelineSpout::TVal        *POISON;      //< Poisoned object to stop worker thread
     static int                         TIMEOUT;     //< Close timeout
     const BackoffPolicy                backoff_;    //< Back-pressure policy
+    const WaitStrategy                 wait_;       //< Idle strategy of the workers
     Logger                             logger_;     //< Logger instance
 public:
     /** Create new pipeline topology.
+      * @param nworkers number of worker threads, one worker per storage shard
+      *        is created if zero (should be a multiple of the number of shards
+      *        to load workers evenly, storage shards can be written concurrently)
+      * @param ws idle strategy of the workers
       */
-    IngestionPipeline(std::shared_ptr<DbConnection> con, BackoffPolicy bp = AKU_THROTTLE);
+    IngestionPipeline(std::shared_ptr<DbConnection> con, BackoffPolicy bp = AKU_THROTTLE, uint32_t nworkers = 0u,
+                      WaitStrategy ws = AKU_WAIT_SPIN_THEN_PARK);
 
     /** Run pipeline topology.
       */
@@ -161,7 +403,13 @@ public:
     /** Add new pipeline spout. */
     std::shared_ptr<PipelineSpout> make_spout();
 
+    /** Stop pipeline. Values written before this call are
+      * written to the database.
+      */
     void stop();
+
+    //! Get idle statistics of the workers and queue depths
+    PipelineStats get_stats() const;
 };
 
 }  // namespace Akumuli
@@ -0,0 +1,396 @@
+/**
+ * Load generator for akumulid.
+ *
+ * Opens N connections to the ingestion endpoint and sends samples at the
+ * target rate, every connection sends batches in closed loop (next batch
+ * is sent when the previous one is written to the socket). Latency is
+ * measured from the time when the batch was scheduled, so the stalls of the
+ * server are not hidden by the generator that falls behind.
+ *
+ * Ingest-to-visible latency is measured using sentinel samples: first
+ * connection adds sample of the sentinel series to the batch periodically
+ * and prober thread queries it back through the query endpoint until it's
+ * found. Latencies are collected to log-linear (HDR-style) histograms.
+ *
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+
+#include "akumuli.h"
+#include "../libakumuli/src/metrics.h"
+
+namespace po = boost::program_options;
+using namespace Akumuli;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+typedef boost::asio::ip::tcp Tcp;
+
+struct Config {
+    std::string host;
+    int         port;
+    int         query_port;       //< Ingest-to-visible latency is not measured if zero
+    int         nconnections;
+    double      rate;             //< Samples per second (all connections), 0 - unlimited
+    double      duration;         //< Seconds
+    uint32_t    nseries;
+    uint32_t    batch;            //< Samples per write
+    double      disorder;         //< Fraction of the samples that are sent out of order
+    uint64_t    max_delay;        //< Max time shift of the out of order samples (timestamp units)
+    bool        binary;           //< Bulk frames instead of RESP
+    uint32_t    sentinel_ms;      //< Sentinel period
+    double      sentinel_timeout; //< Seconds
+};
+
+//! Current time in nanoseconds since epoch (timestamps of the samples)
+aku_TimeStamp now_ts() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<aku_TimeStamp>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+uint64_t nsec_since(Clock::time_point tp) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - tp).count());
+}
+
+struct Sentinel {
+    aku_TimeStamp     ts;
+    Clock::time_point sent;  //< Time when the batch with the sentinel was scheduled
+};
+
+//! State shared by the connections and prober
+struct LoadState {
+    std::atomic<bool>     stop;
+    std::atomic<uint64_t> nsamples;
+    std::atomic<uint64_t> nbytes;
+    std::atomic<uint64_t> nerrors;           //< Connection errors
+    std::atomic<uint64_t> nlost;             //< Sentinels that wasn't found before timeout
+    std::atomic<uint64_t> nquery_errors;
+    LatencyHistogram      send_latency;      //< Time between batch schedule and write completion
+    LatencyHistogram      visible_latency;   //< Time between sentinel schedule and its visibility
+    std::mutex            sentinels_mutex;
+    std::deque<Sentinel>  sentinels;         //< Sentinels that wasn't queried yet
+
+    LoadState()
+        : stop{false}
+        , nsamples{0}
+        , nbytes{0}
+        , nerrors{0}
+        , nlost{0}
+        , nquery_errors{0}
+    {
+    }
+};
+
+void append_resp(std::string* out, aku_Sample const& sample) {
+    char buffer[128];
+    int len = snprintf(buffer, sizeof(buffer), ":%llu\r\n:%llu\r\n+%.17g\r\n",
+                       static_cast<unsigned long long>(sample.paramid),
+                       static_cast<unsigned long long>(sample.timestamp),
+                       sample.value);
+    out->append(buffer, static_cast<size_t>(len));
+}
+
+bool append_bulk(std::string* out, std::vector<aku_Sample> const& samples, std::vector<char>* frame) {
+    frame->resize(aku_bulk_max_size(samples.size()));
+    size_t size = 0;
+    auto status = aku_encode_bulk(samples.data(), samples.size(), frame->data(), frame->size(), &size);
+    if (status != AKU_SUCCESS) {
+        std::cerr << "Can't encode bulk frame: " << aku_error_message(status) << std::endl;
+        return false;
+    }
+    *out += "$" + std::to_string(size) + "\r\n";
+    out->append(frame->data(), size);
+    *out += "\r\n";
+    return true;
+}
+
+/** Connection worker.
+  * Batches are scheduled at fixed rate, if worker falls behind schedule batches
+  * are sent back to back until it catches up.
+  */
+void connection_worker(int index, Config const& cfg, LoadState* state) {
+    boost::asio::io_service io;
+    Tcp::socket socket(io);
+    try {
+        Tcp::resolver resolver(io);
+        boost::asio::connect(socket, resolver.resolve(Tcp::resolver::query(cfg.host, std::to_string(cfg.port))));
+        socket.set_option(Tcp::no_delay(true));
+    } catch (boost::system::system_error const& error) {
+        std::cerr << "Connection " << index << " failed: " << error.what() << std::endl;
+        state->nerrors++;
+        return;
+    }
+    std::mt19937_64 gen(static_cast<uint64_t>(index) + 1u);
+    std::uniform_int_distribution<aku_ParamId> series(1u, cfg.nseries);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::uniform_int_distribution<uint64_t> delay(1u, std::max<uint64_t>(cfg.max_delay, 1u));
+    const aku_ParamId sentinel_id = cfg.nseries + 1u;
+    const bool has_sentinels = index == 0 && cfg.query_port != 0;
+    const auto sentinel_period = std::chrono::milliseconds(cfg.sentinel_ms);
+    const double conn_rate = cfg.rate/cfg.nconnections;
+    const auto period = conn_rate > 0.0
+                      ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(cfg.batch/conn_rate))
+                      : Clock::duration::zero();
+    std::vector<aku_Sample> samples;
+    std::vector<char> frame;
+    std::string output;
+    auto schedule = Clock::now();
+    auto next_sentinel = schedule;
+    double value = 0.0;
+    while (!state->stop.load(std::memory_order_relaxed)) {
+        if (period != Clock::duration::zero()) {
+            std::this_thread::sleep_until(schedule);
+        } else {
+            schedule = Clock::now();
+        }
+        samples.clear();
+        output.clear();
+        for (uint32_t i = 0; i < cfg.batch; i++) {
+            aku_Sample sample = {};
+            sample.paramid = series(gen);
+            sample.timestamp = now_ts();
+            if (cfg.disorder > 0.0 && coin(gen) < cfg.disorder) {
+                sample.timestamp -= delay(gen);
+            }
+            sample.value = value;
+            value += 0.5;
+            samples.push_back(sample);
+        }
+        Sentinel sentinel = {};
+        bool send_sentinel = has_sentinels && schedule >= next_sentinel;
+        if (send_sentinel) {
+            aku_Sample sample = {};
+            sample.paramid = sentinel_id;
+            sample.timestamp = sentinel.ts = now_ts();
+            sentinel.sent = schedule;
+            samples.push_back(sample);
+            next_sentinel = schedule + sentinel_period;
+        }
+        if (cfg.binary) {
+            if (!append_bulk(&output, samples, &frame)) {
+                state->nerrors++;
+                break;
+            }
+        } else {
+            for (auto const& sample: samples) {
+                append_resp(&output, sample);
+            }
+        }
+        boost::system::error_code error;
+        boost::asio::write(socket, boost::asio::buffer(output), error);
+        if (error) {
+            std::cerr << "Connection " << index << " error: " << error.message() << std::endl;
+            state->nerrors++;
+            break;
+        }
+        state->send_latency.record(nsec_since(schedule));
+        state->nsamples.fetch_add(samples.size(), std::memory_order_relaxed);
+        state->nbytes.fetch_add(output.size(), std::memory_order_relaxed);
+        if (send_sentinel) {
+            std::lock_guard<std::mutex> lock(state->sentinels_mutex);
+            state->sentinels.push_back(sentinel);
+        }
+        schedule += period;
+    }
+    boost::system::error_code ignored;
+    socket.shutdown(Tcp::socket::shutdown_both, ignored);
+}
+
+enum QueryResult {
+    FOUND,
+    NOT_FOUND,
+    QUERY_ERROR,
+};
+
+/** Query sentinel back.
+  * Backward query is used because it also searches data that wasn't merged from
+  * the sequencer yet, results are read until the server closes connection.
+  */
+QueryResult query_sentinel(Config const& cfg, aku_TimeStamp ts) {
+    try {
+        boost::asio::io_service io;
+        Tcp::socket socket(io);
+        Tcp::resolver resolver(io);
+        boost::asio::connect(socket, resolver.resolve(Tcp::resolver::query(cfg.host, std::to_string(cfg.query_port))));
+        std::string request = "select " + std::to_string(ts + 1u) + " " + std::to_string(ts)
+                            + " ids " + std::to_string(cfg.nseries + 1u) + "\n";
+        boost::asio::write(socket, boost::asio::buffer(request));
+        std::string response;
+        char buffer[0x1000];
+        boost::system::error_code error;
+        for (;;) {
+            size_t n = socket.read_some(boost::asio::buffer(buffer), error);
+            response.append(buffer, n);
+            if (error) {
+                break;
+            }
+        }
+        if (error != boost::asio::error::eof || response.empty() || response[0] == '-') {
+            return QUERY_ERROR;
+        }
+        return response.compare(0, 4, "*0\r\n") == 0 ? NOT_FOUND : FOUND;
+    } catch (boost::system::system_error const&) {
+        return QUERY_ERROR;
+    }
+}
+
+//! Query sentinels in order until they are visible
+void prober(Config const& cfg, LoadState* state) {
+    const auto timeout = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(cfg.sentinel_timeout));
+    const auto poll_period = std::chrono::milliseconds(1);
+    while (true) {
+        Sentinel sentinel;
+        {
+            std::lock_guard<std::mutex> lock(state->sentinels_mutex);
+            if (state->sentinels.empty()) {
+                if (state->stop.load()) {
+                    return;
+                }
+                sentinel.ts = 0u;
+            } else {
+                sentinel = state->sentinels.front();
+                state->sentinels.pop_front();
+            }
+        }
+        if (sentinel.ts == 0u) {
+            std::this_thread::sleep_for(poll_period);
+            continue;
+        }
+        while (true) {
+            auto result = query_sentinel(cfg, sentinel.ts);
+            if (result == FOUND) {
+                state->visible_latency.record(nsec_since(sentinel.sent));
+                break;
+            }
+            if (result == QUERY_ERROR) {
+                state->nquery_errors++;
+            }
+            if (Clock::now() - sentinel.sent > timeout) {
+                state->nlost++;
+                break;
+            }
+            std::this_thread::sleep_for(poll_period);
+        }
+    }
+}
+
+void print_latency(const char* title, aku_LatencyStats const& stats) {
+    const double USEC = 1000.0;
+    std::printf("%s (us, %llu samples): min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+                title, static_cast<unsigned long long>(stats.count),
+                stats.min/USEC, stats.p50/USEC, stats.p90/USEC, stats.p99/USEC, stats.p999/USEC, stats.max/USEC);
+}
+
+}
+
+int main(int argc, char** argv) {
+    Config cfg;
+    std::string format;
+    po::options_description desc("Akumuli load generator");
+    desc.add_options()
+            ("help", "Produce help message")
+            ("host", po::value<std::string>(&cfg.host)->default_value("127.0.0.1"), "Server address")
+            ("port", po::value<int>(&cfg.port)->default_value(4096), "Port of the ingestion endpoint")
+            ("query-port", po::value<int>(&cfg.query_port)->default_value(0),
+                           "Port of the query endpoint (0 - don't measure ingest-to-visible latency)")
+            ("connections", po::value<int>(&cfg.nconnections)->default_value(4), "Number of connections")
+            ("rate", po::value<double>(&cfg.rate)->default_value(100000.0),
+                     "Target rate of all connections (samples/s, 0 - unlimited)")
+            ("duration", po::value<double>(&cfg.duration)->default_value(10.0), "Test duration (seconds)")
+            ("nseries", po::value<uint32_t>(&cfg.nseries)->default_value(1000), "Series cardinality")
+            ("batch", po::value<uint32_t>(&cfg.batch)->default_value(100), "Samples per write")
+            ("disorder", po::value<double>(&cfg.disorder)->default_value(0.0),
+                         "Fraction of the samples sent out of order")
+            ("max-delay", po::value<uint64_t>(&cfg.max_delay)->default_value(1000000),
+                          "Max time shift of the out of order samples (nanoseconds)")
+            ("format", po::value<std::string>(&format)->default_value("resp"), "Protocol: resp or binary")
+            ("sentinel-ms", po::value<uint32_t>(&cfg.sentinel_ms)->default_value(100), "Sentinel period (ms)")
+            ("sentinel-timeout", po::value<double>(&cfg.sentinel_timeout)->default_value(10.0),
+                                 "Sentinel is lost if it's not visible after timeout (seconds)")
+            ;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    if (cfg.nconnections <= 0 || cfg.batch == 0 || cfg.nseries == 0 || (format != "resp" && format != "binary")) {
+        std::cout << desc << std::endl;
+        return -1;
+    }
+    cfg.binary = format == "binary";
+
+    LoadState state;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < cfg.nconnections; i++) {
+        threads.emplace_back(&connection_worker, i, std::cref(cfg), &state);
+    }
+    std::thread probe;
+    if (cfg.query_port != 0) {
+        probe = std::thread(&prober, std::cref(cfg), &state);
+    }
+
+    // Progress is reported every second
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(cfg.duration));
+    uint64_t prev = 0;
+    while (Clock::now() < deadline && state.nerrors.load() < static_cast<uint64_t>(cfg.nconnections)) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        auto nsamples = state.nsamples.load();
+        std::cout << nsamples - prev << " samples/s" << std::endl;
+        prev = nsamples;
+    }
+    state.stop = true;
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    if (probe.joinable()) {
+        probe.join();
+    }
+
+    auto nsamples = state.nsamples.load();
+    std::cout << "Sent " << nsamples << " samples (" << state.nbytes.load() << " bytes) in "
+              << elapsed << "s, " << static_cast<uint64_t>(nsamples/elapsed) << " samples/s" << std::endl;
+    aku_LatencyStats stats;
+    state.send_latency.get_stats(&stats);
+    print_latency("Send latency", stats);
+    if (cfg.query_port != 0) {
+        state.visible_latency.get_stats(&stats);
+        print_latency("Ingest-to-visible latency", stats);
+        std::cout << "Sentinels lost: " << state.nlost.load()
+                  << ", query errors: " << state.nquery_errors.load() << std::endl;
+    }
+    if (state.nerrors.load()) {
+        std::cout << "Connection errors: " << state.nerrors.load() << std::endl;
+        return 1;
+    }
+    return 0;
+}
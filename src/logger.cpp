@@ -1,61 +1,332 @@
 #include "logger.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 namespace Akumuli {
 
 static log4cxx::LoggerPtr s_common_logger_ = log4cxx::Logger::getLogger("main");
 
 namespace details {
 
-CircularBuffer::CircularBuffer(size_t depth)
-    : trace_(depth)
+LogChannel::LogChannel(const char* log_name, size_t depth)
+    : logger_(log4cxx::Logger::getLogger(log_name))
+    , trace_(depth)
 {
 }
 
-CircularBuffer::CircularBuffer(CircularBuffer&& other)
-    : trace_(std::move(other.trace_))
+//! Preformatted log record
+struct LogRecord {
+    Formatter::SinkType         sink;
+    std::shared_ptr<LogChannel> channel;
+    std::string                 text;
+};
+
+/** Single producer single consumer ring of log records.
+  * Producer is the owner thread, consumer is the AsyncLogger thread.
+  */
+class LogRing {
+    std::vector<LogRecord> slots_;
+    const size_t           mask_;
+    std::atomic<size_t>    head_;     //< Next slot to write (changed by producer)
+    std::atomic<size_t>    tail_;     //< Next slot to read (changed by consumer)
+public:
+    std::atomic<uint64_t>  dropped_;  //< Number of records dropped because ring was full
+    std::atomic<bool>      orphan_;   //< Owner thread has exited
+
+    //! C-tor, size is rounded up to power of two
+    LogRing(size_t size)
+        : slots_(round_up(size))
+        , mask_(slots_.size() - 1)
+        , head_(0)
+        , tail_(0)
+        , dropped_(0)
+        , orphan_(false)
+    {
+    }
+
+    static size_t round_up(size_t size) {
+        size_t result = 2;
+        while (result < size) {
+            result *= 2;
+        }
+        return result;
+    }
+
+    bool push(LogRecord&& record) {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots_[head & mask_] = std::move(record);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    //! Pass all records to `fn` (slots are released before that), return number of records
+    template<class Fn>
+    size_t drain(Fn const& fn) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        auto head = head_.load(std::memory_order_acquire);
+        std::vector<LogRecord> records;
+        records.reserve(head - tail);
+        for (auto ix = tail; ix != head; ix++) {
+            records.push_back(std::move(slots_[ix & mask_]));
+        }
+        tail_.store(head, std::memory_order_release);
+        for (auto& record: records) {
+            fn(record);
+        }
+        return records.size();
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+};
+
+/** Rate limiter of the identical messages.
+  * Used only by the AsyncLogger thread.
+  */
+class RepeatFilter {
+    typedef std::chrono::steady_clock Clock;
+    struct Entry {
+        Clock::time_point           start;   //< Start of the window
+        uint64_t                    count;   //< Number of messages in the window
+        LogRecord                   record;  //< Copy of the first message
+    };
+    std::unordered_map<std::string, Entry> entries_;
+    const uint64_t                         max_repeats_;
+    const Clock::duration                  window_;
+
+    static std::string make_key(LogRecord const& record) {
+        std::string key = record.text;
+        auto channel = record.channel.get();
+        key.append(reinterpret_cast<const char*>(&channel), sizeof(channel));
+        key.push_back(static_cast<char>(record.sink));
+        return key;
+    }
+
+    //! Write number of suppressed messages
+    template<class Fn>
+    void summarize(Entry& entry, Fn const& write) {
+        if (entry.count > max_repeats_) {
+            std::stringstream fmt;
+            fmt << entry.record.text << " [" << (entry.count - max_repeats_) << " repeats suppressed]";
+            entry.record.text = fmt.str();
+            write(entry.record);
+        }
+    }
+
+public:
+    RepeatFilter(uint32_t max_repeats, std::chrono::milliseconds window)
+        : max_repeats_(max_repeats)
+        , window_(window)
+    {
+    }
+
+    //! Return true if record should be written
+    bool accept(LogRecord const& record, Clock::time_point now) {
+        if (max_repeats_ == 0 || record.sink == Formatter::BUFFER) {
+            return true;
+        }
+        auto key = make_key(record);
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            Entry entry = { now, 1u, record };
+            entries_.emplace(std::move(key), std::move(entry));
+            return true;
+        }
+        return ++it->second.count <= max_repeats_;
+    }
+
+    //! Forget expired (or all) windows, write numbers of suppressed messages
+    template<class Fn>
+    void expire(Clock::time_point now, bool all, Fn const& write) {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (all || now - it->second.start >= window_) {
+                summarize(it->second, write);
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+}
+
+namespace {
+
+using details::LogRecord;
+using details::LogRing;
+
+//! Background thread wakes up this often if there is nothing to write
+const std::chrono::milliseconds POLL_INTERVAL(10);
+
+struct AsyncLoggerState {
+    std::mutex                            mutex;        //< Guards rings, thread and stop
+    std::condition_variable               cvar;
+    std::vector<std::shared_ptr<LogRing>> rings;
+    std::thread                           thread;
+    bool                                  stop;
+    std::atomic<bool>                     running;
+    std::atomic<uint64_t>                 generation;   //< Incremented by every start
+    size_t                                ring_size;
+    uint32_t                              max_repeats;
+    std::chrono::milliseconds             window;
+    std::atomic<uint64_t>                 n_written;
+    std::atomic<uint64_t>                 n_dropped;
+    std::atomic<uint64_t>                 n_suppressed;
+
+    AsyncLoggerState()
+        : stop(false)
+        , running(false)
+        , generation(0)
+        , ring_size(0)
+        , max_repeats(0)
+        , window(0)
+        , n_written(0)
+        , n_dropped(0)
+        , n_suppressed(0)
+    {
+    }
+};
+
+AsyncLoggerState& async_state() {
+    static AsyncLoggerState state;
+    return state;
+}
+
+//! Ring of the thread
+struct RingHolder {
+    std::shared_ptr<LogRing> ring;
+    uint64_t                 generation;  //< Generation of the async logger that owns the ring
+
+    RingHolder();
+   ~RingHolder();
+};
+
+thread_local RingHolder ring_holder;
+//! Set when ring holder of the thread is destroyed (records are written by the thread after that)
+thread_local bool ring_holder_destroyed = false;
+
+RingHolder::RingHolder()
+    : generation(0)
 {
 }
 
+RingHolder::~RingHolder() {
+    if (ring) {
+        ring->orphan_.store(true);
+    }
+    ring_holder_destroyed = true;
+}
+
+void write_record(LogRecord const& record) {
+    Formatter::write(record.sink, *record.channel, record.text);
+    async_state().n_written.fetch_add(1, std::memory_order_relaxed);
+}
+
+void async_logger_worker() {
+    auto& state = async_state();
+    details::RepeatFilter filter(state.max_repeats, state.window);
+    auto process = [&filter, &state](LogRecord const& record) {
+        if (filter.accept(record, std::chrono::steady_clock::now())) {
+            write_record(record);
+        } else {
+            state.n_suppressed.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+    size_t nrecords = 0;
+    while (true) {
+        bool stop = false;
+        std::vector<std::shared_ptr<LogRing>> rings;
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            if (nrecords == 0) {
+                state.cvar.wait_for(lock, POLL_INTERVAL, [&state]() { return state.stop; });
+            }
+            stop = state.stop;
+            // Rings of the finished threads are removed after the last drain
+            rings = state.rings;
+            state.rings.erase(std::remove_if(state.rings.begin(), state.rings.end(),
+                                             [](std::shared_ptr<LogRing> const& ring) {
+                                                 return ring->orphan_.load() && ring->empty();
+                                             }),
+                              state.rings.end());
+        }
+        nrecords = 0;
+        uint64_t ndropped = 0;
+        for (auto& ring: rings) {
+            nrecords += ring->drain(process);
+            ndropped += ring->dropped_.exchange(0);
+        }
+        if (ndropped) {
+            state.n_dropped.fetch_add(ndropped, std::memory_order_relaxed);
+            LOG4CXX_ERROR(s_common_logger_, "Log ring overflow, " << ndropped << " records dropped");
+        }
+        filter.expire(std::chrono::steady_clock::now(), stop && nrecords == 0, &write_record);
+        if (stop && nrecords == 0) {
+            return;
+        }
+    }
+}
+
 }
 
 Formatter::Formatter()
     : sink_(NONE)
-    , buffer_(nullptr)
 {
 }
 
 Formatter::~Formatter() {
-    switch (sink_) {
+    if (sink_ == NONE) {
+        return;
+    }
+    auto msg = str_.str();
+    if (!AsyncLogger::push(sink_, std::move(channel_), std::move(msg))) {
+        write(sink_, *channel_, msg);
+    }
+}
+
+void Formatter::write(SinkType sink, details::LogChannel& channel, std::string const& msg) {
+    switch (sink) {
     case LOGGER_INFO:
-        LOG4CXX_INFO(logger_, str_.str());
+        LOG4CXX_INFO(channel.logger_, msg);
         break;
     case LOGGER_ERROR: {
         std::vector<std::string> trace;
         {
-            std::lock_guard<std::mutex> guard(buffer_->mutex_);
-            if (!buffer_->trace_.empty()) {
-                for(auto msg: buffer_->trace_) {
-                    if (!msg.empty()) {
-                        std::string tmp;
-                        std::swap(tmp, msg);
-                        trace.push_back(std::move(tmp));
-                    }
+            std::lock_guard<std::mutex> guard(channel.mutex_);
+            // Trace is written once, before the first error that follows it
+            for(auto& line: channel.trace_) {
+                if (!line.empty()) {
+                    std::string tmp;
+                    std::swap(tmp, line);
+                    trace.push_back(std::move(tmp));
                 }
             }
         }
         if (!trace.empty()) {
-            LOG4CXX_TRACE(logger_, "=Begin=trace=======================================================");
-            for(auto msg: trace) {
-                LOG4CXX_TRACE(logger_, msg);
+            LOG4CXX_TRACE(channel.logger_, "=Begin=trace=======================================================");
+            for(auto const& line: trace) {
+                LOG4CXX_TRACE(channel.logger_, line);
             }
-            LOG4CXX_TRACE(logger_, "==========================================================End=trace=");
+            LOG4CXX_TRACE(channel.logger_, "==========================================================End=trace=");
         }
-        LOG4CXX_ERROR(logger_, str_.str());
+        LOG4CXX_ERROR(channel.logger_, msg);
         break;
     }
     case BUFFER: {
-        std::lock_guard<std::mutex> guard(buffer_->mutex_);
-        buffer_->trace_.push_back(str_.str());
+        std::lock_guard<std::mutex> guard(channel.mutex_);
+        channel.trace_.push_back(msg);
         break;
     }
     case NONE:
@@ -63,41 +334,101 @@ Formatter::~Formatter() {
     };
 }
 
-void Formatter::set_info_sink(log4cxx::LoggerPtr logger) {
-    sink_ = LOGGER_INFO;
-    logger_ = logger;
-}
-
-void Formatter::set_trace_sink(details::CircularBuffer *buffer) {
-    sink_ = BUFFER;
-    buffer_ = buffer;
-}
-
-void Formatter::set_error_sink(log4cxx::LoggerPtr logger, details::CircularBuffer *buffer) {
-    sink_ = LOGGER_ERROR;
-    logger_ = logger;
-    buffer_ = buffer;
+void Formatter::set_sink(SinkType sink, std::shared_ptr<details::LogChannel> const& channel) {
+    sink_ = sink;
+    channel_ = channel;
 }
 
 Logger::Logger(const char* log_name, int depth)
-    : trace_(depth)
-    , plogger_(log4cxx::Logger::getLogger(log_name))
+    : channel_(std::make_shared<details::LogChannel>(log_name, depth))
 {
 }
 
 Formatter&& Logger::trace(Formatter&& fmt) {
-    fmt.set_trace_sink(&trace_);
+    fmt.set_sink(Formatter::BUFFER, channel_);
     return std::move(fmt);
 }
 
 Formatter&& Logger::info(Formatter&& fmt) {
-    fmt.set_info_sink(plogger_);
+    fmt.set_sink(Formatter::LOGGER_INFO, channel_);
     return std::move(fmt);
 }
 
 Formatter&& Logger::error(Formatter&& fmt) {
-    fmt.set_error_sink(plogger_, &trace_);
+    fmt.set_sink(Formatter::LOGGER_ERROR, channel_);
     return std::move(fmt);
 }
 
+void AsyncLogger::start(size_t ring_size, uint32_t max_repeats, uint32_t repeat_window_ms) {
+    auto& state = async_state();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    if (state.running.load()) {
+        return;
+    }
+    state.stop = false;
+    state.ring_size = ring_size;
+    state.max_repeats = max_repeats;
+    state.window = std::chrono::milliseconds(repeat_window_ms);
+    state.generation++;
+    state.thread = std::thread(&async_logger_worker);
+    state.running.store(true);
+}
+
+void AsyncLogger::stop() {
+    auto& state = async_state();
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> guard(state.mutex);
+        if (!state.running.load()) {
+            return;
+        }
+        // New records are written synchronously from now on, records
+        // that are already in the rings are written by the thread
+        state.running.store(false);
+        state.stop = true;
+        std::swap(thread, state.thread);
+    }
+    state.cvar.notify_all();
+    thread.join();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    state.rings.clear();
+}
+
+bool AsyncLogger::is_running() {
+    return async_state().running.load();
+}
+
+AsyncLogger::Stats AsyncLogger::get_stats() {
+    auto& state = async_state();
+    Stats stats = {
+        state.n_written.load(),
+        state.n_dropped.load(),
+        state.n_suppressed.load(),
+    };
+    return stats;
+}
+
+bool AsyncLogger::push(Formatter::SinkType sink, std::shared_ptr<details::LogChannel>&& channel, std::string&& msg) {
+    auto& state = async_state();
+    if (!state.running.load(std::memory_order_acquire) || ring_holder_destroyed) {
+        return false;
+    }
+    auto& holder = ring_holder;
+    auto generation = state.generation.load();
+    if (!holder.ring || holder.generation != generation) {
+        // First record of the thread, ring is registered once
+        std::lock_guard<std::mutex> guard(state.mutex);
+        if (!state.running.load()) {
+            return false;
+        }
+        holder.ring = std::make_shared<LogRing>(state.ring_size);
+        holder.generation = state.generation.load();
+        state.rings.push_back(holder.ring);
+    }
+    LogRecord record = { sink, std::move(channel), std::move(msg) };
+    // Record is dropped if ring is full, number of dropped records is logged
+    holder.ring->push(std::move(record));
+    return true;
+}
+
 }  // namespace
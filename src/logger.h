@@ -17,6 +17,8 @@
 #pragma once
 #include <sstream>
 #include <mutex>
+#include <memory>
+#include <cstdint>
 
 #include <log4cxx/logger.h>
 
@@ -26,12 +28,13 @@ namespace Akumuli {
 
 namespace details {
 
-struct CircularBuffer {
+//! Destination of the log records (shared by logger and records in flight)
+struct LogChannel {
+    log4cxx::LoggerPtr logger_;
     boost::circular_buffer<std::string> trace_;
-    std::mutex mutex_;
+    std::mutex mutex_;  //< Guards trace_
 
-    CircularBuffer(size_t depth);
-    CircularBuffer(CircularBuffer&& other);
+    LogChannel(const char* log_name, size_t depth);
 };
 
 }
@@ -48,16 +51,16 @@ private:
     std::stringstream str_;
     // Optional parameters
     SinkType sink_;
-    log4cxx::LoggerPtr logger_;
-    details::CircularBuffer *buffer_;
+    std::shared_ptr<details::LogChannel> channel_;
 public:
     Formatter();
 
     ~Formatter();
 
-    void set_info_sink(log4cxx::LoggerPtr logger);
-    void set_trace_sink(details::CircularBuffer *buffer);
-    void set_error_sink(log4cxx::LoggerPtr logger, details::CircularBuffer *buffer);
+    void set_sink(SinkType sink, std::shared_ptr<details::LogChannel> const& channel);
+
+    //! Write record to channel (in caller's thread)
+    static void write(SinkType sink, details::LogChannel& channel, std::string const& msg);
 
     template<class T>
     Formatter& operator << (T const& value) {
@@ -67,11 +70,13 @@ public:
 };
 
 /** Logger class.
+  * Trace messages are stored in memory and written only before the next
+  * error. Records are written by the caller or, if AsyncLogger is started,
+  * by the background thread.
   */
 class Logger
 {
-    details::CircularBuffer trace_;
-    log4cxx::LoggerPtr plogger_;
+    std::shared_ptr<details::LogChannel> channel_;
 public:
     Logger(const char* log_name, int depth);
 
@@ -80,5 +85,52 @@ public:
     Formatter&& error(Formatter&& fmt = Formatter());
 };
 
+/** Asynchronous logging backend.
+  * Every thread puts preformatted records to its own lock-free ring, rings
+  * are drained by one background thread that writes records to log4cxx.
+  * Writers never block: if the ring is full the record is dropped (number
+  * of dropped records is logged). Identical messages of the same logger
+  * are rate limited, only first `max_repeats` messages are written during
+  * the `repeat_window`, number of suppressed messages is written after
+  * the window.
+  */
+class AsyncLogger
+{
+public:
+    enum {
+        DEFAULT_RING_SIZE = 0x1000,     //< Records per thread
+        DEFAULT_MAX_REPEATS = 10,       //< Identical messages per window
+        DEFAULT_REPEAT_WINDOW = 1000,   //< Milliseconds
+    };
+
+    struct Stats {
+        uint64_t n_written;     //< Records written to log4cxx
+        uint64_t n_dropped;     //< Records dropped because the ring was full
+        uint64_t n_suppressed;  //< Records suppressed by rate limiter
+    };
+
+    /** Start background thread, records of all loggers are written by it
+      * until `stop` is called. Should be stopped before exit.
+      * @param ring_size capacity of the ring of each thread
+      * @param max_repeats max number of identical messages per window, 0 - unlimited
+      * @param repeat_window_ms length of the rate limiting window in milliseconds
+      */
+    static void start(size_t ring_size = DEFAULT_RING_SIZE,
+                      uint32_t max_repeats = DEFAULT_MAX_REPEATS,
+                      uint32_t repeat_window_ms = DEFAULT_REPEAT_WINDOW);
+
+    //! Write all pending records and stop background thread, loggers become synchronous
+    static void stop();
+
+    static bool is_running();
+
+    static Stats get_stats();
+
+    /** Put record to the ring of the calling thread.
+      * @return false if async logger isn't running (record should be written by caller)
+      */
+    static bool push(Formatter::SinkType sink, std::shared_ptr<details::LogChannel>&& channel, std::string&& msg);
+};
+
 }
 
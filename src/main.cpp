@@ -1,7 +1,10 @@
 #include "tcp_server.h"
+#include "logger.h"
 
 #include <iostream>
 #include <regex>
+#include <thread>
+#include <algorithm>
 
 #include <boost/program_options.hpp>
 #include <apr_errno.h>
@@ -48,11 +51,17 @@ void create_db(const char* name,
     }
 }
 
-void run_server(std::string path) {
+void run_server(std::string path, uint32_t nwriters, int metrics_port, int udp_port, bool per_core,
+                size_t buffer_size, int query_port, bool hugetlb, bool numa)
+{
     auto connection = std::make_shared<AkumuliConnection>(path.c_str(),
-                                                          false,
+                                                          hugetlb,
+                                                          numa,
                                                           AkumuliConnection::MaxDurability);
-    TcpServer server(connection, 4);
+    // Per-core mode runs one I/O thread on every CPU
+    int concurrency = per_core ? std::max(static_cast<int>(std::thread::hardware_concurrency()), 1) : 4;
+    TcpServer server(connection, concurrency, nwriters, metrics_port, udp_port, per_core, buffer_size,
+                     query_port);
     server.start();
     server.wait();
     server.stop();
@@ -82,6 +91,16 @@ int main(int argc, char** argv) {
             ("name", po::value<std::string>(), "Database name (create)")
             ("nvolumes", po::value<int32_t>(), "Number of volumes to create (create)")
             ("window", po::value<std::string>(), "Window size (create)")
+            ("writers", po::value<uint32_t>(), "Number of pipeline writer threads (default: one per storage shard)")
+            ("metrics-port", po::value<int>()->default_value(8282), "Port of the text metrics endpoint (0 - disabled)")
+            ("udp-port", po::value<int>()->default_value(0), "Port of the UDP listener (0 - disabled)")
+            ("per-core", "Use io-service and listening socket (SO_REUSEPORT) per CPU core")
+            ("buffer-size", po::value<size_t>()->default_value(TcpSession::DEFAULT_BUFFER_SIZE),
+                            "Receive buffer size of the TCP sessions (bytes)")
+            ("query-port", po::value<int>()->default_value(0), "Port of the query endpoint (0 - disabled)")
+            ("hugetlb", "Back volumes with huge pages (hugetlbfs or filesystem with transparent huge pages)")
+            ("numa", "Place active volumes on the NUMA node of the writers, interleave historical volumes")
+            ("sync-log", "Write log records in the calling thread (by default records are written by the background thread)")
             ;
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -96,7 +115,16 @@ int main(int argc, char** argv) {
     }
     std::string path = vm["path"].as<std::string>();
     if (vm.count("create") == 0) {
-        run_server(path);
+        uint32_t nwriters = vm.count("writers") ? vm["writers"].as<uint32_t>() : 0u;
+        int metrics_port = vm["metrics-port"].as<int>();
+        int udp_port = vm["udp-port"].as<int>();
+        if (vm.count("sync-log") == 0) {
+            AsyncLogger::start();
+        }
+        run_server(path, nwriters, metrics_port, udp_port, vm.count("per-core") != 0,
+                   vm["buffer-size"].as<size_t>(), vm["query-port"].as<int>(),
+                   vm.count("hugetlb") != 0, vm.count("numa") != 0);
+        AsyncLogger::stop();
     } else {
         if (vm.count("nvolumes") == 0 || vm.count("name") == 0 || vm.count("window") == 0) {
             std::cout << desc << std::endl;
@@ -0,0 +1,445 @@
+/**
+ * Read path performance test.
+ *
+ * Creates database with configurable number of volumes, series cardinality,
+ * out of order ratio and compression threshold, fills it with data and runs
+ * different kinds of queries against it:
+ *
+ * - point lookups (one series, one timestamp);
+ * - short backward ranges (one series);
+ * - long forward scans (one series);
+ * - multi-series selects (forward).
+ *
+ * Every kind of query is executed on cold (database reopened, page cache of
+ * the volumes dropped) and warm storage. Latency percentiles, throughput,
+ * search counters and data TLB misses are reported for every run. Runs with
+ * and without `--hugetlb` and `--numa` can be compared by TLB misses.
+ *
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "akumuli.h"
+#include "perftest_tools.h"
+
+namespace po = boost::program_options;
+using namespace Akumuli;
+
+namespace {
+
+const char* DB_NAME = "perf_query";
+
+struct Config {
+    std::string path;
+    int32_t     nvolumes;
+    uint32_t    nseries;
+    uint64_t    npoints;
+    double      ooo_ratio;      //< Fraction of the samples that are written out of order
+    uint32_t    threshold;      //< Compression threshold
+    uint64_t    window;
+    uint32_t    nqueries;
+    uint32_t    short_range;    //< Length of the short backward range
+    uint32_t    multi_series;   //< Number of series in multi-series select
+    bool        hugetlb;        //< Back volumes with huge pages
+    bool        numa;           //< NUMA aware placement of the volumes
+};
+
+//! Created before the database, threads of the database inherit the counter
+TlbMissCounter* tlb_counter = nullptr;
+
+enum QueryKind {
+    POINT,
+    SHORT_BACKWARD,
+    LONG_FORWARD,
+    MULTI_SERIES,
+};
+
+const char* query_kind_name(QueryKind kind) {
+    switch (kind) {
+    case POINT:
+        return "point lookup";
+    case SHORT_BACKWARD:
+        return "short backward range";
+    case LONG_FORWARD:
+        return "long forward scan";
+    case MULTI_SERIES:
+        return "multi-series select";
+    }
+    return "unknown";
+}
+
+void error_logger(int tag, const char* msg) {
+    if (tag == AKU_LOG_ERROR) {
+        std::cerr << msg << std::endl;
+    }
+}
+
+std::string metadata_file(Config const& cfg) {
+    return cfg.path + "/" + DB_NAME + ".akumuli";
+}
+
+aku_Database* open_database(Config const& cfg) {
+    aku_FineTuneParams params = {};
+    params.durability = AKU_MAX_WRITE_SPEED;
+    params.logger = &error_logger;
+    params.enable_huge_tlb = cfg.hugetlb ? 1u : 0u;
+    params.numa_policy = cfg.numa ? 1u : 0u;
+    auto db = aku_open_database(metadata_file(cfg).c_str(), params);
+    auto status = aku_open_status(db);
+    if (status != AKU_SUCCESS) {
+        std::cerr << "Can't open database: " << aku_error_message(status) << std::endl;
+        aku_close_database(db);
+        return nullptr;
+    }
+    return db;
+}
+
+/** Fill database with data.
+  * Sample `i` belongs to the random series and has timestamp `i`, out of order
+  * samples are moved back in time by random distance inside the window.
+  */
+bool fill_database(aku_Database* db, Config const& cfg) {
+    std::mt19937_64 gen(42);
+    std::uniform_int_distribution<aku_ParamId> series(1u, cfg.nseries);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::uniform_int_distribution<uint64_t> shift(1u, std::max<uint64_t>(cfg.window/2, 1u));
+    uint64_t nbusy = 0, nlate = 0;
+    auto tlb_misses = tlb_counter->read();
+    PerfTimer timer;
+    for (uint64_t i = 0; i < cfg.npoints; i++) {
+        aku_TimeStamp ts = cfg.window + i;
+        if (cfg.ooo_ratio > 0.0 && coin(gen) < cfg.ooo_ratio) {
+            ts -= shift(gen);
+        }
+        auto id = series(gen);
+        double value = static_cast<double>(i % 1000)*0.1;
+        auto status = aku_write_double_raw(db, id, ts, value);
+        while (status == AKU_EBUSY) {
+            nbusy++;
+            status = aku_write_double_raw(db, id, ts, value);
+        }
+        if (status == AKU_ELATE_WRITE) {
+            nlate++;
+        } else if (status != AKU_SUCCESS) {
+            std::cerr << "Write error: " << aku_error_message(status) << std::endl;
+            return false;
+        }
+    }
+    double elapsed = timer.elapsed();
+    std::cout << "Database filled in " << elapsed << "s, " << static_cast<uint64_t>(cfg.npoints/elapsed)
+              << " samples/s, busy: " << nbusy << ", late: " << nlate << std::endl;
+    if (tlb_counter->is_available()) {
+        tlb_misses = tlb_counter->read() - tlb_misses;
+        std::cout << "  dTLB load misses: " << tlb_misses
+                  << " (" << static_cast<double>(tlb_misses)/cfg.npoints << " per sample)" << std::endl;
+    }
+    return true;
+}
+
+/** Evict volumes from page cache.
+  * Database should be closed, pages that are mapped by the process can't be evicted.
+  * Dirty pages are written first, otherwise they stay in memory.
+  */
+void drop_page_cache(Config const& cfg) {
+    sync();
+    std::ofstream drop_caches("/proc/sys/vm/drop_caches");
+    if (drop_caches << "1" << std::flush) {
+        return;
+    }
+    // Not a root, evict only database files
+    namespace fs = boost::filesystem;
+    for (fs::recursive_directory_iterator it(cfg.path), end; it != end; ++it) {
+        if (!fs::is_regular_file(it->status())) {
+            continue;
+        }
+        int fd = open(it->path().c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+aku_SelectQuery* make_query(QueryKind kind, Config const& cfg, std::mt19937_64& gen) {
+    std::uniform_int_distribution<aku_ParamId> series(1u, cfg.nseries);
+    const aku_TimeStamp first = cfg.window;
+    const aku_TimeStamp last = cfg.window + cfg.npoints - 1;
+    const aku_TimeStamp long_range = std::max<aku_TimeStamp>(cfg.npoints/10, 1u);
+    std::vector<aku_ParamId> ids;
+    aku_TimeStamp begin = 0u, end = 0u;
+    switch (kind) {
+    case POINT: {
+        begin = end = std::uniform_int_distribution<aku_TimeStamp>(first, last)(gen);
+        ids.push_back(series(gen));
+        break;
+    }
+    case SHORT_BACKWARD: {
+        // end < begin - backward query
+        end = std::uniform_int_distribution<aku_TimeStamp>(first, last)(gen);
+        begin = end + cfg.short_range;
+        ids.push_back(series(gen));
+        break;
+    }
+    case LONG_FORWARD: {
+        begin = std::uniform_int_distribution<aku_TimeStamp>(first, std::max(first, last - long_range))(gen);
+        end = begin + long_range;
+        ids.push_back(series(gen));
+        break;
+    }
+    case MULTI_SERIES: {
+        begin = std::uniform_int_distribution<aku_TimeStamp>(first, last)(gen);
+        end = begin + 100u*cfg.short_range;
+        for (uint32_t i = 0; i < cfg.multi_series; i++) {
+            ids.push_back(series(gen));
+        }
+        break;
+    }
+    }
+    return aku_make_select_query(begin, end, static_cast<uint32_t>(ids.size()), ids.data());
+}
+
+struct RunResult {
+    std::vector<double> latencies;  //< Seconds
+    uint64_t            nresults;
+    double              elapsed;
+    uint64_t            tlb_misses;  //< Data TLB load misses of the run
+    aku_SearchStats     slowest;     //< Search counters of the slowest query
+};
+
+/** Execute query and read all results.
+  * @return number of results or -1 on error
+  */
+int64_t execute(aku_Database* db, aku_SelectQuery* query, aku_SearchStats* stats) {
+    const size_t NUM_ELEMENTS = 0x1000;
+    static aku_TimeStamp timestamps[NUM_ELEMENTS];
+    static aku_ParamId   paramids[NUM_ELEMENTS];
+    static aku_PData     pointers[NUM_ELEMENTS];
+    static uint32_t      lengths[NUM_ELEMENTS];
+    int64_t nresults = 0;
+    auto cursor = aku_select(db, query);
+    while (!aku_cursor_is_done(cursor)) {
+        int err = AKU_SUCCESS;
+        if (aku_cursor_is_error(cursor, &err)) {
+            std::cerr << "Query error: " << aku_error_message(err) << std::endl;
+            aku_close_cursor(cursor);
+            return -1;
+        }
+        nresults += aku_cursor_read_columns(cursor, timestamps, paramids, pointers, lengths, NUM_ELEMENTS);
+    }
+    aku_cursor_stats(cursor, stats);
+    aku_close_cursor(cursor);
+    return nresults;
+}
+
+bool run_queries(aku_Database* db, QueryKind kind, Config const& cfg, uint32_t nqueries, RunResult* result) {
+    std::mt19937_64 gen(static_cast<uint64_t>(kind) + 1u);
+    result->latencies.clear();
+    result->nresults = 0u;
+    memset(&result->slowest, 0, sizeof(aku_SearchStats));
+    // Queries are generated before the run to measure only the storage
+    std::vector<aku_SelectQuery*> queries;
+    for (uint32_t i = 0; i < nqueries; i++) {
+        queries.push_back(make_query(kind, cfg, gen));
+    }
+    bool success = true;
+    double max_latency = 0.0;
+    auto tlb_misses = tlb_counter->read();
+    PerfTimer total;
+    for (auto query: queries) {
+        aku_SearchStats stats;
+        PerfTimer timer;
+        auto n = execute(db, query, &stats);
+        double latency = timer.elapsed();
+        if (n < 0) {
+            success = false;
+            break;
+        }
+        if (latency >= max_latency) {
+            max_latency = latency;
+            result->slowest = stats;
+        }
+        result->latencies.push_back(latency);
+        result->nresults += static_cast<uint64_t>(n);
+    }
+    result->elapsed = total.elapsed();
+    result->tlb_misses = tlb_counter->read() - tlb_misses;
+    for (auto query: queries) {
+        aku_destroy(query);
+    }
+    return success;
+}
+
+double percentile(std::vector<double> const& sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    auto ix = static_cast<size_t>(p*(sorted.size() - 1) + 0.5);
+    return sorted.at(ix);
+}
+
+void print_search_stats(const char* title, aku_SearchStats const& ss) {
+    std::cout << "  " << title << ":"
+              << " isearch " << ss.istats.n_times << "/" << ss.istats.n_steps
+              << " (matches " << ss.istats.n_matches
+              << ", overshoots " << ss.istats.n_overshoots
+              << ", undershoots " << ss.istats.n_undershoots << ")"
+              << ", bsearch " << ss.bstats.n_times << "/" << ss.bstats.n_steps
+              << ", readahead " << ss.scan.n_readahead << "/" << ss.scan.n_readahead_resident
+              << ", chunk cache " << ss.cache.n_hits << "/" << ss.cache.n_misses
+              << ", stacks " << ss.stacks.n_hits << "/" << ss.stacks.n_misses
+              << std::endl;
+}
+
+void print_result(QueryKind kind, const char* mode, RunResult& result) {
+    auto& lat = result.latencies;
+    std::sort(lat.begin(), lat.end());
+    const double USEC = 1000000.0;
+    std::cout << query_kind_name(kind) << ", " << mode << ": "
+              << lat.size() << " queries in " << result.elapsed << "s, "
+              << static_cast<uint64_t>(lat.size()/result.elapsed) << " queries/s, "
+              << static_cast<uint64_t>(result.nresults/result.elapsed) << " results/s" << std::endl;
+    std::cout << std::fixed << std::setprecision(1)
+              << "  latency (us): p50 " << percentile(lat, 0.5)*USEC
+              << ", p90 " << percentile(lat, 0.9)*USEC
+              << ", p99 " << percentile(lat, 0.99)*USEC
+              << ", max " << (lat.empty() ? 0.0 : lat.back()*USEC)
+              << std::defaultfloat << std::endl;
+    if (tlb_counter->is_available()) {
+        std::cout << "  dTLB load misses: " << result.tlb_misses << " ("
+                  << static_cast<uint64_t>(result.tlb_misses/std::max<size_t>(lat.size(), 1u)) << " per query)"
+                  << std::endl;
+    }
+    aku_SearchStats stats;
+    aku_global_search_stats(&stats, true);
+    print_search_stats("search stats", stats);
+    print_search_stats("slowest query", result.slowest);
+}
+
+}
+
+int main(int argc, char** argv) {
+    Config cfg;
+    po::options_description desc("Read path performance test");
+    desc.add_options()
+            ("help", "Produce help message")
+            ("path", po::value<std::string>(&cfg.path)->default_value("./perf_query_db"),
+                     "Path to database files (contents are removed)")
+            ("nvolumes", po::value<int32_t>(&cfg.nvolumes)->default_value(4), "Number of volumes")
+            ("nseries", po::value<uint32_t>(&cfg.nseries)->default_value(1000), "Number of series")
+            ("npoints", po::value<uint64_t>(&cfg.npoints)->default_value(10000000), "Number of samples")
+            ("ooo-ratio", po::value<double>(&cfg.ooo_ratio)->default_value(0.0),
+                          "Fraction of the samples written out of order (inside the window)")
+            ("threshold", po::value<uint32_t>(&cfg.threshold)->default_value(1000), "Compression threshold")
+            ("window", po::value<uint64_t>(&cfg.window)->default_value(10000), "Window size")
+            ("nqueries", po::value<uint32_t>(&cfg.nqueries)->default_value(1000),
+                         "Number of queries per run (long scans - one tenth)")
+            ("short-range", po::value<uint32_t>(&cfg.short_range)->default_value(1000),
+                            "Length of the short backward range")
+            ("multi-series", po::value<uint32_t>(&cfg.multi_series)->default_value(10),
+                             "Number of series in multi-series select")
+            ("hugetlb", "Back volumes with huge pages (hugetlbfs or filesystem with transparent huge pages)")
+            ("numa", "Place active volumes on the NUMA node of the writer, interleave historical volumes")
+            ("read-only", "Query existing database (created by previous run)")
+            ("keep", "Don't remove database after the test")
+            ;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    if (cfg.nseries == 0 || cfg.npoints == 0) {
+        std::cout << desc << std::endl;
+        return -1;
+    }
+
+    cfg.hugetlb = vm.count("hugetlb") != 0;
+    cfg.numa = vm.count("numa") != 0;
+    TlbMissCounter counter;
+    if (!counter.is_available()) {
+        std::cout << "dTLB miss counter is not available" << std::endl;
+    }
+    tlb_counter = &counter;
+
+    aku_initialize(nullptr);
+
+    if (vm.count("read-only") == 0) {
+        aku_remove_database(metadata_file(cfg).c_str(), &error_logger);
+        boost::filesystem::create_directories(cfg.path);
+        auto status = aku_create_database(DB_NAME, cfg.path.c_str(), cfg.path.c_str(), cfg.nvolumes,
+                                          cfg.threshold, cfg.window, 0u, &error_logger);
+        if (status != AKU_SUCCESS) {
+            std::cerr << "Can't create database" << std::endl;
+            return 1;
+        }
+        auto db = open_database(cfg);
+        if (db == nullptr) {
+            return 1;
+        }
+        bool success = fill_database(db, cfg);
+        aku_close_database(db);
+        if (!success) {
+            return 1;
+        }
+    }
+
+    int retcode = 0;
+    for (auto kind: { POINT, SHORT_BACKWARD, LONG_FORWARD, MULTI_SERIES }) {
+        auto nqueries = kind == LONG_FORWARD ? std::max(cfg.nqueries/10, 1u) : cfg.nqueries;
+        drop_page_cache(cfg);
+        auto db = open_database(cfg);
+        if (db == nullptr) {
+            return 1;
+        }
+        // Reset counters of the previous run
+        aku_SearchStats ignored;
+        aku_global_search_stats(&ignored, true);
+        RunResult result;
+        // Cold run warms up the cache for the warm run, queries are the same
+        for (auto mode: { "cold", "warm" }) {
+            if (!run_queries(db, kind, cfg, nqueries, &result)) {
+                retcode = 2;
+                break;
+            }
+            print_result(kind, mode, result);
+        }
+        aku_close_database(db);
+        if (retcode) {
+            break;
+        }
+    }
+
+    if (vm.count("keep") == 0) {
+        aku_remove_database(metadata_file(cfg).c_str(), &error_logger);
+    }
+    return retcode;
+}
@@ -1,24 +1,72 @@
 #include "resp.h"
+#include "protocolparser.h"
+#include "fastparse.h"
 #include "perftest_tools.h"
 #include <iostream>
 #include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <functional>
 
 const int TEST_ITERATIONS = 100000;
 const int N_TESTS = 1000;
+const size_t PDU_SIZE = 0x1000;  // Same as TcpSession's buffer size
 
 using namespace Akumuli;
 
 bool push_to_graphite = false;
 
+//! Consumer that checks and counts samples
+struct CountingConsumer : ProtocolConsumer {
+    uint64_t nsamples = 0;
+    uint64_t nerrors = 0;
+    aku_TimeStamp expected_ts = 1234567;
+
+    virtual void write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
+        nsamples++;
+        if (param != 1234567 || ts != expected_ts || std::abs(data - 3.14159) > 0.0001) {
+            nerrors++;
+        }
+    }
+
+    virtual void write_samples(ProtocolSample const* samples, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            write_double(samples[i].id, samples[i].ts, samples[i].value);
+        }
+    }
+
+    virtual aku_Status add_bulk_string(const Byte*, size_t) {
+        nerrors++;
+        return AKU_SUCCESS;
+    }
+};
+
+static void report(const char* name, int nmessages, std::vector<double> const& timedeltas) {
+    double min = std::numeric_limits<double>::max();
+    for (auto t: timedeltas) {
+        min = std::min(min, t);
+    }
+    std::cout << name << ": parsing " << nmessages << " messages in " << min << " sec ("
+              << static_cast<uint64_t>(nmessages/min) << " msgs/sec)" << std::endl;
+    if (push_to_graphite) {
+        push_metric_to_graphite(name, 1000.0*min);
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc == 2) {
         push_to_graphite = std::string(argv[1]) == "graphite";
     }
-    const char* pattern = ":1234567\r\n+3.14159\r\n";
+    // id, timestamp and value
+    const char* pattern = ":1234567\r\n:1234567\r\n+3.14159\r\n";
+    const int nmessages = TEST_ITERATIONS/3*3;
     std::string input;
-    for (int i = 0; i < TEST_ITERATIONS/2; i++) {
+    for (int i = 0; i < nmessages/3; i++) {
         input += pattern;
     }
+
+    // Byte stream reader
     std::vector<double> timedeltas;
     uint64_t intvalue;
     Byte buffer[RESPStream::STRING_LENGTH_MAX];
@@ -26,7 +74,7 @@ int main(int argc, char *argv[]) {
         PerfTimer tm;
         MemStreamReader stream(input.data(), input.size());
         RESPStream protocol(&stream);
-        for (int j = TEST_ITERATIONS; j --> 0;) {
+        for (int j = nmessages; j --> 0;) {
             auto type = protocol.next_type();
             switch(type) {
             case RESPStream::INTEGER:
@@ -42,9 +90,10 @@ int main(int argc, char *argv[]) {
                         std::cerr << "Bad string value at " << j << std::endl;
                         return -1;
                     }
+                    buffer[len] = '\0';
                     char *p = buffer;
                     double res = strtod(buffer, &p);
-                    if (abs(res - 3.14159) > 0.0001) {
+                    if (std::abs(res - 3.14159) > 0.0001) {
                         std::cerr << "Can't parse float at " << j << std::endl;
                         return -1;
                     }
@@ -61,13 +110,103 @@ int main(int argc, char *argv[]) {
         }
         timedeltas.push_back(tm.elapsed());
     }
-    double min = std::numeric_limits<double>::max();
-    for (auto t: timedeltas) {
-        min = std::min(min, t);
+    report("respstream", nmessages, timedeltas);
+
+    // Protocol parser, input is split into PDUs the same way TcpSession does it
+    auto run_parser = [](const char* name, std::string const& input, int nmessages, aku_TimeStamp expected_ts) {
+        std::vector<PDU> pdus;
+        std::shared_ptr<const Byte> data(input.data(), [](const Byte*) {});
+        for (size_t pos = 0; pos < input.size(); pos += PDU_SIZE) {
+            PDU pdu = { data, std::min(pos + PDU_SIZE, input.size()), pos };
+            pdus.push_back(pdu);
+        }
+        std::vector<double> timedeltas;
+        for (int i = N_TESTS; i --> 0;) {
+            auto consumer = std::make_shared<CountingConsumer>();
+            consumer->expected_ts = expected_ts;
+            PerfTimer tm;
+            ProtocolParser parser(consumer);
+            for (auto const& pdu: pdus) {
+                parser.parse_next(pdu);
+            }
+            timedeltas.push_back(tm.elapsed());
+            if (consumer->nsamples != static_cast<uint64_t>(nmessages/3) || consumer->nerrors != 0) {
+                std::cerr << "Protocol parser error" << std::endl;
+                return false;
+            }
+        }
+        report(name, nmessages, timedeltas);
+        return true;
+    };
+    if (!run_parser("protocolparser", input, nmessages, 1234567)) {
+        return -1;
     }
-    std::cout << "Parsing " << TEST_ITERATIONS << " messages in " << min << " sec." << std::endl;
-    if (push_to_graphite) {
-        push_metric_to_graphite("respstream", 1000.0*min);
+
+    // Same messages with ISO 8601 timestamps
+    const char* iso_pattern = ":1234567\r\n+2015-03-14T15:09:26.535897932Z\r\n+3.14159\r\n";
+    const aku_TimeStamp iso_ts = 1426345766535897932ull;
+    std::string iso_input;
+    for (int i = 0; i < nmessages/3; i++) {
+        iso_input += iso_pattern;
+    }
+    if (!run_parser("protocolparser-iso8601", iso_input, nmessages, iso_ts)) {
+        return -1;
+    }
+
+    // Value and timestamp parsers (one string parsed over and over again)
+    const int nvalues = TEST_ITERATIONS;
+    const std::string values[] = { "3.14159", "-0.000123", "1234567.25", "2.718281828459045" };
+    const size_t nvariants = sizeof(values)/sizeof(values[0]);
+    auto run_values = [&](const char* name, std::function<double(std::string const&)> parse) {
+        std::vector<double> timedeltas;
+        double sum = 0;
+        for (int i = N_TESTS/10; i --> 0;) {
+            PerfTimer tm;
+            for (int j = 0; j < nvalues; j++) {
+                sum += parse(values[j % nvariants]);
+            }
+            timedeltas.push_back(tm.elapsed());
+        }
+        report(name, nvalues, timedeltas);
+        return sum;
+    };
+    double sum_strtod = run_values("strtod", [](std::string const& str) {
+        // Null-terminated copy, as the parser used to do
+        char buffer[RESPStream::STRING_LENGTH_MAX + 1];
+        memcpy(buffer, str.data(), str.size());
+        buffer[str.size()] = '\0';
+        return strtod(buffer, nullptr);
+    });
+    double sum_fast = run_values("parse_double", [](std::string const& str) {
+        double value = 0;
+        parse_double(str.data(), str.data() + str.size(), &value);
+        return value;
+    });
+    if (sum_strtod != sum_fast) {
+        std::cerr << "parse_double error" << std::endl;
+        return -1;
+    }
+
+    const std::string stamps[] = {
+        "2015-03-14T15:09:26.535897932Z", "2015-03-14T15:09:26Z", "20150314T150926.535897932",
+        "2015-03-14T18:39:26.5+03:30",
+    };
+    const size_t nstamps = sizeof(stamps)/sizeof(stamps[0]);
+    timedeltas.clear();
+    aku_TimeStamp checksum = 0;
+    for (int i = N_TESTS/10; i --> 0;) {
+        PerfTimer tm;
+        for (int j = 0; j < nvalues; j++) {
+            auto const& str = stamps[j % nstamps];
+            aku_TimeStamp ts;
+            if (!parse_iso8601(str.data(), str.data() + str.size(), &ts)) {
+                std::cerr << "parse_iso8601 error" << std::endl;
+                return -1;
+            }
+            checksum += ts;
+        }
+        timedeltas.push_back(tm.elapsed());
     }
-    return 0;
+    report("parse_iso8601", nvalues, timedeltas);
+    return checksum == 0 ? -1 : 0;
 }
@@ -3,6 +3,10 @@
 #include <chrono>
 #include <cstdlib>
 #include <time.h>
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "perftest_tools.h"
 
 namespace Akumuli {
@@ -22,6 +26,38 @@ double PerfTimer::elapsed() const {
            double(curr.tv_nsec - _start_time.tv_nsec)/1000000000.0;
 }
 
+TlbMissCounter::TlbMissCounter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    _fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+TlbMissCounter::~TlbMissCounter() {
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+bool TlbMissCounter::is_available() const {
+    return _fd >= 0;
+}
+
+uint64_t TlbMissCounter::read() const {
+    uint64_t value = 0;
+    if (_fd < 0 || ::read(_fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
 void push_metric_to_graphite(std::string metric, double value) {
 #ifdef DEBUG
     return;
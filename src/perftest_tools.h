@@ -16,6 +16,8 @@
 
 #pragma once
 #include <time.h>
+#include <cstdint>
+#include <string>
 
 namespace Akumuli {
 
@@ -29,6 +31,24 @@ private:
     timespec _start_time;
 };
 
+/** Hardware counter of the data TLB load misses (perf_event_open).
+  * Counts misses of the calling thread and of the threads that it creates
+  * after the counter. Use difference between two reads to measure the run.
+  * Counter can be unavailable (virtual machine, perf_event_paranoid setting).
+  */
+class TlbMissCounter
+{
+public:
+    TlbMissCounter();
+    ~TlbMissCounter();
+    TlbMissCounter(TlbMissCounter const&) = delete;
+    TlbMissCounter& operator = (TlbMissCounter const&) = delete;
+    bool     is_available() const;
+    uint64_t read() const;
+private:
+    int _fd;
+};
+
 /** Put value to graphite. Graphite host should be defined in
  * `GRAPHITE_HOST` environment variable.
  */
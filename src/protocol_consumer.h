@@ -21,6 +21,17 @@ namespace Akumuli {
 
 typedef char Byte;
 
+//! Decoded sample
+struct ProtocolSample {
+    aku_ParamId            id;                               //< Measurement ID
+    aku_TimeStamp          ts;                               //< Measurement timestamp
+    union {
+        double             value;                            //< Value
+        int64_t            ivalue;                           //< Integer value (if is_int is set)
+    };
+    bool                   is_int;                           //< Value type
+};
+
 /** Protocol consumer. All decoded data goes here.
   * Abstract class.
   */
@@ -30,8 +41,35 @@ struct ProtocolConsumer {
 
     virtual void write_double(aku_ParamId param, aku_TimeStamp ts, double data) = 0;
 
-    // TODO: remove this function, bulk string decoding should be done inside ProtocolParser
-    virtual void add_bulk_string(const Byte *buffer, size_t n) = 0;
+    //! Write integer value, default implementation converts value to double
+    virtual void write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data) {
+        write_double(param, ts, static_cast<double>(data));
+    }
+
+    /** Convert series name to param id.
+      * Default implementation doesn't support series names.
+      */
+    virtual aku_Status series_to_param_id(const char* name, size_t size, aku_ParamId* out_id) {
+        return AKU_ENOT_IMPLEMENTED;
+    }
+
+    /** Write batch of decoded samples.
+      * Default implementation writes samples one by one.
+      */
+    virtual void write_samples(ProtocolSample const* samples, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            if (samples[i].is_int) {
+                write_int64(samples[i].id, samples[i].ts, samples[i].ivalue);
+            } else {
+                write_double(samples[i].id, samples[i].ts, samples[i].value);
+            }
+        }
+    }
+
+    /** Write bulk frame (compressed batch of samples, see aku_encode_bulk).
+      * @returns AKU_EBAD_DATA if frame is damaged, AKU_EOVERFLOW if frame is too large
+      */
+    virtual aku_Status add_bulk_string(const Byte *buffer, size_t n) = 0;
 };
 
 }
@@ -1,6 +1,11 @@
 #include "protocolparser.h"
 #include "resp.h"
+#include "fastparse.h"
+#include "utility.h"
 #include <sstream>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <boost/algorithm/string.hpp>
 
 namespace Akumuli {
@@ -10,271 +15,329 @@ ProtocolParserError::ProtocolParserError(std::string line, int pos)
 {
 }
 
-const PDU ProtocolParser::POISON_ = {
-    std::shared_ptr<const Byte>(),
-    0u, 0u
-};
-
-ProtocolParser::ProtocolParser(std::shared_ptr<ProtocolConsumer> consumer)
-    : done_(false)
-    , consumer_(consumer)
-    , logger_("protocol-parser", 32)
+SeriesCache::SeriesCache(size_t capacity)
+    : capacity_(capacity)
+    , hits_(0u)
+    , misses_(0u)
 {
 }
 
-void ProtocolParser::start() {
-    logger_.info() << "Starting protocol parser";
-    auto fn = std::bind(&ProtocolParser::worker, this, std::placeholders::_1);
-    coroutine_.reset(new Coroutine(fn));
+bool SeriesCache::get(std::string const& name, aku_ParamId* out_id) {
+    auto it = index_.find(name);
+    if (it == index_.end()) {
+        misses_++;
+        return false;
+    }
+    hits_++;
+    items_.splice(items_.begin(), items_, it->second);
+    *out_id = it->second->second;
+    return true;
 }
 
-void ProtocolParser::worker(Caller& caller) {
-    // Remember caller for use in ByteStreamReader's methods
-    set_caller(caller);
-    // Buffer to read strings from
-    const int     buffer_len         = RESPStream::STRING_LENGTH_MAX;
-    Byte          buffer[buffer_len] = {};
-    int           bytes_read         = 0;
-    // Data to read
-    aku_ParamId   id                 = 0;
-    std::string   sid;
-    bool          integer_id         = false;
-    aku_TimeStamp ts                 = 0;
-    double        value              =.0;
-    //
-    try {
-        RESPStream stream(this);
-        while(true) {
-            // read id
-            auto next = stream.next_type();
-            switch(next) {
-            case RESPStream::INTEGER:
-                id = stream.read_int();
-                integer_id = true;
-                break;
-            case RESPStream::STRING:
-                bytes_read = stream.read_string(buffer, buffer_len);
-                sid = std::string(buffer, buffer + bytes_read);
-                integer_id = false;
-                break;
-            case RESPStream::BULK_STR:
-                // Compressed chunk of data
-                bytes_read = stream.read_bulkstr(buffer, buffer_len);
-                consumer_->add_bulk_string(buffer, bytes_read);
-                continue;
-            default:
-                // Bad frame
-                {
-                    std::string msg;
-                    size_t pos;
-                    std::tie(msg, pos) = get_error_context("unexpected parameter id format");
-                    BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
-                }
-            };
-
-            // read ts
-            next = stream.next_type();
-            switch(next) {
-            case RESPStream::INTEGER:
-                ts = stream.read_int();
-                break;
-            case RESPStream::STRING:
-                bytes_read = stream.read_string(buffer, buffer_len);
-                // TODO: parse date-time
-                {
-                    std::string msg;
-                    size_t pos;
-                    std::tie(msg, pos) = get_error_context("not implemented");
-                    BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
-                }
-            default:
-                // Bad frame
-                {
-                    std::string msg;
-                    size_t pos;
-                    std::tie(msg, pos) = get_error_context("Unexpected parameter timestamp format");
-                    BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
-                }
-            };
-
-            // read value
-            next = stream.next_type();
-            switch(next) {
-            case RESPStream::INTEGER:
-                value = stream.read_int();
-                break;
-            case RESPStream::STRING:
-                bytes_read = stream.read_string(buffer, buffer_len);
-                value = strtod(buffer, nullptr);
-                memset(buffer, 0, bytes_read);
-                break;
-            default:
-                // Bad frame
-                {
-                    std::string msg;
-                    size_t pos;
-                    std::tie(msg, pos) = get_error_context("Unexpected parameter value format");
-                    BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
-                }
-            };
-
-            if (integer_id) {
-                consumer_->write_double(id, ts, value);
-            } else {
-                // TODO: write blob
-                BOOST_THROW_EXCEPTION(std::runtime_error("not implemented"));
-            }
-        }
-    } catch(EStopIteration const&) {
-        logger_.info() << "EStopIteration";
-        done_ = true;
+void SeriesCache::put(std::string const& name, aku_ParamId id) {
+    if (index_.count(name)) {
+        return;
     }
+    if (items_.size() == capacity_) {
+        index_.erase(items_.back().first);
+        items_.pop_back();
+    }
+    items_.emplace_front(name, id);
+    index_[name] = items_.begin();
 }
 
-void ProtocolParser::set_caller(Caller& caller) {
-    caller_ = &caller;
+uint64_t SeriesCache::hits() const {
+    return hits_;
 }
 
-void ProtocolParser::yield_to_worker() {
-    coroutine_->operator()();
+uint64_t SeriesCache::misses() const {
+    return misses_;
 }
 
-void ProtocolParser::yield_to_client() const {
-    (*caller_)();
+ProtocolParser::ProtocolParser(std::shared_ptr<ProtocolConsumer> consumer)
+    : state_(PARSE_ID)
+    , sample_()
+    , integer_id_(false)
+    , origin_(nullptr)
+    , origin_size_(0u)
+    , consumer_(consumer)
+    , cache_(SERIES_CACHE_SIZE)
+    , logger_("protocol-parser", 32)
+{
+    batch_.reserve(BATCH_SIZE);
 }
 
-void ProtocolParser::throw_if_poisoned(PDU const& top) const {
-    if (top.size == 0 && top.pos == 0) {
-        throw EStopIteration();
-    }
+void ProtocolParser::start() {
+    logger_.info() << "Starting protocol parser";
 }
 
-void ProtocolParser::parse_next(PDU pdu) {
-    buffers_.push(pdu);
-    yield_to_worker();
+uint64_t ProtocolParser::parse_digits(const Byte* begin, const Byte* end) {
+    if (AKU_UNLIKELY(end - begin > INT_DIGITS_MAX)) {
+        throw_error<RESPError>("integer is too long", begin + INT_DIGITS_MAX + 1);
+    }
+    // Digits are validated all at once after the loop
+    uint64_t result = 0;
+    unsigned invalid = 0;
+    for (auto it = begin; it < end; it++) {
+        unsigned digit = static_cast<unsigned char>(*it) - static_cast<unsigned>('0');
+        invalid |= digit > 9;
+        result = result*10 + digit;
+    }
+    if (AKU_UNLIKELY(invalid)) {
+        auto it = std::find_if(begin, end, [](Byte c) { return c < '0' || c > '9'; });
+        throw_error<RESPError>("can't parse integer (character value out of range)", it + 1);
+    }
+    return result;
 }
 
-Byte ProtocolParser::get() {
-    while(true) {
-        if (buffers_.empty()) {
-            yield_to_client();
+const Byte* ProtocolParser::scan_element(const Byte* begin, const Byte* end, Element* out) {
+    auto body = begin + 1;
+    out->begin = begin;
+    out->type = *begin;
+    switch (*begin) {
+    case ':':
+    case '+':
+    case '$': {
+        auto cr = static_cast<const Byte*>(memchr(body, '\r', end - body));
+        auto last = cr ? cr : end;
+        if (*begin == '+') {
+            if (AKU_UNLIKELY(last - body >= RESPStream::STRING_LENGTH_MAX)) {
+                throw_error<RESPError>("out of quota", body + RESPStream::STRING_LENGTH_MAX);
+            }
+        } else {
+            // Incomplete integers are checked too, bad input is reported
+            // without waiting for the rest of the element
+            out->integer = parse_digits(body, last);
+        }
+        if (cr == nullptr || cr + 1 == end) {
+            return nullptr;
+        }
+        if (AKU_UNLIKELY(cr[1] != '\n')) {
+            throw_error<RESPError>(*begin == '+' ? "bad end of sequence"
+                                                 : "invalid symbol inside stream - '\\r'", cr + 2);
+        }
+        out->body = body;
+        out->length = static_cast<size_t>(cr - body);
+        auto next = cr + 2;
+        if (*begin != '$') {
+            return next;
         }
-        auto& top = buffers_.front();
-        throw_if_poisoned(top);
-        if (top.pos < top.size) {
-            auto buf = top.buffer.get();
-            return buf[top.pos++];
+        // Bulk string body follows the header
+        if (AKU_UNLIKELY(out->integer > RESPStream::BULK_LENGTH_MAX)) {
+            throw_error<RESPError>("declared object size is too large", next);
         }
-        buffers_.pop();
-        yield_to_client();
+        if (static_cast<uint64_t>(end - next) < out->integer + 2) {
+            return nullptr;
+        }
+        out->body = next;
+        out->length = out->integer;
+        next += out->integer;
+        if (AKU_UNLIKELY(next[0] != '\r' || next[1] != '\n')) {
+            throw_error<RESPError>("bad end of stream", next + 2);
+        }
+        return next + 2;
+    }
+    default:
+        // Unsupported element, error is reported by process_element
+        return body;
     }
-    auto ctx = get_error_context("unexpected end of stream");
-    BOOST_THROW_EXCEPTION(ProtocolParserError(std::get<0>(ctx), std::get<1>(ctx)));
 }
 
-Byte ProtocolParser::pick() const {
-    while(true) {
-        if (buffers_.empty()) {
-            yield_to_client();
+void ProtocolParser::process_element(Element const& el) {
+    switch (state_) {
+    case PARSE_ID:
+        switch (el.type) {
+        case ':':
+            sample_.id = el.integer;
+            integer_id_ = true;
+            break;
+        case '+':
+            sid_.assign(el.body, el.length);
+            integer_id_ = false;
+            break;
+        case '$': {
+                // Bulk frame (compressed batch of samples)
+                flush_batch();
+                auto status = consumer_->add_bulk_string(el.body, el.length);
+                if (status == AKU_EOVERFLOW) {
+                    throw_error<ProtocolParserError>("bulk frame is too large", el.begin + 1);
+                } else if (status != AKU_SUCCESS) {
+                    throw_error<ProtocolParserError>("bad bulk frame", el.begin + 1);
+                }
+            }
+            return;
+        default:
+            throw_error<ProtocolParserError>("unexpected parameter id format", el.begin + 1);
+        }
+        state_ = PARSE_TS;
+        break;
+    case PARSE_TS:
+        switch (el.type) {
+        case ':':
+            sample_.ts = el.integer;
+            break;
+        case '+':
+            if (!parse_iso8601(el.body, el.body + el.length, &sample_.ts)) {
+                throw_error<ProtocolParserError>("can't parse timestamp", el.begin + 1);
+            }
+            break;
+        default:
+            throw_error<ProtocolParserError>("Unexpected parameter timestamp format", el.begin + 1);
+        }
+        state_ = PARSE_VALUE;
+        break;
+    case PARSE_VALUE:
+        switch (el.type) {
+        case ':':
+            sample_.ivalue = static_cast<int64_t>(el.integer);
+            sample_.is_int = true;
+            break;
+        case '+':
+            if (!parse_double(el.body, el.body + el.length, &sample_.value)) {
+                throw_error<ProtocolParserError>("can't parse float", el.begin + 1);
+            }
+            sample_.is_int = false;
+            break;
+        default:
+            throw_error<ProtocolParserError>("Unexpected parameter value format", el.begin + 1);
         }
-        auto& top = buffers_.front();
-        throw_if_poisoned(top);
-        if (top.pos < top.size) {
-            auto buf = top.buffer.get();
-            return buf[top.pos];
+        if (!integer_id_ && !cache_.get(sid_, &sample_.id)) {
+            // Series name is resolved by the storage
+            auto status = consumer_->series_to_param_id(sid_.data(), sid_.size(), &sample_.id);
+            if (status != AKU_SUCCESS) {
+                throw_error<ProtocolParserError>("can't resolve series name", el.begin + 1);
+            }
+            cache_.put(sid_, sample_.id);
         }
-        buffers_.pop();
-        yield_to_client();
+        batch_.push_back(sample_);
+        if (batch_.size() == BATCH_SIZE) {
+            flush_batch();
+        }
+        state_ = PARSE_ID;
+        break;
     }
-    auto ctx = get_error_context("unexpected end of stream");
-    BOOST_THROW_EXCEPTION(ProtocolParserError(std::get<0>(ctx), std::get<1>(ctx)));
 }
 
-bool ProtocolParser::is_eof() {
-    return done_;
-}
-
-int ProtocolParser::read(Byte *buffer, size_t buffer_len) {
-    int bytes_copied = 0;
-    while(true) {
-        if (buffers_.empty()) {
-            yield_to_client();
-        }
-        auto& top = buffers_.front();
-        if (top.pos < top.size) {
-            size_t sz = top.size - top.pos;
-            size_t bytes_to_copy = std::min(sz, buffer_len);
-            memcpy(buffer, top.buffer.get() + top.pos, bytes_to_copy);
-            bytes_copied += (int)bytes_to_copy;
-            top.pos += bytes_to_copy;
-            if (bytes_to_copy == buffer_len) {
-                // everything is copied!
-                break;
-            } else {
-                // continue reading from the next buffer in the queue
-                buffer += bytes_to_copy;
-                buffer_len -= bytes_to_copy;
-            }
+const Byte* ProtocolParser::complete_carried(const Byte* begin, const Byte* end) {
+    // Every element ends with CRLF, so bytes are appended line by line
+    // and element can't be completed in the middle of the line
+    Element el;
+    while (begin < end) {
+        auto lf = static_cast<const Byte*>(memchr(begin, '\n', end - begin));
+        auto last = lf ? lf + 1 : end;
+        carry_.insert(carry_.end(), begin, last);
+        begin = last;
+        origin_ = carry_.data();
+        origin_size_ = carry_.size();
+        auto next = scan_element(carry_.data(), carry_.data() + carry_.size(), &el);
+        if (next) {
+            assert(next == carry_.data() + carry_.size());
+            process_element(el);
+            carry_.clear();
+            break;
         }
-        buffers_.pop();
     }
-    return bytes_copied;
+    return begin;
 }
 
-void ProtocolParser::close() {
-    buffers_.push(POISON_);
-    // stop worker
-    yield_to_worker();
+void ProtocolParser::flush_batch() {
+    if (!batch_.empty()) {
+        consumer_->write_samples(batch_.data(), batch_.size());
+        batch_.clear();
+    }
 }
 
-std::tuple<std::string, size_t> ProtocolParser::get_error_from_pdu(PDU const& pdu) const {
-    const char* origin = pdu.buffer.get();
-    // Scan to PDU head
-    if (pdu.pos == 0) {
-        // Error in first symbol
-        size_t size = std::min(pdu.size, (size_t)StreamError::MAX_LENGTH);
-        auto res = std::string(origin, origin + size);
-        boost::algorithm::replace_all(res, "\r", "\\r");
-        boost::algorithm::replace_all(res, "\n", "\\n");
-        return std::make_pair(res, 0);
+void ProtocolParser::parse_next(PDU pdu) {
+    auto begin = pdu.buffer.get() + pdu.pos;
+    auto end = pdu.buffer.get() + pdu.size;
+    if (!carry_.empty()) {
+        begin = complete_carried(begin, end);
     }
-    auto pdu_pos = pdu.pos;
-    auto ipos = origin + pdu_pos;   // Iterator
-    auto begin = origin;            // PDU begining
-    while (ipos > origin) {
-        if (*ipos == '\n') {        // Stop when prev. PDU begining or origin was reached
+    origin_ = pdu.buffer.get();
+    origin_size_ = pdu.size;
+    Element el;
+    while (begin < end) {
+        auto next = scan_element(begin, end, &el);
+        if (next == nullptr) {
+            // Element is completed by the next PDU
+            carry_.assign(begin, end);
             break;
         }
-        begin = ipos;
-        ipos--;
+        process_element(el);
+        begin = next;
     }
-    auto delta = (begin - origin);       // PDU begining position from the origin
-    auto size = pdu.size - delta;
-    auto position = pdu_pos - delta;
-    if (position < StreamError::MAX_LENGTH) {
-        // Truncate string if it wouldn't hide error (most of the PDU's is small so
-        // this will be almost always the case).
-        size = std::min(size, (size_t)StreamError::MAX_LENGTH);
+    flush_batch();
+}
+
+void ProtocolParser::close() {
+    flush_batch();
+    if (state_ != PARSE_ID || !carry_.empty()) {
+        logger_.info() << "Incomplete sample discarded";
     }
-    auto res = std::string(begin, begin + size);
-    boost::algorithm::replace_all(res, "\r", "\\r");
-    boost::algorithm::replace_all(res, "\n", "\\n");
-    return std::make_pair(res, position);
+    logger_.info() << "Series cache hits: " << cache_.hits() << ", misses: " << cache_.misses();
+    state_ = PARSE_ID;
+    carry_.clear();
+}
+
+bool ProtocolParser::discard_incomplete() {
+    bool incomplete = state_ != PARSE_ID || !carry_.empty();
+    state_ = PARSE_ID;
+    carry_.clear();
+    return incomplete;
 }
 
-std::tuple<std::string, size_t> ProtocolParser::get_error_context(const char* msg) const {
-    if (buffers_.empty()) {
+SeriesCache const& ProtocolParser::get_series_cache() const {
+    return cache_;
+}
+
+template<class Error>
+void ProtocolParser::throw_error(const char* msg, const Byte* pos) {
+    std::string line;
+    size_t linepos;
+    std::tie(line, linepos) = get_error_context(msg, pos);
+    // Samples decoded before the error are written
+    flush_batch();
+    state_ = PARSE_ID;
+    carry_.clear();
+    BOOST_THROW_EXCEPTION(Error(line, static_cast<int>(linepos)));
+}
+
+std::tuple<std::string, size_t> ProtocolParser::get_error_context(const char* msg, const Byte* pos) const {
+    if (origin_ == nullptr || origin_size_ == 0) {
         return std::make_tuple(std::string("Can't generate error, no data"), 0u);
     }
-    auto& top = buffers_.front();
+    const char* origin = origin_;
+    size_t size = origin_size_;
+    size_t err_pos = std::min(static_cast<size_t>(pos - origin), size);
     std::string err;
-    size_t pos;
-    std::tie(err, pos) = get_error_from_pdu(top);
+    size_t position;
+    if (err_pos == 0) {
+        // Error in first symbol
+        err = std::string(origin, origin + std::min(size, (size_t)StreamError::MAX_LENGTH));
+        position = 0;
+    } else {
+        // Scan to the begining of the line
+        auto begin = origin + std::min(err_pos, size - 1);
+        while (begin > origin && begin[-1] != '\n') {
+            begin--;
+        }
+        auto delta = static_cast<size_t>(begin - origin);
+        auto line_size = size - delta;
+        position = err_pos - delta;
+        if (position < StreamError::MAX_LENGTH) {
+            // Truncate string if it wouldn't hide error (most of the lines are small so
+            // this will be almost always the case).
+            line_size = std::min(line_size, (size_t)StreamError::MAX_LENGTH);
+        }
+        err = std::string(begin, begin + line_size);
+    }
+    boost::algorithm::replace_all(err, "\r", "\\r");
+    boost::algorithm::replace_all(err, "\n", "\\n");
     std::stringstream message;
     message << msg << " - ";
-    pos += message.str().size();
+    position += message.str().size();
     message << err;
-    return std::make_tuple(message.str(), pos);
+    return std::make_tuple(message.str(), position);
 }
 
 }
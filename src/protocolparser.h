@@ -16,13 +16,12 @@
 
 #pragma once
 
-// Using old-style boost.coroutines
-#define BOOST_COROUTINES_BIDIRECT
-#include <boost/coroutine/all.hpp>
 #include <memory>
 #include <cstdint>
 #include <vector>
-#include <queue>
+#include <list>
+#include <string>
+#include <unordered_map>
 
 #include "stream.h"
 #include "resp.h"
@@ -42,46 +41,109 @@ struct ProtocolParserError : StreamError {
     ProtocolParserError(std::string line, int pos);
 };
 
-typedef boost::coroutines::coroutine< void() > Coroutine;
-typedef typename Coroutine::caller_type Caller;
+/** LRU cache that maps raw (not normalized) series names to param ids.
+  * Every session sends the same series over and over again, cache hit
+  * skips series name normalization and global series table lookup.
+  * Param ids never change so cache entries are never invalidated.
+  */
+class SeriesCache {
+    typedef std::pair<std::string, aku_ParamId> Item;
+    std::list<Item> items_;  //< Most recently used first
+    std::unordered_map<std::string, std::list<Item>::iterator> index_;
+    const size_t capacity_;
+    uint64_t hits_;
+    uint64_t misses_;
+public:
+    SeriesCache(size_t capacity);
+
+    //! Find param id by series name, return false if name is not cached
+    bool get(std::string const& name, aku_ParamId* out_id);
 
+    //! Add series name to cache, evict least recently used name if cache is full
+    void put(std::string const& name, aku_ParamId id);
 
-//! Stop iteration exception
-struct EStopIteration {};
+    uint64_t hits() const;
+    uint64_t misses() const;
+};
 
 
-class ProtocolParser : ByteStreamReader {
-    mutable std::shared_ptr<Coroutine> coroutine_;
-    mutable Caller *caller_;
-    mutable std::queue<PDU> buffers_;
-    static const PDU POISON_;  //< This object marks end of the stream
-    bool done_;
+/** Incremental RESP parser.
+  * Parser is a state machine that scans PDU buffers in place, elements are
+  * located using memchr and integers are parsed without per-digit branches.
+  * Only the incomplete element at the end of the PDU is copied (and completed
+  * by the next PDU). Decoded samples are passed to consumer in batches.
+  * Timestamp can be sent as integer or as ISO 8601 string (converted to
+  * nanoseconds since epoch, see parse_iso8601).
+  */
+class ProtocolParser {
+    enum {
+        SERIES_CACHE_SIZE = 1024,  //< Number of series names cached per session
+        BATCH_SIZE        = 0x40,  //< Max number of samples passed to consumer at once
+        INT_DIGITS_MAX    = 20,    //< Maximum number of decimal digits in uint64_t
+    };
+
+    //! Sample field that should be parsed next
+    enum State {
+        PARSE_ID,
+        PARSE_TS,
+        PARSE_VALUE,
+    };
+
+    //! RESP element
+    struct Element {
+        const Byte* begin;     //< Position of the type byte
+        Byte        type;      //< Type byte (':', '+', '$', etc)
+        uint64_t    integer;   //< Value of the integer or size of the bulk string
+        const Byte* body;      //< String or bulk string body
+        size_t      length;    //< Length of the body
+    };
+
+    State state_;
+    ProtocolSample sample_;                //< Sample that is being parsed
+    std::string sid_;                      //< Series name of the sample
+    bool integer_id_;                      //< Sample has numeric id
+    std::vector<Byte> carry_;              //< Incomplete element from the previous PDU
+    std::vector<ProtocolSample> batch_;    //< Samples that wasn't passed to consumer yet
+    const Byte* origin_;                   //< Buffer that is being parsed (used in error messages)
+    size_t origin_size_;                   //< Size of the buffer that is being parsed
     std::shared_ptr<ProtocolConsumer> consumer_;
+    SeriesCache cache_;
     Logger logger_;
 
-    void worker(Caller &yield);
-    void set_caller(Caller& caller);
-    //! Yield control to worker
-    void yield_to_worker();
-    //! Yield control to external code
-    void yield_to_client() const;
-    //! Throw exception if poisoned
-    void throw_if_poisoned(PDU const& top) const;
-    //! Generate error message
-    std::tuple<std::string, size_t> get_error_from_pdu(PDU const& pdu) const;
+    /** Locate element that starts at `begin`.
+      * @return pointer to the next element or null if element is incomplete
+      * @throw RESPError if element is malformed
+      */
+    const Byte* scan_element(const Byte* begin, const Byte* end, Element* out);
+    //! Parse decimal integer
+    uint64_t parse_digits(const Byte* begin, const Byte* end);
+    //! Move parser to the next state
+    void process_element(Element const& el);
+    //! Complete carried element using bytes of the new PDU, return position of the next element
+    const Byte* complete_carried(const Byte* begin, const Byte* end);
+    //! Pass decoded samples to consumer
+    void flush_batch();
+    /** Throw exception of type Error with error context.
+      * @param pos points to the symbol after the error inside the current buffer
+      */
+    template<class Error>
+    void throw_error(const char* msg, const Byte* pos);
+    //! Generate error message (line of the current buffer that contains `pos`)
+    std::tuple<std::string, size_t> get_error_context(const char* msg, const Byte* pos) const;
 public:
     ProtocolParser(std::shared_ptr<ProtocolConsumer> consumer);
     void start();
+    //! Parse PDU, samples are passed to consumer before return
     void parse_next(PDU pdu);
-
-    // ByteStreamReader interface
-public:
-    virtual Byte get();
-    virtual Byte pick() const;
-    virtual bool is_eof();
-    virtual int read(Byte *buffer, size_t buffer_len);
-    virtual void close();
-    virtual std::tuple<std::string, size_t> get_error_context(const char* msg) const;
+    //! Stop parsing (incomplete sample is discarded)
+    void close();
+    /** Discard incomplete sample, next PDU is parsed from scratch (used
+      * when PDUs are independent, e.g. datagrams).
+      * @return true if incomplete sample was discarded
+      */
+    bool discard_incomplete();
+    //! Get series name cache of the session
+    SeriesCache const& get_series_cache() const;
 };
 
 
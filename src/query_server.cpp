@@ -0,0 +1,350 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "query_server.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace Akumuli {
+
+//                       //
+//     Query Session     //
+//                       //
+
+namespace {
+
+void append(std::vector<char>* out, const char* str, size_t size) {
+    out->insert(out->end(), str, str + size);
+}
+
+void append(std::vector<char>* out, std::string const& str) {
+    append(out, str.data(), str.size());
+}
+
+//! Append RESP element with integer or string payload (e.g. ":42\r\n")
+template<class T>
+void append_element(std::vector<char>* out, char prefix, T value) {
+    out->push_back(prefix);
+    append(out, std::to_string(value));
+    append(out, "\r\n", 2);
+}
+
+template<class T>
+bool parse_number(std::string const& str, T* out) {
+    try {
+        *out = boost::lexical_cast<T>(str);
+    } catch (boost::bad_lexical_cast const&) {
+        return false;
+    }
+    return true;
+}
+
+}
+
+QuerySession::QuerySession(boost::asio::io_service* io, std::shared_ptr<DbConnection> con)
+    : socket_(*io)
+    , request_(MAX_REQUEST_SIZE)
+    , dbcon_(con)
+    , format_(AKU_QUERY_RESP)
+    , timestamps_(BATCH_SIZE)
+    , ids_(BATCH_SIZE)
+    , values_(BATCH_SIZE)
+    , lengths_(BATCH_SIZE)
+    , logger_("query-session", 10)
+{
+}
+
+boost::asio::ip::tcp::socket& QuerySession::socket() {
+    return socket_;
+}
+
+void QuerySession::start() {
+    boost::asio::async_read_until(socket_, request_, '\n',
+                                  boost::bind(&QuerySession::handle_request,
+                                              shared_from_this(),
+                                              boost::asio::placeholders::error,
+                                              boost::asio::placeholders::bytes_transferred));
+}
+
+std::string QuerySession::parse_request(std::string const& line, QueryRequest* query, QueryFormat* format) {
+    std::istringstream stream(line);
+    std::string token;
+    stream >> token;
+    if (token != "select") {
+        return "unknown request";
+    }
+    std::string begin, end;
+    stream >> begin >> end;
+    if (!parse_number(begin, &query->begin) || !parse_number(end, &query->end)) {
+        return "bad time range";
+    }
+    query->limit = 0u;
+    query->ids.clear();
+    query->expression.clear();
+    *format = AKU_QUERY_RESP;
+    bool has_series = false;
+    while (stream >> token) {
+        std::string arg;
+        if (token == "where") {
+            std::getline(stream, arg);
+            auto first = arg.find_first_not_of(" \t");
+            if (first == std::string::npos) {
+                return "empty tag expression";
+            }
+            query->expression = arg.substr(first);
+            has_series = true;
+            break;
+        }
+        if (!(stream >> arg)) {
+            return "no value for `" + token + "`";
+        }
+        if (token == "limit") {
+            if (!parse_number(arg, &query->limit)) {
+                return "bad limit";
+            }
+        } else if (token == "order") {
+            bool backward = query->end < query->begin;
+            if ((arg == "asc" && backward) || (arg == "desc" && !backward)) {
+                std::swap(query->begin, query->end);
+            } else if (arg != "asc" && arg != "desc") {
+                return "bad order `" + arg + "`";
+            }
+        } else if (token == "format") {
+            if (arg == "resp") {
+                *format = AKU_QUERY_RESP;
+            } else if (arg == "binary") {
+                *format = AKU_QUERY_BINARY;
+            } else {
+                return "bad format `" + arg + "`";
+            }
+        } else if (token == "ids") {
+            std::istringstream ids(arg);
+            std::string id;
+            while (std::getline(ids, id, ',')) {
+                aku_ParamId param;
+                if (!parse_number(id, &param)) {
+                    return "bad param id `" + id + "`";
+                }
+                query->ids.push_back(param);
+            }
+            if (query->ids.empty()) {
+                return "empty id list";
+            }
+            has_series = true;
+        } else {
+            return "unknown clause `" + token + "`";
+        }
+    }
+    if (!has_series) {
+        return "`ids` or `where` clause expected";
+    }
+    return std::string();
+}
+
+std::string QuerySession::format_batch(QueryFormat format, size_t n, const aku_TimeStamp* ts, const aku_ParamId* ids,
+                                       const aku_PData* values, const uint32_t* lengths,
+                                       std::vector<aku_Sample>* samples, std::vector<char>* out)
+{
+    if (format == AKU_QUERY_RESP) {
+        append_element(out, '*', 3*n);
+        char buffer[64];
+        for (size_t i = 0; i < n; i++) {
+            append_element(out, ':', ids[i]);
+            append_element(out, ':', ts[i]);
+            if (lengths[i] == 0u) {
+                int len = snprintf(buffer, sizeof(buffer), "+%.17g\r\n", values[i].float64);
+                append(out, buffer, static_cast<size_t>(len));
+            } else if (lengths[i] == AKU_LENGTH_INT64) {
+                append_element(out, ':', values[i].int64);
+            } else {
+                append_element(out, '$', lengths[i]);
+                append(out, static_cast<const char*>(values[i].ptr), lengths[i]);
+                append(out, "\r\n", 2);
+            }
+        }
+        return std::string();
+    }
+    samples->clear();
+    for (size_t i = 0; i < n; i++) {
+        aku_Sample sample = {};
+        sample.paramid = ids[i];
+        sample.timestamp = ts[i];
+        if (lengths[i] == 0u) {
+            sample.value = values[i].float64;
+        } else if (lengths[i] == AKU_LENGTH_INT64) {
+            sample.ivalue = values[i].int64;
+            sample.is_int = 1;
+        } else {
+            return "blob values can't be sent in binary format";
+        }
+        samples->push_back(sample);
+    }
+    std::vector<char> frame(aku_bulk_max_size(n));
+    size_t frame_size = 0;
+    auto status = aku_encode_bulk(samples->data(), n, frame.data(), frame.size(), &frame_size);
+    if (status != AKU_SUCCESS) {
+        return aku_error_message(status);
+    }
+    append_element(out, '$', frame_size);
+    append(out, frame.data(), frame_size);
+    append(out, "\r\n", 2);
+    return std::string();
+}
+
+void QuerySession::handle_request(boost::system::error_code error, size_t) {
+    if (error) {
+        if (error == boost::asio::error::not_found) {
+            finish("-QUERY request is too long\r\n");
+        } else if (error != boost::asio::error::eof) {
+            logger_.error() << error.message();
+        }
+        return;
+    }
+    std::string line;
+    std::istream stream(&request_);
+    std::getline(stream, line);
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    QueryRequest query;
+    auto msg = parse_request(line, &query, &format_);
+    if (!msg.empty()) {
+        logger_.trace() << "Bad request `" << line << "`: " << msg;
+        finish("-QUERY " + msg + "\r\n");
+        return;
+    }
+    auto status = dbcon_->select(query, &cursor_);
+    if (status != AKU_SUCCESS) {
+        finish(std::string("-DB ") + aku_error_message(status) + "\r\n");
+        return;
+    }
+    write_next();
+}
+
+void QuerySession::write_next() {
+    size_t n = cursor_->read(timestamps_.data(), ids_.data(), values_.data(), lengths_.data(), BATCH_SIZE);
+    if (n == 0) {
+        auto status = cursor_->get_error();
+        if (status != AKU_SUCCESS) {
+            finish(std::string("-DB ") + aku_error_message(status) + "\r\n");
+        } else {
+            finish("*0\r\n");
+        }
+        return;
+    }
+    output_.clear();
+    auto msg = format_batch(format_, n, timestamps_.data(), ids_.data(), values_.data(), lengths_.data(),
+                            &samples_, &output_);
+    if (!msg.empty()) {
+        finish("-QUERY " + msg + "\r\n");
+        return;
+    }
+    boost::asio::async_write(socket_, boost::asio::buffer(output_),
+                             boost::bind(&QuerySession::handle_write,
+                                         shared_from_this(),
+                                         boost::asio::placeholders::error));
+}
+
+void QuerySession::handle_write(boost::system::error_code error) {
+    if (error) {
+        // Client went away, cursor is closed with the session
+        logger_.trace() << "Query aborted: " << error.message();
+        return;
+    }
+    write_next();
+}
+
+void QuerySession::finish(std::string msg) {
+    cursor_.reset();
+    output_.assign(msg.begin(), msg.end());
+    auto self = shared_from_this();
+    boost::asio::async_write(socket_, boost::asio::buffer(output_),
+                             [self](boost::system::error_code, size_t) {
+                                 boost::system::error_code ignored;
+                                 self->socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                                 self->socket_.close(ignored);
+                             });
+}
+
+//                        //
+//     Query Acceptor     //
+//                        //
+
+QueryAcceptor::QueryAcceptor(int port, std::shared_ptr<DbConnection> con, int nthreads)
+    : acceptor_(io_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port))
+    , dbcon_(con)
+    , nthreads_(std::max(nthreads, 1))
+    , logger_("query-acceptor", 10)
+{
+    logger_.info() << "Query endpoint created on port " << port;
+}
+
+void QueryAcceptor::start() {
+    auto session = std::make_shared<QuerySession>(&io_, dbcon_);
+    acceptor_.async_accept(
+                session->socket(),
+                boost::bind(&QueryAcceptor::handle_accept,
+                            shared_from_this(),
+                            session,
+                            boost::asio::placeholders::error)
+                );
+    for (int i = 0; i < nthreads_; i++) {
+        threads_.emplace_back([this]() {
+            io_.run();
+        });
+    }
+}
+
+void QueryAcceptor::stop() {
+    logger_.info() << "Stopping query endpoint";
+    io_.stop();
+    for (auto& thread: threads_) {
+        thread.join();
+    }
+    threads_.clear();
+    // No thread runs the io-service at this point, aborted accept handler is
+    // executed to release the acceptor, unfinished sessions are destroyed
+    // with the io-service
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+    io_.reset();
+    io_.poll();
+}
+
+void QueryAcceptor::handle_accept(std::shared_ptr<QuerySession> session, boost::system::error_code err) {
+    if (err) {
+        if (err != boost::asio::error::operation_aborted) {
+            logger_.error() << "Query acceptor error " << err.message();
+        }
+        return;
+    }
+    session->start();
+    auto next = std::make_shared<QuerySession>(&io_, dbcon_);
+    acceptor_.async_accept(
+                next->socket(),
+                boost::bind(&QueryAcceptor::handle_accept,
+                            shared_from_this(),
+                            next,
+                            boost::asio::placeholders::error)
+                );
+}
+
+}  // namespace
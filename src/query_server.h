@@ -0,0 +1,138 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "logger.h"
+#include "ingestion_pipeline.h"
+
+namespace Akumuli {
+
+//! Output format of the query results
+enum QueryFormat {
+    AKU_QUERY_RESP,    //< RESP triples (id, timestamp, value)
+    AKU_QUERY_BINARY,  //< Bulk frames (see aku_encode_bulk)
+};
+
+
+/** Query session.
+  * Reads one request line from the socket, executes the query and streams results
+  * back in batches. Next batch is read from the cursor only when the previous one
+  * was written to the socket, so slow client holds the cursor instead of the
+  * results piling up in memory. Session closes the connection after the last batch.
+  *
+  * Request: `select <begin> <end> [limit <n>] [order asc|desc] [format resp|binary]
+  * (ids <id>[,<id>...] | where <tag expression>)\n`, `where` clause takes the rest
+  * of the line. Without `order` results are returned backward if end < begin.
+  *
+  * Response is a RESP stream. In `resp` format every batch is an array of
+  * `:<id>`, `:<timestamp>` and value triples, value is `+<double>`, `:<integer>`
+  * or `$<blob>`. In `binary` format every batch is a bulk string that contains
+  * bulk frame (the one accepted by the ingestion protocol, measurements are sorted
+  * by timestamp inside the frame, blobs are not supported). Empty array `*0` marks
+  * the end of results, `-QUERY <msg>` or `-DB <msg>` error ends the stream early.
+  */
+class QuerySession : public std::enable_shared_from_this<QuerySession> {
+public:
+    enum {
+        BATCH_SIZE       = 0x400,  //< Max number of results in one batch
+        MAX_REQUEST_SIZE = 0x2000, //< Max length of the request line
+    };
+private:
+    boost::asio::ip::tcp::socket   socket_;
+    boost::asio::streambuf         request_;
+    std::shared_ptr<DbConnection>  dbcon_;
+    std::unique_ptr<DbCursor>      cursor_;
+    QueryFormat                    format_;
+    std::vector<char>              output_;   //< Batch that is being written
+    // Cursor output
+    std::vector<aku_TimeStamp>     timestamps_;
+    std::vector<aku_ParamId>       ids_;
+    std::vector<aku_PData>         values_;
+    std::vector<uint32_t>          lengths_;
+    std::vector<aku_Sample>        samples_;
+    Logger                         logger_;
+public:
+    QuerySession(boost::asio::io_service* io, std::shared_ptr<DbConnection> con);
+
+    boost::asio::ip::tcp::socket& socket();
+
+    //! Start reading request
+    void start();
+
+    /** Parse request line.
+      * @return empty string on success or error message
+      */
+    static std::string parse_request(std::string const& line, QueryRequest* query, QueryFormat* format);
+
+    /** Serialize batch of results.
+      * @return empty string on success or error message
+      */
+    static std::string format_batch(QueryFormat format, size_t n, const aku_TimeStamp* ts, const aku_ParamId* ids,
+                                    const aku_PData* values, const uint32_t* lengths,
+                                    std::vector<aku_Sample>* samples, std::vector<char>* out);
+private:
+    void handle_request(boost::system::error_code error, size_t nbytes);
+
+    //! Read next batch from the cursor and write it to the socket
+    void write_next();
+
+    void handle_write(boost::system::error_code error);
+
+    //! Write final message and close connection
+    void finish(std::string msg);
+};
+
+
+/** Query endpoint.
+  * Sessions run on the endpoint's own io-service and threads because cursors
+  * block on storage reads, ingestion sessions are not affected by long queries.
+  */
+class QueryAcceptor : public std::enable_shared_from_this<QueryAcceptor>
+{
+    boost::asio::io_service             io_;       //< Io-service of the query sessions
+    boost::asio::ip::tcp::acceptor      acceptor_;
+    std::shared_ptr<DbConnection>       dbcon_;
+    const int                           nthreads_;
+    std::vector<std::thread>            threads_;
+    Logger                              logger_;
+public:
+    /** C-tor. Should be created in the heap.
+      * @param port port to listen for new connections
+      * @param con database connection
+      * @param nthreads number of threads that run query sessions
+      */
+    QueryAcceptor(int port, std::shared_ptr<DbConnection> con, int nthreads = 1);
+
+    //! Start listening on socket and start session threads
+    void start();
+
+    //! Stop listening on socket and stop session threads (active queries are aborted)
+    void stop();
+private:
+
+    //! Accept event handler
+    void handle_accept(std::shared_ptr<QuerySession> session, boost::system::error_code err);
+};
+
+}  // namespace
@@ -2,22 +2,110 @@
 #include "utility.h"
 #include <thread>
 #include <boost/function.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace Akumuli {
 
+//                     //
+//     Buffer Pool     //
+//                     //
+
+namespace {
+
+//! Free buffers of the thread
+struct FreeList {
+    size_t             size;     //< Size of the buffers
+    std::vector<Byte*> buffers;
+
+    FreeList();
+   ~FreeList();
+};
+
+thread_local FreeList free_list;
+//! Set when free list of the thread is destroyed (buffers released after that are freed)
+thread_local bool free_list_destroyed = false;
+
+FreeList::FreeList()
+    : size(0u)
+{
+}
+
+FreeList::~FreeList() {
+    for (auto buffer: buffers) {
+        free(buffer);
+    }
+    free_list_destroyed = true;
+}
+
+void release_buffer(Byte* buffer, size_t size) {
+    if (free_list_destroyed) {
+        free(buffer);
+        return;
+    }
+    auto& list = free_list;
+    if (list.size != size) {
+        // Buffer size was changed, old buffers can't be reused
+        for (auto buf: list.buffers) {
+            free(buf);
+        }
+        list.buffers.clear();
+        list.size = size;
+    }
+    if (list.buffers.size() < BufferPool::MAX_FREE) {
+        list.buffers.push_back(buffer);
+    } else {
+        free(buffer);
+    }
+}
+
+}
+
+BufferPool::BufferT BufferPool::get(size_t size) {
+    Byte* buffer = nullptr;
+    if (!free_list_destroyed) {
+        auto& list = free_list;
+        if (list.size == size && !list.buffers.empty()) {
+            buffer = list.buffers.back();
+            list.buffers.pop_back();
+        }
+    }
+    if (buffer == nullptr) {
+        buffer = static_cast<Byte*>(malloc(size));
+        if (buffer == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+    return BufferT(buffer, [size](Byte* p) {
+        release_buffer(p, size);
+    });
+}
+
+size_t BufferPool::nfree() {
+    return free_list_destroyed ? 0u : free_list.buffers.size();
+}
+
 //                     //
 //     Tcp Session     //
 //                     //
 
-TcpSession::TcpSession(IOServiceT *io, std::shared_ptr<PipelineSpout> spout)
+TcpSession::TcpSession(IOServiceT *io, std::shared_ptr<PipelineSpout> spout, size_t buffer_size)
     : io_(io)
+    , buffer_size_(std::max(buffer_size, static_cast<size_t>(2*BUFFER_SIZE_THRESHOLD)))
     , socket_(*io)
     , strand_(*io)
+    , drain_timer_(*io)
     , spout_(spout)
     , parser_(spout)
     , logger_("tcp-session", 10)
 {
     logger_.info() << "Session created";
+    // IO thread shouldn't block on the full ring, reading is paused instead
+    spout_->set_flow_control(true);
     parser_.start();
 }
 
@@ -30,12 +118,11 @@ std::tuple<TcpSession::BufferT, size_t, size_t> TcpSession::get_next_buffer(Buff
                                                                             size_t pos,
                                                                             size_t bytes_read)
 {
-    Byte *buffer = (Byte*)malloc(BUFFER_SIZE);
-    auto deleter = [](Byte* p) {
-        free((void*)p);
-    };
-    std::shared_ptr<Byte> bufptr(buffer, deleter);
-    return std::make_tuple(bufptr, BUFFER_SIZE, 0u);
+    // Data before `pos + bytes_read` is already parsed (parser copies incomplete elements)
+    if (prev_buf && size - pos - bytes_read >= BUFFER_SIZE_THRESHOLD) {
+        return std::make_tuple(prev_buf, size, pos + bytes_read);
+    }
+    return std::make_tuple(BufferPool::get(buffer_size_), buffer_size_, 0u);
 }
 
 void TcpSession::start(BufferT buf, size_t buf_size, size_t pos, size_t bytes_read) {
@@ -84,13 +171,17 @@ void TcpSession::handle_read(BufferT buffer,
                              size_t nbytes) {
     if (!error) {
         try {
-            start(buffer, buf_size, pos, nbytes);
             PDU pdu = {
                 buffer,
-                nbytes,
+                pos + nbytes,
                 pos
             };
             parser_.parse_next(pdu);
+            if (AKU_UNLIKELY(spout_->is_overloaded())) {
+                wait_for_drain(buffer, pos, buf_size, nbytes);
+            } else {
+                start(buffer, buf_size, pos, nbytes);
+            }
         } catch (RESPError const& resp_err) {
             // This error is related to client so we need to send it back
             logger_.error() << resp_err.what();
@@ -104,6 +195,7 @@ void TcpSession::handle_read(BufferT buffer,
                                                  shared_from_this(),
                                                  boost::asio::placeholders::error)
                                      );
+            drain_backlog(boost::system::error_code());
         } catch (...) {
             // Unexpected error
             logger_.error() << boost::current_exception_diagnostic_information();
@@ -115,12 +207,64 @@ void TcpSession::handle_read(BufferT buffer,
                                                  shared_from_this(),
                                                  boost::asio::placeholders::error)
                                      );
+            drain_backlog(boost::system::error_code());
         }
 
     } else {
         logger_.error() << error.message();
         parser_.close();
+        drain_backlog(boost::system::error_code());
+    }
+}
+
+void TcpSession::wait_for_drain(BufferT buffer, size_t pos, size_t buf_size, size_t nbytes) {
+    drain_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(DRAIN_POLL_MSEC)));
+    drain_timer_.async_wait(
+                strand_.wrap(
+                    boost::bind(&TcpSession::handle_drain_timer,
+                                shared_from_this(),
+                                buffer,
+                                pos,
+                                buf_size,
+                                nbytes,
+                                boost::asio::placeholders::error)
+                ));
+}
+
+void TcpSession::handle_drain_timer(BufferT buffer,
+                                    size_t pos,
+                                    size_t buf_size,
+                                    size_t nbytes,
+                                    boost::system::error_code error)
+{
+    if (error) {
+        logger_.error() << error.message();
+        parser_.close();
+        return;
+    }
+    spout_->flush_backlog();
+    if (spout_->is_drained()) {
+        start(buffer, buf_size, pos, nbytes);
+    } else {
+        wait_for_drain(buffer, pos, buf_size, nbytes);
+    }
+}
+
+void TcpSession::drain_backlog(boost::system::error_code error) {
+    if (error) {
+        logger_.error() << error.message();
+        return;
     }
+    if (spout_->flush_backlog()) {
+        return;
+    }
+    drain_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(DRAIN_POLL_MSEC)));
+    drain_timer_.async_wait(
+                strand_.wrap(
+                    boost::bind(&TcpSession::drain_backlog,
+                                shared_from_this(),
+                                boost::asio::placeholders::error)
+                ));
 }
 
 void TcpSession::handle_write_error(boost::system::error_code error) {
@@ -140,11 +284,13 @@ void TcpSession::handle_write_error(boost::system::error_code error) {
 TcpAcceptor::TcpAcceptor(// Server parameters
                         std::vector<IOServiceT *> io, int port,
                         // Storage & pipeline
-                        std::shared_ptr<IngestionPipeline> pipeline )
+                        std::shared_ptr<IngestionPipeline> pipeline,
+                        size_t buffer_size)
     : acceptor_(own_io_, EndpointT(boost::asio::ip::tcp::v4(), port))
     , sessions_io_(io)
     , pipeline_(pipeline)
     , io_index_{0}
+    , buffer_size_(buffer_size)
     , start_barrier_(2)
     , stop_barrier_(2)
     , logger_("tcp-acceptor", 10)
@@ -195,7 +341,7 @@ void TcpAcceptor::_run_one() {
 void TcpAcceptor::_start() {
     std::shared_ptr<TcpSession> session;
     auto spout = pipeline_->make_spout();
-    session.reset(new TcpSession(sessions_io_.at(io_index_++ % sessions_io_.size()), spout));
+    session.reset(new TcpSession(sessions_io_.at(io_index_++ % sessions_io_.size()), spout, buffer_size_));
     // attach session to spout
     spout->set_error_cb(session->get_error_cb());
     // run session
@@ -234,24 +380,235 @@ void TcpAcceptor::handle_accept(std::shared_ptr<TcpSession> session, boost::syst
     _start();
 }
 
+//                       //
+//     Core Acceptor     //
+//                       //
+
+CoreAcceptor::CoreAcceptor(IOServiceT* io, int port, std::shared_ptr<IngestionPipeline> pipeline,
+                           size_t buffer_size)
+    : io_(io)
+    , acceptor_(*io)
+    , pipeline_(pipeline)
+    , buffer_size_(buffer_size)
+    , logger_("core-acceptor", 10)
+{
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> ReusePortT;
+    EndpointT endpoint(boost::asio::ip::tcp::v4(), port);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(AcceptorT::reuse_address(true));
+    acceptor_.set_option(ReusePortT(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    logger_.info() << "Core acceptor created on port " << port;
+}
+
+void CoreAcceptor::start() {
+    auto spout = pipeline_->make_spout();
+    auto session = std::make_shared<TcpSession>(io_, spout, buffer_size_);
+    spout->set_error_cb(session->get_error_cb());
+    acceptor_.async_accept(
+                session->socket(),
+                boost::bind(&CoreAcceptor::handle_accept,
+                            shared_from_this(),
+                            session,
+                            boost::asio::placeholders::error)
+                );
+}
+
+void CoreAcceptor::stop() {
+    // Acceptor is used only by the thread of the core
+    auto self = shared_from_this();
+    io_->post([self]() {
+        boost::system::error_code ignored;
+        self->acceptor_.close(ignored);
+    });
+}
+
+void CoreAcceptor::handle_accept(std::shared_ptr<TcpSession> session, boost::system::error_code err) {
+    if (AKU_LIKELY(!err)) {
+        session->start(TcpSession::NO_BUFFER, 0u, 0u, 0u);
+    } else if (err == boost::asio::error::operation_aborted) {
+        return;
+    } else {
+        logger_.error() << "Acceptor error " << err.message();
+    }
+    start();
+}
+
+//                          //
+//     Metrics Acceptor     //
+//                          //
+
+MetricsAcceptor::MetricsAcceptor(IOServiceT* io, int port,
+                                 std::shared_ptr<IngestionPipeline> pipeline,
+                                 std::shared_ptr<DbConnection> con,
+                                 std::shared_ptr<UdpServer> udp)
+    : io_(io)
+    , acceptor_(*io, EndpointT(boost::asio::ip::tcp::v4(), port))
+    , pipeline_(pipeline)
+    , dbcon_(con)
+    , udp_(udp)
+    , logger_("metrics-acceptor", 10)
+{
+    logger_.info() << "Metrics endpoint created on port " << port;
+}
+
+void MetricsAcceptor::start() {
+    auto socket = std::make_shared<SocketT>(*io_);
+    acceptor_.async_accept(
+                *socket,
+                boost::bind(&MetricsAcceptor::handle_accept,
+                            shared_from_this(),
+                            socket,
+                            boost::asio::placeholders::error)
+                );
+}
+
+void MetricsAcceptor::stop() {
+    logger_.info() << "Stopping metrics endpoint";
+    acceptor_.close();
+}
+
+void MetricsAcceptor::handle_accept(std::shared_ptr<SocketT> socket, boost::system::error_code err) {
+    if (err) {
+        if (err != boost::asio::error::operation_aborted) {
+            logger_.error() << "Metrics acceptor error " << err.message();
+        }
+        return;
+    }
+    aku_Metrics metrics;
+    dbcon_->get_metrics(&metrics);
+    auto stream = std::make_shared<boost::asio::streambuf>();
+    std::ostream os(stream.get());
+    UdpStats udp;
+    if (udp_) {
+        udp = udp_->get_stats();
+    }
+    format(os, pipeline_->get_stats(), metrics, udp_ ? &udp : nullptr);
+    // Socket and buffer are kept alive by the handler
+    boost::asio::async_write(*socket, *stream,
+                             [socket, stream](boost::system::error_code, size_t) {
+                                 boost::system::error_code ignored;
+                                 socket->shutdown(SocketT::shutdown_both, ignored);
+                                 socket->close(ignored);
+                             });
+    start();
+}
+
+void MetricsAcceptor::format(std::ostream& ostr, PipelineStats const& pstats, aku_Metrics const& metrics,
+                             UdpStats const* udp)
+{
+    auto latency = [&ostr](const char* name, aku_LatencyStats const& stats) {
+        ostr << name << ".count "   << stats.count << "\n"
+             << name << ".mean_ns " << stats.mean  << "\n"
+             << name << ".min_ns "  << stats.min   << "\n"
+             << name << ".p50_ns "  << stats.p50   << "\n"
+             << name << ".p90_ns "  << stats.p90   << "\n"
+             << name << ".p99_ns "  << stats.p99   << "\n"
+             << name << ".p999_ns " << stats.p999  << "\n"
+             << name << ".max_ns "  << stats.max   << "\n";
+    };
+    ostr << "pipeline.rings "           << pstats.nrings           << "\n"
+         << "pipeline.queue_depth "     << pstats.queue_depth      << "\n"
+         << "pipeline.max_queue_depth " << pstats.max_queue_depth  << "\n"
+         << "pipeline.wakeups "         << pstats.nwakeups         << "\n"
+         << "pipeline.parks "           << pstats.nparks           << "\n"
+         << "pipeline.spin_ns "         << pstats.spin_ns          << "\n"
+         << "pipeline.park_ns "         << pstats.park_ns          << "\n"
+         << "storage.writes "           << metrics.n_writes        << "\n"
+         << "storage.write_errors "     << metrics.n_write_errors  << "\n"
+         << "storage.sequencer_size "   << metrics.sequencer_size  << "\n"
+         << "storage.merge_queue_depth " << metrics.merge_queue_depth << "\n"
+         << "storage.merge_lag_us "     << metrics.merge_lag       << "\n";
+    latency("storage.write",      metrics.write);
+    latency("storage.checkpoint", metrics.checkpoint);
+    latency("storage.flush",      metrics.flush);
+    latency("storage.query",      metrics.query);
+    if (udp) {
+        ostr << "udp.datagrams "        << udp->ndatagrams         << "\n"
+             << "udp.bytes "            << udp->nbytes             << "\n"
+             << "udp.bad "              << udp->nbad               << "\n"
+             << "udp.dropped "          << udp->ndropped           << "\n"
+             << "udp.write_errors "     << udp->nwrite_errors      << "\n"
+             << "udp.throttled "        << udp->nthrottled         << "\n";
+    }
+}
+
 //                    //
 //     Tcp Server     //
 //                    //
 
-TcpServer::TcpServer(std::shared_ptr<DbConnection> con, int concurrency)
+namespace {
+
+//! Pin thread to CPU (modulo number of CPUs)
+void pin_thread(std::thread& thread, int cpu) {
+#ifdef __linux__
+    auto ncpus = std::max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(static_cast<unsigned>(cpu) % ncpus, &cpuset);
+    if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset) != 0) {
+        std::cout << "Can't pin I/O thread to CPU " << cpu << std::endl;
+    }
+#endif
+}
+
+}
+
+TcpServer::TcpServer(std::shared_ptr<DbConnection> con, int concurrency, uint32_t nwriters, int metrics_port,
+                     int udp_port, bool per_core, size_t buffer_size, int query_port)
     : dbcon(con)
     , barrier(concurrency + 1)
     , sig(io, SIGINT)
     , stopped{0}
+    , per_core(per_core)
 {
-    for(;concurrency --> 0;) {
+    if (per_core) {
+        // First core is served by `io`, it also runs signal handler and metrics endpoint
         iovec.push_back(&io);
+        for (int i = 1; i < concurrency; i++) {
+            core_io.emplace_back(new IOServiceT());
+            iovec.push_back(core_io.back().get());
+        }
+    } else {
+        for(;concurrency --> 0;) {
+            iovec.push_back(&io);
+        }
     }
-    pline = std::make_shared<IngestionPipeline>(dbcon, AKU_LINEAR_BACKOFF);
+    pline = std::make_shared<IngestionPipeline>(dbcon, AKU_LINEAR_BACKOFF, nwriters);
     int port = 4096;
-    serv = std::make_shared<TcpAcceptor>(iovec, port, pline);
+    if (per_core) {
+        for (auto core: iovec) {
+            core_acceptors.push_back(std::make_shared<CoreAcceptor>(core, port, pline, buffer_size));
+        }
+    } else {
+        serv = std::make_shared<TcpAcceptor>(iovec, port, pline, buffer_size);
+    }
+    if (udp_port != 0) {
+        udp = std::make_shared<UdpServer>(pline, udp_port, static_cast<int>(iovec.size()));
+    }
+    if (metrics_port != 0) {
+        metrics = std::make_shared<MetricsAcceptor>(&io, metrics_port, pline, dbcon, udp);
+    }
+    if (query_port != 0) {
+        query = std::make_shared<QueryAcceptor>(query_port, dbcon);
+    }
     pline->start();
-    serv->start();
+    if (serv) {
+        serv->start();
+    }
+    for (auto acceptor: core_acceptors) {
+        acceptor->start();
+    }
+    if (udp) {
+        udp->start();
+    }
+    if (metrics) {
+        metrics->start();
+    }
+    if (query) {
+        query->start();
+    }
 }
 
 void TcpServer::start() {
@@ -277,8 +634,12 @@ void TcpServer::start() {
         return fn;
     };
 
+    int cpu = 0;
     for (auto io: iovec) {
         std::thread iothread(iorun(*io, barrier));
+        if (per_core) {
+            pin_thread(iothread, cpu++);
+        }
         iothread.detach();
     }
 }
@@ -287,11 +648,20 @@ void TcpServer::handle_sigint(boost::system::error_code err) {
     if (!err) {
         if (stopped++ == 0) {
             std::cout << "SIGINT catched, stopping pipeline" << std::endl;
+            if (metrics) {
+                metrics->stop();
+            }
+            if (query) {
+                query->stop();
+            }
             for (auto io: iovec) {
                 io->stop();
             }
+            if (udp) {
+                udp->stop();
+            }
             pline->stop();
-            serv->stop();
+            stop_acceptors();
             barrier.wait();
             std::cout << "Server stopped" << std::endl;
         } else {
@@ -304,9 +674,21 @@ void TcpServer::handle_sigint(boost::system::error_code err) {
 
 void TcpServer::stop() {
     if (stopped++ == 0) {
-        serv->stop();
+        if (metrics) {
+            metrics->stop();
+        }
+        if (query) {
+            query->stop();
+        }
+        stop_acceptors();
         std::cout << "TcpServer stopped" << std::endl;
 
+        if (udp) {
+            // UDP workers write to the pipeline, they're stopped first
+            udp->stop();
+            std::cout << "UdpServer stopped" << std::endl;
+        }
+
         sig.cancel();
 
         // No need to joint I/O threads, just wait until they completes.
@@ -325,6 +707,15 @@ void TcpServer::stop() {
     }
 }
 
+void TcpServer::stop_acceptors() {
+    if (serv) {
+        serv->stop();
+    }
+    for (auto acceptor: core_acceptors) {
+        acceptor->stop();
+    }
+}
+
 void TcpServer::wait() {
     // TODO: use cond var
     while(!stopped) {
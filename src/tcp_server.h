@@ -25,6 +25,8 @@
 #include "logger.h"
 #include "protocolparser.h"
 #include "ingestion_pipeline.h"
+#include "udp_server.h"
+#include "query_server.h"
 
 namespace Akumuli {
 
@@ -39,24 +41,52 @@ typedef boost::asio::ip::tcp::endpoint  EndpointT;
 typedef boost::asio::strand             StrandT;
 typedef boost::asio::io_service::work   WorkT;
 
+/** Per-thread pool of receive buffers.
+  * Buffer goes back to the pool of the thread that drops the last reference
+  * to it (I/O thread of the session, PDUs aren't retained by the parser),
+  * so buffers are recycled without locks.
+  */
+struct BufferPool {
+    enum {
+        MAX_FREE = 0x40,  //< Max number of free buffers kept by the thread
+    };
+    typedef std::shared_ptr<Byte> BufferT;
+
+    //! Get buffer of `size` bytes from the calling thread's pool (allocate if pool is empty)
+    static BufferT get(size_t size);
+
+    //! Number of free buffers in the calling thread's pool
+    static size_t nfree();
+};
+
+
 /** Server session. Reads data from socket.
  *  Must be created in the heap.
   */
 class TcpSession : public std::enable_shared_from_this<TcpSession> {
-    // TODO: Unique session ID
+public:
     enum {
-        BUFFER_SIZE           = 0x1000,  //< Buffer size
+        DEFAULT_BUFFER_SIZE   = 0x10000, //< Default buffer size
         BUFFER_SIZE_THRESHOLD = 0x0200,  //< Min free buffer space
+        DRAIN_POLL_MSEC       = 1,       //< Spout check interval while reading is paused
     };
+private:
+    // TODO: Unique session ID
     IOServiceT *io_;
+    const size_t buffer_size_;
     SocketT socket_;
     StrandT strand_;
+    boost::asio::deadline_timer drain_timer_;  //< Used to wait for pipeline while reading is paused
     std::shared_ptr<PipelineSpout> spout_;
     ProtocolParser parser_;
     Logger logger_;
 public:
     typedef std::shared_ptr<Byte> BufferT;
-    TcpSession(IOServiceT *io, std::shared_ptr<PipelineSpout> spout);
+    /** C-tor
+      * @param buffer_size size of the receive buffers
+      */
+    TcpSession(IOServiceT *io, std::shared_ptr<PipelineSpout> spout,
+               size_t buffer_size = DEFAULT_BUFFER_SIZE);
 
     SocketT& socket();
 
@@ -70,7 +100,7 @@ public:
     static BufferT NO_BUFFER;
 private:
 
-    /** Allocate new buffer or reuse old if there is enough space in there.
+    /** Get new buffer from the pool or reuse old if there is enough space in there.
       * @param prev_buf previous buffer or NO_BUFFER
       * @param size buffer full size
       * @param pos position in the buffer
@@ -89,6 +119,22 @@ private:
                      size_t nbytes);
 
     void handle_write_error(boost::system::error_code error);
+
+    /** Stop reading until the pipeline drains the spout. Socket is not read
+      * while pipeline is overloaded, so TCP pushes back on the client. Values
+      * of the last buffer that didn't fit into the pipeline are kept in the
+      * spout's backlog, so buffer size is not limited by the ring size.
+      */
+    void wait_for_drain(BufferT buffer, size_t pos, size_t buf_size, size_t nbytes);
+
+    void handle_drain_timer(BufferT buffer,
+                            size_t pos,
+                            size_t buf_size,
+                            size_t nbytes,
+                            boost::system::error_code error);
+
+    //! Push spout's backlog to the pipeline after the session stopped reading
+    void drain_backlog(boost::system::error_code error);
 };
 
 
@@ -103,6 +149,7 @@ class TcpAcceptor : public std::enable_shared_from_this<TcpAcceptor>
     std::vector<WorkT>                  sessions_work_;  //< Work to block io-services from completing too early
     std::shared_ptr<IngestionPipeline>  pipeline_;       //< Pipeline instance
     std::atomic<int>                    io_index_;       //< I/O service index
+    const size_t                        buffer_size_;    //< Receive buffer size of the sessions
 
     boost::barrier                      start_barrier_;  //< Barrier to start worker thread
     boost::barrier                      stop_barrier_;   //< Barrier to stop worker thread
@@ -114,11 +161,13 @@ public:
       * @param io io-service instance
       * @param port port to listen for new connections
       * @param pipeline ingestion pipeline
+      * @param buffer_size receive buffer size of the sessions
       */
     TcpAcceptor(// Server parameters
                 std::vector<IOServiceT*> io, int port,
                 // Storage & pipeline
-                std::shared_ptr<IngestionPipeline> pipeline);
+                std::shared_ptr<IngestionPipeline> pipeline,
+                size_t buffer_size = TcpSession::DEFAULT_BUFFER_SIZE);
 
     //! Start listening on socket
     void start();
@@ -141,18 +190,112 @@ private:
 };
 
 
+/** Per-core acceptor.
+  * Listening socket is opened with SO_REUSEPORT on the io-service of the core,
+  * so every core has its own socket and kernel spreads incoming connections
+  * between them. Connections are accepted and served by the same io-service
+  * (same thread), session and its spout never leave the core.
+  */
+class CoreAcceptor : public std::enable_shared_from_this<CoreAcceptor>
+{
+    IOServiceT*                         io_;             //< Io-service of the core
+    AcceptorT                           acceptor_;       //< Acceptor (SO_REUSEPORT)
+    std::shared_ptr<IngestionPipeline>  pipeline_;       //< Pipeline instance
+    const size_t                        buffer_size_;    //< Receive buffer size of the sessions
+    Logger                              logger_;
+public:
+    /** C-tor. Should be created in the heap.
+      * @param io io-service of the core
+      * @param port port to listen for new connections (shared by all cores)
+      * @param pipeline ingestion pipeline
+      * @param buffer_size receive buffer size of the sessions
+      */
+    CoreAcceptor(IOServiceT* io, int port, std::shared_ptr<IngestionPipeline> pipeline,
+                 size_t buffer_size = TcpSession::DEFAULT_BUFFER_SIZE);
+
+    //! Start listening on socket
+    void start();
+
+    //! Stop listening on socket
+    void stop();
+private:
+
+    //! Accept event handler
+    void handle_accept(std::shared_ptr<TcpSession> session, boost::system::error_code err);
+};
+
+
+/** Metrics endpoint.
+  * Writes plain text report (one `name value` pair per line) to every
+  * accepted connection and closes it, e.g. `nc localhost 8282`.
+  * Runs on the sessions io-service, report is built on request, so
+  * endpoint doesn't add anything to the write path.
+  */
+class MetricsAcceptor : public std::enable_shared_from_this<MetricsAcceptor>
+{
+    IOServiceT*                         io_;             //< Sessions io-service
+    AcceptorT                           acceptor_;       //< Acceptor
+    std::shared_ptr<IngestionPipeline>  pipeline_;       //< Pipeline instance (queue depths)
+    std::shared_ptr<DbConnection>       dbcon_;          //< Connection (storage metrics)
+    std::shared_ptr<UdpServer>          udp_;            //< UDP listener (optional)
+    Logger                              logger_;
+public:
+    /** C-tor. Should be created in the heap.
+      * @param io io-service instance
+      * @param port port to listen for new connections
+      * @param udp UDP listener (can be null)
+      */
+    MetricsAcceptor(IOServiceT* io, int port,
+                    std::shared_ptr<IngestionPipeline> pipeline,
+                    std::shared_ptr<DbConnection> con,
+                    std::shared_ptr<UdpServer> udp = std::shared_ptr<UdpServer>());
+
+    //! Start listening on socket
+    void start();
+
+    //! Stop listening on socket
+    void stop();
+
+    //! Write metrics report to stream (UDP counters are reported if `udp` is not null)
+    static void format(std::ostream& ostr, PipelineStats const& pstats, aku_Metrics const& metrics,
+                       UdpStats const* udp = nullptr);
+private:
+
+    //! Accept event handler
+    void handle_accept(std::shared_ptr<SocketT> socket, boost::system::error_code err);
+};
+
+
 struct TcpServer : public std::enable_shared_from_this<TcpServer>
 {
     std::shared_ptr<IngestionPipeline>  pline;
     std::shared_ptr<DbConnection>       dbcon;
-    std::shared_ptr<TcpAcceptor>        serv;
+    std::shared_ptr<TcpAcceptor>        serv;     //< Shared acceptor (null in per-core mode)
+    std::vector<std::shared_ptr<CoreAcceptor>> core_acceptors;  //< Acceptors (per-core mode)
+    std::vector<std::unique_ptr<IOServiceT>>   core_io;         //< Io-services of the cores except the first one
+    std::shared_ptr<MetricsAcceptor>    metrics;  //< Metrics endpoint (optional)
+    std::shared_ptr<UdpServer>          udp;      //< UDP listener (optional)
+    std::shared_ptr<QueryAcceptor>      query;    //< Query endpoint (optional)
     boost::asio::io_service             io;
     std::vector<IOServiceT*>            iovec;
     boost::barrier                      barrier;
     boost::asio::signal_set             sig;
     std::atomic<int>                    stopped;
-
-    TcpServer(std::shared_ptr<DbConnection> con, int concurrency);
+    const bool                          per_core;  //< Every io-service is run by its own thread pinned to CPU
+
+    /** C-tor
+      * @param concurrency number of IO threads
+      * @param nwriters number of pipeline worker threads (one per storage shard if zero)
+      * @param metrics_port port of the metrics endpoint (disabled if zero)
+      * @param udp_port port of the UDP listener (disabled if zero), listener runs `concurrency` workers
+      * @param per_core use `concurrency` io-services (one per core, see CoreAcceptor) instead of
+      *        one io-service shared by `concurrency` threads
+      * @param buffer_size receive buffer size of the TCP sessions
+      * @param query_port port of the query endpoint (disabled if zero)
+      */
+    TcpServer(std::shared_ptr<DbConnection> con, int concurrency, uint32_t nwriters = 0u, int metrics_port = 0,
+              int udp_port = 0, bool per_core = false, size_t buffer_size = TcpSession::DEFAULT_BUFFER_SIZE,
+              int query_port = 0);
 
     //! Run IO service
     void start();
@@ -162,5 +305,7 @@ struct TcpServer : public std::enable_shared_from_this<TcpServer>
     void stop();
 
     void wait();
+private:
+    void stop_acceptors();
 };
 }
@@ -0,0 +1,57 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Main
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+
+using namespace Akumuli;
+
+BOOST_AUTO_TEST_CASE(Test_async_logger_rate_limit) {
+    Logger logger("test-async-logger", 10);
+    AsyncLogger::start(AsyncLogger::DEFAULT_RING_SIZE, 10u, 60000u);
+    BOOST_REQUIRE(AsyncLogger::is_running());
+    auto before = AsyncLogger::get_stats();
+    const int NTHREADS = 4;
+    const int NMESSAGES = 100;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < NTHREADS; i++) {
+        threads.emplace_back([&logger, i]() {
+            for (int j = 0; j < NMESSAGES; j++) {
+                logger.error() << "same message";
+                logger.info() << "unique message " << i << " " << j;
+            }
+        });
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    AsyncLogger::stop();
+    BOOST_REQUIRE(!AsyncLogger::is_running());
+    auto after = AsyncLogger::get_stats();
+    BOOST_REQUIRE_EQUAL(after.n_dropped - before.n_dropped, 0u);
+    // 10 identical messages are written, the rest is reported by one summary
+    BOOST_REQUIRE_EQUAL(after.n_suppressed - before.n_suppressed, NTHREADS*NMESSAGES - 10u);
+    BOOST_REQUIRE_EQUAL(after.n_written - before.n_written, NTHREADS*NMESSAGES + 10u + 1u);
+
+    // Logger is synchronous after stop
+    logger.error() << "sync message";
+    BOOST_REQUIRE_EQUAL(AsyncLogger::get_stats().n_written, after.n_written);
+}
+
+BOOST_AUTO_TEST_CASE(Test_async_logger_overflow) {
+    Logger logger("test-async-logger", 10);
+    // Nothing is suppressed, small ring overflows if background thread is slow
+    AsyncLogger::start(2u, 0u);
+    auto before = AsyncLogger::get_stats();
+    const int NMESSAGES = 10000;
+    for (int i = 0; i < NMESSAGES; i++) {
+        logger.trace() << "message " << i;
+    }
+    AsyncLogger::stop();
+    auto after = AsyncLogger::get_stats();
+    BOOST_REQUIRE_EQUAL(after.n_suppressed - before.n_suppressed, 0u);
+    BOOST_REQUIRE_EQUAL((after.n_written - before.n_written) + (after.n_dropped - before.n_dropped),
+                        static_cast<uint64_t>(NMESSAGES));
+}
@@ -5,6 +5,10 @@
 #include <boost/test/unit_test.hpp>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <map>
+#include <set>
+#include <algorithm>
 
 #include "ingestion_pipeline.h"
 
@@ -43,3 +47,325 @@ BOOST_AUTO_TEST_CASE(Test_spout_in_single_thread) {
         BOOST_REQUIRE_EQUAL(con->cntt, sumt);
         BOOST_REQUIRE_EQUAL(con->cntp, sump);
 }
+
+struct ShardedConnectionMock : Akumuli::DbConnection {
+    std::mutex mutex;
+    std::map<aku_ParamId, std::vector<aku_TimeStamp>> written;
+    std::map<aku_ParamId, std::thread::id> writers;
+    bool wrong_thread = false;
+
+    aku_Status write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
+        std::lock_guard<std::mutex> guard(mutex);
+        written[param].push_back(ts);
+        auto it = writers.find(param);
+        if (it == writers.end()) {
+            writers[param] = std::this_thread::get_id();
+        } else if (it->second != std::this_thread::get_id()) {
+            wrong_thread = true;
+        }
+        return AKU_SUCCESS;
+    }
+
+    uint32_t num_shards() {
+        return 2u;
+    }
+
+    uint32_t shard_index(aku_ParamId param) {
+        return param % 2;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(Test_pipeline_multiple_workers) {
+
+    // Four workers, two workers per shard
+    std::shared_ptr<ShardedConnectionMock> con = std::make_shared<ShardedConnectionMock>();
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_LINEAR_BACKOFF, 4u);
+    pipeline->start();
+    auto spout = pipeline->make_spout();
+    std::set<uint32_t> workers;
+    for (aku_ParamId id = 0; id < 16; id++) {
+        workers.insert(spout->get_worker_index(id));
+        BOOST_REQUIRE_EQUAL(spout->get_worker_index(id) % 2, id % 2);
+    }
+    BOOST_REQUIRE_EQUAL(workers.size(), 4u);
+    for (aku_TimeStamp ts = 0; ts < 10000; ts++) {
+        spout->write_double(ts % 16, ts, 0.0);
+    }
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->written.size(), 16u);
+    BOOST_REQUIRE(!con->wrong_thread);
+    for (auto const& kv: con->written) {
+        // Order of the series values is preserved
+        BOOST_REQUIRE(std::is_sorted(kv.second.begin(), kv.second.end()));
+        BOOST_REQUIRE_EQUAL(kv.second.size(), 10000u/16);
+    }
+}
+
+struct BatchConnectionMock : Akumuli::DbConnection {
+    std::vector<size_t> batches;
+    std::vector<aku_TimeStamp> written;
+
+    aku_Status write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
+        BOOST_ERROR("Values should be written in batches");
+        return AKU_SUCCESS;
+    }
+
+    aku_Status write_batch(const aku_ParamId* params, const aku_TimeStamp* ts,
+                           const double* data, size_t size, aku_Status* statuses)
+    {
+        batches.push_back(size);
+        written.insert(written.end(), ts, ts + size);
+        return AKU_SUCCESS;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(Test_pipeline_batch_write) {
+
+    std::shared_ptr<BatchConnectionMock> con = std::make_shared<BatchConnectionMock>();
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_LINEAR_BACKOFF);
+    auto spout = pipeline->make_spout();
+    // Values are queued before the worker starts and drained at once
+    const aku_TimeStamp N = 500;
+    for (aku_TimeStamp ts = 0; ts < N; ts++) {
+        spout->write_double(42, ts, 0.0);
+    }
+    pipeline->start();
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->written.size(), N);
+    BOOST_REQUIRE(std::is_sorted(con->written.begin(), con->written.end()));
+    BOOST_REQUIRE(con->batches.size() < 10u);
+    BOOST_REQUIRE(*std::max_element(con->batches.begin(), con->batches.end()) > 100u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_pipeline_wait_strategies) {
+
+    WaitStrategy strategies[] = { AKU_WAIT_BUSY_SPIN, AKU_WAIT_SPIN_THEN_PARK, AKU_WAIT_BLOCKING };
+    for (auto ws: strategies) {
+        std::shared_ptr<ConnectionMock> con = std::make_shared<ConnectionMock>();
+        con->cntp = 0;
+        con->cntt = 0;
+        auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_LINEAR_BACKOFF, 0u, ws);
+        pipeline->start();
+        auto spout = pipeline->make_spout();
+        for (int i = 0; i < 1000; i++) {
+            spout->write_double(1, 1, 0.0);
+            if (i % 100 == 0) {
+                // Let the worker go idle
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        }
+        pipeline->stop();
+        BOOST_REQUIRE_EQUAL(con->cntt, 1000);
+        auto stats = pipeline->get_stats();
+        if (ws == AKU_WAIT_BUSY_SPIN) {
+            BOOST_REQUIRE_EQUAL(stats.nparks, 0u);
+            BOOST_REQUIRE(stats.spin_ns > 0u);
+        } else if (ws == AKU_WAIT_BLOCKING) {
+            // Parked worker is woken up by the spout
+            BOOST_REQUIRE(stats.nparks > 0u);
+            BOOST_REQUIRE(stats.nwakeups > 0u);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_pipeline_many_spouts) {
+
+    // Every spout has its own ring, rings of destroyed spouts are drained
+    std::shared_ptr<ConnectionMock> con = std::make_shared<ConnectionMock>();
+    con->cntp = 0;
+    con->cntt = 0;
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_LINEAR_BACKOFF);
+    pipeline->start();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&pipeline, t]() {
+            for (int s = 0; s < 10; s++) {
+                auto spout = pipeline->make_spout();
+                for (int i = 0; i < 1000; i++) {
+                    spout->write_double(t, 1, 0.0);
+                }
+            }
+        });
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->cntt, 40000);
+    BOOST_REQUIRE_EQUAL(con->cntp, (0 + 1 + 2 + 3)*10000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_spout_water_marks) {
+
+    std::shared_ptr<ConnectionMock> con = std::make_shared<ConnectionMock>();
+    con->cntp = 0;
+    con->cntt = 0;
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_LINEAR_BACKOFF);
+    auto spout = pipeline->make_spout();
+    // Worker is not started yet, values are accumulated in the ring
+    for (int i = 0; i <= PipelineSpout::HIGH_WATER_MARK; i++) {
+        BOOST_REQUIRE(!spout->is_overloaded());
+        spout->write_double(1, 1, 0.0);
+    }
+    BOOST_REQUIRE(spout->is_overloaded());
+    BOOST_REQUIRE(!spout->is_drained());
+    auto stats = pipeline->get_stats();
+    BOOST_REQUIRE_EQUAL(stats.nrings, 1u);
+    BOOST_REQUIRE_EQUAL(stats.queue_depth, PipelineSpout::HIGH_WATER_MARK + 1u);
+    BOOST_REQUIRE_EQUAL(stats.max_queue_depth, PipelineSpout::HIGH_WATER_MARK + 1u);
+    pipeline->start();
+    while (!spout->is_drained()) {
+        std::this_thread::yield();
+    }
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->cntt, PipelineSpout::HIGH_WATER_MARK + 1);
+    BOOST_REQUIRE_EQUAL(spout->get_pending(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_spout_backlog) {
+
+    std::shared_ptr<ConnectionMock> con = std::make_shared<ConnectionMock>();
+    con->cntp = 0;
+    con->cntt = 0;
+    // Values would be dropped without flow control
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_THROTTLE);
+    auto spout = pipeline->make_spout();
+    spout->set_flow_control(true);
+    // Worker is not started yet, values that don't fit into the ring are kept in the backlog
+    const int N = PipelineSpout::RING_SIZE*4;
+    int sump = 0;
+    for (int i = 0; i < N; i++) {
+        spout->write_double(i, 1, 0.0);
+        sump += i;
+    }
+    BOOST_REQUIRE_EQUAL(spout->get_pending(), static_cast<size_t>(PipelineSpout::RING_SIZE));
+    BOOST_REQUIRE(spout->is_overloaded());
+    BOOST_REQUIRE(!spout->flush_backlog());
+    pipeline->start();
+    while (!spout->flush_backlog() || spout->get_pending() != 0) {
+        std::this_thread::yield();
+    }
+    BOOST_REQUIRE(spout->is_drained());
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->cntt, N);
+    BOOST_REQUIRE_EQUAL(con->cntp, sump);
+    BOOST_REQUIRE_EQUAL(spout->get_dropped(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_spout_throttle_drops) {
+
+    std::shared_ptr<ConnectionMock> con = std::make_shared<ConnectionMock>();
+    con->cntp = 0;
+    con->cntt = 0;
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_THROTTLE);
+    auto spout = pipeline->make_spout();
+    // Worker is not started yet, values that don't fit into the ring are dropped and counted
+    const int NDROPPED = 10;
+    for (int i = 0; i < PipelineSpout::RING_SIZE + NDROPPED; i++) {
+        spout->write_double(i, 1, 0.0);
+    }
+    BOOST_REQUIRE_EQUAL(spout->get_dropped(), static_cast<uint64_t>(NDROPPED));
+    pipeline->start();
+    while (spout->get_pending() != 0) {
+        std::this_thread::yield();
+    }
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->cntt, PipelineSpout::RING_SIZE);
+}
+
+struct SampleConnectionMock : Akumuli::DbConnection {
+    std::vector<aku_TimeStamp> timestamps;
+    double  sum = 0.0;
+    int64_t isum = 0;
+
+    aku_Status write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
+        timestamps.push_back(ts);
+        sum += data;
+        return AKU_SUCCESS;
+    }
+
+    aku_Status write_int64(aku_ParamId param, aku_TimeStamp ts, int64_t data) {
+        timestamps.push_back(ts);
+        isum += data;
+        return AKU_SUCCESS;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(Test_spout_bulk_frame) {
+
+    std::shared_ptr<SampleConnectionMock> con = std::make_shared<SampleConnectionMock>();
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_LINEAR_BACKOFF);
+    pipeline->start();
+    auto spout = pipeline->make_spout();
+    std::vector<aku_Sample> samples;
+    double sum = 0.0;
+    int64_t isum = 0;
+    for (int i = 0; i < 5000; i++) {
+        aku_Sample sample = {};
+        sample.paramid = 1u;
+        sample.timestamp = 10000u - i;
+        sample.is_int = i % 2;
+        if (sample.is_int) {
+            sample.ivalue = i;
+            isum += i;
+        } else {
+            sample.value = i*0.25;
+            sum += i*0.25;
+        }
+        samples.push_back(sample);
+    }
+    std::vector<char> frame(aku_bulk_max_size(samples.size()));
+    size_t size = 0;
+    auto status = aku_encode_bulk(samples.data(), samples.size(), frame.data(), frame.size(), &size);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(spout->add_bulk_string(frame.data(), size), AKU_SUCCESS);
+    // Damaged frame is rejected
+    frame[0] = 'X';
+    BOOST_REQUIRE_EQUAL(spout->add_bulk_string(frame.data(), size), AKU_EBAD_DATA);
+    while (spout->get_pending() != 0) {
+        std::this_thread::yield();
+    }
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->timestamps.size(), samples.size());
+    // Frame is sorted by timestamp
+    BOOST_REQUIRE(std::is_sorted(con->timestamps.begin(), con->timestamps.end()));
+    BOOST_REQUIRE_EQUAL(con->sum, sum);
+    BOOST_REQUIRE_EQUAL(con->isum, isum);
+}
+
+BOOST_AUTO_TEST_CASE(Test_spout_bulk_frame_backlog) {
+
+    std::shared_ptr<SampleConnectionMock> con = std::make_shared<SampleConnectionMock>();
+    auto pipeline = std::make_shared<IngestionPipeline>(con, AKU_THROTTLE);
+    auto spout = pipeline->make_spout();
+    spout->set_flow_control(true);
+    // Frame is much larger than the ring
+    std::vector<aku_Sample> samples;
+    double sum = 0.0;
+    for (int i = 0; i < PipelineSpout::RING_SIZE*8; i++) {
+        aku_Sample sample = {};
+        sample.paramid = 1u;
+        sample.timestamp = i;
+        sample.value = i*0.5;
+        sum += i*0.5;
+        samples.push_back(sample);
+    }
+    std::vector<char> frame(aku_bulk_max_size(samples.size()));
+    size_t size = 0;
+    auto status = aku_encode_bulk(samples.data(), samples.size(), frame.data(), frame.size(), &size);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    // Worker is not started yet, the rest of the frame is kept in the backlog
+    BOOST_REQUIRE_EQUAL(spout->add_bulk_string(frame.data(), size), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(spout->add_bulk_string(frame.data(), size), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(spout->get_pending(), static_cast<size_t>(PipelineSpout::RING_SIZE));
+    BOOST_REQUIRE(spout->is_overloaded());
+    pipeline->start();
+    while (!spout->flush_backlog() || spout->get_pending() != 0) {
+        std::this_thread::yield();
+    }
+    pipeline->stop();
+    BOOST_REQUIRE_EQUAL(con->timestamps.size(), 2*samples.size());
+    BOOST_REQUIRE(std::is_sorted(con->timestamps.begin(), con->timestamps.begin() + samples.size()));
+    BOOST_REQUIRE(std::is_sorted(con->timestamps.begin() + samples.size(), con->timestamps.end()));
+    BOOST_REQUIRE_EQUAL(con->sum, 2*sum);
+}
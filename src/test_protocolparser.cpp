@@ -1,4 +1,6 @@
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Main
@@ -14,6 +16,7 @@ struct ConsumerMock : ProtocolConsumer {
     std::vector<aku_TimeStamp>   ts_;
     std::vector<double>          data_;
     std::vector<std::string>     bulk_;
+    aku_Status                   bulk_status_ = AKU_SUCCESS;
 
     void write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
         param_.push_back(param);
@@ -21,9 +24,24 @@ struct ConsumerMock : ProtocolConsumer {
         data_.push_back(data);
     }
 
-    void add_bulk_string(const Byte *buffer, size_t n) {
+    aku_Status add_bulk_string(const Byte *buffer, size_t n) {
         bulk_.push_back(std::string(buffer, buffer + n));
+        return bulk_status_;
     }
+
+    aku_Status series_to_param_id(const char* name, size_t size, aku_ParamId* out_id) {
+        std::string series(name, name + size);
+        resolved_++;
+        auto it = std::find(names_.begin(), names_.end(), series);
+        if (it == names_.end()) {
+            it = names_.insert(names_.end(), series);
+        }
+        *out_id = 1000u + static_cast<aku_ParamId>(it - names_.begin());
+        return AKU_SUCCESS;
+    }
+
+    std::vector<std::string>     names_;
+    int                          resolved_ = 0;  //< Number of series_to_param_id calls
 };
 
 void null_deleter(const char* s) {}
@@ -155,3 +173,209 @@ BOOST_AUTO_TEST_CASE(Test_protocol_parse_error_format) {
     parser.start();
     BOOST_REQUIRE_EXCEPTION(parser.parse_next(pdu), RESPError, check_resp_error);
 }
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parse_series_names) {
+
+    const char *messages = "+cpu host=a\r\n:2\r\n+34.5\r\n+cpu host=b\r\n:3\r\n:6\r\n+cpu host=a\r\n:4\r\n+8.9\r\n";
+    auto buffer = buffer_from_static_string(messages);
+    PDU pdu = {
+        buffer,
+        strlen(messages),
+        0u
+    };
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+    ProtocolParser parser(cons);
+    parser.start();
+    parser.parse_next(pdu);
+    parser.close();
+    BOOST_REQUIRE_EQUAL(cons->names_.size(), 2);
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 3);
+    BOOST_REQUIRE_EQUAL(cons->param_[0], 1000u);
+    BOOST_REQUIRE_EQUAL(cons->param_[1], 1001u);
+    BOOST_REQUIRE_EQUAL(cons->param_[2], 1000u);
+    BOOST_REQUIRE_EQUAL(cons->data_[0], 34.5);
+    BOOST_REQUIRE_EQUAL(cons->data_[1], 6.0);
+    BOOST_REQUIRE_EQUAL(cons->data_[2], 8.9);
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_series_cache) {
+
+    const char *messages = "+cpu host=a\r\n:2\r\n+34.5\r\n+cpu host=b\r\n:3\r\n:6\r\n"
+                           "+cpu host=a\r\n:4\r\n+8.9\r\n+cpu host=a\r\n:5\r\n:7\r\n";
+    auto buffer = buffer_from_static_string(messages);
+    PDU pdu = {
+        buffer,
+        strlen(messages),
+        0u
+    };
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+    ProtocolParser parser(cons);
+    parser.start();
+    parser.parse_next(pdu);
+    parser.close();
+    // Repeated names are resolved by the session cache
+    BOOST_REQUIRE_EQUAL(cons->resolved_, 2);
+    BOOST_REQUIRE_EQUAL(parser.get_series_cache().hits(), 2u);
+    BOOST_REQUIRE_EQUAL(parser.get_series_cache().misses(), 2u);
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 4);
+    BOOST_REQUIRE_EQUAL(cons->param_[2], 1000u);
+    BOOST_REQUIRE_EQUAL(cons->param_[3], 1000u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_series_cache_eviction) {
+
+    SeriesCache cache(2);
+    aku_ParamId id = 0;
+    cache.put("a", 1);
+    cache.put("b", 2);
+    BOOST_REQUIRE(cache.get("a", &id));
+    BOOST_REQUIRE_EQUAL(id, 1u);
+    // "b" is least recently used
+    cache.put("c", 3);
+    BOOST_REQUIRE(!cache.get("b", &id));
+    BOOST_REQUIRE(cache.get("a", &id));
+    BOOST_REQUIRE(cache.get("c", &id));
+    BOOST_REQUIRE_EQUAL(id, 3u);
+    BOOST_REQUIRE_EQUAL(cache.hits(), 3u);
+    BOOST_REQUIRE_EQUAL(cache.misses(), 1u);
+}
+
+static void parse_in_chunks(ProtocolParser& parser, std::string const& messages, std::vector<size_t> const& splits) {
+    size_t begin = 0;
+    for (size_t i = 0; i <= splits.size(); i++) {
+        size_t end = i < splits.size() ? splits[i] : messages.size();
+        // Every PDU has its own buffer, parser shouldn't keep pointers to old buffers
+        auto chunk = std::make_shared<std::string>(messages.substr(begin, end - begin));
+        std::shared_ptr<const Byte> buffer(chunk, chunk->data());
+        PDU pdu = { buffer, chunk->size(), 0u };
+        parser.parse_next(pdu);
+        begin = end;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parse_split_everywhere) {
+
+    const std::string messages = "+cpu host=a\r\n:2\r\n+34.5\r\n$5\r\nab\r\nc\r\n:12345\r\n:3\r\n:6\r\n"
+                                 "+cpu host=b\r\n:4\r\n+8.9\r\n";
+    // Messages are split in two PDUs at every position and are fed byte by byte
+    std::vector<std::vector<size_t>> cases;
+    for (size_t split = 1; split < messages.size(); split++) {
+        cases.push_back({split});
+    }
+    std::vector<size_t> bytes;
+    for (size_t split = 1; split < messages.size(); split++) {
+        bytes.push_back(split);
+    }
+    cases.push_back(bytes);
+    for (auto const& splits: cases) {
+        std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+        ProtocolParser parser(cons);
+        parser.start();
+        parse_in_chunks(parser, messages, splits);
+        parser.close();
+        BOOST_REQUIRE_EQUAL(cons->param_.size(), 3);
+        BOOST_REQUIRE_EQUAL(cons->param_[0], 1000u);
+        BOOST_REQUIRE_EQUAL(cons->param_[1], 12345u);
+        BOOST_REQUIRE_EQUAL(cons->param_[2], 1001u);
+        BOOST_REQUIRE_EQUAL(cons->ts_[0], 2u);
+        BOOST_REQUIRE_EQUAL(cons->ts_[1], 3u);
+        BOOST_REQUIRE_EQUAL(cons->ts_[2], 4u);
+        BOOST_REQUIRE_EQUAL(cons->data_[0], 34.5);
+        BOOST_REQUIRE_EQUAL(cons->data_[1], 6.0);
+        BOOST_REQUIRE_EQUAL(cons->data_[2], 8.9);
+        BOOST_REQUIRE_EQUAL(cons->bulk_.size(), 1);
+        BOOST_REQUIRE_EQUAL(cons->bulk_[0], "ab\r\nc");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parse_bad_bulk_frame) {
+
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+    ProtocolParser parser(cons);
+    parser.start();
+    // Values parsed before the frame are written before the frame
+    parse_in_chunks(parser, ":1\r\n:2\r\n+3.5\r\n", {});
+    cons->bulk_status_ = AKU_EBAD_DATA;
+    auto messages = std::make_shared<std::string>("$3\r\nabc\r\n");
+    PDU pdu = { std::shared_ptr<const Byte>(messages, messages->data()), messages->size(), 0u };
+    BOOST_REQUIRE_THROW(parser.parse_next(pdu), ProtocolParserError);
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 1);
+    BOOST_REQUIRE_EQUAL(cons->bulk_.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parse_error_in_carried_element) {
+
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+    ProtocolParser parser(cons);
+    parser.start();
+    parse_in_chunks(parser, ":1\r\n:2\r\n+3.5\r\n:1", {});
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 1);
+    auto messages = std::make_shared<std::string>("2x\r\n:7\r\n+8.9\r\n");
+    PDU pdu = { std::shared_ptr<const Byte>(messages, messages->data()), messages->size(), 0u };
+    auto check_resp_error = [](const RESPError& error) {
+        std::string what = error.what();
+        auto bls = error.get_bottom_line().size();
+        return bls > 0 && bls < what.size() && what[bls-1] == 'x';
+    };
+    BOOST_REQUIRE_EXCEPTION(parser.parse_next(pdu), RESPError, check_resp_error);
+}
+
+struct BatchConsumerMock : ConsumerMock {
+    std::vector<size_t> batches_;
+
+    void write_samples(ProtocolSample const* samples, size_t size) {
+        batches_.push_back(size);
+        ConsumerMock::write_samples(samples, size);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parse_batches) {
+
+    std::string messages;
+    const int N = 1000;
+    for (int i = 0; i < N; i++) {
+        messages += ":" + std::to_string(i) + "\r\n:" + std::to_string(i) + "\r\n:" + std::to_string(i) + "\r\n";
+    }
+    std::shared_ptr<BatchConsumerMock> cons(new BatchConsumerMock);
+    ProtocolParser parser(cons);
+    parser.start();
+    parse_in_chunks(parser, messages, {messages.size()/2});
+    parser.close();
+    // Samples are passed to consumer in batches (in order)
+    BOOST_REQUIRE(cons->batches_.size() < N/10);
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), N);
+    for (int i = 0; i < N; i++) {
+        BOOST_REQUIRE_EQUAL(cons->param_[i], static_cast<aku_ParamId>(i));
+        BOOST_REQUIRE_EQUAL(cons->data_[i], static_cast<double>(i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parse_iso_timestamps) {
+
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+    ProtocolParser parser(cons);
+    parser.start();
+    std::string messages = ":1\r\n+2015-03-14T15:09:26.5Z\r\n+1.5\r\n"
+                           ":2\r\n+20150314T150926\r\n+2.5\r\n";
+    parse_in_chunks(parser, messages, {7, 20});
+    parser.close();
+    BOOST_REQUIRE_EQUAL(cons->ts_.size(), 2);
+    BOOST_REQUIRE_EQUAL(cons->ts_[0], 1426345766500000000ull);
+    BOOST_REQUIRE_EQUAL(cons->ts_[1], 1426345766000000000ull);
+    BOOST_REQUIRE_EQUAL(cons->data_[1], 2.5);
+
+    auto bad = std::make_shared<std::string>(":1\r\n+2015-13-14T15:09:26\r\n+1.5\r\n");
+    PDU pdu = { std::shared_ptr<const Byte>(bad, bad->data()), bad->size(), 0u };
+    BOOST_REQUIRE_THROW(parser.parse_next(pdu), ProtocolParserError);
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parse_bad_float) {
+
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+    ProtocolParser parser(cons);
+    parser.start();
+    auto bad = std::make_shared<std::string>(":1\r\n:2\r\n+1.5\r\n:1\r\n:2\r\n+1.5x\r\n");
+    PDU pdu = { std::shared_ptr<const Byte>(bad, bad->data()), bad->size(), 0u };
+    BOOST_REQUIRE_THROW(parser.parse_next(pdu), ProtocolParserError);
+    BOOST_REQUIRE_EQUAL(cons->data_.size(), 1);
+}
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <memory>
 #include <thread>
+#include <map>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Main
@@ -262,3 +263,324 @@ BOOST_AUTO_TEST_CASE(Test_tcp_server_backend_error_handling) {
         BOOST_REQUIRE_EQUAL(std::string(buffer, buffer + 3), "-DB");
     });
 }
+
+
+BOOST_AUTO_TEST_CASE(Test_metrics_endpoint) {
+
+    struct MetricsMock : DbMock {
+        void get_metrics(aku_Metrics* rcv_metrics) {
+            DbConnection::get_metrics(rcv_metrics);
+            rcv_metrics->n_writes = 42;
+            rcv_metrics->write.p99 = 1000;
+        }
+    };
+    auto dbcon = std::make_shared<MetricsMock>();
+    auto pline = std::make_shared<IngestionPipeline>(dbcon, AKU_LINEAR_BACKOFF);
+    auto spout = pline->make_spout();
+    spout->write_double(1, 2, 3.0);  // not written, pipeline is not started
+    IOServiceT io;
+    auto metrics = std::make_shared<MetricsAcceptor>(&io, 8282, pline, dbcon);
+    metrics->start();
+
+    SocketT socket(io);
+    auto loopback = boost::asio::ip::address_v4::loopback();
+    socket.connect(boost::asio::ip::tcp::endpoint(loopback, 8282));
+    io.run_one();  // handle_accept
+    io.run_one();  // write report
+
+    boost::asio::streambuf instream;
+    boost::system::error_code err;
+    boost::asio::read(socket, instream, err);
+    BOOST_REQUIRE(err == boost::asio::error::eof);
+    std::istream is(&instream);
+    std::map<std::string, uint64_t> report;
+    std::string name;
+    uint64_t value;
+    while (is >> name >> value) {
+        report[name] = value;
+    }
+    BOOST_REQUIRE_EQUAL(report["pipeline.queue_depth"], 1u);
+    BOOST_REQUIRE_EQUAL(report["storage.writes"], 42u);
+    BOOST_REQUIRE_EQUAL(report["storage.write.p99_ns"], 1000u);
+    BOOST_REQUIRE(report.count("storage.checkpoint.count"));
+    BOOST_REQUIRE(report.count("storage.flush.max_ns"));
+    BOOST_REQUIRE(report.count("storage.query.p50_ns"));
+    metrics->stop();
+}
+
+BOOST_AUTO_TEST_CASE(Test_udp_server) {
+
+    auto dbcon = std::make_shared<DbMock>();
+    auto pline = std::make_shared<IngestionPipeline>(dbcon, AKU_LINEAR_BACKOFF);
+    pline->start();
+    auto udp = std::make_shared<UdpServer>(pline, 14096, 2);
+    udp->start();
+
+    IOServiceT io;
+    boost::asio::ip::udp::socket socket(io);
+    socket.open(boost::asio::ip::udp::v4());
+    auto loopback = boost::asio::ip::address_v4::loopback();
+    boost::asio::ip::udp::endpoint endpoint(loopback, 14096);
+    const std::string datagrams[] = {
+        ":1\r\n:2\r\n+3.0\r\n:4\r\n:5\r\n+6.0\r\n",
+        ":7\r\n:8\r\n+9.0\r\n:10\r\n",          // incomplete message is discarded
+        ":11\r\n:12\r\n+13.0\r\n:1x\r\n",       // values before the error are written
+    };
+    for (auto const& dgram: datagrams) {
+        socket.send_to(boost::asio::buffer(dgram), endpoint);
+    }
+    for (int i = 0; i < 1000 && udp->get_stats().ndatagrams < 3u; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    udp->stop();
+    pline->stop();
+
+    auto stats = udp->get_stats();
+    BOOST_REQUIRE_EQUAL(stats.ndatagrams, 3u);
+    BOOST_REQUIRE_EQUAL(stats.nbad, 2u);
+    BOOST_REQUIRE_EQUAL(stats.nbytes, datagrams[0].size() + datagrams[1].size() + datagrams[2].size());
+    BOOST_REQUIRE_EQUAL(stats.nthrottled, 0u);
+    BOOST_REQUIRE_EQUAL(dbcon->results.size(), 4u);
+    std::sort(dbcon->results.begin(), dbcon->results.end());
+    BOOST_REQUIRE(dbcon->results[0] == std::make_tuple(1u, 2u, 3.0));
+    BOOST_REQUIRE(dbcon->results[1] == std::make_tuple(4u, 5u, 6.0));
+    BOOST_REQUIRE(dbcon->results[2] == std::make_tuple(7u, 8u, 9.0));
+    BOOST_REQUIRE(dbcon->results[3] == std::make_tuple(11u, 12u, 13.0));
+
+    std::stringstream report;
+    aku_Metrics metrics = {};
+    MetricsAcceptor::format(report, pline->get_stats(), metrics, &stats);
+    BOOST_REQUIRE(report.str().find("udp.bad 2\n") != std::string::npos);
+    BOOST_REQUIRE(report.str().find("udp.throttled 0\n") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(Test_core_acceptors) {
+
+    struct CountingMock : DbMock {
+        std::atomic<int> count = {0};
+        aku_Status write_double(aku_ParamId param, aku_TimeStamp ts, double data) {
+            count++;
+            return DbMock::write_double(param, ts, data);
+        }
+    };
+    auto dbcon = std::make_shared<CountingMock>();
+    auto pline = std::make_shared<IngestionPipeline>(dbcon, AKU_LINEAR_BACKOFF);
+    pline->start();
+    // Two cores listen on the same port
+    IOServiceT io1, io2;
+    auto acc1 = std::make_shared<CoreAcceptor>(&io1, 14097, pline);
+    auto acc2 = std::make_shared<CoreAcceptor>(&io2, 14097, pline);
+    acc1->start();
+    acc2->start();
+    std::thread thread1([&io1]() { io1.run(); });
+    std::thread thread2([&io2]() { io2.run(); });
+
+    const int NCLIENTS = 16;
+    IOServiceT io;
+    auto loopback = boost::asio::ip::address_v4::loopback();
+    for (int i = 0; i < NCLIENTS; i++) {
+        SocketT socket(io);
+        socket.connect(EndpointT(loopback, 14097));
+        std::string message = ":" + std::to_string(i) + "\r\n:1\r\n+2.0\r\n";
+        boost::asio::write(socket, boost::asio::buffer(message));
+        socket.shutdown(SocketT::shutdown_both);
+    }
+    // Sessions are closed by clients, io-services complete when acceptors are stopped
+    for (int i = 0; i < 1000 && dbcon->count < NCLIENTS; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    acc1->stop();
+    acc2->stop();
+    thread1.join();
+    thread2.join();
+    pline->stop();
+    BOOST_REQUIRE_EQUAL(dbcon->results.size(), NCLIENTS);
+}
+
+BOOST_AUTO_TEST_CASE(Test_buffer_pool) {
+
+    const size_t SIZE = 0x1000;
+    // Pool keeps buffers of one size, buffers of other size
+    // (left by previous tests) are dropped
+    BufferPool::get(SIZE).reset();
+    BOOST_REQUIRE_EQUAL(BufferPool::nfree(), 1u);
+    auto buf1 = BufferPool::get(SIZE);
+    const Byte* address = buf1.get();
+    BOOST_REQUIRE_EQUAL(BufferPool::nfree(), 0u);
+    {
+        auto copy = buf1;
+        buf1.reset();
+        // Buffer is referenced by copy
+        BOOST_REQUIRE_EQUAL(BufferPool::nfree(), 0u);
+    }
+    BOOST_REQUIRE_EQUAL(BufferPool::nfree(), 1u);
+    // Released buffer is reused
+    auto buf2 = BufferPool::get(SIZE);
+    BOOST_REQUIRE(buf2.get() == address);
+    BOOST_REQUIRE_EQUAL(BufferPool::nfree(), 0u);
+    // Pool is limited
+    std::vector<BufferPool::BufferT> buffers;
+    for (int i = 0; i < BufferPool::MAX_FREE*2; i++) {
+        buffers.push_back(BufferPool::get(SIZE));
+    }
+    buffers.clear();
+    BOOST_REQUIRE_EQUAL(BufferPool::nfree(), static_cast<size_t>(BufferPool::MAX_FREE));
+}
+
+BOOST_AUTO_TEST_CASE(Test_query_request_parser) {
+
+    QueryRequest query;
+    QueryFormat format;
+    auto err = QuerySession::parse_request("select 10 20 limit 5 order desc format binary ids 1,2,3", &query, &format);
+    BOOST_REQUIRE(err.empty());
+    BOOST_REQUIRE_EQUAL(query.begin, 20u);
+    BOOST_REQUIRE_EQUAL(query.end, 10u);
+    BOOST_REQUIRE_EQUAL(query.limit, 5u);
+    BOOST_REQUIRE(format == AKU_QUERY_BINARY);
+    BOOST_REQUIRE(query.ids == std::vector<aku_ParamId>({1u, 2u, 3u}));
+
+    err = QuerySession::parse_request("select 20 10 where metric=cpu AND host=web*", &query, &format);
+    BOOST_REQUIRE(err.empty());
+    BOOST_REQUIRE_EQUAL(query.begin, 20u);
+    BOOST_REQUIRE_EQUAL(query.end, 10u);
+    BOOST_REQUIRE_EQUAL(query.limit, 0u);
+    BOOST_REQUIRE(format == AKU_QUERY_RESP);
+    BOOST_REQUIRE(query.ids.empty());
+    BOOST_REQUIRE_EQUAL(query.expression, "metric=cpu AND host=web*");
+
+    BOOST_REQUIRE(!QuerySession::parse_request("select 10 20", &query, &format).empty());
+    BOOST_REQUIRE(!QuerySession::parse_request("select 10 x ids 1", &query, &format).empty());
+    BOOST_REQUIRE(!QuerySession::parse_request("select 10 20 ids 1,y", &query, &format).empty());
+    BOOST_REQUIRE(!QuerySession::parse_request("select 10 20 order up ids 1", &query, &format).empty());
+    BOOST_REQUIRE(!QuerySession::parse_request("delete 10 20 ids 1", &query, &format).empty());
+}
+
+BOOST_AUTO_TEST_CASE(Test_query_endpoint) {
+
+    const size_t N = QuerySession::BATCH_SIZE*2 + 10;
+    // Returns N results, odd values are integers
+    struct QueryCursor : DbCursor {
+        size_t pos = 0;
+        size_t read(aku_TimeStamp* ts, aku_ParamId* ids, aku_PData* values, uint32_t* lengths, size_t size) {
+            size_t n = 0;
+            for (; n < size && pos < N; n++, pos++) {
+                ts[n] = 10000 - pos;
+                ids[n] = pos % 3;
+                if (pos % 2) {
+                    values[n].int64 = -static_cast<int64_t>(pos);
+                    lengths[n] = AKU_LENGTH_INT64;
+                } else {
+                    values[n].float64 = pos + 0.5;
+                    lengths[n] = 0u;
+                }
+            }
+            return n;
+        }
+        bool is_done() {
+            return pos == N;
+        }
+        aku_Status get_error() {
+            return AKU_SUCCESS;
+        }
+    };
+    struct QueryMock : DbMock {
+        QueryRequest last;
+        aku_Status select(QueryRequest const& query, std::unique_ptr<DbCursor>* out_cursor) {
+            if (query.ids.empty()) {
+                return AKU_EBAD_DATA;
+            }
+            last = query;
+            out_cursor->reset(new QueryCursor());
+            return AKU_SUCCESS;
+        }
+    };
+    auto dbcon = std::make_shared<QueryMock>();
+    auto query = std::make_shared<QueryAcceptor>(14098, dbcon);
+    query->start();
+
+    auto run_query = [](std::string request) {
+        IOServiceT io;
+        SocketT socket(io);
+        auto loopback = boost::asio::ip::address_v4::loopback();
+        socket.connect(boost::asio::ip::tcp::endpoint(loopback, 14098));
+        boost::asio::write(socket, boost::asio::buffer(request));
+        boost::asio::streambuf instream;
+        boost::system::error_code err;
+        boost::asio::read(socket, instream, err);
+        BOOST_REQUIRE(err == boost::asio::error::eof);
+        std::istream is(&instream);
+        return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    };
+
+    // RESP format, results are split into batches
+    auto resp = run_query("select 10000 0 limit 100000 ids 0,1,2\r\n");
+    BOOST_REQUIRE_EQUAL(dbcon->last.begin, 10000u);
+    BOOST_REQUIRE_EQUAL(dbcon->last.end, 0u);
+    BOOST_REQUIRE_EQUAL(dbcon->last.limit, 100000u);
+    std::istringstream lines(resp);
+    std::string line;
+    size_t nresults = 0, nbatches = 0;
+    while (std::getline(lines, line)) {
+        BOOST_REQUIRE(boost::algorithm::ends_with(line, "\r"));
+        line.pop_back();
+        BOOST_REQUIRE(line[0] == '*');
+        size_t size = std::stoul(line.substr(1));
+        if (size == 0) {
+            break;
+        }
+        nbatches++;
+        BOOST_REQUIRE_EQUAL(size % 3, 0u);
+        for (size_t i = 0; i < size/3; i++, nresults++) {
+            std::string id, ts, value;
+            std::getline(lines, id);
+            std::getline(lines, ts);
+            std::getline(lines, value);
+            BOOST_REQUIRE_EQUAL(id, ":" + std::to_string(nresults % 3) + "\r");
+            BOOST_REQUIRE_EQUAL(ts, ":" + std::to_string(10000 - nresults) + "\r");
+            if (nresults % 2) {
+                BOOST_REQUIRE_EQUAL(value, ":-" + std::to_string(nresults) + "\r");
+            } else {
+                BOOST_REQUIRE_EQUAL(std::stod(value.substr(1)), nresults + 0.5);
+            }
+        }
+    }
+    BOOST_REQUIRE_EQUAL(nresults, N);
+    BOOST_REQUIRE_EQUAL(nbatches, 3u);
+    BOOST_REQUIRE(!std::getline(lines, line));
+
+    // Binary format, every batch is a bulk frame
+    auto binary = run_query("select 0 10000 order desc format binary ids 1\n");
+    BOOST_REQUIRE_EQUAL(dbcon->last.begin, 10000u);
+    BOOST_REQUIRE_EQUAL(dbcon->last.end, 0u);
+    size_t pos = 0;
+    std::vector<aku_Sample> samples;
+    while (binary[pos] == '$') {
+        auto eol = binary.find("\r\n", pos);
+        size_t size = std::stoul(binary.substr(pos + 1, eol - pos - 1));
+        aku_Sample frame[QuerySession::BATCH_SIZE];
+        size_t nframe = QuerySession::BATCH_SIZE;
+        BOOST_REQUIRE_EQUAL(aku_decode_bulk(binary.data() + eol + 2, size, frame, &nframe), AKU_SUCCESS);
+        samples.insert(samples.end(), frame, frame + nframe);
+        pos = eol + 2 + size + 2;
+    }
+    BOOST_REQUIRE_EQUAL(binary.substr(pos), "*0\r\n");
+    BOOST_REQUIRE_EQUAL(samples.size(), N);
+    std::sort(samples.begin(), samples.end(), [](aku_Sample const& lhs, aku_Sample const& rhs) {
+        return lhs.timestamp > rhs.timestamp;
+    });
+    for (size_t i = 0; i < N; i++) {
+        BOOST_REQUIRE_EQUAL(samples[i].timestamp, 10000 - i);
+        BOOST_REQUIRE_EQUAL(samples[i].is_int, static_cast<int>(i % 2));
+        if (i % 2) {
+            BOOST_REQUIRE_EQUAL(samples[i].ivalue, -static_cast<int64_t>(i));
+        } else {
+            BOOST_REQUIRE_EQUAL(samples[i].value, i + 0.5);
+        }
+    }
+
+    // Errors
+    BOOST_REQUIRE_EQUAL(run_query("select 0 1000\n").substr(0, 7), "-QUERY ");
+    BOOST_REQUIRE_EQUAL(run_query("select 0 1000 where host=*\n").substr(0, 4), "-DB ");
+
+    query->stop();
+}
@@ -2,8 +2,11 @@
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <iostream>
+#include <cmath>
+#include <cstring>
 
 #include "expected.h"
+#include "fastparse.h"
 
 using namespace Akumuli;
 
@@ -79,3 +82,73 @@ BOOST_AUTO_TEST_CASE(Test_expected_value_lifetime) {
 
 }
 
+
+BOOST_AUTO_TEST_CASE(Test_parse_iso8601) {
+
+    auto parse = [](std::string str, aku_TimeStamp* ts) {
+        return parse_iso8601(str.data(), str.data() + str.size(), ts);
+    };
+    aku_TimeStamp ts = 0;
+    const aku_TimeStamp NS = 1000000000ull;
+    BOOST_REQUIRE(parse("1970-01-01T00:00:00", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 0u);
+    BOOST_REQUIRE(parse("2015-03-14T15:09:26Z", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1426345766ull*NS);
+    BOOST_REQUIRE(parse("2015-03-14 15:09:26.535897932", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1426345766ull*NS + 535897932u);
+    BOOST_REQUIRE(parse("2015-03-14T15:09:26.5358979323846Z", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1426345766ull*NS + 535897932u);
+    BOOST_REQUIRE(parse("20150314T150926.25", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1426345766ull*NS + 250000000u);
+    // Zone offsets
+    BOOST_REQUIRE(parse("2015-03-14T18:39:26+03:30", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1426345766ull*NS);
+    BOOST_REQUIRE(parse("2015-03-14T14:09:26-0100", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1426345766ull*NS);
+    BOOST_REQUIRE(parse("20150314T170926+02", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1426345766ull*NS);
+    // Leap years
+    BOOST_REQUIRE(parse("2000-02-29T00:00:00", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 951782400ull*NS);
+    BOOST_REQUIRE(parse("2016-12-31T23:59:59", &ts));
+    BOOST_REQUIRE_EQUAL(ts, 1483228799ull*NS);
+
+    const char* bad[] = {
+        "", "2015", "2015-03-14", "2015-03-14T15:09", "2015-03-14X15:09:26", "2015-3-14T15:09:26",
+        "2015-00-14T15:09:26", "2015-13-14T15:09:26", "2015-02-29T15:09:26", "1900-02-29T00:00:00",
+        "2015-03-14T24:09:26", "2015-03-14T15:60:26", "2015-03-14T15:09:26.", "2015-03-14T15:09:26.5x",
+        "2015-03-14T15:09:26+3", "2015-03-14T15:09:26+03:0", "2015-03-14T15:09:26ZZ",
+        "1969-12-31T23:59:59", "1970-01-01T00:00:00+01:00", "2015031T150926",
+    };
+    for (auto str: bad) {
+        BOOST_CHECK_MESSAGE(!parse(str, &ts), str);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_parse_double) {
+
+    auto parse = [](std::string str, double* value) {
+        return parse_double(str.data(), str.data() + str.size(), value);
+    };
+    const char* good[] = {
+        "0", "-0", "1", "3.14159", "-2.5", "+7", "1.", ".5", "1e10", "1E-5", "-1.5e+3",
+        "0.1", "0.000001", "123456789012345678", "9007199254740993", "12345678901234567890123",
+        "1.7976931348623157e308", "4.9e-324", "2.2250738585072014e-308", "1e400", "1e-400",
+        "0.30000000000000004", "3.141592653589793238462643383279", "1e22", "1e23", "8.5e-23",
+        "00000000000000000000000001.5", "inf", "-nan",
+    };
+    for (auto str: good) {
+        double value = 0, expected = strtod(str, nullptr);
+        BOOST_REQUIRE_MESSAGE(parse(str, &value), str);
+        if (std::isnan(expected)) {
+            BOOST_REQUIRE(std::isnan(value));
+        } else {
+            BOOST_REQUIRE_MESSAGE(memcmp(&value, &expected, sizeof(double)) == 0, str);
+        }
+    }
+    const char* bad[] = { "", "-", ".", "e5", "1e", "1e+", "1.5x", "x1", "1..5", " 1", "1 " };
+    for (auto str: bad) {
+        double value;
+        BOOST_CHECK_MESSAGE(!parse(str, &value), str);
+    }
+}
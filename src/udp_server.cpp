@@ -0,0 +1,213 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "udp_server.h"
+#include "protocolparser.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <boost/system/system_error.hpp>
+
+namespace Akumuli {
+
+namespace {
+
+void throw_socket_error(const char* what) {
+    boost::system::error_code error(errno, boost::system::system_category());
+    throw boost::system::system_error(error, what);
+}
+
+}
+
+UdpServer::UdpServer(std::shared_ptr<IngestionPipeline> pipeline, int port, int nworkers)
+    : pipeline_(pipeline)
+    , port_(port)
+    , nworkers_(std::max(nworkers, 1))
+    , fd_(-1)
+    , stop_{false}
+    , ndatagrams_{0}
+    , nbytes_{0}
+    , nbad_{0}
+    , ndropped_{0}
+    , nwrite_errors_{0}
+    , nthrottled_{0}
+    , logger_("udp-server", 10)
+{
+    logger_.info() << "UDP server created, port: " << port << ", workers: " << nworkers_;
+}
+
+UdpServer::~UdpServer() {
+    if (fd_ >= 0) {
+        stop();
+    }
+}
+
+void UdpServer::start() {
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd_ < 0) {
+        throw_socket_error("can't create UDP socket");
+    }
+    int rcvbuf = RCVBUF_SIZE;
+    setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    // Kernel reports number of dropped datagrams in every received message
+    int enable = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+    timeval timeout = { 0, POLL_MSEC*1000 };
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(static_cast<uint16_t>(port_));
+    if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        auto err = errno;
+        close(fd_);
+        fd_ = -1;
+        errno = err;
+        throw_socket_error("can't bind UDP socket");
+    }
+    std::weak_ptr<UdpServer> weak = shared_from_this();
+    for (int i = 0; i < nworkers_; i++) {
+        auto spout = pipeline_->make_spout();
+        // There is no client to report errors to
+        spout->set_error_cb([weak](aku_Status status, uint64_t) {
+            auto self = weak.lock();
+            if (self) {
+                self->nwrite_errors_.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        threads_.emplace_back(&UdpServer::worker, this, spout);
+    }
+    logger_.info() << "Start listening";
+}
+
+void UdpServer::stop() {
+    logger_.info() << "Stopping UDP server";
+    stop_.store(true);
+    for (auto& thread: threads_) {
+        thread.join();
+    }
+    threads_.clear();
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    auto stats = get_stats();
+    logger_.info() << "UDP server stopped, datagrams: " << stats.ndatagrams
+                   << ", bad: " << stats.nbad << ", dropped: " << stats.ndropped
+                   << ", throttled: " << stats.nthrottled;
+}
+
+UdpStats UdpServer::get_stats() const {
+    UdpStats stats;
+    stats.ndatagrams = ndatagrams_.load();
+    stats.nbytes = nbytes_.load();
+    stats.nbad = nbad_.load();
+    stats.ndropped = ndropped_.load();
+    stats.nwrite_errors = nwrite_errors_.load();
+    stats.nthrottled = nthrottled_.load();
+    return stats;
+}
+
+void UdpServer::worker(std::shared_ptr<PipelineSpout> spout) {
+    ProtocolParser parser(spout);
+    parser.start();
+    // Buffers are allocated once, parser reads datagrams in place
+    auto buffer = std::make_shared<std::vector<Byte>>(BATCH_SIZE*DATAGRAM_SIZE);
+    std::shared_ptr<const Byte> bufptr(buffer, buffer->data());
+    const size_t CONTROL_SIZE = CMSG_SPACE(sizeof(uint32_t));
+    std::vector<char> control(BATCH_SIZE*CONTROL_SIZE);
+    std::vector<iovec> iovecs(BATCH_SIZE);
+    std::vector<mmsghdr> msgs(BATCH_SIZE);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        iovecs[i].iov_base = buffer->data() + i*DATAGRAM_SIZE;
+        iovecs[i].iov_len = DATAGRAM_SIZE;
+    }
+    // Spout counts values that it drops, counter is added to the server's one after every batch
+    uint64_t nthrottled = 0;
+    auto update_throttled = [&]() {
+        auto dropped = spout->get_dropped();
+        if (dropped != nthrottled) {
+            nthrottled_.fetch_add(dropped - nthrottled, std::memory_order_relaxed);
+            nthrottled = dropped;
+        }
+    };
+    while (!stop_.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            // Lengths are overwritten by the kernel
+            memset(&msgs[i], 0, sizeof(mmsghdr));
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = control.data() + i*CONTROL_SIZE;
+            msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+        // Blocks until the first datagram (or timeout), other datagrams are taken if available
+        int n = recvmmsg(fd_, msgs.data(), BATCH_SIZE, MSG_WAITFORONE, nullptr);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            logger_.error() << "UDP receive error: " << strerror(errno);
+            break;
+        }
+        uint64_t nbytes = 0, nbad = 0;
+        for (int i = 0; i < n; i++) {
+            auto& hdr = msgs[i].msg_hdr;
+            for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                    // Drop counter of the socket, workers can see values out of order
+                    uint32_t ndropped;
+                    memcpy(&ndropped, CMSG_DATA(cmsg), sizeof(ndropped));
+                    uint64_t prev = ndropped_.load(std::memory_order_relaxed);
+                    while (prev < ndropped && !ndropped_.compare_exchange_weak(prev, ndropped)) {
+                    }
+                }
+            }
+            nbytes += msgs[i].msg_len;
+            if (hdr.msg_flags & MSG_TRUNC) {
+                nbad++;
+                continue;
+            }
+            size_t pos = static_cast<size_t>(i)*DATAGRAM_SIZE;
+            PDU pdu = {
+                bufptr,
+                pos + msgs[i].msg_len,
+                pos
+            };
+            try {
+                parser.parse_next(pdu);
+                nbad += parser.discard_incomplete();
+            } catch (StreamError const& error) {
+                logger_.trace() << error.what();
+                nbad++;
+            }
+        }
+        ndatagrams_.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+        nbytes_.fetch_add(nbytes, std::memory_order_relaxed);
+        nbad_.fetch_add(nbad, std::memory_order_relaxed);
+        update_throttled();
+    }
+    parser.close();
+    update_throttled();
+}
+
+}  // namespace
@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2015 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+#include "ingestion_pipeline.h"
+
+namespace Akumuli {
+
+//! UDP listener counters
+struct UdpStats {
+    uint64_t ndatagrams;        //< Number of received datagrams
+    uint64_t nbytes;            //< Number of received bytes
+    uint64_t nbad;              //< Datagrams with malformed or truncated data (values before the error are written)
+    uint64_t ndropped;          //< Datagrams dropped by the kernel (socket receive buffer overflow)
+    uint64_t nwrite_errors;     //< Values rejected by the storage
+    uint64_t nthrottled;        //< Values dropped by the spouts (rings were full, backoff policy is AKU_THROTTLE)
+};
+
+
+/** UDP listener.
+  * Every datagram should contain complete messages (same format as TCP
+  * stream), incomplete message at the end of the datagram is discarded.
+  * Worker threads read datagrams from the shared socket in batches (recvmmsg)
+  * into pre-allocated buffers, every worker has its own parser and spout,
+  * so there is no per-client state. Datagrams can't be pushed back, they are
+  * dropped by the kernel if workers can't keep up (see UdpStats::ndropped),
+  * values are dropped by the spout if pipeline can't keep up and backoff
+  * policy is AKU_THROTTLE (see UdpStats::nthrottled).
+  */
+class UdpServer : public std::enable_shared_from_this<UdpServer>
+{
+    enum {
+        BATCH_SIZE      = 0x40,     //< Max number of datagrams received at once
+        DATAGRAM_SIZE   = 0x2000,   //< Max datagram size, larger datagrams are truncated and discarded
+        RCVBUF_SIZE     = 0x400000, //< Socket receive buffer size (capped by the kernel limit)
+        POLL_MSEC       = 100,      //< Receive timeout (workers check stop flag after timeout)
+    };
+    std::shared_ptr<IngestionPipeline>   pipeline_;
+    const int                            port_;
+    const int                            nworkers_;
+    int                                  fd_;           //< Socket (shared by all workers)
+    std::vector<std::thread>             threads_;
+    std::atomic<bool>                    stop_;
+    // Counters
+    std::atomic<uint64_t>                ndatagrams_;
+    std::atomic<uint64_t>                nbytes_;
+    std::atomic<uint64_t>                nbad_;
+    std::atomic<uint64_t>                ndropped_;
+    std::atomic<uint64_t>                nwrite_errors_;
+    std::atomic<uint64_t>                nthrottled_;
+    Logger                               logger_;
+
+    //! Worker thread function
+    void worker(std::shared_ptr<PipelineSpout> spout);
+public:
+    /** C-tor. Should be created in the heap.
+      * @param pipeline ingestion pipeline
+      * @param port port to listen
+      * @param nworkers number of worker threads (one spout per worker)
+      */
+    UdpServer(std::shared_ptr<IngestionPipeline> pipeline, int port, int nworkers);
+   ~UdpServer();
+
+    //! Open socket and start worker threads
+    void start();
+
+    //! Stop worker threads and close socket
+    void stop();
+
+    //! Get counters
+    UdpStats get_stats() const;
+};
+
+}  // namespace